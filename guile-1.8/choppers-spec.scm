@@ -81,6 +81,8 @@
 		  #:arguments '(((<stream> aggregated) input)
 				(int window-size (default 10))
 				(long window-fpr-mask (default 8191))
+				(int min-size (default 0))
+				(int max-size (default 0))
 				((<chopper> out) chopper)))
 
   (wrap-function! ws
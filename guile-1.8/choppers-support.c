@@ -50,6 +50,7 @@ static inline chop_error_t
 chop_anchor_based_chopper_open_alloc (chop_stream_t *input,
 				      size_t window_size,
 				      unsigned long magic_fpr_mask,
+				      size_t min_size, size_t max_size,
 				      chop_chopper_t **chopper)
 {
   chop_error_t err;
@@ -60,7 +61,7 @@ chop_anchor_based_chopper_open_alloc (chop_stream_t *input,
     return ENOMEM;
 
   err = chop_anchor_based_chopper_init (input, window_size, magic_fpr_mask,
-					*chopper);
+					min_size, max_size, *chopper);
   if (err)
     {
       gwrap_chop_free_uninitialized
@@ -22,6 +22,7 @@
             whole-stream-chopper-open
             fixed-size-chopper-open
             anchor-based-chopper-open
+            fastcdc-chopper-open
             chopper-generic-open
             chopper-read-block
             chopper-stream
@@ -63,13 +64,27 @@ BLOCK-SIZE byte long."
 
 (define anchor-based-chopper-open
   (let ((f (libchop-type-constructor "anchor_based_chopper_init"
-                                     ('* size_t unsigned-long)
+                                     ('* size_t unsigned-long size_t size_t)
                                      "anchor_based_chopper" wrap-chopper)))
-    (lambda* (stream window-size #:optional (fingerprint-mask 8191))
+    (lambda* (stream window-size #:optional (fingerprint-mask 8191)
+                     (min-size 0) (max-size 0))
       "Return a new chopper that uses STREAM as its source and produces
-variable-width blocks depending on the input data.  See the manual for
-details."
-      (f (unwrap-stream stream) window-size fingerprint-mask))))
+variable-width blocks depending on the input data.  Blocks are at least
+MIN-SIZE bytes long and, unless MAX-SIZE is zero, at most MAX-SIZE bytes
+long.  See the manual for details."
+      (f (unwrap-stream stream) window-size fingerprint-mask
+         min-size max-size))))
+
+(define fastcdc-chopper-open
+  (let ((f (libchop-type-constructor "fastcdc_chopper_init"
+                                     ('* size_t size_t size_t)
+                                     "fastcdc_chopper" wrap-chopper)))
+    (lambda* (stream #:optional (min-size 2048) (average-size 8192)
+                     (max-size 65536))
+      "Return a new chopper that uses STREAM as its source and produces
+variable-width blocks using the FastCDC algorithm.  Blocks are between
+MIN-SIZE and MAX-SIZE bytes, AVERAGE-SIZE on average."
+      (f (unwrap-stream stream) min-size average-size max-size))))
 
 (define* (chopper-generic-open class stream #:optional (block-size 8192))
   "Return a chopper of type CLASS draining input from STREAM and return
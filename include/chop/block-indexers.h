@@ -50,6 +50,55 @@ chop_index_handle_binary_size (const chop_index_handle_t *__handle)
   return (__handle->size);
 }
 
+/* The `chop_index_handle_class_t' metaclass, which allows index handle
+   classes to provide a fast way to decode arrays of binary-serialized
+   handles, such as the keys stored in a key block, and to serialize
+   handles in place.  */
+CHOP_DECLARE_RT_CLASS (index_handle_class, klass,
+		       chop_error_t (* decode_binary) (const char *, size_t,
+						       size_t,
+						       chop_index_handle_t *,
+						       size_t *, size_t *);
+		       void (* encode_binary) (const chop_index_handle_t *,
+					       char *););
+
+/* Decode at most COUNT index handles of class KLASS from BUFFER, a
+   SIZE-byte buffer that contains their binary serializations one after
+   another, into HANDLES, an array of COUNT instances of KLASS.  On
+   success, return zero, set DECODED to the number of handles decoded,
+   which is less than COUNT only if the end of BUFFER was reached, and set
+   BYTES_READ to the number of bytes read.  On failure, DECODED is set to
+   the number of handles decoded before the failure.  In both cases, the
+   handles decoded must eventually be destroyed by the caller.  This is
+   faster than repeated calls to `chop_object_deserialize ()' when KLASS's
+   metaclass is `chop_index_handle_class_class' and provides a
+   `decode_binary' method.  */
+extern chop_error_t chop_index_handle_decode_binary (const chop_class_t
+						     *klass,
+						     const char *buffer,
+						     size_t size,
+						     size_t count,
+						     chop_index_handle_t
+						     *handles,
+						     size_t *decoded,
+						     size_t *bytes_read);
+
+/* Append the binary serialization of HANDLE, which is
+   `chop_index_handle_binary_size (HANDLE)' bytes long, to BUFFER.  When
+   the metaclass of HANDLE's class provides an `encode_binary' method,
+   HANDLE is serialized in place at the end of BUFFER, without any
+   intermediate buffer.  */
+extern chop_error_t chop_index_handle_append_binary (const
+						     chop_index_handle_t
+						     *handle,
+						     chop_buffer_t *buffer);
+
+/* Return a pointer to the INDEX-th handle of HANDLES, an array of index
+   handles of class KLASS.  */
+#define chop_index_handle_array_ref(__klass, __handles, __index)	\
+  ((chop_index_handle_t *)						\
+   ((char *) (__handles) + (__index) * chop_class_instance_size (__klass)))
+
 
 
 /* Block indexers and fetchers.  */
@@ -259,6 +308,39 @@ chop_chk_block_indexer_open (chop_cipher_handle_t cipher_handle,
 			     chop_hash_method_t block_id_hash_method,
 			     chop_block_indexer_t *block_indexer);
 
+/* Have BLOCK_INDEXER, a CHK block indexer, use the persistent index cache
+   stored in FILE_NAME, creating it with room for SLOTS blocks if it does
+   not exist.  The cache maps the key hash of each block indexed by
+   BLOCK_INDEXER to its index handle; when a block is found in the cache,
+   its index handle is returned right away, without ciphering the block or
+   writing it to the store.  Thus, the cache must only be used with the
+   stores that contain the blocks it records.  Copies of
+   BLOCK_INDEXER share the cache, which is closed when the last of them
+   is destroyed.  Blocks written to the store are only added to the cache
+   by `chop_chk_block_indexer_sync_cache'; they are no longer added once
+   three quarters of the slots are used.  Return CHOP_INVALID_ARG if
+   FILE_NAME was filled by a block indexer with different parameters.  */
+extern chop_error_t
+chop_chk_block_indexer_open_cache (chop_block_indexer_t *block_indexer,
+				   const char *file_name, size_t slots);
+
+/* Sync DATA_STORE and METADATA_STORE, the stores to which BLOCK_INDEXER, a
+   CHK block indexer, wrote data and key blocks, and on success add to its
+   cache the blocks it indexed since the cache was opened or last synced,
+   and write the cache to disk.  METADATA_STORE may be NULL or equal to
+   DATA_STORE when a single store is used.  If syncing either store fails,
+   these blocks are discarded from the cache.  */
+extern chop_error_t
+chop_chk_block_indexer_sync_cache (chop_block_indexer_t *block_indexer,
+				   chop_block_store_t *data_store,
+				   chop_block_store_t *metadata_store);
+
+/* Discard the blocks indexed by BLOCK_INDEXER, a CHK block indexer, since
+   its cache was opened or last synced, so that they are not added to the
+   cache.  This must be called when writing them may have failed.  */
+extern chop_error_t
+chop_chk_block_indexer_discard_cache (chop_block_indexer_t *block_indexer);
+
 /* Initialize BLOCK_INDEXER as a UUID block indexer.  In other words,
    BLOCK_INDEXER will then yield DCE compatible Universally Unique
    Identifiers for each block, using `libuuid' (provided it was available at
@@ -45,6 +45,12 @@ extern chop_error_t chop_buffer_push (chop_buffer_t *buffer,
 extern chop_error_t chop_buffer_append (chop_buffer_t *buffer,
 					const char *buf, size_t size);
 
+/* Grow BUFFER's contents by SIZE bytes and return in AREA a pointer to
+   these SIZE bytes, which are left uninitialized.  AREA remains valid until
+   BUFFER is modified.  */
+extern chop_error_t chop_buffer_extend (chop_buffer_t *buffer, size_t size,
+					char **area);
+
 /* Return the size (in bytes) of BUFFER's contents.  */
 static __inline__ size_t chop_buffer_size (const chop_buffer_t *__buffer)
 {
@@ -74,5 +80,12 @@ static __inline__ void chop_buffer_copy (const chop_buffer_t *buffer,
 /* Return BUFFER to its owner for deallocation.  */
 extern void chop_buffer_return (chop_buffer_t *buffer);
 
+/* Enable or disable, depending on ENABLE, the pool where returned buffers
+   are kept for reuse by `chop_buffer_init ()'; it is enabled by default.
+   Disabling it releases the buffers it contains, and makes every buffer
+   initialization allocate memory, which allows allocators passed to
+   `chop_init_with_allocator ()' to account for all of them.  */
+extern void chop_buffer_enable_pool (int enable);
+
 #endif
 
@@ -26,6 +26,16 @@
 #include <chop/objects.h>
 #include <chop/logs.h>
 
+#include <stdint.h>
+
+
+/* A block within a region of input data, as returned by
+   `chop_chopper_find_boundaries ()'.  */
+typedef struct chop_block_span
+{
+  size_t offset;
+  size_t size;
+} chop_block_span_t;
 
 /* Declare `chop_chopper_t' which inherits from `chop_object_t'.  */
 CHOP_DECLARE_RT_CLASS (chopper, object,
@@ -35,6 +45,17 @@ CHOP_DECLARE_RT_CLASS (chopper, object,
 		       size_t typical_block_size;
 		       chop_error_t (* read_block) (struct chop_chopper *,
 						    chop_buffer_t *, size_t *);
+		       /* The READ_BLOCK_VIEW method is optional.  */
+		       chop_error_t (* read_block_view) (struct chop_chopper *,
+							 chop_buffer_t *,
+							 const char **,
+							 size_t *);
+		       /* The FIND_BOUNDARIES method is optional.  */
+		       chop_error_t (* find_boundaries) (struct chop_chopper *,
+							 chop_buffer_t *,
+							 const char **,
+							 chop_block_span_t *,
+							 size_t, size_t *);
 		       /* The CLOSE method is optional.  */
 		       void (* close) (struct chop_chopper *););
 
@@ -50,6 +71,9 @@ CHOP_DECLARE_RT_CLASS (chopper_class, klass,
 extern const chop_chopper_class_t chop_fixed_size_chopper_class;
 extern const chop_chopper_class_t chop_whole_stream_chopper_class;
 extern const chop_chopper_class_t chop_anchor_based_chopper_class;
+extern const chop_chopper_class_t chop_fastcdc_chopper_class;
+extern const chop_chopper_class_t chop_parallel_chopper_class;
+extern const chop_chopper_class_t chop_tar_chopper_class;
 
 
 
@@ -108,10 +132,16 @@ chop_whole_stream_chopper_open (chop_stream_t *input,
    that will be applied to each fingerprint computed in order to determine
    whether it should yield a block boundary.  The more bits are set in
    MAGIC_FPR_MASK, the less likely a fingerprint will match, and the larger
-   the average block size will be.  */
+   the average block size will be.  Blocks are at least MIN_SIZE bytes long
+   (except for the last one): no fingerprint is computed over the first
+   MIN_SIZE - WINDOW_SIZE bytes of a block.  If MAX_SIZE is non-zero, a
+   block boundary is forced after MAX_SIZE bytes when no anchor was found
+   earlier.  Return CHOP_INVALID_ARG if WINDOW_SIZE is zero or if MAX_SIZE
+   is non-zero and lower than MIN_SIZE.  */
 extern chop_error_t
 chop_anchor_based_chopper_init (chop_stream_t *input, size_t window_size,
 				unsigned long magic_fpr_mask,
+				size_t min_size, size_t max_size,
 				chop_chopper_t *chopper);
 
 /* If CHOPPER is an anchor-based chopper, return its log.  Return NULL
@@ -119,6 +149,110 @@ chop_anchor_based_chopper_init (chop_stream_t *input, size_t window_size,
 extern chop_log_t *
 chop_anchor_based_chopper_log (chop_chopper_t *chopper);
 
+/* Return the offset, relative to the beginning of the stream being chopped
+   by CHOPPER, an anchor-based chopper, of the end of the last block whose
+   boundary does not depend on the data that follows it.  Only the last
+   block of a stream, which ends where the stream ends, may extend past
+   that offset.  Thus, if data is appended to the stream, blocks up to that
+   offset remain unchanged.
+
+   Anchor-based choppers can be serialized with `chop_object_serialize ()'
+   to save their parameters along with this offset; the deserialized
+   chopper is not attached to any stream, and it must be passed one with
+   `chop_anchor_based_chopper_resume ()'.  */
+extern uint64_t
+chop_anchor_based_chopper_resume_offset (const chop_chopper_t *chopper);
+
+/* Have CHOPPER, an anchor-based chopper, chop INPUT, whose read position
+   must be the offset returned by
+   `chop_anchor_based_chopper_resume_offset ()'.  Data pending in CHOPPER's
+   input buffer is discarded.  The blocks subsequently returned are those
+   that CHOPPER would return if it had chopped the whole stream, from the
+   resume offset on.  Return CHOP_INVALID_ARG if CHOPPER is not an
+   anchor-based chopper.  */
+extern chop_error_t
+chop_anchor_based_chopper_resume (chop_chopper_t *chopper,
+				  chop_stream_t *input);
+
+/* Return the name of the kernel used by anchor-based choppers to look for
+   anchors: "scalar", or the name of the vector instruction set it uses,
+   such as "sse4.2" or "avx2".  The best kernel supported by the CPU is
+   chosen by `chop_init ()'.  */
+extern const char *
+chop_anchor_based_chopper_kernel (void);
+
+/* Have anchor-based choppers use the kernel called NAME (see above).
+   Return CHOP_ERR_NOT_IMPL if that kernel is unavailable or not supported
+   by the CPU.  All kernels yield the same block boundaries; this is mostly
+   useful for testing and benchmarking.  */
+extern chop_error_t
+chop_anchor_based_chopper_select_kernel (const char *name);
+
+/* Initialize CHOPPER as a FastCDC stream chopper.  Like anchor-based
+   choppers, FastCDC choppers produce variably sized blocks whose boundaries
+   are a function of the contents of INPUT, but they do so using a much
+   cheaper rolling hash (a "gear" hash).  Blocks are at least MIN_SIZE bytes
+   long (except for the last one) and at most MAX_SIZE bytes long.  The
+   "normalized chunking" technique is used so that block sizes are
+   concentrated around AVERAGE_SIZE.  Return CHOP_INVALID_ARG if MIN_SIZE,
+   AVERAGE_SIZE and MAX_SIZE are not in increasing order.  */
+extern chop_error_t
+chop_fastcdc_chopper_init (chop_stream_t *input,
+			   size_t min_size, size_t average_size,
+			   size_t max_size,
+			   chop_chopper_t *chopper);
+
+/* If CHOPPER is a FastCDC chopper, return its log.  Return NULL
+   otherwise.  */
+extern chop_log_t *
+chop_fastcdc_chopper_log (chop_chopper_t *chopper);
+
+/* Initialize CHOPPER as a parallel stream chopper.  CHOPPER produces
+   exactly the same blocks as an instance of INNER_CLASS opened with
+   `chop_chopper_generic_open ()' on INPUT with TYPICAL_BLOCK_SIZE, but it
+   does so using THREAD_COUNT threads.  Input is read in batches of
+   THREAD_COUNT times SEGMENT_SIZE bytes, and each thread chops one segment
+   of a batch with its own instance of INNER_CLASS.  If THREAD_COUNT is
+   zero, one thread per processor is used; if SEGMENT_SIZE is zero, a
+   default value is chosen.  Block boundaries produced by INNER_CLASS must
+   only depend on the data that follows the previous boundary, which is the
+   case of all the chopper classes above; content-defined choppers such as
+   anchor-based and FastCDC choppers benefit the most from parallelization.
+   Return CHOP_INVALID_ARG if INNER_CLASS is NULL or is itself
+   CHOP_PARALLEL_CHOPPER_CLASS.  */
+extern chop_error_t
+chop_parallel_chopper_init (chop_stream_t *input,
+			    const chop_chopper_class_t *inner_class,
+			    size_t typical_block_size,
+			    size_t thread_count,
+			    size_t segment_size,
+			    chop_chopper_t *chopper);
+
+/* If CHOPPER is a parallel chopper, return its log.  Return NULL
+   otherwise.  */
+extern chop_log_t *
+chop_parallel_chopper_log (chop_chopper_t *chopper);
+
+/* Initialize CHOPPER as a tar stream chopper.  CHOPPER parses the tar
+   archive (ustar, pax, or GNU format) read from INPUT.  The header records
+   of each archive member, along with any extended header that precedes
+   them, are returned as a block of their own.  The contents of each member
+   are read through a sub-stream by an instance of INNER_CLASS opened with
+   `chop_chopper_generic_open ()' and TYPICAL_BLOCK_SIZE.  Thus, the blocks
+   of a given file are the same regardless of its position in the archive.
+   If INPUT turns out not to be a tar archive, the rest of it is passed as
+   is to INNER_CLASS.  Return CHOP_INVALID_ARG if INNER_CLASS is NULL or
+   does not support generic opening.  */
+extern chop_error_t
+chop_tar_chopper_init (chop_stream_t *input,
+		       const chop_chopper_class_t *inner_class,
+		       size_t typical_block_size,
+		       chop_chopper_t *chopper);
+
+/* If CHOPPER is a tar chopper, return its log.  Return NULL otherwise.  */
+extern chop_log_t *
+chop_tar_chopper_log (chop_chopper_t *chopper);
+
 /* Return the input stream attached to CHOPPER.  */
 static __inline__ chop_stream_t *
 chop_chopper_stream (const chop_chopper_t *__chopper)
@@ -138,6 +272,66 @@ chop_chopper_read_block (chop_chopper_t *__chopper,
   return (__chopper->read_block (__chopper, __block, __size));
 }
 
+/* Read a block from CHOPPER and set *BLOCK to point to its contents and
+   *SIZE to its size.  When possible, *BLOCK points to memory internal to
+   CHOPPER, which avoids copying the block contents; otherwise, the block is
+   stored into BUFFER and *BLOCK points to BUFFER's contents.  In either
+   case, *BLOCK is only valid until the next call to CHOPPER and it must
+   not be modified.  On end of stream, *SIZE is set to zero and
+   CHOP_STREAM_END is returned.  */
+static __inline__ chop_error_t
+chop_chopper_read_block_view (chop_chopper_t *__chopper,
+			      chop_buffer_t *__buffer,
+			      const char **__block,
+			      size_t *__size)
+{
+  chop_error_t __err;
+
+  if (__chopper->read_block_view)
+    return (__chopper->read_block_view (__chopper, __buffer,
+					__block, __size));
+
+  __err = __chopper->read_block (__chopper, __buffer, __size);
+  *__block = chop_buffer_content (__buffer);
+
+  return __err;
+}
+
+/* Read up to MAX_BLOCKS consecutive blocks from CHOPPER in one go, which
+   is cheaper than reading them one by one when blocks are small.  On
+   success, set *REGION to point to the memory region that contains them,
+   store the offset within *REGION and the size of each of them in BLOCKS,
+   set *COUNT to the number of blocks read, and return zero.  At least one
+   block is returned, but fewer than MAX_BLOCKS blocks may be returned even
+   before the end of stream, for instance when CHOPPER's internal buffer is
+   exhausted.  As for `chop_chopper_read_block_view ()', *REGION may point
+   to memory internal to CHOPPER or to BUFFER's contents; it is only valid
+   until the next call to CHOPPER and must not be modified.  MAX_BLOCKS
+   must be greater than zero.  On end of stream, *COUNT is set to zero and
+   CHOP_STREAM_END is returned.  */
+static __inline__ chop_error_t
+chop_chopper_find_boundaries (chop_chopper_t *__chopper,
+			      chop_buffer_t *__buffer,
+			      const char **__region,
+			      chop_block_span_t *__blocks,
+			      size_t __max_blocks,
+			      size_t *__count)
+{
+  chop_error_t __err;
+
+  if (__chopper->find_boundaries)
+    return (__chopper->find_boundaries (__chopper, __buffer, __region,
+					__blocks, __max_blocks, __count));
+
+  /* Fall back to reading a single block.  */
+  __blocks[0].offset = 0;
+  __err = chop_chopper_read_block_view (__chopper, __buffer, __region,
+					&__blocks[0].size);
+  *__count = (__err ? 0 : 1);
+
+  return __err;
+}
+
 /* Return the "typical" size of the blocks produced by CHOPPER.  The meaning
    of "typical" actually depends on the chopper implementation.  The value
    returned can be used as a hint for the initial size of block buffers.  */
@@ -156,4 +350,11 @@ chop_chopper_close (chop_chopper_t *__chopper)
     __chopper->close (__chopper);
 }
 
+
+
+/* Internal.  */
+
+/* Select the best anchor-scanning kernel for the current CPU.  */
+extern void _chop_anchor_based_chopper_init (void);
+
 #endif
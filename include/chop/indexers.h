@@ -174,5 +174,66 @@ extern chop_error_t chop_tree_indexer_open (size_t indexes_per_block,
    CHOP_TREE_INDEXER_CLASS.  */
 extern chop_log_t *chop_tree_indexer_log (chop_indexer_t *indexer);
 
+/* Enable zero-block detection in INDEXER, a tree indexer, if DETECT is
+   true, and disable it otherwise.  When it is enabled, which is the
+   default, blocks that contain only zeros are neither indexed nor written
+   to the data store; instead, the key blocks record the size of each run
+   of zeros, which is expanded when the stream is fetched.  Key blocks that
+   contain runs of zeros cannot be decoded by libchop 0.5.2 and earlier.  */
+extern void chop_tree_indexer_set_zero_block_detection (chop_indexer_t
+							*indexer,
+							int detect);
+
+/* Have INDEXER, a tree indexer, record in each key block the number of
+   bytes of the stream covered by each of its children if RECORD is true,
+   and not otherwise, which is the default.  This allows the streams
+   returned by `chop_indexer_fetch_stream ()' to support
+   `chop_stream_seek ()' efficiently: seeking goes straight to the data
+   block that covers the given offset, fetching only the key blocks on the
+   way.  Streams indexed without child sizes can still be sought, but by
+   reading them from the beginning.  Key blocks that record child sizes
+   cannot be decoded by libchop 0.5.2 and earlier.  */
+extern void chop_tree_indexer_set_child_sizes (chop_indexer_t *indexer,
+					       int record);
+
+/* Have INDEXER, a tree indexer, use THREAD_COUNT threads to index data
+   blocks.  Input is then chopped by a separate thread, blocks are handed
+   in batches to THREAD_COUNT worker threads that index them, each with its
+   own copy of the block indexer, and the calling thread adds the resulting
+   index handles to key blocks and writes the blocks to the stores in input
+   order.  The resulting index is the same as when indexing with a single
+   thread, which is the default.  If THREAD_COUNT is zero, one thread per
+   processor is used.  Block indexers whose class does not provide a copy
+   constructor, such as integer and UUID block indexers, are always used
+   from the calling thread only.  */
+extern void chop_tree_indexer_set_thread_count (chop_indexer_t *indexer,
+						size_t thread_count);
+
+/* Have the streams returned by `chop_indexer_fetch_stream ()' for INDEXER,
+   a tree indexer, read up to BLOCKS data blocks ahead of the one being
+   read.  The keys of the upcoming data blocks are taken from the current
+   key block, and the blocks are fetched and deciphered in the background
+   by the number of threads set with `chop_tree_indexer_set_thread_count
+   ()', at most BLOCKS, each with its own copy of the block fetcher.  Reads
+   from the block stores are serialized since stores need not be
+   thread-safe.  At most BLOCKS data blocks, plus one per thread, are kept
+   in memory.  When BLOCKS is zero, which is the default, or when the
+   fetcher's class does not provide a copy constructor, data blocks are
+   fetched one at a time, when they are read.  */
+extern void chop_tree_indexer_set_prefetch (chop_indexer_t *indexer,
+					    size_t blocks);
+
+/* Have INDEXER, a tree indexer, check which data blocks already exist in
+   the data store before writing them, BLOCKS blocks at a time, with a
+   single call to `chop_store_blocks_exist ()', and write only the missing
+   ones.  This saves a round trip per block with remote stores when most
+   blocks already exist, as is the case with incremental backups, at the
+   cost of keeping up to BLOCKS data blocks in memory.  When indexing with
+   several threads, blocks are checked at most one batch of the pipeline
+   at a time.  When BLOCKS is zero, which is the default, or when the data
+   store cannot check the existence of blocks, every block is written.  */
+extern void chop_tree_indexer_set_existence_checks (chop_indexer_t *indexer,
+						    size_t blocks);
+
 
 #endif
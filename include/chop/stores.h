@@ -192,7 +192,10 @@ extern const chop_file_based_store_class_t chop_gdbm_block_store_class;
 extern const chop_file_based_store_class_t chop_tdb_block_store_class;
 extern const chop_file_based_store_class_t chop_bdb_block_store_class;
 extern const chop_file_based_store_class_t chop_qdbm_block_store_class;
+extern const chop_file_based_store_class_t chop_lmdb_block_store_class;
 extern const chop_file_based_store_class_t chop_fs_block_store_class;
+extern const chop_file_based_store_class_t chop_pack_block_store_class;
+extern const chop_file_based_store_class_t chop_log_block_store_class;
 extern const chop_class_t chop_sunrpc_block_store_class;
 extern const chop_class_t chop_dbus_block_store_class;
 extern const chop_class_t chop_smart_block_store_class;
@@ -251,6 +254,40 @@ extern chop_error_t chop_qdbm_store_open (const char *name, size_t block_size,
 					  int open_flags, mode_t mode,
 					  chop_block_store_t *store);
 
+/* Same as `chop_gdbm_store_open ()' for an LMDB database.  MAP_SIZE is the
+   maximum size of the database, or zero for a default of 1 TiB (1 GiB on
+   32-bit hosts).  Any number of threads may look up blocks in STORE and
+   write blocks to it at the same time.  Each write is committed right
+   away, unless `chop_lmdb_store_set_batch_size' was called.  */
+extern chop_error_t chop_lmdb_store_open (const char *name, size_t map_size,
+					  int open_flags, mode_t mode,
+					  chop_block_store_t *store);
+
+/* Have STORE, an LMDB block store, group SIZE writes in each of its
+   transactions, which are also committed when STORE is synced or closed;
+   SIZE is 1 by default.  This makes writing much cheaper, but the thread
+   that began the pending transaction is then the only one that may write
+   to STORE, sync it, or close it until the transaction is committed:
+   other threads get EBUSY, and STORE is left open when closing it fails
+   that way.  Blocks written in the pending transaction
+   are only visible to other threads once it is committed, and they are
+   lost if one of its writes fails.  */
+extern chop_error_t chop_lmdb_store_set_batch_size (chop_block_store_t *store,
+						    size_t size);
+
+/* Look up the block with key KEY in STORE, an LMDB block store, and call
+   PROCESS with a pointer to its contents, its size, and DATA, without
+   copying it.  The contents may only be accessed until PROCESS returns.
+   Return CHOP_STORE_BLOCK_UNAVAIL if the block is not found, and the
+   value returned by PROCESS otherwise.  */
+extern chop_error_t
+chop_lmdb_store_process_block (chop_block_store_t *store,
+			       const chop_block_key_t *key,
+			       chop_error_t (* process) (const char *block,
+							 size_t size,
+							 void *data),
+			       void *data);
+
 /* XXX:  Implement a store for SkipDB,
    http://www.dekorte.com/projects/opensource/SkipDB/ .  */
 
@@ -262,6 +299,63 @@ extern chop_error_t chop_fs_store_open (int dir_fd,
 					int eventually_close,
 					chop_block_store_t *store);
 
+/* Same as `chop_fs_store_open ()', but if DIR_FD is an empty directory,
+   create a store where the file of a block is stored LEVELS directories
+   deep, each named after WIDTH characters of the block's base32 key.  Both
+   must be between 1 and 3, or both zero to get the default layout, with one
+   level of two-character directories, which suits up to a few million
+   blocks.  The layout is recorded in the store, so `chop_fs_store_open ()'
+   can later open it.  Return CHOP_INVALID_ARG if DIR_FD is an existing
+   store with a different layout.  */
+extern chop_error_t chop_fs_store_open_with_layout (int dir_fd,
+						    int eventually_close,
+						    unsigned levels,
+						    unsigned width,
+						    chop_block_store_t *store);
+
+/* Set the durability policy of STORE, a file system block store.  If
+   INTERVAL is zero, which is the default, block files are left for the
+   operating system to write to disk.  If INTERVAL is one, each block file,
+   along with its directory entry, is synced to disk before the write
+   returns.  Otherwise, the block files written and the directories they
+   were added to are synced every INTERVAL blocks and when STORE is synced
+   or closed, so that a crash can only lose the last blocks written.  */
+extern void chop_fs_store_set_sync_interval (chop_block_store_t *store,
+					     size_t interval);
+
+/* Open a block store that appends blocks to ``pack'' files in the directory
+   at DIR_FD, which spares the file system one file per block.  A pack is
+   sealed and indexed once it is larger than PACK_SIZE bytes; if PACK_SIZE
+   is zero, a default of 32 MiB is used.  Sealed packs and their index are
+   mapped in memory.  Blocks cannot be deleted from such a store.  On
+   success, return 0 and initialize STORE.  If EVENTUALLY_CLOSE is non-zero,
+   close DIR_FD when the returned store is closed or destroyed.  */
+extern chop_error_t chop_pack_store_open (int dir_fd,
+					  int eventually_close,
+					  size_t pack_size,
+					  chop_block_store_t *store);
+
+/* Open a log-structured block store in the directory at DIR_FD: blocks are
+   appended to ``segment'' files of about SEGMENT_SIZE bytes (64 MiB if
+   SEGMENT_SIZE is zero), and an in-memory hash table maps their keys to
+   their location.  This table is checkpointed when the store is synced or
+   closed, so that opening the store only replays the records written
+   since.  Deleted blocks are marked as such by appending a record.  On
+   success, return 0 and initialize STORE.  If EVENTUALLY_CLOSE is non-zero,
+   close DIR_FD when the returned store is closed or destroyed.  */
+extern chop_error_t chop_log_store_open (int dir_fd,
+					 int eventually_close,
+					 size_t segment_size,
+					 chop_block_store_t *store);
+
+/* Reclaim the space of deleted and overwritten blocks of STORE, a log
+   block store, by copying the live blocks of each segment that is at
+   least GARBAGE_PERCENT percent dead to the end of the log, and removing
+   that segment.  Deletion records are copied as long as an older segment
+   remains.  Iterators over STORE must not be used afterwards.  */
+extern chop_error_t chop_log_store_compact (chop_block_store_t *store,
+					    unsigned garbage_percent);
+
 /* This function is a simple version of the GDBM/TDB block store open
    functions which it just calls.  The first argument gives the pointer to
    one of the database-based block store classes.  */
@@ -303,12 +397,31 @@ chop_dbus_block_store_open (const char *dbus_address,
 /* Initialize STORE as a ``smart proxy'' of BACKEND, meaning that STORE will
    only forward `write_block' requests to BACKEND is the block doesn't
    already exist in BACKEND.  This is particularly useful as a proxy to
-   remote block stores.  BPS specifies how STORE will behave as a proxy to
-   BACKEND.  */
+   remote block stores.  STORE keeps in memory the keys of blocks known to
+   exist in BACKEND, so that BACKEND is asked about each block at most once.
+   BPS specifies how STORE will behave as a proxy to BACKEND.  */
 extern chop_error_t chop_smart_block_store_open (chop_block_store_t *backend,
 						 chop_proxy_semantics_t bps,
 						 chop_block_store_t *store);
 
+/* Add the keys of all the blocks of the backend of STORE, a smart block
+   store, to the set of keys known to exist, so that writing these blocks
+   does not require a round trip to the backend.  STORE's Bloom filter, if
+   any, is updated as well.  Return CHOP_ERR_NOT_IMPL if the backend does
+   not support iteration.  */
+extern chop_error_t chop_smart_block_store_seed (chop_block_store_t *store);
+
+/* Have STORE, a smart block store, use the Bloom filter stored in
+   FILE_NAME to record the keys of blocks it writes to its backend.  A block
+   whose key is not in the filter is written without first checking whether
+   the backend has it; at worst, a block the backend got by other means is
+   written again.  If FILE_NAME does not exist, it is created with room for
+   EXPECTED_BLOCKS keys.  */
+extern chop_error_t
+chop_smart_block_store_open_bloom_filter (chop_block_store_t *store,
+					  const char *file_name,
+					  size_t expected_blocks);
+
 /* Return the log attached to STORE, a smart block store.  If STORE is not an
    instance of CHOP_SMART_BLOCK_STORE_CLASS, then NULL is returned.  */
 extern chop_log_t *chop_smart_block_store_log (chop_block_store_t *store);
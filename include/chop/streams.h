@@ -24,6 +24,8 @@
 #include <chop/chop.h>
 #include <chop/objects.h>
 
+#include <stdint.h>
+
 
 _CHOP_BEGIN_DECLS
 
@@ -36,12 +38,21 @@ CHOP_DECLARE_RT_CLASS (stream, object,
 		       /* common methods */
 		       chop_error_t (* read)  (struct chop_stream *,
 					       char *, size_t, size_t *);
-		       void (* close) (struct chop_stream *););
+		       void (* close) (struct chop_stream *);
+
+		       /* optional methods */
+		       chop_error_t (* peek) (struct chop_stream *,
+					      const char **, size_t *);
+		       void (* consume) (struct chop_stream *, size_t);
+		       chop_error_t (* seek) (struct chop_stream *,
+					      uint64_t););
 
 
 extern const chop_class_t chop_file_stream_class;
+extern const chop_class_t chop_async_file_stream_class;
 extern const chop_class_t chop_mem_stream_class;
 extern const chop_class_t chop_filtered_stream_class;
+extern const chop_class_t chop_sub_stream_class;
 
 
 
@@ -66,6 +77,46 @@ chop_stream_read (chop_stream_t *__stream,
   return (__stream->read (__stream, __buffer, __size, __read));
 }
 
+/* Return in DATA a pointer to the next bytes available from STREAM and in
+   SIZE their number, which is non-zero, without consuming them.  The bytes
+   at DATA remain valid until the next call to `chop_stream_peek ()',
+   `chop_stream_read ()', or `chop_stream_close ()' on STREAM, which allows
+   them to be processed without being copied.  Return CHOP_STREAM_END if
+   the end of STREAM has been reached, and CHOP_ERR_NOT_IMPL if STREAM
+   does not support this method, in which case `chop_stream_read ()' must
+   be used instead.  */
+static __inline__ chop_error_t
+chop_stream_peek (chop_stream_t *__stream,
+		  const char **__data, size_t *__size)
+{
+  if (__stream->peek)
+    return (__stream->peek (__stream, __data, __size));
+
+  return CHOP_ERR_NOT_IMPL;
+}
+
+/* Consume the first SIZE bytes returned by the last call to
+   `chop_stream_peek ()' on STREAM.  SIZE must be lower than or equal to
+   the size returned by `chop_stream_peek ()'.  */
+static __inline__ void
+chop_stream_consume (chop_stream_t *__stream, size_t __size)
+{
+  __stream->consume (__stream, __size);
+}
+
+/* Move STREAM to OFFSET bytes from its beginning, so that the next read
+   returns the data at OFFSET.  When OFFSET is past the end of STREAM, the
+   next read returns CHOP_STREAM_END.  Return CHOP_ERR_NOT_IMPL if STREAM
+   does not support random access.  */
+static __inline__ chop_error_t
+chop_stream_seek (chop_stream_t *__stream, uint64_t __offset)
+{
+  if (__stream->seek)
+    return (__stream->seek (__stream, __offset));
+
+  return CHOP_ERR_NOT_IMPL;
+}
+
 /* Close STREAM, i.e. deallocate any resources associated to it.  */
 static __inline__ void
 chop_stream_close (chop_stream_t *__stream)
@@ -89,6 +140,81 @@ extern chop_error_t chop_file_stream_open (const char *path,
 extern chop_error_t chop_file_stream_open_fd (int fd, int eventually_close,
 					      chop_stream_t *stream);
 
+/* How file streams interact with the operating system's page cache.  */
+typedef enum
+  {
+    /* Read through the page cache, which is the default.  */
+    CHOP_FILE_STREAM_CACHED = 0,
+
+    /* Bypass the page cache by reading with `O_DIRECT' into an aligned
+       buffer.  */
+    CHOP_FILE_STREAM_DIRECT,
+
+    /* Read through the page cache, but evict the pages that have been read
+       with `posix_fadvise (POSIX_FADV_DONTNEED)' as the stream goes.  */
+    CHOP_FILE_STREAM_DROP_BEHIND
+  } chop_file_stream_cache_mode_t;
+
+/* Have file stream STREAM use MODE from now on.  This is meant for bulk
+   reads, such as archiving, that should not evict the working set of other
+   processes from the page cache.  When MODE is CHOP_FILE_STREAM_DIRECT but
+   the underlying file system does not support `O_DIRECT', STREAM falls
+   back to CHOP_FILE_STREAM_DROP_BEHIND; use
+   `chop_file_stream_cache_mode ()' to know which mode is actually used.
+   Return CHOP_ERR_NOT_IMPL if STREAM is not a regular file or if MODE is
+   not supported.  */
+extern chop_error_t
+chop_file_stream_set_cache_mode (chop_stream_t *stream,
+				 chop_file_stream_cache_mode_t mode);
+
+/* Return the page cache mode of file stream STREAM.  */
+extern chop_file_stream_cache_mode_t
+chop_file_stream_cache_mode (const chop_stream_t *stream);
+
+/* If ENABLE is true, have file stream STREAM support `chop_stream_peek ()'
+   by mapping windows of the file in memory; otherwise, stop doing so,
+   which is the default.  Mapped streams avoid a copy, but the process
+   receives SIGBUS if the file is truncated while it is being read.  Return
+   CHOP_ERR_NOT_IMPL if STREAM is not a regular file.  */
+extern chop_error_t
+chop_file_stream_enable_mapping (chop_stream_t *stream, int enable);
+
+/* Open file located at PATH and initialize STREAM as an asynchronous file
+   stream.  Such streams read ahead of their users by keeping up to
+   QUEUE_DEPTH reads of READ_SIZE bytes in flight, so that processing data,
+   e.g., chopping and hashing it, overlaps with I/O.  This is useful for
+   slow devices and network file systems.  When QUEUE_DEPTH or READ_SIZE
+   is zero, a default value is used.  STREAM has to point to a
+   large-enough memory area to hold an object whose class is
+   CHOP_ASYNC_FILE_STREAM_CLASS.  */
+extern chop_error_t chop_async_file_stream_open (const char *path,
+						 size_t queue_depth,
+						 size_t read_size,
+						 chop_stream_t *stream);
+
+/* Same as above, except that data is read from FD, an open file descriptor,
+   which need not be seekable.  If EVENTUALLY_CLOSE is true, then
+   `chop_stream_close' will invoke close(2) on FD; otherwise it will leave
+   it open.  */
+extern chop_error_t chop_async_file_stream_open_fd (int fd,
+						    int eventually_close,
+						    size_t queue_depth,
+						    size_t read_size,
+						    chop_stream_t *stream);
+
+/* Return the name of the back-end that handles the reads of asynchronous
+   file stream STREAM: "io_uring" or "thread".  */
+extern const char *
+chop_async_file_stream_backend (const chop_stream_t *stream);
+
+/* Have asynchronous file streams opened from now on use the back-end called
+   NAME (see above).  Return CHOP_ERR_NOT_IMPL if that back-end is
+   unavailable.  By default, io_uring is used when available; streams fall
+   back to the "thread" back-end when the kernel does not support it, and
+   for non-seekable files.  */
+extern chop_error_t
+chop_async_file_stream_select_backend (const char *name);
+
 
 /* Open a memory-backed stream, i.e. a stream whose input is read from BASE
    which is SIZE byte-long.  If FREE_FUNC is not NULL, it is called upon
@@ -109,6 +235,20 @@ extern chop_error_t chop_filtered_stream_open (chop_stream_t *backend,
 					       int owns_filter,
 					       chop_stream_t *stream);
 
+/* Initialize STREAM as a sub-stream of SOURCE that reads at most COUNT bytes
+   from SOURCE, starting at its current position, and then returns
+   CHOP_STREAM_END.  SPS defines the semantics of STREAM as a proxy of
+   SOURCE.  This allows, for instance, the contents of an archive member to
+   be passed to a chopper.  */
+extern chop_error_t chop_sub_stream_open (chop_stream_t *source,
+					  chop_proxy_semantics_t sps,
+					  size_t count,
+					  chop_stream_t *stream);
+
+/* Return the number of bytes that remain to be read from sub-stream
+   STREAM.  */
+extern size_t chop_sub_stream_remaining (const chop_stream_t *stream);
+
 
 _CHOP_END_DECLS;
 
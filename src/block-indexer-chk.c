@@ -26,9 +26,22 @@
 #include <chop/block-indexers.h>
 
 #include <stdio.h>
+#include <stdint.h>
 #include <string.h>
 #include <ctype.h>
 #include <assert.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifdef HAVE_PTHREAD_H
+# include <pthread.h>
+#endif
 
 #ifdef HAVE_VALGRIND_MEMCHECK_H
 # include <valgrind/memcheck.h>
@@ -37,7 +50,8 @@
 
 /* The index handle class.  */
 
-CHOP_DECLARE_RT_CLASS (chk_index_handle, index_handle,
+CHOP_DECLARE_RT_CLASS_WITH_METACLASS (chk_index_handle, index_handle,
+				      index_handle_class,
 		       size_t block_size; /* size of the indexed block */
 		       size_t key_size;
 		       char   key[1024];
@@ -61,6 +75,49 @@ chk_equalp (const chop_object_t *h1, const chop_object_t *h2)
 
 #define BINARY_SERIALIZATION_HEADER_SIZE  12
 
+/* Write the binary serialization of HANDLE, a CHK index handle, to
+   BUFFER, which must be `chop_index_handle_binary_size (HANDLE)' bytes
+   long.  */
+static void
+chk_encode_binary (const chop_index_handle_t *handle, char *buffer)
+{
+  const chop_chk_index_handle_t *chk_handle =
+    (chop_chk_index_handle_t *)handle;
+  unsigned char *u_buffer = (unsigned char *)buffer;
+  size_t orig_size;
+
+  assert (chop_index_handle_binary_size (handle)
+	  == chk_handle->key_size + chk_handle->block_id_size
+	  + BINARY_SERIALIZATION_HEADER_SIZE);
+
+  orig_size = chk_handle->block_size;
+  u_buffer[0] = orig_size & 0xff;  orig_size >>= 8;
+  u_buffer[1] = orig_size & 0xff;  orig_size >>= 8;
+  u_buffer[2] = orig_size & 0xff;  orig_size >>= 8;
+  u_buffer[3] = orig_size & 0xff;  orig_size >>= 8;
+  assert (!orig_size);
+
+  orig_size = chk_handle->key_size;
+  u_buffer[4] = orig_size & 0xff;  orig_size >>= 8;
+  u_buffer[5] = orig_size & 0xff;  orig_size >>= 8;
+  u_buffer[6] = orig_size & 0xff;  orig_size >>= 8;
+  u_buffer[7] = orig_size & 0xff;  orig_size >>= 8;
+  assert (!orig_size);
+
+  orig_size = chk_handle->block_id_size;
+  u_buffer[8]  = orig_size & 0xff;  orig_size >>= 8;
+  u_buffer[9]  = orig_size & 0xff;  orig_size >>= 8;
+  u_buffer[10] = orig_size & 0xff;  orig_size >>= 8;
+  u_buffer[11] = orig_size & 0xff;  orig_size >>= 8;
+  assert (!orig_size);
+
+  memcpy (u_buffer + BINARY_SERIALIZATION_HEADER_SIZE,
+	  chk_handle->key, chk_handle->key_size);
+  memcpy (u_buffer + BINARY_SERIALIZATION_HEADER_SIZE
+	  + chk_handle->key_size,
+	  chk_handle->block_id, chk_handle->block_id_size);
+}
+
 static chop_error_t
 chk_serialize (const chop_object_t *object, chop_serial_method_t method,
 	       chop_buffer_t *buffer)
@@ -98,41 +155,14 @@ chk_serialize (const chop_object_t *object, chop_serial_method_t method,
 
     case CHOP_SERIAL_BINARY:
       {
-	chop_error_t err;
-	size_t orig_size;
-	unsigned char size[12];
-
-	orig_size = handle->block_size;
-	size[0] = orig_size & 0xff;  orig_size >>= 8;
-	size[1] = orig_size & 0xff;  orig_size >>= 8;
-	size[2] = orig_size & 0xff;  orig_size >>= 8;
-	size[3] = orig_size & 0xff;  orig_size >>= 8;
-	assert (!orig_size);
-
-	orig_size = handle->key_size;
-	size[4] = orig_size & 0xff;  orig_size >>= 8;
-	size[5] = orig_size & 0xff;  orig_size >>= 8;
-	size[6] = orig_size & 0xff;  orig_size >>= 8;
-	size[7] = orig_size & 0xff;  orig_size >>= 8;
-	assert (!orig_size);
-
-	orig_size = handle->block_id_size;
-	size[8]  = orig_size & 0xff;  orig_size >>= 8;
-	size[9]  = orig_size & 0xff;  orig_size >>= 8;
-	size[10] = orig_size & 0xff;  orig_size >>= 8;
-	size[11] = orig_size & 0xff;  orig_size >>= 8;
-	assert (!orig_size);
-
-	chop_buffer_push (buffer, (char *)size, sizeof (size));
-
-	err = chop_buffer_append (buffer, handle->key, handle->key_size);
-	if (err)
-	  return err;
-
-	err = chop_buffer_append (buffer, handle->block_id,
-				  handle->block_id_size);
+	char *serial;
 
-	return err;
+	serial = alloca (chop_index_handle_binary_size (&handle->index_handle));
+	chk_encode_binary (&handle->index_handle, serial);
+
+	return (chop_buffer_push (buffer, serial,
+				  chop_index_handle_binary_size
+				  (&handle->index_handle)));
       }
 
     default:
@@ -142,6 +172,63 @@ chk_serialize (const chop_object_t *object, chop_serial_method_t method,
   return CHOP_ERR_NOT_IMPL;
 }
 
+/* Decode the binary serialization of a CHK index handle from BUFFER, a
+   SIZE-byte buffer, into HANDLE, and set BYTES_READ to its size.  */
+static inline chop_error_t
+chk_decode_binary_handle (const char *buffer, size_t size,
+			  chop_chk_index_handle_t *handle,
+			  size_t *bytes_read)
+{
+  const unsigned char *u_buffer = (unsigned char *)buffer;
+  size_t block_size, key_size, block_id_size;
+
+  /* The serialized thing has to contain at least 4 bytes representing the
+     size of the index itself, 4 bytes representing the size of the
+     addressed block, and 4 more bytes for the cipher key.  */
+  if (size < BINARY_SERIALIZATION_HEADER_SIZE)
+    return CHOP_DESERIAL_CORRUPT_INPUT;
+
+  block_size  = u_buffer[3]; block_size <<= 8;
+  block_size |= u_buffer[2]; block_size <<= 8;
+  block_size |= u_buffer[1]; block_size <<= 8;
+  block_size |= u_buffer[0];
+  handle->block_size = block_size;
+
+  key_size  = u_buffer[7]; key_size <<= 8;
+  key_size |= u_buffer[6]; key_size <<= 8;
+  key_size |= u_buffer[5]; key_size <<= 8;
+  key_size |= u_buffer[4];
+  handle->key_size = key_size;
+
+  block_id_size  = u_buffer[11]; block_id_size <<= 8;
+  block_id_size |= u_buffer[10]; block_id_size <<= 8;
+  block_id_size |= u_buffer[9];  block_id_size <<= 8;
+  block_id_size |= u_buffer[8];
+  handle->block_id_size = block_id_size;
+
+  if ((key_size > sizeof (handle->key))
+      || (block_id_size > sizeof (handle->block_id)))
+    return CHOP_DESERIAL_CORRUPT_INPUT;
+
+  if (size - BINARY_SERIALIZATION_HEADER_SIZE < key_size + block_id_size)
+    return CHOP_DESERIAL_TOO_SHORT;
+
+  memcpy (handle->key, buffer + BINARY_SERIALIZATION_HEADER_SIZE,
+	  key_size);
+  memcpy (handle->block_id,
+	  buffer + BINARY_SERIALIZATION_HEADER_SIZE + key_size,
+	  block_id_size);
+  *bytes_read = key_size + block_id_size + BINARY_SERIALIZATION_HEADER_SIZE;
+
+  /* The size of the binary representation of that handle: this includes
+     the size of the `block_size', `key_size' and `block_id_size' fields,
+     currently 12 bytes.  */
+  handle->index_handle.size = key_size + block_id_size
+    + BINARY_SERIALIZATION_HEADER_SIZE;
+
+  return 0;
+}
+
 static chop_error_t
 chk_deserialize (const char *buffer, size_t size, chop_serial_method_t method,
 		 chop_object_t *object, size_t *bytes_read)
@@ -151,7 +238,8 @@ chk_deserialize (const char *buffer, size_t size, chop_serial_method_t method,
     (chop_chk_index_handle_t *)object;
 
   *bytes_read = 0;
-  err = chop_object_initialize (object, &chop_chk_index_handle_class);
+  err = chop_object_initialize (object,
+				(chop_class_t *) &chop_chk_index_handle_class);
   if (err)
     return err;
 
@@ -227,49 +315,8 @@ chk_deserialize (const char *buffer, size_t size, chop_serial_method_t method,
 	}
 
     case CHOP_SERIAL_BINARY:
-      {
-	const unsigned char *u_buffer = (unsigned char *)buffer;
-	size_t block_size, key_size, block_id_size;
-
-	/* The serialized thing has to contain at least 4 bytes representing
-	   the size of the index itself, 4 bytes representing the size of
-	   the addressed block, and 4 more bytes for the cipher key.  */
-	if (size < BINARY_SERIALIZATION_HEADER_SIZE)
-	  return CHOP_DESERIAL_CORRUPT_INPUT;
-
-	block_size  = u_buffer[3]; block_size <<= 8;
-	block_size |= u_buffer[2]; block_size <<= 8;
-	block_size |= u_buffer[1]; block_size <<= 8;
-	block_size |= u_buffer[0];
-	handle->block_size = block_size;
-
-	key_size  = u_buffer[7]; key_size <<= 8;
-	key_size |= u_buffer[6]; key_size <<= 8;
-	key_size |= u_buffer[5]; key_size <<= 8;
-	key_size |= u_buffer[4];
-	handle->key_size = key_size;
-
-	block_id_size  = u_buffer[11]; block_id_size <<= 8;
-	block_id_size |= u_buffer[10]; block_id_size <<= 8;
-	block_id_size |= u_buffer[9];  block_id_size <<= 8;
-	block_id_size |= u_buffer[8];
-	handle->block_id_size = block_id_size;
-
-	if (size - BINARY_SERIALIZATION_HEADER_SIZE < key_size + block_id_size)
-	  err = CHOP_DESERIAL_TOO_SHORT;
-	else
-	  {
-	    memcpy (handle->key, buffer + BINARY_SERIALIZATION_HEADER_SIZE,
-		    key_size);
-	    memcpy (handle->block_id,
-		    buffer + BINARY_SERIALIZATION_HEADER_SIZE + key_size,
-		    block_id_size);
-	    *bytes_read = key_size +
-	      block_id_size + BINARY_SERIALIZATION_HEADER_SIZE;
-	  }
-
-	break;
-      }
+      err = chk_decode_binary_handle (buffer, size, handle, bytes_read);
+      break;
 
     default:
       return CHOP_ERR_NOT_IMPL;
@@ -277,20 +324,70 @@ chk_deserialize (const char *buffer, size_t size, chop_serial_method_t method,
 
   if (!err)
     /* The size of the binary representation of that handle: this includes
-       the size of the `block_size' and `key_size' fields, currently 8
-       bytes.  */
-    handle->index_handle.size = handle->key_size
+       the size of the `block_size', `key_size' and `block_id_size' fields,
+       currently 12 bytes.  */
+    handle->index_handle.size = handle->key_size + handle->block_id_size
       + BINARY_SERIALIZATION_HEADER_SIZE;
 
   return err;
 }
 
+/* Decode at most COUNT binary-serialized handles from BUFFER into HANDLES.
+   Unlike `chk_deserialize ()', the unused parts of the key and block ID
+   are left uninitialized.  */
+static chop_error_t
+chk_decode_binary (const char *buffer, size_t size, size_t count,
+		   chop_index_handle_t *handles,
+		   size_t *decoded, size_t *bytes_read)
+{
+  chop_error_t err = 0;
+  chop_chk_index_handle_t *handle;
+  size_t offset = 0, i;
+
+  handle = (chop_chk_index_handle_t *) handles;
+  for (i = 0; (i < count) && (offset < size); i++, handle++)
+    {
+      size_t handle_size;
+
+      err = chop_object_initialize ((chop_object_t *) handle,
+				    (chop_class_t *)
+				    &chop_chk_index_handle_class);
+      if (err)
+	break;
+
+      err = chk_decode_binary_handle (buffer + offset, size - offset,
+				      handle, &handle_size);
+      if (err)
+	{
+	  chop_object_destroy ((chop_object_t *) handle);
+	  break;
+	}
+
+      offset += handle_size;
+    }
+
+  *decoded = i;
+  *bytes_read = offset;
+
+  return err;
+}
+
 /* Note: the default copy constructor will work fine.  */
 
-CHOP_DEFINE_RT_CLASS (chk_index_handle, index_handle,
-		      NULL, NULL,
-		      NULL, chk_equalp,
-		      chk_serialize, chk_deserialize);
+/* The metaclass methods, passed as a single macro argument below.  */
+#define CHK_METACLASS_INITS					\
+  .decode_binary = chk_decode_binary,				\
+  .encode_binary = chk_encode_binary
+
+CHOP_DEFINE_RT_CLASS_WITH_METACLASS (chk_index_handle, index_handle,
+				     index_handle_class,
+
+				     /* Metaclass inits */
+				     CHK_METACLASS_INITS,
+
+				     NULL, NULL,
+				     NULL, chk_equalp,
+				     chk_serialize, chk_deserialize);
 
 
 
@@ -321,7 +418,8 @@ cbf_ctor (chop_object_t *object, const chop_class_t *class)
   fetcher = (chop_chk_block_fetcher_t *) object;
   fetcher->block_fetcher.fetch_block = chk_block_fetch;
   fetcher->block_fetcher.blocks_exist = chk_blocks_exist;
-  fetcher->block_fetcher.index_handle_class = &chop_chk_index_handle_class;
+  fetcher->block_fetcher.index_handle_class =
+    (chop_class_t *) &chop_chk_index_handle_class;
 
   fetcher->cipher_handle = CHOP_CIPHER_HANDLE_NIL;
   fetcher->owns_cipher_handle = 0;
@@ -496,9 +594,52 @@ cbf_deserialize (const char *buffer, size_t size, chop_serial_method_t method,
   return err;
 }
 
+static chop_error_t
+cbf_copy (const chop_object_t *s, chop_object_t *d)
+{
+  chop_error_t err;
+  chop_chk_block_fetcher_t *source, *dest;
+
+  source = (chop_chk_block_fetcher_t *)s;
+  dest = (chop_chk_block_fetcher_t *)d;
+
+  dest->block_fetcher.index_handle_class =
+    source->block_fetcher.index_handle_class;
+  dest->block_fetcher.fetch_block = source->block_fetcher.fetch_block;
+  dest->block_fetcher.blocks_exist = source->block_fetcher.blocks_exist;
+
+  dest->block_id_hash_method = source->block_id_hash_method;
+
+  err = chop_log_init ("chk-block-fetcher", &dest->log);
+  if (err)
+    return err;
+
+  chop_log_mimic (&dest->log, &source->log, 0);
+
+  if (source->cipher_handle == CHOP_CIPHER_HANDLE_NIL)
+    {
+      dest->cipher_handle = CHOP_CIPHER_HANDLE_NIL;
+      dest->owns_cipher_handle = 0;
+    }
+  else
+    {
+      /* Cipher handles have internal state, hence the copy.  */
+      dest->cipher_handle = chop_cipher_copy (source->cipher_handle);
+      if (dest->cipher_handle == CHOP_CIPHER_HANDLE_NIL)
+	{
+	  chop_object_destroy ((chop_object_t *) &dest->log);
+	  return ENOMEM;
+	}
+
+      dest->owns_cipher_handle = 1;
+    }
+
+  return 0;
+}
+
 CHOP_DEFINE_RT_CLASS (chk_block_fetcher, block_fetcher,
 		      cbf_ctor, cbf_dtor,
-		      NULL, NULL,
+		      cbf_copy, NULL,
 		      cbf_serialize, cbf_deserialize);
 
 chop_log_t *
@@ -526,6 +667,7 @@ chk_blocks_exist (chop_block_fetcher_t *block_fetcher, size_t n,
   for (i = 0; i < n; i++)
     {
       if (!chop_object_is_a ((chop_object_t *) indices[i],
+			     (chop_class_t *)
 			     &chop_chk_index_handle_class))
 	return CHOP_INVALID_ARG;
 
@@ -553,7 +695,7 @@ chk_block_fetch (chop_block_fetcher_t *block_fetcher,
 
   fetcher = (chop_chk_block_fetcher_t *)block_fetcher;
   if (!chop_object_is_a ((chop_object_t *)index,
-			 &chop_chk_index_handle_class))
+			 (chop_class_t *) &chop_chk_index_handle_class))
     return CHOP_INVALID_ARG;
 
   handle = (chop_chk_index_handle_t *) index;
@@ -682,6 +824,400 @@ chk_block_fetch (chop_block_fetcher_t *block_fetcher,
 }
 
 
+
+/* The index cache.  */
+
+/* A persistent cache that maps the hash of a block's cleartext, as
+   computed with the key hash method of a CHK block indexer, to the binary
+   serialization of the block's index handle.  It is an open-addressing
+   hash table with linear probing, stored in a file mapped in memory, and
+   shared by all the copies of a block indexer.  Blocks written to a store
+   are only entered in the table once the store has been synced: until
+   then, their entries are kept aside as pending.  */
+
+#define CHK_CACHE_MAGIC           "libchop-chk-cache-1"
+#define CHK_CACHE_SIGNATURE_SIZE  64
+
+/* Entries are no longer added once this many of SLOTS slots are used, so
+   that probing remains short and always terminates.  */
+#define CHK_CACHE_MAX_USED(_slots)  (((_slots) / 4) * 3)
+
+/* The header of a cache file, followed by SLOT_COUNT slots.  SIGNATURE is
+   the ASCII serialization of the block indexer that fills the cache.  Each
+   slot is a 32-bit handle size, zero for empty slots, followed by the
+   HASH_SIZE-byte hash and then the handle.  */
+typedef struct
+{
+  char     magic[24];
+  char     signature[CHK_CACHE_SIGNATURE_SIZE];
+  uint32_t hash_size;
+  uint32_t slot_size;
+  uint64_t slot_count;
+  uint64_t used;
+} chk_cache_header_t;
+
+typedef struct
+{
+  size_t  refs;
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_t lock;
+#endif
+
+  int     fd;
+  char   *map;
+  size_t  map_size;
+
+  chk_cache_header_t *header;
+  char   *slots;
+  size_t  hash_size;
+  size_t  handle_size;
+  size_t  slot_size;
+  size_t  slot_count;
+
+  /* Entries of the blocks that are not known to be stored yet, in the slot
+     format.  */
+  char   *pending;
+  size_t  pending_count;
+  size_t  pending_allocated;
+} chk_cache_t;
+
+static inline void
+chk_cache_lock (chk_cache_t *cache)
+{
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_lock (&cache->lock);
+#endif
+}
+
+static inline void
+chk_cache_unlock (chk_cache_t *cache)
+{
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_unlock (&cache->lock);
+#endif
+}
+
+/* Open the cache stored in FILE_NAME, creating it with SLOTS slots if it
+   is empty, and return it in RESULT.  SIGNATURE identifies the block
+   indexer that uses it, which maps HASH_SIZE-byte hashes to index handles
+   of at most HANDLE_SIZE bytes.  */
+static chop_error_t
+chk_cache_open (const char *file_name, const char *signature,
+		size_t hash_size, size_t handle_size, size_t slots,
+		chk_cache_t **result)
+{
+  chop_error_t err = 0;
+  chk_cache_t *cache;
+  struct stat file_stats;
+  size_t slot_size;
+  int fd, create;
+
+  if ((strlen (signature) >= CHK_CACHE_SIGNATURE_SIZE) || (slots < 4))
+    return CHOP_INVALID_ARG;
+
+  slot_size = sizeof (uint32_t) + hash_size + handle_size;
+
+  fd = open (file_name, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+  if (fd < 0)
+    return errno;
+
+  /* Several processes updating the same cache would corrupt it.  */
+  if ((flock (fd, LOCK_EX | LOCK_NB)) || (fstat (fd, &file_stats)))
+    {
+      err = errno;
+      close (fd);
+      return err;
+    }
+
+  cache = chop_malloc (sizeof (*cache), &chop_chk_block_indexer_class);
+  if (!cache)
+    {
+      close (fd);
+      return ENOMEM;
+    }
+
+  create = (file_stats.st_size == 0);
+  if (create)
+    {
+      cache->map_size = sizeof (chk_cache_header_t) + slots * slot_size;
+      if (ftruncate (fd, cache->map_size))
+	err = errno;
+    }
+  else if ((size_t) file_stats.st_size < sizeof (chk_cache_header_t))
+    err = CHOP_DESERIAL_CORRUPT_INPUT;
+  else
+    cache->map_size = file_stats.st_size;
+
+  if (!err)
+    {
+      cache->map = mmap (0, cache->map_size, PROT_READ | PROT_WRITE,
+			 MAP_SHARED, fd, 0);
+      if (cache->map == MAP_FAILED)
+	err = errno;
+    }
+
+  if (err)
+    {
+      chop_free (cache, &chop_chk_block_indexer_class);
+      close (fd);
+      return err;
+    }
+
+  cache->header = (chk_cache_header_t *) cache->map;
+  if (create)
+    {
+      /* The new file is filled with zeros, i.e., empty slots.  */
+      memcpy (cache->header->magic, CHK_CACHE_MAGIC,
+	      sizeof (CHK_CACHE_MAGIC));
+      strcpy (cache->header->signature, signature);
+      cache->header->hash_size = hash_size;
+      cache->header->slot_size = slot_size;
+      cache->header->slot_count = slots;
+      cache->header->used = 0;
+    }
+  else if ((memcmp (cache->header->magic, CHK_CACHE_MAGIC,
+		    sizeof (CHK_CACHE_MAGIC)))
+	   || (cache->header->slot_count < 4)
+	   || (cache->map_size != sizeof (chk_cache_header_t)
+	       + cache->header->slot_count * cache->header->slot_size))
+    err = CHOP_DESERIAL_CORRUPT_INPUT;
+  else if ((strncmp (cache->header->signature, signature,
+		     CHK_CACHE_SIGNATURE_SIZE))
+	   || (cache->header->hash_size != hash_size)
+	   || (cache->header->slot_size != slot_size))
+    /* This cache was filled by a different block indexer.  */
+    err = CHOP_INVALID_ARG;
+
+  if (err)
+    {
+      munmap (cache->map, cache->map_size);
+      chop_free (cache, &chop_chk_block_indexer_class);
+      close (fd);
+      return err;
+    }
+
+  cache->refs = 1;
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_init (&cache->lock, NULL);
+#endif
+  cache->fd = fd;
+  cache->slots = cache->map + sizeof (chk_cache_header_t);
+  cache->hash_size = hash_size;
+  cache->handle_size = handle_size;
+  cache->slot_size = slot_size;
+  cache->slot_count = cache->header->slot_count;
+  cache->pending = NULL;
+  cache->pending_count = cache->pending_allocated = 0;
+
+  *result = cache;
+
+  return 0;
+}
+
+static chk_cache_t *
+chk_cache_ref (chk_cache_t *cache)
+{
+  chk_cache_lock (cache);
+  cache->refs++;
+  chk_cache_unlock (cache);
+
+  return cache;
+}
+
+/* Release a reference to CACHE, closing it when it was the last one.
+   Pending entries are then discarded.  */
+static void
+chk_cache_unref (chk_cache_t *cache)
+{
+  size_t refs;
+
+  chk_cache_lock (cache);
+  refs = --cache->refs;
+  chk_cache_unlock (cache);
+
+  if (refs == 0)
+    {
+      msync (cache->map, cache->map_size, MS_SYNC);
+      munmap (cache->map, cache->map_size);
+      if (cache->pending)
+	chop_free (cache->pending, &chop_chk_block_indexer_class);
+      close (cache->fd);
+#ifdef HAVE_PTHREAD_H
+      pthread_mutex_destroy (&cache->lock);
+#endif
+      chop_free (cache, &chop_chk_block_indexer_class);
+    }
+}
+
+/* Return the slot of CACHE that holds HASH, or the empty slot where it
+   would go.  */
+static inline char *
+chk_cache_find_slot (const chk_cache_t *cache, const char *hash)
+{
+  uint64_t start = 0;
+  size_t slot;
+
+  /* HASH is a cryptographic hash, so any part of it is evenly
+     distributed.  */
+  memcpy (&start, hash,
+	  cache->hash_size < sizeof (start) ? cache->hash_size
+	  : sizeof (start));
+
+  for (slot = start % cache->slot_count;
+       ;
+       slot = (slot + 1) % cache->slot_count)
+    {
+      char *p = cache->slots + slot * cache->slot_size;
+      uint32_t size;
+
+      memcpy (&size, p, sizeof (size));
+      if ((size == 0)
+	  || (!memcmp (p + sizeof (size), hash, cache->hash_size)))
+	return p;
+    }
+}
+
+/* Look up HASH in CACHE.  If found, copy the corresponding handle to
+   HANDLE, which must be large enough for any handle in CACHE, set
+   HANDLE_SIZE to its size, and return true.  */
+static int
+chk_cache_lookup (chk_cache_t *cache, const char *hash,
+		  char *handle, size_t *handle_size)
+{
+  const char *slot;
+  uint32_t size;
+
+  chk_cache_lock (cache);
+
+  slot = chk_cache_find_slot (cache, hash);
+  memcpy (&size, slot, sizeof (size));
+  if ((size > 0) && (size <= cache->handle_size))
+    memcpy (handle, slot + sizeof (size) + cache->hash_size, size);
+  else
+    size = 0;
+
+  chk_cache_unlock (cache);
+
+  *handle_size = size;
+
+  return (size > 0);
+}
+
+/* Record in CACHE that HASH maps to HANDLE, a HANDLE_SIZE-byte index
+   handle, once the block is known to be stored, i.e., when
+   `chk_cache_commit' is called.  */
+static void
+chk_cache_add (chk_cache_t *cache, const char *hash,
+	       const char *handle, size_t handle_size)
+{
+  char *entry;
+  uint32_t size;
+
+  assert (handle_size > 0 && handle_size <= cache->handle_size);
+
+  chk_cache_lock (cache);
+
+  if (cache->pending_count >= cache->pending_allocated)
+    {
+      char *bigger;
+      size_t allocated;
+
+      allocated = cache->pending_allocated
+	? 2 * cache->pending_allocated : 256;
+      bigger = chop_realloc (cache->pending, allocated * cache->slot_size,
+			     &chop_chk_block_indexer_class);
+      if (bigger != NULL)
+	{
+	  cache->pending = bigger;
+	  cache->pending_allocated = allocated;
+	}
+    }
+
+  /* The cache is only an optimization: when memory is short, the entry is
+     simply not recorded.  */
+  if (cache->pending_count < cache->pending_allocated)
+    {
+      entry = cache->pending + cache->pending_count * cache->slot_size;
+      size = handle_size;
+      memcpy (entry, &size, sizeof (size));
+      memcpy (entry + sizeof (size), hash, cache->hash_size);
+      memcpy (entry + sizeof (size) + cache->hash_size, handle, handle_size);
+      cache->pending_count++;
+    }
+
+  chk_cache_unlock (cache);
+}
+
+/* Return the number of pending entries of CACHE.  */
+static size_t
+chk_cache_pending_count (chk_cache_t *cache)
+{
+  size_t count;
+
+  chk_cache_lock (cache);
+  count = cache->pending_count;
+  chk_cache_unlock (cache);
+
+  return count;
+}
+
+/* Enter the first COUNT pending entries of CACHE in its table, unless it
+   is full, and write it to disk.  */
+static chop_error_t
+chk_cache_commit (chk_cache_t *cache, size_t count)
+{
+  chop_error_t err = 0;
+  size_t i;
+
+  chk_cache_lock (cache);
+
+  assert (count <= cache->pending_count);
+
+  for (i = 0;
+       (i < count)
+	 && (cache->header->used < CHK_CACHE_MAX_USED (cache->slot_count));
+       i++)
+    {
+      const char *entry;
+      char *slot;
+      uint32_t size;
+
+      entry = cache->pending + i * cache->slot_size;
+      slot = chk_cache_find_slot (cache, entry + sizeof (size));
+      memcpy (&size, slot, sizeof (size));
+      if (size == 0)
+	{
+	  /* Write the size last so that the slot never appears to hold a
+	     partial handle.  */
+	  memcpy (slot + sizeof (size), entry + sizeof (size),
+		  cache->slot_size - sizeof (size));
+	  memcpy (slot, entry, sizeof (size));
+	  cache->header->used++;
+	}
+    }
+
+  /* Keep the entries added since COUNT was determined.  */
+  memmove (cache->pending, cache->pending + count * cache->slot_size,
+	   (cache->pending_count - count) * cache->slot_size);
+  cache->pending_count -= count;
+
+  if (msync (cache->map, cache->map_size, MS_SYNC))
+    err = errno;
+
+  chk_cache_unlock (cache);
+
+  return err;
+}
+
+/* Forget the pending entries of CACHE.  */
+static void
+chk_cache_discard (chk_cache_t *cache)
+{
+  chk_cache_lock (cache);
+  cache->pending_count = 0;
+  chk_cache_unlock (cache);
+}
+
 
 /* The block indexer class.  */
 
@@ -690,6 +1226,7 @@ CHOP_DECLARE_RT_CLASS (chk_block_indexer, block_indexer,
 		       int owns_cipher_handle;
 		       chop_hash_method_t key_hash_method;
 		       chop_hash_method_t block_id_hash_method;
+		       chk_cache_t *cache;
 		       chop_log_t log;);
 
 static chop_error_t
@@ -731,7 +1268,8 @@ cbi_ctor (chop_object_t *object, const chop_class_t *class)
   chop_chk_block_indexer_t *indexer;
 
   indexer = (chop_chk_block_indexer_t *)object;
-  indexer->block_indexer.index_handle_class = &chop_chk_index_handle_class;
+  indexer->block_indexer.index_handle_class =
+    (chop_class_t *) &chop_chk_index_handle_class;
   indexer->block_indexer.block_fetcher_class = &chop_chk_block_fetcher_class;
   indexer->block_indexer.index_block = chk_index_block;
   indexer->block_indexer.init_fetcher = chk_indexer_init_fetcher;
@@ -739,6 +1277,7 @@ cbi_ctor (chop_object_t *object, const chop_class_t *class)
   indexer->key_hash_method = CHOP_HASH_NONE;
   indexer->cipher_handle = CHOP_CIPHER_HANDLE_NIL;
   indexer->owns_cipher_handle = 0;
+  indexer->cache = NULL;
 
   return chop_log_init ("chk-block-indexer", &indexer->log);
 }
@@ -759,6 +1298,10 @@ cbi_dtor (chop_object_t *object)
   indexer->owns_cipher_handle = 0;
   indexer->cipher_handle = CHOP_CIPHER_HANDLE_NIL;
 
+  if (indexer->cache)
+    chk_cache_unref (indexer->cache);
+  indexer->cache = NULL;
+
   chop_object_destroy ((chop_object_t *) &indexer->log);
 }
 
@@ -882,9 +1425,51 @@ cbi_deserialize (const char *buffer, size_t size, chop_serial_method_t method,
   return err;
 }
 
+/* Make D a copy of S with its own cipher handle, so that both can be used
+   concurrently.  */
+static chop_error_t
+cbi_copy (const chop_object_t *s, chop_object_t *d)
+{
+  chop_error_t err;
+  chop_chk_block_indexer_t *source, *dest;
+
+  source = (chop_chk_block_indexer_t *)s;
+  dest = (chop_chk_block_indexer_t *)d;
+
+  dest->block_indexer.index_handle_class =
+    source->block_indexer.index_handle_class;
+  dest->block_indexer.block_fetcher_class =
+    source->block_indexer.block_fetcher_class;
+  dest->block_indexer.index_block = source->block_indexer.index_block;
+  dest->block_indexer.init_fetcher = source->block_indexer.init_fetcher;
+
+  dest->key_hash_method = source->key_hash_method;
+  dest->block_id_hash_method = source->block_id_hash_method;
+
+  err = chop_log_init ("chk-block-indexer", &dest->log);
+  if (err)
+    return err;
+
+  chop_log_mimic (&dest->log, &source->log, 0);
+
+  dest->cipher_handle = chop_cipher_copy (source->cipher_handle);
+  if (dest->cipher_handle == CHOP_CIPHER_HANDLE_NIL)
+    {
+      chop_object_destroy ((chop_object_t *) &dest->log);
+      return ENOMEM;
+    }
+
+  dest->owns_cipher_handle = 1;
+
+  /* The index cache is shared.  */
+  dest->cache = source->cache ? chk_cache_ref (source->cache) : NULL;
+
+  return 0;
+}
+
 CHOP_DEFINE_RT_CLASS (chk_block_indexer, block_indexer,
 		      cbi_ctor, cbi_dtor,
-		      NULL, NULL,
+		      cbi_copy, NULL,
 		      cbi_serialize, cbi_deserialize);
 
 /* Make KEY point to a ciphering key of at most KEY_SIZE bytes.  Fill KEY
@@ -946,6 +1531,7 @@ chk_index_block (chop_block_indexer_t *indexer,
   chk_indexer = (chop_chk_block_indexer_t *)indexer;
   cipher_handle = chk_indexer->cipher_handle;
   err = chop_object_initialize ((chop_object_t *)handle,
+				(chop_class_t *)
 				&chop_chk_index_handle_class);
   if (err)
     return err;
@@ -966,6 +1552,22 @@ chk_index_block (chop_block_indexer_t *indexer,
   hash_key = alloca (hash_key_size);
   chop_hash_buffer (chk_indexer->key_hash_method, buffer, size, hash_key);
 
+  if (chk_indexer->cache != NULL)
+    {
+      /* If this block was already indexed, reuse its index handle: it is
+	 neither ciphered nor written again.  */
+      char *cached;
+      size_t cached_size, bytes_read;
+
+      cached = alloca (chk_indexer->cache->handle_size);
+      if ((chk_cache_lookup (chk_indexer->cache, hash_key,
+			     cached, &cached_size))
+	  && (chk_decode_binary_handle (cached, cached_size, chk_handle,
+					&bytes_read) == 0)
+	  && (chk_handle->block_size == size))
+	return 0;
+    }
+
   /* Most ciphering algorithms need the input size to be a multiple of
      their ciphering block size.  */
   padding_size = (size % block_size) ? (block_size - (size % block_size)) : 0;
@@ -1052,6 +1654,16 @@ chk_index_block (chop_block_indexer_t *indexer,
       chk_handle->index_handle.size =
 	chk_handle->key_size + chk_handle->block_id_size
 	+ BINARY_SERIALIZATION_HEADER_SIZE;
+
+      if ((err == 0) && (chk_indexer->cache != NULL))
+	{
+	  char *encoded;
+
+	  encoded = alloca (chk_handle->index_handle.size);
+	  chk_encode_binary (handle, encoded);
+	  chk_cache_add (chk_indexer->cache, hash_key,
+			 encoded, chk_handle->index_handle.size);
+	}
     }
 
   if (CHOP_EXPECT_FALSE (err != 0))
@@ -1096,6 +1708,113 @@ chop_chk_block_indexer_open (chop_cipher_handle_t cipher_handle,
   return err;
 }
 
+/* Return the CHK block indexer BLOCK_INDEXER, or NULL if it is not a CHK
+   block indexer.  */
+static inline chop_chk_block_indexer_t *
+chk_block_indexer (chop_block_indexer_t *block_indexer)
+{
+  if (!chop_object_is_a ((chop_object_t *) block_indexer,
+			 &chop_chk_block_indexer_class))
+    return NULL;
+
+  return (chop_chk_block_indexer_t *) block_indexer;
+}
+
+chop_error_t
+chop_chk_block_indexer_open_cache (chop_block_indexer_t *block_indexer,
+				   const char *file_name, size_t slots)
+{
+  chop_error_t err;
+  chop_chk_block_indexer_t *indexer;
+  chop_buffer_t signature;
+  chk_cache_t *cache = NULL;
+  size_t hash_size, handle_size;
+
+  indexer = chk_block_indexer (block_indexer);
+  if (indexer == NULL)
+    return CHOP_INVALID_ARG;
+
+  /* The cache may only be used by block indexers that yield the same
+     index handles as INDEXER.  */
+  err = chop_buffer_init (&signature, 0);
+  if (err)
+    return err;
+
+  err = chop_object_serialize ((chop_object_t *) indexer, CHOP_SERIAL_ASCII,
+			       &signature);
+  if (!err)
+    {
+      hash_size = chop_hash_size (indexer->key_hash_method);
+      handle_size = BINARY_SERIALIZATION_HEADER_SIZE
+	+ chop_cipher_algo_key_size (chop_cipher_algorithm
+				     (indexer->cipher_handle))
+	+ chop_hash_size (indexer->block_id_hash_method);
+
+      err = chk_cache_open (file_name, chop_buffer_content (&signature),
+			    hash_size, handle_size, slots, &cache);
+    }
+
+  chop_buffer_return (&signature);
+
+  if (!err)
+    {
+      if (indexer->cache)
+	chk_cache_unref (indexer->cache);
+      indexer->cache = cache;
+    }
+
+  return err;
+}
+
+chop_error_t
+chop_chk_block_indexer_sync_cache (chop_block_indexer_t *block_indexer,
+				   chop_block_store_t *data_store,
+				   chop_block_store_t *metadata_store)
+{
+  chop_error_t err;
+  chop_chk_block_indexer_t *indexer;
+  size_t count = 0;
+
+  indexer = chk_block_indexer (block_indexer);
+  if (indexer == NULL)
+    return CHOP_INVALID_ARG;
+
+  /* Blocks indexed while the stores are being synced may not be part of
+     what they write to disk, so only the entries pending so far are
+     committed.  Entries do not tell which store their block went to, so
+     both stores must be synced before any of them is committed.  */
+  if (indexer->cache)
+    count = chk_cache_pending_count (indexer->cache);
+
+  err = chop_store_sync (data_store);
+  if (!err && metadata_store != NULL && metadata_store != data_store)
+    err = chop_store_sync (metadata_store);
+  if (indexer->cache)
+    {
+      if (err)
+	chk_cache_discard (indexer->cache);
+      else
+	err = chk_cache_commit (indexer->cache, count);
+    }
+
+  return err;
+}
+
+chop_error_t
+chop_chk_block_indexer_discard_cache (chop_block_indexer_t *block_indexer)
+{
+  chop_chk_block_indexer_t *indexer;
+
+  indexer = chk_block_indexer (block_indexer);
+  if (indexer == NULL)
+    return CHOP_INVALID_ARG;
+
+  if (indexer->cache)
+    chk_cache_discard (indexer->cache);
+
+  return 0;
+}
+
 
 /* arch-tag: e90a9c2b-ae67-4082-a518-6278e2224c8e
  */
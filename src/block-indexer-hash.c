@@ -34,7 +34,8 @@
 
 /* The index handle class.  */
 
-CHOP_DECLARE_RT_CLASS (hash_index_handle, index_handle,
+CHOP_DECLARE_RT_CLASS_WITH_METACLASS (hash_index_handle, index_handle,
+				      index_handle_class,
 		       size_t block_size; /* size of the indexed block */
 		       size_t key_size;   /* size of the block key */
 		       char content[1024];/* the block key */);
@@ -67,6 +68,43 @@ hih_equalp (const chop_object_t *h1, const chop_object_t *h2)
 #endif
 
 
+/* Write the binary serialization of HANDLE, a hash index handle, to
+   BUFFER, which must be `chop_index_handle_binary_size (HANDLE)' bytes
+   long.  */
+static void
+hih_encode_binary (const chop_index_handle_t *handle, char *buffer)
+{
+  const chop_hash_index_handle_t *hash_handle =
+    (chop_hash_index_handle_t *)handle;
+  unsigned char *u_buffer = (unsigned char *)buffer;
+  size_t orig_size;
+
+#ifdef BINARY_SERIALIZATION_USES_MAGIC_BYTES
+  memcpy (u_buffer, BINARY_SERIALIZATION_MAGIC,
+	  BINARY_SERIALIZATION_MAGIC_SIZE);
+  u_buffer += BINARY_SERIALIZATION_MAGIC_SIZE;
+#endif
+
+  assert (chop_index_handle_binary_size (handle)
+	  == hash_handle->key_size + BINARY_SERIALIZATION_HEADER_SIZE);
+
+  orig_size = hash_handle->block_size;
+  u_buffer[0] = orig_size & 0xff;  orig_size >>= 8;
+  u_buffer[1] = orig_size & 0xff;  orig_size >>= 8;
+  u_buffer[2] = orig_size & 0xff;  orig_size >>= 8;
+  u_buffer[3] = orig_size & 0xff;  orig_size >>= 8;
+  assert (!orig_size);
+
+  orig_size = hash_handle->key_size;
+  u_buffer[4] = orig_size & 0xff;  orig_size >>= 8;
+  u_buffer[5] = orig_size & 0xff;  orig_size >>= 8;
+  u_buffer[6] = orig_size & 0xff;  orig_size >>= 8;
+  u_buffer[7] = orig_size & 0xff;  orig_size >>= 8;
+  assert (!orig_size);
+
+  memcpy (u_buffer + 8, hash_handle->content, hash_handle->key_size);
+}
+
 static chop_error_t
 hih_serialize (const chop_object_t *object, chop_serial_method_t method,
 	       chop_buffer_t *buffer)
@@ -96,47 +134,86 @@ hih_serialize (const chop_object_t *object, chop_serial_method_t method,
 
     case CHOP_SERIAL_BINARY:
       {
-	chop_error_t err;
-	size_t orig_size;
-	unsigned char size[8];
+	char *serial;
 
-#ifdef BINARY_SERIALIZATION_USES_MAGIC_BYTES
-	err = chop_buffer_push (buffer, BINARY_SERIALIZATION_MAGIC,
-				BINARY_SERIALIZATION_MAGIC_SIZE);
-	if (err)
-	  return err;
-#endif
+	serial = alloca (chop_index_handle_binary_size (&handle->index_handle));
+	hih_encode_binary (&handle->index_handle, serial);
 
-	orig_size = handle->block_size;
-	size[0] = orig_size & 0xff;  orig_size >>= 8;
-	size[1] = orig_size & 0xff;  orig_size >>= 8;
-	size[2] = orig_size & 0xff;  orig_size >>= 8;
-	size[3] = orig_size & 0xff;  orig_size >>= 8;
-	assert (!orig_size);
+	return (chop_buffer_push (buffer, serial,
+				  chop_index_handle_binary_size
+				  (&handle->index_handle)));
+      }
 
-	orig_size = handle->key_size;
-	size[4] = orig_size & 0xff;  orig_size >>= 8;
-	size[5] = orig_size & 0xff;  orig_size >>= 8;
-	size[6] = orig_size & 0xff;  orig_size >>= 8;
-	size[7] = orig_size & 0xff;  orig_size >>= 8;
-	assert (!orig_size);
+    default:
+      return CHOP_ERR_NOT_IMPL;
+    }
 
-#ifndef BINARY_SERIALIZATION_USES_MAGIC_BYTES
-	chop_buffer_push (buffer, (char *)size, sizeof (size));
-#else
-	chop_buffer_append (buffer, (char *)size, sizeof (size));
+  return CHOP_ERR_NOT_IMPL;
+}
+
+/* Decode the binary serialization of a hash index handle from S_BUFFER, a
+   SIZE-byte buffer, into HANDLE, and set BYTES_READ to its size.  */
+static inline chop_error_t
+hih_decode_binary_handle (const char *s_buffer, size_t size,
+			  chop_hash_index_handle_t *handle,
+			  size_t *bytes_read)
+{
+  const unsigned char *buffer = (unsigned char *)s_buffer;
+  size_t block_size, index_size;
+
+  /* The serialized thing has to contain at least 4 bytes representing the
+     size of the index itself and 4 bytes representing the size of the
+     addressed block.  */
+  if (size < BINARY_SERIALIZATION_HEADER_SIZE)
+    return CHOP_DESERIAL_CORRUPT_INPUT;
+
+#ifdef BINARY_SERIALIZATION_USES_MAGIC_BYTES
+  if (memcmp (buffer, BINARY_SERIALIZATION_MAGIC,
+	      BINARY_SERIALIZATION_MAGIC_SIZE))
+    {
+      printf ("didn't find hih magic bytes\n");
+      return CHOP_DESERIAL_CORRUPT_INPUT;
+    }
+
+  buffer += BINARY_SERIALIZATION_MAGIC_SIZE;
 #endif
 
-	err = chop_buffer_append (buffer, handle->content, handle->key_size);
+  block_size  = buffer[3]; block_size <<= 8;
+  block_size |= buffer[2]; block_size <<= 8;
+  block_size |= buffer[1]; block_size <<= 8;
+  block_size |= buffer[0];
+  handle->block_size = block_size;
 
-	return err;
-      }
+  index_size  = buffer[7]; index_size <<= 8;
+  index_size |= buffer[6]; index_size <<= 8;
+  index_size |= buffer[5]; index_size <<= 8;
+  index_size |= buffer[4];
+  handle->key_size = index_size;
 
-    default:
-      return CHOP_ERR_NOT_IMPL;
+  if (index_size > sizeof (handle->content))
+    return CHOP_DESERIAL_CORRUPT_INPUT;
+
+  if (size - BINARY_SERIALIZATION_HEADER_SIZE < index_size)
+    {
+      printf ("expecting block size %zu and "
+	      "index size %zu but only %zu bytes left",
+	      block_size, index_size,
+	      size - BINARY_SERIALIZATION_HEADER_SIZE);
+      return CHOP_DESERIAL_TOO_SHORT;
     }
 
-  return CHOP_ERR_NOT_IMPL;
+  memcpy (handle->content, buffer + 8, index_size);
+  *bytes_read = index_size + 8;
+#ifdef BINARY_SERIALIZATION_USES_MAGIC_BYTES
+  *bytes_read += BINARY_SERIALIZATION_MAGIC_SIZE;
+#endif
+
+  /* The size of the binary representation of that handle: this includes
+     the size of the `block_size' and `key_size' fields, currently 8
+     bytes.  */
+  handle->index_handle.size = index_size + BINARY_SERIALIZATION_HEADER_SIZE;
+
+  return 0;
 }
 
 static chop_error_t
@@ -150,7 +227,9 @@ hih_deserialize (const char *s_buffer, size_t size,
     (chop_hash_index_handle_t *)object;
 
   *bytes_read = 0;
-  err = chop_object_initialize (object, &chop_hash_index_handle_class);
+  err = chop_object_initialize (object,
+				(chop_class_t *)
+				&chop_hash_index_handle_class);
   if (err)
     return err;
 
@@ -208,57 +287,8 @@ hih_deserialize (const char *s_buffer, size_t size,
 	}
 
     case CHOP_SERIAL_BINARY:
-      {
-	size_t block_size, index_size;
-
-	/* The serialized thing has to contain at least 4 bytes representing
-	   the size of the index itself and 4 bytes representing the size of
-	   the addressed block.  */
-	if (size < BINARY_SERIALIZATION_HEADER_SIZE)
-	  return CHOP_DESERIAL_CORRUPT_INPUT;
-
-#ifdef BINARY_SERIALIZATION_USES_MAGIC_BYTES
-	if (memcmp (buffer, BINARY_SERIALIZATION_MAGIC,
-		    BINARY_SERIALIZATION_MAGIC_SIZE))
-	  {
-	    printf ("didn't find hih magic bytes\n");
-	    return CHOP_DESERIAL_CORRUPT_INPUT;
-	  }
-
-	buffer += BINARY_SERIALIZATION_MAGIC_SIZE;
-#endif
-
-	block_size  = buffer[3]; block_size <<= 8;
-	block_size |= buffer[2]; block_size <<= 8;
-	block_size |= buffer[1]; block_size <<= 8;
-	block_size |= buffer[0];
-	handle->block_size = block_size;
-
-	index_size  = buffer[7]; index_size <<= 8;
-	index_size |= buffer[6]; index_size <<= 8;
-	index_size |= buffer[5]; index_size <<= 8;
-	index_size |= buffer[4];
-	handle->key_size = index_size;
-
-	if (size - BINARY_SERIALIZATION_HEADER_SIZE < index_size)
-	  {
-	    printf ("expecting block size %zu and "
-		    "index size %zu but only %zu bytes left",
-		    block_size, index_size,
-		    size - BINARY_SERIALIZATION_HEADER_SIZE);
-	    err = CHOP_DESERIAL_TOO_SHORT;
-	  }
-	else
-	  {
-	    memcpy (handle->content, buffer + 8, index_size);
-	    *bytes_read = index_size + 8;
-#ifdef BINARY_SERIALIZATION_USES_MAGIC_BYTES
-	    *bytes_read += BINARY_SERIALIZATION_MAGIC_SIZE;
-#endif
-	  }
-
-	break;
-      }
+      err = hih_decode_binary_handle (s_buffer, size, handle, bytes_read);
+      break;
 
     default:
       return CHOP_ERR_NOT_IMPL;
@@ -274,12 +304,61 @@ hih_deserialize (const char *s_buffer, size_t size,
   return err;
 }
 
+/* Decode at most COUNT binary-serialized handles from BUFFER into
+   HANDLES.  */
+static chop_error_t
+hih_decode_binary (const char *buffer, size_t size, size_t count,
+		   chop_index_handle_t *handles,
+		   size_t *decoded, size_t *bytes_read)
+{
+  chop_error_t err = 0;
+  chop_hash_index_handle_t *handle;
+  size_t offset = 0, i;
+
+  handle = (chop_hash_index_handle_t *) handles;
+  for (i = 0; (i < count) && (offset < size); i++, handle++)
+    {
+      size_t handle_size;
+
+      err = chop_object_initialize ((chop_object_t *) handle,
+				    (chop_class_t *)
+				    &chop_hash_index_handle_class);
+      if (err)
+	break;
+
+      err = hih_decode_binary_handle (buffer + offset, size - offset,
+				      handle, &handle_size);
+      if (err)
+	{
+	  chop_object_destroy ((chop_object_t *) handle);
+	  break;
+	}
+
+      offset += handle_size;
+    }
+
+  *decoded = i;
+  *bytes_read = offset;
+
+  return err;
+}
+
 /* Note: the default copy constructor will work fine.  */
 
-CHOP_DEFINE_RT_CLASS (hash_index_handle, index_handle,
-		      NULL, NULL,
-		      NULL, hih_equalp,
-		      hih_serialize, hih_deserialize);
+/* The metaclass methods, passed as a single macro argument below.  */
+#define HIH_METACLASS_INITS					\
+  .decode_binary = hih_decode_binary,				\
+  .encode_binary = hih_encode_binary
+
+CHOP_DEFINE_RT_CLASS_WITH_METACLASS (hash_index_handle, index_handle,
+				     index_handle_class,
+
+				     /* Metaclass inits */
+				     HIH_METACLASS_INITS,
+
+				     NULL, NULL,
+				     NULL, hih_equalp,
+				     hih_serialize, hih_deserialize);
 
 
 /* The fetcher class.  */
@@ -306,7 +385,8 @@ hbf_ctor (chop_object_t *object, const chop_class_t *class)
   fetcher = (chop_hash_block_fetcher_t *) object;
   fetcher->block_fetcher.fetch_block = hash_block_fetch;
   fetcher->block_fetcher.blocks_exist = hash_blocks_exist;
-  fetcher->block_fetcher.index_handle_class = &chop_hash_index_handle_class;
+  fetcher->block_fetcher.index_handle_class =
+    (chop_class_t *) &chop_hash_index_handle_class;
 
   fetcher->hash_method = CHOP_HASH_NONE;
 
@@ -415,9 +495,32 @@ hbf_deserialize (const char *buffer, size_t size, chop_serial_method_t method,
   return err;
 }
 
+static chop_error_t
+hbf_copy (const chop_object_t *s, chop_object_t *d)
+{
+  chop_error_t err;
+  chop_hash_block_fetcher_t *source, *dest;
+
+  source = (chop_hash_block_fetcher_t *)s;
+  dest = (chop_hash_block_fetcher_t *)d;
+
+  dest->block_fetcher.index_handle_class =
+    source->block_fetcher.index_handle_class;
+  dest->block_fetcher.fetch_block = source->block_fetcher.fetch_block;
+  dest->block_fetcher.blocks_exist = source->block_fetcher.blocks_exist;
+
+  dest->hash_method = source->hash_method;
+
+  err = chop_log_init ("hash-block-fetcher", &dest->log);
+  if (!err)
+    chop_log_mimic (&dest->log, &source->log, 0);
+
+  return err;
+}
+
 CHOP_DEFINE_RT_CLASS (hash_block_fetcher, block_fetcher,
 		      hbf_ctor, hbf_dtor,
-		      NULL, NULL,
+		      hbf_copy, NULL,
 		      hbf_serialize, hbf_deserialize);
 
 chop_log_t *
@@ -446,6 +549,7 @@ hash_blocks_exist (chop_block_fetcher_t *block_fetcher,
   for (i = 0; i < n; i++)
     {
       if (!chop_object_is_a ((chop_object_t *) indices[i],
+			     (chop_class_t *)
 			     &chop_hash_index_handle_class))
 	return CHOP_INVALID_ARG;
 
@@ -471,7 +575,7 @@ hash_block_fetch (chop_block_fetcher_t *block_fetcher,
 
   fetcher = (chop_hash_block_fetcher_t *)block_fetcher;
   if (!chop_object_is_a ((chop_object_t *)index,
-			 &chop_hash_index_handle_class))
+			 (chop_class_t *) &chop_hash_index_handle_class))
     return CHOP_INVALID_ARG;
 
   handle = (chop_hash_index_handle_t *)index;
@@ -574,7 +678,8 @@ hbi_ctor (chop_object_t *object, const chop_class_t *class)
   chop_hash_block_indexer_t *indexer;
 
   indexer = (chop_hash_block_indexer_t *)object;
-  indexer->block_indexer.index_handle_class = &chop_hash_index_handle_class;
+  indexer->block_indexer.index_handle_class =
+    (chop_class_t *) &chop_hash_index_handle_class;
   indexer->block_indexer.block_fetcher_class = &chop_hash_block_fetcher_class;
   indexer->block_indexer.index_block = hash_block_index;
   indexer->block_indexer.init_fetcher = hash_indexer_init_fetcher;
@@ -669,9 +774,30 @@ hbi_deserialize (const char *buffer, size_t size, chop_serial_method_t method,
   return 0;
 }
 
+static chop_error_t
+hbi_copy (const chop_object_t *s, chop_object_t *d)
+{
+  const chop_hash_block_indexer_t *source;
+  chop_hash_block_indexer_t *dest;
+
+  source = (const chop_hash_block_indexer_t *)s;
+  dest = (chop_hash_block_indexer_t *)d;
+
+  dest->block_indexer.index_handle_class =
+    source->block_indexer.index_handle_class;
+  dest->block_indexer.block_fetcher_class =
+    source->block_indexer.block_fetcher_class;
+  dest->block_indexer.index_block = source->block_indexer.index_block;
+  dest->block_indexer.init_fetcher = source->block_indexer.init_fetcher;
+
+  dest->hash_method = source->hash_method;
+
+  return 0;
+}
+
 CHOP_DEFINE_RT_CLASS (hash_block_indexer, block_indexer,
 		      hbi_ctor, hbi_dtor,
-		      NULL, NULL,
+		      hbi_copy, NULL,
 		      hbi_serialize, hbi_deserialize);
 
 
@@ -690,6 +816,7 @@ hash_block_index (chop_block_indexer_t *indexer,
 
   hash_indexer = (chop_hash_block_indexer_t *)indexer;
   err = chop_object_initialize ((chop_object_t *)handle,
+				(chop_class_t *)
 				&chop_hash_index_handle_class);
   if (err)
     return err;
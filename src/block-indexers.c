@@ -35,5 +35,97 @@ CHOP_DEFINE_RT_CLASS (index_handle, object,
 		      NULL, NULL,
 		      NULL, NULL);
 
+/* The `chop_index_handle_class_t' definition.  */
+CHOP_DEFINE_RT_CLASS (index_handle_class, class,
+		      NULL, NULL,
+		      NULL, NULL,
+		      NULL, NULL);
+
+chop_error_t
+chop_index_handle_decode_binary (const chop_class_t *klass,
+				 const char *buffer, size_t size,
+				 size_t count, chop_index_handle_t *handles,
+				 size_t *decoded, size_t *bytes_read)
+{
+  chop_error_t err = 0;
+  size_t offset = 0, i;
+
+  if (chop_object_is_a ((chop_object_t *) klass,
+			&chop_index_handle_class_class))
+    {
+      const chop_index_handle_class_t *handle_class;
+
+      handle_class = (chop_index_handle_class_t *) klass;
+      if (handle_class->decode_binary)
+	return (handle_class->decode_binary (buffer, size, count, handles,
+					     decoded, bytes_read));
+    }
+
+  for (i = 0; (i < count) && (offset < size); i++)
+    {
+      size_t handle_size;
+
+      err = chop_object_deserialize ((chop_object_t *)
+				     chop_index_handle_array_ref (klass,
+								  handles, i),
+				     klass, CHOP_SERIAL_BINARY,
+				     buffer + offset, size - offset,
+				     &handle_size);
+      if (err)
+	break;
+
+      offset += handle_size;
+    }
+
+  *decoded = i;
+  *bytes_read = offset;
+
+  return err;
+}
+
+chop_error_t
+chop_index_handle_append_binary (const chop_index_handle_t *handle,
+				 chop_buffer_t *buffer)
+{
+  chop_error_t err;
+  const chop_class_t *klass;
+  chop_buffer_t serial;
+
+  klass = chop_object_get_class ((chop_object_t *) handle);
+  if (chop_object_is_a ((chop_object_t *) klass,
+			&chop_index_handle_class_class))
+    {
+      const chop_index_handle_class_t *handle_class;
+
+      handle_class = (chop_index_handle_class_t *) klass;
+      if (handle_class->encode_binary)
+	{
+	  char *area;
+
+	  err = chop_buffer_extend (buffer,
+				    chop_index_handle_binary_size (handle),
+				    &area);
+	  if (!err)
+	    handle_class->encode_binary (handle, area);
+
+	  return err;
+	}
+    }
+
+  err = chop_buffer_init (&serial, chop_index_handle_binary_size (handle));
+  if (err)
+    return err;
+
+  err = chop_object_serialize ((chop_object_t *) handle, CHOP_SERIAL_BINARY,
+			       &serial);
+  if (!err)
+    err = chop_buffer_append (buffer, chop_buffer_content (&serial),
+			      chop_buffer_size (&serial));
+
+  chop_buffer_return (&serial);
+
+  return err;
+}
+
 /* arch-tag: ae556de6-c0ce-4cfc-98e0-1683dc5d60fc
  */
@@ -25,6 +25,9 @@
 #include <unistd.h>
 #include <errno.h>
 
+#ifdef HAVE_PTHREAD_H
+# include <pthread.h>
+#endif
 
 /* Define the following variable to compile-in pool support.  */
 #define ENABLE_POOL 1
@@ -39,6 +42,18 @@
 static chop_buffer_t buffer_pool[BUFFER_POOL_MAX_SIZE];
 static size_t        buffer_pool_size = 0;      /* Number of buffers in pool */
 static size_t        buffer_pool_available = 0; /* In bytes */
+static int           buffer_pool_enabled = 1;
+
+/* Buffers may be allocated and returned from several threads, e.g., by
+   parallel choppers.  */
+#ifdef HAVE_PTHREAD_H
+static pthread_mutex_t buffer_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+# define LOCK_POOL()    pthread_mutex_lock (&buffer_pool_lock)
+# define UNLOCK_POOL()  pthread_mutex_unlock (&buffer_pool_lock)
+#else
+# define LOCK_POOL()    do { } while (0)
+# define UNLOCK_POOL()  do { } while (0)
+#endif
 
 
 /* Find a buffer in the pool whose size is at greater than or equal to SIZE.
@@ -48,7 +63,10 @@ static inline int
 find_buffer_in_pool (size_t size, chop_buffer_t *found)
 {
   unsigned buf;
-  for (buf = 0; buf < buffer_pool_size; buf++)
+  int result = 0;
+
+  LOCK_POOL ();
+  for (buf = 0; (buffer_pool_enabled) && (buf < buffer_pool_size); buf++)
     {
       if (buffer_pool[buf].real_size >= size)
 	{
@@ -59,11 +77,13 @@ find_buffer_in_pool (size_t size, chop_buffer_t *found)
 	    /* Move the last buffer */
 	    buffer_pool[buf] = buffer_pool[buffer_pool_size];
 
-	  return 1;
+	  result = 1;
+	  break;
 	}
     }
+  UNLOCK_POOL ();
 
-  return 0;
+  return result;
 }
 #endif
 
@@ -163,18 +183,44 @@ chop_buffer_append (chop_buffer_t *buffer,
   return 0;
 }
 
+chop_error_t
+chop_buffer_extend (chop_buffer_t *buffer, size_t size, char **area)
+{
+  chop_error_t err;
+  size_t new_size = buffer->size + size;
+
+  if (new_size > buffer->real_size)
+    {
+      err = chop_buffer_grow (buffer, new_size);
+      if (err)
+	return err;
+    }
+
+  *area = buffer->buffer + buffer->size;
+  buffer->size = new_size;
+
+  return 0;
+}
+
 #ifdef ENABLE_POOL
 static inline void
 _chop_buffer_return (chop_buffer_t *buffer)
 {
-  if ((buffer_pool_size < BUFFER_POOL_MAX_SIZE)
+  int pooled = 0;
+
+  LOCK_POOL ();
+  if ((buffer_pool_enabled)
+      && (buffer_pool_size < BUFFER_POOL_MAX_SIZE)
       && (buffer_pool_available + buffer->real_size
 	  < BUFFER_POOL_MAX_AVAILABLE))
     {
       buffer_pool[buffer_pool_size++] = *buffer;
       buffer_pool_available += buffer->real_size;
+      pooled = 1;
     }
-  else
+  UNLOCK_POOL ();
+
+  if (!pooled)
     chop_free (buffer->buffer, NULL);
 }
 #endif
@@ -193,3 +239,23 @@ chop_buffer_return (chop_buffer_t *buffer)
   buffer->buffer = 0;
 }
 
+void
+chop_buffer_enable_pool (int enable)
+{
+#ifdef ENABLE_POOL
+  size_t count;
+  chop_buffer_t pool[BUFFER_POOL_MAX_SIZE];
+
+  LOCK_POOL ();
+  buffer_pool_enabled = enable;
+  count = enable ? 0 : buffer_pool_size;
+  memcpy (pool, buffer_pool, count * sizeof (*pool));
+  if (!enable)
+    buffer_pool_size = buffer_pool_available = 0;
+  UNLOCK_POOL ();
+
+  while (count > 0)
+    chop_free (pool[--count].buffer, NULL);
+#endif
+}
+
@@ -20,6 +20,7 @@
 #include <chop/chop.h>
 #include <chop/cipher.h>
 #include <chop/streams.h>
+#include <chop/choppers.h>
 #include <chop/objects.h>  /* Serializable objects */
 
 #include <stdio.h>
@@ -511,15 +512,16 @@ chop_object_destroy (chop_object_t *object)
 
 /* Class lookup by name (when GPerf is available).  */
 
-/* The following header declares a class.  */
+/* The following headers declare classes.  */
 #include <chop/store-stats.h>
+#include <chop/block-indexers.h>
 
 /* Class definitions that are internal to `indexer-hash-tree.c',
    `block-indexer-hash.c' and `block-indexer-chk.c'.  (FIXME)  */
-extern const chop_class_t chop_hash_index_handle_class,
-  chop_hash_block_indexer_class,
+extern const chop_index_handle_class_t chop_hash_index_handle_class,
+  chop_chk_index_handle_class;
+extern const chop_class_t chop_hash_block_indexer_class,
   chop_hash_block_fetcher_class,
-  chop_chk_index_handle_class,
   chop_chk_block_indexer_class,
   chop_chk_block_fetcher_class,
 #ifdef HAVE_LIBUUID
@@ -530,14 +532,19 @@ extern const chop_class_t chop_hash_index_handle_class,
   chop_integer_index_handle_class,
   chop_integer_block_indexer_class,
   chop_integer_block_fetcher_class,
-  chop_tree_stream_class;
+  chop_tree_stream_class,
+  chop_deferred_block_store_class,
+  chop_prefetch_block_store_class;
 
 /* Store-related class definitions.  (FIXME too: this is becoming ugly!) */
 extern const chop_class_t chop_gdbm_block_iterator_class,
   chop_tdb_block_iterator_class,
   chop_bdb_block_iterator_class,
   chop_qdbm_block_iterator_class,
-  chop_fs_block_iterator_class;
+  chop_lmdb_block_iterator_class,
+  chop_fs_block_iterator_class,
+  chop_pack_block_iterator_class,
+  chop_log_block_iterator_class;
 
 const struct chop_class_entry *
 chop_lookup_class_entry (const char *str, unsigned int len);
@@ -683,6 +690,8 @@ chop_init (void)
 #endif
 #endif
 
+  _chop_anchor_based_chopper_init ();
+
   err = _chop_cipher_init ();
   if (CHOP_EXPECT_TRUE (err == 0))
     err =  chop_log_init ("cipher", &chop_cipher_log);
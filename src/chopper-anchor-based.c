@@ -39,89 +39,16 @@
 #include <string.h>
 #include <stdint.h>
 #include <assert.h>
-#include <alloca.h>
 #include <errno.h>
-
-
-/* The following should only be defined when debugging things.  */
-/* #define AUTO_TEST 1 */
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
 
 
 /* A (sort of) Rabin fingerprint.  */
 typedef uint32_t fpr_t;
 
-/* A "sliding window": contains two buffers of WINDOW_SIZE bytes and (almost)
-   automatically manages transition from one to the other.  This is some sort
-   of a double buffering scheme.  */
-typedef struct
-{
-  size_t window_size;        /* size of the sliding window */
-  size_t raw_size;           /* 2 * WINDOW_SIZE */
-  uint8_t *raw_window;          /* pointer to RAW_SIZE bytes pointed to by the
-				two subwindows */
-  uint8_t *windows[2];          /* two subwindows, each of which points
-				to WINDOW_SIZE bytes */
-  size_t offset;             /* start offset within the sliding window */
-  size_t sizes[2];           /* size of each of the subwindows */
-} sliding_window_t;
-
-
-#ifdef HAVE_LIGHTNING_H
-
-#include <lightning.h>
-
-
-#ifdef __GNUC__
-/* GCC has an extensions for ``labels as pointers'' and the other way.  We
-   can leverage this to inline the dynamically-generated code.  Beware:  this
-   is slower than the no-inlining version.  */
-/* #define INLINE_LIGHTNING_CODE 1 */
-#endif
-
-/* The type of function we want to compile.  */
-typedef unsigned long (* jit_multiplier_func_t) (unsigned long);
-
-#ifdef INLINE_LIGHTNING_CODE
-#warning "You're compiling the inlining stuff, great!"
 
-/* In order to inline code, we'll need to generate it once and then patch it
-   every time before we use it.  Lightning's patch operations are not
-   costly.  */
-typedef struct
-{
-  jit_multiplier_func_t func;
-  jit_insn *operand_ptr_movi;
-  jit_insn *final_jump;
-  int patched;
-} jit_multiplier_t;
-
-#define JIT_MULTIPLIER_INIT(_m)				\
-do							\
-{							\
-  (_m).func = NULL;					\
-  (_m).patched = 0;					\
-  (_m).operand_ptr_movi = (_m).final_jump = NULL;	\
-}							\
-while (0)
-
-#define JIT_MULTIPLIER_FUNC(_m)  (_m).func
-
-#else /* INLINE_LIGHTNING_CODE */
-
-/* The type of a dynamically compiled multiplication function.  */
-typedef jit_multiplier_func_t jit_multiplier_t;
-
-#define JIT_MULTIPLIER_INIT(_m)  (_m) = NULL;
-#define JIT_MULTIPLIER_FUNC(_m)  (_m)
-
-#endif /* INLINE_LIGHTNING_CODE */
-
-#else /* !HAVE_LIGHTNING_H */
-# warning "Not compiling the Lightning code"
-#endif /* HAVE_LIGHTNING_H */
-
-
-
 /* Declare `chop_anchor_based_chopper_t' which inherits from
    `chop_chopper_t'.  */
 CHOP_DECLARE_RT_CLASS_WITH_METACLASS (anchor_based_chopper, chopper,
@@ -135,34 +62,35 @@ CHOP_DECLARE_RT_CLASS_WITH_METACLASS (anchor_based_chopper, chopper,
 			  boundary */
 		       fpr_t magic_fpr_mask;
 
+		       /* Minimum and maximum block sizes; a zero
+			  MAX_SIZE means "unlimited" */
+		       size_t min_size;
+		       size_t max_size;
+
 		       /* The value of ANCHOR_PRIME_NUMBER to the
 			  WINDOW_SIZE */
 		       fpr_t  prime_to_the_ws;
 
-		       /* The sliding window (double buffer) that is used
-			  when reading the input stream.  */
-		       sliding_window_t sliding_window;
-
-#ifndef HAVE_LIGHTNING_H
-		       /* Cache of multiplication of a byte by PRIME to the
+		       /* Multiplication of each byte by PRIME to the
 			  WINDOW_SIZE */
 		       fpr_t product_cache[256];
-#else
-		       /* Dynamically generated function that computes an
-			  integer multiplied by PRIME_TO_THE_WS */
-		       jit_multiplier_t jit_multiply_with_prime_to_the_ws;
-#endif
-
-		       /* Tells whether this is the first time we process
-			  this stream.  */
-		       int first;
 
-		       /* If FIRST is false, fingerprint of the previous
-			  sliding window (whose offset was one byte earlier)
-			  and first character of the previous sliding
-			  window.  */
-		       fpr_t prev_fpr;
-		       uint8_t prev_first_char;
+		       /* Input buffer of INPUT_SIZE bytes.  Bytes between
+			  INPUT_START and INPUT_END have been read from the
+			  stream but not returned yet.  */
+		       uint8_t *input;
+		       size_t input_size;
+		       size_t input_start;
+		       size_t input_end;
+		       int end_of_stream;
+
+		       /* Offset in the stream of the beginning of the next
+			  block, and offset of the end of the last block
+			  whose boundary does not depend on the data that
+			  follows it, i.e., where chopping can be resumed
+			  if data is appended to the stream.  */
+		       uint64_t offset;
+		       uint64_t resume_offset;
 
 		       /* Message logging */
 		       chop_log_t log;);
@@ -187,11 +115,18 @@ ab_generic_open (chop_stream_t *input, size_t average_size,
   return (chop_anchor_based_chopper_init (input,
 					  48 /* window size */,
 					  power_of_two /* magic fpr mask */,
+					  (power_of_two + 1) / 4 /* min. size */,
+					  (power_of_two + 1) * 8 /* max. size */,
 					  chopper));
 }
 
 static chop_error_t ab_ctor (chop_object_t *, const chop_class_t *);
 static void ab_dtor (chop_object_t *);
+static chop_error_t ab_serialize (const chop_object_t *,
+				  chop_serial_method_t, chop_buffer_t *);
+static chop_error_t ab_deserialize (const char *, size_t,
+				    chop_serial_method_t, chop_object_t *,
+				    size_t *);
 
 CHOP_DEFINE_RT_CLASS_WITH_METACLASS (anchor_based_chopper, chopper,
 				     chopper_class,  /* Metaclass */
@@ -201,571 +136,461 @@ CHOP_DEFINE_RT_CLASS_WITH_METACLASS (anchor_based_chopper, chopper,
 
 				     ab_ctor, ab_dtor,
 				     NULL, NULL, /* No copy, equalp */
-				     NULL, NULL  /* No serial/deserial */);
+				     ab_serialize, ab_deserialize);
 
 
 /* These are the main parameters of the algorithm.  Here the `M' parameter
    is chosen to be 2^30 (see ANCHOR_MODULO_MASK) and `p'
-   (ANCHOR_PRIME_NUMBER) is 3.  This way, in
-   `compute_next_window_fingerprint ()', we can multiply the previous
-   fingerprint by ANCHOR_PRIME_NUMBER without risking to overflow the 32-bit
-   `fpr_t' type.  */
+   (ANCHOR_PRIME_NUMBER) is 3.  This way, in `roll_and_find_anchor ()', we
+   can multiply the previous fingerprint by ANCHOR_PRIME_NUMBER without risking
+   to overflow the 32-bit `fpr_t' type.  */
 #define ANCHOR_PRIME_NUMBER (3U)
 #define ANCHOR_MODULO_MASK  (0x3fffffffU)
 
+/* Lower and upper bounds on the size of the input buffer when no maximum
+   block size is specified.  */
+#define ANCHOR_MIN_INPUT_SIZE  (64U * 1024U)
+#define ANCHOR_MAX_INPUT_SIZE  (2U * 1024U * 1024U)
+
+
 
 
-
 static chop_error_t
 chop_anchor_chopper_read_block (chop_chopper_t *, chop_buffer_t *,
 				size_t *);
 
+static chop_error_t
+chop_anchor_chopper_read_block_view (chop_chopper_t *, chop_buffer_t *,
+				     const char **, size_t *);
+
+static chop_error_t
+chop_anchor_chopper_find_boundaries (chop_chopper_t *, chop_buffer_t *,
+				     const char **, chop_block_span_t *,
+				     size_t, size_t *);
+
 static void
 chop_anchor_chopper_close (chop_chopper_t *);
 
 
-
-#ifndef HAVE_LIGHTNING_H
 
-/* Multiply WHAT by ANCHOR->PRIME to the ANCHOR->WINDOW_SIZE.  */
+/* Fingerprint computation routines.  */
+
+/* Return the fingerprint of the WINDOW_SIZE bytes at DATA.  */
 static inline fpr_t
-multiply_with_prime_to_the_ws (chop_anchor_based_chopper_t *anchor,
-			       uint8_t what)
+compute_window_fingerprint (const chop_anchor_based_chopper_t *anchor,
+			    const uint8_t *data)
 {
-  fpr_t cached;
-  unsigned idx;
-
-  if (what == '\0')
-    return 0;
+  register fpr_t fpr = 0;
+  const uint8_t *p;
 
-  idx = what;
-  cached = anchor->product_cache[idx];
-  if (cached == 0)
+  for (p = data; p < data + anchor->window_size; p++)
     {
-      /* Not computed yet: compute the result and cache it.  */
-      fpr_t result = (fpr_t)what;
-
-      result *= anchor->prime_to_the_ws;
-      anchor->product_cache[idx] = result;
-
-      return result;
+      fpr *= ANCHOR_PRIME_NUMBER;
+      fpr += *p;
+      fpr &= ANCHOR_MODULO_MASK;
     }
 
-  return (cached);
+  return fpr;
 }
 
-#else /* HAVE_LIGHTNING_H */
-
-/* XXX:  Maybe we should actually compile the whole
-   `compute_next_window_fingerprint ()' function here, so as to avoid the
-   function-call overhead for just one multiplication.  */
+/* Return true if FPR should be chosen as an anchor point.  */
+#define IS_ANCHOR_FINGERPRINT(_fpr)   (((_fpr) & magic_fpr_mask) == 0)
 
-/* Compile and return a function that multiplies an unsigned long with
-   PRIME_TO_THE_WS.  The returned function must be freed eventually.  */
-static inline jit_multiplier_t
-compile_multiplication_function (unsigned long prime_to_the_ws)
+/* Continue looking for an anchor in the SIZE bytes at DATA, where FPR is
+   the fingerprint of the window that ends at offset END.  Return the
+   offset of the end of the first window whose fingerprint is magic, or
+   zero if none was found.  */
+static inline size_t
+roll_and_find_anchor (const chop_anchor_based_chopper_t *anchor,
+		      const uint8_t *data, size_t size,
+		      size_t end, register fpr_t fpr)
 {
-#define MAX_CODE_SIZE   1024
-
-#ifndef INLINE_LIGHTNING_CODE
-  unsigned long input_arg;
-#endif
-  char *buffer, *start, *end;
-  jit_multiplier_t result;
+  register const fpr_t magic_fpr_mask = anchor->magic_fpr_mask;
+  const size_t window_size = anchor->window_size;
 
-  JIT_MULTIPLIER_INIT (result);
-  buffer = chop_malloc (MAX_CODE_SIZE,
-			(chop_class_t *) &chop_anchor_based_chopper_class);
-  if (!buffer)
-    return result;
-
-  JIT_MULTIPLIER_FUNC (result) =
-    (jit_multiplier_func_t)(jit_set_ip ((void *)buffer).iptr);
-  start = jit_get_ip ().ptr;
-
-#ifndef INLINE_LIGHTNING_CODE
-
-  /* Take one argument (the character), and instruct Lightning that we won't
-     call any function.  */
-  jit_leaf (1);
-  input_arg = jit_arg_ul ();
-  jit_getarg_l (JIT_R2, input_arg);
-
-#else /* INLINE_LIGHTNING_CODE */
+  for (; end < size; end++)
+    {
+      /* The fingerprint of each window can be computed efficiently based
+	 on the previous fingerprint.  */
+      fpr *= ANCHOR_PRIME_NUMBER;
+      fpr -= anchor->product_cache[data[end - window_size]];
+      fpr += data[end];
+      fpr &= ANCHOR_MODULO_MASK;
+
+      if (IS_ANCHOR_FINGERPRINT (fpr))
+	return end + 1;
+    }
 
-  /* Create a zero-argument function.  The first `movi' instructions are
-     meant to be patched later, in `compute_next_window_fingerprint ()'.  */
-  jit_leaf (0);
-  jit_pushr_p (JIT_R1);
-  jit_pushr_p (JIT_R2);
-  result.operand_ptr_movi = jit_movi_p (JIT_R1, NULL);
-  jit_ldr_p (JIT_R2, JIT_R1);
+  return 0;
+}
 
-#endif
+/* Look for an anchor in the SIZE bytes at DATA, i.e., a WINDOW_SIZE-long
+   window whose fingerprint is magic.  Return the offset of the end of the
+   first such window, or zero if none was found.  */
+static size_t
+find_anchor_scalar (const chop_anchor_based_chopper_t *anchor,
+		    const uint8_t *data, size_t size)
+{
+  register fpr_t fpr;
+  register const fpr_t magic_fpr_mask = anchor->magic_fpr_mask;
 
-  /* Actually perform the multiplication:  PRIME_TO_THE_WS is now considered
-     a compile-time value.  */
-  jit_muli_ul (JIT_R2, JIT_R2, prime_to_the_ws);
+  if (size < anchor->window_size)
+    return 0;
 
-#ifndef INLINE_LIGHTNING_CODE
+  /* For the first window, we must compute the fingerprint from scratch.  */
+  fpr = compute_window_fingerprint (anchor, data);
+  if (IS_ANCHOR_FINGERPRINT (fpr))
+    return anchor->window_size;
 
-  /* Return the value just computed.  */
-  jit_movr_ul (JIT_RET, JIT_R2);
-  jit_ret ();
+  return roll_and_find_anchor (anchor, data, size, anchor->window_size, fpr);
+}
 
-#else
 
-  /* Store the result at the address pointed to by R1.  */
-  jit_str_p (JIT_R1, JIT_R2);
+#if (defined HAVE_IMMINTRIN_H) && (defined HAVE_CPUID_H)	\
+  && (defined __GNUC__)						\
+  && ((defined __x86_64__) || (defined __i386__))
 
-  /* Restore the registers and jump out.  */
-  jit_popr_p (JIT_R2);
-  jit_popr_p (JIT_R1);
+/* Vectorized kernels.  They compute the fingerprints of LANES consecutive
+   windows at once: let F(x) be the fingerprint of the window that starts
+   at offset X and C(x) the byte at offset X; with P = ANCHOR_PRIME_NUMBER
+   and WS = WINDOW_SIZE, we have:
 
-  result.final_jump = jit_jmpi (NULL);
+     F(x + LANES) = P^LANES F(x) - P^WS G(x) + G(x + WS)
 
-#endif
+   where G(x) = sum_{i=0}^{LANES-1} C(x + i) P^(LANES-1-i).
 
-  /* Finish.  */
-  end = jit_get_ip ().ptr;
-  assert (end - start < MAX_CODE_SIZE);
-  jit_flush_code (start, end);
+   G is computed for LANES consecutive offsets by shuffling input bytes such
+   that each 32-bit lane contains the bytes it needs, and then by computing
+   dot products with `pmaddubsw' and `pmaddwd'.  Computations are made
+   modulo 2^32, which is fine since ANCHOR_MODULO_MASK is 2^30 - 1.  */
 
-  buffer = chop_realloc (buffer, end - start,
-			 (chop_class_t *) &chop_anchor_based_chopper_class);
-  return result;
-#undef MAX_CODE_SIZE
-}
+# include <immintrin.h>
+# include <cpuid.h>
 
-#define multiply_with_prime_to_the_ws(_chopper, _char)			\
-  (_chopper)->jit_multiply_with_prime_to_the_ws ((unsigned long)(_char))
+# define HAVE_ANCHOR_SIMD_KERNELS 1
 
-#endif /* HAVE_LIGHTNING_H */
+/* The number of fingerprints computed at once, and P^LANES.  */
+# define SSE_LANES      4
+# define SSE_PRIME_TO_THE_LANES   81U
+# define AVX2_LANES     8
+# define AVX2_PRIME_TO_THE_LANES  6561U
 
-
-/* Read a whole window (ie. ANCHOR->WINDOW_SIZE bytes) from ANCHOR's input
-   stream and store it into BUFFER.  */
-static inline chop_error_t
-read_sliding_window (chop_anchor_based_chopper_t *anchor,
-		     uint8_t *buffer, size_t *size)
+/* Compute the fingerprints of the first LANES windows of the SIZE bytes at
+   DATA, which must be at least WINDOW_SIZE + LANES - 1 bytes long, and
+   store them in FPRS.  Return the offset of the end of the first anchor
+   among them, or zero if there is none.  */
+static inline size_t
+compute_first_fingerprints (const chop_anchor_based_chopper_t *anchor,
+			    const uint8_t *data, size_t lanes,
+			    uint32_t *fprs)
 {
-  chop_error_t err = 0;
-  chop_stream_t *input = anchor->chopper.stream;
-
-  *size = 0;
+  register fpr_t fpr;
+  register const fpr_t magic_fpr_mask = anchor->magic_fpr_mask;
+  const size_t window_size = anchor->window_size;
+  size_t lane;
 
-  /* Read data from INPUT until we got ANCHOR->WINDOW_SIZE bytes or
-     end-of-stream is reached.  */
-  while (*size < anchor->window_size)
+  fpr = compute_window_fingerprint (anchor, data);
+  for (lane = 0; ; lane++)
     {
-      size_t amount = 0;
+      if (IS_ANCHOR_FINGERPRINT (fpr))
+	return lane + window_size;
 
-      err = chop_stream_read (input, (char *) buffer + *size,
-			      anchor->window_size - *size, &amount);
-      *size += amount;
+      fprs[lane] = fpr;
+      if (lane + 1 == lanes)
+	break;
 
-      if (err)
-	{
-	  if (err == CHOP_STREAM_END)
-	    break;
-	  else
-	    return err;
-	}
+      fpr *= ANCHOR_PRIME_NUMBER;
+      fpr -= anchor->product_cache[data[lane]];
+      fpr += data[lane + window_size];
+      fpr &= ANCHOR_MODULO_MASK;
     }
 
-  if (((!err) || (err == CHOP_STREAM_END))
-      && (*size < anchor->window_size))
-    /* Pad with zeros.  This is meant to help the "fast" implementation of
-       sliding windows.  */
-    memset (buffer + *size, 0, anchor->window_size - *size);
-
-  if ((err == CHOP_STREAM_END) && (*size > 0))
-    /* We'll announce the end of stream once there is really nothing left to
-       read.  */
-    err = 0;
-
-  return err;
+  return 0;
 }
 
+/* Return the lowest bit set in MASK, which must be non-zero.  */
+# define lowest_bit_set(_mask)  ((size_t) __builtin_ctz (_mask))
 
-
-/* Sliding windows.  */
-
-/* Return the offset starting from WIN->RAW_WINDOW that corresponds to the
-   offset OFFS starting from the beginning of the current sliding window.  */
-#define sliding_window_get_raw_offset(_win, _offs)	\
-((((_win)->windows[0] - (_win)->raw_window) + (_offs))	\
- % (_win)->raw_size)
+/* Return G(x) for the four offsets starting at DATA; 8 bytes are read.  */
+__attribute__ ((__target__ ("sse4.2")))
+static inline __m128i
+sse_sum4 (const uint8_t *data, __m128i shuffle, __m128i weights,
+	  __m128i ones)
+{
+  __m128i bytes;
 
-/* Return the character located at offset OFFS within WIN.  */
-#define sliding_window_ref(_win, _offs)					\
-((_win)->raw_window[sliding_window_get_raw_offset (_win, _offs)])
+  bytes = _mm_shuffle_epi8 (_mm_loadl_epi64 ((const __m128i *) data),
+			    shuffle);
+  return _mm_madd_epi16 (_mm_maddubs_epi16 (bytes, weights), ones);
+}
 
-/* Return the character at the current start offset of WINDOW.  */
-#define sliding_window_first_char(_win)		\
-(sliding_window_ref (_win, (_win)->offset))
+__attribute__ ((__target__ ("sse4.2")))
+static size_t
+find_anchor_sse42 (const chop_anchor_based_chopper_t *anchor,
+		   const uint8_t *data, size_t size)
+{
+  uint32_t fprs[SSE_LANES] __attribute__ ((__aligned__ (16)));
+  const size_t window_size = anchor->window_size;
+  size_t start, result;
+  __m128i fpr, magic_fpr_mask, prime_to_the_ws, prime_to_the_lanes, zero;
+  __m128i shuffle, weights, ones;
 
-/* Return the character at the current end offset (start offset + window
-   size) of WINDOW.  */
-#define sliding_window_last_char(_win)					\
-(sliding_window_ref (_win, (_win)->offset + (_win)->window_size - 1))
+  if (size < window_size + 2 * SSE_LANES)
+    return find_anchor_scalar (anchor, data, size);
 
+  result = compute_first_fingerprints (anchor, data, SSE_LANES, fprs);
+  if (result)
+    return result;
 
-/* Forward declarations.  */
+  fpr = _mm_load_si128 ((const __m128i *) fprs);
+  magic_fpr_mask =
+    _mm_set1_epi32 ((int) (anchor->magic_fpr_mask & ANCHOR_MODULO_MASK));
+  prime_to_the_ws = _mm_set1_epi32 ((int) anchor->prime_to_the_ws);
+  prime_to_the_lanes = _mm_set1_epi32 ((int) SSE_PRIME_TO_THE_LANES);
+  zero = _mm_setzero_si128 ();
+
+  /* Lane K gets bytes K to K + 3, which are multiplied by P^3 to P^0.  */
+  shuffle = _mm_setr_epi8 (0, 1, 2, 3, 1, 2, 3, 4,
+			   2, 3, 4, 5, 3, 4, 5, 6);
+  weights = _mm_set1_epi32 (0x0103091b);
+  ones = _mm_set1_epi16 (1);
+
+  /* START is the offset of the window whose fingerprint is in the first
+     lane of FPR.  */
+  for (start = 0;
+       start + window_size + 2 * SSE_LANES <= size;
+       start += SSE_LANES)
+    {
+      __m128i out, in;
+      int anchors;
+
+      out = sse_sum4 (data + start, shuffle, weights, ones);
+      in = sse_sum4 (data + start + window_size, shuffle, weights, ones);
+
+      fpr = _mm_mullo_epi32 (fpr, prime_to_the_lanes);
+      fpr = _mm_sub_epi32 (fpr, _mm_mullo_epi32 (out, prime_to_the_ws));
+      fpr = _mm_add_epi32 (fpr, in);
+
+      anchors =
+	_mm_movemask_ps (_mm_castsi128_ps
+			 (_mm_cmpeq_epi32 (_mm_and_si128 (fpr, magic_fpr_mask),
+					   zero)));
+      if (anchors)
+	return start + SSE_LANES + lowest_bit_set (anchors) + window_size;
+    }
 
-#ifdef __GNUC__
-# define INLINED  __attribute__ ((__always_inline__))
-#else
-# define INLINED
-#endif
+  /* Resume with the scalar code after the window in the last lane.  */
+  _mm_store_si128 ((__m128i *) fprs, fpr);
+  return roll_and_find_anchor (anchor, data, size,
+			       start + SSE_LANES - 1 + window_size,
+			       fprs[SSE_LANES - 1] & ANCHOR_MODULO_MASK);
+}
 
-static uint8_t *sliding_window_dest_buffer (sliding_window_t *,
-					    size_t **,
-					    size_t *) INLINED;
-static void sliding_window_increment_offset (sliding_window_t *) INLINED;
-
-
-
-/* Return non-zero if less than WINDOW->WINDOW_SIZE bytes are available from
-   WINDOW's current offset.  */
-#define sliding_window_unfull(window)				\
-  (((window)->sizes[1] > 0)					\
-   ? ((window)->offset > (window)->sizes[1])			\
-   : (((window)->sizes[0] > 0)					\
-      ? (((window)->offset > 0)					\
-	 || ((window)->sizes[0] < (window)->window_size))	\
-      : 1))
-
-/* Return a pointer to a WINDOW->WINDOW_SIZE byte buffer.  Return in
-   DEST_SIZE a pointer to this buffer's size which should be updated and be
-   lower than or equal to WINDOW->WINDOW_SIZE.  DISCARDED is set to the
-   amount of useful data that were originally pointed to by *DEST_SIZE.  This
-   may be used to flush the data pointed to by *DEST_SIZE before overwriting
-   it.  */
-static inline uint8_t *
-sliding_window_dest_buffer (sliding_window_t *window,
-			    size_t **dest_size,
-			    size_t *discarded)
+/* Return G(x) for the eight offsets starting at DATA; 16 bytes are
+   read.  */
+__attribute__ ((__target__ ("avx2")))
+static inline __m256i
+avx2_sum8 (const uint8_t *data,
+	   __m256i high_shuffle, __m256i high_weights,
+	   __m256i low_shuffle, __m256i low_weights,
+	   __m256i ones)
 {
-  uint8_t *dest;
+  __m256i bytes, high, low;
+
+  /* G(x) = 27 * (81 C(x) + 27 C(x + 1) + 9 C(x + 2) + 3 C(x + 3))
+            + (27 C(x + 4) + 9 C(x + 5) + 3 C(x + 6) + C(x + 7))  */
+  bytes =
+    _mm256_broadcastsi128_si256 (_mm_loadu_si128 ((const __m128i *) data));
+  high = _mm256_maddubs_epi16 (_mm256_shuffle_epi8 (bytes, high_shuffle),
+			       high_weights);
+  low = _mm256_maddubs_epi16 (_mm256_shuffle_epi8 (bytes, low_shuffle),
+			      low_weights);
+
+  return _mm256_add_epi32 (_mm256_madd_epi16 (high,
+					      _mm256_set1_epi16 (27)),
+			   _mm256_madd_epi16 (low, ones));
+}
 
-  if (window->sizes[0] == 0)
-    {
-      dest = window->windows[0];
-      *dest_size = &window->sizes[0];
-      *discarded = window->sizes[0];
-    }
-  else
-    {
-      if (window->sizes[1] == 0)
-	{
-	  dest = window->windows[1];
-	  *dest_size = &window->sizes[1];
-	  *discarded = window->sizes[1];
-	}
-      else
-	{
-	  /* Discard the contents of the first window.  Make the second
-	     window the first one.  */
-	  uint8_t *new_window = window->windows[0];
+__attribute__ ((__target__ ("avx2")))
+static size_t
+find_anchor_avx2 (const chop_anchor_based_chopper_t *anchor,
+		  const uint8_t *data, size_t size)
+{
+  uint32_t fprs[AVX2_LANES] __attribute__ ((__aligned__ (32)));
+  const size_t window_size = anchor->window_size;
+  size_t start, result;
+  __m256i fpr, magic_fpr_mask, prime_to_the_ws, prime_to_the_lanes, zero;
+  __m256i high_shuffle, high_weights, low_shuffle, low_weights, ones;
 
-	  *discarded = window->sizes[0];
+  if (size < window_size + 2 * AVX2_LANES)
+    return find_anchor_scalar (anchor, data, size);
 
-	  window->windows[0] = window->windows[1];
-	  window->windows[1] = new_window;
-	  window->sizes[0] = window->sizes[1];
-	  window->offset %= window->window_size;
+  result = compute_first_fingerprints (anchor, data, AVX2_LANES, fprs);
+  if (result)
+    return result;
 
-	  dest = window->windows[1];
-	  *dest_size = &window->sizes[1];
-	}
+  fpr = _mm256_load_si256 ((const __m256i *) fprs);
+  magic_fpr_mask =
+    _mm256_set1_epi32 ((int) (anchor->magic_fpr_mask & ANCHOR_MODULO_MASK));
+  prime_to_the_ws = _mm256_set1_epi32 ((int) anchor->prime_to_the_ws);
+  prime_to_the_lanes = _mm256_set1_epi32 ((int) AVX2_PRIME_TO_THE_LANES);
+  zero = _mm256_setzero_si256 ();
+
+  /* Lane K gets bytes K to K + 3 in HIGH, and bytes K + 4 to K + 7 in LOW.
+     Since `vpshufb' operates on each 128-bit half independently, the input
+     bytes are broadcast to both halves.  */
+  high_shuffle = _mm256_setr_epi8 (0, 1, 2, 3, 1, 2, 3, 4,
+				   2, 3, 4, 5, 3, 4, 5, 6,
+				   4, 5, 6, 7, 5, 6, 7, 8,
+				   6, 7, 8, 9, 7, 8, 9, 10);
+  low_shuffle = _mm256_setr_epi8 (4, 5, 6, 7, 5, 6, 7, 8,
+				  6, 7, 8, 9, 7, 8, 9, 10,
+				  8, 9, 10, 11, 9, 10, 11, 12,
+				  10, 11, 12, 13, 11, 12, 13, 14);
+  high_weights = _mm256_set1_epi32 (0x03091b51);
+  low_weights = _mm256_set1_epi32 (0x0103091b);
+  ones = _mm256_set1_epi16 (1);
+
+  for (start = 0;
+       start + window_size + 2 * AVX2_LANES <= size;
+       start += AVX2_LANES)
+    {
+      __m256i out, in;
+      int anchors;
+
+      out = avx2_sum8 (data + start, high_shuffle, high_weights,
+		       low_shuffle, low_weights, ones);
+      in = avx2_sum8 (data + start + window_size, high_shuffle, high_weights,
+		      low_shuffle, low_weights, ones);
+
+      fpr = _mm256_mullo_epi32 (fpr, prime_to_the_lanes);
+      fpr = _mm256_sub_epi32 (fpr, _mm256_mullo_epi32 (out, prime_to_the_ws));
+      fpr = _mm256_add_epi32 (fpr, in);
+
+      anchors =
+	_mm256_movemask_ps (_mm256_castsi256_ps
+			    (_mm256_cmpeq_epi32 (_mm256_and_si256 (fpr,
+								   magic_fpr_mask),
+						 zero)));
+      if (anchors)
+	return start + AVX2_LANES + lowest_bit_set (anchors) + window_size;
     }
 
-  return dest;
+  _mm256_store_si256 ((__m256i *) fprs, fpr);
+  return roll_and_find_anchor (anchor, data, size,
+			       start + AVX2_LANES - 1 + window_size,
+			       fprs[AVX2_LANES - 1] & ANCHOR_MODULO_MASK);
 }
 
-
-static inline size_t
-sliding_window_start_offset (sliding_window_t *window)
+static int
+cpu_supports_sse42 (void)
 {
-  register size_t size;
-
-  size = window->sizes[0] + window->sizes[1];
+  unsigned int eax, ebx, ecx, edx;
 
-  if (window->offset < size)
-    return window->offset;
+  if (!__get_cpuid (1, &eax, &ebx, &ecx, &edx))
+    return 0;
 
-  return (size ? size - 1 : 0);
+  return ((ecx & bit_SSE4_2) != 0);
 }
 
-/* Return the end offset of WINDOW, i.e. and integer between zero and
-   two times WINDOW->WINDOW_SIZE.  */
-static inline size_t
-sliding_window_end_offset (sliding_window_t *window)
+static int
+cpu_supports_avx2 (void)
 {
-  register size_t size, end;
+  unsigned int eax, ebx, ecx, edx, xcr0_lo, xcr0_hi;
 
-  size = window->sizes[0] + window->sizes[1];
-  end = window->offset + window->window_size;
+  if (!__get_cpuid (1, &eax, &ebx, &ecx, &edx))
+    return 0;
 
-  return ((end < size) ? end : size);
-}
+  /* Make sure the OS saves the YMM registers.  */
+  if (!(ecx & bit_OSXSAVE) || !(ecx & bit_AVX))
+    return 0;
 
-/* Discard AMOUNT bytes (at most WINDOW->WINDOW_SIZE) from WINDOW.  */
-static inline void
-sliding_window_skip (sliding_window_t *window, size_t amount)
-{
-  assert (amount <= window->raw_size - window->offset);
+  __asm__ ("xgetbv" : "=a" (xcr0_lo), "=d" (xcr0_hi) : "c" (0));
+  if ((xcr0_lo & 6) != 6)
+    return 0;
 
-  /* Actually, WINDOW->SIZES[0] should be equal to WINDOW->WINDOW_SIZE most
-     of the time.  */
-  if (window->offset + amount >= window->sizes[0])
-    {
-      /* Discard the first subwindow.  */
-      uint8_t *old_window;
+  if (__get_cpuid_max (0, NULL) < 7)
+    return 0;
 
-      window->offset += amount;
-      window->offset -= window->sizes[0];
+  __cpuid_count (7, 0, eax, ebx, ecx, edx);
 
-      old_window = window->windows[0];
-      window->windows[0] = window->windows[1];
-      window->windows[1] = old_window;
-      window->sizes[0] = window->sizes[1];
-      window->sizes[1] = 0;
-    }
-  else
-    window->offset += amount;
+  return ((ebx & bit_AVX2) != 0);
 }
 
-/* Naively increment WINDOW's offset.  Pre-condition:  WINDOW must not be
-   `unfull'.  Whether it becomes unfull afterwards should be checked by the
-   caller.  */
-static inline void
-sliding_window_increment_offset (sliding_window_t *window)
-{
-  assert (!sliding_window_unfull (window));
-  window->offset++;
-}
+#endif /* HAVE_IMMINTRIN_H && HAVE_CPUID_H && __GNUC__ && x86 */
 
-/* Append SIZE bytes starting at START_OFFSET from WINDOW to BUFFER.  */
-static inline chop_error_t
-sliding_window_append_to_buffer (sliding_window_t *window,
-				 size_t start_offset, size_t size,
-				 chop_buffer_t *buffer)
-{
-  chop_error_t err;
+#undef IS_ANCHOR_FINGERPRINT
 
-  if (start_offset < window->window_size)
-    {
-      /* Copy from the first sub-window */
-      size_t amount, available = window->sizes[0] - start_offset;
-      amount = (available > size) ? size : available;
-      err = chop_buffer_append (buffer,
-				(char *) window->windows[0] + start_offset,
-				amount);
-      if (err)
-	return err;
-      size -= amount;
 
-      if (size > 0)
-	{
-	  /* Copy the remaining bytes from the second sub-window */
-	  available = window->sizes[1];
-	  amount = (available > size) ? size : available;
-
-	  err = chop_buffer_append (buffer, (char *) window->windows[1],
-				    amount);
-	  if (err)
-	    return err;
-	}
-    }
-  else
-    {
-      /* Copy from the second sub-window */
-      start_offset -= window->window_size;
-      err = chop_buffer_append (buffer,
-				(char *) window->windows[1] + start_offset,
-				size);
-      if (err)
-	return err;
-    }
+/* Anchor-scanning kernels.  */
 
-  return 0;
-}
+typedef size_t (* anchor_kernel_t) (const chop_anchor_based_chopper_t *,
+				    const uint8_t *, size_t);
 
-/* Copy data available starting from offset WINDOW->WINDOW_SIZE from WINDOW
-   to BUFFER.  Set SIZE to the number of bytes copied, at most
-   WINDOW->WINDOW_SIZE bytes.  */
-static inline void
-sliding_window_copy_second_half (sliding_window_t *window,
-				 uint8_t *buffer, size_t *size)
+static int
+cpu_supports_anything (void)
 {
-  memcpy (buffer, window->windows[1], window->sizes[1]);
-  *size = window->sizes[1];
+  return 1;
 }
 
-static inline const uint8_t *
-sliding_window_first_half (sliding_window_t *window)
+static const struct
 {
-  return (window->windows[0]);
-}
+  const char     *name;
+  anchor_kernel_t find_anchor;
+  int          (* supported) (void);
+} anchor_kernels[] =
+  {
+    /* Best kernels come first.  */
+#ifdef HAVE_ANCHOR_SIMD_KERNELS
+    { "avx2",   find_anchor_avx2,   cpu_supports_avx2 },
+    { "sse4.2", find_anchor_sse42,  cpu_supports_sse42 },
+#endif
+    { "scalar", find_anchor_scalar, cpu_supports_anything }
+  };
 
-static inline size_t
-sliding_window_first_half_size (sliding_window_t *window)
-{
-  return (window->sizes[0]);
-}
+#define ANCHOR_KERNEL_COUNT  (sizeof (anchor_kernels) / sizeof (anchor_kernels[0]))
 
-/* Clear WINDOW's contents, i.e. make it empty.  */
-static inline void
-sliding_window_clear (sliding_window_t *window)
-{
-  window->sizes[0] = window->sizes[1] = 0;
-  window->offset = 0;
-}
+/* Index of the kernel currently used in ANCHOR_KERNELS.  */
+static size_t current_kernel = ANCHOR_KERNEL_COUNT - 1;
 
-/* Initialize WINDOW to be a sliding window of size SIZE.  Memory is
-   allocated on the stack.  Returns an error code.  */
-static inline chop_error_t
-sliding_window_init (sliding_window_t *window, size_t size)
+void
+_chop_anchor_based_chopper_init (void)
 {
-  window->raw_window =
-    chop_calloc (2 * size, (chop_class_t *) &chop_anchor_based_chopper_class);
-  if (!window->raw_window)
-    return ENOMEM;
-
-  window->windows[0] = window->raw_window;
-  window->windows[1] = window->raw_window + size;
+  size_t i;
 
-  window->offset = 0;
-  window->sizes[0] = window->sizes[1] = 0;
-  window->window_size = size;
-  window->raw_size = 2 * size;
+  for (i = 0; i < ANCHOR_KERNEL_COUNT; i++)
+    if (anchor_kernels[i].supported ())
+      break;
 
-  return 0;
+  current_kernel = i;
 }
 
-static inline void
-sliding_window_destroy (sliding_window_t *window)
+const char *
+chop_anchor_based_chopper_kernel (void)
 {
-  chop_free (window->raw_window,
-	     (chop_class_t *) &chop_anchor_based_chopper_class);
-  window->raw_window = NULL;
-  window->windows[0] = window->windows[1] = NULL;
+  return (anchor_kernels[current_kernel].name);
 }
 
-
-/* Fingerprint computation routines.  */
-
-/* Compute the fingerprint that comes after FPR.  FPR is both an input value
-   (the previous fingerprint) and an output argument (the newly computed
-   fingerprint).  */
-static inline fpr_t
-compute_next_window_fingerprint (chop_anchor_based_chopper_t *anchor,
-				 uint8_t first_char, uint8_t last_char,
-				 register fpr_t fpr)
+chop_error_t
+chop_anchor_based_chopper_select_kernel (const char *name)
 {
-#if (defined HAVE_LIGHTNING_H) && (defined INLINE_LIGHTNING_CODE)
-  register jit_insn *movi;
-  volatile unsigned long multiplication;
-
-  if (!anchor->jit_multiply_with_prime_to_the_ws.patched)
-    {
-      register jit_insn *jmp;
-
-      jmp  = anchor->jit_multiply_with_prime_to_the_ws.final_jump;
-      jit_patch_at (jmp, &&after_mult);
-      anchor->jit_multiply_with_prime_to_the_ws.patched = 1;
-    }
-
-  /* This one has to be patched every type since MULTIPLICATION is on the
-     stack. */
-  movi = anchor->jit_multiply_with_prime_to_the_ws.operand_ptr_movi;
-  jit_patch_movi (movi, &multiplication);
-#endif
-
-  fpr *= ANCHOR_PRIME_NUMBER;
-
-#if (defined HAVE_LIGHTNING_H) && (defined INLINE_LIGHTNING_CODE)
-  /* Set the input parameter.  */
-  multiplication = anchor->prev_first_char;
-  goto *anchor->jit_multiply_with_prime_to_the_ws.func;
-
- after_mult:
-  /* At this point, MULTIPLICATION should contain the result.  */
-  fpr -= multiplication;
-#else
-  fpr -= multiply_with_prime_to_the_ws (anchor, anchor->prev_first_char);
-#endif
+  size_t i;
 
-  fpr += last_char;
-  fpr &= ANCHOR_MODULO_MASK;
+  for (i = 0; i < ANCHOR_KERNEL_COUNT; i++)
+    if (!strcmp (anchor_kernels[i].name, name))
+      {
+	if (!anchor_kernels[i].supported ())
+	  break;
 
-  anchor->prev_first_char = first_char;
-  anchor->prev_fpr = fpr;
+	current_kernel = i;
+	return 0;
+      }
 
-  return fpr;
+  return CHOP_ERR_NOT_IMPL;
 }
 
-static inline fpr_t
-compute_window_fingerprint (chop_anchor_based_chopper_t *anchor,
-			    sliding_window_t *window)
-{
-  register fpr_t fpr;
-  const uint8_t *p;
-  uint8_t first_char = '\0';
-  fpr_t prime_power = 1;
-  size_t total = anchor->window_size;
-
-#define ITERATE_OVER_SUBWINDOW(subwin, end_offset, start_offset)	\
-  do									\
-    {									\
-      for (p = subwin + end_offset - 1;					\
-	   p >= subwin + start_offset;					\
-	   p--)								\
-	{								\
-	  fpr_t this_fpr = *p;						\
-									\
-	  first_char = *p;						\
-	  fpr += this_fpr * prime_power;				\
-	  fpr &= ANCHOR_MODULO_MASK;					\
-									\
-	  prime_power *= ANCHOR_PRIME_NUMBER;				\
-	  if (--total == 0)						\
-	    break;							\
-	}								\
-    }									\
-  while (0)
-
-
-  /* Traverse WINDOW from its end offset to its start offset.  That is, first
-     traverse the second subwindow from OFFSET to zero, and then the first
-     subwindow from WINDOW_SIZE to OFFSET.  */
-  fpr = 0;
-
-  if ((sliding_window_start_offset (window) > 0) && (window->sizes[1] > 0))
-    ITERATE_OVER_SUBWINDOW (window->windows[1],
-			    sliding_window_start_offset (window), 0);
-
-  if (total > 0)
-    ITERATE_OVER_SUBWINDOW (window->windows[0], window->sizes[0],
-			    sliding_window_start_offset (window));
-
-  /* Note: At this point, if less than WINDOW_SIZE bytes were available from
-     WINDOW (WINDOW was ``unfull''), then TOTAL is greater than zero.  But
-     that's no problem.  */
-  assert ((sliding_window_unfull (window)) || (total == 0));
-
-  /* ANCHOR->PREV_FIRST_CHAR is then used in
-     COMPUTE_NEXT_WINDOW_FINGERPRINT.  */
-  anchor->prev_first_char = first_char;
-
-  return fpr;
-#undef ITERATE_OVER_SUBWINDOW
-}
 
 
-
 /* Initialization code.  */
 static chop_error_t
 ab_ctor (chop_object_t *object, const chop_class_t *class)
@@ -775,18 +600,19 @@ ab_ctor (chop_object_t *object, const chop_class_t *class)
 
   chopper->chopper.stream = NULL;
   chopper->chopper.read_block = chop_anchor_chopper_read_block;
+  chopper->chopper.read_block_view = chop_anchor_chopper_read_block_view;
+  chopper->chopper.find_boundaries = chop_anchor_chopper_find_boundaries;
   chopper->chopper.typical_block_size = 0;
   chopper->chopper.close = chop_anchor_chopper_close;
 
   chopper->window_size = 0;
-  chopper->first = 1;
-#ifndef HAVE_LIGHTNING_H
-  memset (&chopper->product_cache, 0, sizeof (chopper->product_cache));
-#else
-  JIT_MULTIPLIER_INIT (chopper->jit_multiply_with_prime_to_the_ws);
-#endif
+  chopper->min_size = chopper->max_size = 0;
+  chopper->input = NULL;
+  chopper->input_size = chopper->input_start = chopper->input_end = 0;
+  chopper->end_of_stream = 0;
+  chopper->offset = chopper->resume_offset = 0;
 
-  return 0;
+  return chop_log_init ("anchor-based-chopper", &chopper->log);
 }
 
 static void
@@ -795,232 +621,461 @@ ab_dtor (chop_object_t *object)
   chop_anchor_based_chopper_t *anchor =
     (chop_anchor_based_chopper_t *)object;
 
-  sliding_window_destroy (&anchor->sliding_window);
+  chop_free (anchor->input, (chop_class_t *) &chop_anchor_based_chopper_class);
+  anchor->input = NULL;
   chop_object_destroy ((chop_object_t *)&anchor->log);
-
-#ifdef HAVE_LIGHTNING_H
-  chop_free (JIT_MULTIPLIER_FUNC (anchor->jit_multiply_with_prime_to_the_ws),
-	     (chop_class_t *) &chop_anchor_based_chopper_class);
-#endif
 }
 
 chop_error_t
 chop_anchor_based_chopper_init (chop_stream_t *input,
 				size_t window_size,
 				unsigned long magic_fpr_mask,
+				size_t min_size, size_t max_size,
 				chop_chopper_t *uchopper)
 {
   chop_error_t err;
-  size_t i;
+  size_t i, input_size;
   chop_anchor_based_chopper_t *chopper =
     (chop_anchor_based_chopper_t *)uchopper;
 
-  chop_object_initialize ((chop_object_t *)chopper,
-			  (chop_class_t *)&chop_anchor_based_chopper_class);
+  if ((window_size == 0) || ((max_size > 0) && (max_size < min_size)))
+    return CHOP_INVALID_ARG;
+
+  err = chop_object_initialize ((chop_object_t *)chopper,
+				(chop_class_t *)&chop_anchor_based_chopper_class);
+  if (err)
+    return err;
 
   chopper->chopper.stream = input;
   chopper->chopper.typical_block_size = magic_fpr_mask + window_size;
   chopper->window_size = window_size;
   chopper->magic_fpr_mask = magic_fpr_mask;
+  chopper->min_size = min_size;
+  chopper->max_size = max_size;
 
-  err = sliding_window_init (&chopper->sliding_window, window_size);
-  if (err)
-    return err;
-
-  /* Precompute ANCHOR_PRIME_NUMBER to the WINDOW_SIZE.  */
+  /* Precompute ANCHOR_PRIME_NUMBER to the WINDOW_SIZE, and its product
+     with each possible byte value.  */
   chopper->prime_to_the_ws = 1;
   for (i = 0; i < window_size; i++)
     chopper->prime_to_the_ws *= ANCHOR_PRIME_NUMBER;
 
-#ifdef HAVE_LIGHTNING_H
-  chopper->jit_multiply_with_prime_to_the_ws =
-    compile_multiplication_function (chopper->prime_to_the_ws);
+  for (i = 0; i < 256; i++)
+    chopper->product_cache[i] = (fpr_t) i * chopper->prime_to_the_ws;
 
-  if (!JIT_MULTIPLIER_FUNC (chopper->jit_multiply_with_prime_to_the_ws))
-    return ENOMEM;
-#endif
+  /* When MAX_SIZE is specified, make sure a whole block always fits in the
+     input buffer.  */
+  if (max_size > 0)
+    input_size = 2 * max_size;
+  else
+    {
+      input_size = 2 * chopper->chopper.typical_block_size;
+      if ((input_size < chopper->chopper.typical_block_size)
+	  || (input_size > ANCHOR_MAX_INPUT_SIZE))
+	input_size = ANCHOR_MAX_INPUT_SIZE;
+    }
 
-  err = chop_log_init ("anchor-based-chopper", &chopper->log);
+  if (input_size < ANCHOR_MIN_INPUT_SIZE)
+    input_size = ANCHOR_MIN_INPUT_SIZE;
+  if (input_size <= 2 * window_size)
+    input_size = 2 * window_size;
+
+  chopper->input = chop_malloc (input_size,
+				(chop_class_t *) &chop_anchor_based_chopper_class);
+  if (!chopper->input)
+    {
+      chop_object_destroy ((chop_object_t *) chopper);
+      return ENOMEM;
+    }
+
+  chopper->input_size = input_size;
+  chopper->input_start = chopper->input_end = 0;
+  chopper->end_of_stream = 0;
+
+  return 0;
+}
+
+
+
+/* Read as much data as possible from ANCHOR's input stream, so as to fill
+   its input buffer.  */
+static chop_error_t
+fill_input (chop_anchor_based_chopper_t *anchor)
+{
+  chop_error_t err = 0;
+  chop_stream_t *stream = anchor->chopper.stream;
+
+  while (anchor->input_end < anchor->input_size)
+    {
+      size_t amount = 0;
+
+      err = chop_stream_read (stream, (char *) anchor->input + anchor->input_end,
+			      anchor->input_size - anchor->input_end, &amount);
+      anchor->input_end += amount;
+
+      if (CHOP_EXPECT_FALSE (err))
+	{
+	  if (err == CHOP_STREAM_END)
+	    {
+	      anchor->end_of_stream = 1;
+	      err = 0;
+	    }
+	  break;
+	}
+    }
+
+  chop_log_printf (&anchor->log, "refilled input buffer, %zu bytes pending",
+		   anchor->input_end - anchor->input_start);
 
   return err;
 }
 
+/* Return the size of the block that starts at DATA, given that AVAILABLE
+   bytes are available there, if its end can be determined from these
+   bytes.  Return zero otherwise.  END_OF_STREAM must be true if nothing
+   follows these bytes; in that case, set *AT_END to true if the block ends
+   because the end of the stream was reached.  */
+static inline size_t
+find_cut (const chop_anchor_based_chopper_t *anchor,
+	  const uint8_t *data, size_t available, int end_of_stream,
+	  int *at_end)
+{
+  size_t limit, next_window;
+  const size_t window_size = anchor->window_size;
+
+  *at_end = 0;
+  limit = available;
+  if ((anchor->max_size > 0) && (limit > anchor->max_size))
+    limit = anchor->max_size;
+
+  next_window = (anchor->min_size > window_size)
+    ? anchor->min_size - window_size : 0;
+
+  if (next_window + window_size <= limit)
+    {
+      size_t anchor_end;
+
+      anchor_end =
+	anchor_kernels[current_kernel].find_anchor (anchor,
+						    data + next_window,
+						    limit - next_window);
+      if (anchor_end > 0)
+	return next_window + anchor_end;
+    }
+
+  if ((anchor->max_size > 0) && (limit == anchor->max_size))
+    return limit;
+
+  if (end_of_stream)
+    {
+      *at_end = 1;
+      return available;
+    }
+
+  return 0;
+}
+
+/* Same as above for the block that starts at ANCHOR's INPUT_START.  */
+static inline size_t
+find_buffered_cut (const chop_anchor_based_chopper_t *anchor, int *at_end)
+{
+  return (find_cut (anchor, anchor->input + anchor->input_start,
+		    anchor->input_end - anchor->input_start,
+		    anchor->end_of_stream, at_end));
+}
 
-
+/* When ANCHOR's input buffer is empty, look for up to MAX_BLOCKS blocks
+   directly in the memory of its input stream, using `chop_stream_peek ()',
+   which avoids copying them.  On success, set *REGION and BLOCKS as for
+   `chop_chopper_find_boundaries ()', and set *COUNT to the number of
+   blocks found, which is zero when the input buffer must be used
+   instead.  */
 static chop_error_t
-chop_anchor_chopper_read_block (chop_chopper_t *chopper,
-				chop_buffer_t *buffer, size_t *size)
+find_peeked_cuts (chop_anchor_based_chopper_t *anchor,
+		  const char **region, chop_block_span_t *blocks,
+		  size_t max_blocks, size_t *count)
+{
+  chop_error_t err;
+  chop_stream_t *stream = anchor->chopper.stream;
+  const char *data;
+  size_t available, offset, cut;
+  int at_end;
+
+  *count = 0;
+  if ((anchor->input_start < anchor->input_end) || (anchor->end_of_stream))
+    return 0;
+
+  err = chop_stream_peek (stream, &data, &available);
+  if (err)
+    return (((err == CHOP_ERR_NOT_IMPL) || (err == CHOP_STREAM_END))
+	    ? 0 : err);
+
+  /* The end of the peeked region is not necessarily the end of the stream,
+     so only blocks whose end does not depend on the bytes that follow the
+     region are returned.  */
+  for (offset = 0; *count < max_blocks; offset += cut)
+    {
+      cut = find_cut (anchor, (const uint8_t *) data + offset,
+		      available - offset, 0, &at_end);
+      if (cut == 0)
+	break;
+
+      blocks[*count].offset = offset;
+      blocks[*count].size = cut;
+      (*count)++;
+    }
+
+  if (*count > 0)
+    {
+      chop_stream_consume (stream, offset);
+      anchor->offset += offset;
+      anchor->resume_offset = anchor->offset;
+      *region = data;
+
+      chop_log_printf (&anchor->log, "found %zu blocks in %zu peeked bytes",
+		       *count, offset);
+    }
+
+  return 0;
+}
+
+static chop_error_t
+chop_anchor_chopper_read_block_view (chop_chopper_t *chopper,
+				     chop_buffer_t *buffer,
+				     const char **block, size_t *size)
 {
   /* Algorithm:
 
-     1.  If less than WINDOW_SIZE bytes are available starting from the
-         current offset of the sliding window, read in WINDOW_SIZE bytes
+     1.  Skip the first MIN_SIZE bytes of the block, or rather the first
+         MIN_SIZE - WINDOW_SIZE bytes, since the window that ends at
+         MIN_SIZE is the first one that may yield an anchor.
 
      2.  Compute the fingerprint of each WINDOW_SIZE-long sliding window,
          i.e. fingerprint of [0..29], then [1..30], ..., [30..59].
 
      3.  Whenever such a fingerprint is considered "magic", then make it an
          anchor and return all the data read till then, including the
-         WINDOW_SIZE bytes which yielded the magic value.  Goto 1.  */
+         WINDOW_SIZE bytes which yielded the magic value.
 
+     4.  If no anchor was found in the first MAX_SIZE bytes, return those
+         MAX_SIZE bytes.
 
-/* Return true if FPR should be chosen as an anchor point.  */
-#define IS_ANCHOR_FINGERPRINT(_fpr)   (((_fpr) & magic_fpr_mask) == 0)
+     The input buffer is refilled as needed.  When there is no maximum
+     block size and the input buffer is full, the beginning of the current
+     block is flushed to BUFFER.  Otherwise, the block is returned as a
+     pointer into the input buffer, without any copy.  When the input
+     buffer is empty and the input stream supports it, the block is looked
+     for directly in the stream's memory instead.  */
 
   chop_error_t err;
-  sliding_window_t *window;
-  int first = 1;
-  uint8_t *window_dest;
-  size_t start_offset, *window_dest_size;
-  register fpr_t window_fpr = 0;
-  register fpr_t magic_fpr_mask;
+  size_t block_flushed = 0, next_window, cut, count;
+  int at_end = 0;
+  chop_block_span_t span;
   chop_anchor_based_chopper_t *anchor =
     (chop_anchor_based_chopper_t *)chopper;
+  const size_t window_size = anchor->window_size;
+  const size_t max_size = anchor->max_size;
 
   *size = 0;
   chop_buffer_clear (buffer);
-  window = &anchor->sliding_window;
-
-  magic_fpr_mask = anchor->magic_fpr_mask;
-  start_offset = window->offset;
 
-  anchor->first = 0;
-  while (1)
+  err = find_peeked_cuts (anchor, block, &span, 1, &count);
+  if (err)
+    return err;
+  if (count > 0)
     {
-      if (CHOP_EXPECT_FALSE (sliding_window_unfull (window)))
-	{
-	  /* There are less that WINDOW_SIZE bytes left in WINDOW so we need
-	     to get some more.  */
-	  size_t discarded;
+      *size = span.size;
+      return 0;
+    }
 
-	  window_dest = sliding_window_dest_buffer (window, &window_dest_size,
-						    &discarded);
-	  if (discarded)
-	    {
-	      /* Flush the data we're about to discard.  */
-	      assert (discarded >= start_offset);
-	      chop_log_printf (&anchor->log, "appending %zu bytes to block",
-			       discarded - start_offset);
-	      err = chop_buffer_append (buffer,
-					(char *) window_dest + start_offset,
-					discarded - start_offset);
-	      if (err)
-		return err;
+  /* Block offset of the first window to be fingerprinted.  */
+  next_window = (anchor->min_size > window_size)
+    ? anchor->min_size - window_size : 0;
 
-	      start_offset = 0;
-	    }
+  while (1)
+    {
+      size_t available, limit;
 
-	  *window_dest_size = 0;
-	  err = read_sliding_window (anchor, window_dest,
-				     window_dest_size);
-	  chop_log_printf (&anchor->log, "reloaded sliding window, "
-			   "got %zu bytes", *window_dest_size);
+      /* Bytes of the current block available from the input buffer, and
+	 the maximum number of them that may be part of this block.  */
+      available = anchor->input_end - anchor->input_start;
+      limit = available;
+      if ((max_size > 0) && (block_flushed + limit > max_size))
+	limit = max_size - block_flushed;
 
-	  if (CHOP_EXPECT_FALSE (err))
+      if (next_window + window_size <= block_flushed + limit)
+	{
+	  size_t anchor_end;
+	  const uint8_t *start;
+
+	  start = anchor->input + anchor->input_start
+	    + (next_window - block_flushed);
+	  anchor_end =
+	    anchor_kernels[current_kernel].find_anchor (anchor, start,
+							block_flushed + limit
+							- next_window);
+	  if (anchor_end > 0)
 	    {
-	      if (err == CHOP_STREAM_END)
-		/* That's it: stop computing fingerprints.  */
-		break;
-	      else
-		return err;
+	      cut = next_window + anchor_end;
+	      chop_log_printf (&anchor->log, "found an anchor (block size: %zu)",
+			       cut);
+	      break;
 	    }
 
-	  if (sliding_window_unfull (window))
-	    /* Looks like we're about to read the end of stream.  */
-	    continue;
+	  /* Resume right after the last window fingerprinted.  */
+	  next_window = block_flushed + limit - window_size + 1;
 	}
 
-      /* Compute a fingerprint of the current WINDOW_SIZE bytes.  */
-      if (first)
+      if ((max_size > 0) && (block_flushed + limit == max_size))
 	{
-	  /* For the first window, we must compute the fingerprint from
-	     scratch.  */
-	  window_fpr = compute_window_fingerprint (anchor, window);
-	  first = 0;
+	  cut = max_size;
+	  chop_log_printf (&anchor->log, "no anchor found, cutting at %zu bytes",
+			   cut);
+	  break;
 	}
-      else
-	{
-	  /* For subsequent windows, the fingerprint can be computed
-	     efficiently based on the previous fingerprint.  */
-	  register uint8_t first_char, last_char;
-
-	  first_char = sliding_window_first_char (window);
-	  last_char = sliding_window_last_char (window);
-
-	  window_fpr = compute_next_window_fingerprint (anchor,
-							first_char, last_char,
-							window_fpr);
-#ifdef AUTO_TEST /* debugging */
-	  {
-	    fpr_t ref_fpr;
 
-	    ref_fpr = compute_window_fingerprint (anchor, window);
-	    assert (ref_fpr == window_fpr);
-	  }
-#endif
+      if (anchor->end_of_stream)
+	{
+	  /* We've reached the end of the input stream.  */
+	  cut = block_flushed + available;
+	  at_end = 1;
+	  chop_log_printf (&anchor->log,
+			   "end of stream, flushing %zu bytes left", available);
+	  break;
 	}
 
-      chop_log_printf (&anchor->log, "fingerprint: 0x%x", window_fpr);
-      if (IS_ANCHOR_FINGERPRINT (window_fpr))
+      if (anchor->input_end == anchor->input_size)
 	{
-	  /* This looks like an anchor.  If we've reached the end of stream,
-	     we need to flush the remaining bytes.  */
-	  size_t amount;
+	  /* Make room in the input buffer.  */
+	  if (anchor->input_start == 0)
+	    {
+	      /* The input buffer only contains the current block, which
+		 means that there is no maximum block size.  Flush the
+		 bytes that won't be fingerprinted anymore.  */
+	      size_t amount = next_window - block_flushed;
 
-	  /* Push all the bytes up to the anchor itself into the user's
-	     buffer (we consider the anchor to be the location of the end of
-	     the current sliding window).  */
-	  assert (sliding_window_end_offset (window) >= start_offset);
-	  amount = sliding_window_end_offset (window) - start_offset;
+	      if (amount > available)
+		amount = available;
 
-	  if (amount)
-	    {
-	      err = sliding_window_append_to_buffer (window, start_offset,
-						     amount, buffer);
+	      assert (max_size == 0);
+	      assert (amount > 0);
+
+	      chop_log_printf (&anchor->log, "appending %zu bytes to block",
+			       amount);
+	      err = chop_buffer_append (buffer, (char *) anchor->input, amount);
 	      if (err)
 		return err;
 
-	      /* Fingerprinting will resume after the current WINDOW_SIZE
-		 bytes on the next call.  */
-	      sliding_window_skip (window, window->window_size);
-
-	      chop_log_printf (&anchor->log,
-			       "found an anchor (fpr: 0x%x, block size: %zu)",
-			       window_fpr, chop_buffer_size (buffer));
-
-	      break;
+	      block_flushed += amount;
+	      anchor->input_start += amount;
 	    }
+
+	  memmove (anchor->input, anchor->input + anchor->input_start,
+		   anchor->input_end - anchor->input_start);
+	  anchor->input_end -= anchor->input_start;
+	  anchor->input_start = 0;
 	}
 
-      /* Shift the sliding window by one byte.  */
-      sliding_window_increment_offset (window);
+      err = fill_input (anchor);
+      if (CHOP_EXPECT_FALSE (err))
+	return err;
     }
 
-  if (CHOP_EXPECT_FALSE (err == CHOP_STREAM_END))
+  /* The block contains all the bytes up to the anchor itself (we consider
+     the anchor to be the location of the end of the sliding window).  */
+  assert (cut >= block_flushed);
+  if (block_flushed == 0)
+    *block = (char *) anchor->input + anchor->input_start;
+  else
     {
-      /* We've reached the end of the input stream.  */
-      size_t amount;
+      /* Push the rest of the block into BUFFER.  */
+      err = chop_buffer_append (buffer,
+				(char *) anchor->input + anchor->input_start,
+				cut - block_flushed);
+      if (err)
+	return err;
 
-      /* Flush the remaining bytes.  */
-      amount = sliding_window_end_offset (window) - start_offset;
-      chop_log_printf (&anchor->log, "end of stream, flushing %zu bytes left",
-		       amount);
+      *block = chop_buffer_content (buffer);
+    }
 
-      err = sliding_window_append_to_buffer (window, start_offset,
-					     amount, buffer);
+  anchor->input_start += cut - block_flushed;
+  anchor->offset += cut;
+  if (!at_end)
+    anchor->resume_offset = anchor->offset;
 
-      /* Clear WINDOW's contents.  */
-      sliding_window_clear (window);
+  *size = cut;
 
-      if ((!err) && (chop_buffer_size (buffer) == 0))
-	err = CHOP_STREAM_END;
-    }
+  return ((*size == 0) ? CHOP_STREAM_END : 0);
+}
 
+static chop_error_t
+chop_anchor_chopper_read_block (chop_chopper_t *chopper,
+				chop_buffer_t *buffer, size_t *size)
+{
+  chop_error_t err;
+  const char *block;
+
+  err = chop_anchor_chopper_read_block_view (chopper, buffer, &block, size);
+  if ((!err) && (block != chop_buffer_content (buffer)))
+    err = chop_buffer_push (buffer, block, *size);
 
-  *size = chop_buffer_size (buffer);
   return err;
 }
 
+static chop_error_t
+chop_anchor_chopper_find_boundaries (chop_chopper_t *chopper,
+				     chop_buffer_t *buffer,
+				     const char **region,
+				     chop_block_span_t *blocks,
+				     size_t max_blocks, size_t *count)
+{
+  chop_error_t err;
+  size_t offset, cut;
+  int at_end;
+  chop_anchor_based_chopper_t *anchor =
+    (chop_anchor_based_chopper_t *)chopper;
+
+  err = find_peeked_cuts (anchor, region, blocks, max_blocks, count);
+  if ((err) || (*count > 0))
+    return err;
+
+  /* Read the first block the usual way, refilling the input buffer as
+     needed.  */
+  err = chop_anchor_chopper_read_block_view (chopper, buffer, region,
+					     &blocks[0].size);
+  if (err)
+    return err;
+
+  blocks[0].offset = 0;
+  *count = 1;
+
+  if (*region == chop_buffer_content (buffer))
+    /* This block did not fit in the input buffer.  */
+    return 0;
+
+  /* Then return the blocks that follow it in the input buffer, without
+     moving it.  */
+  for (offset = blocks[0].size; *count < max_blocks; offset += cut)
+    {
+      cut = find_buffered_cut (anchor, &at_end);
+      if (cut == 0)
+	break;
+
+      blocks[*count].offset = offset;
+      blocks[*count].size = cut;
+      (*count)++;
+
+      anchor->input_start += cut;
+      anchor->offset += cut;
+      if (!at_end)
+	anchor->resume_offset = anchor->offset;
+    }
+
+  chop_log_printf (&anchor->log, "found %zu blocks in %zu bytes",
+		   *count, offset);
+
+  return 0;
+}
+
 static void
 chop_anchor_chopper_close (chop_chopper_t *chopper)
 {
@@ -1028,6 +1083,185 @@ chop_anchor_chopper_close (chop_chopper_t *chopper)
 }
 
 
+/* Checkpoints.  */
+
+/* Number of 64-bit fields in the binary serialization of an anchor-based
+   chopper: window size, magic fingerprint mask, minimum and maximum block
+   sizes, and resume offset.  */
+#define ANCHOR_SERIAL_FIELDS  5
+
+static chop_error_t
+ab_serialize (const chop_object_t *object, chop_serial_method_t method,
+	      chop_buffer_t *buffer)
+{
+  chop_error_t err;
+  const chop_anchor_based_chopper_t *anchor =
+    (const chop_anchor_based_chopper_t *) object;
+  const uint64_t fields[ANCHOR_SERIAL_FIELDS] =
+    {
+      anchor->window_size, anchor->magic_fpr_mask,
+      anchor->min_size, anchor->max_size,
+      anchor->resume_offset
+    };
+
+  switch (method)
+    {
+    case CHOP_SERIAL_ASCII:
+      {
+	char buf[5 * 17 + 1];
+
+	snprintf (buf, sizeof (buf), "%llx/%llx/%llx/%llx/%llx",
+		  (unsigned long long) fields[0],
+		  (unsigned long long) fields[1],
+		  (unsigned long long) fields[2],
+		  (unsigned long long) fields[3],
+		  (unsigned long long) fields[4]);
+	err = chop_buffer_push (buffer, buf, strlen (buf) + 1);
+	break;
+      }
+
+    case CHOP_SERIAL_BINARY:
+      {
+	unsigned char buf[ANCHOR_SERIAL_FIELDS * 8];
+	size_t field, byte;
+
+	/* Fields are stored in little-endian order.  */
+	for (field = 0; field < ANCHOR_SERIAL_FIELDS; field++)
+	  for (byte = 0; byte < 8; byte++)
+	    buf[field * 8 + byte] = (fields[field] >> (byte * 8)) & 0xff;
+
+	err = chop_buffer_push (buffer, (char *) buf, sizeof (buf));
+	break;
+      }
+
+    default:
+      err = CHOP_ERR_NOT_IMPL;
+    }
+
+  return err;
+}
+
+static chop_error_t
+ab_deserialize (const char *buffer, size_t size,
+		chop_serial_method_t method,
+		chop_object_t *object, size_t *bytes_read)
+{
+  chop_error_t err;
+  chop_anchor_based_chopper_t *anchor =
+    (chop_anchor_based_chopper_t *) object;
+  uint64_t fields[ANCHOR_SERIAL_FIELDS];
+  size_t field;
+
+  *bytes_read = 0;
+
+  switch (method)
+    {
+    case CHOP_SERIAL_ASCII:
+      {
+	char input[5 * 17 + 1];
+	const char *start;
+	char *end;
+
+	/* Copy BUFFER locally and add a trailing zero to make sure we
+	   don't read past the end.  */
+	if (size > sizeof (input) - 1)
+	  size = sizeof (input) - 1;
+	memcpy (input, buffer, size);
+	input[size] = '\0';
+
+	for (field = 0, end = input; field < ANCHOR_SERIAL_FIELDS; field++)
+	  {
+	    if (field > 0)
+	      {
+		if (*end != '/')
+		  return CHOP_DESERIAL_CORRUPT_INPUT;
+		end++;
+	      }
+
+	    start = end;
+	    fields[field] = strtoull (start, &end, 16);
+	    if (end == start)
+	      return CHOP_DESERIAL_CORRUPT_INPUT;
+	  }
+
+	*bytes_read = end - input;
+	break;
+      }
+
+    case CHOP_SERIAL_BINARY:
+      {
+	const unsigned char *input = (const unsigned char *) buffer;
+	size_t byte;
+
+	if (size < ANCHOR_SERIAL_FIELDS * 8)
+	  return CHOP_DESERIAL_TOO_SHORT;
+
+	for (field = 0; field < ANCHOR_SERIAL_FIELDS; field++)
+	  for (byte = 8, fields[field] = 0; byte > 0; byte--)
+	    {
+	      fields[field] <<= 8;
+	      fields[field] |= input[field * 8 + byte - 1];
+	    }
+
+	*bytes_read = ANCHOR_SERIAL_FIELDS * 8;
+	break;
+      }
+
+    default:
+      return CHOP_ERR_NOT_IMPL;
+    }
+
+  if ((fields[0] > SIZE_MAX) || (fields[1] > ULONG_MAX)
+      || (fields[2] > SIZE_MAX) || (fields[3] > SIZE_MAX))
+    return CHOP_DESERIAL_CORRUPT_INPUT;
+
+  /* The resulting chopper has no input stream; it must be passed one with
+     `chop_anchor_based_chopper_resume ()'.  */
+  err = chop_anchor_based_chopper_init (NULL, fields[0], fields[1],
+					fields[2], fields[3],
+					(chop_chopper_t *) anchor);
+  if (err)
+    return err;
+
+  anchor->offset = anchor->resume_offset = fields[4];
+
+  return 0;
+}
+
+uint64_t
+chop_anchor_based_chopper_resume_offset (const chop_chopper_t *chopper)
+{
+  const chop_anchor_based_chopper_t *anchor =
+    (const chop_anchor_based_chopper_t *)chopper;
+
+  return anchor->resume_offset;
+}
+
+chop_error_t
+chop_anchor_based_chopper_resume (chop_chopper_t *chopper,
+				  chop_stream_t *input)
+{
+  chop_anchor_based_chopper_t *anchor =
+    (chop_anchor_based_chopper_t *)chopper;
+
+  if (!chop_object_is_a ((chop_object_t *)chopper,
+			 (chop_class_t *)&chop_anchor_based_chopper_class))
+    return CHOP_INVALID_ARG;
+
+  chop_log_printf (&anchor->log, "resuming at offset %llu",
+		   (unsigned long long) anchor->resume_offset);
+
+  /* Discard pending input, including blocks that were returned after the
+     resume offset.  */
+  anchor->chopper.stream = input;
+  anchor->input_start = anchor->input_end = 0;
+  anchor->end_of_stream = 0;
+  anchor->offset = anchor->resume_offset;
+
+  return 0;
+}
+
+
 chop_log_t *
 chop_anchor_based_chopper_log (chop_chopper_t *chopper)
 {
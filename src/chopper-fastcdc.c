@@ -0,0 +1,505 @@
+/* libchop -- a utility library for distributed storage and data backup
+   Copyright (C) 2026  Ludovic Courtès <ludo@gnu.org>
+
+   Libchop is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Libchop is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with libchop.  If not, see <http://www.gnu.org/licenses/>.  */
+
+/* This file implements the FastCDC content-defined chunking algorithm
+   described in [1].  Like the anchor-based chopper, it deterministically
+   finds block boundaries as a function of the input data, but it does so
+   using a "gear" rolling hash, which costs one shift, one table lookup and
+   one addition per input byte.  In addition, it implements "normalized
+   chunking": a harder-to-match mask is used before the average block size
+   is reached and an easier-to-match mask after that, which narrows the
+   block size distribution around the average.  Bytes before the minimum
+   block size are skipped altogether.
+
+   [1] Wen Xia et al.  FastCDC: a Fast and Efficient Content-Defined
+       Chunking Approach for Data Deduplication.  In Proceedings of the
+       2016 USENIX Annual Technical Conference, pages 101--114.  */
+
+#include <chop/chop-config.h>
+
+#include <chop/chop.h>
+#include <chop/choppers.h>
+
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+
+
+/* The gear table: 256 random 64-bit integers.  These values are part of the
+   on-disk format, in the sense that changing them changes the block
+   boundaries, and thus defeats single-instance storage.  Don't touch them.  */
+static const uint64_t gear_table[256] =
+  {
+    0xd616336ecf6f28cfULL, 0xf785692b896baae6ULL, 0x8640f64807f44d29ULL,
+    0x8b6c2a33f7b34464ULL, 0x4c09f9cc8aaf8ce5ULL, 0xe31de304ae171db1ULL,
+    0x2712dfaec767c5a0ULL, 0xe98cea75ad01913eULL, 0x73f19bae5ea60ec3ULL,
+    0x6aee9168768dcc6cULL, 0x12c2cd7ca3a84f8bULL, 0xcc8f5bd42a73068fULL,
+    0xf5ce1daeee68b791ULL, 0x39d1cbe515aa991cULL, 0xb97a8d0d4123c1deULL,
+    0x430cbea5f1437136ULL, 0x180fe04a0ecf13bcULL, 0xe4704804fe977099ULL,
+    0xaa8beacd4f8bff9eULL, 0xa28b2852feaa5c27ULL, 0xba28177e421c370eULL,
+    0x45610176c7c50c24ULL, 0x828d7bca29975afeULL, 0x218e3c7a78b98196ULL,
+    0x246046cc52ac1ae9ULL, 0xab1da9765ef1d9fbULL, 0x2e042e640ed0d1a6ULL,
+    0xf374e20022f27d63ULL, 0x1da4231772e441fbULL, 0x18a42ee25cbb0a34ULL,
+    0xf067fb722d701295ULL, 0x511a3d2d73b7594cULL, 0xa5ddf1b9362a4187ULL,
+    0x2905dd3a018b686fULL, 0x4c815e4868a1c7aaULL, 0xb7573ea0c47ae575ULL,
+    0x1dee8bdd346bd19dULL, 0xfa68ba4bb94848b9ULL, 0x00bc61f39c015c67ULL,
+    0x0fa8dbb2e1a5ad63ULL, 0xe3eb7dbcf221e9aaULL, 0x0d21f737cce7b0e5ULL,
+    0x0b4572bc43518e7bULL, 0x72b05a91aee88a86ULL, 0xa560c2a9e4f62fd5ULL,
+    0x9b61826e7a79254bULL, 0x47edb3a71e27fd8aULL, 0x36ec0468dc186e24ULL,
+    0xed72a016f47c592aULL, 0xf907597e06642679ULL, 0x3d3626207df33ff4ULL,
+    0x6a8c147412e11d2dULL, 0x8120891d4d364e1dULL, 0xa72679015c606692ULL,
+    0x35ab0a2efda0ff07ULL, 0x12a9095a6d0302b9ULL, 0x0a662c84282d0e06ULL,
+    0x0d29180bc07d679dULL, 0xf3c25b67aa702a46ULL, 0x3ba3c63e78e460cbULL,
+    0xe55a7a99504c6330ULL, 0x869fc95b59abee50ULL, 0x217f08602e719b4bULL,
+    0xe8983b364a298eddULL, 0x559d502c0d00761cULL, 0xdd5e20f0fa6a4342ULL,
+    0x5d14ea20677e34acULL, 0x8c3ac9d788f80164ULL, 0x8f21c5feb8b70934ULL,
+    0x6ef40ab5621db8b0ULL, 0x4de1b3d67f94b820ULL, 0xdfd09d6814247a11ULL,
+    0xbfdff4cfab55b6dcULL, 0x13b0a3641be9f291ULL, 0xc744b80766a28768ULL,
+    0xb6ac4fa8c21acdd9ULL, 0x9ab5030b40cabe4cULL, 0xfcdfe46128c1b359ULL,
+    0xe5f6f711793f9d28ULL, 0x1baf30fef4d16322ULL, 0xa803d6301339c4deULL,
+    0xa592961b5af8c232ULL, 0xbdafb84ab857141cULL, 0x521c1d5e1b2fb90bULL,
+    0xde9f7d6cf50e1008ULL, 0x27d66321e62b3d18ULL, 0x75c055629006bce9ULL,
+    0xbd0d210a67f188f1ULL, 0xb41ab1ae0d41a9e4ULL, 0xa69185fc0c9b7072ULL,
+    0xda5b79af5ce60ee7ULL, 0x6d23eb2243f64d0eULL, 0xfda42bdf3cb4ca75ULL,
+    0x0e382326251afcb2ULL, 0x226dd13d4336da16ULL, 0xca8b010d474b7804ULL,
+    0x3f0ce9661a22f0e0ULL, 0x82accae145a3c40cULL, 0x1ff148e14ddb3c80ULL,
+    0xfee40603493a7dbfULL, 0x6ade4178fa3855aeULL, 0x539de4e8c4e3327dULL,
+    0x777220d0e45c770fULL, 0xd4aa028872b03b42ULL, 0x022dcef64c8f49f1ULL,
+    0xf9f98f8257823a06ULL, 0x8bbf76127c2515d6ULL, 0x979fa6cb6db10e15ULL,
+    0x0086c190c6e36013ULL, 0xb48ba960d6522d0bULL, 0xf22200cc1114c159ULL,
+    0xffb892e52615dc92ULL, 0xa266faaadd0fc34bULL, 0x1723e8545a4d1731ULL,
+    0xa04326a1da8a3529ULL, 0x32d036a5c09bb40bULL, 0xab970443f72870b0ULL,
+    0xaf2043cc8e664226ULL, 0xad48c4523b067e17ULL, 0x21e5cc55ae2c1385ULL,
+    0xec1642c37b7c473aULL, 0xcefbd4a0caf7ae58ULL, 0x68bd9fa3ff489756ULL,
+    0x8fa7d6a43a05af30ULL, 0x173f57b39a93c487ULL, 0xd2ba4c02b7d3bd79ULL,
+    0xf01db02837387827ULL, 0x1a9d9ae50dbf78b4ULL, 0x9ac211c63748f964ULL,
+    0xa172a24a39468918ULL, 0x213a677629dfeae7ULL, 0x19d4b0106c74e114ULL,
+    0x4fd8618f5ca763d0ULL, 0xeb5dac5a4e386b2aULL, 0x5a570f85b9c66543ULL,
+    0xb52e62a7c6c927a1ULL, 0xec17003fc0465a23ULL, 0x0382ae07591e2ee2ULL,
+    0x490a6edc99ee0686ULL, 0x51fa8d781c2980c1ULL, 0xb8fe919ff6abfaefULL,
+    0x170e40e679371e5cULL, 0xee0b66c5289a40b8ULL, 0x712a365f2e3b7e68ULL,
+    0x9e03b9f038de1aebULL, 0x922eecb2d6e0834bULL, 0x795c7ba32e8ef3f1ULL,
+    0xd441abf1658b3d56ULL, 0xcb211d87ff5ca7cdULL, 0x9d6f5ae00784bc69ULL,
+    0x0459ad7be30c4600ULL, 0x66905687fa245b06ULL, 0x5dcb5c42d026592bULL,
+    0x2aeb616f25815d16ULL, 0x698d9b753461ff15ULL, 0x8e398281e216dd60ULL,
+    0x7f4d2b9c9f0c9d6eULL, 0x634cb209068fbc10ULL, 0x1b20ab931681cef2ULL,
+    0xe256e723a64cdb68ULL, 0xfed00b2a8548e08cULL, 0x41b36ae5e3b17c11ULL,
+    0xf0655d7aae230defULL, 0xdc9ddc0fd569e3a8ULL, 0x4b934af2b00e544fULL,
+    0xb3aff9626013a79dULL, 0xe344b1215b170b83ULL, 0x5e804d05a409568cULL,
+    0xb28d888f21ab85d7ULL, 0x3006d401ae8657e0ULL, 0x732f87e2a27a0181ULL,
+    0x48dbab400ec60713ULL, 0xde2ac7ded3b1f89dULL, 0xad51119a77c199f2ULL,
+    0xa0a083e710d1a34bULL, 0x4c775ae0a1dc7596ULL, 0x0c1384c2935b9c1dULL,
+    0x13ef202f00518ccdULL, 0x3f72b45b4b944903ULL, 0x809e41c5eb237d95ULL,
+    0xac786bef790fe446ULL, 0x252ed41fb55f396aULL, 0xe38784604d49f32eULL,
+    0xdd98abbae774ca27ULL, 0xebc50fe395641f94ULL, 0xba8452f96ce797f1ULL,
+    0xc24df67292122b58ULL, 0x4375cc2791d49794ULL, 0x2f5d97300aa79306ULL,
+    0xbb33bbcaa0de5f74ULL, 0x464e065e951568b9ULL, 0x4c914fcef5a24860ULL,
+    0x83a23741aee3d93cULL, 0xfe9be8b6f2071e01ULL, 0x382a2eb9b0d58569ULL,
+    0x48f8c7de7be3fa17ULL, 0x574969251309cc77ULL, 0x56d289588b92c9d6ULL,
+    0xe9ab6fed88a9b0ebULL, 0xfe6472b307127713ULL, 0x137b9857736e216fULL,
+    0xcdbd0340951ccfa0ULL, 0x65db25977cb9267fULL, 0xb2654a2c7d689928ULL,
+    0xd4b1f235cee57535ULL, 0x202307469fe0d903ULL, 0x114fb21c22846607ULL,
+    0xe5ac417f988e7d97ULL, 0x3481b6bfc2963948ULL, 0x18b74cb8ba851b76ULL,
+    0xeea6b1afcce1d4fcULL, 0xcc1ccef55b4d42dbULL, 0xc4e8339b4a173e7eULL,
+    0x77cd48255a047268ULL, 0x3ccade9666ba26edULL, 0x8b7fe6cee8e4bca7ULL,
+    0xdda91e429d968ee6ULL, 0x4d5b8aa5f3071e7cULL, 0x4ae6378d2e00ef20ULL,
+    0x63a9ae46fd05f670ULL, 0x25a6247658e101d6ULL, 0x4ec6641fbc42134fULL,
+    0x51cdd7788fb73a35ULL, 0x7c98a7b643118fb3ULL, 0x7009885a8efdced4ULL,
+    0x0e2dbfc6eef5f32aULL, 0x1fb3bbda5c99b52eULL, 0xaa1e678827b654e2ULL,
+    0x19a03769f7513eb8ULL, 0x80644ee1873b4bf2ULL, 0xde32477791fce118ULL,
+    0xe085b72cb9fa5070ULL, 0x8592844173a83545ULL, 0x19db920487c6b68bULL,
+    0xefda4f7994c28f58ULL, 0x33d0f5d1dd608f02ULL, 0x47a5fa52b62aca7fULL,
+    0x91c2c3c7e3d5520cULL, 0xf5b70f62be069f14ULL, 0x5f5590853c497c8fULL,
+    0x614d948b2560b302ULL, 0x46e517a8c1796d67ULL, 0x9cb79e65bc3ab781ULL,
+    0xf6547ec2635897c6ULL, 0x1c484fc09e9cd43aULL, 0xbfddbb5a0d7c212fULL,
+    0x81bc32cbd8887eaaULL, 0x8d2870358df61329ULL, 0x68053a4fbcd1ff20ULL,
+    0x3a34969de8e743aeULL, 0xc20704c4175d0921ULL, 0xa00cd357f48ecd87ULL,
+    0x751e36cc98c96ffeULL, 0x49f97f26194ed3e3ULL, 0xb35a41099ecd6139ULL,
+    0x8350d65fcb3f15dbULL
+  };
+
+
+/* Declare `chop_fastcdc_chopper_t' which inherits from `chop_chopper_t'.  */
+CHOP_DECLARE_RT_CLASS_WITH_METACLASS (fastcdc_chopper, chopper,
+				      chopper_class,
+
+		       /* Block size parameters */
+		       size_t min_size;
+		       size_t average_size;
+		       size_t max_size;
+
+		       /* The "small" mask, used before AVERAGE_SIZE is
+			  reached, has more bits set than the "large" mask,
+			  used after that.  */
+		       uint64_t mask_small;
+		       uint64_t mask_large;
+
+		       /* Input buffer: bytes [START, END) of INPUT have been
+			  read from the stream but not returned yet.  */
+		       char  *input;
+		       size_t input_size;
+		       size_t start;
+		       size_t end;
+		       int    end_of_stream;
+
+		       /* Message logging */
+		       chop_log_t log;);
+
+/* A generic `open' method that chooses default values.  */
+static chop_error_t
+fcdc_generic_open (chop_stream_t *input, size_t average_size,
+		   chop_chopper_t *chopper)
+{
+  size_t power_of_two = 1;
+
+  if (average_size == 0)
+    power_of_two = 8192;
+  else
+    {
+      while ((power_of_two << 1) <= average_size)
+	power_of_two <<= 1;
+
+      if (power_of_two < 64)
+	power_of_two = 64;
+    }
+
+  return (chop_fastcdc_chopper_init (input,
+				     power_of_two / 4 /* min. size */,
+				     power_of_two,
+				     power_of_two * 8 /* max. size */,
+				     chopper));
+}
+
+static chop_error_t fcdc_ctor (chop_object_t *, const chop_class_t *);
+static void fcdc_dtor (chop_object_t *);
+
+CHOP_DEFINE_RT_CLASS_WITH_METACLASS (fastcdc_chopper, chopper,
+				     chopper_class,  /* Metaclass */
+
+				     /* Metaclass inits */
+				     .generic_open = fcdc_generic_open,
+
+				     fcdc_ctor, fcdc_dtor,
+				     NULL, NULL, /* No copy, equalp */
+				     NULL, NULL  /* No serial/deserial */);
+
+
+
+static chop_error_t
+chop_fastcdc_chopper_read_block (chop_chopper_t *, chop_buffer_t *,
+				 size_t *);
+
+static chop_error_t
+chop_fastcdc_chopper_read_block_view (chop_chopper_t *, chop_buffer_t *,
+				      const char **, size_t *);
+
+static void
+chop_fastcdc_chopper_close (chop_chopper_t *);
+
+
+static chop_error_t
+fcdc_ctor (chop_object_t *object, const chop_class_t *class)
+{
+  chop_fastcdc_chopper_t *fastcdc = (chop_fastcdc_chopper_t *) object;
+
+  fastcdc->chopper.stream = NULL;
+  fastcdc->chopper.read_block = chop_fastcdc_chopper_read_block;
+  fastcdc->chopper.read_block_view = chop_fastcdc_chopper_read_block_view;
+  fastcdc->chopper.typical_block_size = 0;
+  fastcdc->chopper.close = chop_fastcdc_chopper_close;
+
+  fastcdc->min_size = fastcdc->average_size = fastcdc->max_size = 0;
+  fastcdc->mask_small = fastcdc->mask_large = 0;
+  fastcdc->input = NULL;
+  fastcdc->input_size = fastcdc->start = fastcdc->end = 0;
+  fastcdc->end_of_stream = 0;
+
+  return chop_log_init ("fastcdc-chopper", &fastcdc->log);
+}
+
+static void
+fcdc_dtor (chop_object_t *object)
+{
+  chop_fastcdc_chopper_t *fastcdc = (chop_fastcdc_chopper_t *) object;
+
+  chop_free (fastcdc->input, (chop_class_t *) &chop_fastcdc_chopper_class);
+  fastcdc->input = NULL;
+  fastcdc->input_size = fastcdc->start = fastcdc->end = 0;
+
+  chop_object_destroy ((chop_object_t *) &fastcdc->log);
+}
+
+static void
+chop_fastcdc_chopper_close (chop_chopper_t *chopper)
+{
+  chop_fastcdc_chopper_t *fastcdc = (chop_fastcdc_chopper_t *) chopper;
+
+  chop_free (fastcdc->input, (chop_class_t *) &chop_fastcdc_chopper_class);
+  fastcdc->input = NULL;
+  fastcdc->input_size = fastcdc->start = fastcdc->end = 0;
+}
+
+
+/* Return a mask with BITS bits set, spread over the 48 most significant bits
+   of a 64-bit word.  Since the gear hash is shifted left by one bit for each
+   input byte, bit N of the hash depends on the last N + 1 bytes; using
+   high-order bits makes sure each boundary depends on a reasonably large
+   window of input bytes.  */
+static uint64_t
+spread_mask (unsigned bits)
+{
+  uint64_t mask = 0;
+  unsigned i;
+
+  assert (bits > 0 && bits <= 48);
+
+  for (i = 0; i < bits; i++)
+    mask |= ((uint64_t) 1) << (63 - (i * 48) / bits);
+
+  return mask;
+}
+
+chop_error_t
+chop_fastcdc_chopper_init (chop_stream_t *input,
+			   size_t min_size, size_t average_size,
+			   size_t max_size,
+			   chop_chopper_t *chopper)
+{
+  chop_error_t err;
+  unsigned bits;
+  chop_fastcdc_chopper_t *fastcdc = (chop_fastcdc_chopper_t *) chopper;
+
+  if ((average_size == 0) || (min_size > average_size)
+      || (average_size > max_size))
+    return CHOP_INVALID_ARG;
+
+  /* BITS is the base-2 logarithm of AVERAGE_SIZE, rounded down.  */
+  for (bits = 0; (((size_t) 2) << bits) <= average_size; bits++);
+
+  if ((bits < 3) || (bits > 40))
+    return CHOP_OUT_OF_RANGE_ARG;
+
+  err = chop_object_initialize ((chop_object_t *) chopper,
+				(chop_class_t *) &chop_fastcdc_chopper_class);
+  if (err)
+    return err;
+
+  fastcdc->chopper.stream = input;
+  fastcdc->chopper.typical_block_size = average_size;
+
+  fastcdc->min_size = min_size;
+  fastcdc->average_size = average_size;
+  fastcdc->max_size = max_size;
+
+  /* "Normalization level 2", as recommended by the paper.  */
+  fastcdc->mask_small = spread_mask (bits + 2);
+  fastcdc->mask_large = spread_mask (bits - 2);
+
+  /* Keep room for two maximum-size blocks so that refills are amortized.  */
+  fastcdc->input_size = 2 * max_size;
+  if (fastcdc->input_size < chop_stream_preferred_block_size (input))
+    fastcdc->input_size = chop_stream_preferred_block_size (input);
+
+  fastcdc->input = chop_malloc (fastcdc->input_size,
+				(chop_class_t *) &chop_fastcdc_chopper_class);
+  if (!fastcdc->input)
+    {
+      chop_object_destroy ((chop_object_t *) chopper);
+      return ENOMEM;
+    }
+
+  return 0;
+}
+
+chop_log_t *
+chop_fastcdc_chopper_log (chop_chopper_t *chopper)
+{
+  chop_fastcdc_chopper_t *fastcdc = (chop_fastcdc_chopper_t *) chopper;
+
+  if (chop_object_is_a ((chop_object_t *) chopper,
+			(chop_class_t *) &chop_fastcdc_chopper_class))
+    return (&fastcdc->log);
+
+  return NULL;
+}
+
+
+
+/* Make sure at least FASTCDC->MAX_SIZE bytes are available in FASTCDC's
+   input buffer, unless the end of stream has been reached.  */
+static chop_error_t
+fill_input (chop_fastcdc_chopper_t *fastcdc)
+{
+  chop_error_t err = 0;
+  chop_stream_t *stream = fastcdc->chopper.stream;
+
+  if ((fastcdc->end_of_stream)
+      || (fastcdc->end - fastcdc->start >= fastcdc->max_size))
+    return 0;
+
+  /* Move the pending bytes to the beginning of the buffer.  */
+  if (fastcdc->start > 0)
+    {
+      memmove (fastcdc->input, fastcdc->input + fastcdc->start,
+	       fastcdc->end - fastcdc->start);
+      fastcdc->end -= fastcdc->start;
+      fastcdc->start = 0;
+    }
+
+  while (fastcdc->end < fastcdc->input_size)
+    {
+      size_t amount = 0;
+
+      err = chop_stream_read (stream, fastcdc->input + fastcdc->end,
+			      fastcdc->input_size - fastcdc->end, &amount);
+      fastcdc->end += amount;
+
+      if (CHOP_EXPECT_FALSE (err))
+	{
+	  if (err == CHOP_STREAM_END)
+	    {
+	      fastcdc->end_of_stream = 1;
+	      err = 0;
+	    }
+	  break;
+	}
+    }
+
+  chop_log_printf (&fastcdc->log, "refilled input buffer, %zu bytes pending",
+		   fastcdc->end - fastcdc->start);
+
+  return err;
+}
+
+/* Return the size of the block that starts at DATA, where SIZE bytes are
+   available.  */
+static inline size_t
+find_cut_point (const chop_fastcdc_chopper_t *fastcdc,
+		const uint8_t *data, size_t size)
+{
+  register uint64_t hash = 0;
+  register size_t i;
+  size_t normal_size;
+
+  if (size <= fastcdc->min_size)
+    return size;
+
+  if (size > fastcdc->max_size)
+    size = fastcdc->max_size;
+
+  normal_size = (size < fastcdc->average_size) ? size : fastcdc->average_size;
+
+  for (i = fastcdc->min_size; i < normal_size; i++)
+    {
+      hash = (hash << 1) + gear_table[data[i]];
+      if (!(hash & fastcdc->mask_small))
+	return i + 1;
+    }
+
+  for (; i < size; i++)
+    {
+      hash = (hash << 1) + gear_table[data[i]];
+      if (!(hash & fastcdc->mask_large))
+	return i + 1;
+    }
+
+  return size;
+}
+
+static chop_error_t
+chop_fastcdc_chopper_read_block_view (chop_chopper_t *chopper,
+				      chop_buffer_t *buffer,
+				      const char **block, size_t *size)
+{
+  chop_error_t err;
+  chop_fastcdc_chopper_t *fastcdc = (chop_fastcdc_chopper_t *) chopper;
+
+  *size = 0;
+
+  if ((fastcdc->start == fastcdc->end) && (!fastcdc->end_of_stream))
+    {
+      const char *data;
+      size_t available, cut;
+
+      /* The input buffer is empty: try to find the block directly in the
+	 memory of the input stream.  */
+      err = chop_stream_peek (chopper->stream, &data, &available);
+      if (!err)
+	{
+	  cut = find_cut_point (fastcdc, (const uint8_t *) data, available);
+
+	  /* A cut at the very end of DATA may depend on the bytes that
+	     follow it, unless the maximum block size was reached.  */
+	  if ((cut < available) || (available >= fastcdc->max_size))
+	    {
+	      chop_stream_consume (chopper->stream, cut);
+	      *block = data;
+	      *size = cut;
+
+	      chop_log_printf (&fastcdc->log,
+			       "returning a %zu-byte peeked block", *size);
+
+	      return 0;
+	    }
+	}
+      else if ((err != CHOP_ERR_NOT_IMPL) && (err != CHOP_STREAM_END))
+	return err;
+    }
+
+  err = fill_input (fastcdc);
+  if (CHOP_EXPECT_FALSE (err))
+    return err;
+
+  if (fastcdc->start == fastcdc->end)
+    {
+      assert (fastcdc->end_of_stream);
+      return CHOP_STREAM_END;
+    }
+
+  *size = find_cut_point (fastcdc,
+			  (uint8_t *) fastcdc->input + fastcdc->start,
+			  fastcdc->end - fastcdc->start);
+
+  /* Return a pointer into the input buffer: it remains valid until the
+     next call, which may refill the input buffer.  */
+  *block = fastcdc->input + fastcdc->start;
+  fastcdc->start += *size;
+
+  chop_log_printf (&fastcdc->log, "returning a %zu-byte block", *size);
+
+  return 0;
+}
+
+static chop_error_t
+chop_fastcdc_chopper_read_block (chop_chopper_t *chopper,
+				 chop_buffer_t *buffer, size_t *size)
+{
+  chop_error_t err;
+  const char *block;
+
+  chop_buffer_clear (buffer);
+
+  err = chop_fastcdc_chopper_read_block_view (chopper, buffer, &block, size);
+  if (!err)
+    {
+      err = chop_buffer_push (buffer, block, *size);
+      if (CHOP_EXPECT_FALSE (err))
+	*size = 0;
+    }
+
+  return err;
+}
@@ -25,9 +25,25 @@
 #include <errno.h>
 
 
+/* The base `chop_chopper_t' constructor.  */
+static chop_error_t
+chopper_ctor (chop_object_t *object, const chop_class_t *class)
+{
+  chop_chopper_t *chopper = (chop_chopper_t *) object;
+
+  chopper->stream = NULL;
+  chopper->typical_block_size = 0;
+  chopper->read_block = NULL;
+  chopper->read_block_view = NULL;
+  chopper->find_boundaries = NULL;
+  chopper->close = NULL;
+
+  return 0;
+}
+
 /* The base `chop_chopper_t' definition.  */
 CHOP_DEFINE_RT_CLASS (chopper, object,
-		      NULL, NULL, /* No ctor/dtor */
+		      chopper_ctor, NULL, /* No dtor */
 		      NULL, NULL, /* No copy/equalp */
 		      NULL, NULL  /* No serial/deserial */);
 
@@ -44,6 +60,7 @@ CHOP_DEFINE_RT_CLASS (chopper_class, class,
 
 static chop_error_t fixed_size_chopper_ctor (chop_object_t *object,
 					     const chop_class_t *class);
+static void fixed_size_chopper_dtor (chop_object_t *object);
 
 
 /* Declare `chop_fixed_size_chopper_t' which inherits from
@@ -51,7 +68,11 @@ static chop_error_t fixed_size_chopper_ctor (chop_object_t *object,
 CHOP_DECLARE_RT_CLASS_WITH_METACLASS (fixed_size_chopper, chopper,
 				      chopper_class,  /* Metaclass */
 				      size_t block_size;
-				      int pad_blocks;);
+				      int pad_blocks;
+
+				      /* Storage for the blocks being read */
+				      char *block;
+				      size_t block_storage_size;);
 
 /* A generic `open' method that chooses default parameters.  */
 static chop_error_t
@@ -72,7 +93,8 @@ CHOP_DEFINE_RT_CLASS_WITH_METACLASS (fixed_size_chopper, chopper,
 				     /* metaclass inits */
 				     .generic_open = chop_fs_generic_open,
 
-				     fixed_size_chopper_ctor, NULL,
+				     fixed_size_chopper_ctor,
+				     fixed_size_chopper_dtor,
 				     NULL, NULL, /* No copy/equalp */
 				     NULL, NULL  /* No serial/deserial */);
 
@@ -81,6 +103,15 @@ CHOP_DEFINE_RT_CLASS_WITH_METACLASS (fixed_size_chopper, chopper,
 static chop_error_t chop_fixed_chopper_read_block (chop_chopper_t *,
 						   chop_buffer_t *block,
 						   size_t *);
+static chop_error_t chop_fixed_chopper_read_block_view (chop_chopper_t *,
+							chop_buffer_t *,
+							const char **,
+							size_t *);
+static chop_error_t chop_fixed_chopper_find_boundaries (chop_chopper_t *,
+							chop_buffer_t *,
+							const char **,
+							chop_block_span_t *,
+							size_t, size_t *);
 
 /* The constructor.  */
 static chop_error_t
@@ -92,12 +123,26 @@ fixed_size_chopper_ctor (chop_object_t *object,
   fixed = (chop_fixed_size_chopper_t *)object;
   fixed->chopper.stream = NULL;
   fixed->chopper.read_block = chop_fixed_chopper_read_block;
+  fixed->chopper.read_block_view = chop_fixed_chopper_read_block_view;
+  fixed->chopper.find_boundaries = chop_fixed_chopper_find_boundaries;
   fixed->chopper.typical_block_size = 0;
   fixed->chopper.close = NULL;
+  fixed->block = NULL;
+  fixed->block_storage_size = 0;
 
   return 0;
 }
 
+static void
+fixed_size_chopper_dtor (chop_object_t *object)
+{
+  chop_fixed_size_chopper_t *fixed;
+
+  fixed = (chop_fixed_size_chopper_t *)object;
+  chop_free (fixed->block, (chop_class_t *) &chop_fixed_size_chopper_class);
+  fixed->block = NULL;
+}
+
 chop_error_t
 chop_fixed_size_chopper_init (chop_stream_t *input,
 			      size_t block_size,
@@ -115,27 +160,48 @@ chop_fixed_size_chopper_init (chop_stream_t *input,
   fixed->block_size = block_size;
   fixed->pad_blocks = pad_blocks;
 
+  fixed->block = chop_malloc (block_size,
+			      (chop_class_t *) &chop_fixed_size_chopper_class);
+  if (!fixed->block)
+    {
+      chop_object_destroy ((chop_object_t *) chopper);
+      return ENOMEM;
+    }
+
+  fixed->block_storage_size = block_size;
+
   return 0;
 }
 
 static chop_error_t
-chop_fixed_chopper_read_block (chop_chopper_t *chopper,
-			       chop_buffer_t *buffer,
-			       size_t *size)
+chop_fixed_chopper_read_block_view (chop_chopper_t *chopper,
+				    chop_buffer_t *buffer,
+				    const char **block,
+				    size_t *size)
 {
   chop_error_t err = 0;
   size_t amount;
-  char *block;
   chop_fixed_size_chopper_t *fixed = (chop_fixed_size_chopper_t *)chopper;
   chop_stream_t *input = chop_chopper_stream (chopper);
 
-  block = (char *)alloca (fixed->block_size);
+  err = chop_stream_peek (input, block, size);
+  if ((!err) && (*size >= fixed->block_size))
+    {
+      /* Return a view of INPUT's own memory.  */
+      *size = fixed->block_size;
+      chop_stream_consume (input, *size);
+
+      return 0;
+    }
+
+  err = 0;
+  *block = fixed->block;
 
   *size = 0;
   while (*size < fixed->block_size)
     {
       amount = 0;
-      err = chop_stream_read (input, &block[*size],
+      err = chop_stream_read (input, &fixed->block[*size],
 			      fixed->block_size - *size, &amount);
       *size += amount;
 
@@ -155,11 +221,123 @@ chop_fixed_chopper_read_block (chop_chopper_t *chopper,
   if ((fixed->pad_blocks) && (*size < fixed->block_size))
     {
       /* Reached the end of stream: pad block with zeros */
-      memset (&block[*size], '0', fixed->block_size - *size);
+      memset (&fixed->block[*size], '0', fixed->block_size - *size);
       *size = fixed->block_size;
     }
 
-  err = chop_buffer_push (buffer, block, *size);
+  return 0;
+}
 
-  return err;
+static chop_error_t
+chop_fixed_chopper_read_block (chop_chopper_t *chopper,
+			       chop_buffer_t *buffer,
+			       size_t *size)
+{
+  chop_error_t err;
+  const char *block;
+
+  err = chop_fixed_chopper_read_block_view (chopper, buffer, &block, size);
+  if (err)
+    return err;
+
+  return (chop_buffer_push (buffer, block, *size));
+}
+
+/* Read at most this many bytes at once in `find_boundaries'.  */
+#define FIXED_MAX_REGION_SIZE  (64U * 1024U)
+
+static chop_error_t
+chop_fixed_chopper_find_boundaries (chop_chopper_t *chopper,
+				    chop_buffer_t *buffer,
+				    const char **region,
+				    chop_block_span_t *blocks,
+				    size_t max_blocks, size_t *count)
+{
+  chop_error_t err = 0;
+  size_t region_size, amount, total = 0, block_count;
+  chop_fixed_size_chopper_t *fixed = (chop_fixed_size_chopper_t *)chopper;
+  chop_stream_t *input = chop_chopper_stream (chopper);
+
+  *count = 0;
+
+  err = chop_stream_peek (input, region, &region_size);
+  if ((!err) && (region_size >= fixed->block_size))
+    {
+      /* Return as many full blocks of INPUT's own memory as possible.  */
+      block_count = region_size / fixed->block_size;
+      if (block_count > max_blocks)
+	block_count = max_blocks;
+
+      for (*count = 0; *count < block_count; (*count)++)
+	{
+	  blocks[*count].offset = *count * fixed->block_size;
+	  blocks[*count].size = fixed->block_size;
+	}
+
+      chop_stream_consume (input, block_count * fixed->block_size);
+
+      return 0;
+    }
+
+  err = 0;
+  block_count = FIXED_MAX_REGION_SIZE / fixed->block_size;
+  if (block_count > max_blocks)
+    block_count = max_blocks;
+  if (block_count == 0)
+    block_count = 1;
+
+  region_size = block_count * fixed->block_size;
+  if (region_size > fixed->block_storage_size)
+    {
+      char *larger;
+
+      larger = chop_realloc (fixed->block, region_size,
+			     (chop_class_t *) &chop_fixed_size_chopper_class);
+      if (!larger)
+	return ENOMEM;
+
+      fixed->block = larger;
+      fixed->block_storage_size = region_size;
+    }
+
+  while (total < region_size)
+    {
+      amount = 0;
+      err = chop_stream_read (input, &fixed->block[total],
+			      region_size - total, &amount);
+      total += amount;
+
+      if (CHOP_EXPECT_FALSE (err))
+	{
+	  if (err == CHOP_STREAM_END)
+	    break;
+	  else
+	    return err;
+	}
+    }
+
+  if (total == 0)
+    /* Tried to read past the end of stream */
+    return err;
+
+  if ((fixed->pad_blocks) && (total % fixed->block_size))
+    {
+      /* Reached the end of stream: pad the last block with zeros */
+      size_t padding = fixed->block_size - (total % fixed->block_size);
+
+      memset (&fixed->block[total], '0', padding);
+      total += padding;
+    }
+
+  for (amount = 0; amount < total; amount += fixed->block_size)
+    {
+      blocks[*count].offset = amount;
+      blocks[*count].size = (total - amount < fixed->block_size)
+	? total - amount : fixed->block_size;
+      (*count)++;
+    }
+
+  *region = fixed->block;
+
+  return 0;
 }
@@ -0,0 +1,806 @@
+/* libchop -- a utility library for distributed storage and data backup
+   Copyright (C) 2026  Ludovic Courtès <ludo@gnu.org>
+
+   Libchop is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Libchop is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with libchop.  If not, see <http://www.gnu.org/licenses/>.  */
+
+/* A chopper that runs another chopper class on several threads.
+
+   Input is read in large batches, each of which starts at a block boundary.
+   A batch is split into segments and each segment is chopped independently
+   by a separate thread, using a fresh instance of the inner chopper class.
+   Boundaries found in the first segment are exactly those that the inner
+   chopper would find when reading the stream sequentially.  Boundaries
+   found in the other segments are only "candidates", since those segments
+   do not start at a block boundary.
+
+   Candidates are then validated sequentially: starting from the last known
+   boundary, the inner chopper is run on the batch until it yields a
+   boundary that is also a candidate.  From there on, since the boundaries
+   produced by content-defined choppers only depend on the data that
+   follows the previous boundary, the remaining candidates of that segment
+   are known to be actual boundaries.  Thus, this sequential "resync" phase
+   typically costs only a couple of blocks per segment, and the sequence of
+   blocks produced is exactly the one the inner chopper would produce.
+
+   Bytes that follow the last boundary of a batch are carried over to the
+   next batch.  */
+
+#include <chop/chop-config.h>
+
+#include <chop/chop.h>
+#include <chop/choppers.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <alloca.h>
+
+#ifdef HAVE_PTHREAD_H
+# include <pthread.h>
+#endif
+
+
+/* Default size of the segment handed to each thread.  */
+#define DEFAULT_SEGMENT_SIZE  (1024U * 1024U)
+
+/* Segments of the last batch of a stream are made smaller so that all
+   threads get some work, but not smaller than this number of blocks.  */
+#define MIN_SEGMENT_BLOCKS    (16U)
+
+
+/* A growable array of block boundaries, expressed as offsets within the
+   current batch.  */
+typedef struct
+{
+  size_t *offsets;
+  size_t  count;
+  size_t  allocated;
+} boundary_list_t;
+
+/* A segment of a batch, chopped by one thread.  */
+typedef struct
+{
+  struct chop_parallel_chopper *parallel;
+
+  /* Bytes [START, END) of the batch.  LAST is non-zero if END is the end of
+     the input stream.  */
+  size_t start;
+  size_t end;
+  int    last;
+
+  /* Candidate block boundaries found in this segment.  */
+  boundary_list_t candidates;
+  chop_error_t    result;
+
+#ifdef HAVE_PTHREAD_H
+  pthread_t thread;
+  int       spawned;
+#endif
+} segment_t;
+
+
+/* Declare `chop_parallel_chopper_t' which inherits from `chop_chopper_t'.  */
+CHOP_DECLARE_RT_CLASS_WITH_METACLASS (parallel_chopper, chopper,
+				      chopper_class,
+
+		       /* The inner chopper class and the typical block size
+			  passed to its generic `open' method.  */
+		       const chop_chopper_class_t *inner_class;
+		       size_t inner_block_size;
+
+		       /* Segments are a multiple of ALIGNMENT bytes long
+			  so that fixed-size inner choppers remain in
+			  sync.  */
+		       size_t alignment;
+		       size_t segment_size;
+
+		       size_t     thread_count;
+		       segment_t *segments;
+
+		       /* The current batch: bytes [0, BATCH_END) of BATCH,
+			  starting at a block boundary.  */
+		       char  *batch;
+		       size_t batch_size;
+		       size_t batch_end;
+		       int    end_of_stream;
+
+		       /* Boundaries of the current batch and the index of
+			  the next block to be returned.  */
+		       boundary_list_t boundaries;
+		       size_t next_block;
+		       size_t block_start;
+
+		       /* Message logging */
+		       chop_log_t log;);
+
+/* A generic `open' method that wraps anchor-based choppers and uses as many
+   threads as there are processors.  */
+static chop_error_t
+pc_generic_open (chop_stream_t *input, size_t typical_block_size,
+		 chop_chopper_t *chopper)
+{
+  return (chop_parallel_chopper_init (input, &chop_anchor_based_chopper_class,
+				      typical_block_size,
+				      0 /* thread count */,
+				      0 /* segment size */,
+				      chopper));
+}
+
+static chop_error_t pc_ctor (chop_object_t *, const chop_class_t *);
+static void pc_dtor (chop_object_t *);
+
+CHOP_DEFINE_RT_CLASS_WITH_METACLASS (parallel_chopper, chopper,
+				     chopper_class,  /* Metaclass */
+
+				     /* Metaclass inits */
+				     .generic_open = pc_generic_open,
+
+				     pc_ctor, pc_dtor,
+				     NULL, NULL, /* No copy, equalp */
+				     NULL, NULL  /* No serial/deserial */);
+
+
+
+static chop_error_t
+chop_parallel_chopper_read_block (chop_chopper_t *, chop_buffer_t *,
+				  size_t *);
+
+static chop_error_t
+chop_parallel_chopper_read_block_view (chop_chopper_t *, chop_buffer_t *,
+				       const char **, size_t *);
+
+static chop_error_t
+chop_parallel_chopper_find_boundaries (chop_chopper_t *, chop_buffer_t *,
+				       const char **, chop_block_span_t *,
+				       size_t, size_t *);
+
+static void
+chop_parallel_chopper_close (chop_chopper_t *);
+
+
+static chop_error_t
+pc_ctor (chop_object_t *object, const chop_class_t *class)
+{
+  chop_parallel_chopper_t *parallel = (chop_parallel_chopper_t *) object;
+
+  parallel->chopper.stream = NULL;
+  parallel->chopper.read_block = chop_parallel_chopper_read_block;
+  parallel->chopper.read_block_view = chop_parallel_chopper_read_block_view;
+  parallel->chopper.find_boundaries = chop_parallel_chopper_find_boundaries;
+  parallel->chopper.typical_block_size = 0;
+  parallel->chopper.close = chop_parallel_chopper_close;
+
+  parallel->inner_class = NULL;
+  parallel->inner_block_size = 0;
+  parallel->alignment = 1;
+  parallel->segment_size = 0;
+  parallel->thread_count = 0;
+  parallel->segments = NULL;
+
+  parallel->batch = NULL;
+  parallel->batch_size = parallel->batch_end = 0;
+  parallel->end_of_stream = 0;
+
+  memset (&parallel->boundaries, 0, sizeof (parallel->boundaries));
+  parallel->next_block = parallel->block_start = 0;
+
+  return chop_log_init ("parallel-chopper", &parallel->log);
+}
+
+static void
+chop_parallel_chopper_close (chop_chopper_t *chopper)
+{
+  size_t i;
+  chop_parallel_chopper_t *parallel = (chop_parallel_chopper_t *) chopper;
+  const chop_class_t *class = (chop_class_t *) &chop_parallel_chopper_class;
+
+  if (parallel->segments)
+    {
+      for (i = 0; i < parallel->thread_count; i++)
+	chop_free (parallel->segments[i].candidates.offsets, class);
+
+      chop_free (parallel->segments, class);
+      parallel->segments = NULL;
+    }
+
+  chop_free (parallel->boundaries.offsets, class);
+  memset (&parallel->boundaries, 0, sizeof (parallel->boundaries));
+
+  chop_free (parallel->batch, class);
+  parallel->batch = NULL;
+  parallel->batch_size = parallel->batch_end = 0;
+}
+
+static void
+pc_dtor (chop_object_t *object)
+{
+  chop_parallel_chopper_t *parallel = (chop_parallel_chopper_t *) object;
+
+  chop_parallel_chopper_close ((chop_chopper_t *) parallel);
+  chop_object_destroy ((chop_object_t *) &parallel->log);
+}
+
+
+/* Initialize CHOPPER as an instance of PARALLEL's inner chopper class that
+   reads bytes [START, END) of PARALLEL's batch through STREAM.  */
+static chop_error_t
+open_inner_chopper (const chop_parallel_chopper_t *parallel,
+		    size_t start, size_t end,
+		    chop_stream_t *stream, chop_chopper_t *chopper)
+{
+  chop_error_t err;
+
+  chop_mem_stream_open (parallel->batch + start, end - start, NULL, stream);
+
+  /* Make sure inner choppers see the same preferred block size as if they
+     were reading the actual input stream, since their default parameters
+     may depend on it.  */
+  stream->preferred_block_size =
+    chop_stream_preferred_block_size (parallel->chopper.stream);
+
+  err = chop_chopper_generic_open (parallel->inner_class, stream,
+				   parallel->inner_block_size, chopper);
+  if (err)
+    chop_object_destroy ((chop_object_t *) stream);
+
+  return err;
+}
+
+static void
+close_inner_chopper (chop_stream_t *stream, chop_chopper_t *chopper)
+{
+  chop_object_destroy ((chop_object_t *) chopper);
+  chop_object_destroy ((chop_object_t *) stream);
+}
+
+/* Append OFFSET to LIST.  */
+static chop_error_t
+push_boundary (boundary_list_t *list, size_t offset)
+{
+  if (CHOP_EXPECT_FALSE (list->count >= list->allocated))
+    {
+      size_t *larger;
+      size_t allocated = list->allocated ? list->allocated * 2 : 256;
+
+      larger = chop_realloc (list->offsets, allocated * sizeof (size_t),
+			     (chop_class_t *) &chop_parallel_chopper_class);
+      if (!larger)
+	return ENOMEM;
+
+      list->offsets = larger;
+      list->allocated = allocated;
+    }
+
+  list->offsets[list->count++] = offset;
+
+  return 0;
+}
+
+/* Chop SEGMENT and record its candidate boundaries.  The boundary at the
+   end of SEGMENT is only recorded if it is the end of the stream.  */
+static void *
+chop_segment (void *data)
+{
+  chop_error_t err;
+  segment_t *segment = (segment_t *) data;
+  const chop_parallel_chopper_t *parallel = segment->parallel;
+  chop_stream_t *stream;
+  chop_chopper_t *chopper;
+  chop_buffer_t buffer;
+  const char *block;
+  size_t size, offset;
+
+  segment->candidates.count = 0;
+
+  stream = chop_class_alloca_instance (&chop_mem_stream_class);
+  chopper = chop_class_alloca_instance ((chop_class_t *)
+					parallel->inner_class);
+
+  err = open_inner_chopper (parallel, segment->start, segment->end,
+			    stream, chopper);
+  if (err)
+    goto done;
+
+  err = chop_buffer_init (&buffer, chop_chopper_typical_block_size (chopper));
+  if (err)
+    goto close;
+
+  for (offset = segment->start; ; )
+    {
+      err = chop_chopper_read_block_view (chopper, &buffer, &block, &size);
+      if (err)
+	break;
+
+      offset += size;
+      if ((offset < segment->end) || (segment->last))
+	{
+	  err = push_boundary (&segment->candidates, offset);
+	  if (err)
+	    break;
+	}
+    }
+
+  if (err == CHOP_STREAM_END)
+    err = 0;
+
+  chop_buffer_return (&buffer);
+
+ close:
+  close_inner_chopper (stream, chopper);
+
+ done:
+  segment->result = err;
+
+  return NULL;
+}
+
+/* Chop the segments of PARALLEL's batch, in parallel when possible.  */
+static chop_error_t
+chop_segments (chop_parallel_chopper_t *parallel, size_t segment_count)
+{
+  size_t i;
+  chop_error_t err = 0;
+
+#ifdef HAVE_PTHREAD_H
+  /* Spawn one thread per segment but the first one, which is chopped by the
+     calling thread.  */
+  for (i = 1; i < segment_count; i++)
+    parallel->segments[i].spawned =
+      !pthread_create (&parallel->segments[i].thread, NULL,
+		       chop_segment, &parallel->segments[i]);
+
+  chop_segment (&parallel->segments[0]);
+
+  for (i = 1; i < segment_count; i++)
+    {
+      if (parallel->segments[i].spawned)
+	pthread_join (parallel->segments[i].thread, NULL);
+      else
+	/* Thread creation failed, so do it ourselves.  */
+	chop_segment (&parallel->segments[i]);
+    }
+#else
+  for (i = 0; i < segment_count; i++)
+    chop_segment (&parallel->segments[i]);
+#endif
+
+  for (i = 0; (i < segment_count) && (!err); i++)
+    err = parallel->segments[i].result;
+
+  return err;
+}
+
+static int
+compare_offsets (const void *a, const void *b)
+{
+  size_t x = *(const size_t *) a, y = *(const size_t *) b;
+
+  return ((x > y) - (x < y));
+}
+
+/* Append to PARALLEL's boundary list the boundaries of SEGMENT that follow
+   OFFSET, an actual block boundary.  Return non-zero if OFFSET is one of
+   SEGMENT's candidates, in which case the candidates that follow it are
+   actual boundaries too and *NEW_OFFSET is set to the last of them.  */
+static int
+accept_candidates (chop_parallel_chopper_t *parallel,
+		   const segment_t *segment, size_t offset,
+		   size_t *new_offset, chop_error_t *err)
+{
+  const size_t *match, *last;
+
+  *err = 0;
+  if (segment->candidates.count == 0)
+    return 0;
+
+  match = bsearch (&offset, segment->candidates.offsets,
+		   segment->candidates.count, sizeof (size_t),
+		   compare_offsets);
+  if (!match)
+    return 0;
+
+  last = segment->candidates.offsets + segment->candidates.count;
+  for (match++; (match < last) && (!*err); match++)
+    *err = push_boundary (&parallel->boundaries, *match);
+
+  *new_offset = last[-1];
+
+  return 1;
+}
+
+/* Compute the actual block boundaries of PARALLEL's batch from the
+   candidates of its SEGMENT_COUNT segments, each SEGMENT_SIZE bytes long.
+   Boundaries are only known up to the last boundary of the batch, unless
+   the batch ends the stream.  */
+static chop_error_t
+resync_segments (chop_parallel_chopper_t *parallel,
+		 size_t segment_count, size_t segment_size)
+{
+  chop_error_t err = 0;
+  size_t offset = 0, resyncs = 0, i;
+  const segment_t *first = &parallel->segments[0];
+  chop_stream_t *stream;
+  chop_chopper_t *chopper;
+  chop_buffer_t buffer;
+
+  /* The first segment starts at a block boundary so all its candidates are
+     actual boundaries.  */
+  for (i = 0; i < first->candidates.count; i++)
+    {
+      offset = first->candidates.offsets[i];
+      err = push_boundary (&parallel->boundaries, offset);
+      if (err)
+	return err;
+    }
+
+  stream = chop_class_alloca_instance (&chop_mem_stream_class);
+  chopper = chop_class_alloca_instance ((chop_class_t *)
+					parallel->inner_class);
+
+  err = chop_buffer_init (&buffer, parallel->chopper.typical_block_size);
+  if (err)
+    return err;
+
+  while (offset < parallel->batch_end)
+    {
+      int synced = 0;
+
+      /* Chop sequentially from OFFSET until we find a boundary that is also
+	 a candidate.  */
+      err = open_inner_chopper (parallel, offset, parallel->batch_end,
+				stream, chopper);
+      if (err)
+	break;
+
+      while (!synced)
+	{
+	  const char *block;
+	  size_t size, segment;
+
+	  err = chop_chopper_read_block_view (chopper, &buffer, &block, &size);
+	  if (err)
+	    break;
+
+	  if ((offset + size == parallel->batch_end)
+	      && (!parallel->end_of_stream))
+	    {
+	      /* This block is cut short by the end of the batch.  */
+	      err = CHOP_STREAM_END;
+	      break;
+	    }
+
+	  offset += size;
+	  err = push_boundary (&parallel->boundaries, offset);
+	  if (err)
+	    break;
+
+	  segment = (offset - 1) / segment_size;
+	  if (segment < segment_count)
+	    {
+	      size_t new_offset = offset;
+
+	      if (accept_candidates (parallel, &parallel->segments[segment],
+				     offset, &new_offset, &err)
+		  && (new_offset > offset))
+		{
+		  /* We're in sync with SEGMENT, and we know where its last
+		     boundary is, so restart from there.  */
+		  offset = new_offset;
+		  synced = 1;
+		}
+
+	      if (err)
+		break;
+	    }
+	}
+
+      close_inner_chopper (stream, chopper);
+
+      if (err)
+	break;
+
+      resyncs++;
+    }
+
+  chop_buffer_return (&buffer);
+
+  chop_log_printf (&parallel->log, "batch of %zu bytes: %zu blocks, "
+		   "%zu segments, %zu resyncs",
+		   parallel->batch_end, parallel->boundaries.count,
+		   segment_count, resyncs);
+
+  return ((err == CHOP_STREAM_END) ? 0 : err);
+}
+
+/* Fill PARALLEL's batch buffer, growing it if it is already full, and
+   compute the block boundaries of the resulting batch.  */
+static chop_error_t
+process_batch (chop_parallel_chopper_t *parallel)
+{
+  chop_error_t err = 0;
+  size_t segment_size, segment_count, min_segment_size, i;
+
+  if (parallel->batch_end == parallel->batch_size)
+    {
+      /* The previous batch did not contain any block boundary; make room
+	 for a larger one.  */
+      char *larger;
+
+      larger = chop_realloc (parallel->batch, parallel->batch_size * 2,
+			     (chop_class_t *) &chop_parallel_chopper_class);
+      if (!larger)
+	return ENOMEM;
+
+      parallel->batch = larger;
+      parallel->batch_size *= 2;
+    }
+
+  while ((parallel->batch_end < parallel->batch_size)
+	 && (!parallel->end_of_stream))
+    {
+      size_t amount = 0;
+
+      err = chop_stream_read (parallel->chopper.stream,
+			      parallel->batch + parallel->batch_end,
+			      parallel->batch_size - parallel->batch_end,
+			      &amount);
+      parallel->batch_end += amount;
+
+      if (CHOP_EXPECT_FALSE (err))
+	{
+	  if (err == CHOP_STREAM_END)
+	    {
+	      parallel->end_of_stream = 1;
+	      err = 0;
+	    }
+	  else
+	    return err;
+	}
+    }
+
+  parallel->boundaries.count = 0;
+  parallel->next_block = 0;
+  parallel->block_start = 0;
+
+  if (parallel->batch_end == 0)
+    return 0;
+
+  /* Split the batch evenly among threads, making sure each segment starts
+     at a multiple of the alignment.  */
+  segment_size = (parallel->batch_end + parallel->thread_count - 1)
+    / parallel->thread_count;
+  segment_size = ((segment_size + parallel->alignment - 1)
+		  / parallel->alignment) * parallel->alignment;
+
+  min_segment_size = MIN_SEGMENT_BLOCKS * parallel->alignment;
+  if (min_segment_size > parallel->segment_size)
+    min_segment_size = parallel->segment_size;
+  if (segment_size < min_segment_size)
+    segment_size = min_segment_size;
+
+  segment_count = (parallel->batch_end + segment_size - 1) / segment_size;
+
+  for (i = 0; i < segment_count; i++)
+    {
+      segment_t *segment = &parallel->segments[i];
+
+      segment->parallel = parallel;
+      segment->start = i * segment_size;
+      segment->end = segment->start + segment_size;
+      if (segment->end >= parallel->batch_end)
+	segment->end = parallel->batch_end;
+      segment->last = ((parallel->end_of_stream)
+		       && (segment->end == parallel->batch_end));
+    }
+
+  err = chop_segments (parallel, segment_count);
+  if (err)
+    return err;
+
+  return (resync_segments (parallel, segment_count, segment_size));
+}
+
+
+chop_error_t
+chop_parallel_chopper_init (chop_stream_t *input,
+			    const chop_chopper_class_t *inner_class,
+			    size_t typical_block_size,
+			    size_t thread_count,
+			    size_t segment_size,
+			    chop_chopper_t *chopper)
+{
+  chop_error_t err;
+  chop_stream_t *stream;
+  chop_chopper_t *probe;
+  chop_parallel_chopper_t *parallel = (chop_parallel_chopper_t *) chopper;
+  const chop_class_t *class = (chop_class_t *) &chop_parallel_chopper_class;
+
+  if ((inner_class == NULL) || (inner_class == &chop_parallel_chopper_class))
+    return CHOP_INVALID_ARG;
+
+  if (thread_count == 0)
+    {
+#ifdef _SC_NPROCESSORS_ONLN
+      long processors = sysconf (_SC_NPROCESSORS_ONLN);
+
+      thread_count = (processors > 0) ? (size_t) processors : 1;
+#else
+      thread_count = 1;
+#endif
+    }
+
+  if (segment_size == 0)
+    segment_size = DEFAULT_SEGMENT_SIZE;
+
+  err = chop_object_initialize ((chop_object_t *) chopper, class);
+  if (err)
+    return err;
+
+  parallel->chopper.stream = input;
+  parallel->inner_class = inner_class;
+  parallel->inner_block_size = typical_block_size;
+  parallel->thread_count = thread_count;
+
+  /* Open an inner chopper on INPUT to make sure INNER_CLASS supports
+     generic opening, and to learn about its block size.  */
+  stream = chop_class_alloca_instance (&chop_mem_stream_class);
+  probe = chop_class_alloca_instance ((chop_class_t *) inner_class);
+  err = open_inner_chopper (parallel, 0, 0, stream, probe);
+  if (err)
+    goto failed;
+
+  parallel->chopper.typical_block_size =
+    chop_chopper_typical_block_size (probe);
+  close_inner_chopper (stream, probe);
+
+  parallel->alignment = parallel->chopper.typical_block_size;
+  if (parallel->alignment == 0)
+    parallel->alignment = 1;
+
+  /* Round SEGMENT_SIZE up to a multiple of the alignment.  */
+  parallel->segment_size = ((segment_size + parallel->alignment - 1)
+			    / parallel->alignment) * parallel->alignment;
+
+  parallel->batch_size = parallel->segment_size * thread_count;
+  parallel->batch = chop_malloc (parallel->batch_size, class);
+  parallel->segments = chop_calloc (thread_count * sizeof (segment_t), class);
+  if ((!parallel->batch) || (!parallel->segments))
+    {
+      err = ENOMEM;
+      goto failed;
+    }
+
+  return 0;
+
+ failed:
+  chop_object_destroy ((chop_object_t *) chopper);
+  return err;
+}
+
+chop_log_t *
+chop_parallel_chopper_log (chop_chopper_t *chopper)
+{
+  chop_parallel_chopper_t *parallel = (chop_parallel_chopper_t *) chopper;
+
+  if (chop_object_is_a ((chop_object_t *) chopper,
+			(chop_class_t *) &chop_parallel_chopper_class))
+    return (&parallel->log);
+
+  return NULL;
+}
+
+
+/* Make sure PARALLEL has blocks left to return, processing a new batch if
+   needed.  */
+static chop_error_t
+ensure_blocks (chop_parallel_chopper_t *parallel)
+{
+  chop_error_t err;
+
+  while (parallel->next_block >= parallel->boundaries.count)
+    {
+      if ((parallel->end_of_stream)
+	  && (parallel->block_start >= parallel->batch_end))
+	return CHOP_STREAM_END;
+
+      /* Carry the bytes past the last boundary over to the next batch.  */
+      if (parallel->block_start > 0)
+	{
+	  memmove (parallel->batch, parallel->batch + parallel->block_start,
+		   parallel->batch_end - parallel->block_start);
+	  parallel->batch_end -= parallel->block_start;
+	  parallel->block_start = 0;
+	}
+
+      err = process_batch (parallel);
+      if (err)
+	return err;
+    }
+
+  return 0;
+}
+
+static chop_error_t
+chop_parallel_chopper_read_block_view (chop_chopper_t *chopper,
+				       chop_buffer_t *buffer,
+				       const char **block, size_t *size)
+{
+  chop_error_t err;
+  chop_parallel_chopper_t *parallel = (chop_parallel_chopper_t *) chopper;
+
+  *size = 0;
+
+  err = ensure_blocks (parallel);
+  if (err)
+    return err;
+
+  *block = parallel->batch + parallel->block_start;
+  *size = parallel->boundaries.offsets[parallel->next_block]
+    - parallel->block_start;
+
+  parallel->block_start = parallel->boundaries.offsets[parallel->next_block];
+  parallel->next_block++;
+
+  return 0;
+}
+
+static chop_error_t
+chop_parallel_chopper_find_boundaries (chop_chopper_t *chopper,
+				       chop_buffer_t *buffer,
+				       const char **region,
+				       chop_block_span_t *blocks,
+				       size_t max_blocks, size_t *count)
+{
+  chop_error_t err;
+  size_t start;
+  chop_parallel_chopper_t *parallel = (chop_parallel_chopper_t *) chopper;
+
+  *count = 0;
+
+  err = ensure_blocks (parallel);
+  if (err)
+    return err;
+
+  *region = parallel->batch + parallel->block_start;
+  for (start = parallel->block_start;
+       (*count < max_blocks)
+	 && (parallel->next_block < parallel->boundaries.count);
+       (*count)++)
+    {
+      size_t end = parallel->boundaries.offsets[parallel->next_block++];
+
+      blocks[*count].offset = start - parallel->block_start;
+      blocks[*count].size = end - start;
+      start = end;
+    }
+
+  parallel->block_start = start;
+
+  return 0;
+}
+
+static chop_error_t
+chop_parallel_chopper_read_block (chop_chopper_t *chopper,
+				  chop_buffer_t *buffer, size_t *size)
+{
+  chop_error_t err;
+  const char *block;
+
+  err = chop_parallel_chopper_read_block_view (chopper, buffer, &block, size);
+  if (err)
+    return err;
+
+  return (chop_buffer_push (buffer, block, *size));
+}
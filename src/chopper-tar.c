@@ -0,0 +1,738 @@
+/* libchop -- a utility library for distributed storage and data backup
+   Copyright (C) 2026  Ludovic Courtès <ludo@gnu.org>
+
+   Libchop is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Libchop is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with libchop.  If not, see <http://www.gnu.org/licenses/>.  */
+
+/* A chopper that knows about the tar archive format.
+
+   Header records are returned as blocks of their own, along with the
+   extended headers that precede them (pax `x' and `g' records, GNU long
+   names) and the padding of the previous member.  The contents of each
+   member are passed to an inner chopper through a sub-stream, so that the
+   blocks of a given file are the same regardless of its position in the
+   archive.  This is what makes it possible to share blocks among
+   successive tarballs of the same tree.
+
+   When the input does not look like a tar archive, for instance because a
+   header checksum is wrong, the rest of the input is passed as is to the
+   inner chopper.  */
+
+#include <chop/chop-config.h>
+
+#include <chop/chop.h>
+#include <chop/choppers.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+
+/* Size of a tar record.  */
+#define TAR_RECORD_SIZE  512
+
+/* Offset and size of the header fields we're interested in.  */
+#define TAR_SIZE_OFFSET       124
+#define TAR_SIZE_LENGTH       12
+#define TAR_CHECKSUM_OFFSET   148
+#define TAR_CHECKSUM_LENGTH   8
+#define TAR_TYPEFLAG_OFFSET   156
+
+
+/* Declare `chop_tar_chopper_t' which inherits from `chop_chopper_t'.  */
+CHOP_DECLARE_RT_CLASS_WITH_METACLASS (tar_chopper, chopper,
+				      chopper_class,
+
+		       /* Chopper class used for member contents and the
+			  typical block size passed to its generic `open'
+			  method.  */
+		       const chop_chopper_class_t *inner_class;
+		       size_t inner_block_size;
+
+		       /* Storage for the sub-stream and inner chopper of
+			  the member being read.  */
+		       chop_stream_t  *member_stream;
+		       chop_chopper_t *member_chopper;
+		       int in_member;
+
+		       /* Number of padding bytes after the current member's
+			  contents.  */
+		       size_t padding;
+
+		       /* Non-zero when the input turned out not to be a tar
+			  archive, and once the end of archive has been
+			  reached, respectively.  */
+		       int opaque;
+		       int finished;
+
+		       /* Message logging */
+		       chop_log_t log;);
+
+/* A generic `open' method that chops member contents with anchor-based
+   choppers.  */
+static chop_error_t
+tc_generic_open (chop_stream_t *input, size_t typical_block_size,
+		 chop_chopper_t *chopper)
+{
+  return (chop_tar_chopper_init (input, &chop_anchor_based_chopper_class,
+				 typical_block_size, chopper));
+}
+
+static chop_error_t tc_ctor (chop_object_t *, const chop_class_t *);
+static void tc_dtor (chop_object_t *);
+
+CHOP_DEFINE_RT_CLASS_WITH_METACLASS (tar_chopper, chopper,
+				     chopper_class,  /* Metaclass */
+
+				     /* Metaclass inits */
+				     .generic_open = tc_generic_open,
+
+				     tc_ctor, tc_dtor,
+				     NULL, NULL, /* No copy, equalp */
+				     NULL, NULL  /* No serial/deserial */);
+
+
+
+static chop_error_t
+chop_tar_chopper_read_block (chop_chopper_t *, chop_buffer_t *, size_t *);
+
+static chop_error_t
+chop_tar_chopper_read_block_view (chop_chopper_t *, chop_buffer_t *,
+				  const char **, size_t *);
+
+static chop_error_t
+chop_tar_chopper_find_boundaries (chop_chopper_t *, chop_buffer_t *,
+				  const char **, chop_block_span_t *,
+				  size_t, size_t *);
+
+static void
+chop_tar_chopper_close (chop_chopper_t *);
+
+
+static chop_error_t
+tc_ctor (chop_object_t *object, const chop_class_t *class)
+{
+  chop_tar_chopper_t *tar = (chop_tar_chopper_t *) object;
+
+  tar->chopper.stream = NULL;
+  tar->chopper.read_block = chop_tar_chopper_read_block;
+  tar->chopper.read_block_view = chop_tar_chopper_read_block_view;
+  tar->chopper.find_boundaries = chop_tar_chopper_find_boundaries;
+  tar->chopper.typical_block_size = 0;
+  tar->chopper.close = chop_tar_chopper_close;
+
+  tar->inner_class = NULL;
+  tar->inner_block_size = 0;
+  tar->member_stream = NULL;
+  tar->member_chopper = NULL;
+  tar->in_member = 0;
+  tar->padding = 0;
+  tar->opaque = tar->finished = 0;
+
+  return chop_log_init ("tar-chopper", &tar->log);
+}
+
+/* Terminate the current member of TAR, if any.  */
+static void
+end_member (chop_tar_chopper_t *tar)
+{
+  if (tar->in_member)
+    {
+      chop_object_destroy ((chop_object_t *) tar->member_chopper);
+      chop_object_destroy ((chop_object_t *) tar->member_stream);
+      tar->in_member = 0;
+    }
+}
+
+static void
+chop_tar_chopper_close (chop_chopper_t *chopper)
+{
+  const chop_class_t *class = (chop_class_t *) &chop_tar_chopper_class;
+  chop_tar_chopper_t *tar = (chop_tar_chopper_t *) chopper;
+
+  end_member (tar);
+
+  chop_free (tar->member_stream, class);
+  chop_free (tar->member_chopper, class);
+  tar->member_stream = NULL;
+  tar->member_chopper = NULL;
+}
+
+static void
+tc_dtor (chop_object_t *object)
+{
+  chop_tar_chopper_t *tar = (chop_tar_chopper_t *) object;
+
+  chop_tar_chopper_close ((chop_chopper_t *) tar);
+  chop_object_destroy ((chop_object_t *) &tar->log);
+}
+
+chop_error_t
+chop_tar_chopper_init (chop_stream_t *input,
+		       const chop_chopper_class_t *inner_class,
+		       size_t typical_block_size,
+		       chop_chopper_t *chopper)
+{
+  chop_error_t err;
+  const chop_class_t *class = (chop_class_t *) &chop_tar_chopper_class;
+  chop_tar_chopper_t *tar = (chop_tar_chopper_t *) chopper;
+
+  if ((inner_class == NULL) || (inner_class->generic_open == NULL))
+    return CHOP_INVALID_ARG;
+
+  err = chop_object_initialize ((chop_object_t *) chopper, class);
+  if (err)
+    return err;
+
+  tar->chopper.stream = input;
+  tar->chopper.typical_block_size =
+    (typical_block_size > 0) ? typical_block_size : TAR_RECORD_SIZE;
+  tar->inner_class = inner_class;
+  tar->inner_block_size = typical_block_size;
+
+  tar->member_stream =
+    chop_malloc (chop_class_instance_size (&chop_sub_stream_class), class);
+  tar->member_chopper =
+    chop_malloc (chop_class_instance_size ((chop_class_t *) inner_class),
+		 class);
+  if ((!tar->member_stream) || (!tar->member_chopper))
+    {
+      chop_object_destroy ((chop_object_t *) chopper);
+      return ENOMEM;
+    }
+
+  return 0;
+}
+
+chop_log_t *
+chop_tar_chopper_log (chop_chopper_t *chopper)
+{
+  chop_tar_chopper_t *tar = (chop_tar_chopper_t *) chopper;
+
+  if (chop_object_is_a ((chop_object_t *) chopper,
+			(chop_class_t *) &chop_tar_chopper_class))
+    return (&tar->log);
+
+  return NULL;
+}
+
+
+
+/* Header parsing.  */
+
+/* Return the value of the numeric field of SIZE bytes at FIELD, which is
+   either a NUL- or space-terminated octal number, or a big-endian base-256
+   number as produced by GNU tar for large values.  Set *VALID to zero if
+   FIELD could not be parsed.  */
+static uint64_t
+parse_number (const unsigned char *field, size_t size, int *valid)
+{
+  uint64_t value = 0;
+  size_t i;
+
+  *valid = 1;
+
+  if (field[0] & 0x80)
+    {
+      /* Base-256 encoding.  */
+      value = field[0] & 0x3f;
+      for (i = 1; i < size; i++)
+	{
+	  if (value >> 56)
+	    {
+	      *valid = 0;
+	      return 0;
+	    }
+	  value = (value << 8) | field[i];
+	}
+
+      return value;
+    }
+
+  for (i = 0; (i < size) && (field[i] == ' '); i++);
+
+  for (; (i < size) && (field[i] >= '0') && (field[i] <= '7'); i++)
+    value = (value << 3) | (field[i] - '0');
+
+  if ((i < size) && (field[i] != ' ') && (field[i] != '\0'))
+    *valid = 0;
+
+  return value;
+}
+
+/* Return non-zero if RECORD is all zeros, i.e., if it marks the end of the
+   archive.  */
+static int
+is_zero_record (const unsigned char *record)
+{
+  size_t i;
+
+  for (i = 0; i < TAR_RECORD_SIZE; i++)
+    if (record[i])
+      return 0;
+
+  return 1;
+}
+
+/* Return non-zero if RECORD is a valid tar header, i.e., if its checksum
+   is right.  Both the unsigned sum mandated by POSIX and the signed sum
+   produced by some historical implementations are accepted.  */
+static int
+is_valid_header (const unsigned char *record)
+{
+  int valid;
+  size_t i;
+  uint64_t expected;
+  unsigned long usum = 0;
+  long ssum = 0;
+
+  expected = parse_number (record + TAR_CHECKSUM_OFFSET, TAR_CHECKSUM_LENGTH,
+			   &valid);
+  if (!valid)
+    return 0;
+
+  for (i = 0; i < TAR_RECORD_SIZE; i++)
+    {
+      unsigned char c;
+
+      if ((i >= TAR_CHECKSUM_OFFSET)
+	  && (i < TAR_CHECKSUM_OFFSET + TAR_CHECKSUM_LENGTH))
+	c = ' ';
+      else
+	c = record[i];
+
+      usum += c;
+      ssum += (signed char) c;
+    }
+
+  return ((expected == usum) || (expected == (uint64_t) ssum));
+}
+
+/* Look for a `size' record in the SIZE bytes of pax extended header data at
+   DATA.  If one is found, set *MEMBER_SIZE to its value and return
+   non-zero.  */
+static int
+parse_pax_size (const char *data, size_t size, uint64_t *member_size)
+{
+  const char *p = data, *end = data + size;
+  int found = 0;
+
+  /* Each record has the form "LENGTH KEY=VALUE\n".  */
+  while (p < end)
+    {
+      size_t length = 0;
+      const char *q, *key;
+
+      for (q = p; (q < end) && (*q >= '0') && (*q <= '9'); q++)
+	length = length * 10 + (*q - '0');
+
+      if ((q >= end) || (*q != ' ') || (length == 0)
+	  || (length > (size_t) (end - p)))
+	break;
+
+      key = q + 1;
+      if ((p + length - key > 5) && (!memcmp (key, "size=", 5)))
+	{
+	  uint64_t value = 0;
+
+	  for (q = key + 5; (q < p + length) && (*q >= '0') && (*q <= '9');
+	       q++)
+	    value = value * 10 + (*q - '0');
+
+	  *member_size = value;
+	  found = 1;
+	}
+
+      p += length;
+    }
+
+  return found;
+}
+
+/* Return non-zero if data follows a header whose type is TYPEFLAG.  */
+static int
+has_contents (char typeflag)
+{
+  switch (typeflag)
+    {
+    case '1': /* hard link */
+    case '2': /* symbolic link */
+    case '3': /* character device */
+    case '4': /* block device */
+    case '5': /* directory */
+    case '6': /* FIFO */
+      return 0;
+
+    default:
+      return 1;
+    }
+}
+
+
+
+/* Reading.  */
+
+/* Append up to SIZE bytes read from STREAM to BUFFER.  Set *READ to the
+   number of bytes actually read, which is lower than SIZE only upon end of
+   stream.  */
+static chop_error_t
+read_into_buffer (chop_stream_t *stream, chop_buffer_t *buffer,
+		  size_t size, size_t *read)
+{
+  chop_error_t err = 0;
+  char chunk[TAR_RECORD_SIZE * 8];
+
+  *read = 0;
+  while (*read < size)
+    {
+      size_t amount = 0, wanted;
+
+      wanted = size - *read;
+      if (wanted > sizeof (chunk))
+	wanted = sizeof (chunk);
+
+      err = chop_stream_read (stream, chunk, wanted, &amount);
+      if (amount > 0)
+	{
+	  chop_error_t append_err;
+
+	  append_err = chop_buffer_append (buffer, chunk, amount);
+	  if (append_err)
+	    return append_err;
+
+	  *read += amount;
+	}
+
+      if (err)
+	break;
+    }
+
+  return ((err == CHOP_STREAM_END) ? 0 : err);
+}
+
+/* Start reading a member of SIZE bytes from TAR's input.  */
+static chop_error_t
+start_member (chop_tar_chopper_t *tar, size_t size)
+{
+  chop_error_t err;
+
+  err = chop_sub_stream_open (tar->chopper.stream, CHOP_PROXY_LEAVE_AS_IS,
+			      size, tar->member_stream);
+  if (err)
+    return err;
+
+  err = chop_chopper_generic_open (tar->inner_class, tar->member_stream,
+				   tar->inner_block_size,
+				   tar->member_chopper);
+  if (err)
+    {
+      chop_object_destroy ((chop_object_t *) tar->member_stream);
+      return err;
+    }
+
+  tar->in_member = 1;
+
+  return 0;
+}
+
+/* Read the next header block of TAR into BUFFER: the padding of the
+   previous member, if any, followed by the header records that describe the
+   next member.  Prepare to read the contents of that member, if any.  */
+static chop_error_t
+read_header_block (chop_tar_chopper_t *tar, chop_buffer_t *buffer)
+{
+  chop_error_t err;
+  size_t amount;
+  int have_pax_size = 0;
+  uint64_t pax_size = 0;
+  chop_stream_t *input = tar->chopper.stream;
+
+  chop_buffer_clear (buffer);
+
+  if (tar->padding > 0)
+    {
+      err = read_into_buffer (input, buffer, tar->padding, &amount);
+      if (err)
+	return err;
+
+      if (amount < tar->padding)
+	{
+	  /* Truncated archive.  */
+	  tar->finished = 1;
+	  return 0;
+	}
+
+      tar->padding = 0;
+    }
+
+  while (1)
+    {
+      const unsigned char *record;
+      size_t start = chop_buffer_size (buffer);
+      uint64_t size;
+      int valid;
+      char typeflag;
+
+      err = read_into_buffer (input, buffer, TAR_RECORD_SIZE, &amount);
+      if (err)
+	return err;
+
+      if (amount < TAR_RECORD_SIZE)
+	{
+	  /* End of stream: return whatever is left.  */
+	  tar->finished = 1;
+	  return 0;
+	}
+
+      record = (unsigned char *) chop_buffer_content (buffer) + start;
+
+      if (is_zero_record (record))
+	{
+	  /* End of archive: the rest of the input is zero records and
+	     padding up to the archive's blocking factor.  Return it as
+	     one block.  */
+	  chop_log_printf (&tar->log, "end of archive");
+	  do
+	    {
+	      err = read_into_buffer (input, buffer, 64 * TAR_RECORD_SIZE,
+				      &amount);
+	      if (err)
+		return err;
+	    }
+	  while (amount > 0);
+
+	  tar->finished = 1;
+	  return 0;
+	}
+
+      if (!is_valid_header (record))
+	{
+	  /* This does not look like a tar archive: hand the rest of the
+	     input to the inner chopper.  */
+	  chop_log_printf (&tar->log, "invalid header, giving up parsing");
+	  tar->opaque = 1;
+	  return (start_member (tar, SIZE_MAX));
+	}
+
+      typeflag = record[TAR_TYPEFLAG_OFFSET];
+      size = parse_number (record + TAR_SIZE_OFFSET, TAR_SIZE_LENGTH, &valid);
+      if ((!valid) || (size > SIZE_MAX - TAR_RECORD_SIZE))
+	{
+	  chop_log_printf (&tar->log, "invalid member size, giving up parsing");
+	  tar->opaque = 1;
+	  return (start_member (tar, SIZE_MAX));
+	}
+
+      switch (typeflag)
+	{
+	case 'x': /* pax extended header for the next member */
+	case 'g': /* pax global extended header */
+	case 'L': /* GNU long name for the next member */
+	case 'K': /* GNU long link name for the next member */
+	  {
+	    /* This header is followed by metadata, which is made part of
+	       the header block.  */
+	    size_t data_start = chop_buffer_size (buffer);
+	    size_t padded;
+
+	    padded = (size + TAR_RECORD_SIZE - 1)
+	      & ~((uint64_t) TAR_RECORD_SIZE - 1);
+	    err = read_into_buffer (input, buffer, padded, &amount);
+	    if (err)
+	      return err;
+
+	    if (amount < padded)
+	      {
+		tar->finished = 1;
+		return 0;
+	      }
+
+	    if (typeflag == 'x')
+	      have_pax_size =
+		parse_pax_size (chop_buffer_content (buffer) + data_start,
+				size, &pax_size);
+	    continue;
+	  }
+
+	default:
+	  break;
+	}
+
+      if (have_pax_size)
+	size = pax_size;
+
+      if (!has_contents (typeflag))
+	size = 0;
+
+      if ((size > 0) && (size <= SIZE_MAX - TAR_RECORD_SIZE))
+	{
+	  chop_log_printf (&tar->log, "member of %llu bytes, type `%c'",
+			   (unsigned long long) size, typeflag);
+
+	  tar->padding = (TAR_RECORD_SIZE - (size % TAR_RECORD_SIZE))
+	    % TAR_RECORD_SIZE;
+	  return (start_member (tar, (size_t) size));
+	}
+
+      if (size == 0)
+	/* No contents, so this header block is complete.  */
+	return 0;
+
+      tar->opaque = 1;
+      return (start_member (tar, SIZE_MAX));
+    }
+}
+
+/* Make sure TAR's next block is available, either from its member chopper
+   (in which case *FROM_MEMBER is set to non-zero) or in BUFFER.  */
+static chop_error_t
+next_block (chop_tar_chopper_t *tar, chop_buffer_t *buffer,
+	    int *from_member)
+{
+  chop_error_t err;
+
+  *from_member = 0;
+
+  while (1)
+    {
+      if (tar->in_member)
+	{
+	  *from_member = 1;
+	  return 0;
+	}
+
+      if (tar->finished)
+	return CHOP_STREAM_END;
+
+      err = read_header_block (tar, buffer);
+      if (err)
+	return err;
+
+      if (chop_buffer_size (buffer) > 0)
+	return 0;
+    }
+}
+
+/* Called when TAR's member chopper returned ERR.  Return the error code
+   that should be returned to the caller, or zero if the next block should
+   be looked for.  */
+static chop_error_t
+handle_member_end (chop_tar_chopper_t *tar, chop_error_t err)
+{
+  if (err != CHOP_STREAM_END)
+    return err;
+
+  if (chop_sub_stream_remaining (tar->member_stream) > 0)
+    {
+      /* The input ended before the end of this member.  */
+      if (!tar->opaque)
+	chop_log_printf (&tar->log, "truncated archive");
+
+      tar->finished = 1;
+    }
+
+  end_member (tar);
+
+  return 0;
+}
+
+static chop_error_t
+chop_tar_chopper_read_block_view (chop_chopper_t *chopper,
+				  chop_buffer_t *buffer,
+				  const char **block, size_t *size)
+{
+  chop_error_t err;
+  int from_member;
+  chop_tar_chopper_t *tar = (chop_tar_chopper_t *) chopper;
+
+  *size = 0;
+
+  while (1)
+    {
+      err = next_block (tar, buffer, &from_member);
+      if (err)
+	return err;
+
+      if (!from_member)
+	{
+	  *block = chop_buffer_content (buffer);
+	  *size = chop_buffer_size (buffer);
+	  return 0;
+	}
+
+      err = chop_chopper_read_block_view (tar->member_chopper, buffer,
+					  block, size);
+      if (!err)
+	return 0;
+
+      *size = 0;
+      err = handle_member_end (tar, err);
+      if (err)
+	return err;
+    }
+}
+
+static chop_error_t
+chop_tar_chopper_find_boundaries (chop_chopper_t *chopper,
+				  chop_buffer_t *buffer,
+				  const char **region,
+				  chop_block_span_t *blocks,
+				  size_t max_blocks, size_t *count)
+{
+  chop_error_t err;
+  int from_member;
+  chop_tar_chopper_t *tar = (chop_tar_chopper_t *) chopper;
+
+  *count = 0;
+
+  while (1)
+    {
+      err = next_block (tar, buffer, &from_member);
+      if (err)
+	return err;
+
+      if (!from_member)
+	{
+	  *region = chop_buffer_content (buffer);
+	  blocks[0].offset = 0;
+	  blocks[0].size = chop_buffer_size (buffer);
+	  *count = 1;
+	  return 0;
+	}
+
+      err = chop_chopper_find_boundaries (tar->member_chopper, buffer,
+					  region, blocks, max_blocks, count);
+      if (!err)
+	return 0;
+
+      *count = 0;
+      err = handle_member_end (tar, err);
+      if (err)
+	return err;
+    }
+}
+
+static chop_error_t
+chop_tar_chopper_read_block (chop_chopper_t *chopper,
+			     chop_buffer_t *buffer, size_t *size)
+{
+  chop_error_t err;
+  const char *block;
+
+  err = chop_tar_chopper_read_block_view (chopper, buffer, &block, size);
+  if ((!err) && (block != chop_buffer_content (buffer)))
+    err = chop_buffer_push (buffer, block, *size);
+
+  return err;
+}
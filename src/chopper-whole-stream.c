@@ -86,6 +86,24 @@ read_whole_stream  (chop_chopper_t *chopper,
   return err;
 }
 
+static chop_error_t
+find_whole_stream_boundaries (chop_chopper_t *chopper,
+			      chop_buffer_t *buffer,
+			      const char **region,
+			      chop_block_span_t *blocks,
+			      size_t max_blocks, size_t *count)
+{
+  chop_error_t err;
+
+  /* There's only one block anyway.  */
+  blocks[0].offset = 0;
+  err = read_whole_stream (chopper, buffer, &blocks[0].size);
+  *region = chop_buffer_content (buffer);
+  *count = (err ? 0 : 1);
+
+  return err;
+}
+
 chop_error_t
 chop_whole_stream_chopper_open (chop_stream_t *input,
 				chop_chopper_t *chopper)
@@ -100,6 +118,7 @@ chop_whole_stream_chopper_open (chop_stream_t *input,
 
   chopper->stream = input;
   chopper->read_block = read_whole_stream;
+  chopper->find_boundaries = find_whole_stream_boundaries;
   chopper->typical_block_size = 0;
   chopper->close = NULL;
 
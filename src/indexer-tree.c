@@ -31,11 +31,18 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <errno.h>
 #include <assert.h>
+#include <unistd.h>
 
-/* Glibc's obstacks */
-/* #include <obstack.h> */
+#ifdef HAVE_PTHREAD_H
+# include <pthread.h>
+#endif
+
+#ifdef __SSE2__
+# include <emmintrin.h>
+#endif
 
 /* libgcrypt */
 #include <gcrypt.h>
@@ -51,6 +58,8 @@
 # include <valgrind/memcheck.h>
 #endif
 
+#include "little-endian.h"
+
 
 /* Declare and define the `chop_tree_indexer_t' class and its run-time
    representation CHOP_TREE_INDEXER_CLASS.  */
@@ -59,6 +68,24 @@ CHOP_DECLARE_RT_CLASS (tree_indexer, indexer,
 		       /* Hash method and message digest size (in bytes) */
 		       size_t             indexes_per_block;
 
+		       /* Whether runs of zeros are recorded in key blocks
+			  rather than indexed */
+		       int                zero_block_detection;
+
+		       /* Whether key blocks record the number of bytes
+			  covered by each of their children */
+		       int                child_sizes;
+
+		       /* Number of threads that index data blocks */
+		       size_t             thread_count;
+
+		       /* Number of data blocks read ahead by streams */
+		       size_t             prefetch_blocks;
+
+		       /* Number of data blocks whose existence is checked
+			  at once before they are written */
+		       size_t             existence_checks;
+
 		       /* For debugging purposes */
 		       chop_log_t         log;);
 
@@ -91,6 +118,11 @@ iht_ctor (chop_object_t *object, const chop_class_t *class)
   htree->indexer.stream_class = &chop_tree_stream_class;
 
   htree->indexes_per_block = 0;
+  htree->zero_block_detection = 1;
+  htree->child_sizes = 0;
+  htree->thread_count = 1;
+  htree->prefetch_blocks = 0;
+  htree->existence_checks = 0;
 
   return chop_log_init ("hash-tree-indexer", &htree->log);
 }
@@ -185,13 +217,40 @@ typedef struct key_block
   struct key_block *parent;
 
   /* KEY_COUNT concatenated block keys.  This contains a header which is
-     KEY_BLOCK_HEADER_SIZE bytes long.  */
+     KEY_BLOCK_HEADER_SIZE bytes long.  Key blocks that use extensions of
+     the original format have a different second magic byte, so that older
+     decoders reject them, and the extensions they use are listed in the
+     flags byte of their header.  */
 #define KEY_BLOCK_HEADER_SIZE  (10)
 #define KEY_BLOCK_MAGIC_1      'H'
 #define KEY_BLOCK_MAGIC_2      'T'
+#define KEY_BLOCK_MAGIC_2_EXT  'X'
   chop_buffer_t keys;
   size_t        key_count;
 
+  /* Runs of zeros, which are not stored anywhere.  Each entry contains the
+     number of keys that precede the run (4 bytes), followed by the size of
+     the run (8 bytes).  When the block is flushed, they are appended to
+     KEYS along with their number (4 bytes), and the
+     KEY_BLOCK_FLAG_ZERO_RUNS flag is set.  Only depth-0 key blocks may
+     contain runs of zeros.  */
+#define KEY_BLOCK_FLAG_ZERO_RUNS     (0x01)
+#define KEY_BLOCK_ZERO_RUN_SIZE      (12)
+  chop_buffer_t zero_runs;
+  size_t        zero_run_count;
+
+  /* The number of bytes of the stream covered by each key, as 8-byte
+     little-endian integers, and the total number of bytes covered by this
+     block, including runs of zeros.  When RECORD_SIZES is true, the former
+     is appended to KEYS when the block is flushed, before the table of runs
+     of zeros, and the KEY_BLOCK_FLAG_CHILD_SIZES flag is set.  This allows
+     decoders to go straight to the data at a given offset.  */
+#define KEY_BLOCK_FLAG_CHILD_SIZES   (0x02)
+#define KEY_BLOCK_CHILD_SIZE_SIZE    (8)
+  chop_buffer_t child_sizes;
+  uint64_t      size;
+  int           record_sizes;
+
   /* Depth of this block's subtree */
   size_t depth;
 
@@ -200,15 +259,35 @@ typedef struct key_block
 } key_block_t;
 
 
+/* Key blocks are allocated from an arena that lives as long as the key
+   block tree: a list of chunks of KEY_BLOCK_CHUNK_SIZE key blocks, the
+   first of which is part of the tree itself.  Since there is one key block
+   per level of the tree, that first chunk is all it takes in practice.  */
+#define KEY_BLOCK_CHUNK_SIZE  (8)
+
+typedef struct key_block_chunk
+{
+  struct key_block_chunk *next;
+  size_t                  used;
+  key_block_t             blocks[KEY_BLOCK_CHUNK_SIZE];
+} key_block_chunk_t;
+
 /* A tree of key blocks.  */
 typedef struct key_block_tree
 {
   /* The current bottom-most key block */
   key_block_t *current;
 
+  /* The arena where key blocks are allocated, and its last chunk */
+  key_block_chunk_t  arena;
+  key_block_chunk_t *last_chunk;
+
   /* Number of keys per key block */
   size_t indexes_per_block;
 
+  /* Whether key blocks record the sizes of their children */
+  int record_sizes;
+
   /* Meta-data block store: the block store where key blocks are flushed */
   chop_block_store_t *metadata_store;
 
@@ -226,10 +305,15 @@ static char zero_vector[4000] = { 0, };
 /* Initialize key block tree TREE.  */
 static inline void
 chop_block_tree_init (key_block_tree_t *tree, size_t indexes_per_block,
+		      int record_sizes,
 		      chop_block_store_t *metadata_store, chop_log_t *log)
 {
   tree->current = NULL;
+  tree->arena.next = NULL;
+  tree->arena.used = 0;
+  tree->last_chunk = &tree->arena;
   tree->indexes_per_block = indexes_per_block;
+  tree->record_sizes = record_sizes;
   tree->metadata_store = metadata_store;
   tree->log = log;
 }
@@ -241,14 +325,20 @@ chop_key_block_fill_header (key_block_t *block)
 {
   size_t count = block->key_count;
   size_t depth = block->depth;
+  unsigned flags = 0;
   unsigned char *header, *start;
 
   header = start = (unsigned char *)chop_buffer_content (&block->keys);
 
   assert (chop_buffer_size (&block->keys) >= KEY_BLOCK_HEADER_SIZE);
 
+  if (block->zero_run_count > 0)
+    flags |= KEY_BLOCK_FLAG_ZERO_RUNS;
+  if (block->record_sizes)
+    flags |= KEY_BLOCK_FLAG_CHILD_SIZES;
+
   *(header++) = KEY_BLOCK_MAGIC_1;
-  *(header++) = KEY_BLOCK_MAGIC_2;
+  *(header++) = flags ? KEY_BLOCK_MAGIC_2_EXT : KEY_BLOCK_MAGIC_2;
 
   *(header++) = (count & 0xff);  count >>= 8;
   *(header++) = (count & 0xff);  count >>= 8;
@@ -260,6 +350,8 @@ chop_key_block_fill_header (key_block_t *block)
   *(header++) = (depth & 0xff);  depth >>= 8;
   assert (!depth);
 
+  *(header++) = flags;
+
   assert (header - start <= KEY_BLOCK_HEADER_SIZE);
 
   /* Don't leave uninitialized bytes.  */
@@ -285,6 +377,32 @@ chop_key_block_flush (key_block_t *block,
 
   chop_key_block_fill_header (block);
 
+  if (block->record_sizes)
+    {
+      /* Append the table of child sizes.  */
+      err = chop_buffer_append (&block->keys,
+				chop_buffer_content (&block->child_sizes),
+				chop_buffer_size (&block->child_sizes));
+      if (err)
+	return err;
+    }
+
+  if (block->zero_run_count > 0)
+    {
+      /* Append the table of runs of zeros.  */
+      unsigned char count[4];
+
+      store_little_endian (count, block->zero_run_count, sizeof (count));
+      err = chop_buffer_append (&block->keys,
+				chop_buffer_content (&block->zero_runs),
+				chop_buffer_size (&block->zero_runs));
+      if (!err)
+	err = chop_buffer_append (&block->keys, (char *) count,
+				  sizeof (count));
+      if (err)
+	return err;
+    }
+
   /* FIXME:  Maybe we should pad BLOCK->KEYS with zero and create fixed-size
      blocks.  */
 /*   block_size = KEY_BLOCK_HEADER_SIZE + (block->key_count * block->key_size); */
@@ -299,7 +417,7 @@ chop_key_block_flush (key_block_t *block,
 
 /* Initialize the key block pointed to by BLOCK.  */
 static inline chop_error_t
-chop_key_block_init (size_t indexes_per_block,
+chop_key_block_init (size_t indexes_per_block, int record_sizes,
 		     chop_log_t *log,
 		     key_block_t *block)
 {
@@ -315,11 +433,34 @@ chop_key_block_init (size_t indexes_per_block,
   err = chop_buffer_push (&block->keys, fake_header,
 			  KEY_BLOCK_HEADER_SIZE);
   if (err)
-    return err;
+    {
+      chop_buffer_return (&block->keys);
+      return err;
+    }
+
+  err = chop_buffer_init (&block->zero_runs, 0);
+  if (err)
+    {
+      chop_buffer_return (&block->keys);
+      return err;
+    }
+
+  err = chop_buffer_init (&block->child_sizes,
+			  record_sizes
+			  ? indexes_per_block * KEY_BLOCK_CHILD_SIZE_SIZE : 0);
+  if (err)
+    {
+      chop_buffer_return (&block->zero_runs);
+      chop_buffer_return (&block->keys);
+      return err;
+    }
 
   block->parent = NULL;
   block->depth = 0;
   block->key_count = 0;
+  block->zero_run_count = 0;
+  block->size = 0;
+  block->record_sizes = record_sizes;
   block->log = log;
 
   return 0;
@@ -337,31 +478,42 @@ chop_key_block_reinit (key_block_t *block)
   chop_buffer_push (&block->keys, fake_header,
 		    KEY_BLOCK_HEADER_SIZE);
 
+  chop_buffer_clear (&block->zero_runs);
+  chop_buffer_clear (&block->child_sizes);
+
   block->key_count = 0;
+  block->zero_run_count = 0;
+  block->size = 0;
 }
 
-/* Allocate and initialize a new key block and return it in BLOCK.  */
+/* Allocate a new key block from the arena of TREE, initialize it, and
+   return it in BLOCK.  */
 static inline chop_error_t
-chop_key_block_new (size_t indexes_per_block,
-		    chop_log_t *log,
-		    key_block_t **block)
+chop_key_block_new (key_block_tree_t *tree, key_block_t **block)
 {
   chop_error_t err;
+  key_block_chunk_t *chunk = tree->last_chunk;
 
-  /* XXX: Use obstacks.  */
-  *block = (key_block_t *) chop_malloc (sizeof (key_block_t),
-					&chop_tree_indexer_class);
-  if (!*block)
-    return ENOMEM;
-
-  err = chop_key_block_init (indexes_per_block,
-			     log, *block);
-  if (err)
+  if (chunk->used == KEY_BLOCK_CHUNK_SIZE)
     {
-      chop_free (*block, &chop_tree_indexer_class);
-      *block = NULL;
+      chunk = chop_malloc (sizeof (*chunk), &chop_tree_indexer_class);
+      if (!chunk)
+	return ENOMEM;
+
+      chunk->next = NULL;
+      chunk->used = 0;
+      tree->last_chunk->next = chunk;
+      tree->last_chunk = chunk;
     }
 
+  *block = &chunk->blocks[chunk->used];
+  err = chop_key_block_init (tree->indexes_per_block, tree->record_sizes,
+			     tree->log, *block);
+  if (err)
+    *block = NULL;
+  else
+    chunk->used++;
+
   return err;
 }
 
@@ -369,24 +521,62 @@ static inline void
 chop_key_block_destroy (key_block_t *block)
 {
   chop_buffer_return (&block->keys);
+  chop_buffer_return (&block->zero_runs);
+  chop_buffer_return (&block->child_sizes);
   block->parent = NULL;
   block->log = NULL;
-  block->depth = block->key_count = 0;
+  block->depth = block->key_count = block->zero_run_count = 0;
+}
+
+/* Append a run of SIZE zeros to BLOCK, right after its last key.  */
+static chop_error_t
+chop_key_block_add_zero_run (key_block_t *block, size_t size)
+{
+  unsigned char entry[KEY_BLOCK_ZERO_RUN_SIZE];
+
+  assert (block->depth == 0);
+
+  block->size += size;
+
+  if (block->zero_run_count > 0)
+    {
+      /* Merge it with the previous run when they are contiguous.  */
+      unsigned char *last;
+      uint64_t last_size;
+
+      last = (unsigned char *) chop_buffer_content (&block->zero_runs)
+	+ chop_buffer_size (&block->zero_runs) - KEY_BLOCK_ZERO_RUN_SIZE;
+      last_size = load_little_endian (last + 4, 8);
+
+      if ((load_little_endian (last, 4) == block->key_count)
+	  && (last_size <= SIZE_MAX - size))
+	{
+	  store_little_endian (last + 4, last_size + size, 8);
+	  return 0;
+	}
+    }
+
+  store_little_endian (entry, block->key_count, 4);
+  store_little_endian (entry + 4, size, 8);
+  block->zero_run_count++;
+
+  return (chop_buffer_append (&block->zero_runs, (char *) entry,
+			      sizeof (entry)));
 }
 
 
-/* Append INDEX to BLOCK which can contain at most INDEXES_PER_BLOCK block keys.
-   When full, BLOCK is written to METADATA and its contents are reset.  */
+/* Append INDEX, the index of a child that covers SIZE bytes of the stream,
+   to BLOCK, a key block of TREE.  When full, BLOCK is written to TREE's
+   meta-data store and its contents are reset.  */
 static chop_error_t
-chop_key_block_add_index (key_block_t *block, size_t indexes_per_block,
-			  chop_block_store_t *metadata,
+chop_key_block_add_index (key_block_tree_t *tree, key_block_t *block,
 			  chop_block_indexer_t *block_indexer,
-			  const chop_index_handle_t *index)
+			  const chop_index_handle_t *index,
+			  uint64_t size)
 {
   chop_error_t err;
-  chop_buffer_t buffer;
 
-  if (block->key_count + 1 >= indexes_per_block)
+  if (block->key_count + 1 >= tree->indexes_per_block)
     {
       /* This key block is full:
 	 1.  flush it;
@@ -398,15 +588,15 @@ chop_key_block_add_index (key_block_t *block, size_t indexes_per_block,
 
       index_class = chop_object_get_class ((chop_object_t *)index);
       block_index = chop_class_alloca_instance (index_class);
-      err = chop_key_block_flush (block, block_indexer, metadata, block_index);
+      err = chop_key_block_flush (block, block_indexer, tree->metadata_store,
+				  block_index);
       if (err)
 	return err;
 
       if (!parent)
 	{
 	  /* BLOCK is orphan: create him a parent key block.  */
-	  err = chop_key_block_new (indexes_per_block,
-				    block->log, &parent);
+	  err = chop_key_block_new (tree, &parent);
 	  if (err)
 	    {
 	      chop_object_destroy ((chop_object_t *)block_index);
@@ -418,8 +608,8 @@ chop_key_block_add_index (key_block_t *block, size_t indexes_per_block,
 	}
 
       /* Recursive call.  */
-      err = chop_key_block_add_index (parent, indexes_per_block, metadata,
-				      block_indexer, block_index);
+      err = chop_key_block_add_index (tree, parent, block_indexer,
+				      block_index, block->size);
       if (err)
 	{
 	  chop_object_destroy ((chop_object_t *)block_index);
@@ -432,46 +622,41 @@ chop_key_block_add_index (key_block_t *block, size_t indexes_per_block,
       chop_object_destroy ((chop_object_t *)block_index);
     }
 
-  /* Append a binary serialization of INDEX.  */
-
-#if 0
-  /* FIXME: This assertion must eventually vanish because it assumes that all
-     indices have the same serialized size.  */
-  assert (chop_buffer_size (&block->keys)
-	  == KEY_BLOCK_HEADER_SIZE
-	  + (block->key_count * chop_index_handle_binary_size (index)));
-#endif
-
-  chop_buffer_init (&buffer, chop_index_handle_binary_size (index));
-  err = chop_object_serialize ((chop_object_t *)index, CHOP_SERIAL_BINARY,
-			       &buffer);
+  /* Append a binary serialization of INDEX, in place.  */
+  err = chop_index_handle_append_binary (index, &block->keys);
   if (err)
     {
       chop_log_printf (block->log, "failed to binary-serialize `%s' index",
 		       chop_class_name
 		       (chop_object_get_class ((chop_object_t *)index)));
-      goto finish;
+      return err;
     }
 
-  assert (chop_buffer_size (&buffer) == chop_index_handle_binary_size (index));
-  err = chop_buffer_append (&block->keys,   /* FIXME: Inefficient */
-			    chop_buffer_content (&buffer),
-			    chop_buffer_size (&buffer));
+  if (block->record_sizes)
+    {
+      char *entry;
+
+      err = chop_buffer_extend (&block->child_sizes,
+				KEY_BLOCK_CHILD_SIZE_SIZE, &entry);
+      if (err)
+	return err;
 
-  if (!err)
-    block->key_count++;
+      store_little_endian ((unsigned char *) entry, size,
+			   KEY_BLOCK_CHILD_SIZE_SIZE);
+    }
 
- finish:
-  chop_buffer_return (&buffer);
+  block->key_count++;
+  block->size += size;
 
-  return err;
+  return 0;
 }
 
-/* Append INDEX to TREE.  */
+/* Append INDEX, the index of a SIZE-byte data block, to TREE.  */
 static chop_error_t
 chop_block_tree_add_index (key_block_tree_t *tree,
 			   chop_block_indexer_t *block_indexer,
-			   const chop_index_handle_t *index)
+			   const chop_index_handle_t *index,
+			   size_t size)
 {
   chop_error_t err = 0;
   key_block_t *current;
@@ -479,8 +664,7 @@ chop_block_tree_add_index (key_block_tree_t *tree,
   if (!tree->current)
     {
       /* Allocate a new block tree */
-      err = chop_key_block_new (tree->indexes_per_block,
-				tree->log, &tree->current);
+      err = chop_key_block_new (tree, &tree->current);
       if (err)
 	return err;
 
@@ -489,20 +673,39 @@ chop_block_tree_add_index (key_block_tree_t *tree,
 
   current = tree->current;
 
-  err = chop_key_block_add_index (current, tree->indexes_per_block,
-				  tree->metadata_store,
-				  block_indexer, index);
+  err = chop_key_block_add_index (tree, current, block_indexer, index, size);
 
   return err;
 }
 
 
+/* Append a run of SIZE zeros to TREE.  */
+static chop_error_t
+chop_block_tree_add_zero_run (key_block_tree_t *tree, size_t size)
+{
+  chop_error_t err;
+
+  if (!tree->current)
+    {
+      err = chop_key_block_new (tree, &tree->current);
+      if (err)
+	return err;
+
+      tree->current->depth = 0;
+    }
+
+  return (chop_key_block_add_zero_run (tree->current, size));
+}
+
+
 /* Flush all the pending key blocks of TREE and return the key of the
-   top-level key block in ROOT_INDEX.  */
+   top-level key block in ROOT_INDEX.  If ROOT_INDEX_INITIALIZED is true,
+   ROOT_INDEX is initially the index of the last block added to TREE.  */
 static chop_error_t
 chop_block_tree_flush (key_block_tree_t *tree,
 		       chop_block_indexer_t *block_indexer,
-		       chop_index_handle_t *root_index)
+		       chop_index_handle_t *root_index,
+		       int root_index_initialized)
 {
   chop_error_t err = 0;
   key_block_t *block;
@@ -513,7 +716,9 @@ chop_block_tree_flush (key_block_tree_t *tree,
        block = block->parent)
     {
       /* Destroy the previous index.  */
-      chop_object_destroy ((chop_object_t *) root_index);
+      if (root_index_initialized)
+	chop_object_destroy ((chop_object_t *) root_index);
+      root_index_initialized = 1;
 
       depth++;
       last_depth = block->depth;
@@ -525,9 +730,8 @@ chop_block_tree_flush (key_block_tree_t *tree,
 
       if (block->parent)
 	/* Add the key of the newly flushed block to its parent */
-	err = chop_key_block_add_index (block->parent, tree->indexes_per_block,
-					tree->metadata_store,
-					block_indexer, root_index);
+	err = chop_key_block_add_index (tree, block->parent, block_indexer,
+					root_index, block->size);
     }
 
   if (!err)
@@ -548,24 +752,67 @@ chop_block_tree_flush (key_block_tree_t *tree,
 static void
 chop_block_tree_free (key_block_tree_t *tree)
 {
-  key_block_t *block, *parent;
+  key_block_chunk_t *chunk, *next;
+  size_t block;
 
-  for (block = tree->current;
-       block != NULL;
-       block = parent)
+  for (chunk = &tree->arena;
+       chunk != NULL;
+       chunk = next)
     {
-      parent = block->parent;
-      chop_key_block_destroy (block);
-      chop_free (block, &chop_tree_indexer_class);
+      next = chunk->next;
+
+      for (block = 0; block < chunk->used; block++)
+	chop_key_block_destroy (&chunk->blocks[block]);
+
+      if (chunk != &tree->arena)
+	chop_free (chunk, &chop_tree_indexer_class);
     }
+
+  tree->current = NULL;
+  tree->arena.next = NULL;
+  tree->arena.used = 0;
+  tree->last_chunk = &tree->arena;
 }
 
 
 /* Implementation of the indexer interface.  */
 
+/* Maximum number of blocks read at once from the input chopper.  */
+#define TREE_INDEXER_BATCH_SIZE  (128)
+
+/* Return true if the SIZE bytes at DATA are all zeros.  */
+static inline int
+is_zero_block (const char *data, size_t size)
+{
+  size_t i = 0;
+
+#ifdef __SSE2__
+  const __m128i zero = _mm_setzero_si128 ();
+
+  for (; i + 64 <= size; i += 64)
+    {
+      __m128i chunk;
+      const __m128i *p = (const __m128i *) (data + i);
+
+      chunk = _mm_or_si128 (_mm_or_si128 (_mm_loadu_si128 (p),
+					  _mm_loadu_si128 (p + 1)),
+			    _mm_or_si128 (_mm_loadu_si128 (p + 2),
+					  _mm_loadu_si128 (p + 3)));
+      if (_mm_movemask_epi8 (_mm_cmpeq_epi8 (chunk, zero)) != 0xffff)
+	return 0;
+    }
+#endif
+
+  for (; i < size; i++)
+    if (data[i])
+      return 0;
+
+  return 1;
+}
 
 static chop_error_t tree_stream_read (chop_stream_t *, char *,
 				      size_t, size_t *);
+static chop_error_t tree_stream_seek (chop_stream_t *, uint64_t);
 
 static void tree_stream_close (chop_stream_t *);
 
@@ -613,161 +860,1743 @@ chop_tree_indexer_log (chop_indexer_t *indexer)
   return (&htree->log);
 }
 
-
-static chop_error_t
-chop_tree_index_blocks (chop_indexer_t *indexer,
-			chop_chopper_t *input,
-			chop_block_indexer_t *block_indexer,
-			chop_block_store_t *output,
-			chop_block_store_t *metadata,
-			chop_index_handle_t *index)
+void
+chop_tree_indexer_set_zero_block_detection (chop_indexer_t *indexer,
+					    int detect)
 {
-  chop_error_t err = 0;
-  int first = 1;
   chop_tree_indexer_t *htree = (chop_tree_indexer_t *)indexer;
-  size_t amount, total_amount = 0;
-  chop_buffer_t buffer;
-  key_block_tree_t tree;
 
-  chop_block_tree_init (&tree, htree->indexes_per_block,
-			metadata, &htree->log);
+  htree->zero_block_detection = detect;
+}
 
-  err = chop_buffer_init (&buffer,
-			  chop_chopper_typical_block_size (input));
-  if (err)
-    return err;
+void
+chop_tree_indexer_set_child_sizes (chop_indexer_t *indexer, int record)
+{
+  chop_tree_indexer_t *htree = (chop_tree_indexer_t *)indexer;
 
-  /* Read blocks from INPUT until the underlying stream returns
-     CHOP_STREAM_END.  Keep a copy of each block key.  */
-  while (1)
-    {
-      chop_buffer_clear (&buffer);
-      err = chop_chopper_read_block (input, &buffer, &amount);
-      if (err)
-	break;
+  htree->child_sizes = record;
+}
 
-      if (!amount)
-	continue;
+void
+chop_tree_indexer_set_thread_count (chop_indexer_t *indexer,
+				    size_t thread_count)
+{
+  chop_tree_indexer_t *htree = (chop_tree_indexer_t *)indexer;
 
-      total_amount += amount;
+  htree->thread_count = thread_count;
+}
 
-      if (CHOP_EXPECT_FALSE (first))
-	first = 0;
-      else
-	/* Destroy the index of the previous block.  */
-	chop_object_destroy ((chop_object_t *) index);
+void
+chop_tree_indexer_set_prefetch (chop_indexer_t *indexer, size_t blocks)
+{
+  chop_tree_indexer_t *htree = (chop_tree_indexer_t *)indexer;
 
-#ifdef HAVE_VALGRIND_MEMCHECK_H
-      VALGRIND_CHECK_MEM_IS_DEFINED (chop_buffer_content (&buffer),
-				     chop_buffer_size (&buffer));
-#endif
+  htree->prefetch_blocks = blocks;
+}
 
-      /* Store this block and get its index */
-      err = chop_block_indexer_index (block_indexer, output,
-				      chop_buffer_content (&buffer),
-				      chop_buffer_size (&buffer),
-				      index);
-      if (err)
-	{
-	  chop_log_printf (&htree->log, "failed to index block: %s",
-			   chop_error_message (err));
-	  break;
-	}
+void
+chop_tree_indexer_set_existence_checks (chop_indexer_t *indexer,
+					size_t blocks)
+{
+  chop_tree_indexer_t *htree = (chop_tree_indexer_t *)indexer;
 
-      /* Add this block key to our block key tree */
-      chop_block_tree_add_index (&tree, block_indexer, index);
-    }
+  htree->existence_checks = blocks;
+}
 
-  if ((err == CHOP_STREAM_END) && (total_amount > 0))
-    /* Flush the key block tree and get its key.  Here, we get the
-       top-level index handle.  */
-    err = chop_block_tree_flush (&tree, block_indexer, index);
+#ifdef HAVE_PTHREAD_H
 
-  /* Free memory associated with TREE */
-  chop_block_tree_free (&tree);
+/* Return the number of threads HTREE should use, i.e., its thread count or
+   the number of processors if it is zero.  */
+static size_t
+tree_indexer_thread_count (const chop_tree_indexer_t *htree)
+{
+  size_t thread_count = htree->thread_count;
 
-  chop_buffer_return (&buffer);
+  if (thread_count == 0)
+    {
+#ifdef _SC_NPROCESSORS_ONLN
+      long processors = sysconf (_SC_NPROCESSORS_ONLN);
 
-  if (total_amount == 0)
-    /* Nothing was read so INDEX is kept uninitialized.  */
-    err = CHOP_INDEXER_EMPTY_SOURCE;
+      thread_count = (processors > 0) ? (size_t) processors : 1;
+#else
+      thread_count = 1;
+#endif
+    }
 
-  return err;
+  return thread_count;
 }
 
+#endif /* HAVE_PTHREAD_H */
 
 
-/* Hash tree stream implementation (for retrieval).  */
+/* Deferred writes.  */
+
+/* A block store that records the blocks written to it instead of storing
+   them, so that worker threads can run block indexers while the calling
+   thread eventually writes blocks to the actual store, in input order,
+   and so that the existence of several blocks can be checked at once
+   before they are written.  Each record of WRITES is a `deferred_write_t'
+   followed by the key of the block and then its contents; COUNT is the
+   number of records.  */
+CHOP_DECLARE_RT_CLASS (deferred_block_store, block_store,
+		       chop_buffer_t *writes;
+		       size_t count;);
+
+typedef struct
+{
+  size_t key_size;
+  size_t size;
+} deferred_write_t;
 
+static chop_error_t
+deferred_store_read_block (chop_block_store_t *store,
+			   const chop_block_key_t *key,
+			   chop_buffer_t *buffer, size_t *size)
+{
+  *size = 0;
+  return CHOP_ERR_NOT_IMPL;
+}
 
-typedef struct decoded_block
+static chop_error_t
+deferred_store_write_block (chop_block_store_t *store,
+			    const chop_block_key_t *key,
+			    const char *block, size_t size)
 {
-  /* The raw buffer and its size */
-  chop_buffer_t buffer;
+  chop_error_t err;
+  deferred_write_t write;
+  chop_deferred_block_store_t *deferred =
+    (chop_deferred_block_store_t *)store;
 
-  /* Offset within this raw buffer */
-  size_t offset;
+  write.key_size = chop_block_key_size (key);
+  write.size = size;
 
-  /* Non-zero if this represents a key block (aka. "inode") */
-  int is_key_block;
+  err = chop_buffer_append (deferred->writes, (char *) &write,
+			    sizeof (write));
+  if (!err)
+    err = chop_buffer_append (deferred->writes,
+			      chop_block_key_buffer (key), write.key_size);
+  if (!err)
+    err = chop_buffer_append (deferred->writes, block, size);
+  if (!err)
+    deferred->count++;
 
-  /* If this is a key block, this represents its height within the tree,
-     starting from the lowest key blocks (data blocks being bottommost).  */
-  size_t depth;
+  return err;
+}
 
-  /* If this is a key block, this is the total number of children it has.  */
-  size_t key_count;
+static chop_error_t
+deferred_store_sync (chop_block_store_t *store)
+{
+  return 0;
+}
 
-  /* If this is a key block, this points to its current child.  We don't keep
-     all blocks in memory.  */
-  struct decoded_block *current_child;
+static chop_error_t
+deferred_store_close (chop_block_store_t *store)
+{
+  return 0;
+}
 
-  /* If this is a key block, this is the number of CURRENT_CHILD, i.e. an
-     integer between zero and KEY_COUNT.  */
-  size_t current_child_number;
+static chop_error_t
+dbs_ctor (chop_object_t *object, const chop_class_t *class)
+{
+  chop_deferred_block_store_t *deferred =
+    (chop_deferred_block_store_t *)object;
 
-  /* The parent block */
-  struct decoded_block *parent;
+  deferred->block_store.read_block = deferred_store_read_block;
+  deferred->block_store.write_block = deferred_store_write_block;
+  deferred->block_store.sync = deferred_store_sync;
+  deferred->block_store.close = deferred_store_close;
+  deferred->writes = NULL;
+  deferred->count = 0;
 
-  /* If this is a data block, this represents its offset within the stream
-     being decoded.  */
-  size_t stream_offset;
+  return 0;
+}
 
-  /* Pointer to the stream's log */
-  chop_log_t *log;
-} decoded_block_t;
+CHOP_DEFINE_RT_CLASS (deferred_block_store, block_store,
+		      dbs_ctor, NULL,
+		      NULL, NULL,
+		      NULL, NULL);
 
-typedef struct decoded_block_tree
+/* Existence checks of the blocks to be written, SIZE blocks at a time.
+   When SIZE is zero, blocks are written without being checked.  */
+typedef struct
 {
-  chop_block_store_t *data_store;
-  chop_block_store_t *metadata_store;
-  chop_index_handle_t *index;
-  chop_block_fetcher_t *fetcher;
+  size_t             size;
+  chop_block_key_t  *keys;
+  bool              *exists;
+  const char       **records;
+} existence_checks_t;
 
-  decoded_block_t *top_level;
-  size_t current_offset;
-  chop_log_t *log;
-} decoded_block_tree_t;
+/* Initialize CHECKS to check the existence of SIZE blocks at a time.  */
+static chop_error_t
+existence_checks_init (existence_checks_t *checks, size_t size)
+{
+  checks->size = size;
+  checks->keys = NULL;
+  checks->exists = NULL;
+  checks->records = NULL;
 
+  if (size > 0)
+    {
+      checks->keys = chop_malloc (size * sizeof (*checks->keys),
+				  &chop_tree_indexer_class);
+      checks->exists = chop_malloc (size * sizeof (*checks->exists),
+				    &chop_tree_indexer_class);
+      checks->records = chop_malloc (size * sizeof (*checks->records),
+				     &chop_tree_indexer_class);
+      if ((!checks->keys) || (!checks->exists) || (!checks->records))
+	return ENOMEM;
+    }
 
+  return 0;
+}
 
-
-/* Hash tree stream objects are returned by CHOP_INDEXER_FETCH_STREAM when
-   reading from a hash-tree-indexed stream.  */
-CHOP_DECLARE_RT_CLASS (tree_stream, stream,
-		       decoded_block_tree_t tree;
-		       chop_log_t log;);
+static void
+existence_checks_destroy (existence_checks_t *checks)
+{
+  chop_free (checks->keys, &chop_tree_indexer_class);
+  chop_free (checks->exists, &chop_tree_indexer_class);
+  chop_free (checks->records, &chop_tree_indexer_class);
+  checks->keys = NULL;
+  checks->exists = NULL;
+  checks->records = NULL;
+  checks->size = 0;
+}
 
+/* Write to STORE the blocks recorded in WRITES by a deferred block store.
+   Unless the size of CHECKS is zero, first check which of them exist in
+   STORE, with one call to `chop_store_blocks_exist ()' for every CHECKS
+   blocks, and write only the others.  If STORE cannot check the existence
+   of blocks, existence checks are disabled in CHECKS.  */
+static chop_error_t
+deferred_writes_replay (const chop_buffer_t *writes,
+			chop_block_store_t *store,
+			existence_checks_t *checks)
+{
+  chop_error_t err = 0;
+  const char *p, *end;
+  deferred_write_t write;
+  chop_block_key_t key;
 
+  p = chop_buffer_content (writes);
+  end = p + chop_buffer_size (writes);
 
-static inline chop_error_t
-chop_decoded_block_tree_init (decoded_block_tree_t *tree,
-			      chop_block_store_t *data_store,
-			      chop_block_store_t *metadata_store,
-			      const chop_index_handle_t *handle,
-			      chop_block_fetcher_t *fetcher,
-			      chop_log_t *log)
-{
+  while ((p < end) && (!err))
+    {
+      size_t count, i;
+
+      if (checks->size == 0)
+	{
+	  memcpy (&write, p, sizeof (write));
+	  p += sizeof (write);
+
+	  chop_block_key_init (&key, (char *) p, write.key_size, NULL, NULL);
+	  err = chop_store_write_block (store, &key, p + write.key_size,
+					write.size);
+
+	  p += write.key_size + write.size;
+	  continue;
+	}
+
+      for (count = 0; (count < checks->size) && (p < end); count++)
+	{
+	  checks->records[count] = p;
+
+	  memcpy (&write, p, sizeof (write));
+	  p += sizeof (write);
+
+	  chop_block_key_init (&checks->keys[count], (char *) p,
+			       write.key_size, NULL, NULL);
+	  p += write.key_size + write.size;
+	}
+
+      err = chop_store_blocks_exist (store, count, checks->keys,
+				     checks->exists);
+      if (err == CHOP_ERR_NOT_IMPL)
+	{
+	  /* Write every block from now on.  */
+	  memset (checks->exists, 0, count * sizeof (*checks->exists));
+	  checks->size = 0;
+	  err = 0;
+	}
+
+      for (i = 0; (i < count) && (!err); i++)
+	{
+	  if (checks->exists[i])
+	    continue;
+
+	  memcpy (&write, checks->records[i], sizeof (write));
+	  err = chop_store_write_block (store, &checks->keys[i],
+					checks->records[i] + sizeof (write)
+					+ write.key_size,
+					write.size);
+	}
+    }
+
+  return err;
+}
+
+/* Write the blocks recorded by DEFERRED to STORE, subject to CHECKS, and
+   clear them.  */
+static chop_error_t
+deferred_store_flush (chop_deferred_block_store_t *deferred,
+		      chop_block_store_t *store, existence_checks_t *checks)
+{
+  chop_error_t err;
+
+  err = deferred_writes_replay (deferred->writes, store, checks);
+  chop_buffer_clear (deferred->writes);
+  deferred->count = 0;
+
+  return err;
+}
+
+
+/* Parallel indexing.  */
+
+#ifdef HAVE_PTHREAD_H
+
+/* Number of batches in flight per worker thread.  */
+#define TREE_INDEXER_BATCHES_PER_THREAD  (2)
+
+/* What a worker found out about a block.  */
+typedef enum
+  {
+    BLOCK_EMPTY = 0,
+    BLOCK_ZERO,
+    BLOCK_INDEXED
+  } batch_block_kind_t;
+
+/* A batch of consecutive blocks going through the indexing pipeline.  */
+typedef struct tree_batch
+{
+  struct tree_batch *next;
+
+  /* Position of this batch in the input */
+  uint64_t sequence;
+
+  /* The COUNT blocks of this batch, within REGION, which points to DATA's
+     contents */
+  chop_buffer_t data;
+  const char *region;
+  chop_block_span_t blocks[TREE_INDEXER_BATCH_SIZE];
+  size_t count;
+
+  /* The number of blocks handled by a worker, what each of them is, and
+     the index handles of the indexed ones */
+  size_t processed;
+  unsigned char kind[TREE_INDEXER_BATCH_SIZE];
+  char *handles;
+
+  /* The blocks written while indexing this batch */
+  chop_buffer_t writes;
+
+  /* CHOP_STREAM_END for the last batch, or an error */
+  chop_error_t err;
+} tree_batch_t;
+
+struct tree_pipeline;
+
+/* A worker thread, with its own copy of the block indexer.  */
+typedef struct
+{
+  struct tree_pipeline *pipeline;
+
+  chop_block_indexer_t *block_indexer;
+  chop_deferred_block_store_t store;
+
+  pthread_t thread;
+  int       spawned;
+} tree_worker_t;
+
+/* The indexing pipeline: the chopper thread reads batches of blocks from
+   INPUT into free batches and queues them in PENDING; workers index them
+   and move them to INDEXED; the calling thread takes them from INDEXED in
+   input order, adds them to the key block tree and returns them to
+   FREE_BATCHES.  The number of batches, and thus memory usage, is
+   bounded.  */
+typedef struct tree_pipeline
+{
+  chop_tree_indexer_t *htree;
+  chop_chopper_t      *input;
+
+  size_t handle_size;
+
+  pthread_mutex_t lock;
+  pthread_cond_t  changed;
+
+  tree_batch_t *free_batches;
+  tree_batch_t *pending, *pending_tail;
+  tree_batch_t *indexed;
+
+  /* Non-zero when threads must terminate */
+  int stop;
+
+  pthread_t chopper_thread;
+  int       chopper_spawned;
+
+  size_t         worker_count;
+  tree_worker_t *workers;
+
+  size_t        batch_count;
+  tree_batch_t *batches;
+} tree_pipeline_t;
+
+#define BATCH_HANDLE(_pipeline, _batch, _block)				\
+  ((chop_index_handle_t *) ((_batch)->handles				\
+			    + (_block) * (_pipeline)->handle_size))
+
+/* Return BATCH to the free batches of PIPELINE.  */
+static void
+tree_pipeline_release (tree_pipeline_t *pipeline, tree_batch_t *batch)
+{
+  pthread_mutex_lock (&pipeline->lock);
+  batch->next = pipeline->free_batches;
+  pipeline->free_batches = batch;
+  pthread_cond_broadcast (&pipeline->changed);
+  pthread_mutex_unlock (&pipeline->lock);
+}
+
+/* The chopper thread.  */
+static void *
+tree_pipeline_chop (void *data)
+{
+  chop_error_t err = 0;
+  uint64_t sequence = 0;
+  tree_pipeline_t *pipeline = (tree_pipeline_t *) data;
+
+  while (1)
+    {
+      tree_batch_t *batch;
+      const char *region;
+
+      pthread_mutex_lock (&pipeline->lock);
+      while ((pipeline->free_batches == NULL) && (!pipeline->stop))
+	pthread_cond_wait (&pipeline->changed, &pipeline->lock);
+
+      batch = pipeline->stop ? NULL : pipeline->free_batches;
+      if (batch)
+	pipeline->free_batches = batch->next;
+      pthread_mutex_unlock (&pipeline->lock);
+
+      if (!batch)
+	break;
+
+      batch->count = 0;
+      batch->processed = 0;
+
+      chop_buffer_clear (&batch->data);
+      err = chop_chopper_find_boundaries (pipeline->input, &batch->data,
+					  &region, batch->blocks,
+					  TREE_INDEXER_BATCH_SIZE,
+					  &batch->count);
+      if ((!err) && (batch->count > 0))
+	{
+	  const char *content = chop_buffer_content (&batch->data);
+
+	  if ((region >= content)
+	      && (region < content + chop_buffer_size (&batch->data)))
+	    /* REGION is in BATCH's own buffer, which remains valid until
+	       BATCH is reused.  */
+	    batch->region = region;
+	  else
+	    {
+	      /* REGION is internal to the chopper and only valid until the
+		 next call, so copy it.  */
+	      const chop_block_span_t *last;
+
+	      last = &batch->blocks[batch->count - 1];
+	      err = chop_buffer_push (&batch->data, region,
+				      last->offset + last->size);
+	      batch->region = chop_buffer_content (&batch->data);
+	    }
+	}
+
+      if (err)
+	batch->count = 0;
+
+      batch->err = err;
+      batch->sequence = sequence++;
+      batch->next = NULL;
+
+      pthread_mutex_lock (&pipeline->lock);
+      if (pipeline->pending_tail)
+	pipeline->pending_tail->next = batch;
+      else
+	pipeline->pending = batch;
+      pipeline->pending_tail = batch;
+      pthread_cond_broadcast (&pipeline->changed);
+      pthread_mutex_unlock (&pipeline->lock);
+
+      if (err)
+	/* This includes CHOP_STREAM_END.  */
+	break;
+    }
+
+  return NULL;
+}
+
+/* Index the blocks of BATCH with WORKER's block indexer.  */
+static void
+tree_batch_index (tree_worker_t *worker, tree_batch_t *batch)
+{
+  chop_error_t err = 0;
+  size_t block;
+  tree_pipeline_t *pipeline = worker->pipeline;
+
+  chop_buffer_clear (&batch->writes);
+  worker->store.writes = &batch->writes;
+
+  for (block = 0; block < batch->count; block++)
+    {
+      const char *data = batch->region + batch->blocks[block].offset;
+      size_t size = batch->blocks[block].size;
+
+      if (!size)
+	batch->kind[block] = BLOCK_EMPTY;
+      else if (pipeline->htree->zero_block_detection
+	       && is_zero_block (data, size))
+	batch->kind[block] = BLOCK_ZERO;
+      else
+	{
+#ifdef HAVE_VALGRIND_MEMCHECK_H
+	  VALGRIND_CHECK_MEM_IS_DEFINED (data, size);
+#endif
+
+	  err = chop_block_indexer_index (worker->block_indexer,
+					  (chop_block_store_t *) &worker->store,
+					  data, size,
+					  BATCH_HANDLE (pipeline, batch,
+							block));
+	  if (err)
+	    break;
+
+	  batch->kind[block] = BLOCK_INDEXED;
+	}
+    }
+
+  batch->processed = block;
+  if (err)
+    batch->err = err;
+}
+
+/* A worker thread.  */
+static void *
+tree_pipeline_index (void *data)
+{
+  tree_worker_t *worker = (tree_worker_t *) data;
+  tree_pipeline_t *pipeline = worker->pipeline;
+
+  while (1)
+    {
+      tree_batch_t *batch;
+
+      pthread_mutex_lock (&pipeline->lock);
+      while ((pipeline->pending == NULL) && (!pipeline->stop))
+	pthread_cond_wait (&pipeline->changed, &pipeline->lock);
+
+      batch = pipeline->stop ? NULL : pipeline->pending;
+      if (batch)
+	{
+	  pipeline->pending = batch->next;
+	  if (pipeline->pending == NULL)
+	    pipeline->pending_tail = NULL;
+	}
+      pthread_mutex_unlock (&pipeline->lock);
+
+      if (!batch)
+	break;
+
+      tree_batch_index (worker, batch);
+
+      pthread_mutex_lock (&pipeline->lock);
+      batch->next = pipeline->indexed;
+      pipeline->indexed = batch;
+      pthread_cond_broadcast (&pipeline->changed);
+      pthread_mutex_unlock (&pipeline->lock);
+    }
+
+  return NULL;
+}
+
+/* Destroy the index handles of the blocks of BATCH that have been indexed
+   but not added to a key block tree.  */
+static void
+tree_batch_clear_handles (tree_pipeline_t *pipeline, tree_batch_t *batch)
+{
+  size_t block;
+
+  for (block = 0; block < batch->processed; block++)
+    if (batch->kind[block] == BLOCK_INDEXED)
+      chop_object_destroy ((chop_object_t *)
+			   BATCH_HANDLE (pipeline, batch, block));
+
+  batch->processed = 0;
+}
+
+/* Stop the threads of PIPELINE and free the resources associated with
+   it.  */
+static void
+tree_pipeline_destroy (tree_pipeline_t *pipeline)
+{
+  size_t i;
+
+  pthread_mutex_lock (&pipeline->lock);
+  pipeline->stop = 1;
+  pthread_cond_broadcast (&pipeline->changed);
+  pthread_mutex_unlock (&pipeline->lock);
+
+  if (pipeline->chopper_spawned)
+    pthread_join (pipeline->chopper_thread, NULL);
+
+  for (i = 0; i < pipeline->worker_count; i++)
+    {
+      tree_worker_t *worker = &pipeline->workers[i];
+
+      if (worker->spawned)
+	pthread_join (worker->thread, NULL);
+
+      if (worker->block_indexer)
+	{
+	  chop_object_destroy ((chop_object_t *) worker->block_indexer);
+	  chop_free (worker->block_indexer, &chop_tree_indexer_class);
+	}
+
+      chop_object_destroy ((chop_object_t *) &worker->store);
+    }
+
+  for (i = 0; i < pipeline->batch_count; i++)
+    {
+      tree_batch_t *batch = &pipeline->batches[i];
+
+      if (batch->handles)
+	{
+	  tree_batch_clear_handles (pipeline, batch);
+	  chop_free (batch->handles, &chop_tree_indexer_class);
+	}
+
+      chop_buffer_return (&batch->data);
+      chop_buffer_return (&batch->writes);
+    }
+
+  chop_free (pipeline->workers, &chop_tree_indexer_class);
+  chop_free (pipeline->batches, &chop_tree_indexer_class);
+
+  pthread_cond_destroy (&pipeline->changed);
+  pthread_mutex_destroy (&pipeline->lock);
+}
+
+/* Initialize PIPELINE to index INPUT with copies of BLOCK_INDEXER and spawn
+   its threads.  Return CHOP_ERR_NOT_IMPL if BLOCK_INDEXER cannot be copied
+   or if threads cannot be created, in which case INPUT is left
+   untouched.  */
+static chop_error_t
+tree_pipeline_start (tree_pipeline_t *pipeline, chop_tree_indexer_t *htree,
+		     chop_chopper_t *input,
+		     chop_block_indexer_t *block_indexer)
+{
+  chop_error_t err = 0;
+  size_t i, worker_count, spawned = 0, indexer_size, block_size;
+  const chop_class_t *class, *handle_class;
+
+  class = chop_object_get_class ((chop_object_t *) block_indexer);
+  if (class->copy == NULL)
+    /* Copying BLOCK_INDEXER is needed to use it from several threads.  */
+    return CHOP_ERR_NOT_IMPL;
+
+  worker_count = tree_indexer_thread_count (htree);
+  if (worker_count < 2)
+    return CHOP_ERR_NOT_IMPL;
+
+  handle_class = chop_block_indexer_index_handle_class (block_indexer);
+  indexer_size = chop_class_instance_size (class);
+  block_size = chop_chopper_typical_block_size (input);
+
+  memset (pipeline, 0, sizeof (*pipeline));
+  pipeline->htree = htree;
+  pipeline->input = input;
+  pipeline->handle_size = chop_class_instance_size (handle_class);
+
+  pthread_mutex_init (&pipeline->lock, NULL);
+  pthread_cond_init (&pipeline->changed, NULL);
+
+  pipeline->workers = chop_calloc (worker_count * sizeof (tree_worker_t),
+				   &chop_tree_indexer_class);
+  pipeline->batches =
+    chop_calloc (worker_count * TREE_INDEXER_BATCHES_PER_THREAD
+		 * sizeof (tree_batch_t),
+		 &chop_tree_indexer_class);
+  if ((!pipeline->workers) || (!pipeline->batches))
+    {
+      err = ENOMEM;
+      goto failed;
+    }
+
+  for (i = 0; (i < worker_count) && (!err); i++)
+    {
+      tree_worker_t *worker = &pipeline->workers[i];
+
+      worker->pipeline = pipeline;
+
+      err = chop_object_initialize ((chop_object_t *) &worker->store,
+				    &chop_deferred_block_store_class);
+      if (err)
+	break;
+      pipeline->worker_count++;
+
+      worker->block_indexer = chop_malloc (indexer_size,
+					   &chop_tree_indexer_class);
+      if (!worker->block_indexer)
+	err = ENOMEM;
+      else
+	{
+	  /* Each worker needs its own copy of BLOCK_INDEXER since block
+	     indexers may have internal state, such as a cipher handle.  */
+	  err = chop_object_copy ((chop_object_t *) block_indexer,
+				  (chop_object_t *) worker->block_indexer);
+	  if (err)
+	    {
+	      chop_free (worker->block_indexer, &chop_tree_indexer_class);
+	      worker->block_indexer = NULL;
+	    }
+	}
+    }
+
+  for (i = 0; (i < worker_count * TREE_INDEXER_BATCHES_PER_THREAD)
+	 && (!err); i++)
+    {
+      tree_batch_t *batch = &pipeline->batches[i];
+
+      batch->handles = chop_malloc (TREE_INDEXER_BATCH_SIZE
+				    * pipeline->handle_size,
+				    &chop_tree_indexer_class);
+      if (!batch->handles)
+	{
+	  err = ENOMEM;
+	  break;
+	}
+
+      err = chop_buffer_init (&batch->data, block_size);
+      if (err)
+	break;
+
+      err = chop_buffer_init (&batch->writes, block_size);
+      if (err)
+	{
+	  chop_buffer_return (&batch->data);
+	  break;
+	}
+
+      batch->next = pipeline->free_batches;
+      pipeline->free_batches = batch;
+      pipeline->batch_count++;
+    }
+
+  if (err)
+    goto failed;
+
+  for (i = 0; i < worker_count; i++)
+    {
+      tree_worker_t *worker = &pipeline->workers[i];
+
+      worker->spawned = !pthread_create (&worker->thread, NULL,
+					 tree_pipeline_index, worker);
+      if (worker->spawned)
+	spawned++;
+    }
+
+  if (spawned > 0)
+    pipeline->chopper_spawned =
+      !pthread_create (&pipeline->chopper_thread, NULL,
+		       tree_pipeline_chop, pipeline);
+
+  if (!pipeline->chopper_spawned)
+    {
+      err = CHOP_ERR_NOT_IMPL;
+      goto failed;
+    }
+
+  chop_log_printf (&htree->log, "indexing with %zu worker threads",
+		   spawned);
+
+  return 0;
+
+ failed:
+  chop_log_printf (&htree->log, "cannot index with %zu threads: %s",
+		   worker_count, chop_error_message (err));
+  tree_pipeline_destroy (pipeline);
+
+  return CHOP_ERR_NOT_IMPL;
+}
+
+/* The ordered stage of PIPELINE: add the blocks of each batch, in input
+   order, to TREE, and write them to OUTPUT, subject to CHECKS.  Return
+   CHOP_STREAM_END once the end of the input has been reached, an error
+   otherwise.  */
+static chop_error_t
+tree_pipeline_run (tree_pipeline_t *pipeline, key_block_tree_t *tree,
+		   chop_block_indexer_t *block_indexer,
+		   chop_block_store_t *output, existence_checks_t *checks,
+		   size_t *total_amount)
+{
+  chop_error_t err = 0;
+  uint64_t sequence = 0;
+
+  while (!err)
+    {
+      size_t block;
+      tree_batch_t *batch, **prev;
+
+      pthread_mutex_lock (&pipeline->lock);
+      while (1)
+	{
+	  for (prev = &pipeline->indexed;
+	       (*prev != NULL) && ((*prev)->sequence != sequence);
+	       prev = &(*prev)->next);
+
+	  if (*prev != NULL)
+	    break;
+
+	  pthread_cond_wait (&pipeline->changed, &pipeline->lock);
+	}
+
+      batch = *prev;
+      *prev = batch->next;
+      pthread_mutex_unlock (&pipeline->lock);
+
+      sequence++;
+
+      err = deferred_writes_replay (&batch->writes, output, checks);
+
+      for (block = 0; (block < batch->processed) && (!err); block++)
+	{
+	  size_t amount = batch->blocks[block].size;
+
+	  switch (batch->kind[block])
+	    {
+	    case BLOCK_ZERO:
+	      err = chop_block_tree_add_zero_run (tree, amount);
+	      break;
+
+	    case BLOCK_INDEXED:
+	      err = chop_block_tree_add_index (tree, block_indexer,
+					       BATCH_HANDLE (pipeline, batch,
+							     block),
+					       amount);
+	      break;
+
+	    default:
+	      break;
+	    }
+
+	  *total_amount += amount;
+	}
+
+      if ((!err) && (batch->err))
+	{
+	  err = batch->err;
+	  if (batch->processed < batch->count)
+	    chop_log_printf (&pipeline->htree->log,
+			     "failed to index block: %s",
+			     chop_error_message (err));
+	}
+
+      tree_batch_clear_handles (pipeline, batch);
+      tree_pipeline_release (pipeline, batch);
+    }
+
+  return err;
+}
+
+#endif /* HAVE_PTHREAD_H */
+
+
+/* Index blocks from INPUT with BLOCK_INDEXER, one at a time, adding them
+   to TREE and writing them to OUTPUT, subject to CHECKS.  *FIRST is true
+   until INDEX has been initialized with the index of a block.  */
+static chop_error_t
+tree_index_serially (chop_tree_indexer_t *htree, chop_chopper_t *input,
+		     chop_block_indexer_t *block_indexer,
+		     chop_block_store_t *output, existence_checks_t *checks,
+		     key_block_tree_t *tree,
+		     chop_index_handle_t *index, int *first,
+		     size_t *total_amount)
+{
+  chop_error_t err;
+  size_t amount;
+  chop_buffer_t buffer, writes;
+  chop_deferred_block_store_t deferred;
+  chop_block_store_t *store = output;
+  int deferring = (checks->size > 0);
+
+  err = chop_buffer_init (&buffer,
+			  chop_chopper_typical_block_size (input));
+  if (err)
+    return err;
+
+  if (deferring)
+    {
+      /* Have BLOCK_INDEXER write to DEFERRED so that the existence of
+	 blocks can be checked in batches before they are written.  */
+      err = chop_buffer_init (&writes,
+			      chop_chopper_typical_block_size (input));
+      if (!err)
+	{
+	  err = chop_object_initialize ((chop_object_t *) &deferred,
+					&chop_deferred_block_store_class);
+	  if (err)
+	    chop_buffer_return (&writes);
+	}
+      if (err)
+	{
+	  chop_buffer_return (&buffer);
+	  return err;
+	}
+
+      deferred.writes = &writes;
+      store = (chop_block_store_t *) &deferred;
+    }
+
+  /* Read blocks from INPUT until the underlying stream returns
+     CHOP_STREAM_END.  Keep a copy of each block key.  Blocks are read in
+     batches, as views, which avoids copying them when INPUT supports it,
+     as well as the overhead of reading them one by one.  */
+  while (1)
+    {
+      const char *region;
+      size_t block, count;
+      chop_block_span_t blocks[TREE_INDEXER_BATCH_SIZE];
+
+      chop_buffer_clear (&buffer);
+      err = chop_chopper_find_boundaries (input, &buffer, &region,
+					  blocks, TREE_INDEXER_BATCH_SIZE,
+					  &count);
+      if (err)
+	break;
+
+      for (block = 0; block < count; block++)
+	{
+	  const char *data = region + blocks[block].offset;
+
+	  amount = blocks[block].size;
+	  if (!amount)
+	    continue;
+
+	  *total_amount += amount;
+
+	  if (htree->zero_block_detection && is_zero_block (data, amount))
+	    {
+	      /* Record it in the current key block instead of storing it.  */
+	      err = chop_block_tree_add_zero_run (tree, amount);
+	      if (err)
+		break;
+
+	      continue;
+	    }
+
+	  if (CHOP_EXPECT_FALSE (*first))
+	    *first = 0;
+	  else
+	    /* Destroy the index of the previous block.  */
+	    chop_object_destroy ((chop_object_t *) index);
+
+#ifdef HAVE_VALGRIND_MEMCHECK_H
+	  VALGRIND_CHECK_MEM_IS_DEFINED (data, amount);
+#endif
+
+	  /* Store this block and get its index */
+	  err = chop_block_indexer_index (block_indexer, store,
+					  data, amount, index);
+	  if (err)
+	    {
+	      chop_log_printf (&htree->log, "failed to index block: %s",
+			       chop_error_message (err));
+	      break;
+	    }
+
+	  /* Add this block key to our block key tree */
+	  err = chop_block_tree_add_index (tree, block_indexer, index, amount);
+	  if (err)
+	    break;
+
+	  if ((deferring) && (deferred.count >= checks->size))
+	    {
+	      err = deferred_store_flush (&deferred, output, checks);
+	      if (err)
+		break;
+	    }
+	}
+
+      if (err)
+	break;
+    }
+
+  if (deferring)
+    {
+      if (err == CHOP_STREAM_END)
+	{
+	  chop_error_t flush_err;
+
+	  flush_err = deferred_store_flush (&deferred, output, checks);
+	  if (flush_err)
+	    err = flush_err;
+	}
+
+      chop_object_destroy ((chop_object_t *) &deferred);
+      chop_buffer_return (&writes);
+    }
+
+  chop_buffer_return (&buffer);
+
+  return err;
+}
+
+static chop_error_t
+chop_tree_index_blocks (chop_indexer_t *indexer,
+			chop_chopper_t *input,
+			chop_block_indexer_t *block_indexer,
+			chop_block_store_t *output,
+			chop_block_store_t *metadata,
+			chop_index_handle_t *index)
+{
+  chop_error_t err = 0;
+  int first = 1;
+  chop_tree_indexer_t *htree = (chop_tree_indexer_t *)indexer;
+  size_t total_amount = 0;
+  key_block_tree_t tree;
+  existence_checks_t checks;
+#ifdef HAVE_PTHREAD_H
+  tree_pipeline_t pipeline;
+#endif
+
+  err = existence_checks_init (&checks, htree->existence_checks);
+  if (err)
+    {
+      existence_checks_destroy (&checks);
+      return err;
+    }
+
+  chop_block_tree_init (&tree, htree->indexes_per_block,
+			htree->child_sizes, metadata, &htree->log);
+
+#ifdef HAVE_PTHREAD_H
+  if ((htree->thread_count != 1)
+      && (!tree_pipeline_start (&pipeline, htree, input, block_indexer)))
+    {
+      /* INDEX remains uninitialized until the tree is flushed.  */
+      err = tree_pipeline_run (&pipeline, &tree, block_indexer, output,
+			       &checks, &total_amount);
+      tree_pipeline_destroy (&pipeline);
+    }
+  else
+#endif
+    err = tree_index_serially (htree, input, block_indexer, output,
+			       &checks, &tree, index, &first, &total_amount);
+
+  if ((err == CHOP_STREAM_END) && (total_amount > 0))
+    /* Flush the key block tree and get its key.  Here, we get the
+       top-level index handle.  */
+    err = chop_block_tree_flush (&tree, block_indexer, index, !first);
+
+  /* Free memory associated with TREE */
+  chop_block_tree_free (&tree);
+  existence_checks_destroy (&checks);
+
+  if (total_amount == 0)
+    /* Nothing was read so INDEX is kept uninitialized.  */
+    err = CHOP_INDEXER_EMPTY_SOURCE;
+
+  return err;
+}
+
+
+
+/* Hash tree stream implementation (for retrieval).  */
+
+
+typedef struct decoded_block
+{
+  /* The raw buffer and its size */
+  chop_buffer_t buffer;
+
+  /* Offset within this raw buffer */
+  size_t offset;
+
+  /* Non-zero if this represents a key block (aka. "inode") */
+  int is_key_block;
+
+  /* If this is a key block, this represents its height within the tree,
+     starting from the lowest key blocks (data blocks being bottommost).  */
+  size_t depth;
+
+  /* If this is a key block, this is the total number of children it has.  */
+  size_t key_count;
+
+  /* If this is a key block, the offsets in BUFFER of the binary
+     serializations of its KEY_COUNT keys, followed by the offset of the
+     end of the last one, in an array of KEY_OFFSETS_SIZE elements.  Keys
+     are decoded one at a time into KEY, an index handle of class
+     KEY_CLASS, when they are needed.  */
+  size_t *key_offsets;
+  size_t key_offsets_size;
+  const chop_class_t *key_class;
+  chop_index_handle_t *key;
+
+  /* If this is a key block, this points to its current child.  We don't keep
+     all blocks in memory.  */
+  struct decoded_block *current_child;
+
+  /* If this is a key block, this is the number of CURRENT_CHILD, i.e. an
+     integer between zero and KEY_COUNT.  */
+  size_t current_child_number;
+
+  /* If this is a key block, the offset of the end of its keys, the offset
+     of its table of runs of zeros, the number of entries in that table,
+     and the number of entries already visited.  */
+  size_t keys_end;
+  size_t zero_runs_offset;
+  size_t zero_run_count;
+  size_t next_zero_run;
+
+  /* If this is a key block that records the sizes of its children, the
+     offset of the table of sizes.  */
+  int    has_child_sizes;
+  size_t child_sizes_offset;
+
+  /* If this is a data block that represents a run of zeros, this is the
+     size of that run, in which case BUFFER is empty.  */
+  size_t zero_run_size;
+
+  /* The parent block */
+  struct decoded_block *parent;
+
+  /* If this is a data block, this represents its offset within the stream
+     being decoded.  */
+  size_t stream_offset;
+
+  /* If this is a key block, the number of times this object was fetched,
+     which tells prefetched children of its successive contents apart.  */
+  unsigned long generation;
+
+  /* The prefetcher of data blocks, or NULL */
+  struct block_prefetcher *prefetcher;
+
+  /* Pointer to the stream's log */
+  chop_log_t *log;
+} decoded_block_t;
+
+typedef struct decoded_block_tree
+{
+  chop_block_store_t *data_store;
+  chop_block_store_t *metadata_store;
+  chop_index_handle_t *index;
+  chop_block_fetcher_t *fetcher;
+
+  decoded_block_t *top_level;
+  size_t current_offset;
+  struct block_prefetcher *prefetcher;
+  chop_log_t *log;
+} decoded_block_tree_t;
+
+/* Decode the INDEX-th key of key block BLOCK into HANDLE, an index handle
+   of class `BLOCK->key_class'.  On success, HANDLE must eventually be
+   destroyed.  */
+static inline chop_error_t
+chop_decoded_block_key (const decoded_block_t *block, size_t index,
+			chop_index_handle_t *handle)
+{
+  chop_error_t err;
+  size_t start, decoded, bytes_read;
+
+  assert (index < block->key_count);
+
+  start = block->key_offsets[index];
+  err = chop_index_handle_decode_binary (block->key_class,
+					 chop_buffer_content (&block->buffer)
+					 + start,
+					 block->key_offsets[index + 1] - start,
+					 1, handle, &decoded, &bytes_read);
+  if ((!err) && (decoded != 1))
+    err = CHOP_DESERIAL_TOO_SHORT;
+
+  return err;
+}
+
+
+
+
+/* Hash tree stream objects are returned by CHOP_INDEXER_FETCH_STREAM when
+   reading from a hash-tree-indexed stream.  */
+CHOP_DECLARE_RT_CLASS (tree_stream, stream,
+		       decoded_block_tree_t tree;
+		       chop_log_t log;);
+
+
+/* Data block prefetching.  */
+
+struct block_prefetcher;
+
+static void block_prefetcher_lock_store (struct block_prefetcher *);
+static void block_prefetcher_unlock_store (struct block_prefetcher *);
+
+/* A block store that reads from BACKEND on behalf of the threads of
+   PREFETCHER, one thread at a time, since block stores are not
+   necessarily thread-safe.  */
+CHOP_DECLARE_RT_CLASS (prefetch_block_store, block_store,
+		       chop_block_store_t *backend;
+		       struct block_prefetcher *prefetcher;);
+
+static chop_error_t
+prefetch_store_read_block (chop_block_store_t *store,
+			   const chop_block_key_t *key,
+			   chop_buffer_t *buffer, size_t *size)
+{
+  chop_error_t err;
+  chop_prefetch_block_store_t *prefetch =
+    (chop_prefetch_block_store_t *)store;
+
+  block_prefetcher_lock_store (prefetch->prefetcher);
+  err = chop_store_read_block (prefetch->backend, key, buffer, size);
+  block_prefetcher_unlock_store (prefetch->prefetcher);
+
+  return err;
+}
+
+static chop_error_t
+prefetch_store_sync (chop_block_store_t *store)
+{
+  return 0;
+}
+
+static chop_error_t
+prefetch_store_close (chop_block_store_t *store)
+{
+  /* BACKEND belongs to the user.  */
+  return 0;
+}
+
+static chop_error_t
+pbs_ctor (chop_object_t *object, const chop_class_t *class)
+{
+  chop_prefetch_block_store_t *prefetch =
+    (chop_prefetch_block_store_t *)object;
+
+  prefetch->block_store.read_block = prefetch_store_read_block;
+  prefetch->block_store.sync = prefetch_store_sync;
+  prefetch->block_store.close = prefetch_store_close;
+  prefetch->backend = NULL;
+  prefetch->prefetcher = NULL;
+
+  return 0;
+}
+
+CHOP_DEFINE_RT_CLASS (prefetch_block_store, block_store,
+		      pbs_ctor, NULL,
+		      NULL, NULL,
+		      NULL, NULL);
+
+#ifdef HAVE_PTHREAD_H
+
+/* A data block being prefetched.  It is designated by key number
+   CHILD_NUMBER of the GENERATION-th contents of key block OWNER, a copy
+   of which is HANDLE, and SEQUENCE is its position in the queue of
+   prefetched blocks.  Once fetched, its contents are in BUFFER, or ERR is
+   set.  */
+typedef struct
+{
+  enum { SLOT_FREE, SLOT_QUEUED, SLOT_FETCHING, SLOT_DONE } state;
+  int cancelled;
+  unsigned long sequence;
+
+  const decoded_block_t *owner;
+  unsigned long generation;
+  size_t child_number;
+
+  chop_index_handle_t *handle;
+  chop_buffer_t buffer;
+  chop_error_t err;
+} prefetch_slot_t;
+
+typedef struct
+{
+  struct block_prefetcher *prefetcher;
+  chop_block_fetcher_t *fetcher;
+  pthread_t thread;
+  int spawned;
+} prefetch_worker_t;
+
+/* The data block prefetcher of a tree stream.  The calling thread queues
+   the data blocks that follow the one being read in the current key
+   block, and worker threads fetch them, each with its own copy of the
+   stream's fetcher.  LOCK protects the slots; STORE_LOCK serializes
+   accesses to the stores.  */
+typedef struct block_prefetcher
+{
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  pthread_mutex_t store_lock;
+  int stop;
+
+  /* The blocks being prefetched, i.e., at most BLOCKS of them plus those
+     cancelled while being fetched.  HEAD is the sequence number of the
+     next block to be read, and TAIL that of the next block queued.  */
+  prefetch_slot_t *slots;
+  size_t slot_count;
+  size_t blocks;
+  unsigned long head, tail;
+
+  /* The key block whose keys are being queued, and the number of the next
+     key to be queued.  */
+  const decoded_block_t *cursor_owner;
+  unsigned long cursor_generation;
+  size_t cursor_child;
+
+  prefetch_worker_t *workers;
+  size_t worker_count;
+
+  chop_prefetch_block_store_t data_store;
+  chop_prefetch_block_store_t metadata_store;
+
+  chop_log_t *log;
+} block_prefetcher_t;
+
+static void
+block_prefetcher_lock_store (block_prefetcher_t *prefetcher)
+{
+  pthread_mutex_lock (&prefetcher->store_lock);
+}
+
+static void
+block_prefetcher_unlock_store (block_prefetcher_t *prefetcher)
+{
+  pthread_mutex_unlock (&prefetcher->store_lock);
+}
+
+/* Make SLOT available again.  */
+static inline void
+prefetch_slot_release (prefetch_slot_t *slot)
+{
+  chop_object_destroy ((chop_object_t *) slot->handle);
+  slot->state = SLOT_FREE;
+  slot->cancelled = 0;
+}
+
+/* Return the slot of the next block to be read from PREFETCHER, or NULL
+   if none is queued.  */
+static prefetch_slot_t *
+block_prefetcher_head (block_prefetcher_t *prefetcher)
+{
+  size_t i;
+
+  if (prefetcher->head == prefetcher->tail)
+    return NULL;
+
+  for (i = 0; i < prefetcher->slot_count; i++)
+    {
+      prefetch_slot_t *slot = &prefetcher->slots[i];
+
+      if ((slot->state != SLOT_FREE) && (!slot->cancelled)
+	  && (slot->sequence == prefetcher->head))
+	return slot;
+    }
+
+  return NULL;
+}
+
+/* Cancel all the blocks queued in PREFETCHER.  Blocks being fetched are
+   released by the worker that fetches them.  */
+static void
+block_prefetcher_flush (block_prefetcher_t *prefetcher)
+{
+  size_t i;
+
+  for (i = 0; i < prefetcher->slot_count; i++)
+    {
+      prefetch_slot_t *slot = &prefetcher->slots[i];
+
+      if (slot->state == SLOT_FETCHING)
+	slot->cancelled = 1;
+      else if (slot->state != SLOT_FREE)
+	prefetch_slot_release (slot);
+    }
+
+  prefetcher->head = prefetcher->tail;
+  prefetcher->cursor_owner = NULL;
+}
+
+/* Queue the data blocks designated by the keys of BLOCK that follow those
+   already queued, until PREFETCHER holds as many blocks as it may.  */
+static void
+block_prefetcher_schedule (block_prefetcher_t *prefetcher,
+			   const decoded_block_t *block)
+{
+  chop_error_t err;
+  size_t i = 0;
+
+  if ((prefetcher->cursor_owner != block)
+      || (prefetcher->cursor_generation != block->generation))
+    return;
+
+  while ((prefetcher->tail - prefetcher->head < prefetcher->blocks)
+	 && (prefetcher->cursor_child < block->key_count))
+    {
+      prefetch_slot_t *slot;
+
+      for (; i < prefetcher->slot_count; i++)
+	if (prefetcher->slots[i].state == SLOT_FREE)
+	  break;
+
+      /* There is always a free slot since there are as many slots as
+	 queued blocks plus cancelled blocks being fetched.  */
+      assert (i < prefetcher->slot_count);
+      slot = &prefetcher->slots[i];
+
+      /* BLOCK's keys may be replaced while SLOT is being fetched, hence
+	 the copy.  They were all decoded successfully when BLOCK was
+	 fetched.  */
+      err = chop_decoded_block_key (block, prefetcher->cursor_child,
+				    slot->handle);
+      assert (!err);
+
+      slot->state = SLOT_QUEUED;
+      slot->cancelled = 0;
+      slot->sequence = prefetcher->tail++;
+      slot->owner = block;
+      slot->generation = block->generation;
+      slot->child_number = prefetcher->cursor_child++;
+      slot->err = 0;
+    }
+
+  pthread_cond_broadcast (&prefetcher->changed);
+}
+
+/* Make CHILD the data block designated by BLOCK's current key, waiting
+   for PREFETCHER to fetch it if needed.  */
+static chop_error_t
+block_prefetcher_fetch (block_prefetcher_t *prefetcher,
+			decoded_block_t *block, decoded_block_t *child)
+{
+  chop_error_t err;
+  prefetch_slot_t *slot;
+  chop_buffer_t buffer;
+
+  pthread_mutex_lock (&prefetcher->lock);
+
+  slot = block_prefetcher_head (prefetcher);
+  if ((slot == NULL) || (slot->owner != block)
+      || (slot->generation != block->generation)
+      || (slot->child_number != block->current_child_number))
+    {
+      /* This is a new key block or the stream was sought: start queueing
+	 from BLOCK's current key.  */
+      if (slot)
+	chop_log_printf (prefetcher->log, "discarding prefetched blocks");
+
+      block_prefetcher_flush (prefetcher);
+      prefetcher->cursor_owner = block;
+      prefetcher->cursor_generation = block->generation;
+      prefetcher->cursor_child = block->current_child_number;
+
+      block_prefetcher_schedule (prefetcher, block);
+      slot = block_prefetcher_head (prefetcher);
+      assert (slot != NULL);
+    }
+
+  while (slot->state != SLOT_DONE)
+    pthread_cond_wait (&prefetcher->changed, &prefetcher->lock);
+
+  /* Hand SLOT's buffer over to CHILD.  */
+  buffer = child->buffer;
+  child->buffer = slot->buffer;
+  slot->buffer = buffer;
+
+  child->is_key_block = 0;
+  child->offset = 0;
+  child->zero_run_size = 0;
+  child->parent = block;
+
+  err = slot->err;
+
+  prefetch_slot_release (slot);
+  prefetcher->head++;
+
+  if (!err)
+    block_prefetcher_schedule (prefetcher, block);
+
+  pthread_mutex_unlock (&prefetcher->lock);
+
+  return err;
+}
+
+/* A worker thread.  */
+static void *
+block_prefetcher_run (void *data)
+{
+  prefetch_worker_t *worker = (prefetch_worker_t *) data;
+  block_prefetcher_t *prefetcher = worker->prefetcher;
+
+  pthread_mutex_lock (&prefetcher->lock);
+
+  while (1)
+    {
+      prefetch_slot_t *slot = NULL;
+      chop_error_t err;
+      size_t i, size;
+
+      /* Pick the oldest queued block.  */
+      for (i = 0; i < prefetcher->slot_count; i++)
+	{
+	  prefetch_slot_t *candidate = &prefetcher->slots[i];
+
+	  if ((candidate->state == SLOT_QUEUED)
+	      && ((slot == NULL) || (candidate->sequence < slot->sequence)))
+	    slot = candidate;
+	}
+
+      if (prefetcher->stop)
+	break;
+
+      if (slot == NULL)
+	{
+	  pthread_cond_wait (&prefetcher->changed, &prefetcher->lock);
+	  continue;
+	}
+
+      slot->state = SLOT_FETCHING;
+      pthread_mutex_unlock (&prefetcher->lock);
+
+      chop_buffer_clear (&slot->buffer);
+      err = chop_block_fetcher_fetch (worker->fetcher, slot->handle,
+				      (chop_block_store_t *)
+				      &prefetcher->data_store,
+				      &slot->buffer, &size);
+
+      pthread_mutex_lock (&prefetcher->lock);
+      if (slot->cancelled)
+	prefetch_slot_release (slot);
+      else
+	{
+	  slot->err = err;
+	  slot->state = SLOT_DONE;
+	}
+
+      pthread_cond_broadcast (&prefetcher->changed);
+    }
+
+  pthread_mutex_unlock (&prefetcher->lock);
+
+  return NULL;
+}
+
+/* Stop the threads of PREFETCHER and free the resources associated with
+   it.  */
+static void
+block_prefetcher_destroy (block_prefetcher_t *prefetcher)
+{
+  size_t i;
+
+  pthread_mutex_lock (&prefetcher->lock);
+  prefetcher->stop = 1;
+  pthread_cond_broadcast (&prefetcher->changed);
+  pthread_mutex_unlock (&prefetcher->lock);
+
+  for (i = 0; i < prefetcher->worker_count; i++)
+    {
+      prefetch_worker_t *worker = &prefetcher->workers[i];
+
+      if (worker->spawned)
+	pthread_join (worker->thread, NULL);
+    }
+
+  /* No block is being fetched anymore.  */
+  block_prefetcher_flush (prefetcher);
+
+  for (i = 0; i < prefetcher->worker_count; i++)
+    {
+      prefetch_worker_t *worker = &prefetcher->workers[i];
+
+      chop_object_destroy ((chop_object_t *) worker->fetcher);
+      chop_free (worker->fetcher, &chop_tree_stream_class);
+    }
+
+  for (i = 0; i < prefetcher->slot_count; i++)
+    {
+      prefetch_slot_t *slot = &prefetcher->slots[i];
+
+      if (slot->handle)
+	{
+	  chop_free (slot->handle, &chop_tree_stream_class);
+	  chop_buffer_return (&slot->buffer);
+	}
+    }
+
+  chop_free (prefetcher->workers, &chop_tree_stream_class);
+  chop_free (prefetcher->slots, &chop_tree_stream_class);
+
+  chop_object_destroy ((chop_object_t *) &prefetcher->data_store);
+  chop_object_destroy ((chop_object_t *) &prefetcher->metadata_store);
+
+  pthread_mutex_destroy (&prefetcher->store_lock);
+  pthread_cond_destroy (&prefetcher->changed);
+  pthread_mutex_destroy (&prefetcher->lock);
+}
+
+/* Initialize PREFETCHER to read up to BLOCKS data blocks of TREE ahead
+   with THREAD_COUNT threads, and have TREE read from the stores through
+   it.  Return CHOP_ERR_NOT_IMPL if TREE's fetcher cannot be copied or if
+   threads cannot be created, in which case TREE is left untouched.  */
+static chop_error_t
+block_prefetcher_start (block_prefetcher_t *prefetcher,
+			decoded_block_tree_t *tree,
+			size_t blocks, size_t thread_count)
+{
+  chop_error_t err = 0;
+  size_t i, spawned = 0, fetcher_size, handle_size;
+  const chop_class_t *class, *handle_class;
+
+  class = chop_object_get_class ((chop_object_t *) tree->fetcher);
+  if (class->copy == NULL)
+    /* Copying the fetcher is needed to use it from several threads.  */
+    return CHOP_ERR_NOT_IMPL;
+
+  if (thread_count > blocks)
+    thread_count = blocks;
+
+  handle_class = chop_block_fetcher_index_handle_class (tree->fetcher);
+  handle_size = chop_class_instance_size (handle_class);
+  fetcher_size = chop_class_instance_size (class);
+
+  memset (prefetcher, 0, sizeof (*prefetcher));
+  prefetcher->blocks = blocks;
+  prefetcher->log = tree->log;
+
+  pthread_mutex_init (&prefetcher->lock, NULL);
+  pthread_cond_init (&prefetcher->changed, NULL);
+  pthread_mutex_init (&prefetcher->store_lock, NULL);
+
+  chop_object_initialize ((chop_object_t *) &prefetcher->data_store,
+			  &chop_prefetch_block_store_class);
+  chop_object_initialize ((chop_object_t *) &prefetcher->metadata_store,
+			  &chop_prefetch_block_store_class);
+  prefetcher->data_store.backend = tree->data_store;
+  prefetcher->data_store.prefetcher = prefetcher;
+  prefetcher->metadata_store.backend = tree->metadata_store;
+  prefetcher->metadata_store.prefetcher = prefetcher;
+
+  prefetcher->workers = chop_calloc (thread_count * sizeof (prefetch_worker_t),
+				     &chop_tree_stream_class);
+  prefetcher->slots = chop_calloc ((blocks + thread_count)
+				   * sizeof (prefetch_slot_t),
+				   &chop_tree_stream_class);
+  if ((!prefetcher->workers) || (!prefetcher->slots))
+    {
+      err = ENOMEM;
+      goto failed;
+    }
+
+  for (i = 0; i < thread_count; i++)
+    {
+      prefetch_worker_t *worker = &prefetcher->workers[i];
+
+      worker->prefetcher = prefetcher;
+      worker->fetcher = chop_malloc (fetcher_size, &chop_tree_stream_class);
+      if (!worker->fetcher)
+	{
+	  err = ENOMEM;
+	  break;
+	}
+
+      /* Each worker needs its own copy of the fetcher since fetchers may
+	 have internal state, such as a cipher handle.  */
+      err = chop_object_copy ((chop_object_t *) tree->fetcher,
+			      (chop_object_t *) worker->fetcher);
+      if (err)
+	{
+	  chop_free (worker->fetcher, &chop_tree_stream_class);
+	  break;
+	}
+
+      prefetcher->worker_count++;
+    }
+
+  for (i = 0; (i < blocks + thread_count) && (!err); i++)
+    {
+      prefetch_slot_t *slot = &prefetcher->slots[i];
+
+      slot->handle = chop_malloc (handle_size, &chop_tree_stream_class);
+      if (!slot->handle)
+	{
+	  err = ENOMEM;
+	  break;
+	}
+
+      err = chop_buffer_init (&slot->buffer, 0);
+      if (err)
+	{
+	  chop_free (slot->handle, &chop_tree_stream_class);
+	  slot->handle = NULL;
+	  break;
+	}
+
+      prefetcher->slot_count++;
+    }
+
+  if (err)
+    goto failed;
+
+  for (i = 0; i < prefetcher->worker_count; i++)
+    {
+      prefetch_worker_t *worker = &prefetcher->workers[i];
+
+      worker->spawned = !pthread_create (&worker->thread, NULL,
+					 block_prefetcher_run, worker);
+      if (worker->spawned)
+	spawned++;
+    }
+
+  if (spawned == 0)
+    {
+      err = CHOP_ERR_NOT_IMPL;
+      goto failed;
+    }
+
+  tree->data_store = (chop_block_store_t *) &prefetcher->data_store;
+  tree->metadata_store = (chop_block_store_t *) &prefetcher->metadata_store;
+
+  chop_log_printf (tree->log, "prefetching %zu blocks with %zu threads",
+		   blocks, spawned);
+
+  return 0;
+
+ failed:
+  block_prefetcher_destroy (prefetcher);
+
+  return err;
+}
+
+#else /* !HAVE_PTHREAD_H */
+
+static void
+block_prefetcher_lock_store (struct block_prefetcher *prefetcher)
+{
+}
+
+static void
+block_prefetcher_unlock_store (struct block_prefetcher *prefetcher)
+{
+}
+
+#endif /* !HAVE_PTHREAD_H */
+
+
+
+static inline chop_error_t
+chop_decoded_block_tree_init (decoded_block_tree_t *tree,
+			      chop_block_store_t *data_store,
+			      chop_block_store_t *metadata_store,
+			      const chop_index_handle_t *handle,
+			      chop_block_fetcher_t *fetcher,
+			      chop_log_t *log)
+{
   chop_error_t err;
   const chop_class_t *handle_class =
     chop_object_get_class ((chop_object_t *)handle);
@@ -793,6 +2622,7 @@ chop_decoded_block_tree_init (decoded_block_tree_t *tree,
 
   tree->top_level = NULL;
   tree->current_offset = 0;
+  tree->prefetcher = NULL;
 
   tree->log = log;
 
@@ -800,9 +2630,10 @@ chop_decoded_block_tree_init (decoded_block_tree_t *tree,
 }
 
 
-/* Free resources associated with TREE.  */
+/* Free the decoded blocks of TREE, which brings it back to the beginning
+   of the stream.  */
 static void
-chop_decoded_block_tree_free (decoded_block_tree_t *tree)
+chop_decoded_block_tree_free_blocks (decoded_block_tree_t *tree)
 {
   decoded_block_t *block, *next;
 
@@ -811,11 +2642,40 @@ chop_decoded_block_tree_free (decoded_block_tree_t *tree)
        block = next)
     {
       next = block->current_child;
+      chop_free (block->key_offsets, &chop_tree_stream_class);
+      chop_free (block->key, &chop_tree_stream_class);
       chop_buffer_return (&block->buffer);
       chop_free (block, &chop_tree_stream_class);
     }
 
+#ifdef HAVE_PTHREAD_H
+  if (tree->prefetcher)
+    {
+      /* The blocks prefetched so far belong to the blocks just freed.  */
+      pthread_mutex_lock (&tree->prefetcher->lock);
+      block_prefetcher_flush (tree->prefetcher);
+      pthread_mutex_unlock (&tree->prefetcher->lock);
+    }
+#endif
+
   tree->top_level = NULL;
+  tree->current_offset = 0;
+}
+
+/* Free resources associated with TREE.  */
+static void
+chop_decoded_block_tree_free (decoded_block_tree_t *tree)
+{
+  chop_decoded_block_tree_free_blocks (tree);
+
+#ifdef HAVE_PTHREAD_H
+  if (tree->prefetcher)
+    {
+      block_prefetcher_destroy (tree->prefetcher);
+      chop_free (tree->prefetcher, &chop_tree_stream_class);
+      tree->prefetcher = NULL;
+    }
+#endif
 
   chop_object_destroy ((chop_object_t *)tree->index);
   chop_free (tree->index, &chop_tree_stream_class);
@@ -831,6 +2691,7 @@ tree_stream_ctor (chop_object_t *object, const chop_class_t *class)
 
   stream->stream.read = tree_stream_read;
   stream->stream.close = tree_stream_close;
+  stream->stream.seek = tree_stream_seek;
 
   stream->tree.index = NULL;
 
@@ -882,6 +2743,28 @@ chop_tree_fetch_stream (struct chop_indexer *indexer,
 				      handle, fetcher,
 				      &tstream->log);
 
+#ifdef HAVE_PTHREAD_H
+  if ((!err) && (htree->prefetch_blocks > 0))
+    {
+      block_prefetcher_t *prefetcher;
+
+      prefetcher = chop_malloc (sizeof (*prefetcher),
+				&chop_tree_stream_class);
+      if ((prefetcher != NULL)
+	  && (block_prefetcher_start (prefetcher, &tstream->tree,
+				      htree->prefetch_blocks,
+				      tree_indexer_thread_count (htree))
+	      == 0))
+	tstream->tree.prefetcher = prefetcher;
+      else
+	{
+	  /* Fall back to fetching blocks one at a time.  */
+	  chop_log_printf (&htree->log, "cannot prefetch data blocks");
+	  chop_free (prefetcher, &chop_tree_stream_class);
+	}
+    }
+#endif
+
   chop_log_printf (&htree->log, "fetching stream");
 
   return err;
@@ -889,6 +2772,49 @@ chop_tree_fetch_stream (struct chop_indexer *indexer,
 
 
 
+/* Decode the table of runs of zeros of key block BLOCK, and set BLOCK's
+   KEYS_END, ZERO_RUNS_OFFSET, and ZERO_RUN_COUNT fields accordingly.  */
+static chop_error_t
+chop_decoded_block_decode_zero_runs (decoded_block_t *block)
+{
+  size_t size, count, run;
+  const unsigned char *buffer =
+    (unsigned char *)chop_buffer_content (&block->buffer);
+
+  size = chop_buffer_size (&block->buffer);
+  if ((block->depth > 0) || (size < KEY_BLOCK_HEADER_SIZE + 4))
+    return CHOP_INDEXER_ERROR;
+
+  count = load_little_endian (buffer + size - 4, 4);
+  if (count > (size - KEY_BLOCK_HEADER_SIZE - 4) / KEY_BLOCK_ZERO_RUN_SIZE)
+    return CHOP_INDEXER_ERROR;
+
+  block->zero_run_count = count;
+  block->zero_runs_offset = size - 4 - count * KEY_BLOCK_ZERO_RUN_SIZE;
+  block->keys_end = block->zero_runs_offset;
+
+  /* Make sure runs are sorted and refer to existing keys.  */
+  for (run = 0; run < count; run++)
+    {
+      const unsigned char *entry;
+      uint64_t position, run_size;
+
+      entry = buffer + block->zero_runs_offset
+	+ run * KEY_BLOCK_ZERO_RUN_SIZE;
+      position = load_little_endian (entry, 4);
+      run_size = load_little_endian (entry + 4, 8);
+
+      if ((position > block->key_count) || (run_size > SIZE_MAX)
+	  || ((run > 0)
+	      && (position < load_little_endian (entry
+						 - KEY_BLOCK_ZERO_RUN_SIZE,
+						 4))))
+	return CHOP_INDEXER_ERROR;
+    }
+
+  return 0;
+}
+
 /* Decode BLOCK's header (which was created by CHOP_KEY_BLOCK_FILL_HEADER).
    BLOCK is assumed to be a key block.  This functions sets BLOCK's KEY_COUNT
    and DEPTH fields.  */
@@ -896,6 +2822,7 @@ static inline chop_error_t
 chop_decoded_block_decode_header (decoded_block_t *block)
 {
   char magic[2];
+  unsigned flags = 0;
   const unsigned char *buffer =
     (unsigned char *)chop_buffer_content (&block->buffer);
   assert (block->is_key_block);
@@ -909,7 +2836,9 @@ chop_decoded_block_decode_header (decoded_block_t *block)
   magic[0] = *(buffer++);
   magic[1] = *(buffer++);
 
-  if ((magic[0] != KEY_BLOCK_MAGIC_1) || (magic[1] != KEY_BLOCK_MAGIC_2))
+  if ((magic[0] != KEY_BLOCK_MAGIC_1)
+      || ((magic[1] != KEY_BLOCK_MAGIC_2)
+	  && (magic[1] != KEY_BLOCK_MAGIC_2_EXT)))
     {
       chop_log_printf (block->log,
 		       "invalid key block magic numbers: 0x%02x%02x",
@@ -926,10 +2855,53 @@ chop_decoded_block_decode_header (decoded_block_t *block)
 
       block->depth  = ((size_t)*(buffer++));
       block->depth |= ((size_t)*(buffer++)) << 8;
+
+      /* The flags byte is only meaningful in extended key blocks.  */
+      if (magic[1] == KEY_BLOCK_MAGIC_2_EXT)
+	flags = *(buffer++);
     }
 
   block->offset = KEY_BLOCK_HEADER_SIZE;
   block->current_child_number = 0;
+  block->keys_end = chop_buffer_size (&block->buffer);
+  block->zero_runs_offset = block->keys_end;
+  block->zero_run_count = block->next_zero_run = 0;
+  block->has_child_sizes = 0;
+
+  if (flags & ~(KEY_BLOCK_FLAG_ZERO_RUNS | KEY_BLOCK_FLAG_CHILD_SIZES))
+    {
+      chop_log_printf (block->log, "unsupported key block flags: 0x%02x",
+		       flags);
+      return CHOP_INDEXER_ERROR;
+    }
+
+  if (flags & KEY_BLOCK_FLAG_ZERO_RUNS)
+    {
+      chop_error_t err;
+
+      err = chop_decoded_block_decode_zero_runs (block);
+      if (err)
+	{
+	  chop_log_printf (block->log, "invalid table of runs of zeros");
+	  return err;
+	}
+    }
+
+  if (flags & KEY_BLOCK_FLAG_CHILD_SIZES)
+    {
+      /* The table of child sizes precedes that of runs of zeros.  */
+      if ((block->keys_end - KEY_BLOCK_HEADER_SIZE) / KEY_BLOCK_CHILD_SIZE_SIZE
+	  < block->key_count)
+	{
+	  chop_log_printf (block->log, "invalid table of child sizes");
+	  return CHOP_INDEXER_ERROR;
+	}
+
+      block->has_child_sizes = 1;
+      block->child_sizes_offset =
+	block->keys_end - block->key_count * KEY_BLOCK_CHILD_SIZE_SIZE;
+      block->keys_end = block->child_sizes_offset;
+    }
 
   chop_log_printf (block->log, "decoded block: keys=%zu, depth=%zu",
 		   block->key_count, block->depth);
@@ -937,8 +2909,91 @@ chop_decoded_block_decode_header (decoded_block_t *block)
   return 0;
 }
 
+/* Locate the keys of key block BLOCK, whose header has been decoded, and
+   fill in its KEY_OFFSETS array.  The keys are index handles of the class
+   associated with FETCHER; each of them is decoded once to make sure it
+   is valid.  */
+static chop_error_t
+chop_decoded_block_decode_keys (decoded_block_t *block,
+				chop_block_fetcher_t *fetcher)
+{
+  chop_error_t err = 0;
+  const chop_class_t *key_class;
+  const char *content;
+  size_t count, position, i;
+
+  key_class = chop_block_fetcher_index_handle_class (fetcher);
+  if (block->key_class != key_class)
+    {
+      chop_free (block->key, &chop_tree_stream_class);
+      block->key_class = NULL;
+      block->key = chop_malloc (chop_class_instance_size (key_class),
+				&chop_tree_stream_class);
+      if (!block->key)
+	{
+	  block->key_count = 0;
+	  return ENOMEM;
+	}
+
+      block->key_class = key_class;
+    }
+
+  /* Each key takes up at least one byte, which bounds the allocation
+     below in case KEY_COUNT is bogus.  */
+  count = block->keys_end - block->offset;
+  if (block->key_count < count)
+    count = block->key_count;
+
+  if (block->key_offsets_size < count + 1)
+    {
+      chop_free (block->key_offsets, &chop_tree_stream_class);
+      block->key_offsets_size = 0;
+      block->key_offsets = chop_malloc ((count + 1) * sizeof (size_t),
+					&chop_tree_stream_class);
+      if (!block->key_offsets)
+	{
+	  block->key_count = 0;
+	  return ENOMEM;
+	}
+
+      block->key_offsets_size = count + 1;
+    }
+
+  content = chop_buffer_content (&block->buffer);
+  for (i = 0, position = block->offset; i < count; i++)
+    {
+      size_t decoded, bytes_read;
+
+      block->key_offsets[i] = position;
+      err = chop_index_handle_decode_binary (key_class, content + position,
+					     block->keys_end - position,
+					     1, block->key,
+					     &decoded, &bytes_read);
+      if (decoded > 0)
+	chop_object_destroy ((chop_object_t *) block->key);
+      if ((err) || (decoded == 0))
+	break;
+
+      position += bytes_read;
+    }
+
+  block->key_offsets[i] = position;
+
+  /* Key blocks normally have exactly KEY_COUNT keys, but stop at the end
+     of the keys or at the first undecodable key nonetheless.  */
+  block->key_count = i;
+
+  if (err)
+    chop_log_printf (block->log, "failed to binary-deserialize "
+		     "index handle #%zu", i);
+
+  return err;
+}
+
 static inline chop_error_t
-chop_decoded_block_new (decoded_block_t **block, chop_log_t *log)
+chop_decoded_block_new (decoded_block_t **block,
+			struct block_prefetcher *prefetcher,
+			chop_log_t *log)
 {
   chop_error_t err;
 
@@ -949,11 +3004,20 @@ chop_decoded_block_new (decoded_block_t **block, chop_log_t *log)
 
   (*block)->current_child = (*block)->parent = NULL;
   (*block)->current_child_number = 0;
+  (*block)->zero_run_count = (*block)->next_zero_run = 0;
+  (*block)->zero_run_size = 0;
+  (*block)->has_child_sizes = 0;
+  (*block)->generation = 0;
+  (*block)->key_offsets = NULL;
+  (*block)->key_offsets_size = 0;
+  (*block)->key_class = NULL;
+  (*block)->key = NULL;
 
   err = chop_buffer_init (&(*block)->buffer, 0);
   if (err)
     return err;
 
+  (*block)->prefetcher = prefetcher;
   (*block)->log = log;
 
   return 0;
@@ -992,8 +3056,16 @@ chop_decoded_block_fetch (chop_block_store_t *store,
 
   block->is_key_block = is_key_block;
   block->offset = 0;
+  block->zero_run_size = 0;
+  block->generation++;
   if (is_key_block)
-    err = chop_decoded_block_decode_header (block);
+    {
+      err = chop_decoded_block_decode_header (block);
+      if (!err)
+	err = chop_decoded_block_decode_keys (block, fetcher);
+      if (err)
+	block->key_count = 0;
+    }
 
   block->parent = parent;
 
@@ -1004,6 +3076,35 @@ chop_decoded_block_fetch (chop_block_store_t *store,
   return err;
 }
 
+/* Return the size of data block BLOCK.  */
+static inline size_t
+chop_decoded_block_data_size (const decoded_block_t *block)
+{
+  return (block->zero_run_size > 0
+	  ? block->zero_run_size : chop_buffer_size (&block->buffer));
+}
+
+/* If key block BLOCK has a run of zeros before its current child, return
+   its size and move to the next run.  Return zero otherwise.  */
+static inline size_t
+chop_decoded_block_next_zero_run (decoded_block_t *block)
+{
+  const unsigned char *entry;
+
+  if (block->next_zero_run >= block->zero_run_count)
+    return 0;
+
+  entry = (unsigned char *) chop_buffer_content (&block->buffer)
+    + block->zero_runs_offset
+    + block->next_zero_run * KEY_BLOCK_ZERO_RUN_SIZE;
+  if (load_little_endian (entry, 4) != block->current_child_number)
+    return 0;
+
+  block->next_zero_run++;
+
+  return (load_little_endian (entry + 4, 8));
+}
+
 /* Update BLOCK's CURRENT_CHILD pointer to its next block if any.
    CHOP_STREAM_END is returned if BLOCK and his parents don't have any
    further block.  This propagates the request recursively to BLOCK's
@@ -1016,19 +3117,45 @@ chop_decoded_block_next_child (decoded_block_t *block,
 			       chop_block_store_t *data_store)
 {
   chop_error_t err;
+  size_t zero_run_size;
   chop_log_t *log = block->log;
 
  start:
-  if ((block->current_child_number >= block->key_count)
-      || (block->offset >= chop_buffer_size (&block->buffer)))
+  zero_run_size = chop_decoded_block_next_zero_run (block);
+  if (zero_run_size > 0)
+    {
+      /* The next child is a run of zeros: there's nothing to fetch.  */
+      decoded_block_t *child;
+
+      if (!block->current_child)
+	{
+	  err = chop_decoded_block_new (&block->current_child,
+					block->prefetcher, block->log);
+	  if (err)
+	    return err;
+	}
+
+      child = block->current_child;
+      chop_buffer_clear (&child->buffer);
+      child->is_key_block = 0;
+      child->offset = 0;
+      child->zero_run_size = zero_run_size;
+      child->parent = block;
+
+      chop_log_printf (log, "run of %zu zeros", zero_run_size);
+
+      return 0;
+    }
+
+  if (block->current_child_number >= block->key_count)
     {
       /* We're done with this block so let's reuse it with the next block */
       if (!block->parent)
 	{
 	  /* BLOCK is the top-level key block and there's nothing left in
 	     it.  */
-	  chop_log_printf (log, "root block: end of stream (offset: %zu/%zu)",
-			   block->offset, chop_buffer_size (&block->buffer));
+	  chop_log_printf (log, "root block: end of stream (child: %zu/%zu)",
+			   block->current_child_number, block->key_count);
 	  return CHOP_STREAM_END;
 	}
       else
@@ -1054,35 +3181,37 @@ chop_decoded_block_next_child (decoded_block_t *block,
     }
   else
     {
-      /* Read a block index and update BLOCK's CURRENT_CHILD pointer.  */
-      size_t available, serialized_size;
+      /* Fetch the block designated by the current key and update BLOCK's
+	 CURRENT_CHILD pointer.  */
       chop_block_store_t *the_store;
-      const chop_class_t *index_class;
-      chop_index_handle_t *index;
-      char *pos;
-
-      pos = (char *)chop_buffer_content (&block->buffer) + block->offset;
-      available = chop_buffer_size (&block->buffer) - block->offset;
-
-      index_class = chop_block_fetcher_index_handle_class (fetcher);
-      index = chop_class_alloca_instance (index_class);
-      err = chop_object_deserialize ((chop_object_t *)index, index_class,
-				     CHOP_SERIAL_BINARY,
-				     pos, available,
-				     &serialized_size);
-      if (err)
+
+#ifdef HAVE_PTHREAD_H
+      if ((block->prefetcher) && (!CHILDREN_ARE_KEY_BLOCKS (block)))
 	{
-	  chop_log_printf (block->log, "failed to binary-deserialize "
-			   "index handle");
+	  /* BLOCK's children are data blocks, which are read ahead.  */
+	  if (!block->current_child)
+	    {
+	      err = chop_decoded_block_new (&block->current_child,
+					    block->prefetcher, block->log);
+	      if (err)
+		return err;
+	    }
+
+	  err = block_prefetcher_fetch (block->prefetcher,
+					block, block->current_child);
+	  if (!err)
+	    block->current_child_number++;
+
 	  return err;
 	}
+#endif
 
-      block->offset += serialized_size;
       if (!block->current_child)
 	{
-	  err = chop_decoded_block_new (&block->current_child, block->log);
+	  err = chop_decoded_block_new (&block->current_child,
+					block->prefetcher, block->log);
 	  if (err)
-	    goto finish;
+	    return err;
 	}
 
       /* Pick up the right block store */
@@ -1091,18 +3220,19 @@ chop_decoded_block_next_child (decoded_block_t *block,
       else
 	the_store = data_store;
 
+      err = chop_decoded_block_key (block, block->current_child_number,
+				    block->key);
+      if (err)
+	return err;
+
       chop_log_printf (log, "fetching new child block (current depth: %zu)",
 		       block->is_key_block ? block->depth : 0);
-      err = chop_decoded_block_fetch (the_store, index,
+      err = chop_decoded_block_fetch (the_store, block->key,
 				      fetcher,
 				      block, block->current_child);
-      if (err)
-	goto finish;
-
-      block->current_child_number++;
-
-    finish:
-      chop_object_destroy ((chop_object_t *)index);
+      chop_object_destroy ((chop_object_t *) block->key);
+      if (!err)
+	block->current_child_number++;
     }
 
   return err;
@@ -1153,7 +3283,7 @@ chop_decoded_block_read (decoded_block_t *block,
 	  const char *block_buf;
 	  size_t amount, available, to_read = size - *read;
 
-	  if (block->offset >= chop_buffer_size (&block->buffer))
+	  if (block->offset >= chop_decoded_block_data_size (block))
 	    {
 	      /* We're done with this block.  Re-use it for the next block.  */
 	      err = chop_decoded_block_next_child (block->parent,
@@ -1173,11 +3303,17 @@ chop_decoded_block_read (decoded_block_t *block,
 		}
 	    }
 
-	  block_buf = chop_buffer_content (&block->buffer) + block->offset;
-	  available = chop_buffer_size (&block->buffer) - block->offset;
+	  available = chop_decoded_block_data_size (block) - block->offset;
 	  amount = (available > to_read) ? to_read : available;
 
-	  memcpy (buffer + *read, block_buf, amount);
+	  if (block->zero_run_size > 0)
+	    memset (buffer + *read, 0, amount);
+	  else
+	    {
+	      block_buf = chop_buffer_content (&block->buffer) + block->offset;
+	      memcpy (buffer + *read, block_buf, amount);
+	    }
+
 	  block->offset += amount;
 	  *read += amount;
 
@@ -1193,6 +3329,208 @@ chop_decoded_block_read (decoded_block_t *block,
   return err;
 }
 
+static chop_error_t chop_decoded_block_tree_read (decoded_block_tree_t *,
+						  char *, size_t, size_t *);
+
+/* Position key block BLOCK so that its current child covers OFFSET, an
+   offset relative to the beginning of BLOCK, and do the same recursively
+   with that child.  When OFFSET is past the end of BLOCK, position it at
+   the end of its last child.  Return CHOP_ERR_NOT_IMPL if BLOCK or one of
+   its descendants does not record the sizes of its children.  */
+static chop_error_t
+chop_decoded_block_seek (decoded_block_t *block, uint64_t offset,
+			 chop_block_fetcher_t *fetcher,
+			 chop_block_store_t *metadata_store,
+			 chop_block_store_t *data_store)
+{
+  chop_error_t err;
+  const unsigned char *content, *run_entry;
+  size_t child, run;
+  size_t target_child = 0, target_run = 0;
+  uint64_t start = 0, entry_size, target_start = 0, target_size = 0;
+  int found = 0, have_target = 0;
+  decoded_block_t *current;
+
+  assert (block->is_key_block);
+
+  if (!block->has_child_sizes)
+    return CHOP_ERR_NOT_IMPL;
+
+  content = (unsigned char *) chop_buffer_content (&block->buffer);
+
+  /* Walk BLOCK's children and runs of zeros until the one that covers
+     OFFSET is found.  */
+  for (child = 0, run = 0; ; child++)
+    {
+      while (run < block->zero_run_count)
+	{
+	  run_entry = content + block->zero_runs_offset
+	    + run * KEY_BLOCK_ZERO_RUN_SIZE;
+	  if (load_little_endian (run_entry, 4) != child)
+	    break;
+
+	  entry_size = load_little_endian (run_entry + 4, 8);
+	  target_child = child;
+	  target_run = run;
+	  target_start = start;
+	  target_size = entry_size;
+	  have_target = 1;
+
+	  if (offset < start + entry_size)
+	    {
+	      found = 1;
+	      break;
+	    }
+
+	  start += entry_size;
+	  run++;
+	}
+
+      if ((found) || (child >= block->key_count))
+	break;
+
+      entry_size = load_little_endian (content + block->child_sizes_offset
+				       + child * KEY_BLOCK_CHILD_SIZE_SIZE,
+				       KEY_BLOCK_CHILD_SIZE_SIZE);
+      target_child = child;
+      target_run = run;
+      target_start = start;
+      target_size = entry_size;
+      have_target = 1;
+
+      if (offset < start + entry_size)
+	{
+	  found = 1;
+	  break;
+	}
+
+      start += entry_size;
+    }
+
+  if (!have_target)
+    {
+      chop_log_printf (block->log, "seek: key block has no children");
+      return CHOP_INDEXER_ERROR;
+    }
+
+  /* Make TARGET_CHILD, or the run of zeros that precedes it, BLOCK's next
+     child, and fetch it.  */
+  block->current_child_number = target_child;
+  block->next_zero_run = target_run;
+
+  err = chop_decoded_block_next_child (block, fetcher,
+				       metadata_store, data_store);
+  if (err)
+    return err;
+
+  current = block->current_child;
+  offset = found ? offset - target_start : target_size;
+
+  if (current->is_key_block)
+    return (chop_decoded_block_seek (current, offset, fetcher,
+				     metadata_store, data_store));
+
+  if (chop_decoded_block_data_size (current) != target_size)
+    {
+      chop_log_printf (block->log, "seek: data block size mismatch: "
+		       "expected %llu, got %zu",
+		       (unsigned long long) target_size,
+		       chop_decoded_block_data_size (current));
+      return CHOP_INDEXER_ERROR;
+    }
+
+  current->offset = offset;
+
+  return 0;
+}
+
+/* Fetch the top-level key block of TREE, unless already done.  */
+static chop_error_t
+chop_decoded_block_tree_fetch_top_level (decoded_block_tree_t *tree)
+{
+  chop_error_t err;
+
+  if (tree->top_level)
+    return 0;
+
+  /* Fetch the top-level key block (or "inode").  */
+  err = chop_decoded_block_new (&tree->top_level, tree->prefetcher,
+				tree->log);
+  if (err)
+    return err;
+
+  return (chop_decoded_block_fetch (tree->metadata_store, tree->index,
+				    tree->fetcher,
+				    NULL /* No parent block */,
+				    tree->top_level));
+}
+
+/* Move TREE to OFFSET bytes from the beginning of the stream.  */
+static chop_error_t
+chop_decoded_block_tree_seek (decoded_block_tree_t *tree, uint64_t offset)
+{
+  chop_error_t err;
+
+  chop_log_printf (tree->log, "seeking to offset %llu",
+		   (unsigned long long) offset);
+
+  err = chop_decoded_block_tree_fetch_top_level (tree);
+  if (err)
+    return err;
+
+  if (tree->top_level->has_child_sizes)
+    {
+      err = chop_decoded_block_seek (tree->top_level, offset, tree->fetcher,
+				     tree->metadata_store, tree->data_store);
+      if (!err)
+	{
+	  tree->current_offset = offset;
+	  return 0;
+	}
+
+      if (err != CHOP_ERR_NOT_IMPL)
+	return err;
+
+      /* Part of the tree was repositioned: start over.  */
+      chop_decoded_block_tree_free_blocks (tree);
+    }
+  else if (offset < tree->current_offset)
+    /* Key blocks produced by earlier versions do not record the sizes of
+       their children, so the stream must be read from the beginning.  */
+    chop_decoded_block_tree_free_blocks (tree);
+
+  /* Read and discard data until OFFSET is reached.  */
+  {
+    char *scratch;
+    size_t read;
+
+    scratch = chop_malloc (65536, &chop_tree_stream_class);
+    if (!scratch)
+      return ENOMEM;
+
+    for (err = 0; (!err) && (tree->current_offset < offset); )
+      {
+	uint64_t remaining = offset - tree->current_offset;
+
+	err = chop_decoded_block_tree_read (tree, scratch,
+					    remaining > 65536
+					    ? 65536 : (size_t) remaining,
+					    &read);
+      }
+
+    chop_free (scratch, &chop_tree_stream_class);
+
+    if (err == CHOP_STREAM_END)
+      {
+	/* Next reads will return CHOP_STREAM_END as well.  */
+	tree->current_offset = offset;
+	err = 0;
+      }
+  }
+
+  return err;
+}
+
 /* Read at most SIZE bytes from TREE's underlying metadata block store.  On
    success, zero is returned and READ is set to the number of bytes actually
    read.  CHOP_STREAM_END is returned on end-of-stream.  */
@@ -1204,20 +3542,9 @@ chop_decoded_block_tree_read (decoded_block_tree_t *tree,
   chop_error_t err;
 
   chop_log_printf (tree->log, "reading %zu bytes", size);
-  if (!tree->top_level)
-    {
-      /* Fetch the top-level key block (or "inode").  */
-      err = chop_decoded_block_new (&tree->top_level, tree->log);
-      if (err)
-	return err;
-
-      err = chop_decoded_block_fetch (tree->metadata_store, tree->index,
-				      tree->fetcher,
-				      NULL /* No parent block */,
-				      tree->top_level);
-      if (err)
-	return err;
-    }
+  err = chop_decoded_block_tree_fetch_top_level (tree);
+  if (err)
+    return err;
 
   *read = 0;
   err = chop_decoded_block_read (tree->top_level,
@@ -1244,6 +3571,18 @@ tree_stream_read (chop_stream_t *stream, char *buffer, size_t size,
 					buffer, size, read));
 }
 
+/* The stream `seek' method for hash tree streams.  */
+static chop_error_t
+tree_stream_seek (chop_stream_t *stream, uint64_t offset)
+{
+  chop_tree_stream_t *tstream = (chop_tree_stream_t *)stream;
+
+  assert (tstream->tree.index);
+  assert (tstream->tree.fetcher);
+
+  return (chop_decoded_block_tree_seek (&tstream->tree, offset));
+}
+
 /* The stream `close' method for hash tree streams.  */
 static void
 tree_stream_close (chop_stream_t *stream)
@@ -0,0 +1,49 @@
+/* libchop -- a utility library for distributed storage and data backup
+   Copyright (C) 2026  Ludovic Courtès <ludo@gnu.org>
+
+   Libchop is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Libchop is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with libchop.  If not, see <http://www.gnu.org/licenses/>.  */
+
+/* Reading and writing the little-endian integers of on-disk and on-wire
+   formats, regardless of the host's byte order and alignment.  */
+
+#ifndef CHOP_LITTLE_ENDIAN_H
+#define CHOP_LITTLE_ENDIAN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Store the SIZE least significant bytes of VALUE at BUFFER, in
+   little-endian order.  */
+static inline void
+store_little_endian (unsigned char *buffer, uint64_t value, size_t size)
+{
+  size_t i;
+
+  for (i = 0; i < size; i++, value >>= 8)
+    buffer[i] = value & 0xff;
+}
+
+/* Return the SIZE-byte little-endian integer at BUFFER.  */
+static inline uint64_t
+load_little_endian (const unsigned char *buffer, size_t size)
+{
+  uint64_t value = 0;
+
+  while (size-- > 0)
+    value = (value << 8) | buffer[size];
+
+  return value;
+}
+
+#endif
@@ -0,0 +1,198 @@
+/* libchop -- a utility library for distributed storage and data backup
+   Copyright (C) 2026  Ludovic Courtès <ludo@gnu.org>
+
+   Libchop is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Libchop is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with libchop.  If not, see <http://www.gnu.org/licenses/>.  */
+
+/* Helpers shared by the block store implementations: key hashing for
+   in-memory hash tables, positioned reads, and the handling of stores
+   that keep their blocks in numbered files of a directory, such as the
+   pack and log stores.  */
+
+#ifndef CHOP_STORE_COMMON_H
+#define CHOP_STORE_COMMON_H
+
+#include <chop/chop.h>
+#include <chop/stores.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/* Return the FNV-1a hash of the KEY_SIZE bytes at KEY.  */
+static inline uint64_t
+store_hash_key (const char *key, size_t key_size)
+{
+  const unsigned char *p, *end;
+  uint64_t hash = 14695981039346656037ULL;
+
+  p = (const unsigned char *) key;
+  for (end = p + key_size; p < end; p++)
+    {
+      hash ^= *p;
+      hash *= 1099511628211ULL;
+    }
+
+  return hash;
+}
+
+/* Read SIZE bytes at OFFSET of FD into BUFFER.  Return errno if reading
+   failed, and CHOP_STORE_ERROR if FD ends before OFFSET + SIZE.  */
+static inline chop_error_t
+store_read_at (int fd, void *buffer, size_t size, uint64_t offset)
+{
+  char *p = (char *) buffer;
+
+  while (size > 0)
+    {
+      ssize_t count;
+
+      count = pread (fd, p, size, offset);
+      if (count < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  return errno;
+	}
+      if (count == 0)
+	return CHOP_STORE_ERROR;
+
+      p += count, size -= count, offset += count;
+    }
+
+  return 0;
+}
+
+
+/* Numbered files.  */
+
+static inline int
+store_compare_numbers (const void *n1, const void *n2)
+{
+  unsigned u1 = *(const unsigned *) n1, u2 = *(const unsigned *) n2;
+
+  return (u1 < u2) ? -1 : ((u1 > u2) ? 1 : 0);
+}
+
+/* Look in the directory at DIR_FD for files named PREFIX followed by an
+   hexadecimal number of at most 8 digits and SUFFIX.  On success, return
+   zero, their numbers in increasing order in *NUMBERS, which is to be
+   freed on behalf of KLASS, and their count in *COUNT.  */
+static inline chop_error_t
+store_numbered_files (int dir_fd, const char *prefix, const char *suffix,
+		      const chop_class_t *klass,
+		      unsigned **numbers, size_t *count)
+{
+  chop_error_t err = 0;
+  size_t allocated = 0, prefix_size = strlen (prefix);
+  struct dirent *entry;
+  DIR *dir;
+  int fd;
+
+  *numbers = NULL;
+  *count = 0;
+
+  fd = dup (dir_fd);
+  if (fd < 0)
+    return errno;
+
+  dir = fdopendir (fd);
+  if (dir == NULL)
+    {
+      err = errno;
+      close (fd);
+      return err;
+    }
+
+  rewinddir (dir);
+  while ((!err) && ((entry = readdir (dir)) != NULL))
+    {
+      unsigned number;
+      int end;
+
+      if ((strncmp (entry->d_name, prefix, prefix_size))
+	  || (sscanf (entry->d_name + prefix_size, "%8x%n", &number, &end)
+	      != 1)
+	  || (strcmp (entry->d_name + prefix_size + end, suffix)))
+	continue;
+
+      if (*count >= allocated)
+	{
+	  unsigned *bigger;
+
+	  allocated = allocated ? 2 * allocated : 64;
+	  bigger = chop_realloc (*numbers, allocated * sizeof (**numbers),
+				 klass);
+	  if (bigger == NULL)
+	    err = ENOMEM;
+	  else
+	    *numbers = bigger;
+	}
+
+      if (!err)
+	(*numbers)[(*count)++] = number;
+    }
+
+  closedir (dir);
+
+  if (err)
+    {
+      chop_free (*numbers, klass);
+      *numbers = NULL;
+      *count = 0;
+    }
+  else if (*count > 0)
+    qsort (*numbers, *count, sizeof (**numbers), store_compare_numbers);
+
+  return err;
+}
+
+
+/* Directory-based stores.  */
+
+/* A function that opens in STORE the block store in the directory at
+   DIR_FD, with its default file size if SIZE is zero.  */
+typedef chop_error_t (* store_directory_open_t) (int dir_fd,
+						 int eventually_close,
+						 size_t size,
+						 chop_block_store_t *store);
+
+/* Open in STORE the block store in directory FILE, which is created with
+   MODE if needed, by calling OPEN_STORE, which eventually closes the
+   directory.  This implements the `generic_open' method of file-based
+   stores kept in a directory.  */
+static inline chop_error_t
+store_directory_generic_open (const char *file, mode_t mode,
+			      store_directory_open_t open_store,
+			      chop_block_store_t *store)
+{
+  int dir_fd;
+
+  if ((mkdir (file, mode | S_IXUSR)) && (errno != EEXIST))
+    return errno;
+
+  dir_fd = open (file, O_RDONLY | O_DIRECTORY);
+  if (dir_fd < 0)
+    return errno;
+
+  return open_store (dir_fd, 1, 0, store);
+}
+
+#endif
@@ -71,7 +71,7 @@ chop_dummy_block_store_blocks_exist (chop_block_store_t *store,
 		   store->name, store, n);
   if (!dummy->backend)
     {
-      memset (exists, 0, sizeof exists);
+      memset (exists, 0, n * sizeof *exists);
       return 0; /* CHOP_ERR_NOT_IMPL ? */
     }
 
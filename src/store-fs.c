@@ -15,7 +15,13 @@
    along with libchop.  If not, see <http://www.gnu.org/licenses/>.  */
 
 /* The file system as a key-value database.  This is similar to Git's object
-   store on the file system.  */
+   store on the file system.
+
+   The base32 representation of a block's key is split into LEVELS
+   directory names of WIDTH characters each, followed by the name of the
+   block file.  The layout of a store is recorded in its layout file,
+   unless it is the original one, with one level of two-character
+   directories.  */
 
 #include <chop/chop-config.h>
 
@@ -33,19 +39,69 @@
 #include <dirent.h>
 #include <errno.h>
 #include <sys/stat.h>
-#include <libgen.h>
 #include <assert.h>
 
-#include <full-read.h>
 #include <full-write.h>
 
-
+
+/* Store layouts.  */
+
+/* The name of the file that describes the layout of a store.  */
+#define FS_LAYOUT_FILE_NAME  ".libchop-fs-layout"
+
+/* Limits on the number of directory levels and their width, and the
+   original layout of stores without a layout file.  */
+#define FS_MAX_LEVELS      3
+#define FS_MAX_WIDTH       3
+#define FS_DEFAULT_LEVELS  1
+#define FS_DEFAULT_WIDTH   2
+
+/* The maximum length of the name of a leaf directory, such as "AB/CD",
+   including the trailing zero.  */
+#define FS_MAX_DIR_NAME  (FS_MAX_LEVELS * (FS_MAX_WIDTH + 1))
+
+/* Number of leaf directory file descriptors kept open.  This must be a
+   power of two.  */
+#define FS_DIR_CACHE_SIZE  256
+
+/* An open leaf directory.  */
+typedef struct
+{
+  int  fd;
+  char name[FS_MAX_DIR_NAME];
+} fs_dir_cache_entry_t;
+
+
 /* Class definitions.  */
 
 CHOP_DECLARE_RT_CLASS_WITH_METACLASS (fs_block_store, block_store,
 				      file_based_store_class,
 				      int dir_fd;
-				      int eventually_close;);
+				      int eventually_close;
+
+				      /* The layout of the store */
+				      unsigned levels;
+				      unsigned width;
+
+				      /* Open leaf directories, indexed by a
+					 hash of their name */
+				      fs_dir_cache_entry_t
+				      dir_cache[FS_DIR_CACHE_SIZE];
+
+				      /* Number of blocks written between
+					 syncs, and number of blocks written
+					 since the last one, along with the
+					 names of their files and of the
+					 directories whose entries changed
+					 since, relative to DIR_FD and
+					 separated by zeros */
+				      size_t sync_interval;
+				      size_t unsynced;
+				      chop_buffer_t unsynced_files;
+				      chop_buffer_t unsynced_dirs;
+
+				      /* Used to name temporary files */
+				      unsigned long temp_counter;);
 
 static chop_error_t chop_fs_close (chop_block_store_t *);
 static chop_error_t chop_fs_next_block (chop_block_iterator_t *it);
@@ -71,7 +127,11 @@ chop_fs_generic_open (const chop_class_t *class,
       if (dir_fd < 0)
 	err = errno;
       else
-	err = chop_fs_store_open (dir_fd, 1, store);
+	{
+	  err = chop_fs_store_open (dir_fd, 1, store);
+	  if (err)
+	    close (dir_fd);
+	}
     }
   else
     err = errno;
@@ -99,17 +159,16 @@ CHOP_DEFINE_RT_CLASS_WITH_METACLASS (fs_block_store, block_store,
 				     NULL, NULL, /* No copy/equalp */
 				     NULL, NULL  /* No serial/deserial */);
 
-
+
 /* Iterators.  */
 
+/* An iterator that walks the directory tree of a store depth-first: DIRS
+   are the directories being listed, from the top directory down to the
+   DEPTH one, and PREFIX is the concatenation of their names.  */
 CHOP_DECLARE_RT_CLASS (fs_block_iterator, block_iterator,
-		       int top_dir_fd;
-		       int subdir_fd;
-		       char subdir_name[3];
-		       DIR *top_dir;
-		       DIR *subdir;
-		       struct dirent top_entry;
-		       struct dirent sub_entry;)
+		       unsigned depth;
+		       DIR *dirs[FS_MAX_LEVELS + 1];
+		       char prefix[FS_MAX_LEVELS * FS_MAX_WIDTH + 1];)
 
 static chop_error_t
 fsi_ctor (chop_object_t *object, const chop_class_t *class)
@@ -118,8 +177,9 @@ fsi_ctor (chop_object_t *object, const chop_class_t *class)
 
   fsit->block_iterator.next = chop_fs_next_block;
 
-  fsit->top_dir_fd = fsit->subdir_fd = -1;
-  fsit->top_dir = fsit->subdir = NULL;
+  fsit->depth = 0;
+  memset (fsit->dirs, 0, sizeof (fsit->dirs));
+  fsit->prefix[0] = '\0';
 
   return 0;
 }
@@ -128,14 +188,14 @@ static void
 fsi_dtor (chop_object_t *object)
 {
   chop_fs_block_iterator_t *fsit = (chop_fs_block_iterator_t *) object;
+  unsigned i;
 
   /* Close the directories.  The associated file descriptors get closed at
      the same time.  */
 
-  if (fsit->top_dir != NULL)
-    closedir (fsit->top_dir);
-  if (fsit->subdir != NULL)
-    closedir (fsit->subdir);
+  for (i = 0; i <= FS_MAX_LEVELS; i++)
+    if (fsit->dirs[i] != NULL)
+      closedir (fsit->dirs[i]);
 }
 
 CHOP_DEFINE_RT_CLASS (fs_block_iterator, block_iterator,
@@ -143,34 +203,345 @@ CHOP_DEFINE_RT_CLASS (fs_block_iterator, block_iterator,
 		      NULL, NULL,
 		      NULL, NULL);
 
-
-/* Set NAME to the relative file name for KEY.  NAME must be twice the size
-   of KEY plus 2 bytes (for the `/' and `\0'.)  */
+
+/* Set DIR_NAME to the name of the leaf directory of KEY relative to the top
+   directory of FS, and FILE_NAME to the name of its file in that directory.
+   DIR_NAME must be FS_MAX_DIR_NAME bytes long, and FILE_NAME twice the size
+   of KEY plus 1 byte.  */
 static void
-block_file_name (const chop_block_key_t *key, char *name)
+block_file_name (const chop_fs_block_store_t *fs,
+		 const chop_block_key_t *key,
+		 char *dir_name, char *file_name)
 {
   char buffer[chop_block_key_size (key) * 2 + 1];
+  unsigned level;
 
   chop_buffer_to_base32_string (chop_block_key_buffer (key),
 				chop_block_key_size (key),
 				buffer);
-  assert (strlen (buffer) > 2);
+  assert (strlen (buffer) > fs->levels * fs->width);
   assert (strlen (buffer) < chop_block_key_size (key) * 2 + 1);
 
-  memcpy (name, buffer, 2);
-  strcpy (&name[2], "/");
-  strcat (name, &buffer[2]);
+  for (level = 0; level < fs->levels; level++)
+    {
+      memcpy (dir_name, &buffer[level * fs->width], fs->width);
+      dir_name += fs->width;
+      *(dir_name++) = (level + 1 < fs->levels) ? '/' : '\0';
+    }
+
+  strcpy (file_name, &buffer[fs->levels * fs->width]);
 }
 
-/* Return true if NAME is "." or "..".  */
+/* Return true if NAME is not that of a block file or directory, such as "."
+   or a temporary file.  Base32 strings never start with a dot.  */
 static inline bool
-dot_or_dot_dot (const char *name)
+hidden_file_p (const char *name)
+{
+  return (name[0] == '.');
+}
+
+/* Return the slot of the leaf directory DIR_NAME in FS's cache.  */
+static inline fs_dir_cache_entry_t *
+dir_cache_slot (chop_fs_block_store_t *fs, const char *dir_name)
+{
+  unsigned hash = 0;
+
+  for (; *dir_name; dir_name++)
+    hash = hash * 31 + (unsigned char) *dir_name;
+
+  return &fs->dir_cache[hash & (FS_DIR_CACHE_SIZE - 1)];
+}
+
+/* Forget about the leaf directory DIR_NAME of FS, which was removed.  */
+static void
+dir_cache_invalidate (chop_fs_block_store_t *fs, const char *dir_name)
+{
+  fs_dir_cache_entry_t *entry;
+
+  entry = dir_cache_slot (fs, dir_name);
+  if ((entry->fd >= 0) && (!strcmp (entry->name, dir_name)))
+    {
+      close (entry->fd);
+      entry->fd = -1;
+    }
+}
+
+static void
+dir_cache_clear (chop_fs_block_store_t *fs)
+{
+  size_t i;
+
+  for (i = 0; i < FS_DIR_CACHE_SIZE; i++)
+    if (fs->dir_cache[i].fd >= 0)
+      {
+	close (fs->dir_cache[i].fd);
+	fs->dir_cache[i].fd = -1;
+      }
+}
+
+/* Return true if FD is an open directory that was removed.  */
+static inline bool
+removed_directory_p (int fd)
+{
+  struct stat stat;
+
+  return ((fstat (fd, &stat) == 0) && (stat.st_nlink == 0));
+}
+
+/* Record that the entries of the directory whose name is the first SIZE
+   bytes of NAME changed since FS was last synced.  If SIZE is zero, this is
+   the top directory of FS.  */
+static chop_error_t
+fs_note_unsynced_directory (chop_fs_block_store_t *fs,
+			    const char *name, size_t size)
+{
+  chop_error_t err;
+
+  if (size == 0)
+    name = ".", size = 1;
+
+  err = chop_buffer_append (&fs->unsynced_dirs, name, size);
+  if (!err)
+    err = chop_buffer_append (&fs->unsynced_dirs, "", 1);
+
+  return err;
+}
+
+/* Return in *FD a file descriptor for the leaf directory DIR_NAME of FS,
+   which is owned by FS's cache.  If CREATE is true, create DIR_NAME and its
+   parents as needed.  If *CACHED is true, the file descriptor was found in
+   the cache, in which case it may refer to a directory removed by another
+   process.  */
+static chop_error_t
+open_leaf_directory (chop_fs_block_store_t *fs, const char *dir_name,
+		     bool create, int *fd, bool *cached)
+{
+  fs_dir_cache_entry_t *entry;
+  int parent_fd;
+  const char *p;
+
+  entry = dir_cache_slot (fs, dir_name);
+  if ((entry->fd >= 0) && (!strcmp (entry->name, dir_name)))
+    {
+      *fd = entry->fd;
+      *cached = true;
+      return 0;
+    }
+
+  *cached = false;
+
+  /* Open DIR_NAME one component at a time, creating it if needed.  */
+  for (p = dir_name, parent_fd = fs->dir_fd;
+       *p;
+       p += fs->width + (p[fs->width] == '/'))
+    {
+      char component[FS_MAX_WIDTH + 1];
+      int child_fd;
+
+      memcpy (component, p, fs->width);
+      component[fs->width] = '\0';
+
+      child_fd = openat (parent_fd, component, O_RDONLY | O_DIRECTORY);
+      if ((child_fd < 0) && (errno == ENOENT) && (create))
+	{
+	  if (mkdirat (parent_fd, component, S_IRWXU) == 0)
+	    {
+	      chop_error_t err = 0;
+
+	      /* Make the new entry of the parent durable, now or at the next
+		 sync.  */
+	      if (fs->sync_interval == 1)
+		err = fsync (parent_fd) ? errno : 0;
+	      else if (fs->sync_interval > 1)
+		err = fs_note_unsynced_directory (fs, dir_name,
+						  p > dir_name
+						  ? p - dir_name - 1 : 0);
+
+	      if (err)
+		{
+		  if (parent_fd != fs->dir_fd)
+		    close (parent_fd);
+		  return err;
+		}
+
+	      child_fd = openat (parent_fd, component,
+				 O_RDONLY | O_DIRECTORY);
+	    }
+	  else if (errno == EEXIST)
+	    /* COMPONENT was created in the meantime.  */
+	    child_fd = openat (parent_fd, component, O_RDONLY | O_DIRECTORY);
+	}
+
+      if (parent_fd != fs->dir_fd)
+	close (parent_fd);
+
+      if (child_fd < 0)
+	return errno;
+
+      parent_fd = child_fd;
+    }
+
+  if (entry->fd >= 0)
+    close (entry->fd);
+
+  entry->fd = parent_fd;
+  strcpy (entry->name, dir_name);
+  *fd = parent_fd;
+
+  return 0;
+}
+
+/* Like `fstatat ()', relative to the leaf directory DIR_NAME of FS.  */
+static chop_error_t
+stat_block_file (chop_fs_block_store_t *fs, const char *dir_name,
+		 const char *file_name, struct stat *stat)
+{
+  chop_error_t err;
+  bool cached;
+  int dir_fd;
+
+ retry:
+  err = open_leaf_directory (fs, dir_name, false, &dir_fd, &cached);
+  if (!err && fstatat (dir_fd, file_name, stat, 0))
+    {
+      err = errno;
+      if ((err == ENOENT) && (cached) && (removed_directory_p (dir_fd)))
+	{
+	  dir_cache_invalidate (fs, dir_name);
+	  goto retry;
+	}
+    }
+
+  return err;
+}
+
+/* Return in *FD a file descriptor for block file FILE_NAME in the leaf
+   directory DIR_NAME of FS, opened read-only.  */
+static chop_error_t
+open_block_file (chop_fs_block_store_t *fs, const char *dir_name,
+		 const char *file_name, int *fd)
+{
+  chop_error_t err;
+  bool cached;
+  int dir_fd;
+
+ retry:
+  err = open_leaf_directory (fs, dir_name, false, &dir_fd, &cached);
+  if (!err)
+    {
+      *fd = openat (dir_fd, file_name, O_RDONLY);
+      if (*fd < 0)
+	{
+	  err = errno;
+	  if ((err == ENOENT) && (cached) && (removed_directory_p (dir_fd)))
+	    {
+	      dir_cache_invalidate (fs, dir_name);
+	      goto retry;
+	    }
+	}
+    }
+
+  return err;
+}
+
+
+/* Layout files.  */
+
+/* Read the layout of FS from its layout file, if any.  Return ENOENT if
+   there is none.  */
+static chop_error_t
+read_layout (chop_fs_block_store_t *fs, unsigned *levels, unsigned *width)
 {
-  return (name[0] == '.'
-	  && (name[1] == '\0'
-	      || (name[1] == '.' && name[2] == '\0')));
+  chop_error_t err = 0;
+  char content[64];
+  ssize_t count;
+  int fd;
+
+  fd = openat (fs->dir_fd, FS_LAYOUT_FILE_NAME, O_RDONLY);
+  if (fd < 0)
+    return errno;
+
+  count = read (fd, content, sizeof (content) - 1);
+  if (count < 0)
+    err = errno;
+  else
+    {
+      content[count] = '\0';
+      if ((sscanf (content, "levels: %u\nwidth: %u\n", levels, width) != 2)
+	  || (*levels < 1) || (*levels > FS_MAX_LEVELS)
+	  || (*width < 1) || (*width > FS_MAX_WIDTH))
+	err = CHOP_DESERIAL_CORRUPT_INPUT;
+    }
+
+  close (fd);
+
+  return err;
+}
+
+/* Write the layout file of FS.  */
+static chop_error_t
+write_layout (chop_fs_block_store_t *fs)
+{
+  chop_error_t err = 0;
+  char content[64];
+  size_t size;
+  int fd;
+
+  size = snprintf (content, sizeof (content), "levels: %u\nwidth: %u\n",
+		   fs->levels, fs->width);
+
+  fd = openat (fs->dir_fd, FS_LAYOUT_FILE_NAME ".tmp",
+	       O_CREAT | O_TRUNC | O_WRONLY, S_IRUSR | S_IWUSR);
+  if (fd < 0)
+    return errno;
+
+  if ((full_write (fd, content, size) < size) || (fsync (fd)))
+    err = errno;
+
+  close (fd);
+
+  if (!err && renameat (fs->dir_fd, FS_LAYOUT_FILE_NAME ".tmp",
+			fs->dir_fd, FS_LAYOUT_FILE_NAME))
+    err = errno;
+
+  return err;
 }
 
+/* Return true if the top directory of FS contains anything besides hidden
+   files.  */
+static chop_error_t
+store_empty_p (chop_fs_block_store_t *fs, bool *empty)
+{
+  struct dirent *entry;
+  DIR *dir;
+  int fd;
+
+  /* Use a new file descriptor rather than a copy of FS's, which would
+     share its position.  */
+  fd = openat (fs->dir_fd, ".", O_RDONLY | O_DIRECTORY);
+  if (fd < 0)
+    return errno;
+
+  dir = fdopendir (fd);
+  if (dir == NULL)
+    {
+      close (fd);
+      return errno;
+    }
+
+  *empty = true;
+  while ((*empty) && ((entry = readdir (dir)) != NULL))
+    if (!hidden_file_p (entry->d_name))
+      *empty = false;
+
+  closedir (dir);
+
+  return 0;
+}
+
+
+/* The block store methods.  */
+
 static chop_error_t
 chop_fs_blocks_exist (chop_block_store_t *store,
 		      size_t n, const chop_block_key_t keys[n],
@@ -189,22 +560,20 @@ chop_fs_blocks_exist (chop_block_store_t *store,
       max_size = max_size > size ? max_size : size;
     }
 
-  char file_name[max_size * 2 + 2];
+  char dir_name[FS_MAX_DIR_NAME];
+  char file_name[max_size * 2 + 1];
 
   for (i = 0, err = 0; i < n && err == 0; i++)
     {
-      block_file_name (&keys[i], file_name);
-      err = fstatat (fs->dir_fd, file_name, &stat, 0);
+      block_file_name (fs, &keys[i], dir_name, file_name);
+      err = stat_block_file (fs, dir_name, file_name, &stat);
 
       if (err == 0)
 	exists[i] = true;
+      else if (err == ENOENT)
+	exists[i] = false, err = 0;
       else
-	{
-	  if (errno == ENOENT)
-	    exists[i] = false, err = 0;
-	  else
-	    exists[i] = false, err = errno;
-	}
+	exists[i] = false;
     }
 
   return err;
@@ -219,42 +588,53 @@ chop_fs_read_block (chop_block_store_t *store,
   chop_error_t err;
   chop_fs_block_store_t *fs =
     (chop_fs_block_store_t *) store;
-  char file_name[chop_block_key_size (key) * 2 + 2];
+  char dir_name[FS_MAX_DIR_NAME];
+  char file_name[chop_block_key_size (key) * 2 + 1];
   int fd;
 
   *size = 0;
 
-  block_file_name (key, file_name);
-  fd = openat (fs->dir_fd, file_name, O_RDONLY);
+  block_file_name (fs, key, dir_name, file_name);
+  err = open_block_file (fs, dir_name, file_name, &fd);
 
-  if (fd < 0)
+  if (err)
     {
-      if (errno == ENOENT)
+      if (err == ENOENT)
 	err = CHOP_STORE_BLOCK_UNAVAIL;
-      else
-	err = errno;
     }
   else
     {
-      size_t count, total = 0;
+      struct stat stat;
 
-      do
+      /* Read the whole block at once, right into BUFFER.  */
+      if (fstat (fd, &stat))
+	err = errno;
+      else
 	{
-	  char data[1024];
+	  char *data;
+	  size_t total;
 
-	  count = full_read (fd, data, sizeof (data));
-	  if (count > 0)
+	  chop_buffer_clear (buffer);
+	  err = chop_buffer_extend (buffer, stat.st_size, &data);
+	  for (total = 0; (!err) && (total < (size_t) stat.st_size); )
 	    {
-	      chop_buffer_append (buffer, data, count);
-	      total += count;
+	      ssize_t count;
+
+	      count = pread (fd, data + total, stat.st_size - total, total);
+	      if (count > 0)
+		total += count;
+	      else if (count == 0)
+		/* The file was truncated behind our back.  */
+		err = CHOP_STORE_ERROR;
+	      else if (errno != EINTR)
+		err = errno;
 	    }
-	}
-      while (count > 0);
 
-      if (errno != 0)
-	err = errno;
-      else
-	err = 0, *size = total;
+	  if (!err)
+	    *size = total;
+	  else
+	    chop_buffer_clear (buffer);
+	}
 
       close (fd);
     }
@@ -262,57 +642,180 @@ chop_fs_read_block (chop_block_store_t *store,
   return err;
 }
 
+/* Sync file NAME of FS to disk, opening it with FLAGS, with `fsync' if
+   IS_DIRECTORY is true and with `fdatasync' otherwise.  Files removed in
+   the meantime need not be synced.  */
+static chop_error_t
+fs_sync_file (chop_fs_block_store_t *fs, const char *name, int flags,
+	      bool is_directory)
+{
+  chop_error_t err = 0;
+  int fd;
+
+  fd = openat (fs->dir_fd, name, flags);
+  if (fd < 0)
+    return (errno == ENOENT) ? 0 : errno;
+
+  if (is_directory ? fsync (fd) : fdatasync (fd))
+    err = errno;
+
+  close (fd);
+
+  return err;
+}
+
+static int
+compare_names (const void *name1, const void *name2)
+{
+  return strcmp (*(const char **) name1, *(const char **) name2);
+}
+
+/* Make sure all the blocks written to FS so far, and their directory
+   entries, are on stable storage.  */
+static chop_error_t
+fs_sync_blocks (chop_fs_block_store_t *fs)
+{
+  chop_error_t err = 0;
+  const char *name, *end, **dirs;
+  size_t count, i;
+
+  if (fs->unsynced == 0)
+    return 0;
+
+  /* Sync the block files first, and then the directories that refer to
+     them.  */
+  name = chop_buffer_content (&fs->unsynced_files);
+  end = name + chop_buffer_size (&fs->unsynced_files);
+  for (; (name < end) && (!err); name += strlen (name) + 1)
+    err = fs_sync_file (fs, name, O_WRONLY, false);
+
+  if (err)
+    return err;
+
+  name = chop_buffer_content (&fs->unsynced_dirs);
+  end = name + chop_buffer_size (&fs->unsynced_dirs);
+  for (i = 0, count = 0; name + i < end; i++)
+    count += (name[i] == '\0');
+
+  /* Most blocks share their directory with others written in the same
+     round: sort the names to sync each directory once.  */
+  dirs = chop_malloc (count * sizeof (*dirs) + 1,
+		      (chop_class_t *) &chop_fs_block_store_class);
+  if (dirs == NULL)
+    return ENOMEM;
+
+  for (i = 0; name < end; name += strlen (name) + 1)
+    dirs[i++] = name;
+
+  qsort (dirs, count, sizeof (*dirs), compare_names);
+
+  for (i = 0; (i < count) && (!err); i++)
+    if ((i == 0) || (strcmp (dirs[i], dirs[i - 1])))
+      err = fs_sync_file (fs, dirs[i], O_RDONLY | O_DIRECTORY, true);
+
+  chop_free (dirs, (chop_class_t *) &chop_fs_block_store_class);
+
+  if (!err)
+    {
+      chop_buffer_clear (&fs->unsynced_files);
+      chop_buffer_clear (&fs->unsynced_dirs);
+      fs->unsynced = 0;
+    }
+
+  return err;
+}
+
+/* Record that block file FILE_NAME was written to the leaf directory
+   DIR_NAME of FS, and sync FS if enough blocks were written since the
+   last sync.  */
+static chop_error_t
+fs_note_unsynced_block (chop_fs_block_store_t *fs,
+			const char *dir_name, const char *file_name)
+{
+  chop_error_t err;
+
+  err = chop_buffer_append (&fs->unsynced_files, dir_name, strlen (dir_name));
+  if (!err)
+    err = chop_buffer_append (&fs->unsynced_files, "/", 1);
+  if (!err)
+    err = chop_buffer_append (&fs->unsynced_files, file_name,
+			      strlen (file_name) + 1);
+  if (!err)
+    err = fs_note_unsynced_directory (fs, dir_name, strlen (dir_name));
+
+  if ((!err) && (++fs->unsynced >= fs->sync_interval))
+    err = fs_sync_blocks (fs);
+
+  return err;
+}
+
 static chop_error_t
 chop_fs_write_block (chop_block_store_t *store,
 		     const chop_block_key_t *key,
 		     const char *block, size_t size)
 {
-  int fd;
-  bool new_dir = false;
+  int fd, dir_fd;
+  bool cached;
   chop_error_t err = 0;
-  char file_name[chop_block_key_size (key) * 2 + 2];
-  char *dir_name;
+  char dir_name[FS_MAX_DIR_NAME];
+  char file_name[chop_block_key_size (key) * 2 + 1];
+  char temp_name[sizeof (".tmp-") + 2 * 3 * sizeof (long)];
   chop_fs_block_store_t *fs =
     (chop_fs_block_store_t *) store;
 
-  block_file_name (key, file_name);
-  dir_name = dirname (strdupa (file_name));
+  block_file_name (fs, key, dir_name, file_name);
 
  try:
-  /* Speculate that DIR_NAME already exists.  In practice, this is the case
-     most of the time when a store is populated since there are only 1024
-     possible values for DIR_NAME.  */
-  fd = openat (fs->dir_fd, file_name, O_CREAT | O_WRONLY,
+  err = open_leaf_directory (fs, dir_name, true, &dir_fd, &cached);
+  if (err)
+    return err;
+
+  /* Write the block to a temporary file next to its final location, and
+     then rename it, so that the block file is either missing or complete,
+     even if the block is being overwritten.  */
+  snprintf (temp_name, sizeof (temp_name), ".tmp-%lx-%lx",
+	    (unsigned long) getpid (), fs->temp_counter++);
+
+  fd = openat (dir_fd, temp_name, O_CREAT | O_EXCL | O_WRONLY,
 	       S_IRUSR | S_IWUSR);
   if (fd >= 0)
     {
       size_t count;
 
-      if (!new_dir)
-	/* Overwrite the existing block, if any.  */
-	ftruncate (fd, 0);
-
       count = full_write (fd, block, size);
 
       if (count < size)
 	err = errno;
+      else if ((fs->sync_interval == 1) && (fdatasync (fd)))
+	err = errno;
       else
 	err = 0;
 
-      close (fd);
+      if ((close (fd)) && (!err))
+	err = errno;
+
+      if ((!err) && (renameat (dir_fd, temp_name, dir_fd, file_name)))
+	err = errno;
+
+      if (err)
+	unlinkat (dir_fd, temp_name, 0);
+      else if (fs->sync_interval == 1)
+	{
+	  /* Make the new directory entry durable too.  */
+	  if (fsync (dir_fd))
+	    err = errno;
+	}
+      else if (fs->sync_interval > 1)
+	err = fs_note_unsynced_block (fs, dir_name, file_name);
     }
-  else if (errno == ENOENT)
+  else if (errno == EEXIST)
+    /* A stale temporary file, or another process using the same name.  */
+    goto try;
+  else if ((errno == ENOENT) && (cached) && (removed_directory_p (dir_fd)))
     {
-      /* DIR_NAME doesn't exist yet.  */
-      new_dir = true;
-      err = mkdirat (fs->dir_fd, dir_name, S_IRWXU);
-      if (err == 0)
-	goto try;
-      else if (errno == EEXIST)
-	/* DIR_NAME was created in the meantime.  */
-	goto try;
-      else
-	err = errno;
+      /* DIR_NAME was removed by another process.  */
+      dir_cache_invalidate (fs, dir_name);
+      goto try;
     }
   else
     err = errno;
@@ -325,36 +828,60 @@ chop_fs_delete_block (chop_block_store_t *store,
 		      const chop_block_key_t *key)
 {
   chop_error_t err;
+  bool cached;
+  int dir_fd;
   chop_fs_block_store_t *fs =
     (chop_fs_block_store_t *) store;
-  char file_name[chop_block_key_size (key) * 2 + 2];
+  char dir_name[FS_MAX_DIR_NAME];
+  char file_name[chop_block_key_size (key) * 2 + 1];
 
-  block_file_name (key, file_name);
-  err = unlinkat (fs->dir_fd, file_name, 0);
+  block_file_name (fs, key, dir_name, file_name);
+
+ retry:
+  err = open_leaf_directory (fs, dir_name, false, &dir_fd, &cached);
+  if (!err && unlinkat (dir_fd, file_name, 0))
+    {
+      err = errno;
+      if ((err == ENOENT) && (cached) && (removed_directory_p (dir_fd)))
+	{
+	  dir_cache_invalidate (fs, dir_name);
+	  goto retry;
+	}
+    }
 
   if (err != 0)
     {
-      if (errno == ENOENT)
+      if (err == ENOENT)
 	err = CHOP_STORE_BLOCK_UNAVAIL;
-      else
-	err = errno;
     }
   else
     {
-      /* Try to remove the directory containing FILE_NAME.  */
-      char *dir_name;
+      /* Try to remove the directories containing FILE_NAME, starting from
+	 the innermost one.  */
+      char *slash;
 
-      dir_name = dirname (file_name);
-      err = unlinkat (fs->dir_fd, dir_name, AT_REMOVEDIR);
-
-      if (err != 0)
+      do
 	{
-	  if (errno == ENOTEMPTY || errno == EEXIST)
-	    /* There are other entries in this directory.  */
-	    err = 0;
-	  else
-	    err = errno;
+	  err = unlinkat (fs->dir_fd, dir_name, AT_REMOVEDIR);
+	  if (err != 0)
+	    {
+	      if (errno == ENOTEMPTY || errno == EEXIST)
+		/* There are other entries in this directory.  */
+		err = 0;
+	      else
+		err = errno;
+	      break;
+	    }
+
+	  /* Only leaf directories are cached, so this is a no-op for the
+	     others.  */
+	  dir_cache_invalidate (fs, dir_name);
+
+	  slash = strrchr (dir_name, '/');
+	  if (slash != NULL)
+	    *slash = '\0';
 	}
+      while (slash != NULL);
     }
 
   return err;
@@ -366,106 +893,128 @@ free_key (char *key, void *unused)
   free (key);
 }
 
+/* Move IT to the next block file, starting from its current position.  */
 static chop_error_t
-chop_fs_first_block (chop_block_store_t *store,
-		     chop_block_iterator_t *it)
+fs_iterator_advance (chop_fs_block_iterator_t *fsit)
 {
-  chop_error_t err;
-  chop_fs_block_iterator_t *fsit = (chop_fs_block_iterator_t *) it;
+  chop_fs_block_store_t *fs =
+    (chop_fs_block_store_t *) fsit->block_iterator.store;
+  struct dirent *entry;
 
-  err = chop_object_initialize ((chop_object_t *) it,
-				&chop_fs_block_iterator_class);
-  if (err == 0)
+  while (1)
     {
-      struct dirent *result;
-      chop_fs_block_store_t *fs = (chop_fs_block_store_t *) store;
-
-      fsit->top_dir_fd = dup (fs->dir_fd);
-      if (fsit->top_dir_fd < 0)
+      errno = 0;
+      entry = readdir (fsit->dirs[fsit->depth]);
+      if (entry == NULL)
 	{
-	  err = errno;
-	  goto error;
-	}
+	  if (errno != 0)
+	    return errno;
 
-      fsit->top_dir = fdopendir (fsit->top_dir_fd);
-      if (fsit->top_dir == NULL)
-	{
-	  err = errno;
-	  goto error;
-	}
+	  /* We're done with this directory; go back to its parent.  */
+	  if (fsit->depth == 0)
+	    {
+	      fsit->block_iterator.nil = 1;
+	      return CHOP_STORE_END;
+	    }
 
-      do
+	  closedir (fsit->dirs[fsit->depth]);
+	  fsit->dirs[fsit->depth] = NULL;
+	  fsit->depth--;
+	}
+      else if (hidden_file_p (entry->d_name))
+	continue;
+      else if (fsit->depth < fs->levels)
 	{
-	  err = readdir_r (fsit->top_dir, &fsit->top_entry, &result);
-	  if (result == NULL)
+	  /* Enter this sub-directory.  */
+	  int fd;
+
+	  if (strlen (entry->d_name) != fs->width)
+	    continue;
+
+	  fd = openat (dirfd (fsit->dirs[fsit->depth]), entry->d_name,
+		       O_DIRECTORY | O_RDONLY);
+	  if (fd < 0)
 	    {
-	      err = CHOP_STORE_END;
-	      goto error;
+	      if (errno == ENOTDIR || errno == ENOENT)
+		continue;
+	      return errno;
 	    }
-	  if (err != 0)
+
+	  memcpy (&fsit->prefix[fsit->depth * fs->width], entry->d_name,
+		  fs->width);
+	  fsit->depth++;
+	  fsit->dirs[fsit->depth] = fdopendir (fd);
+	  if (fsit->dirs[fsit->depth] == NULL)
 	    {
-	      err = errno;
-	      goto error;
+	      close (fd);
+	      fsit->depth--;
+	      return errno;
 	    }
 	}
-      while (dot_or_dot_dot (fsit->top_entry.d_name));
+      else
+	{
+	  /* We have an entry, so compute the corresponding key and store it
+	     in IT.  */
+	  size_t prefix_size = fs->levels * fs->width;
+	  size_t name_size = strlen (entry->d_name);
+	  char base32[prefix_size + name_size + 1];
+	  const char *end;
+	  size_t key_size;
+	  char *raw;
+
+	  memcpy (base32, fsit->prefix, prefix_size);
+	  memcpy (base32 + prefix_size, entry->d_name, name_size + 1);
+
+	  raw = chop_malloc (sizeof base32, &chop_fs_block_iterator_class);
+	  if (raw == NULL)
+	    return ENOMEM;
+	  key_size = chop_base32_string_to_buffer (base32, sizeof base32 - 1,
+						   raw, &end);
+
+	  chop_block_key_free (&fsit->block_iterator.key);
+	  chop_block_key_init (&fsit->block_iterator.key,
+			       raw, key_size, free_key, NULL);
+	  fsit->block_iterator.nil = 0;
+
+	  return 0;
+	}
+    }
+}
 
-      memcpy (fsit->subdir_name, fsit->top_entry.d_name, 2);
-      fsit->subdir_name[2] = '\0';
+static chop_error_t
+chop_fs_first_block (chop_block_store_t *store,
+		     chop_block_iterator_t *it)
+{
+  chop_error_t err;
+  chop_fs_block_iterator_t *fsit = (chop_fs_block_iterator_t *) it;
+
+  err = chop_object_initialize ((chop_object_t *) it,
+				&chop_fs_block_iterator_class);
+  if (err == 0)
+    {
+      chop_fs_block_store_t *fs = (chop_fs_block_store_t *) store;
+      int fd;
+
+      it->store = store;
 
-      fsit->subdir_fd = openat (fsit->top_dir_fd, fsit->top_entry.d_name,
-				O_DIRECTORY | O_RDONLY);
-      if (fsit->subdir_fd < 0)
+      fd = openat (fs->dir_fd, ".", O_RDONLY | O_DIRECTORY);
+      if (fd < 0)
 	{
 	  err = errno;
 	  goto error;
 	}
 
-      fsit->subdir = fdopendir (fsit->subdir_fd);
-      if (fsit->subdir == NULL)
+      fsit->dirs[0] = fdopendir (fd);
+      if (fsit->dirs[0] == NULL)
 	{
 	  err = errno;
+	  close (fd);
 	  goto error;
 	}
 
-      do
-	{
-	  err = readdir_r (fsit->subdir, &fsit->sub_entry, &result);
-	  if (result == NULL)
-	    {
-	      err = CHOP_STORE_END;
-	      goto error;
-	    }
-	  if (err != 0)
-	    {
-	      err = errno;
-	      goto error;
-	    }
-	}
-      while (dot_or_dot_dot (fsit->sub_entry.d_name));
-
-      fsit->block_iterator.nil = 0;
-
-      /* We have an entry, so compute the corresponding key and store it in
-	 IT.  */
-      char base32[2 + fsit->sub_entry.d_reclen + 1];
-      strcpy (base32, fsit->subdir_name);
-      memcpy (base32 + 2, fsit->sub_entry.d_name, fsit->sub_entry.d_reclen);
-      base32[2 + fsit->sub_entry.d_reclen] = '\0';
-
-      char *raw;
-      const char *end;
-      size_t key_size;
-      raw = chop_malloc (sizeof base32, &chop_fs_block_iterator_class);
-      if (raw == NULL)
-	return ENOMEM;
-      key_size = chop_base32_string_to_buffer (base32, sizeof base32 - 1,
-					       raw, &end);
-
-      chop_block_key_init (&fsit->block_iterator.key,
-			   raw, key_size, free_key, NULL);
-
-      return 0;
+      err = fs_iterator_advance (fsit);
+      if (err)
+	goto error;
     }
 
   return err;
@@ -478,117 +1027,60 @@ chop_fs_first_block (chop_block_store_t *store,
 static chop_error_t
 chop_fs_next_block (chop_block_iterator_t *it)
 {
-  chop_error_t err;
-  struct dirent *result;
-  chop_fs_block_iterator_t *fsit = (chop_fs_block_iterator_t *) it;
-
- retry:
-  do
-    {
-      err = readdir_r (fsit->subdir, &fsit->sub_entry, &result);
-
-      if (result == NULL)
-	{
-	  /* We're done with this sub-directory; jump to the next one.  */
-	  closedir (fsit->subdir);
-	  fsit->subdir_fd = -1;
-	  fsit->subdir = NULL;
-
-	  do
-	    {
-	      err = readdir_r (fsit->top_dir, &fsit->top_entry, &result);
-	      if (result == NULL)
-		{
-		  err = CHOP_STORE_END;
-		  fsit->block_iterator.nil = 1;
-		}
-	      else if (err != 0)
-		err = errno;
-	    }
-	  while (err == 0 && dot_or_dot_dot (fsit->top_entry.d_name));
-
-	  if (err == 0)
-	    {
-	      memcpy (fsit->subdir_name, fsit->top_entry.d_name, 2);
-
-	      fsit->subdir_fd = openat (fsit->top_dir_fd, fsit->top_entry.d_name,
-					O_DIRECTORY | O_RDONLY);
-	      if (fsit->subdir_fd < 0)
-		err = errno;
-	      else
-		{
-		  fsit->subdir = fdopendir (fsit->subdir_fd);
-		  if (fsit->subdir == NULL)
-		    err = errno;
-		  else
-		    /* We entered the next sub-directory, so try again.  */
-		    goto retry;
-		}
-	    }
-	}
-      else if (err != 0)
-	err = errno;
-    }
-  while (err == 0 && dot_or_dot_dot (fsit->sub_entry.d_name));
-
-  if (err == 0)
-    {
-      /* We have an entry, so compute the corresponding key and store it in
-	 IT.  */
-
-      chop_block_key_free (&fsit->block_iterator.key);
-
-      char base32[2 + fsit->sub_entry.d_reclen + 1];
-      strcpy (base32, fsit->subdir_name);
-      memcpy (base32 + 2, fsit->sub_entry.d_name, fsit->sub_entry.d_reclen);
-      base32[2 + fsit->sub_entry.d_reclen] = '\0';
-
-      char *raw;
-      const char *end;
-      size_t key_size;
-      raw = chop_malloc (sizeof base32, &chop_fs_block_iterator_class);
-      if (raw == NULL)
-	return ENOMEM;
-      key_size = chop_base32_string_to_buffer (base32, sizeof base32 - 1,
-					       raw, &end);
-
-      chop_block_key_init (&fsit->block_iterator.key,
-			   raw, key_size, free_key, NULL);
-    }
-
-  return err;
+  return fs_iterator_advance ((chop_fs_block_iterator_t *) it);
 }
 
 static chop_error_t
 chop_fs_sync (chop_block_store_t *store)
 {
-  return 0;
+  chop_fs_block_store_t *fs =
+    (chop_fs_block_store_t *) store;
+
+  return fs_sync_blocks (fs);
 }
 
 static chop_error_t
 chop_fs_close (chop_block_store_t *store)
 {
+  chop_error_t err = 0;
   chop_fs_block_store_t *fs =
     (chop_fs_block_store_t *) store;
 
+  /* Release everything even if syncing fails, but report it: the blocks
+     written since the last sync may not be on disk.  */
+  if (fs->dir_fd >= 0)
+    err = fs_sync_blocks (fs);
+
+  dir_cache_clear (fs);
+  chop_buffer_return (&fs->unsynced_files);
+  chop_buffer_return (&fs->unsynced_dirs);
+
   if (fs->eventually_close && fs->dir_fd >= 0)
     close (fs->dir_fd);
 
   fs->dir_fd = -1;
 
-  return 0;
+  return err;
 }
 
-
+
 chop_error_t
-chop_fs_store_open (int dir_fd, int eventually_close,
-		    chop_block_store_t *store)
+chop_fs_store_open_with_layout (int dir_fd, int eventually_close,
+				unsigned levels, unsigned width,
+				chop_block_store_t *store)
 {
   chop_error_t err;
   char *log_name;
+  unsigned actual_levels, actual_width;
+  bool empty = false;
+  size_t i;
   chop_fs_block_store_t *fs =
     (chop_fs_block_store_t *)store;
 
+  if ((levels > FS_MAX_LEVELS) || (width > FS_MAX_WIDTH)
+      || ((levels == 0) != (width == 0)))
+    return CHOP_INVALID_ARG;
+
   log_name = alloca (10);
   snprintf (log_name, 10, "fs/%i", dir_fd);
 
@@ -610,6 +1102,73 @@ chop_fs_store_open (int dir_fd, int eventually_close,
 
   fs->dir_fd = dir_fd;
   fs->eventually_close = eventually_close;
+  fs->sync_interval = 0;
+  fs->unsynced = 0;
+  chop_buffer_init (&fs->unsynced_files, 0);
+  chop_buffer_init (&fs->unsynced_dirs, 0);
+  fs->temp_counter = 0;
+  for (i = 0; i < FS_DIR_CACHE_SIZE; i++)
+    fs->dir_cache[i].fd = -1;
+
+  err = read_layout (fs, &actual_levels, &actual_width);
+  if (err == ENOENT)
+    {
+      err = store_empty_p (fs, &empty);
+      if ((!err) && (empty) && (levels != 0))
+	{
+	  /* A new store: use the requested layout.  */
+	  actual_levels = levels;
+	  actual_width = width;
+	}
+      else
+	{
+	  actual_levels = FS_DEFAULT_LEVELS;
+	  actual_width = FS_DEFAULT_WIDTH;
+	}
+
+      fs->levels = actual_levels;
+      fs->width = actual_width;
+
+      /* Only record layouts other than the original one, which older
+	 versions of libchop can read.  */
+      if ((!err)
+	  && ((actual_levels != FS_DEFAULT_LEVELS)
+	      || (actual_width != FS_DEFAULT_WIDTH)))
+	err = write_layout (fs);
+    }
+
+  if ((!err)
+      && (levels != 0)
+      && ((actual_levels != levels) || (actual_width != width)))
+    /* The store already uses a different layout.  */
+    err = CHOP_INVALID_ARG;
+
+  if (err)
+    {
+      fs->eventually_close = 0;
+      chop_object_destroy ((chop_object_t *) store);
+      return err;
+    }
+
+  fs->levels = actual_levels;
+  fs->width = actual_width;
 
   return 0;
 }
+
+chop_error_t
+chop_fs_store_open (int dir_fd, int eventually_close,
+		    chop_block_store_t *store)
+{
+  return chop_fs_store_open_with_layout (dir_fd, eventually_close, 0, 0,
+					 store);
+}
+
+void
+chop_fs_store_set_sync_interval (chop_block_store_t *store, size_t interval)
+{
+  chop_fs_block_store_t *fs =
+    (chop_fs_block_store_t *) store;
+
+  fs->sync_interval = interval;
+}
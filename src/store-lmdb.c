@@ -0,0 +1,685 @@
+/* libchop -- a utility library for distributed storage and data backup
+   Copyright (C) 2026  Ludovic Courtès <ludo@gnu.org>
+
+   Libchop is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Libchop is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with libchop.  If not, see <http://www.gnu.org/licenses/>.  */
+
+/* A store backed by LMDB, the Lightning Memory-Mapped Database.  Reads use
+   read-only transactions of their own, so any number of threads may read
+   at once.  By default, each write is committed in a transaction of its
+   own.  Writes may instead be grouped in a write transaction that is
+   committed every few blocks, which amortizes the cost of syncing; since
+   LMDB write transactions belong to the thread that began them, that
+   thread is then the only one allowed to write until it commits.  */
+
+#include <chop/chop-config.h>
+
+#include <chop/chop.h>
+#include <chop/stores.h>
+#include <chop/buffers.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <lmdb.h>
+
+
+/* The default size of the memory map, which bounds the size of the
+   database.  Address space is only reserved, not allocated.  */
+#define LMDB_DEFAULT_MAP_SIZE						\
+  (sizeof (size_t) > 4 ? (size_t) 1 << 40 : (size_t) 1 << 30)
+
+
+/* `chop_lmdb_block_store_t' inherits from `chop_block_store_t'.  */
+CHOP_DECLARE_RT_CLASS_WITH_METACLASS (lmdb_block_store, block_store,
+				      file_based_store_class,
+				      MDB_env *env;
+				      MDB_dbi dbi;
+
+				      /* The pending write transaction, if
+					 any, the thread that began it, the
+					 number of writes it contains, and
+					 the number of writes after which it
+					 is committed */
+				      pthread_mutex_t lock;
+				      MDB_txn *txn;
+				      pthread_t writer;
+				      size_t pending;
+				      size_t batch_size;);
+
+/* A generic open method, common to all file-based block stores.  */
+static chop_error_t
+chop_lmdb_generic_open (const chop_class_t *class,
+			const char *file, int open_flags, mode_t mode,
+			chop_block_store_t *store)
+{
+  if ((chop_file_based_store_class_t *)class != &chop_lmdb_block_store_class)
+    return CHOP_INVALID_ARG;
+
+  return (chop_lmdb_store_open (file, 0, open_flags, mode, store));
+}
+
+static chop_error_t chop_lmdb_close (chop_block_store_t *);
+
+static void
+lmdb_dtor (chop_object_t *object)
+{
+  /* Release the environment of stores destroyed without being closed.
+     When another thread holds the pending write transaction, this fails
+     with EBUSY and the environment is left open: closing it, or
+     committing or aborting that transaction from here, would corrupt
+     LMDB's state.  */
+  chop_lmdb_close ((chop_block_store_t *) object);
+}
+
+CHOP_DEFINE_RT_CLASS_WITH_METACLASS (lmdb_block_store, block_store,
+				     file_based_store_class,
+
+				     /* metaclass inits */
+				     .generic_open = chop_lmdb_generic_open,
+
+				     NULL, lmdb_dtor,
+				     NULL, NULL, /* No copy/equalp */
+				     NULL, NULL  /* No serial/deserial */);
+
+
+/* Convert RC, an LMDB return code, to a libchop error code.  */
+static inline chop_error_t
+lmdb_error (int rc)
+{
+  switch (rc)
+    {
+    case MDB_SUCCESS:
+      return 0;
+
+    case MDB_NOTFOUND:
+      return CHOP_STORE_BLOCK_UNAVAIL;
+
+    case MDB_MAP_FULL:
+      return ENOSPC;
+
+    default:
+      /* Positive values are `errno' values.  */
+      return (rc > 0) ? rc : CHOP_STORE_ERROR;
+    }
+}
+
+static inline void
+lmdb_key (const chop_block_key_t *key, MDB_val *db_key)
+{
+  db_key->mv_data = (char *) chop_block_key_buffer (key);
+  db_key->mv_size = chop_block_key_size (key);
+}
+
+/* Commit the pending write transaction of LMDB, if any.  LMDB->LOCK must
+   be held.  Return EBUSY if the transaction belongs to another thread.  */
+static chop_error_t
+lmdb_commit (chop_lmdb_block_store_t *lmdb)
+{
+  int rc = 0;
+
+  if (lmdb->txn != NULL)
+    {
+      if (!pthread_equal (lmdb->writer, pthread_self ()))
+	return EBUSY;
+
+      rc = mdb_txn_commit (lmdb->txn);
+      lmdb->txn = NULL;
+      lmdb->pending = 0;
+    }
+
+  return lmdb_error (rc);
+}
+
+/* Return in *TXN a transaction in which to look up blocks of LMDB.  It is
+   the pending write transaction if it was begun by the calling thread, so
+   that it sees the blocks it wrote, and a new read-only transaction
+   otherwise, in which case *OWNED is set to true.  */
+static chop_error_t
+lmdb_read_txn (chop_lmdb_block_store_t *lmdb, MDB_txn **txn, bool *owned)
+{
+  pthread_mutex_lock (&lmdb->lock);
+  if ((lmdb->txn != NULL) && (pthread_equal (lmdb->writer, pthread_self ())))
+    {
+      *txn = lmdb->txn;
+      *owned = false;
+    }
+  else
+    *txn = NULL;
+  pthread_mutex_unlock (&lmdb->lock);
+
+  if (*txn != NULL)
+    return 0;
+
+  *owned = true;
+
+  return lmdb_error (mdb_txn_begin (lmdb->env, NULL, MDB_RDONLY, txn));
+}
+
+/* Return in *TXN the write transaction in which to modify LMDB.  When
+   writes are not grouped, it is a new transaction, and *OWNED is set to
+   true.  Otherwise, it is the pending write transaction, which is begun
+   if needed; return EBUSY if it belongs to another thread.  */
+static chop_error_t
+lmdb_write_txn (chop_lmdb_block_store_t *lmdb, MDB_txn **txn, bool *owned)
+{
+  int rc = 0;
+  chop_error_t err;
+
+  pthread_mutex_lock (&lmdb->lock);
+  if (lmdb->batch_size <= 1)
+    {
+      /* LMDB serializes the threads that begin a write transaction.  */
+      pthread_mutex_unlock (&lmdb->lock);
+      *owned = true;
+
+      return lmdb_error (mdb_txn_begin (lmdb->env, NULL, 0, txn));
+    }
+
+  *owned = false;
+  if (lmdb->txn == NULL)
+    {
+      rc = mdb_txn_begin (lmdb->env, NULL, 0, &lmdb->txn);
+      if (rc)
+	lmdb->txn = NULL;
+      else
+	{
+	  lmdb->writer = pthread_self ();
+	  lmdb->pending = 0;
+	}
+      err = lmdb_error (rc);
+    }
+  else if (!pthread_equal (lmdb->writer, pthread_self ()))
+    /* Using the transaction of another thread would corrupt LMDB's
+       state.  */
+    err = EBUSY;
+  else
+    err = 0;
+  *txn = lmdb->txn;
+  pthread_mutex_unlock (&lmdb->lock);
+
+  return err;
+}
+
+/* Account for a write in TXN, as returned along with OWNED by
+   `lmdb_write_txn', whose result was RC, and commit TXN if it is large
+   enough.  */
+static chop_error_t
+lmdb_written (chop_lmdb_block_store_t *lmdb, MDB_txn *txn, bool owned,
+	      int rc)
+{
+  chop_error_t err;
+
+  if (owned)
+    {
+      if ((rc) && (rc != MDB_NOTFOUND))
+	{
+	  mdb_txn_abort (txn);
+	  return lmdb_error (rc);
+	}
+
+      err = lmdb_error (mdb_txn_commit (txn));
+
+      return err ? err : lmdb_error (rc);
+    }
+
+  pthread_mutex_lock (&lmdb->lock);
+  if ((rc) && (rc != MDB_NOTFOUND))
+    {
+      /* The transaction can no longer be used, so the blocks it contains
+	 are lost.  */
+      mdb_txn_abort (lmdb->txn);
+      lmdb->txn = NULL;
+      lmdb->pending = 0;
+      err = lmdb_error (rc);
+    }
+  else if (++lmdb->pending >= lmdb->batch_size)
+    err = lmdb_commit (lmdb);
+  else
+    err = lmdb_error (rc);
+  pthread_mutex_unlock (&lmdb->lock);
+
+  return err;
+}
+
+
+
+/* Iterators.  */
+
+CHOP_DECLARE_RT_CLASS (lmdb_block_iterator, block_iterator,
+		       MDB_txn *txn;
+		       MDB_cursor *cursor;);
+
+static chop_error_t chop_lmdb_it_next (chop_block_iterator_t *);
+
+static chop_error_t
+lbi_ctor (chop_object_t *object, const chop_class_t *class)
+{
+  chop_lmdb_block_iterator_t *it = (chop_lmdb_block_iterator_t *)object;
+
+  it->block_iterator.next = chop_lmdb_it_next;
+  it->txn = NULL;
+  it->cursor = NULL;
+
+  return 0;
+}
+
+static void
+lbi_dtor (chop_object_t *object)
+{
+  chop_lmdb_block_iterator_t *it = (chop_lmdb_block_iterator_t *)object;
+
+  it->block_iterator.next = NULL;
+  if (it->cursor)
+    {
+      mdb_cursor_close (it->cursor);
+      it->cursor = NULL;
+    }
+  if (it->txn)
+    {
+      mdb_txn_abort (it->txn);
+      it->txn = NULL;
+    }
+
+  chop_block_key_free (&it->block_iterator.key);
+}
+
+CHOP_DEFINE_RT_CLASS (lmdb_block_iterator, block_iterator,
+		      lbi_ctor, lbi_dtor,
+		      NULL, NULL,
+		      NULL, NULL);
+
+
+static void
+do_free (char *ptr, void *thing)
+{
+  free (ptr);
+}
+
+/* Move the cursor of IT with OP and copy the key it points to, since it
+   is only valid until the transaction ends.  */
+static chop_error_t
+lmdb_cursor_nextify (chop_lmdb_block_iterator_t *it, MDB_cursor_op op)
+{
+  int rc;
+  MDB_val db_key, db_data;
+  char *key;
+
+  rc = mdb_cursor_get (it->cursor, &db_key, &db_data, op);
+  if (rc == MDB_NOTFOUND)
+    {
+      it->block_iterator.nil = 1;
+      return CHOP_STORE_END;
+    }
+  else if (rc)
+    return lmdb_error (rc);
+
+  key = malloc (db_key.mv_size + 1);
+  if (key == NULL)
+    return ENOMEM;
+
+  memcpy (key, db_key.mv_data, db_key.mv_size);
+  chop_block_key_free (&it->block_iterator.key);
+  chop_block_key_init (&it->block_iterator.key, key, db_key.mv_size,
+		       do_free, NULL);
+  it->block_iterator.nil = 0;
+
+  return 0;
+}
+
+static chop_error_t
+chop_lmdb_first_block (chop_block_store_t *store,
+		       chop_block_iterator_t *it)
+{
+  chop_error_t err;
+  chop_lmdb_block_store_t *lmdb = (chop_lmdb_block_store_t *)store;
+  chop_lmdb_block_iterator_t *lmdb_it = (chop_lmdb_block_iterator_t *)it;
+
+  /* Make the blocks written so far visible to the iterator's
+     transaction.  */
+  pthread_mutex_lock (&lmdb->lock);
+  err = lmdb_commit (lmdb);
+  pthread_mutex_unlock (&lmdb->lock);
+  if (err)
+    return err;
+
+  err = chop_object_initialize ((chop_object_t *)it,
+				&chop_lmdb_block_iterator_class);
+  if (err)
+    return err;
+
+  it->store = store;
+
+  err = lmdb_error (mdb_txn_begin (lmdb->env, NULL, MDB_RDONLY,
+				   &lmdb_it->txn));
+  if (err)
+    lmdb_it->txn = NULL;
+  else
+    {
+      err = lmdb_error (mdb_cursor_open (lmdb_it->txn, lmdb->dbi,
+					 &lmdb_it->cursor));
+      if (err)
+	lmdb_it->cursor = NULL;
+      else
+	err = lmdb_cursor_nextify (lmdb_it, MDB_FIRST);
+    }
+
+  if (err)
+    chop_object_destroy ((chop_object_t *)it);
+
+  return err;
+}
+
+static chop_error_t
+chop_lmdb_it_next (chop_block_iterator_t *it)
+{
+  chop_lmdb_block_iterator_t *lmdb_it = (chop_lmdb_block_iterator_t *)it;
+
+  if ((chop_block_iterator_is_nil (it)) || (!lmdb_it->cursor))
+    return CHOP_STORE_END;
+
+  return lmdb_cursor_nextify (lmdb_it, MDB_NEXT);
+}
+
+
+
+static chop_error_t chop_lmdb_blocks_exist (chop_block_store_t *,
+					    size_t n,
+					    const chop_block_key_t k[n],
+					    bool e[n]);
+
+static chop_error_t chop_lmdb_read_block (chop_block_store_t *,
+					  const chop_block_key_t *,
+					  chop_buffer_t *,
+					  size_t *);
+
+static chop_error_t chop_lmdb_write_block (chop_block_store_t *,
+					   const chop_block_key_t *,
+					   const char *,
+					   size_t);
+
+static chop_error_t chop_lmdb_delete_block (chop_block_store_t *,
+					    const chop_block_key_t *);
+
+static chop_error_t chop_lmdb_sync (chop_block_store_t *);
+
+
+chop_error_t
+chop_lmdb_store_open (const char *name, size_t map_size,
+		      int open_flags, mode_t mode,
+		      chop_block_store_t *s)
+{
+  chop_error_t err;
+  unsigned int env_flags;
+  MDB_env *env;
+  MDB_txn *txn;
+  MDB_dbi dbi;
+  chop_lmdb_block_store_t *store = (chop_lmdb_block_store_t *)s;
+
+  /* The database is a single file rather than a directory, and read-only
+     transactions are not tied to threads, so that a thread may look up
+     blocks while it has a write transaction pending.  */
+  env_flags = MDB_NOSUBDIR | MDB_NOTLS;
+  if ((open_flags & O_ACCMODE) == O_RDONLY)
+    env_flags |= MDB_RDONLY;
+
+  if ((!(open_flags & O_CREAT)) && (access (name, F_OK)))
+    return errno;
+
+  err = lmdb_error (mdb_env_create (&env));
+  if (err)
+    return err;
+
+  err = lmdb_error (mdb_env_set_mapsize (env, map_size ? map_size
+					 : LMDB_DEFAULT_MAP_SIZE));
+  if (!err)
+    err = lmdb_error (mdb_env_open (env, name, env_flags, mode));
+  if (!err)
+    {
+      err = lmdb_error (mdb_txn_begin (env, NULL, env_flags & MDB_RDONLY,
+				       &txn));
+      if (!err)
+	{
+	  err = lmdb_error (mdb_dbi_open (txn, NULL, 0, &dbi));
+	  if (err)
+	    mdb_txn_abort (txn);
+	  else
+	    err = lmdb_error (mdb_txn_commit (txn));
+	}
+    }
+
+  if (!err)
+    err = chop_object_initialize ((chop_object_t *)store,
+				  (chop_class_t *)&chop_lmdb_block_store_class);
+  if (err)
+    {
+      mdb_env_close (env);
+      return err;
+    }
+
+  store->env = env;
+  store->dbi = dbi;
+  store->txn = NULL;
+  store->pending = 0;
+  store->batch_size = 1;
+  pthread_mutex_init (&store->lock, NULL);
+
+  store->block_store.iterator_class = &chop_lmdb_block_iterator_class;
+  store->block_store.blocks_exist = chop_lmdb_blocks_exist;
+  store->block_store.read_block = chop_lmdb_read_block;
+  store->block_store.write_block = chop_lmdb_write_block;
+  store->block_store.delete_block = chop_lmdb_delete_block;
+  store->block_store.first_block = chop_lmdb_first_block;
+  store->block_store.sync = chop_lmdb_sync;
+  store->block_store.close = chop_lmdb_close;
+
+  return 0;
+}
+
+chop_error_t
+chop_lmdb_store_set_batch_size (chop_block_store_t *store, size_t size)
+{
+  chop_error_t err;
+  chop_lmdb_block_store_t *lmdb = (chop_lmdb_block_store_t *)store;
+
+  if ((size == 0)
+      || (!chop_object_is_a ((chop_object_t *) store,
+			     (chop_class_t *) &chop_lmdb_block_store_class)))
+    return CHOP_INVALID_ARG;
+
+  pthread_mutex_lock (&lmdb->lock);
+  err = lmdb_commit (lmdb);
+  if (!err)
+    lmdb->batch_size = size;
+  pthread_mutex_unlock (&lmdb->lock);
+
+  return err;
+}
+
+chop_error_t
+chop_lmdb_store_process_block (chop_block_store_t *store,
+			       const chop_block_key_t *key,
+			       chop_error_t (* process) (const char *,
+							 size_t, void *),
+			       void *data)
+{
+  chop_error_t err;
+  chop_lmdb_block_store_t *lmdb = (chop_lmdb_block_store_t *)store;
+  MDB_txn *txn;
+  MDB_val db_key, db_data;
+  bool owned;
+
+  err = lmdb_read_txn (lmdb, &txn, &owned);
+  if (err)
+    return err;
+
+  lmdb_key (key, &db_key);
+  err = lmdb_error (mdb_get (txn, lmdb->dbi, &db_key, &db_data));
+  if (!err)
+    /* DB_DATA points into the memory map until TXN ends.  */
+    err = process (db_data.mv_data, db_data.mv_size, data);
+
+  if (owned)
+    mdb_txn_abort (txn);
+
+  return err;
+}
+
+
+/* Method implementations.  */
+
+static chop_error_t
+chop_lmdb_blocks_exist (chop_block_store_t *store,
+			size_t n, const chop_block_key_t keys[n],
+			bool exists[n])
+{
+  chop_error_t err;
+  chop_lmdb_block_store_t *lmdb = (chop_lmdb_block_store_t *)store;
+  MDB_txn *txn;
+  MDB_val db_key, db_data;
+  bool owned;
+  size_t i;
+
+  /* Look up all the keys in a single transaction.  */
+  err = lmdb_read_txn (lmdb, &txn, &owned);
+  if (err)
+    return err;
+
+  for (i = 0; (i < n) && (!err); i++)
+    {
+      int rc;
+
+      lmdb_key (&keys[i], &db_key);
+      rc = mdb_get (txn, lmdb->dbi, &db_key, &db_data);
+      exists[i] = (rc == 0);
+      if ((rc) && (rc != MDB_NOTFOUND))
+	err = lmdb_error (rc);
+    }
+
+  if (owned)
+    mdb_txn_abort (txn);
+
+  return err;
+}
+
+static chop_error_t
+copy_block (const char *block, size_t size, void *buffer)
+{
+  return chop_buffer_push ((chop_buffer_t *) buffer, block, size);
+}
+
+static chop_error_t
+chop_lmdb_read_block (chop_block_store_t *store,
+		      const chop_block_key_t *key, chop_buffer_t *buffer,
+		      size_t *size)
+{
+  chop_error_t err;
+
+  err = chop_lmdb_store_process_block (store, key, copy_block, buffer);
+  *size = err ? 0 : chop_buffer_size (buffer);
+
+  return err;
+}
+
+static chop_error_t
+chop_lmdb_write_block (chop_block_store_t *store,
+		       const chop_block_key_t *key,
+		       const char *buffer, size_t size)
+{
+  chop_error_t err;
+  chop_lmdb_block_store_t *lmdb = (chop_lmdb_block_store_t *)store;
+  MDB_txn *txn;
+  MDB_val db_key, db_data;
+  bool owned;
+
+  err = lmdb_write_txn (lmdb, &txn, &owned);
+  if (err)
+    return err;
+
+  lmdb_key (key, &db_key);
+  db_data.mv_data = (char *) buffer;
+  db_data.mv_size = size;
+
+  return lmdb_written (lmdb, txn, owned,
+		       mdb_put (txn, lmdb->dbi, &db_key, &db_data,
+				0 /* replace */));
+}
+
+static chop_error_t
+chop_lmdb_delete_block (chop_block_store_t *store,
+			const chop_block_key_t *key)
+{
+  chop_error_t err;
+  chop_lmdb_block_store_t *lmdb = (chop_lmdb_block_store_t *)store;
+  MDB_txn *txn;
+  MDB_val db_key;
+  bool owned;
+
+  err = lmdb_write_txn (lmdb, &txn, &owned);
+  if (err)
+    return err;
+
+  lmdb_key (key, &db_key);
+
+  return lmdb_written (lmdb, txn, owned,
+		       mdb_del (txn, lmdb->dbi, &db_key, NULL));
+}
+
+static chop_error_t
+chop_lmdb_sync (chop_block_store_t *store)
+{
+  chop_error_t err;
+  chop_lmdb_block_store_t *lmdb = (chop_lmdb_block_store_t *)store;
+
+  pthread_mutex_lock (&lmdb->lock);
+  err = lmdb_commit (lmdb);
+  pthread_mutex_unlock (&lmdb->lock);
+
+  if (!err)
+    err = lmdb_error (mdb_env_sync (lmdb->env, 1));
+
+  return err;
+}
+
+static chop_error_t
+chop_lmdb_close (chop_block_store_t *store)
+{
+  chop_error_t err = 0;
+  chop_lmdb_block_store_t *lmdb = (chop_lmdb_block_store_t *)store;
+
+  if (lmdb->env)
+    {
+      pthread_mutex_lock (&lmdb->lock);
+      err = lmdb_commit (lmdb);
+      pthread_mutex_unlock (&lmdb->lock);
+
+      if (err == EBUSY)
+	/* The transaction of another thread is still pending: keep
+	   everything in place so that it can be committed.  */
+	return err;
+
+      mdb_dbi_close (lmdb->env, lmdb->dbi);
+      mdb_env_close (lmdb->env);
+      pthread_mutex_destroy (&lmdb->lock);
+
+      /* The handle may no longer be accessed, regardless of the return
+	 value.  */
+      lmdb->env = NULL;
+    }
+
+  return err;
+}
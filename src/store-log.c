@@ -0,0 +1,1608 @@
+/* libchop -- a utility library for distributed storage and data backup
+   Copyright (C) 2026  Ludovic Courtès <ludo@gnu.org>
+
+   Libchop is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Libchop is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with libchop.  If not, see <http://www.gnu.org/licenses/>.  */
+
+/* A log-structured block store: blocks are appended to ``segment'' files
+   and an in-memory hash table maps each key to its latest record.  The
+   table is checkpointed to disk, so that opening the store only replays
+   the records written since the last checkpoint.  Deleting a block
+   appends a ``tombstone'' record; the space of dead records is reclaimed
+   by rewriting the segments that contain many of them.  */
+
+#include <chop/chop-config.h>
+
+#include <chop/chop.h>
+#include <chop/stores.h>
+#include <chop/buffers.h>
+#include <alloca.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <assert.h>
+
+#include <full-write.h>
+
+#include "store-common.h"
+#include "little-endian.h"
+
+
+/* File formats.  */
+
+#define LOG_SEGMENT_MAGIC     "CHOPLOG1"
+#define LOG_CHECKPOINT_MAGIC  "CHOPLCP1"
+
+#define LOG_CHECKPOINT_NAME   "checkpoint"
+
+/* The default size above which a new segment is started.  */
+#define LOG_DEFAULT_SEGMENT_SIZE  (64UL << 20)
+
+/* The amount of data written to a segment at once.  */
+#define LOG_WRITE_SIZE            (1UL << 20)
+
+/* The flag of records that mark the deletion of a block.  */
+#define LOG_RECORD_TOMBSTONE      1
+
+/* A segment file starts with LOG_SEGMENT_MAGIC, followed by records, each
+   of which is a header followed by the key and then the contents of a
+   block.  Tombstones have no contents.  The header is made of these
+   fields, stored as 32-bit little-endian integers.  */
+typedef struct
+{
+  uint32_t key_size;
+  uint32_t size;
+  uint32_t flags;
+  uint32_t reserved;
+} log_record_t;
+
+#define LOG_RECORD_HEADER_SIZE  16
+
+/* The header of the checkpoint file.  The checkpoint describes every
+   record of the segments numbered below SEGMENT, and the first OFFSET
+   bytes of segment SEGMENT.  It is followed by COUNT entries, each
+   followed by its key.  On disk, the magic is followed by the other
+   fields as little-endian integers of the sizes below.  */
+typedef struct
+{
+  char     magic[8];
+  uint64_t count;
+  uint32_t segment;
+  uint32_t reserved;
+  uint64_t offset;
+} log_checkpoint_header_t;
+
+#define LOG_CHECKPOINT_HEADER_SIZE  32
+
+typedef struct
+{
+  uint64_t offset;
+  uint32_t segment;
+  uint32_t size;
+  uint32_t key_size;
+  uint32_t reserved;
+} log_checkpoint_entry_t;
+
+#define LOG_CHECKPOINT_ENTRY_SIZE  24
+
+/* A segment, along with the number of bytes of its records that are still
+   live.  UNSYNCED is true if data was written to it since it was last
+   synced.  */
+typedef struct
+{
+  unsigned number;
+  int      fd;
+  uint64_t size;
+  uint64_t live_size;
+  bool     unsynced;
+} log_segment_t;
+
+/* The location of the latest record of a block, whose key is at
+   KEY_OFFSET in the store's KEYS buffer.  SEGMENT is LOG_NO_SEGMENT if the
+   block was deleted.  */
+typedef struct
+{
+  uint64_t offset;
+  size_t   key_offset;
+  uint32_t segment;
+  uint32_t key_size;
+  uint32_t size;
+} log_entry_t;
+
+#define LOG_NO_SEGMENT  UINT32_MAX
+
+/* Return the size of the record of a block with KEY_SIZE-byte key and
+   SIZE bytes of contents.  */
+#define log_record_size(_key_size, _size)		\
+  (LOG_RECORD_HEADER_SIZE + (_key_size) + (_size))
+
+
+/* Encoding.  */
+
+static inline void
+log_record_encode (const log_record_t *record,
+		   unsigned char buffer[LOG_RECORD_HEADER_SIZE])
+{
+  store_little_endian (buffer, record->key_size, 4);
+  store_little_endian (buffer + 4, record->size, 4);
+  store_little_endian (buffer + 8, record->flags, 4);
+  store_little_endian (buffer + 12, record->reserved, 4);
+}
+
+static inline void
+log_record_decode (const unsigned char buffer[LOG_RECORD_HEADER_SIZE],
+		   log_record_t *record)
+{
+  record->key_size = load_little_endian (buffer, 4);
+  record->size = load_little_endian (buffer + 4, 4);
+  record->flags = load_little_endian (buffer + 8, 4);
+  record->reserved = load_little_endian (buffer + 12, 4);
+}
+
+/* Read into RECORD the header of the record at OFFSET in FD.  */
+static inline chop_error_t
+log_record_read (int fd, uint64_t offset, log_record_t *record)
+{
+  chop_error_t err;
+  unsigned char buffer[LOG_RECORD_HEADER_SIZE];
+
+  err = store_read_at (fd, buffer, sizeof (buffer), offset);
+  if (!err)
+    log_record_decode (buffer, record);
+
+  return err;
+}
+
+static inline void
+log_checkpoint_header_encode (const log_checkpoint_header_t *header,
+			      unsigned char
+			      buffer[LOG_CHECKPOINT_HEADER_SIZE])
+{
+  memcpy (buffer, header->magic, sizeof (header->magic));
+  store_little_endian (buffer + 8, header->count, 8);
+  store_little_endian (buffer + 16, header->segment, 4);
+  store_little_endian (buffer + 20, header->reserved, 4);
+  store_little_endian (buffer + 24, header->offset, 8);
+}
+
+static inline void
+log_checkpoint_header_decode (const unsigned char
+			      buffer[LOG_CHECKPOINT_HEADER_SIZE],
+			      log_checkpoint_header_t *header)
+{
+  memcpy (header->magic, buffer, sizeof (header->magic));
+  header->count = load_little_endian (buffer + 8, 8);
+  header->segment = load_little_endian (buffer + 16, 4);
+  header->reserved = load_little_endian (buffer + 20, 4);
+  header->offset = load_little_endian (buffer + 24, 8);
+}
+
+static inline void
+log_checkpoint_entry_encode (const log_checkpoint_entry_t *entry,
+			     unsigned char buffer[LOG_CHECKPOINT_ENTRY_SIZE])
+{
+  store_little_endian (buffer, entry->offset, 8);
+  store_little_endian (buffer + 8, entry->segment, 4);
+  store_little_endian (buffer + 12, entry->size, 4);
+  store_little_endian (buffer + 16, entry->key_size, 4);
+  store_little_endian (buffer + 20, entry->reserved, 4);
+}
+
+static inline void
+log_checkpoint_entry_decode (const unsigned char
+			     buffer[LOG_CHECKPOINT_ENTRY_SIZE],
+			     log_checkpoint_entry_t *entry)
+{
+  entry->offset = load_little_endian (buffer, 8);
+  entry->segment = load_little_endian (buffer + 8, 4);
+  entry->size = load_little_endian (buffer + 12, 4);
+  entry->key_size = load_little_endian (buffer + 16, 4);
+  entry->reserved = load_little_endian (buffer + 20, 4);
+}
+
+
+/* Class definitions.  */
+
+CHOP_DECLARE_RT_CLASS_WITH_METACLASS (log_block_store, block_store,
+				      file_based_store_class,
+				      int dir_fd;
+				      int eventually_close;
+				      size_t segment_size;
+
+				      /* Segments, sorted by number; when
+					 WRITING is true, the last one is
+					 written to, and its data from
+					 FLUSHED_SIZE on is in PENDING */
+				      log_segment_t *segments;
+				      size_t segment_count;
+				      size_t segments_allocated;
+				      unsigned next_number;
+				      bool writing;
+				      uint64_t flushed_size;
+				      chop_buffer_t pending;
+
+				      /* True if segments were created since
+					 the directory was last synced */
+				      bool unsynced_directory;
+
+				      /* The index: one entry per key, their
+					 keys, and a hash table of ENTRIES
+					 indices plus one */
+				      log_entry_t *entries;
+				      size_t entry_count;
+				      size_t entries_allocated;
+				      chop_buffer_t keys;
+				      size_t *table;
+				      size_t table_size;
+
+				      /* True if the index changed since the
+					 last checkpoint */
+				      bool dirty;);
+
+static chop_error_t chop_log_store_close (chop_block_store_t *);
+static chop_error_t chop_log_store_next_block (chop_block_iterator_t *it);
+
+
+/* A generic open method, common to all file-based block stores.  */
+static chop_error_t
+chop_log_store_generic_open (const chop_class_t *class,
+			     const char *file, int open_flags, mode_t mode,
+			     chop_block_store_t *store)
+{
+  if ((chop_file_based_store_class_t *) class != &chop_log_block_store_class)
+    return CHOP_INVALID_ARG;
+
+  return store_directory_generic_open (file, mode, chop_log_store_open,
+				       store);
+}
+
+static void
+lbs_dtor (chop_object_t *object)
+{
+  chop_log_block_store_t *log =
+    (chop_log_block_store_t *) object;
+
+  if (log->dir_fd >= 0)
+    chop_log_store_close (&log->block_store);
+}
+
+CHOP_DEFINE_RT_CLASS_WITH_METACLASS (log_block_store, block_store,
+				     file_based_store_class,
+
+				     /* metaclass inits */
+				     .generic_open = chop_log_store_generic_open,
+
+				     NULL, lbs_dtor,
+				     NULL, NULL, /* No copy/equalp */
+				     NULL, NULL  /* No serial/deserial */);
+
+
+/* Iterators.  */
+
+/* An iterator over the live entries of the index.  */
+CHOP_DECLARE_RT_CLASS (log_block_iterator, block_iterator,
+		       size_t entry;);
+
+static chop_error_t
+lbi_ctor (chop_object_t *object, const chop_class_t *class)
+{
+  chop_log_block_iterator_t *it = (chop_log_block_iterator_t *) object;
+
+  it->block_iterator.next = chop_log_store_next_block;
+  it->entry = 0;
+
+  return 0;
+}
+
+static void
+lbi_dtor (chop_object_t *object)
+{
+  chop_log_block_iterator_t *it = (chop_log_block_iterator_t *) object;
+
+  chop_block_key_free (&it->block_iterator.key);
+}
+
+CHOP_DEFINE_RT_CLASS (log_block_iterator, block_iterator,
+		      lbi_ctor, lbi_dtor,
+		      NULL, NULL,
+		      NULL, NULL);
+
+
+/* The index.  */
+
+static inline const char *
+entry_key (const chop_log_block_store_t *log, const log_entry_t *entry)
+{
+  return chop_buffer_content (&log->keys) + entry->key_offset;
+}
+
+/* Return segment NUMBER of LOG, or NULL.  */
+static log_segment_t *
+log_segment (const chop_log_block_store_t *log, unsigned number)
+{
+  size_t low = 0, high = log->segment_count;
+
+  while (low < high)
+    {
+      size_t middle = low + (high - low) / 2;
+
+      if (log->segments[middle].number == number)
+	return &log->segments[middle];
+      else if (log->segments[middle].number < number)
+	low = middle + 1;
+      else
+	high = middle;
+    }
+
+  return NULL;
+}
+
+/* Return the index of the entry of LOG for KEY, live or not, or -1.  */
+static ssize_t
+log_index_lookup (const chop_log_block_store_t *log,
+		  const char *key, size_t key_size)
+{
+  size_t slot;
+
+  if (log->table_size == 0)
+    return -1;
+
+  for (slot = store_hash_key (key, key_size) & (log->table_size - 1);
+       log->table[slot] != 0;
+       slot = (slot + 1) & (log->table_size - 1))
+    {
+      const log_entry_t *entry = &log->entries[log->table[slot] - 1];
+
+      if ((entry->key_size == key_size)
+	  && (!memcmp (entry_key (log, entry), key, key_size)))
+	return log->table[slot] - 1;
+    }
+
+  return -1;
+}
+
+/* Return the live entry of LOG for KEY, or NULL.  */
+static inline const log_entry_t *
+log_index_find (const chop_log_block_store_t *log,
+		const chop_block_key_t *key)
+{
+  ssize_t index;
+
+  index = log_index_lookup (log, chop_block_key_buffer (key),
+			    chop_block_key_size (key));
+  if ((index < 0) || (log->entries[index].segment == LOG_NO_SEGMENT))
+    return NULL;
+
+  return &log->entries[index];
+}
+
+/* Insert entry INDEX of LOG in its hash table, which must have room for
+   it.  */
+static void
+log_index_insert (chop_log_block_store_t *log, size_t index)
+{
+  const log_entry_t *entry = &log->entries[index];
+  size_t slot;
+
+  for (slot = store_hash_key (entry_key (log, entry), entry->key_size)
+	 & (log->table_size - 1);
+       log->table[slot] != 0;
+       slot = (slot + 1) & (log->table_size - 1));
+
+  log->table[slot] = index + 1;
+}
+
+/* Resize the hash table of LOG to SIZE slots, a power of two, and fill it
+   again.  */
+static chop_error_t
+log_index_resize (chop_log_block_store_t *log, size_t size)
+{
+  size_t *table, i;
+
+  table = chop_calloc (size * sizeof (*table),
+		       (chop_class_t *) &chop_log_block_store_class);
+  if (!table)
+    return ENOMEM;
+
+  chop_free (log->table, (chop_class_t *) &chop_log_block_store_class);
+  log->table = table;
+  log->table_size = size;
+
+  for (i = 0; i < log->entry_count; i++)
+    log_index_insert (log, i);
+
+  return 0;
+}
+
+/* Add an entry for KEY to LOG and return its index in *INDEX.  The entry
+   is that of a deleted block.  */
+static chop_error_t
+log_index_add (chop_log_block_store_t *log,
+	       const char *key, size_t key_size, size_t *index)
+{
+  chop_error_t err;
+  log_entry_t *entry;
+
+  if (log->entry_count >= log->entries_allocated)
+    {
+      size_t count = log->entries_allocated ? 2 * log->entries_allocated
+	: 1024;
+      log_entry_t *entries;
+
+      entries = chop_realloc (log->entries, count * sizeof (*entries),
+			      (chop_class_t *) &chop_log_block_store_class);
+      if (!entries)
+	return ENOMEM;
+
+      log->entries = entries;
+      log->entries_allocated = count;
+    }
+
+  if (2 * (log->entry_count + 1) > log->table_size)
+    {
+      /* Keep the hash table at most half full.  */
+      err = log_index_resize (log, log->table_size
+			      ? 2 * log->table_size : 2048);
+      if (err)
+	return err;
+    }
+
+  entry = &log->entries[log->entry_count];
+  entry->key_offset = chop_buffer_size (&log->keys);
+  entry->key_size = key_size;
+  entry->segment = LOG_NO_SEGMENT;
+  entry->offset = 0;
+  entry->size = 0;
+
+  err = chop_buffer_append (&log->keys, key, key_size);
+  if (err)
+    return err;
+
+  *index = log->entry_count;
+  log_index_insert (log, log->entry_count++);
+
+  return 0;
+}
+
+/* Record that the latest record for KEY, at OFFSET in SEGMENT, has SIZE
+   bytes of contents, or is a tombstone if TOMBSTONE is true, and update
+   the live size of the segments involved.  */
+static chop_error_t
+log_index_update (chop_log_block_store_t *log,
+		  const char *key, size_t key_size,
+		  unsigned segment, uint64_t offset, size_t size,
+		  bool tombstone)
+{
+  chop_error_t err;
+  ssize_t index;
+  log_entry_t *entry;
+
+  index = log_index_lookup (log, key, key_size);
+  if (index < 0)
+    {
+      size_t new_index;
+
+      if (tombstone)
+	return 0;
+
+      err = log_index_add (log, key, key_size, &new_index);
+      if (err)
+	return err;
+
+      index = new_index;
+    }
+
+  entry = &log->entries[index];
+  if (entry->segment != LOG_NO_SEGMENT)
+    {
+      /* The previous record of this block is now dead.  */
+      log_segment_t *previous = log_segment (log, entry->segment);
+
+      assert (previous != NULL);
+      previous->live_size -= log_record_size (entry->key_size, entry->size);
+    }
+
+  if (tombstone)
+    entry->segment = LOG_NO_SEGMENT;
+  else
+    {
+      log_segment_t *current = log_segment (log, segment);
+
+      assert (current != NULL);
+      entry->segment = segment;
+      entry->offset = offset;
+      entry->size = size;
+      current->live_size += log_record_size (key_size, size);
+    }
+
+  log->dirty = true;
+
+  return 0;
+}
+
+/* Empty the index of LOG.  */
+static void
+log_index_reset (chop_log_block_store_t *log)
+{
+  size_t i;
+
+  log->entry_count = 0;
+  chop_buffer_clear (&log->keys);
+  if (log->table != NULL)
+    memset (log->table, 0, log->table_size * sizeof (*log->table));
+
+  for (i = 0; i < log->segment_count; i++)
+    log->segments[i].live_size = 0;
+}
+
+/* Remove the entries of deleted blocks from the index of LOG.  */
+static chop_error_t
+log_index_prune (chop_log_block_store_t *log)
+{
+  chop_error_t err;
+  chop_buffer_t keys;
+  size_t i, count, size;
+
+  err = chop_buffer_init (&keys, chop_buffer_size (&log->keys));
+  if (err)
+    return err;
+
+  for (i = 0, count = 0; (i < log->entry_count) && (!err); i++)
+    {
+      log_entry_t entry = log->entries[i];
+
+      if (entry.segment == LOG_NO_SEGMENT)
+	continue;
+
+      err = chop_buffer_append (&keys, entry_key (log, &entry),
+				entry.key_size);
+      entry.key_offset = chop_buffer_size (&keys) - entry.key_size;
+      log->entries[count++] = entry;
+    }
+
+  if (err)
+    {
+      /* Keep the index as it was.  */
+      chop_buffer_return (&keys);
+      return err;
+    }
+
+  chop_buffer_return (&log->keys);
+  log->keys = keys;
+  log->entry_count = count;
+
+  for (size = 2048; 2 * (count + 1) > size; size *= 2);
+
+  return log_index_resize (log, size);
+}
+
+
+/* Segments.  */
+
+/* Set NAME to the name of the file of segment NUMBER.  */
+#define segment_file_name(_name, _number)			\
+  snprintf ((_name), sizeof (_name), "segment-%08x.log", (_number))
+
+/* Append a segment to those of LOG.  */
+static chop_error_t
+log_add_segment (chop_log_block_store_t *log, unsigned number, int fd,
+		 uint64_t size)
+{
+  log_segment_t *segment;
+
+  if (log->segment_count >= log->segments_allocated)
+    {
+      size_t count = log->segments_allocated
+	? 2 * log->segments_allocated : 16;
+      log_segment_t *segments;
+
+      segments = chop_realloc (log->segments, count * sizeof (*segments),
+			       (chop_class_t *) &chop_log_block_store_class);
+      if (!segments)
+	return ENOMEM;
+
+      log->segments = segments;
+      log->segments_allocated = count;
+    }
+
+  segment = &log->segments[log->segment_count++];
+  segment->number = number;
+  segment->fd = fd;
+  segment->size = size;
+  segment->live_size = 0;
+  segment->unsynced = false;
+
+  if (number >= log->next_number)
+    log->next_number = number + 1;
+
+  return 0;
+}
+
+/* Sync the directory of LOG, so that the segments created or removed and
+   the checkpoint renamed in it survive a crash.  */
+static chop_error_t
+log_sync_directory (chop_log_block_store_t *log)
+{
+  if (fsync (log->dir_fd))
+    return errno;
+
+  log->unsynced_directory = false;
+
+  return 0;
+}
+
+/* Close and remove segment NUMBER of LOG, which must not be the one being
+   written.  The removal is synced, so that segments removed one after
+   another disappear in that order.  */
+static chop_error_t
+log_remove_segment (chop_log_block_store_t *log, unsigned number)
+{
+  log_segment_t *segment;
+  char name[32];
+
+  segment = log_segment (log, number);
+  assert (segment != NULL);
+
+  close (segment->fd);
+  memmove (segment, segment + 1,
+	   (log->segments + log->segment_count - segment - 1)
+	   * sizeof (*segment));
+  log->segment_count--;
+
+  segment_file_name (name, number);
+  if (unlinkat (log->dir_fd, name, 0))
+    return errno;
+
+  return log_sync_directory (log);
+}
+
+/* Create a new segment to write to.  */
+static chop_error_t
+log_create_segment (chop_log_block_store_t *log)
+{
+  chop_error_t err;
+  char name[32];
+  int fd;
+
+  segment_file_name (name, log->next_number);
+  fd = openat (log->dir_fd, name, O_RDWR | O_CREAT | O_EXCL,
+	       S_IRUSR | S_IWUSR);
+  if (fd < 0)
+    return errno;
+
+  err = log_add_segment (log, log->next_number, fd,
+			 sizeof (LOG_SEGMENT_MAGIC) - 1);
+  if (err)
+    {
+      close (fd);
+      unlinkat (log->dir_fd, name, 0);
+      return err;
+    }
+
+  log->writing = true;
+  log->flushed_size = 0;
+  log->unsynced_directory = true;
+
+  return chop_buffer_push (&log->pending, LOG_SEGMENT_MAGIC,
+			   sizeof (LOG_SEGMENT_MAGIC) - 1);
+}
+
+/* Write the pending data of the segment being written to its file.  */
+static chop_error_t
+log_flush (chop_log_block_store_t *log)
+{
+  size_t size = chop_buffer_size (&log->pending);
+
+  if ((log->writing) && (size > 0))
+    {
+      log_segment_t *segment = &log->segments[log->segment_count - 1];
+
+      if (full_write (segment->fd, chop_buffer_content (&log->pending),
+		      size) < size)
+	return errno;
+
+      log->flushed_size += size;
+      segment->unsynced = true;
+      chop_buffer_clear (&log->pending);
+    }
+
+  return 0;
+}
+
+/* Flush the segment being written and sync to disk every segment written
+   since the last sync, including those that were filled in the meantime,
+   along with the directory if segments were created in it.  */
+static chop_error_t
+log_sync_segments (chop_log_block_store_t *log)
+{
+  chop_error_t err;
+  size_t i;
+
+  err = log_flush (log);
+  for (i = 0; (i < log->segment_count) && (!err); i++)
+    {
+      log_segment_t *segment = &log->segments[i];
+
+      if (segment->unsynced)
+	{
+	  if (fdatasync (segment->fd))
+	    err = errno;
+	  else
+	    segment->unsynced = false;
+	}
+    }
+
+  if ((!err) && (log->unsynced_directory))
+    err = log_sync_directory (log);
+
+  return err;
+}
+
+/* Append a record for KEY with contents BLOCK to the segment being
+   written, starting a new one if needed, and update the index.  */
+static chop_error_t
+log_append (chop_log_block_store_t *log,
+	    const char *key, size_t key_size,
+	    const char *block, size_t size, uint32_t flags)
+{
+  chop_error_t err;
+  log_segment_t *segment;
+  log_record_t record;
+  unsigned char header[LOG_RECORD_HEADER_SIZE];
+  uint64_t offset;
+
+  if ((log->writing)
+      && (log->segments[log->segment_count - 1].size >= log->segment_size))
+    {
+      err = log_flush (log);
+      if (err)
+	return err;
+
+      log->writing = false;
+    }
+
+  if (!log->writing)
+    {
+      err = log_create_segment (log);
+      if (err)
+	return err;
+    }
+
+  record.key_size = key_size;
+  record.size = size;
+  record.flags = flags;
+  record.reserved = 0;
+  log_record_encode (&record, header);
+
+  err = chop_buffer_append (&log->pending, (char *) header, sizeof (header));
+  if (!err)
+    err = chop_buffer_append (&log->pending, key, key_size);
+  if ((!err) && (size > 0))
+    err = chop_buffer_append (&log->pending, block, size);
+  if (err)
+    return err;
+
+  segment = &log->segments[log->segment_count - 1];
+  offset = segment->size;
+  segment->size += log_record_size (key_size, size);
+
+  err = log_index_update (log, key, key_size, segment->number, offset, size,
+			  flags & LOG_RECORD_TOMBSTONE);
+
+  if ((!err) && (chop_buffer_size (&log->pending) >= LOG_WRITE_SIZE))
+    err = log_flush (log);
+
+  return err;
+}
+
+/* Read the contents of the block at ENTRY into BUFFER.  */
+static chop_error_t
+log_read_entry (const chop_log_block_store_t *log, const log_entry_t *entry,
+		chop_buffer_t *buffer)
+{
+  chop_error_t err;
+  const log_segment_t *segment;
+  uint64_t offset;
+  char *area;
+
+  segment = log_segment (log, entry->segment);
+  assert (segment != NULL);
+
+  offset = entry->offset + LOG_RECORD_HEADER_SIZE + entry->key_size;
+  if ((log->writing) && (segment == &log->segments[log->segment_count - 1])
+      && (offset >= log->flushed_size))
+    /* The block has not been written to the file yet.  */
+    return chop_buffer_push (buffer,
+			     chop_buffer_content (&log->pending)
+			     + (offset - log->flushed_size),
+			     entry->size);
+
+  chop_buffer_clear (buffer);
+  err = chop_buffer_extend (buffer, entry->size, &area);
+  if (!err)
+    err = store_read_at (segment->fd, area, entry->size, offset);
+
+  return err;
+}
+
+/* Read the records of SEGMENT, from OFFSET on, into the index of LOG.
+   If its last record extends past the end of the file, truncate the
+   segment after its last complete record if it is the NEWEST segment,
+   which was being written when the store was last used; otherwise,
+   return CHOP_DESERIAL_CORRUPT_INPUT.  */
+static chop_error_t
+log_replay_segment (chop_log_block_store_t *log, unsigned number,
+		    uint64_t offset, bool newest)
+{
+  chop_error_t err;
+  log_segment_t *segment;
+  chop_buffer_t key;
+  uint64_t end;
+
+  segment = log_segment (log, number);
+  end = segment->size;
+
+  err = chop_buffer_init (&key, 0);
+  if (err)
+    return err;
+
+  while ((offset < end) && (!err))
+    {
+      log_record_t record;
+      char *area;
+
+      if (offset + LOG_RECORD_HEADER_SIZE > end)
+	break;
+
+      err = log_record_read (segment->fd, offset, &record);
+      if ((err)
+	  || (offset + log_record_size (record.key_size, record.size) > end))
+	break;
+
+      chop_buffer_clear (&key);
+      err = chop_buffer_extend (&key, record.key_size, &area);
+      if (!err)
+	err = store_read_at (segment->fd, area, record.key_size,
+			     offset + LOG_RECORD_HEADER_SIZE);
+      if (!err)
+	err = log_index_update (log, area, record.key_size, number, offset,
+				record.size,
+				record.flags & LOG_RECORD_TOMBSTONE);
+
+      offset += log_record_size (record.key_size, record.size);
+    }
+
+  chop_buffer_return (&key);
+
+  if ((!err) && (offset < end))
+    {
+      if (!newest)
+	err = CHOP_DESERIAL_CORRUPT_INPUT;
+      else if (ftruncate (segment->fd, offset))
+	err = errno;
+      else
+	segment->size = offset;
+    }
+
+  return err;
+}
+
+
+/* Checkpoints.  */
+
+/* Write the index of LOG to its checkpoint file.  The segments must have
+   been synced.  */
+static chop_error_t
+log_write_checkpoint (chop_log_block_store_t *log)
+{
+  chop_error_t err = 0;
+  log_checkpoint_header_t header;
+  unsigned char encoded[LOG_CHECKPOINT_HEADER_SIZE];
+  chop_buffer_t data;
+  size_t i;
+  int fd;
+
+  memset (&header, 0, sizeof (header));
+  memcpy (header.magic, LOG_CHECKPOINT_MAGIC, sizeof (header.magic));
+  if (log->segment_count > 0)
+    {
+      header.segment = log->segments[log->segment_count - 1].number;
+      header.offset = log->segments[log->segment_count - 1].size;
+    }
+  else
+    {
+      header.segment = log->next_number;
+      header.offset = 0;
+    }
+
+  err = chop_buffer_init (&data, LOG_CHECKPOINT_HEADER_SIZE
+			  + log->entry_count * LOG_CHECKPOINT_ENTRY_SIZE
+			  + chop_buffer_size (&log->keys));
+  if (err)
+    return err;
+
+  /* Reserve room for the header, which is filled in once the entries are
+     counted.  */
+  memset (encoded, 0, sizeof (encoded));
+  err = chop_buffer_push (&data, (char *) encoded, sizeof (encoded));
+  for (i = 0; (i < log->entry_count) && (!err); i++)
+    {
+      const log_entry_t *entry = &log->entries[i];
+      log_checkpoint_entry_t cp_entry;
+      unsigned char encoded_entry[LOG_CHECKPOINT_ENTRY_SIZE];
+
+      if (entry->segment == LOG_NO_SEGMENT)
+	continue;
+
+      cp_entry.offset = entry->offset;
+      cp_entry.segment = entry->segment;
+      cp_entry.size = entry->size;
+      cp_entry.key_size = entry->key_size;
+      cp_entry.reserved = 0;
+      header.count++;
+      log_checkpoint_entry_encode (&cp_entry, encoded_entry);
+
+      err = chop_buffer_append (&data, (char *) encoded_entry,
+				sizeof (encoded_entry));
+      if (!err)
+	err = chop_buffer_append (&data, entry_key (log, entry),
+				  entry->key_size);
+    }
+
+  if (!err)
+    {
+      /* Write it under a temporary name so that the previous checkpoint
+	 remains in place until the new one is complete.  */
+      log_checkpoint_header_encode (&header, encoded);
+      memcpy ((char *) chop_buffer_content (&data), encoded,
+	      sizeof (encoded));
+
+      fd = openat (log->dir_fd, LOG_CHECKPOINT_NAME ".tmp",
+		   O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+      if (fd < 0)
+	err = errno;
+      else
+	{
+	  if (full_write (fd, chop_buffer_content (&data),
+			  chop_buffer_size (&data))
+	      < chop_buffer_size (&data))
+	    err = errno;
+	  else if (fdatasync (fd))
+	    err = errno;
+
+	  close (fd);
+
+	  if ((!err)
+	      && (renameat (log->dir_fd, LOG_CHECKPOINT_NAME ".tmp",
+			    log->dir_fd, LOG_CHECKPOINT_NAME)))
+	    err = errno;
+	  if (!err)
+	    err = log_sync_directory (log);
+	}
+    }
+
+  chop_buffer_return (&data);
+
+  if (!err)
+    log->dirty = false;
+
+  return err;
+}
+
+/* Load the checkpoint of LOG into its index, and return in *SEGMENT and
+   *OFFSET the position of the first record it does not cover.  */
+static chop_error_t
+log_read_checkpoint (chop_log_block_store_t *log,
+		     unsigned *segment, uint64_t *offset)
+{
+  chop_error_t err = 0;
+  log_checkpoint_header_t header;
+  struct stat stat;
+  char *data, *p, *end;
+  uint64_t i;
+  int fd;
+
+  fd = openat (log->dir_fd, LOG_CHECKPOINT_NAME, O_RDONLY);
+  if (fd < 0)
+    return errno;
+
+  if (fstat (fd, &stat))
+    {
+      err = errno;
+      close (fd);
+      return err;
+    }
+
+  if ((size_t) stat.st_size < LOG_CHECKPOINT_HEADER_SIZE)
+    {
+      close (fd);
+      return CHOP_DESERIAL_CORRUPT_INPUT;
+    }
+
+  data = chop_malloc (stat.st_size,
+		      (chop_class_t *) &chop_log_block_store_class);
+  if (data == NULL)
+    {
+      close (fd);
+      return ENOMEM;
+    }
+
+  err = store_read_at (fd, data, stat.st_size, 0);
+
+  close (fd);
+
+  if (!err)
+    {
+      log_checkpoint_header_decode ((unsigned char *) data, &header);
+      if (memcmp (header.magic, LOG_CHECKPOINT_MAGIC, sizeof (header.magic)))
+	err = CHOP_DESERIAL_CORRUPT_INPUT;
+    }
+
+  p = data + LOG_CHECKPOINT_HEADER_SIZE;
+  end = data + stat.st_size;
+  for (i = 0; (i < header.count) && (!err); i++)
+    {
+      log_checkpoint_entry_t entry;
+      const log_segment_t *seg;
+
+      if (p + LOG_CHECKPOINT_ENTRY_SIZE > end)
+	{
+	  err = CHOP_DESERIAL_CORRUPT_INPUT;
+	  break;
+	}
+
+      log_checkpoint_entry_decode ((unsigned char *) p, &entry);
+      p += LOG_CHECKPOINT_ENTRY_SIZE;
+
+      /* Make sure the entry points to an existing record.  */
+      seg = log_segment (log, entry.segment);
+      if ((p + entry.key_size > end) || (seg == NULL)
+	  || (entry.offset + log_record_size (entry.key_size, entry.size)
+	      > seg->size))
+	{
+	  err = CHOP_DESERIAL_CORRUPT_INPUT;
+	  break;
+	}
+
+      err = log_index_update (log, p, entry.key_size, entry.segment,
+			      entry.offset, entry.size, false);
+      p += entry.key_size;
+    }
+
+  if ((!err) && (p != end))
+    err = CHOP_DESERIAL_CORRUPT_INPUT;
+
+  chop_free (data, (chop_class_t *) &chop_log_block_store_class);
+
+  if (!err)
+    {
+      *segment = header.segment;
+      *offset = header.offset;
+      log->dirty = false;
+    }
+
+  return err;
+}
+
+
+/* The block store methods.  */
+
+static chop_error_t
+chop_log_store_blocks_exist (chop_block_store_t *store,
+			     size_t n, const chop_block_key_t keys[n],
+			     bool exists[n])
+{
+  chop_log_block_store_t *log =
+    (chop_log_block_store_t *) store;
+  size_t i;
+
+  for (i = 0; i < n; i++)
+    exists[i] = (log_index_find (log, &keys[i]) != NULL);
+
+  return 0;
+}
+
+static chop_error_t
+chop_log_store_read_block (chop_block_store_t *store,
+			   const chop_block_key_t *key,
+			   chop_buffer_t *buffer,
+			   size_t *size)
+{
+  chop_error_t err;
+  chop_log_block_store_t *log =
+    (chop_log_block_store_t *) store;
+  const log_entry_t *entry;
+
+  *size = 0;
+
+  entry = log_index_find (log, key);
+  if (entry == NULL)
+    return CHOP_STORE_BLOCK_UNAVAIL;
+
+  err = log_read_entry (log, entry, buffer);
+  if (!err)
+    *size = entry->size;
+
+  return err;
+}
+
+static chop_error_t
+chop_log_store_write_block (chop_block_store_t *store,
+			    const chop_block_key_t *key,
+			    const char *block, size_t size)
+{
+  chop_log_block_store_t *log =
+    (chop_log_block_store_t *) store;
+
+  if ((size > UINT32_MAX) || (chop_block_key_size (key) > UINT32_MAX))
+    return CHOP_INVALID_ARG;
+
+  return log_append (log, chop_block_key_buffer (key),
+		     chop_block_key_size (key), block, size, 0);
+}
+
+static chop_error_t
+chop_log_store_delete_block (chop_block_store_t *store,
+			     const chop_block_key_t *key)
+{
+  chop_log_block_store_t *log =
+    (chop_log_block_store_t *) store;
+
+  if (log_index_find (log, key) == NULL)
+    return CHOP_STORE_BLOCK_UNAVAIL;
+
+  return log_append (log, chop_block_key_buffer (key),
+		     chop_block_key_size (key), NULL, 0,
+		     LOG_RECORD_TOMBSTONE);
+}
+
+static void
+free_key (char *key, void *unused)
+{
+  chop_free (key, &chop_log_block_iterator_class);
+}
+
+/* Move IT to the next live entry, starting from its current position, and
+   copy its key.  */
+static chop_error_t
+log_iterator_settle (chop_log_block_iterator_t *it)
+{
+  chop_log_block_store_t *log =
+    (chop_log_block_store_t *) it->block_iterator.store;
+  const log_entry_t *entry;
+  char *copy;
+
+  while ((it->entry < log->entry_count)
+	 && (log->entries[it->entry].segment == LOG_NO_SEGMENT))
+    it->entry++;
+
+  if (it->entry >= log->entry_count)
+    {
+      it->block_iterator.nil = 1;
+      return CHOP_STORE_END;
+    }
+
+  entry = &log->entries[it->entry];
+  copy = chop_malloc (entry->key_size + 1, &chop_log_block_iterator_class);
+  if (copy == NULL)
+    return ENOMEM;
+
+  memcpy (copy, entry_key (log, entry), entry->key_size);
+  chop_block_key_free (&it->block_iterator.key);
+  chop_block_key_init (&it->block_iterator.key, copy, entry->key_size,
+		       free_key, NULL);
+  it->block_iterator.nil = 0;
+
+  return 0;
+}
+
+static chop_error_t
+chop_log_store_first_block (chop_block_store_t *store,
+			    chop_block_iterator_t *it)
+{
+  chop_error_t err;
+  chop_log_block_iterator_t *lit = (chop_log_block_iterator_t *) it;
+
+  err = chop_object_initialize ((chop_object_t *) it,
+				&chop_log_block_iterator_class);
+  if (err)
+    return err;
+
+  it->store = store;
+  err = log_iterator_settle (lit);
+  if (err)
+    chop_object_destroy ((chop_object_t *) it);
+
+  return err;
+}
+
+static chop_error_t
+chop_log_store_next_block (chop_block_iterator_t *it)
+{
+  chop_log_block_iterator_t *lit = (chop_log_block_iterator_t *) it;
+
+  lit->entry++;
+
+  return log_iterator_settle (lit);
+}
+
+static chop_error_t
+chop_log_store_sync (chop_block_store_t *store)
+{
+  chop_error_t err;
+  chop_log_block_store_t *log =
+    (chop_log_block_store_t *) store;
+
+  err = log_sync_segments (log);
+  if ((!err) && (log->dirty))
+    err = log_write_checkpoint (log);
+
+  return err;
+}
+
+static chop_error_t
+chop_log_store_close (chop_block_store_t *store)
+{
+  chop_error_t err;
+  chop_log_block_store_t *log =
+    (chop_log_block_store_t *) store;
+  size_t i;
+
+  err = chop_log_store_sync (store);
+
+  for (i = 0; i < log->segment_count; i++)
+    close (log->segments[i].fd);
+
+  chop_free (log->segments, (chop_class_t *) &chop_log_block_store_class);
+  chop_free (log->entries, (chop_class_t *) &chop_log_block_store_class);
+  chop_free (log->table, (chop_class_t *) &chop_log_block_store_class);
+  chop_buffer_return (&log->keys);
+  chop_buffer_return (&log->pending);
+  log->segments = NULL;
+  log->entries = NULL;
+  log->table = NULL;
+  log->segment_count = log->segments_allocated = 0;
+  log->entry_count = log->entries_allocated = log->table_size = 0;
+  log->writing = false;
+
+  if (log->eventually_close && log->dir_fd >= 0)
+    close (log->dir_fd);
+
+  log->dir_fd = -1;
+
+  return err;
+}
+
+
+/* Compaction.  */
+
+/* Copy the live records of segment NUMBER of LOG to the segment being
+   written.  If KEEP_TOMBSTONES is true, an older segment may still hold
+   records of the blocks deleted by its tombstones, so copy those of blocks
+   that are still deleted as well: otherwise, replaying every segment, as
+   is done when the checkpoint is lost, would bring these blocks back.  */
+static chop_error_t
+log_copy_live_records (chop_log_block_store_t *log, unsigned number,
+		       bool keep_tombstones)
+{
+  chop_error_t err = 0;
+  chop_buffer_t buffer;
+  uint64_t offset, end;
+  int fd;
+
+  {
+    const log_segment_t *segment = log_segment (log, number);
+
+    /* LOG->SEGMENTS may be reallocated as records are appended.  */
+    fd = segment->fd;
+    end = segment->size;
+  }
+
+  err = chop_buffer_init (&buffer, 0);
+  if (err)
+    return err;
+
+  for (offset = sizeof (LOG_SEGMENT_MAGIC) - 1;
+       (offset < end) && (!err); )
+    {
+      log_record_t record;
+      const log_entry_t *entry;
+      chop_block_key_t key;
+      size_t size;
+      char *area;
+
+      err = log_record_read (fd, offset, &record);
+      if (err)
+	break;
+
+      size = record.key_size + record.size;
+      chop_buffer_clear (&buffer);
+      err = chop_buffer_extend (&buffer, size, &area);
+      if (!err)
+	err = store_read_at (fd, area, size, offset + LOG_RECORD_HEADER_SIZE);
+      if (err)
+	break;
+
+      chop_block_key_init (&key, area, record.key_size, NULL, NULL);
+      entry = log_index_find (log, &key);
+      if (record.flags & LOG_RECORD_TOMBSTONE)
+	{
+	  if ((keep_tombstones) && (entry == NULL))
+	    err = log_append (log, area, record.key_size, NULL, 0,
+			      LOG_RECORD_TOMBSTONE);
+	}
+      else if ((entry != NULL) && (entry->segment == number)
+	       && (entry->offset == offset))
+	err = log_append (log, area, record.key_size,
+			  area + record.key_size, record.size, 0);
+
+      offset += log_record_size (record.key_size, record.size);
+    }
+
+  chop_buffer_return (&buffer);
+
+  return err;
+}
+
+chop_error_t
+chop_log_store_compact (chop_block_store_t *store, unsigned garbage_percent)
+{
+  chop_error_t err = 0;
+  chop_log_block_store_t *log =
+    (chop_log_block_store_t *) store;
+  unsigned *numbers;
+  bool *keep_tombstones;
+  size_t count, last, i;
+
+  numbers = alloca (log->segment_count * sizeof (*numbers) + 1);
+  keep_tombstones = alloca (log->segment_count * sizeof (*keep_tombstones)
+			    + 1);
+
+  /* Choose the segments with enough dead records, leaving aside the one
+     being written.  */
+  last = log->writing ? log->segment_count - 1 : log->segment_count;
+  for (i = 0, count = 0; i < last; i++)
+    {
+      const log_segment_t *segment = &log->segments[i];
+      uint64_t size, garbage;
+
+      size = segment->size - (sizeof (LOG_SEGMENT_MAGIC) - 1);
+      garbage = size - segment->live_size;
+      if ((garbage > 0) && (garbage * 100 >= garbage_percent * size))
+	{
+	  /* Tombstones must be kept if an older segment is left in
+	     place.  */
+	  keep_tombstones[count] = (i > count);
+	  numbers[count++] = segment->number;
+	}
+    }
+
+  if (count == 0)
+    return 0;
+
+  for (i = 0; (i < count) && (!err); i++)
+    err = log_copy_live_records (log, numbers[i], keep_tombstones[i]);
+
+  /* Make the copies durable and checkpoint the index before removing the
+     segments, since they are no longer replayed once checkpointed.  They
+     are removed oldest first, so that a tombstone disappears after the
+     records it applies to.  */
+  if (!err)
+    err = log_sync_segments (log);
+  if (!err)
+    err = log_write_checkpoint (log);
+
+  for (i = 0; (i < count) && (!err); i++)
+    err = log_remove_segment (log, numbers[i]);
+
+  if (!err)
+    err = log_index_prune (log);
+
+  return err;
+}
+
+
+/* Open the segments found in LOG's directory.  */
+static chop_error_t
+log_open_segments (chop_log_block_store_t *log)
+{
+  chop_error_t err;
+  unsigned *numbers;
+  size_t count, i;
+  int fd;
+
+  err = store_numbered_files (log->dir_fd, "segment-", ".log",
+			      (chop_class_t *) &chop_log_block_store_class,
+			      &numbers, &count);
+  if (err)
+    return err;
+
+  for (i = 0; (i < count) && (!err); i++)
+    {
+      char name[32], magic[sizeof (LOG_SEGMENT_MAGIC) - 1];
+      struct stat stat;
+
+      segment_file_name (name, numbers[i]);
+      fd = openat (log->dir_fd, name, O_RDWR);
+      if (fd < 0)
+	{
+	  err = errno;
+	  break;
+	}
+
+      if (fstat (fd, &stat))
+	err = errno;
+      else if ((size_t) stat.st_size >= sizeof (magic))
+	err = store_read_at (fd, magic, sizeof (magic), 0);
+
+      if ((!err)
+	  && (((size_t) stat.st_size < sizeof (magic))
+	      || (memcmp (magic, LOG_SEGMENT_MAGIC, sizeof (magic)))))
+	{
+	  /* The segment was created but not even its header was written,
+	     which can only happen to the last one.  */
+	  if (i + 1 < count)
+	    err = CHOP_DESERIAL_CORRUPT_INPUT;
+	  else if (unlinkat (log->dir_fd, name, 0))
+	    err = errno;
+
+	  close (fd);
+	  log->next_number = numbers[i] + 1;
+	  continue;
+	}
+
+      if (!err)
+	err = log_add_segment (log, numbers[i], fd, stat.st_size);
+      if (err)
+	close (fd);
+    }
+
+  chop_free (numbers, (chop_class_t *) &chop_log_block_store_class);
+
+  return err;
+}
+
+/* Open the segments of LOG and fill its index from its checkpoint and
+   the records written after it.  */
+static chop_error_t
+log_load (chop_log_block_store_t *log)
+{
+  chop_error_t err;
+  unsigned first = 0;
+  uint64_t offset = 0;
+  size_t i;
+
+  err = log_open_segments (log);
+  if (err)
+    return err;
+
+  err = log_read_checkpoint (log, &first, &offset);
+  if (err)
+    {
+      /* Without a usable checkpoint, replay every segment.  */
+      log_index_reset (log);
+      first = 0;
+      offset = 0;
+    }
+  else if (first > log->next_number)
+    log->next_number = first;
+
+  for (i = 0, err = 0; (i < log->segment_count) && (!err); i++)
+    {
+      unsigned number = log->segments[i].number;
+
+      if (number >= first)
+	err = log_replay_segment (log, number,
+				  number == first && offset > 0
+				  ? offset : sizeof (LOG_SEGMENT_MAGIC) - 1,
+				  i + 1 == log->segment_count);
+    }
+
+  /* Segments left behind by an interrupted compaction are not removed
+     here, since they may hold tombstones that are still needed; they have
+     no live records, so the next compaction removes them.  */
+
+  if ((!err) && (log->segment_count > 0)
+      && (log->segments[log->segment_count - 1].size < log->segment_size))
+    {
+      /* Keep appending to the last segment.  */
+      log_segment_t *segment = &log->segments[log->segment_count - 1];
+
+      if (lseek (segment->fd, segment->size, SEEK_SET) == (off_t) -1)
+	err = errno;
+      else
+	{
+	  log->writing = true;
+	  log->flushed_size = segment->size;
+	}
+    }
+
+  return err;
+}
+
+chop_error_t
+chop_log_store_open (int dir_fd, int eventually_close, size_t segment_size,
+		     chop_block_store_t *store)
+{
+  chop_error_t err;
+  char *log_name;
+  chop_log_block_store_t *log =
+    (chop_log_block_store_t *) store;
+
+  log_name = alloca (12);
+  snprintf (log_name, 12, "log/%i", dir_fd);
+
+  err = chop_object_initialize ((chop_object_t *) store,
+				(chop_class_t *) &chop_log_block_store_class);
+  if (err)
+    return err;
+
+  store->name = chop_strdup (log_name,
+			     (chop_class_t *) &chop_log_block_store_class);
+  store->iterator_class = &chop_log_block_iterator_class;
+  store->blocks_exist = chop_log_store_blocks_exist;
+  store->read_block = chop_log_store_read_block;
+  store->write_block = chop_log_store_write_block;
+  store->delete_block = chop_log_store_delete_block;
+  store->first_block = chop_log_store_first_block;
+  store->close = chop_log_store_close;
+  store->sync = chop_log_store_sync;
+
+  log->dir_fd = dir_fd;
+  log->eventually_close = eventually_close;
+  log->segment_size = segment_size ? segment_size : LOG_DEFAULT_SEGMENT_SIZE;
+  log->segments = NULL;
+  log->segment_count = log->segments_allocated = 0;
+  log->next_number = 0;
+  log->writing = false;
+  log->flushed_size = 0;
+  log->unsynced_directory = false;
+  log->entries = NULL;
+  log->entry_count = log->entries_allocated = 0;
+  log->table = NULL;
+  log->table_size = 0;
+  log->dirty = false;
+
+  err = chop_buffer_init (&log->keys, 0);
+  if (!err)
+    {
+      err = chop_buffer_init (&log->pending, 0);
+      if (err)
+	chop_buffer_return (&log->keys);
+    }
+  if (err)
+    {
+      if (eventually_close)
+	close (dir_fd);
+      log->dir_fd = -1;
+      chop_object_destroy ((chop_object_t *) store);
+      return err;
+    }
+
+  err = log_load (log);
+  if (err)
+    {
+      /* Leave the directory as it is.  */
+      log->dirty = false;
+      chop_object_destroy ((chop_object_t *) store);
+    }
+
+  return err;
+}
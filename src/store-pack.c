@@ -0,0 +1,1340 @@
+/* libchop -- a utility library for distributed storage and data backup
+   Copyright (C) 2026  Ludovic Courtès <ludo@gnu.org>
+
+   Libchop is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Libchop is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with libchop.  If not, see <http://www.gnu.org/licenses/>.  */
+
+/* A block store that appends blocks to large ``pack'' files, similar to
+   Git's packs.  Once a pack is full, it is ``sealed'': an index of its
+   blocks sorted by key is written next to it, and both are mapped in
+   memory.  */
+
+#include <chop/chop-config.h>
+
+#include <chop/chop.h>
+#include <chop/stores.h>
+#include <chop/buffers.h>
+#include <alloca.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <assert.h>
+
+#include <full-write.h>
+
+#include "store-common.h"
+#include "little-endian.h"
+
+
+/* File formats.  */
+
+#define PACK_MAGIC        "CHOPPCK1"
+#define PACK_INDEX_MAGIC  "CHOPIDX1"
+
+/* The default size above which a pack is sealed.  */
+#define PACK_DEFAULT_SIZE  (32UL << 20)
+
+/* The amount of data written to a pack at once.  */
+#define PACK_WRITE_SIZE    (1UL << 20)
+
+/* A pack file starts with PACK_MAGIC, followed by records, each of which
+   is a header followed by the key and then the contents of a block.  The
+   header is made of these fields, stored as 32-bit little-endian
+   integers.  */
+typedef struct
+{
+  uint32_t key_size;
+  uint32_t size;
+} pack_record_t;
+
+#define PACK_RECORD_HEADER_SIZE  8
+
+/* The header of a pack index file, followed by COUNT entries sorted by
+   key.  FANOUT[B] is the number of entries whose key starts with a byte
+   lower than or equal to B, as in Git's pack indices.  Integers are
+   stored in little-endian order, so that indices are mapped in memory
+   as is regardless of the host.  */
+typedef struct
+{
+  char          magic[8];
+  unsigned char count[4];
+  unsigned char reserved[4];
+  unsigned char fanout[256][4];
+} pack_index_header_t;
+
+/* An index entry: the first bytes of the key, padded with zeros, which
+   spares most comparisons a visit to the pack, and the offset of the
+   record within the pack.  */
+typedef struct
+{
+  unsigned char prefix[8];
+  unsigned char offset[8];
+} pack_index_entry_t;
+
+#define pack_index_fanout(_index, _byte)		\
+  ((size_t) load_little_endian ((_index)->fanout[_byte], 4))
+#define pack_index_entry_offset(_entry)			\
+  load_little_endian ((_entry)->offset, 8)
+
+/* A sealed pack and its index, both mapped in memory.  */
+typedef struct
+{
+  unsigned                   number;
+  const char                *data;
+  size_t                     data_size;
+  const pack_index_header_t *index;
+  size_t                     index_size;
+  const pack_index_entry_t  *entries;
+  size_t                     count;
+} sealed_pack_t;
+
+/* A block of the pack being written, whose key is at KEY_OFFSET in the
+   store's KEYS buffer.  */
+typedef struct
+{
+  uint64_t offset;
+  size_t   key_offset;
+  uint32_t key_size;
+  uint32_t size;
+} open_entry_t;
+
+
+/* Class definitions.  */
+
+CHOP_DECLARE_RT_CLASS_WITH_METACLASS (pack_block_store, block_store,
+				      file_based_store_class,
+				      int dir_fd;
+				      int eventually_close;
+				      size_t pack_size;
+
+				      /* True if a pack was created since
+					 the directory was last synced */
+				      bool unsynced_directory;
+
+				      /* Sealed packs, oldest first */
+				      sealed_pack_t *packs;
+				      size_t pack_count;
+				      size_t packs_allocated;
+				      unsigned next_number;
+
+				      /* The pack being written, if OPEN_FD
+					 is not -1: its blocks, their keys,
+					 a hash table of ENTRIES indices
+					 plus one, and the data not written
+					 yet, which starts at FLUSHED_SIZE */
+				      int open_fd;
+				      unsigned open_number;
+				      uint64_t open_size;
+				      uint64_t flushed_size;
+				      open_entry_t *entries;
+				      size_t entry_count;
+				      size_t entries_allocated;
+				      chop_buffer_t keys;
+				      size_t *table;
+				      size_t table_size;
+				      chop_buffer_t pending;);
+
+static chop_error_t chop_pack_close (chop_block_store_t *);
+static chop_error_t chop_pack_next_block (chop_block_iterator_t *it);
+
+
+/* A generic open method, common to all file-based block stores.  */
+static chop_error_t
+chop_pack_generic_open (const chop_class_t *class,
+			const char *file, int open_flags, mode_t mode,
+			chop_block_store_t *store)
+{
+  if ((chop_file_based_store_class_t *) class != &chop_pack_block_store_class)
+    return CHOP_INVALID_ARG;
+
+  return store_directory_generic_open (file, mode, chop_pack_store_open,
+				       store);
+}
+
+static void
+pbs_dtor (chop_object_t *object)
+{
+  chop_pack_block_store_t *pack =
+    (chop_pack_block_store_t *) object;
+
+  if (pack->dir_fd >= 0)
+    chop_pack_close (&pack->block_store);
+}
+
+CHOP_DEFINE_RT_CLASS_WITH_METACLASS (pack_block_store, block_store,
+				     file_based_store_class,
+
+				     /* metaclass inits */
+				     .generic_open = chop_pack_generic_open,
+
+				     NULL, pbs_dtor,
+				     NULL, NULL, /* No copy/equalp */
+				     NULL, NULL  /* No serial/deserial */);
+
+
+/* Iterators.  */
+
+/* An iterator over the blocks of PACK_NUMBER, an index in the store's
+   sealed packs or the pack being written if equal to their count.  */
+CHOP_DECLARE_RT_CLASS (pack_block_iterator, block_iterator,
+		       size_t pack_number;
+		       size_t entry;);
+
+static chop_error_t
+pbi_ctor (chop_object_t *object, const chop_class_t *class)
+{
+  chop_pack_block_iterator_t *it = (chop_pack_block_iterator_t *) object;
+
+  it->block_iterator.next = chop_pack_next_block;
+  it->pack_number = it->entry = 0;
+
+  return 0;
+}
+
+static void
+pbi_dtor (chop_object_t *object)
+{
+  chop_pack_block_iterator_t *it = (chop_pack_block_iterator_t *) object;
+
+  chop_block_key_free (&it->block_iterator.key);
+}
+
+CHOP_DEFINE_RT_CLASS (pack_block_iterator, block_iterator,
+		      pbi_ctor, pbi_dtor,
+		      NULL, NULL,
+		      NULL, NULL);
+
+
+/* Keys.  */
+
+/* Fill PREFIX with the first bytes of KEY, a KEY_SIZE-byte key, padded
+   with zeros.  Prefixes compare like the keys they come from, unless they
+   are equal.  */
+static inline void
+key_prefix (const char *key, size_t key_size, unsigned char prefix[8])
+{
+  memset (prefix, 0, 8);
+  memcpy (prefix, key, key_size < 8 ? key_size : 8);
+}
+
+static inline int
+compare_keys (const char *key1, size_t size1,
+	      const char *key2, size_t size2)
+{
+  int result;
+
+  result = memcmp (key1, key2, size1 < size2 ? size1 : size2);
+  if (result == 0)
+    result = (size1 < size2) ? -1 : ((size1 > size2) ? 1 : 0);
+
+  return result;
+}
+
+
+/* Records.  */
+
+static inline void
+pack_record_encode (const pack_record_t *record,
+		    unsigned char buffer[PACK_RECORD_HEADER_SIZE])
+{
+  store_little_endian (buffer, record->key_size, 4);
+  store_little_endian (buffer + 4, record->size, 4);
+}
+
+static inline void
+pack_record_decode (const unsigned char buffer[PACK_RECORD_HEADER_SIZE],
+		    pack_record_t *record)
+{
+  record->key_size = load_little_endian (buffer, 4);
+  record->size = load_little_endian (buffer + 4, 4);
+}
+
+
+/* Sealed packs.  */
+
+/* Set NAME to the name of the file of pack NUMBER with SUFFIX.  */
+#define pack_file_name(_name, _number, _suffix)			\
+  snprintf ((_name), sizeof (_name), "pack-%08x.%s",		\
+	    (_number), (_suffix))
+
+/* Return the record at OFFSET in PACK, or NULL if PACK is corrupt.  */
+static inline const char *
+sealed_pack_record (const sealed_pack_t *pack, uint64_t offset,
+		    pack_record_t *record)
+{
+  if (offset + PACK_RECORD_HEADER_SIZE > pack->data_size)
+    return NULL;
+
+  pack_record_decode ((const unsigned char *) pack->data + offset, record);
+  if (offset + PACK_RECORD_HEADER_SIZE + record->key_size + record->size
+      > pack->data_size)
+    return NULL;
+
+  return pack->data + offset + PACK_RECORD_HEADER_SIZE;
+}
+
+/* Look for KEY in PACK.  If found, return a pointer to its record, which
+   is copied to RECORD, and NULL otherwise.  */
+static const char *
+sealed_pack_lookup (const sealed_pack_t *pack, const chop_block_key_t *key,
+		    pack_record_t *record)
+{
+  const char *key_buffer = chop_block_key_buffer (key);
+  size_t key_size = chop_block_key_size (key);
+  unsigned char prefix[8];
+  unsigned first_byte;
+  size_t low, high;
+
+  first_byte = key_size ? (unsigned char) key_buffer[0] : 0;
+  low = first_byte ? pack_index_fanout (pack->index, first_byte - 1) : 0;
+  high = pack_index_fanout (pack->index, first_byte);
+
+  key_prefix (key_buffer, key_size, prefix);
+
+  while (low < high)
+    {
+      size_t middle = low + (high - low) / 2;
+      const pack_index_entry_t *entry = &pack->entries[middle];
+      const char *p;
+      int cmp;
+
+      cmp = memcmp (prefix, entry->prefix, sizeof (prefix));
+      if (cmp == 0)
+	{
+	  p = sealed_pack_record (pack, pack_index_entry_offset (entry),
+				  record);
+	  if (p == NULL)
+	    return NULL;
+
+	  cmp = compare_keys (key_buffer, key_size, p, record->key_size);
+	  if (cmp == 0)
+	    return p;
+	}
+
+      if (cmp < 0)
+	high = middle;
+      else
+	low = middle + 1;
+    }
+
+  return NULL;
+}
+
+/* Map pack NUMBER and its index from DIR_FD into PACK.  */
+static chop_error_t
+sealed_pack_map (int dir_fd, unsigned number, sealed_pack_t *pack)
+{
+  chop_error_t err = 0;
+  char name[32];
+  struct stat stat;
+  int fd;
+
+  pack->number = number;
+  pack->data = NULL;
+  pack->index = NULL;
+
+  pack_file_name (name, number, "idx");
+  fd = openat (dir_fd, name, O_RDONLY);
+  if (fd < 0)
+    return errno;
+
+  if (fstat (fd, &stat))
+    err = errno;
+  else if ((size_t) stat.st_size < sizeof (pack_index_header_t))
+    err = CHOP_DESERIAL_CORRUPT_INPUT;
+  else
+    {
+      pack->index_size = stat.st_size;
+      pack->index = mmap (0, pack->index_size, PROT_READ, MAP_SHARED, fd, 0);
+      if (pack->index == MAP_FAILED)
+	pack->index = NULL, err = errno;
+    }
+  close (fd);
+
+  if (!err)
+    {
+      pack->count = load_little_endian (pack->index->count, 4);
+      if ((memcmp (pack->index->magic, PACK_INDEX_MAGIC,
+		   sizeof (pack->index->magic)))
+	  || (pack_index_fanout (pack->index, 255) != pack->count)
+	  || (pack->index_size != sizeof (pack_index_header_t)
+	      + pack->count * sizeof (pack_index_entry_t)))
+	err = CHOP_DESERIAL_CORRUPT_INPUT;
+    }
+
+  if (!err)
+    {
+      unsigned i;
+
+      /* Lookups use the fanout table as bounds into the entries.  */
+      for (i = 1; i < 256; i++)
+	if ((pack_index_fanout (pack->index, i - 1)
+	     > pack_index_fanout (pack->index, i))
+	    || (pack_index_fanout (pack->index, i) > pack->count))
+	  {
+	    err = CHOP_DESERIAL_CORRUPT_INPUT;
+	    break;
+	  }
+    }
+
+  if (!err)
+    {
+      pack->entries =
+	(const pack_index_entry_t *) ((const char *) pack->index
+				      + sizeof (pack_index_header_t));
+
+      pack_file_name (name, number, "pack");
+      fd = openat (dir_fd, name, O_RDONLY);
+      if (fd < 0)
+	err = errno;
+      else
+	{
+	  if (fstat (fd, &stat))
+	    err = errno;
+	  else if ((size_t) stat.st_size < sizeof (PACK_MAGIC) - 1)
+	    err = CHOP_DESERIAL_CORRUPT_INPUT;
+	  else
+	    {
+	      pack->data_size = stat.st_size;
+	      pack->data = mmap (0, pack->data_size, PROT_READ, MAP_SHARED,
+				 fd, 0);
+	      if (pack->data == MAP_FAILED)
+		pack->data = NULL, err = errno;
+	      else
+		/* Blocks are mostly read in the order they were written.  */
+		madvise ((void *) pack->data, pack->data_size,
+			 MADV_SEQUENTIAL);
+	    }
+	  close (fd);
+	}
+    }
+
+  if (err)
+    {
+      if (pack->index != NULL)
+	munmap ((void *) pack->index, pack->index_size);
+      if (pack->data != NULL)
+	munmap ((void *) pack->data, pack->data_size);
+      pack->index = NULL;
+      pack->data = NULL;
+    }
+
+  return err;
+}
+
+static void
+sealed_pack_unmap (sealed_pack_t *pack)
+{
+  munmap ((void *) pack->index, pack->index_size);
+  munmap ((void *) pack->data, pack->data_size);
+  pack->index = NULL;
+  pack->data = NULL;
+}
+
+
+/* The pack being written.  */
+
+/* Return the index in PACK's open entries of the block with key KEY, or
+   -1.  */
+static ssize_t
+open_pack_lookup (const chop_pack_block_store_t *pack,
+		  const char *key, size_t key_size)
+{
+  size_t slot;
+
+  if (pack->table_size == 0)
+    return -1;
+
+  for (slot = store_hash_key (key, key_size) & (pack->table_size - 1);
+       pack->table[slot] != 0;
+       slot = (slot + 1) & (pack->table_size - 1))
+    {
+      const open_entry_t *entry = &pack->entries[pack->table[slot] - 1];
+
+      if ((entry->key_size == key_size)
+	  && (!memcmp (chop_buffer_content (&pack->keys) + entry->key_offset,
+		       key, key_size)))
+	return pack->table[slot] - 1;
+    }
+
+  return -1;
+}
+
+/* Insert entry INDEX of PACK in its hash table, which must have room for
+   it.  */
+static void
+open_pack_insert (chop_pack_block_store_t *pack, size_t index)
+{
+  const open_entry_t *entry = &pack->entries[index];
+  size_t slot;
+
+  for (slot = store_hash_key (chop_buffer_content (&pack->keys)
+			      + entry->key_offset, entry->key_size)
+	 & (pack->table_size - 1);
+       pack->table[slot] != 0;
+       slot = (slot + 1) & (pack->table_size - 1));
+
+  pack->table[slot] = index + 1;
+}
+
+/* Record that the block with key KEY and SIZE bytes of contents is stored
+   in a record at OFFSET in the pack being written.  */
+static chop_error_t
+open_pack_add (chop_pack_block_store_t *pack,
+	       const char *key, size_t key_size,
+	       uint64_t offset, size_t size)
+{
+  chop_error_t err;
+  ssize_t existing;
+  open_entry_t *entry;
+  size_t i;
+
+  existing = open_pack_lookup (pack, key, key_size);
+  if (existing >= 0)
+    {
+      /* The block was overwritten: the new record wins.  */
+      pack->entries[existing].offset = offset;
+      pack->entries[existing].size = size;
+      return 0;
+    }
+
+  if (pack->entry_count >= pack->entries_allocated)
+    {
+      size_t count = pack->entries_allocated ? 2 * pack->entries_allocated
+	: 1024;
+      open_entry_t *entries;
+
+      entries = chop_realloc (pack->entries, count * sizeof (*entries),
+			      (chop_class_t *) &chop_pack_block_store_class);
+      if (!entries)
+	return ENOMEM;
+
+      pack->entries = entries;
+      pack->entries_allocated = count;
+    }
+
+  if (2 * (pack->entry_count + 1) > pack->table_size)
+    {
+      /* Keep the hash table at most half full.  */
+      size_t count = pack->table_size ? 2 * pack->table_size : 2048;
+      size_t *table;
+
+      table = chop_calloc (count * sizeof (*table),
+			   (chop_class_t *) &chop_pack_block_store_class);
+      if (!table)
+	return ENOMEM;
+
+      chop_free (pack->table, (chop_class_t *) &chop_pack_block_store_class);
+      pack->table = table;
+      pack->table_size = count;
+
+      for (i = 0; i < pack->entry_count; i++)
+	open_pack_insert (pack, i);
+    }
+
+  entry = &pack->entries[pack->entry_count];
+  entry->offset = offset;
+  entry->key_offset = chop_buffer_size (&pack->keys);
+  entry->key_size = key_size;
+  entry->size = size;
+
+  err = chop_buffer_append (&pack->keys, key, key_size);
+  if (err)
+    return err;
+
+  open_pack_insert (pack, pack->entry_count++);
+
+  return 0;
+}
+
+/* Clear PACK's open pack.  */
+static void
+open_pack_reset (chop_pack_block_store_t *pack)
+{
+  pack->open_fd = -1;
+  pack->open_size = pack->flushed_size = 0;
+  pack->entry_count = 0;
+  chop_buffer_clear (&pack->keys);
+  chop_buffer_clear (&pack->pending);
+  if (pack->table != NULL)
+    memset (pack->table, 0, pack->table_size * sizeof (*pack->table));
+}
+
+/* Sync the directory of PACK, so that the packs created and the indices
+   renamed in it survive a crash.  */
+static chop_error_t
+pack_sync_directory (chop_pack_block_store_t *pack)
+{
+  if (fsync (pack->dir_fd))
+    return errno;
+
+  pack->unsynced_directory = false;
+
+  return 0;
+}
+
+/* Create a new pack to write to.  */
+static chop_error_t
+open_pack_create (chop_pack_block_store_t *pack)
+{
+  char name[32];
+
+  pack_file_name (name, pack->next_number, "pack");
+  pack->open_fd = openat (pack->dir_fd, name,
+			  O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+  if (pack->open_fd < 0)
+    return errno;
+
+  pack->unsynced_directory = true;
+  pack->open_number = pack->next_number++;
+  pack->open_size = sizeof (PACK_MAGIC) - 1;
+  pack->flushed_size = 0;
+
+  return chop_buffer_push (&pack->pending, PACK_MAGIC,
+			   sizeof (PACK_MAGIC) - 1);
+}
+
+/* Write the pending data of the open pack to its file.  */
+static chop_error_t
+open_pack_flush (chop_pack_block_store_t *pack)
+{
+  size_t size = chop_buffer_size (&pack->pending);
+
+  if (size > 0)
+    {
+      if (full_write (pack->open_fd, chop_buffer_content (&pack->pending),
+		      size) < size)
+	return errno;
+
+      pack->flushed_size += size;
+      chop_buffer_clear (&pack->pending);
+    }
+
+  return 0;
+}
+
+/* An open entry along with its key, for sorting.  */
+typedef struct
+{
+  pack_index_entry_t entry;
+  const char        *key;
+  size_t             key_size;
+} sortable_entry_t;
+
+static int
+compare_sortable_entries (const void *e1, const void *e2)
+{
+  const sortable_entry_t *s1 = e1, *s2 = e2;
+  int cmp;
+
+  cmp = memcmp (s1->entry.prefix, s2->entry.prefix,
+		sizeof (s1->entry.prefix));
+  if (cmp == 0)
+    cmp = compare_keys (s1->key, s1->key_size, s2->key, s2->key_size);
+
+  return cmp;
+}
+
+/* Write the index of the open pack of PACK, then map it as a sealed pack
+   and get ready to create a new pack.  */
+static chop_error_t
+open_pack_seal (chop_pack_block_store_t *pack)
+{
+  chop_error_t err;
+  pack_index_header_t header;
+  uint32_t fanout[256];
+  sortable_entry_t *sorted;
+  char name[32], tmp_name[40];
+  size_t i;
+  int fd;
+
+  err = open_pack_flush (pack);
+  if (err)
+    return err;
+
+  if (fdatasync (pack->open_fd))
+    return errno;
+
+  sorted = chop_malloc (pack->entry_count * sizeof (*sorted) + 1,
+			(chop_class_t *) &chop_pack_block_store_class);
+  if (!sorted)
+    return ENOMEM;
+
+  for (i = 0; i < pack->entry_count; i++)
+    {
+      const open_entry_t *entry = &pack->entries[i];
+
+      sorted[i].key = chop_buffer_content (&pack->keys) + entry->key_offset;
+      sorted[i].key_size = entry->key_size;
+      store_little_endian (sorted[i].entry.offset, entry->offset, 8);
+      key_prefix (sorted[i].key, sorted[i].key_size, sorted[i].entry.prefix);
+    }
+
+  qsort (sorted, pack->entry_count, sizeof (*sorted),
+	 compare_sortable_entries);
+
+  memset (fanout, 0, sizeof (fanout));
+  for (i = 0; i < pack->entry_count; i++)
+    fanout[sorted[i].key_size ? (unsigned char) sorted[i].key[0] : 0]++;
+  for (i = 1; i < 256; i++)
+    fanout[i] += fanout[i - 1];
+
+  memset (&header, 0, sizeof (header));
+  memcpy (header.magic, PACK_INDEX_MAGIC, sizeof (header.magic));
+  store_little_endian (header.count, pack->entry_count, 4);
+  for (i = 0; i < 256; i++)
+    store_little_endian (header.fanout[i], fanout[i], 4);
+
+  /* Write the index under a temporary name so that a pack has an index
+   only once it is complete.  */
+  pack_file_name (name, pack->open_number, "idx");
+  snprintf (tmp_name, sizeof (tmp_name), "%s.tmp", name);
+
+  fd = openat (pack->dir_fd, tmp_name, O_WRONLY | O_CREAT | O_TRUNC,
+	       S_IRUSR | S_IWUSR);
+  if (fd < 0)
+    err = errno;
+  else
+    {
+      if (full_write (fd, (char *) &header, sizeof (header))
+	  < sizeof (header))
+	err = errno;
+
+      for (i = 0; (i < pack->entry_count) && (!err); i++)
+	if (full_write (fd, (char *) &sorted[i].entry,
+			sizeof (sorted[i].entry)) < sizeof (sorted[i].entry))
+	  err = errno;
+
+      if ((!err) && (fdatasync (fd)))
+	err = errno;
+
+      close (fd);
+
+      if ((!err) && (renameat (pack->dir_fd, tmp_name, pack->dir_fd, name)))
+	err = errno;
+
+      /* Make both the pack and its index part of the directory.  */
+      if (!err)
+	err = pack_sync_directory (pack);
+    }
+
+  chop_free (sorted, (chop_class_t *) &chop_pack_block_store_class);
+
+  if (!err && pack->pack_count >= pack->packs_allocated)
+    {
+      size_t count = pack->packs_allocated ? 2 * pack->packs_allocated : 16;
+      sealed_pack_t *packs;
+
+      packs = chop_realloc (pack->packs, count * sizeof (*packs),
+			    (chop_class_t *) &chop_pack_block_store_class);
+      if (!packs)
+	err = ENOMEM;
+      else
+	pack->packs = packs, pack->packs_allocated = count;
+    }
+
+  if (!err)
+    err = sealed_pack_map (pack->dir_fd, pack->open_number,
+			   &pack->packs[pack->pack_count]);
+
+  if (!err)
+    {
+      pack->pack_count++;
+      close (pack->open_fd);
+      open_pack_reset (pack);
+    }
+
+  return err;
+}
+
+/* Read back pack NUMBER, which has no index, presumably because it was
+   being written when the store was last used, truncate its last record
+   if it extends past the end of the file, and seal it.  */
+static chop_error_t
+open_pack_recover (chop_pack_block_store_t *pack, unsigned number)
+{
+  chop_error_t err = 0;
+  char name[32], magic[sizeof (PACK_MAGIC) - 1];
+  struct stat stat;
+  chop_buffer_t key;
+  uint64_t offset, end;
+  int fd;
+
+  pack_file_name (name, number, "pack");
+  fd = openat (pack->dir_fd, name, O_RDWR);
+  if (fd < 0)
+    return errno;
+
+  if (fstat (fd, &stat))
+    {
+      err = errno;
+      close (fd);
+      return err;
+    }
+
+  end = stat.st_size;
+  if (end < sizeof (magic))
+    {
+      /* The pack was created but not even its header was written.  */
+      close (fd);
+      return (unlinkat (pack->dir_fd, name, 0) ? errno : 0);
+    }
+
+  err = store_read_at (fd, magic, sizeof (magic), 0);
+  if ((!err) && (memcmp (magic, PACK_MAGIC, sizeof (magic))))
+    err = CHOP_DESERIAL_CORRUPT_INPUT;
+  if (err)
+    {
+      close (fd);
+      return err;
+    }
+
+  err = chop_buffer_init (&key, 0);
+  if (err)
+    {
+      close (fd);
+      return err;
+    }
+
+  pack->open_fd = fd;
+  pack->open_number = number;
+
+  for (offset = sizeof (magic); (offset < end) && (!err); )
+    {
+      pack_record_t record;
+      unsigned char header[PACK_RECORD_HEADER_SIZE];
+      char *area;
+
+      /* Stop at a record that extends past the end of the file: it was
+	 being written when the store was last used.  */
+      if (offset + sizeof (header) > end)
+	break;
+
+      err = store_read_at (fd, header, sizeof (header), offset);
+      if (err)
+	break;
+
+      pack_record_decode (header, &record);
+      if (offset + sizeof (header) + record.key_size + record.size > end)
+	break;
+
+      chop_buffer_clear (&key);
+      err = chop_buffer_extend (&key, record.key_size, &area);
+      if (!err)
+	err = store_read_at (fd, area, record.key_size,
+			     offset + sizeof (header));
+      if (!err)
+	err = open_pack_add (pack, area, record.key_size, offset,
+			     record.size);
+
+      offset += sizeof (header) + record.key_size + record.size;
+    }
+
+  chop_buffer_return (&key);
+
+  if ((!err) && (offset < end) && (ftruncate (fd, offset)))
+    err = errno;
+
+  if (!err)
+    {
+      pack->open_size = pack->flushed_size = offset;
+      err = open_pack_seal (pack);
+    }
+
+  if (err)
+    {
+      close (fd);
+      open_pack_reset (pack);
+    }
+
+  return err;
+}
+
+
+/* The block store methods.  */
+
+/* Look for KEY in PACK.  If it is in the pack being written, return
+   *SEALED = NULL and its entry in *ENTRY; otherwise, return the sealed
+   pack that contains it in *SEALED and its record in RECORD and *DATA.
+   Return false if KEY was not found.  */
+static bool
+pack_lookup (const chop_pack_block_store_t *pack,
+	     const chop_block_key_t *key,
+	     const sealed_pack_t **sealed, const open_entry_t **entry,
+	     pack_record_t *record, const char **data)
+{
+  ssize_t index;
+  size_t i;
+
+  index = open_pack_lookup (pack, chop_block_key_buffer (key),
+			    chop_block_key_size (key));
+  if (index >= 0)
+    {
+      *sealed = NULL;
+      *entry = &pack->entries[index];
+      return true;
+    }
+
+  /* Newer packs take precedence.  */
+  for (i = pack->pack_count; i > 0; i--)
+    {
+      const char *p;
+
+      p = sealed_pack_lookup (&pack->packs[i - 1], key, record);
+      if (p != NULL)
+	{
+	  *sealed = &pack->packs[i - 1];
+	  *entry = NULL;
+	  *data = p + record->key_size;
+	  return true;
+	}
+    }
+
+  return false;
+}
+
+static chop_error_t
+chop_pack_blocks_exist (chop_block_store_t *store,
+			size_t n, const chop_block_key_t keys[n],
+			bool exists[n])
+{
+  chop_pack_block_store_t *pack =
+    (chop_pack_block_store_t *) store;
+  const sealed_pack_t *sealed;
+  const open_entry_t *entry;
+  pack_record_t record;
+  const char *data;
+  size_t i;
+
+  for (i = 0; i < n; i++)
+    exists[i] = pack_lookup (pack, &keys[i], &sealed, &entry,
+			     &record, &data);
+
+  return 0;
+}
+
+static chop_error_t
+chop_pack_read_block (chop_block_store_t *store,
+		      const chop_block_key_t *key,
+		      chop_buffer_t *buffer,
+		      size_t *size)
+{
+  chop_error_t err;
+  chop_pack_block_store_t *pack =
+    (chop_pack_block_store_t *) store;
+  const sealed_pack_t *sealed;
+  const open_entry_t *entry;
+  pack_record_t record;
+  const char *data;
+
+  *size = 0;
+
+  if (!pack_lookup (pack, key, &sealed, &entry, &record, &data))
+    return CHOP_STORE_BLOCK_UNAVAIL;
+
+  if (sealed != NULL)
+    {
+      err = chop_buffer_push (buffer, data, record.size);
+      if (!err)
+	*size = record.size;
+    }
+  else
+    {
+      uint64_t offset;
+
+      offset = entry->offset + PACK_RECORD_HEADER_SIZE + entry->key_size;
+      if (offset >= pack->flushed_size)
+	/* The block has not been written to the file yet.  */
+	err = chop_buffer_push (buffer,
+				chop_buffer_content (&pack->pending)
+				+ (offset - pack->flushed_size),
+				entry->size);
+      else
+	{
+	  char *area;
+
+	  chop_buffer_clear (buffer);
+	  err = chop_buffer_extend (buffer, entry->size, &area);
+	  if (!err)
+	    err = store_read_at (pack->open_fd, area, entry->size, offset);
+	}
+
+      if (!err)
+	*size = entry->size;
+    }
+
+  return err;
+}
+
+static chop_error_t
+chop_pack_write_block (chop_block_store_t *store,
+		       const chop_block_key_t *key,
+		       const char *block, size_t size)
+{
+  chop_error_t err = 0;
+  chop_pack_block_store_t *pack =
+    (chop_pack_block_store_t *) store;
+  pack_record_t record;
+  unsigned char header[PACK_RECORD_HEADER_SIZE];
+
+  if ((size > UINT32_MAX) || (chop_block_key_size (key) > UINT32_MAX))
+    return CHOP_INVALID_ARG;
+
+  if (pack->open_fd < 0)
+    {
+      err = open_pack_create (pack);
+      if (err)
+	return err;
+    }
+
+  record.key_size = chop_block_key_size (key);
+  record.size = size;
+  pack_record_encode (&record, header);
+
+  err = chop_buffer_append (&pack->pending, (char *) header, sizeof (header));
+  if (!err)
+    err = chop_buffer_append (&pack->pending, chop_block_key_buffer (key),
+			      record.key_size);
+  if (!err)
+    err = chop_buffer_append (&pack->pending, block, size);
+  if (!err)
+    err = open_pack_add (pack, chop_block_key_buffer (key), record.key_size,
+			 pack->open_size, size);
+  if (err)
+    return err;
+
+  pack->open_size += sizeof (header) + record.key_size + size;
+
+  if (pack->open_size >= pack->pack_size)
+    err = open_pack_seal (pack);
+  else if (chop_buffer_size (&pack->pending) >= PACK_WRITE_SIZE)
+    err = open_pack_flush (pack);
+
+  return err;
+}
+
+/* Return true if the block with key KEY in sealed pack PACK_NUMBER of PACK
+   is shadowed by a more recent block with the same key.  */
+static bool
+pack_shadowed_p (const chop_pack_block_store_t *pack, size_t pack_number,
+		 const char *key, size_t key_size)
+{
+  chop_block_key_t block_key;
+  pack_record_t record;
+  size_t i;
+
+  if (open_pack_lookup (pack, key, key_size) >= 0)
+    return true;
+
+  chop_block_key_init (&block_key, (char *) key, key_size, NULL, NULL);
+  for (i = pack_number + 1; i < pack->pack_count; i++)
+    if (sealed_pack_lookup (&pack->packs[i], &block_key, &record))
+      return true;
+
+  return false;
+}
+
+static void
+free_key (char *key, void *unused)
+{
+  chop_free (key, &chop_pack_block_iterator_class);
+}
+
+/* Move IT to the next block that is not shadowed, starting from its
+   current position, and copy its key.  */
+static chop_error_t
+pack_iterator_settle (chop_pack_block_iterator_t *it)
+{
+  chop_pack_block_store_t *pack =
+    (chop_pack_block_store_t *) it->block_iterator.store;
+  const char *key = NULL;
+  size_t key_size = 0;
+  char *copy;
+
+  while (it->pack_number < pack->pack_count)
+    {
+      const sealed_pack_t *sealed = &pack->packs[it->pack_number];
+
+      if (it->entry < sealed->count)
+	{
+	  pack_record_t record;
+
+	  key = sealed_pack_record (sealed,
+				    pack_index_entry_offset
+				    (&sealed->entries[it->entry]),
+				    &record);
+	  if (key == NULL)
+	    return CHOP_STORE_ERROR;
+
+	  key_size = record.key_size;
+	  if (!pack_shadowed_p (pack, it->pack_number, key, key_size))
+	    break;
+
+	  key = NULL;
+	  it->entry++;
+	}
+      else
+	it->pack_number++, it->entry = 0;
+    }
+
+  if (key == NULL)
+    {
+      /* Blocks of the pack being written are never shadowed.  */
+      if (it->entry >= pack->entry_count)
+	{
+	  it->block_iterator.nil = 1;
+	  return CHOP_STORE_END;
+	}
+
+      key = chop_buffer_content (&pack->keys)
+	+ pack->entries[it->entry].key_offset;
+      key_size = pack->entries[it->entry].key_size;
+    }
+
+  copy = chop_malloc (key_size + 1, &chop_pack_block_iterator_class);
+  if (copy == NULL)
+    return ENOMEM;
+
+  memcpy (copy, key, key_size);
+  chop_block_key_free (&it->block_iterator.key);
+  chop_block_key_init (&it->block_iterator.key, copy, key_size,
+		       free_key, NULL);
+  it->block_iterator.nil = 0;
+
+  return 0;
+}
+
+static chop_error_t
+chop_pack_first_block (chop_block_store_t *store,
+		       chop_block_iterator_t *it)
+{
+  chop_error_t err;
+  chop_pack_block_iterator_t *pit = (chop_pack_block_iterator_t *) it;
+
+  err = chop_object_initialize ((chop_object_t *) it,
+				&chop_pack_block_iterator_class);
+  if (err)
+    return err;
+
+  it->store = store;
+  err = pack_iterator_settle (pit);
+  if (err)
+    chop_object_destroy ((chop_object_t *) it);
+
+  return err;
+}
+
+static chop_error_t
+chop_pack_next_block (chop_block_iterator_t *it)
+{
+  chop_pack_block_iterator_t *pit = (chop_pack_block_iterator_t *) it;
+
+  pit->entry++;
+
+  return pack_iterator_settle (pit);
+}
+
+static chop_error_t
+chop_pack_sync (chop_block_store_t *store)
+{
+  chop_error_t err = 0;
+  chop_pack_block_store_t *pack =
+    (chop_pack_block_store_t *) store;
+
+  if (pack->open_fd >= 0)
+    {
+      err = open_pack_flush (pack);
+      if ((!err) && (fdatasync (pack->open_fd)))
+	err = errno;
+    }
+
+  if ((!err) && (pack->unsynced_directory))
+    err = pack_sync_directory (pack);
+
+  return err;
+}
+
+static chop_error_t
+chop_pack_close (chop_block_store_t *store)
+{
+  chop_error_t err = 0;
+  chop_pack_block_store_t *pack =
+    (chop_pack_block_store_t *) store;
+  size_t i;
+
+  if (pack->open_fd >= 0)
+    {
+      /* Seal the last pack, even if it is small, so that the next user
+	 need not recover it.  */
+      err = open_pack_seal (pack);
+      if (err)
+	{
+	  close (pack->open_fd);
+	  pack->open_fd = -1;
+	}
+    }
+
+  for (i = 0; i < pack->pack_count; i++)
+    sealed_pack_unmap (&pack->packs[i]);
+
+  chop_free (pack->packs, (chop_class_t *) &chop_pack_block_store_class);
+  chop_free (pack->entries, (chop_class_t *) &chop_pack_block_store_class);
+  chop_free (pack->table, (chop_class_t *) &chop_pack_block_store_class);
+  chop_buffer_return (&pack->keys);
+  chop_buffer_return (&pack->pending);
+  pack->packs = NULL;
+  pack->entries = NULL;
+  pack->table = NULL;
+  pack->pack_count = pack->packs_allocated = 0;
+  pack->entry_count = pack->entries_allocated = pack->table_size = 0;
+
+  if (pack->eventually_close && pack->dir_fd >= 0)
+    close (pack->dir_fd);
+
+  pack->dir_fd = -1;
+
+  return err;
+}
+
+
+/* Map the sealed packs found in PACK's directory, and recover those that
+   have no index.  */
+static chop_error_t
+pack_load (chop_pack_block_store_t *pack)
+{
+  chop_error_t err;
+  unsigned *numbers;
+  size_t count, i;
+
+  err = store_numbered_files (pack->dir_fd, "pack-", ".pack",
+			      (chop_class_t *) &chop_pack_block_store_class,
+			      &numbers, &count);
+  if (err)
+    return err;
+
+  for (i = 0; (i < count) && (!err); i++)
+    {
+      char name[32];
+
+      pack->next_number = numbers[i] + 1;
+
+      pack_file_name (name, numbers[i], "idx");
+      if (faccessat (pack->dir_fd, name, F_OK, 0) == 0)
+	{
+	  if (pack->pack_count >= pack->packs_allocated)
+	    {
+	      size_t allocated = pack->packs_allocated
+		? 2 * pack->packs_allocated : 16;
+	      sealed_pack_t *packs;
+
+	      packs = chop_realloc (pack->packs, allocated * sizeof (*packs),
+				    (chop_class_t *)
+				    &chop_pack_block_store_class);
+	      if (packs == NULL)
+		{
+		  err = ENOMEM;
+		  break;
+		}
+
+	      pack->packs = packs;
+	      pack->packs_allocated = allocated;
+	    }
+
+	  err = sealed_pack_map (pack->dir_fd, numbers[i],
+				 &pack->packs[pack->pack_count]);
+	  if (!err)
+	    pack->pack_count++;
+	}
+      else if (errno == ENOENT)
+	err = open_pack_recover (pack, numbers[i]);
+      else
+	err = errno;
+    }
+
+  chop_free (numbers, (chop_class_t *) &chop_pack_block_store_class);
+
+  return err;
+}
+
+chop_error_t
+chop_pack_store_open (int dir_fd, int eventually_close, size_t pack_size,
+		      chop_block_store_t *store)
+{
+  chop_error_t err;
+  char *log_name;
+  chop_pack_block_store_t *pack =
+    (chop_pack_block_store_t *) store;
+
+  log_name = alloca (12);
+  snprintf (log_name, 12, "pack/%i", dir_fd);
+
+  err = chop_object_initialize ((chop_object_t *) store,
+				(chop_class_t *) &chop_pack_block_store_class);
+  if (err)
+    return err;
+
+  store->name = chop_strdup (log_name,
+			     (chop_class_t *) &chop_pack_block_store_class);
+  store->iterator_class = &chop_pack_block_iterator_class;
+  store->blocks_exist = chop_pack_blocks_exist;
+  store->read_block = chop_pack_read_block;
+  store->write_block = chop_pack_write_block;
+  store->delete_block = NULL;
+  store->first_block = chop_pack_first_block;
+  store->close = chop_pack_close;
+  store->sync = chop_pack_sync;
+
+  pack->dir_fd = dir_fd;
+  pack->eventually_close = eventually_close;
+  pack->pack_size = pack_size ? pack_size : PACK_DEFAULT_SIZE;
+  pack->unsynced_directory = false;
+  pack->packs = NULL;
+  pack->pack_count = pack->packs_allocated = 0;
+  pack->next_number = 0;
+  pack->entries = NULL;
+  pack->entries_allocated = 0;
+  pack->table = NULL;
+  pack->table_size = 0;
+
+  err = chop_buffer_init (&pack->keys, 0);
+  if (!err)
+    {
+      err = chop_buffer_init (&pack->pending, 0);
+      if (err)
+	chop_buffer_return (&pack->keys);
+    }
+  if (err)
+    {
+      if (eventually_close)
+	close (dir_fd);
+      pack->dir_fd = -1;
+      chop_object_destroy ((chop_object_t *) store);
+      return err;
+    }
+
+  open_pack_reset (pack);
+
+  err = pack_load (pack);
+  if (err)
+    chop_object_destroy ((chop_object_t *) store);
+
+  return err;
+}
@@ -17,16 +17,56 @@
 
 /* A `smart' block store that only writes a block if it does not already
    exist on the proxied store.  This is typically useful as a proxy to remote
-   block stores.  */
+   block stores.
+
+   The keys of blocks known to exist on the proxied store are kept in memory,
+   so that each block is looked up on the proxied store at most once.
+   Optionally, a Bloom filter of the keys written, stored in a file, tells
+   which blocks are definitely not on the proxied store, sparing the lookup
+   altogether.  */
 
 #include <chop/chop-config.h>
 
 #include <chop/chop.h>
 #include <chop/stores.h>
 #include <chop/buffers.h>
+#include <alloca.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+
+#include "store-common.h"
+
+
+/* Bloom filters.  */
+
+#define BLOOM_MAGIC  "libchop-bloom-1"
+
+/* The header of a Bloom filter file, followed by BIT_COUNT bits.  */
+typedef struct
+{
+  char     magic[16];
+  uint32_t hash_count;
+  uint32_t reserved;
+  uint64_t bit_count;
+} bloom_header_t;
+
+/* A Bloom filter mapped in memory.  */
+typedef struct
+{
+  int             fd;
+  size_t          map_size;
+  bloom_header_t *header;
+  unsigned char  *bits;
+} bloom_filter_t;
 
 
 /* Class definition.  */
@@ -34,7 +74,35 @@
 CHOP_DECLARE_RT_CLASS (smart_block_store, block_store,
 		       chop_log_t log;
 		       chop_proxy_semantics_t backend_ps;
-		       chop_block_store_t *backend;);
+		       chop_block_store_t *backend;
+
+		       /* The set of keys known to exist on BACKEND: an
+			  open-addressing hash table of offsets plus one in
+			  KEYS, where each key is preceded by its size */
+		       size_t *known;
+		       size_t known_size;
+		       size_t known_count;
+		       chop_buffer_t keys;
+
+		       /* Keys written to BACKEND, or NULL */
+		       bloom_filter_t *bloom;);
+
+static void bloom_filter_close (bloom_filter_t *bloom);
+
+static chop_error_t
+sbs_ctor (chop_object_t *object, const chop_class_t *class)
+{
+  chop_smart_block_store_t *smart =
+    (chop_smart_block_store_t *) object;
+
+  smart->backend = NULL;
+  smart->known = NULL;
+  smart->known_size = smart->known_count = 0;
+  smart->bloom = NULL;
+  chop_buffer_init (&smart->keys, 0);
+
+  return chop_log_init ("smart-block-store", &smart->log);
+}
 
 static void
 sbs_dtor (chop_object_t *object)
@@ -66,24 +134,375 @@ sbs_dtor (chop_object_t *object)
       }
 
   smart->backend = NULL;
+
+  chop_free (smart->known, &chop_smart_block_store_class);
+  smart->known = NULL;
+  smart->known_size = smart->known_count = 0;
+  chop_buffer_return (&smart->keys);
+
+  if (smart->bloom != NULL)
+    bloom_filter_close (smart->bloom);
+  smart->bloom = NULL;
+
+  chop_object_destroy ((chop_object_t *) &smart->log);
 }
 
 CHOP_DEFINE_RT_CLASS (smart_block_store, block_store,
-		      NULL, sbs_dtor, /* No constructor */
+		      sbs_ctor, sbs_dtor,
 		      NULL, NULL, /* No copy/equalp */
 		      NULL, NULL  /* No serializer/deserializer */);
 
+
+/* Keys.  */
+
+static inline uint64_t
+hash_key (const chop_block_key_t *key)
+{
+  return store_hash_key (chop_block_key_buffer (key),
+			 chop_block_key_size (key));
+}
+
+/* Return the slot of KEY, whose hash is HASH, in SMART's set of known keys,
+   or the empty slot where it would go.  */
+static size_t
+known_key_slot (const chop_smart_block_store_t *smart,
+		const chop_block_key_t *key, uint64_t hash)
+{
+  size_t slot, key_size = chop_block_key_size (key);
+
+  for (slot = hash & (smart->known_size - 1);
+       smart->known[slot] != 0;
+       slot = (slot + 1) & (smart->known_size - 1))
+    {
+      const char *entry;
+      size_t entry_size;
+
+      entry = chop_buffer_content (&smart->keys) + smart->known[slot] - 1;
+      memcpy (&entry_size, entry, sizeof (entry_size));
+      if ((entry_size == key_size)
+	  && (!memcmp (entry + sizeof (entry_size),
+		       chop_block_key_buffer (key), key_size)))
+	break;
+    }
+
+  return slot;
+}
+
+/* Return true if KEY is known to exist on SMART's backend.  */
+static inline bool
+known_key_p (const chop_smart_block_store_t *smart,
+	     const chop_block_key_t *key)
+{
+  if (smart->known_count == 0)
+    return false;
+
+  return (smart->known[known_key_slot (smart, key, hash_key (key))] != 0);
+}
+
+/* Record that KEY exists on SMART's backend.  */
+static chop_error_t
+known_key_add (chop_smart_block_store_t *smart, const chop_block_key_t *key)
+{
+  chop_error_t err;
+  size_t slot, key_size;
+
+  if (2 * (smart->known_count + 1) > smart->known_size)
+    {
+      /* Keep the table at most half full.  */
+      size_t i, *old = smart->known, old_size = smart->known_size;
+
+      smart->known_size = old_size ? 2 * old_size : 1024;
+      smart->known = chop_calloc (smart->known_size * sizeof (size_t),
+				  &chop_smart_block_store_class);
+      if (smart->known == NULL)
+	{
+	  smart->known = old;
+	  smart->known_size = old_size;
+	  return ENOMEM;
+	}
+
+      for (i = 0; i < old_size; i++)
+	if (old[i] != 0)
+	  {
+	    const char *entry = chop_buffer_content (&smart->keys) + old[i] - 1;
+	    chop_block_key_t old_key;
+
+	    memcpy (&key_size, entry, sizeof (key_size));
+	    chop_block_key_init (&old_key, (char *) entry + sizeof (key_size),
+				 key_size, NULL, NULL);
+	    smart->known[known_key_slot (smart, &old_key,
+					 hash_key (&old_key))] = old[i];
+	  }
+
+      chop_free (old, &chop_smart_block_store_class);
+    }
+
+  slot = known_key_slot (smart, key, hash_key (key));
+  if (smart->known[slot] != 0)
+    return 0;
+
+  key_size = chop_block_key_size (key);
+  smart->known[slot] = chop_buffer_size (&smart->keys) + 1;
+
+  err = chop_buffer_append (&smart->keys, (char *) &key_size,
+			    sizeof (key_size));
+  if (!err)
+    err = chop_buffer_append (&smart->keys, chop_block_key_buffer (key),
+			      key_size);
+  if (err)
+    smart->known[slot] = 0;
+  else
+    smart->known_count++;
+
+  return err;
+}
+
+/* Forget about KEY.  Its contents remain in SMART's key buffer.  */
+static void
+known_key_remove (chop_smart_block_store_t *smart,
+		  const chop_block_key_t *key)
+{
+  size_t slot, next;
+
+  if (smart->known_count == 0)
+    return;
+
+  slot = known_key_slot (smart, key, hash_key (key));
+  if (smart->known[slot] == 0)
+    return;
+
+  smart->known[slot] = 0;
+  smart->known_count--;
+
+  /* Move back the following entries of the cluster that would otherwise
+     no longer be found.  */
+  for (next = (slot + 1) & (smart->known_size - 1);
+       smart->known[next] != 0;
+       next = (next + 1) & (smart->known_size - 1))
+    {
+      const char *entry = chop_buffer_content (&smart->keys)
+	+ smart->known[next] - 1;
+      chop_block_key_t next_key;
+      size_t key_size, home;
+
+      memcpy (&key_size, entry, sizeof (key_size));
+      chop_block_key_init (&next_key, (char *) entry + sizeof (key_size),
+			   key_size, NULL, NULL);
+      home = hash_key (&next_key) & (smart->known_size - 1);
+
+      /* Leave the entry alone if its home slot lies cyclically in
+	 (SLOT, NEXT].  */
+      if ((slot <= next)
+	  ? ((slot < home) && (home <= next))
+	  : ((slot < home) || (home <= next)))
+	continue;
+
+      smart->known[slot] = smart->known[next];
+      smart->known[next] = 0;
+      slot = next;
+    }
+}
+
+
+/* Bloom filter operations.  */
+
+/* Evaluate BODY with BIT set to each of the bits of KEY in BLOOM, using
+   double hashing.  */
+#define bloom_for_each_bit(_bloom, _key, _bit, _body)			\
+  do									\
+    {									\
+      uint64_t _hash = hash_key (_key);					\
+      uint64_t _h1 = _hash & 0xffffffffULL, _h2 = (_hash >> 32) | 1;	\
+      uint32_t _i;							\
+									\
+      for (_i = 0; _i < (_bloom)->header->hash_count; _i++)		\
+	{								\
+	  uint64_t _bit = (_h1 + _i * _h2) % (_bloom)->header->bit_count; \
+	  _body;							\
+	}								\
+    }									\
+  while (0)
+
+/* Return false if KEY was definitely never added to BLOOM.  */
+static bool
+bloom_filter_may_contain (const bloom_filter_t *bloom,
+			  const chop_block_key_t *key)
+{
+  bloom_for_each_bit (bloom, key, bit,
+		      if (!(bloom->bits[bit / 8] & (1 << (bit % 8))))
+			return false);
+
+  return true;
+}
+
+static void
+bloom_filter_add (bloom_filter_t *bloom, const chop_block_key_t *key)
+{
+  bloom_for_each_bit (bloom, key, bit,
+		      bloom->bits[bit / 8] |= 1 << (bit % 8));
+}
+
+/* Open the Bloom filter in FILE_NAME, creating it with BIT_COUNT bits and
+   HASH_COUNT hash functions if it does not exist yet.  */
+static chop_error_t
+bloom_filter_open (const char *file_name, uint64_t bit_count,
+		   unsigned hash_count, bloom_filter_t **result)
+{
+  chop_error_t err = 0;
+  bloom_filter_t *bloom;
+  struct stat file_stats;
+  int fd, create;
+
+  fd = open (file_name, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+  if (fd < 0)
+    return errno;
+
+  /* Several processes updating the same file would lose bits.  */
+  if ((flock (fd, LOCK_EX | LOCK_NB)) || (fstat (fd, &file_stats)))
+    {
+      err = errno;
+      close (fd);
+      return err;
+    }
+
+  bloom = chop_malloc (sizeof (*bloom), &chop_smart_block_store_class);
+  if (bloom == NULL)
+    {
+      close (fd);
+      return ENOMEM;
+    }
+
+  create = (file_stats.st_size == 0);
+  if (create)
+    {
+      bloom->map_size = sizeof (bloom_header_t) + (bit_count + 7) / 8;
+      if (ftruncate (fd, bloom->map_size))
+	err = errno;
+    }
+  else if ((size_t) file_stats.st_size < sizeof (bloom_header_t))
+    err = CHOP_DESERIAL_CORRUPT_INPUT;
+  else
+    bloom->map_size = file_stats.st_size;
+
+  if (!err)
+    {
+      bloom->header = mmap (0, bloom->map_size, PROT_READ | PROT_WRITE,
+			    MAP_SHARED, fd, 0);
+      if (bloom->header == MAP_FAILED)
+	err = errno;
+    }
+
+  if (err)
+    {
+      chop_free (bloom, &chop_smart_block_store_class);
+      close (fd);
+      return err;
+    }
+
+  if (create)
+    {
+      /* The new file is filled with zeros, i.e., an empty set.  */
+      memcpy (bloom->header->magic, BLOOM_MAGIC, sizeof (BLOOM_MAGIC));
+      bloom->header->hash_count = hash_count;
+      bloom->header->bit_count = bit_count;
+    }
+  else if ((memcmp (bloom->header->magic, BLOOM_MAGIC, sizeof (BLOOM_MAGIC)))
+	   || (bloom->header->hash_count == 0)
+	   || (bloom->header->bit_count == 0)
+	   || (bloom->map_size != sizeof (bloom_header_t)
+	       + (bloom->header->bit_count + 7) / 8))
+    {
+      munmap (bloom->header, bloom->map_size);
+      chop_free (bloom, &chop_smart_block_store_class);
+      close (fd);
+      return CHOP_DESERIAL_CORRUPT_INPUT;
+    }
+
+  bloom->fd = fd;
+  bloom->bits = (unsigned char *) bloom->header + sizeof (bloom_header_t);
+
+  *result = bloom;
+
+  return 0;
+}
+
+static chop_error_t
+bloom_filter_sync (bloom_filter_t *bloom)
+{
+  return (msync (bloom->header, bloom->map_size, MS_SYNC) ? errno : 0);
+}
+
+static void
+bloom_filter_close (bloom_filter_t *bloom)
+{
+  munmap (bloom->header, bloom->map_size);
+  close (bloom->fd);
+  chop_free (bloom, &chop_smart_block_store_class);
+}
 
 
+/* The block store methods.  */
+
 static chop_error_t
 chop_smart_block_store_blocks_exist (chop_block_store_t *store,
 				     size_t n, const chop_block_key_t keys[n],
 				     bool exists[n])
 {
+  chop_error_t err = 0;
   chop_smart_block_store_t *smart =
     (chop_smart_block_store_t *)store;
+  chop_block_key_t *unknown_keys;
+  bool *unknown_exists;
+  size_t i, unknown;
+
+  /* Only ask BACKEND about the keys that are not known to exist.  */
+  for (i = 0, unknown = 0; i < n; i++)
+    {
+      exists[i] = known_key_p (smart, &keys[i]);
+      if (!exists[i])
+	unknown++;
+    }
+
+  if (unknown == 0)
+    return 0;
+  if (unknown == n)
+    {
+      unknown_keys = (chop_block_key_t *) keys;
+      unknown_exists = exists;
+    }
+  else
+    {
+      unknown_keys = chop_malloc (unknown * (sizeof (*unknown_keys)
+					     + sizeof (*unknown_exists)),
+				  &chop_smart_block_store_class);
+      if (unknown_keys == NULL)
+	return ENOMEM;
+
+      unknown_exists = (bool *) (unknown_keys + unknown);
+      for (i = 0, unknown = 0; i < n; i++)
+	if (!exists[i])
+	  unknown_keys[unknown++] = keys[i];
+    }
+
+  err = chop_store_blocks_exist (smart->backend, unknown, unknown_keys,
+				 unknown_exists);
+
+  for (i = 0; (i < unknown) && (!err); i++)
+    if (unknown_exists[i])
+      err = known_key_add (smart, &unknown_keys[i]);
+
+  if (unknown_keys != keys)
+    {
+      size_t j;
+
+      for (i = 0, j = 0; (i < n) && (!err); i++)
+	if (!exists[i])
+	  exists[i] = unknown_exists[j++];
 
-  return chop_store_blocks_exist (smart->backend, n, keys, exists);
+      chop_free (unknown_keys, &chop_smart_block_store_class);
+    }
+
+  return err;
 }
 
 static chop_error_t
@@ -110,24 +529,49 @@ chop_smart_block_store_write_block (chop_block_store_t *store,
 {
   chop_error_t err;
   int exists = 0;
-  char hex_key[1024];
   chop_smart_block_store_t *smart =
     (chop_smart_block_store_t *)store;
 
-  chop_block_key_to_hex_string (key, hex_key);
-  chop_log_printf (&smart->log,
-		   "smart: write_block (%s@%p, 0x%s,\n"
-		   "                    %p, %zu)\n",
-		   store->name, store, hex_key, block, size);
-
-  err = chop_store_block_exists (smart->backend, key, &exists);
-  if (err)
-    return err;
+  if (chop_log_attached (&smart->log))
+    {
+      char *hex_key;
+
+      hex_key = alloca (chop_block_key_size (key) * 2 + 1);
+      chop_block_key_to_hex_string (key, hex_key);
+      chop_log_printf (&smart->log,
+		       "smart: write_block (%s@%p, 0x%s,\n"
+		       "                    %p, %zu)\n",
+		       store->name, store, hex_key, block, size);
+    }
+
+  if (known_key_p (smart, key))
+    exists = 1;
+  else if ((smart->bloom != NULL)
+	   && (!bloom_filter_may_contain (smart->bloom, key)))
+    /* The block was never written through a smart store using this Bloom
+       filter, so don't bother asking BACKEND.  */
+    exists = 0;
+  else
+    {
+      err = chop_store_block_exists (smart->backend, key, &exists);
+      if (err)
+	return err;
+    }
 
   if (!exists)
-    err = chop_store_write_block (smart->backend, key, block, size);
+    {
+      err = chop_store_write_block (smart->backend, key, block, size);
+      if ((!err) && (smart->bloom != NULL))
+	bloom_filter_add (smart->bloom, key);
+    }
   else
-    chop_log_printf (&smart->log, "smart: block not actually written");
+    {
+      err = 0;
+      chop_log_printf (&smart->log, "smart: block not actually written");
+    }
+
+  if (!err)
+    err = known_key_add (smart, key);
 
   return err;
 }
@@ -141,6 +585,8 @@ chop_smart_block_store_delete_block (chop_block_store_t *store,
     (chop_smart_block_store_t *)store;
 
   err = chop_store_delete_block (smart->backend, key);
+  if (!err)
+    known_key_remove (smart, key);
 
   return err;
 }
@@ -167,6 +613,8 @@ chop_smart_block_store_sync (chop_block_store_t *store)
     (chop_smart_block_store_t *)store;
 
   err = chop_store_sync (smart->backend);
+  if ((!err) && (smart->bloom != NULL))
+    err = bloom_filter_sync (smart->bloom);
 
   return err;
 }
@@ -200,14 +648,12 @@ chop_smart_block_store_open (chop_block_store_t *backend,
   if (!backend)
     return CHOP_INVALID_ARG;
 
-  chop_object_initialize ((chop_object_t *) store,
-			  &chop_smart_block_store_class);
-
-  err = chop_log_init ("smart-block-store", &smart->log);
+  err = chop_object_initialize ((chop_object_t *) store,
+				&chop_smart_block_store_class);
   if (err)
     return err;
 
-  store->iterator_class = chop_store_iterator_class (store);
+  store->iterator_class = chop_store_iterator_class (backend);
   store->blocks_exist = chop_smart_block_store_blocks_exist;
   store->read_block = chop_smart_block_store_read_block;
   store->write_block = chop_smart_block_store_write_block;
@@ -222,6 +668,66 @@ chop_smart_block_store_open (chop_block_store_t *backend,
   return 0;
 }
 
+chop_error_t
+chop_smart_block_store_seed (chop_block_store_t *store)
+{
+  chop_error_t err;
+  chop_smart_block_store_t *smart =
+    (chop_smart_block_store_t *)store;
+  const chop_class_t *it_class;
+  chop_block_iterator_t *it;
+
+  it_class = chop_store_iterator_class (smart->backend);
+  if (it_class == NULL)
+    return CHOP_ERR_NOT_IMPL;
+
+  it = chop_class_alloca_instance (it_class);
+  err = chop_store_first_block (smart->backend, it);
+  if (err)
+    return (err == CHOP_STORE_END) ? 0 : err;
+
+  do
+    {
+      err = known_key_add (smart, chop_block_iterator_key (it));
+      if ((!err) && (smart->bloom != NULL))
+	bloom_filter_add (smart->bloom, chop_block_iterator_key (it));
+      if (!err)
+	err = chop_block_iterator_next (it);
+    }
+  while (!err);
+
+  chop_object_destroy ((chop_object_t *) it);
+
+  return (err == CHOP_STORE_END) ? 0 : err;
+}
+
+chop_error_t
+chop_smart_block_store_open_bloom_filter (chop_block_store_t *store,
+					  const char *file_name,
+					  size_t expected_blocks)
+{
+  chop_error_t err;
+  chop_smart_block_store_t *smart =
+    (chop_smart_block_store_t *)store;
+  bloom_filter_t *bloom = NULL;
+
+  if (expected_blocks == 0)
+    return CHOP_INVALID_ARG;
+
+  /* Ten bits and seven hash functions per block give a false positive
+     rate below 1%.  */
+  err = bloom_filter_open (file_name, (uint64_t) expected_blocks * 10, 7,
+			   &bloom);
+  if (err)
+    return err;
+
+  if (smart->bloom != NULL)
+    bloom_filter_close (smart->bloom);
+  smart->bloom = bloom;
+
+  return 0;
+}
+
 chop_log_t *
 chop_smart_block_store_log (chop_block_store_t *store)
 {
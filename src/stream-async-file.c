@@ -0,0 +1,822 @@
+/* libchop -- a utility library for distributed storage and data backup
+   Copyright (C) 2026  Ludovic Courtès <ludo@gnu.org>
+
+   Libchop is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Libchop is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with libchop.  If not, see <http://www.gnu.org/licenses/>.  */
+
+/* A file stream that reads ahead asynchronously.
+
+   The stream has a ring of QUEUE_DEPTH buffers (or "slots") of READ_SIZE
+   bytes each.  Each slot is filled by a read request for the next
+   READ_SIZE bytes of the file, so that up to QUEUE_DEPTH reads are in
+   flight while the user of the stream (typically a chopper) processes
+   data.  A slot is resubmitted as soon as its data has been consumed.
+
+   Read requests are handled either by io_uring, on GNU/Linux, or by a
+   thread that reads the requested slots in order.  The latter also
+   handles non-seekable files such as pipes, using read(2).  */
+
+#include <chop/chop-config.h>
+
+#include <chop/chop.h>
+#include <chop/streams.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef HAVE_PTHREAD_H
+# include <pthread.h>
+#endif
+
+#ifdef HAVE_LINUX_IO_URING_H
+# include <linux/io_uring.h>
+# include <sys/mman.h>
+# include <sys/syscall.h>
+# if (defined __NR_io_uring_setup) && (defined __NR_io_uring_enter)
+#  define USE_IO_URING 1
+# endif
+#endif
+
+
+/* Default parameters.  */
+#define DEFAULT_QUEUE_DEPTH  4
+#define DEFAULT_READ_SIZE    (1024U * 1024U)
+
+
+/* States of a read slot.  */
+typedef enum
+  {
+    SLOT_IDLE = 0,
+    SLOT_PENDING,
+    SLOT_DONE
+  } slot_state_t;
+
+/* A read request and the buffer it fills.  */
+typedef struct
+{
+  char        *buffer;
+  struct iovec iovec;
+  off_t        offset;
+
+  /* When STATE is SLOT_DONE, the number of bytes read, or minus an errno
+     value.  */
+  ssize_t      result;
+  slot_state_t state;
+} read_slot_t;
+
+/* Back-ends that handle read requests.  */
+typedef enum
+  {
+    BACKEND_THREAD = 0,
+    BACKEND_IO_URING
+  } backend_t;
+
+static const char *const backend_names[] = { "thread", "io_uring" };
+
+#ifdef USE_IO_URING
+
+/* The memory shared with the kernel for an io_uring instance.  */
+typedef struct
+{
+  int fd;
+
+  void  *sq_ring;
+  size_t sq_ring_size;
+  void  *cq_ring;
+  size_t cq_ring_size;
+  struct io_uring_sqe *sqes;
+  size_t sqes_size;
+
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_cqe *cqes;
+} ring_t;
+
+#endif
+
+
+CHOP_DECLARE_RT_CLASS (async_file_stream, stream,
+		       int    fd;
+		       int    eventually_close;
+		       int    seekable;
+		       backend_t backend;
+
+		       size_t queue_depth;
+		       size_t read_size;
+		       read_slot_t *slots;
+
+		       /* The slot being consumed and the position within
+			  it, and the offset of the next read to submit.  */
+		       size_t current;
+		       size_t position;
+		       off_t  next_offset;
+
+		       /* True when a short read has been submitted or
+			  completed, i.e., the end of file has been
+			  reached.  */
+		       int    end_of_file;
+
+#ifdef USE_IO_URING
+		       ring_t ring;
+#endif
+
+#ifdef HAVE_PTHREAD_H
+		       pthread_t thread;
+		       pthread_mutex_t lock;
+		       pthread_cond_t cond;
+		       int    thread_spawned;
+		       int    stopping;
+#endif
+		       );
+
+/* Note that the destructor of class `stream' calls `chop_stream_close ()',
+   so we don't need to define our own destructor.  */
+CHOP_DEFINE_RT_CLASS (async_file_stream, stream,
+		      NULL, NULL,
+		      NULL, NULL, /* No copy/equalp */
+		      NULL, NULL  /* No serializer/deserializer */);
+
+
+/* The back-end used by newly opened streams.  */
+#ifdef USE_IO_URING
+static backend_t default_backend = BACKEND_IO_URING;
+#else
+static backend_t default_backend = BACKEND_THREAD;
+#endif
+
+
+static void chop_async_file_stream_close (chop_stream_t *);
+static chop_error_t chop_async_file_stream_read (chop_stream_t *,
+						 char *, size_t, size_t *);
+static chop_error_t chop_async_file_stream_peek (chop_stream_t *,
+						 const char **, size_t *);
+static void chop_async_file_stream_consume (chop_stream_t *, size_t);
+
+
+
+/* Reading.  */
+
+/* Fill SLOT's buffer, starting at byte START of it, synchronously.  Return
+   the total number of bytes in the buffer, or minus an errno value if
+   nothing could be read.  */
+static ssize_t
+read_slot (const chop_async_file_stream_t *stream, read_slot_t *slot,
+	   size_t start)
+{
+  size_t total = start;
+
+  while (total < stream->read_size)
+    {
+      ssize_t result;
+
+      if (stream->seekable)
+	result = pread (stream->fd, slot->buffer + total,
+			stream->read_size - total, slot->offset + total);
+      else
+	result = read (stream->fd, slot->buffer + total,
+		       stream->read_size - total);
+
+      if (result < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+
+	  return ((total > 0) ? (ssize_t) total : -errno);
+	}
+
+      if (result == 0)
+	break;
+
+      total += result;
+    }
+
+  return total;
+}
+
+
+#ifdef HAVE_PTHREAD_H
+
+/* Handle the read requests of the stream at DATA, in order.  */
+static void *
+read_thread (void *data)
+{
+  chop_async_file_stream_t *stream = (chop_async_file_stream_t *) data;
+  size_t next = 0;
+
+  pthread_mutex_lock (&stream->lock);
+
+  while (1)
+    {
+      read_slot_t *slot = &stream->slots[next];
+      ssize_t result;
+
+      while ((!stream->stopping) && (slot->state != SLOT_PENDING))
+	pthread_cond_wait (&stream->cond, &stream->lock);
+
+      if (stream->stopping)
+	break;
+
+      pthread_mutex_unlock (&stream->lock);
+      result = read_slot (stream, slot, 0);
+      pthread_mutex_lock (&stream->lock);
+
+      slot->result = result;
+      slot->state = SLOT_DONE;
+      pthread_cond_broadcast (&stream->cond);
+
+      next = (next + 1) % stream->queue_depth;
+    }
+
+  pthread_mutex_unlock (&stream->lock);
+
+  return NULL;
+}
+
+#endif
+
+
+#ifdef USE_IO_URING
+
+/* Set up STREAM's io_uring.  Return zero on success.  */
+static chop_error_t
+ring_open (chop_async_file_stream_t *stream)
+{
+  struct io_uring_params params;
+  ring_t *ring = &stream->ring;
+  char *sq, *cq;
+  int single_mmap = 0;
+
+  memset (&params, 0, sizeof (params));
+  memset (ring, 0, sizeof (*ring));
+
+  ring->fd = syscall (__NR_io_uring_setup, stream->queue_depth, &params);
+  if (ring->fd < 0)
+    {
+      ring->fd = -1;
+      return errno;
+    }
+
+  ring->sq_ring_size = params.sq_off.array
+    + params.sq_entries * sizeof (unsigned);
+  ring->cq_ring_size = params.cq_off.cqes
+    + params.cq_entries * sizeof (struct io_uring_cqe);
+  ring->sqes_size = params.sq_entries * sizeof (struct io_uring_sqe);
+
+#ifdef IORING_FEAT_SINGLE_MMAP
+  if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+      single_mmap = 1;
+      if (ring->cq_ring_size > ring->sq_ring_size)
+	ring->sq_ring_size = ring->cq_ring_size;
+      ring->cq_ring_size = ring->sq_ring_size;
+    }
+#endif
+
+  ring->sq_ring = mmap (0, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd,
+			IORING_OFF_SQ_RING);
+  if (ring->sq_ring == MAP_FAILED)
+    goto failed;
+
+  if (single_mmap)
+    ring->cq_ring = ring->sq_ring;
+  else
+    {
+      ring->cq_ring = mmap (0, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+			    MAP_SHARED | MAP_POPULATE, ring->fd,
+			    IORING_OFF_CQ_RING);
+      if (ring->cq_ring == MAP_FAILED)
+	{
+	  munmap (ring->sq_ring, ring->sq_ring_size);
+	  goto failed;
+	}
+    }
+
+  ring->sqes = mmap (0, ring->sqes_size, PROT_READ | PROT_WRITE,
+		     MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED)
+    {
+      if (!single_mmap)
+	munmap (ring->cq_ring, ring->cq_ring_size);
+      munmap (ring->sq_ring, ring->sq_ring_size);
+      goto failed;
+    }
+
+  sq = (char *) ring->sq_ring;
+  cq = (char *) ring->cq_ring;
+  ring->sq_tail = (unsigned *) (sq + params.sq_off.tail);
+  ring->sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned *) (sq + params.sq_off.array);
+  ring->cq_head = (unsigned *) (cq + params.cq_off.head);
+  ring->cq_tail = (unsigned *) (cq + params.cq_off.tail);
+  ring->cq_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+
+  return 0;
+
+ failed:
+  close (ring->fd);
+  ring->fd = -1;
+  return ENOMEM;
+}
+
+/* Record the completion of all the read requests of STREAM that have
+   completed so far.  */
+static void
+ring_reap (chop_async_file_stream_t *stream)
+{
+  ring_t *ring = &stream->ring;
+  unsigned head, tail;
+
+  head = *ring->cq_head;
+  tail = __atomic_load_n (ring->cq_tail, __ATOMIC_ACQUIRE);
+
+  for (; head != tail; head++)
+    {
+      const struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+      read_slot_t *slot = &stream->slots[cqe->user_data];
+
+      if (cqe->res < 0)
+	/* The request failed, for instance because the file system does
+	   not support it: read synchronously instead.  */
+	slot->result = read_slot (stream, slot, 0);
+      else if ((size_t) cqe->res < stream->read_size)
+	/* Complete short reads synchronously.  */
+	slot->result = read_slot (stream, slot, cqe->res);
+      else
+	slot->result = cqe->res;
+
+      slot->state = SLOT_DONE;
+    }
+
+  __atomic_store_n (ring->cq_head, head, __ATOMIC_RELEASE);
+}
+
+/* Wait until at least one read request of STREAM completes.  */
+static void
+ring_wait (chop_async_file_stream_t *stream)
+{
+  while (syscall (__NR_io_uring_enter, stream->ring.fd, 0, 1,
+		  IORING_ENTER_GETEVENTS, NULL, 0) < 0
+	 && errno == EINTR);
+
+  ring_reap (stream);
+}
+
+/* Submit the read request of SLOT, whose index is INDEX.  Return zero on
+   success.  */
+static chop_error_t
+ring_submit (chop_async_file_stream_t *stream, read_slot_t *slot,
+	     size_t index)
+{
+  ring_t *ring = &stream->ring;
+  struct io_uring_sqe *sqe;
+  unsigned tail, sqe_index;
+  long result;
+
+  tail = *ring->sq_tail;
+  sqe_index = tail & *ring->sq_mask;
+  sqe = &ring->sqes[sqe_index];
+
+  /* `IORING_OP_READV' is available since Linux 5.1, unlike
+     `IORING_OP_READ'.  */
+  memset (sqe, 0, sizeof (*sqe));
+  sqe->opcode = IORING_OP_READV;
+  sqe->fd = stream->fd;
+  sqe->off = slot->offset;
+  sqe->addr = (uintptr_t) &slot->iovec;
+  sqe->len = 1;
+  sqe->user_data = index;
+
+  ring->sq_array[sqe_index] = sqe_index;
+  __atomic_store_n (ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+  do
+    result = syscall (__NR_io_uring_enter, ring->fd, 1, 0, 0, NULL, 0);
+  while ((result < 0) && (errno == EINTR));
+
+  if (result != 1)
+    {
+      /* Take the request back.  */
+      __atomic_store_n (ring->sq_tail, tail, __ATOMIC_RELEASE);
+      return ((result < 0) ? errno : EAGAIN);
+    }
+
+  return 0;
+}
+
+static void
+ring_close (chop_async_file_stream_t *stream)
+{
+  ring_t *ring = &stream->ring;
+  size_t i;
+
+  if (ring->fd < 0)
+    return;
+
+  /* Wait for pending requests, which write to our buffers.  */
+  for (i = 0; i < stream->queue_depth; i++)
+    while (stream->slots[i].state == SLOT_PENDING)
+      ring_wait (stream);
+
+  munmap (ring->sqes, ring->sqes_size);
+  if (ring->cq_ring != ring->sq_ring)
+    munmap (ring->cq_ring, ring->cq_ring_size);
+  munmap (ring->sq_ring, ring->sq_ring_size);
+  close (ring->fd);
+
+  ring->fd = -1;
+}
+
+#endif
+
+
+/* Submit a read request for the next READ_SIZE bytes of STREAM's file
+   using slot number INDEX.  */
+static void
+submit_slot (chop_async_file_stream_t *stream, size_t index)
+{
+  read_slot_t *slot = &stream->slots[index];
+
+  slot->offset = stream->next_offset;
+  slot->result = 0;
+  stream->next_offset += stream->read_size;
+
+  switch (stream->backend)
+    {
+#ifdef USE_IO_URING
+    case BACKEND_IO_URING:
+      slot->state = SLOT_PENDING;
+      if (ring_submit (stream, slot, index) == 0)
+	return;
+      break;
+#endif
+
+#ifdef HAVE_PTHREAD_H
+    case BACKEND_THREAD:
+      if (stream->thread_spawned)
+	{
+	  pthread_mutex_lock (&stream->lock);
+	  slot->state = SLOT_PENDING;
+	  pthread_cond_broadcast (&stream->cond);
+	  pthread_mutex_unlock (&stream->lock);
+	  return;
+	}
+      break;
+#endif
+
+    default:
+      break;
+    }
+
+  /* Read synchronously.  */
+  slot->result = read_slot (stream, slot, 0);
+  slot->state = SLOT_DONE;
+}
+
+/* Wait for the current slot of STREAM to be filled and return it.  */
+static read_slot_t *
+wait_for_current_slot (chop_async_file_stream_t *stream)
+{
+  read_slot_t *slot = &stream->slots[stream->current];
+
+  switch (stream->backend)
+    {
+#ifdef USE_IO_URING
+    case BACKEND_IO_URING:
+      while (slot->state == SLOT_PENDING)
+	ring_wait (stream);
+      break;
+#endif
+
+#ifdef HAVE_PTHREAD_H
+    case BACKEND_THREAD:
+      pthread_mutex_lock (&stream->lock);
+      while (slot->state != SLOT_DONE)
+	pthread_cond_wait (&stream->cond, &stream->lock);
+      pthread_mutex_unlock (&stream->lock);
+      break;
+#endif
+
+    default:
+      break;
+    }
+
+  return slot;
+}
+
+/* Return in *DATA and *SIZE the bytes of STREAM's current slot that have
+   not been consumed, waiting for them as needed.  */
+static chop_error_t
+current_data (chop_async_file_stream_t *stream,
+	      const char **data, size_t *size)
+{
+  read_slot_t *slot;
+
+  *size = 0;
+
+  while (1)
+    {
+      slot = wait_for_current_slot (stream);
+
+      if (slot->result < 0)
+	return (-slot->result);
+
+      if (stream->position < (size_t) slot->result)
+	break;
+
+      if ((size_t) slot->result < stream->read_size)
+	{
+	  /* This is a short read, so we've reached the end of file.  */
+	  stream->end_of_file = 1;
+	  return CHOP_STREAM_END;
+	}
+
+      /* Move on to the next slot and reuse this one.  */
+      if (!stream->end_of_file)
+	submit_slot (stream, stream->current);
+
+      stream->current = (stream->current + 1) % stream->queue_depth;
+      stream->position = 0;
+    }
+
+  *data = slot->buffer + stream->position;
+  *size = slot->result - stream->position;
+
+  return 0;
+}
+
+static chop_error_t
+chop_async_file_stream_peek (chop_stream_t *raw_stream,
+			     const char **data, size_t *size)
+{
+  return (current_data ((chop_async_file_stream_t *) raw_stream,
+			data, size));
+}
+
+static void
+chop_async_file_stream_consume (chop_stream_t *raw_stream, size_t size)
+{
+  chop_async_file_stream_t *stream = (chop_async_file_stream_t *) raw_stream;
+
+  stream->position += size;
+}
+
+static chop_error_t
+chop_async_file_stream_read (chop_stream_t *raw_stream,
+			     char *buffer, size_t howmuch, size_t *read)
+{
+  chop_error_t err;
+  const char *data;
+  size_t available;
+  chop_async_file_stream_t *stream = (chop_async_file_stream_t *) raw_stream;
+
+  *read = 0;
+  while (*read < howmuch)
+    {
+      err = current_data (stream, &data, &available);
+      if (err)
+	{
+	  if (*read > 0)
+	    /* Report it next time.  */
+	    break;
+
+	  return err;
+	}
+
+      if (available > howmuch - *read)
+	available = howmuch - *read;
+
+      memcpy (buffer + *read, data, available);
+      stream->position += available;
+      *read += available;
+    }
+
+  return 0;
+}
+
+
+
+/* Opening and closing.  */
+
+static chop_error_t
+async_file_stream_open (int fd, int eventually_close,
+			size_t queue_depth, size_t read_size,
+			const char *name,
+			chop_async_file_stream_t *stream)
+{
+  chop_error_t err;
+  struct stat file_stats;
+  size_t i;
+
+  if (fstat (fd, &file_stats))
+    return errno;
+
+  if (queue_depth == 0)
+    queue_depth = DEFAULT_QUEUE_DEPTH;
+  if (read_size == 0)
+    read_size = DEFAULT_READ_SIZE;
+
+  err = chop_object_initialize ((chop_object_t *) stream,
+				&chop_async_file_stream_class);
+  if (err)
+    return err;
+
+  stream->fd = fd;
+  stream->eventually_close = 0;
+  stream->queue_depth = queue_depth;
+  stream->read_size = read_size;
+  stream->current = stream->position = 0;
+  stream->end_of_file = 0;
+
+  stream->next_offset = lseek (fd, 0, SEEK_CUR);
+  stream->seekable = (stream->next_offset != (off_t) -1);
+  if (!stream->seekable)
+    stream->next_offset = 0;
+
+  /* io_uring is only used for seekable files since requests for the
+     current file position may complete out of order.  */
+  stream->backend = stream->seekable ? default_backend : BACKEND_THREAD;
+
+#ifdef USE_IO_URING
+  stream->ring.fd = -1;
+#endif
+#ifdef HAVE_PTHREAD_H
+  stream->thread_spawned = stream->stopping = 0;
+  pthread_mutex_init (&stream->lock, NULL);
+  pthread_cond_init (&stream->cond, NULL);
+#endif
+
+  stream->stream.preferred_block_size = file_stats.st_blksize;
+  stream->stream.close = chop_async_file_stream_close;
+  stream->stream.read = chop_async_file_stream_read;
+  stream->stream.peek = chop_async_file_stream_peek;
+  stream->stream.consume = chop_async_file_stream_consume;
+  stream->stream.name = chop_strdup (name, &chop_async_file_stream_class);
+
+  stream->slots = chop_calloc (queue_depth * sizeof (read_slot_t),
+			       &chop_async_file_stream_class);
+  if (stream->slots == NULL)
+    {
+      chop_object_destroy ((chop_object_t *) stream);
+      return ENOMEM;
+    }
+
+  for (i = 0; i < queue_depth; i++)
+    {
+      stream->slots[i].buffer = chop_malloc (read_size,
+					     &chop_async_file_stream_class);
+      if (stream->slots[i].buffer == NULL)
+	{
+	  chop_object_destroy ((chop_object_t *) stream);
+	  return ENOMEM;
+	}
+
+      stream->slots[i].iovec.iov_base = stream->slots[i].buffer;
+      stream->slots[i].iovec.iov_len = read_size;
+    }
+
+#ifdef USE_IO_URING
+  if ((stream->backend == BACKEND_IO_URING) && (ring_open (stream)))
+    /* The kernel doesn't support it, or we're not allowed to use it.  */
+    stream->backend = BACKEND_THREAD;
+#endif
+
+#ifdef HAVE_PTHREAD_H
+  if (stream->backend == BACKEND_THREAD)
+    /* When the thread cannot be created, reads are synchronous.  */
+    stream->thread_spawned =
+      (pthread_create (&stream->thread, NULL, read_thread, stream) == 0);
+#endif
+
+  /* FD is ours from now on.  */
+  stream->eventually_close = eventually_close;
+
+  /* Fill the queue.  */
+  for (i = 0; i < queue_depth; i++)
+    submit_slot (stream, i);
+
+  return 0;
+}
+
+chop_error_t
+chop_async_file_stream_open (const char *path,
+			     size_t queue_depth, size_t read_size,
+			     chop_stream_t *stream)
+{
+  chop_error_t err;
+  int fd;
+
+  fd = open (path, O_RDONLY);
+  if (fd == -1)
+    return errno;
+
+  err = async_file_stream_open (fd, 1, queue_depth, read_size, path,
+				(chop_async_file_stream_t *) stream);
+  if (err)
+    close (fd);
+
+  return err;
+}
+
+chop_error_t
+chop_async_file_stream_open_fd (int fd, int eventually_close,
+				size_t queue_depth, size_t read_size,
+				chop_stream_t *stream)
+{
+  char name[20];
+
+  snprintf (name, sizeof (name), "%i", fd);
+
+  return (async_file_stream_open (fd, eventually_close,
+				  queue_depth, read_size, name,
+				  (chop_async_file_stream_t *) stream));
+}
+
+static void
+chop_async_file_stream_close (chop_stream_t *raw_stream)
+{
+  chop_async_file_stream_t *stream = (chop_async_file_stream_t *) raw_stream;
+  size_t i;
+
+  if (stream->slots == NULL)
+    return;
+
+#ifdef USE_IO_URING
+  ring_close (stream);
+#endif
+
+#ifdef HAVE_PTHREAD_H
+  if (stream->thread_spawned)
+    {
+      pthread_mutex_lock (&stream->lock);
+      stream->stopping = 1;
+      pthread_cond_broadcast (&stream->cond);
+      pthread_mutex_unlock (&stream->lock);
+
+      pthread_join (stream->thread, NULL);
+      stream->thread_spawned = 0;
+    }
+
+  pthread_cond_destroy (&stream->cond);
+  pthread_mutex_destroy (&stream->lock);
+#endif
+
+  for (i = 0; i < stream->queue_depth; i++)
+    chop_free (stream->slots[i].buffer, &chop_async_file_stream_class);
+
+  chop_free (stream->slots, &chop_async_file_stream_class);
+  stream->slots = NULL;
+
+  if (stream->eventually_close && stream->fd > 2)
+    close (stream->fd);
+
+  stream->fd = -1;
+}
+
+const char *
+chop_async_file_stream_backend (const chop_stream_t *raw_stream)
+{
+  const chop_async_file_stream_t *stream =
+    (const chop_async_file_stream_t *) raw_stream;
+
+  return (backend_names[stream->backend]);
+}
+
+chop_error_t
+chop_async_file_stream_select_backend (const char *name)
+{
+  if (!strcmp (name, backend_names[BACKEND_THREAD]))
+    default_backend = BACKEND_THREAD;
+#ifdef USE_IO_URING
+  else if (!strcmp (name, backend_names[BACKEND_IO_URING]))
+    default_backend = BACKEND_IO_URING;
+#endif
+  else
+    return CHOP_ERR_NOT_IMPL;
+
+  return 0;
+}
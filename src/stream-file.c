@@ -26,6 +26,24 @@
    truncated) soon yields a segmentation fault.  */
 /* #define USE_MMAP */
 
+/* Regardless of USE_MMAP, once `chop_file_stream_enable_mapping ()' has
+   been called, `chop_stream_peek ()' on a regular file maps windows of
+   FILE_STREAM_WINDOW_SIZE bytes of it in memory, which allows arbitrarily
+   large files to be peeked at even when the address space is limited.  The
+   caveat above applies to these windows, which is why they are not used by
+   default.  */
+#define FILE_STREAM_WINDOW_SIZE  (16UL * 1024UL * 1024UL)
+
+/* In CHOP_FILE_STREAM_DIRECT mode, files are read in chunks of
+   FILE_STREAM_DIRECT_BUFFER_SIZE bytes into a buffer aligned on
+   FILE_STREAM_DIRECT_ALIGNMENT bytes, which satisfies the `O_DIRECT'
+   requirements of common file systems.  In CHOP_FILE_STREAM_DROP_BEHIND
+   mode, pages are evicted once FILE_STREAM_DROP_BEHIND_SIZE bytes have been
+   read.  */
+#define FILE_STREAM_DIRECT_ALIGNMENT    4096UL
+#define FILE_STREAM_DIRECT_BUFFER_SIZE  (1024UL * 1024UL)
+#define FILE_STREAM_DROP_BEHIND_SIZE    (8UL * 1024UL * 1024UL)
+
 #include <chop/chop-config.h>
 
 #include <chop/chop.h>
@@ -33,9 +51,7 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
-#ifdef USE_MMAP
-# include <sys/mman.h>
-#endif
+#include <sys/mman.h>
 
 #include <fcntl.h>
 #include <unistd.h>
@@ -57,7 +73,44 @@ CHOP_DECLARE_RT_CLASS (file_stream, stream,
 		       size_t size;
 		       char  *map;
 		       size_t position;
-		       int    eventually_close;);
+		       int    eventually_close;
+
+		       /* When SEEK_HOLE is supported, the offset of FD
+			  corresponding to position zero, and the end of
+			  the data region and of the hole that contain
+			  POSITION, if any.  */
+		       int    seek_holes;
+		       off_t  base;
+		       size_t data_end;
+		       size_t hole_end;
+
+		       /* The region of FD currently mapped by `peek', which
+			  starts at offset WINDOW_OFFSET of FD, if
+			  MAP_WINDOWS is true.  When SEEK_PENDING is true,
+			  FD's offset must be moved to POSITION before it is
+			  read.  */
+		       int    is_regular;
+		       int    map_windows;
+		       int    seek_pending;
+		       char  *window;
+		       off_t  window_offset;
+		       size_t window_size;
+
+		       /* The page cache mode.  When DIRECT_BUFFER is not
+			  NULL, FD is read with `pread' into it; it contains
+			  DIRECT_END bytes read at offset DIRECT_OFFSET of
+			  FD.  In CHOP_FILE_STREAM_DROP_BEHIND mode, the
+			  pages of FD below offset DROPPED have been
+			  evicted.  */
+		       chop_file_stream_cache_mode_t cache_mode;
+		       char  *direct_buffer;
+		       off_t  direct_offset;
+		       size_t direct_end;
+		       off_t  dropped;);
+
+#if (defined SEEK_DATA) && (defined SEEK_HOLE) && !(defined USE_MMAP)
+# define USE_SEEK_HOLE 1
+#endif
 
 
 /* Note that the destructor of class `stream' calls `chop_stream_close ()',
@@ -72,6 +125,10 @@ CHOP_DEFINE_RT_CLASS (file_stream, stream,
 static void chop_file_stream_close (chop_stream_t *);
 static chop_error_t chop_file_stream_read (chop_stream_t *,
 					   char *, size_t, size_t *);
+static chop_error_t chop_file_stream_peek (chop_stream_t *,
+					   const char **, size_t *);
+static void chop_file_stream_consume (chop_stream_t *, size_t);
+static chop_error_t chop_file_stream_seek (chop_stream_t *, uint64_t);
 
 static chop_error_t
 file_stream_open (int fd, int eventually_close,
@@ -105,8 +162,43 @@ file_stream_open (int fd, int eventually_close,
   stream->eventually_close = eventually_close;
   stream->stream.preferred_block_size = file_stats->st_blksize;
 
+  stream->seek_holes = 0;
+  stream->data_end = stream->hole_end = 0;
+
+  stream->is_regular = S_ISREG (file_stats->st_mode);
+  stream->base = 0;
+  stream->map_windows = stream->seek_pending = 0;
+  stream->window = NULL;
+  stream->window_offset = 0;
+  stream->window_size = 0;
+
+  stream->cache_mode = CHOP_FILE_STREAM_CACHED;
+  stream->direct_buffer = NULL;
+  stream->direct_offset = 0;
+  stream->direct_end = 0;
+
+  if (stream->is_regular)
+    {
+      stream->base = lseek (fd, 0, SEEK_CUR);
+      if (stream->base == (off_t) -1)
+	{
+	  stream->base = 0;
+	  stream->is_regular = 0;
+	}
+#ifdef USE_SEEK_HOLE
+      else
+	/* Holes of sparse files are never read.  */
+	stream->seek_holes = 1;
+#endif
+    }
+
+  stream->dropped = stream->base;
+
   stream->stream.close = chop_file_stream_close;
   stream->stream.read = chop_file_stream_read;
+  stream->stream.peek = chop_file_stream_peek;
+  stream->stream.consume = chop_file_stream_consume;
+  stream->stream.seek = chop_file_stream_seek;
   stream->stream.name = chop_strdup (name, &chop_file_stream_class);
 
   return 0;
@@ -150,6 +242,202 @@ chop_file_stream_open_fd (int fd, int eventually_close,
 			   (chop_file_stream_t *) stream);
 }
 
+#ifdef USE_SEEK_HOLE
+
+/* Update the DATA_END and HOLE_END fields of FILE so that they describe the
+   data region or the hole that starts at FILE's current position.  When
+   neither can be determined, both are set to the current position.  On
+   failure, stop looking for holes.  */
+static void
+find_next_hole (chop_file_stream_t *file)
+{
+  off_t offset, data, hole;
+
+  offset = file->base + file->position;
+  file->data_end = file->hole_end = file->position;
+
+  data = lseek (file->fd, offset, SEEK_DATA);
+  if (data == (off_t) -1)
+    {
+      if (errno == ENXIO)
+	{
+	  /* There's no data between OFFSET and the end of the file.  */
+	  if ((off_t) file->size > offset)
+	    file->hole_end = file->size - file->base;
+	}
+      else
+	file->seek_holes = 0;
+    }
+  else if (data > offset)
+    file->hole_end = data - file->base;
+  else
+    {
+      hole = lseek (file->fd, data, SEEK_HOLE);
+      if (hole == (off_t) -1)
+	file->seek_holes = 0;
+      else
+	file->data_end = hole - file->base;
+    }
+
+  if (lseek (file->fd, offset, SEEK_SET) == (off_t) -1)
+    file->seek_holes = 0;
+}
+
+#endif
+
+#ifndef USE_MMAP
+
+/* In CHOP_FILE_STREAM_DROP_BEHIND mode, evict the pages of FILE that have
+   been read and are no longer mapped.  Unless EVERYTHING is true, do it
+   only once enough such pages have accumulated.  */
+static void
+drop_behind (chop_file_stream_t *file, int everything)
+{
+#ifdef HAVE_POSIX_FADVISE
+  off_t limit;
+
+  if (file->cache_mode != CHOP_FILE_STREAM_DROP_BEHIND)
+    return;
+
+  limit = file->base + file->position;
+  if ((file->window != NULL) && (file->window_offset < limit))
+    /* Pages that are still mapped would not be evicted.  */
+    limit = file->window_offset;
+
+  if ((limit > file->dropped)
+      && ((everything)
+	  || (limit - file->dropped >= (off_t) FILE_STREAM_DROP_BEHIND_SIZE)))
+    {
+      off_t start;
+
+      /* Pages are evicted only when they lie entirely in the given range,
+	 and the page cache may use pages larger than the system's page
+	 size; thus, start at an aligned offset so that the large page that
+	 contained the previous limit is covered this time.  */
+      start = file->dropped - (file->dropped % FILE_STREAM_DROP_BEHIND_SIZE);
+      if (start < file->base)
+	start = file->base;
+
+      posix_fadvise (file->fd, start, limit - start, POSIX_FADV_DONTNEED);
+      file->dropped = limit;
+    }
+#endif
+}
+
+/* Fill the direct buffer of FILE so that it contains the data at FILE's
+   position, keeping the data past that position that it already contains.
+   Return CHOP_STREAM_END if FILE's position is at the end of the file.  */
+static chop_error_t
+fill_direct_buffer (chop_file_stream_t *file)
+{
+  off_t offset, start, end;
+  size_t kept;
+  ssize_t result;
+
+  offset = file->base + file->position;
+  start = offset - (offset % FILE_STREAM_DIRECT_ALIGNMENT);
+  end = file->direct_offset + file->direct_end;
+
+  if ((offset >= file->direct_offset) && (offset <= end)
+      && (end % FILE_STREAM_DIRECT_ALIGNMENT == 0))
+    {
+      /* Keep the aligned region that contains OFFSET so that the next read
+	 is aligned as well.  */
+      kept = end - start;
+      if (kept > 0)
+	memmove (file->direct_buffer,
+		 file->direct_buffer + (start - file->direct_offset), kept);
+    }
+  else
+    kept = 0;
+
+  file->direct_offset = start;
+  file->direct_end = kept;
+
+  while (1)
+    {
+      result = pread (file->fd, file->direct_buffer + kept,
+		      FILE_STREAM_DIRECT_BUFFER_SIZE - kept, start + kept);
+      if (result >= 0)
+	break;
+
+      if (errno == EINTR)
+	continue;
+
+#ifdef O_DIRECT
+      if ((errno == EINVAL)
+	  && (file->cache_mode == CHOP_FILE_STREAM_DIRECT))
+	{
+	  int flags;
+
+	  /* The file system accepted `O_DIRECT' but does not actually
+	     support it: read through the page cache instead.  */
+	  flags = fcntl (file->fd, F_GETFL);
+	  if ((flags != -1)
+	      && (fcntl (file->fd, F_SETFL, flags & ~O_DIRECT) == 0))
+	    {
+	      file->cache_mode = CHOP_FILE_STREAM_DROP_BEHIND;
+	      continue;
+	    }
+	}
+#endif
+
+      return errno;
+    }
+
+  file->direct_end += result;
+  if (offset >= file->direct_offset + (off_t) file->direct_end)
+    return CHOP_STREAM_END;
+
+  return 0;
+}
+
+/* Read up to HOWMUCH bytes from FILE into BUFFER through its direct
+   buffer.  */
+static chop_error_t
+read_direct (chop_file_stream_t *file, char *buffer, size_t howmuch,
+	     size_t *bytes_read)
+{
+  *bytes_read = 0;
+
+  while (howmuch > 0)
+    {
+      off_t offset, end;
+      size_t amount;
+
+      offset = file->base + file->position;
+      end = file->direct_offset + file->direct_end;
+      if ((offset < file->direct_offset) || (offset >= end))
+	{
+	  chop_error_t err;
+
+	  err = fill_direct_buffer (file);
+	  if (err)
+	    return (*bytes_read > 0 && err == CHOP_STREAM_END) ? 0 : err;
+
+	  end = file->direct_offset + file->direct_end;
+	}
+
+      amount = end - offset;
+      if (amount > howmuch)
+	amount = howmuch;
+
+      memcpy (buffer, file->direct_buffer + (offset - file->direct_offset),
+	      amount);
+
+      buffer += amount;
+      howmuch -= amount;
+      *bytes_read += amount;
+      file->position += amount;
+    }
+
+  drop_behind (file, 0);
+
+  return 0;
+}
+
+#endif
+
 static chop_error_t
 chop_file_stream_read (chop_stream_t *stream,
 		       char *buffer, size_t howmuch, size_t *bytes_read)
@@ -173,10 +461,60 @@ chop_file_stream_read (chop_stream_t *stream,
 
 #else
 
+  if (file->direct_buffer != NULL)
+    return read_direct (file, buffer, howmuch, bytes_read);
+
+  if (file->seek_pending)
+    {
+      /* Data was consumed with `chop_file_stream_consume ()'.  */
+      if (lseek (file->fd, file->base + file->position, SEEK_SET)
+	  == (off_t) -1)
+	return errno;
+
+      file->seek_pending = 0;
+    }
+
+# ifdef USE_SEEK_HOLE
+  if (file->seek_holes)
+    {
+      if ((file->position >= file->data_end)
+	  && (file->position >= file->hole_end))
+	find_next_hole (file);
+
+      if (file->position < file->data_end)
+	{
+	  /* Don't read past the end of the current data region.  */
+	  if (howmuch > file->data_end - file->position)
+	    howmuch = file->data_end - file->position;
+	}
+      else if (file->position < file->hole_end)
+	{
+	  /* Return zeros without reading the hole.  */
+	  if (howmuch > file->hole_end - file->position)
+	    howmuch = file->hole_end - file->position;
+
+	  if (lseek (file->fd, file->base + file->position + howmuch,
+		     SEEK_SET) == (off_t) -1)
+	    return errno;
+
+	  memset (buffer, 0, howmuch);
+	  *bytes_read = howmuch;
+	  file->position += howmuch;
+
+	  return 0;
+	}
+    }
+# endif
+
   *bytes_read = full_read (file->fd, buffer, howmuch);
   if (*bytes_read == 0 && errno == 0)
     return CHOP_STREAM_END;
 
+  file->position += *bytes_read;
+  drop_behind (file, 0);
+
+  return 0;
+
 #endif
 
   file->position += *bytes_read;
@@ -184,6 +522,193 @@ chop_file_stream_read (chop_stream_t *stream,
   return 0;
 }
 
+#ifndef USE_MMAP
+
+/* Map the window of FILE that contains its current position.  Return
+   CHOP_ERR_NOT_IMPL if FILE cannot be mapped.  */
+static chop_error_t
+map_window (chop_file_stream_t *file)
+{
+  static long page_size = 0;
+  off_t offset, start;
+  size_t size;
+  void *window;
+
+  if (page_size == 0)
+    page_size = sysconf (_SC_PAGESIZE);
+
+  if (file->window != NULL)
+    {
+      munmap (file->window, file->window_size);
+      file->window = NULL;
+      file->window_size = 0;
+    }
+
+  offset = file->base + file->position;
+  start = offset - (offset % page_size);
+  size = file->size - start;
+  if (size > FILE_STREAM_WINDOW_SIZE)
+    size = FILE_STREAM_WINDOW_SIZE;
+
+  window = mmap (0, size, PROT_READ, MAP_SHARED, file->fd, start);
+  if (window == MAP_FAILED)
+    {
+      /* Don't try again.  */
+      file->map_windows = 0;
+      return CHOP_ERR_NOT_IMPL;
+    }
+
+  madvise (window, size, MADV_SEQUENTIAL);
+
+  file->window = window;
+  file->window_offset = start;
+  file->window_size = size;
+
+  return 0;
+}
+
+/* Peek at FILE through its direct buffer.  */
+static chop_error_t
+peek_direct (chop_file_stream_t *file, const char **data, size_t *size)
+{
+  off_t offset, end;
+
+  offset = file->base + file->position;
+  end = file->direct_offset + file->direct_end;
+
+  /* Unless the end of file was reached, make sure at least half a buffer
+     is available.  */
+  if ((offset < file->direct_offset) || (offset >= end)
+      || ((end - offset < (off_t) FILE_STREAM_DIRECT_BUFFER_SIZE / 2)
+	  && (file->direct_end == FILE_STREAM_DIRECT_BUFFER_SIZE)))
+    {
+      chop_error_t err;
+
+      err = fill_direct_buffer (file);
+      if (err)
+	{
+	  *size = 0;
+	  return err;
+	}
+
+      end = file->direct_offset + file->direct_end;
+    }
+
+  *data = file->direct_buffer + (offset - file->direct_offset);
+  *size = end - offset;
+
+  return 0;
+}
+
+#endif
+
+static chop_error_t
+chop_file_stream_peek (chop_stream_t *stream,
+		       const char **data, size_t *size)
+{
+  chop_file_stream_t *file = (chop_file_stream_t *)stream;
+
+#ifdef USE_MMAP
+
+  if (file->position >= file->size)
+    {
+      *size = 0;
+      return CHOP_STREAM_END;
+    }
+
+  *data = &file->map[file->position];
+  *size = file->size - file->position;
+
+#else
+
+  off_t offset, window_end;
+  size_t wanted;
+
+  if (file->direct_buffer != NULL)
+    return peek_direct (file, data, size);
+
+  if ((!file->is_regular) || (!file->map_windows))
+    return CHOP_ERR_NOT_IMPL;
+
+  offset = file->base + file->position;
+  if (offset >= (off_t) file->size)
+    {
+      struct stat file_stats;
+
+      /* The file may have grown since it was opened.  */
+      if (fstat (file->fd, &file_stats) == 0)
+	file->size = file_stats.st_size;
+
+      if (offset >= (off_t) file->size)
+	{
+	  *size = 0;
+	  return CHOP_STREAM_END;
+	}
+    }
+
+  /* Make sure at least half a window, or the rest of the file, is
+     mapped.  */
+  wanted = file->size - offset;
+  if (wanted > FILE_STREAM_WINDOW_SIZE / 2)
+    wanted = FILE_STREAM_WINDOW_SIZE / 2;
+
+  window_end = file->window_offset + file->window_size;
+  if ((file->window == NULL) || (offset < file->window_offset)
+      || (offset + (off_t) wanted > window_end))
+    {
+      chop_error_t err;
+
+      err = map_window (file);
+      if (err)
+	return err;
+
+      drop_behind (file, 0);
+      window_end = file->window_offset + file->window_size;
+    }
+
+  *data = file->window + (offset - file->window_offset);
+  *size = window_end - offset;
+
+#endif
+
+  return 0;
+}
+
+static void
+chop_file_stream_consume (chop_stream_t *stream, size_t size)
+{
+  chop_file_stream_t *file = (chop_file_stream_t *)stream;
+
+  file->position += size;
+  file->seek_pending = 1;
+
+#ifndef USE_MMAP
+  drop_behind (file, 0);
+#endif
+}
+
+static chop_error_t
+chop_file_stream_seek (chop_stream_t *stream, uint64_t offset)
+{
+  chop_file_stream_t *file = (chop_file_stream_t *)stream;
+
+#ifdef USE_MMAP
+  file->position = (offset > file->size) ? file->size : (size_t) offset;
+#else
+  if (!file->is_regular)
+    return CHOP_ERR_NOT_IMPL;
+
+  file->position = offset;
+  file->seek_pending = 1;
+
+  /* The data region or hole that contains the new position must be looked
+     up again.  */
+  file->data_end = file->hole_end = 0;
+#endif
+
+  return 0;
+}
+
 static void
 chop_file_stream_close (chop_stream_t *stream)
 {
@@ -192,6 +717,17 @@ chop_file_stream_close (chop_stream_t *stream)
 #ifdef USE_MMAP
   if (file->map != NULL)
     munmap (file->map, file->size);
+#else
+  if (file->window != NULL)
+    munmap (file->window, file->window_size);
+
+  file->window = NULL;
+  file->window_size = 0;
+
+  drop_behind (file, 1);
+
+  free (file->direct_buffer);
+  file->direct_buffer = NULL;
 #endif
 
   if (file->eventually_close && file->fd > 2)
@@ -200,3 +736,134 @@ chop_file_stream_close (chop_stream_t *stream)
   file->map = NULL;
   file->fd = -1;
 }
+
+chop_error_t
+chop_file_stream_set_cache_mode (chop_stream_t *stream,
+				 chop_file_stream_cache_mode_t mode)
+{
+#ifdef USE_MMAP
+
+  return (mode == CHOP_FILE_STREAM_CACHED) ? 0 : CHOP_ERR_NOT_IMPL;
+
+#else
+
+  chop_file_stream_t *file = (chop_file_stream_t *)stream;
+
+  if ((mode != CHOP_FILE_STREAM_CACHED) && (mode != CHOP_FILE_STREAM_DIRECT)
+      && (mode != CHOP_FILE_STREAM_DROP_BEHIND))
+    return CHOP_INVALID_ARG;
+
+  if (!file->is_regular)
+    return (mode == CHOP_FILE_STREAM_CACHED) ? 0 : CHOP_ERR_NOT_IMPL;
+
+  /* Leave the current mode.  */
+  drop_behind (file, 1);
+  if (file->direct_buffer != NULL)
+    {
+#ifdef O_DIRECT
+      int flags;
+
+      flags = fcntl (file->fd, F_GETFL);
+      if (flags != -1)
+	fcntl (file->fd, F_SETFL, flags & ~O_DIRECT);
+#endif
+
+      free (file->direct_buffer);
+      file->direct_buffer = NULL;
+
+      /* FD's offset was left unchanged by `pread'.  */
+      file->seek_pending = 1;
+    }
+
+  file->cache_mode = CHOP_FILE_STREAM_CACHED;
+
+  switch (mode)
+    {
+    case CHOP_FILE_STREAM_CACHED:
+      break;
+
+    case CHOP_FILE_STREAM_DIRECT:
+#ifdef O_DIRECT
+      {
+	void *buffer;
+	int flags;
+
+	if (posix_memalign (&buffer, FILE_STREAM_DIRECT_ALIGNMENT,
+			    FILE_STREAM_DIRECT_BUFFER_SIZE))
+	  return ENOMEM;
+
+	flags = fcntl (file->fd, F_GETFL);
+	if ((flags != -1)
+	    && (fcntl (file->fd, F_SETFL, flags | O_DIRECT) == 0))
+	  {
+	    /* Mapped windows would populate the page cache.  */
+	    if (file->window != NULL)
+	      munmap (file->window, file->window_size);
+	    file->window = NULL;
+	    file->window_size = 0;
+
+	    file->direct_buffer = buffer;
+	    file->direct_offset = 0;
+	    file->direct_end = 0;
+	    file->cache_mode = CHOP_FILE_STREAM_DIRECT;
+	    break;
+	  }
+
+	/* The file system does not support `O_DIRECT'.  */
+	free (buffer);
+      }
+#endif
+      /* Fall through.  */
+
+    case CHOP_FILE_STREAM_DROP_BEHIND:
+#ifdef HAVE_POSIX_FADVISE
+      file->cache_mode = CHOP_FILE_STREAM_DROP_BEHIND;
+      file->dropped = file->base;
+      posix_fadvise (file->fd, file->base, 0, POSIX_FADV_SEQUENTIAL);
+      break;
+#else
+      return CHOP_ERR_NOT_IMPL;
+#endif
+    }
+
+  return 0;
+
+#endif
+}
+
+chop_file_stream_cache_mode_t
+chop_file_stream_cache_mode (const chop_stream_t *stream)
+{
+  const chop_file_stream_t *file = (const chop_file_stream_t *)stream;
+
+  return file->cache_mode;
+}
+
+chop_error_t
+chop_file_stream_enable_mapping (chop_stream_t *stream, int enable)
+{
+#ifdef USE_MMAP
+
+  /* The whole file is always mapped.  */
+  return enable ? 0 : CHOP_ERR_NOT_IMPL;
+
+#else
+
+  chop_file_stream_t *file = (chop_file_stream_t *)stream;
+
+  if (!file->is_regular)
+    return enable ? CHOP_ERR_NOT_IMPL : 0;
+
+  if ((!enable) && (file->window != NULL))
+    {
+      munmap (file->window, file->window_size);
+      file->window = NULL;
+      file->window_size = 0;
+    }
+
+  file->map_windows = enable;
+
+  return 0;
+
+#endif
+}
@@ -24,6 +24,8 @@
 #include <chop/filters.h>
 
 #include <assert.h>
+#include <errno.h>
+#include <string.h>
 
 CHOP_DECLARE_RT_CLASS (filtered_stream, stream,
 		       chop_stream_t *backend;
@@ -32,7 +34,17 @@ CHOP_DECLARE_RT_CLASS (filtered_stream, stream,
 		       chop_proxy_semantics_t backend_ps;
 		       int owns_filter;
 		       int flushing;
-		       int finished;);
+		       int finished;
+
+		       /* Data pulled from FILTER by `peek' and not
+			  consumed yet, between PEEKED_START and
+			  PEEKED_END.  */
+		       char *peeked;
+		       size_t peeked_start;
+		       size_t peeked_end;);
+
+/* Size of the buffer used by `peek'.  */
+#define FILTERED_STREAM_PEEK_SIZE  (256U * 1024U)
 
 static chop_error_t
 fs_ctor (chop_object_t *object, const chop_class_t *class)
@@ -45,6 +57,8 @@ fs_ctor (chop_object_t *object, const chop_class_t *class)
   stream->backend_ps = CHOP_PROXY_LEAVE_AS_IS;
   stream->owns_filter = 0;
   stream->finished = 0;
+  stream->peeked = NULL;
+  stream->peeked_start = stream->peeked_end = 0;
 
   return 0;
 }
@@ -65,18 +79,35 @@ handle_input_fault (chop_filter_t *filter, size_t how_much, void *data)
   char *buffer;
 
   stream = (chop_filtered_stream_t *)data;
-  buffer = alloca (how_much);
 
-  err = chop_stream_read (stream->backend, buffer, how_much, &read);
+  /* Push data straight from BACKEND when possible.  */
+  err = chop_stream_peek (stream->backend, (const char **) &buffer, &read);
   if (!err)
     {
       size_t pushed;
 
+      if (read > how_much)
+	read = how_much;
+
       err = chop_filter_push (filter, buffer, read, &pushed);
       if (!err)
-	/* XXX: PUSHED will certainly always be equal to READ because READ <=
-	   HOW_MUCH.  */
-	assert (pushed == read);
+	chop_stream_consume (stream->backend, pushed);
+    }
+  else if (err == CHOP_ERR_NOT_IMPL)
+    {
+      buffer = alloca (how_much);
+
+      err = chop_stream_read (stream->backend, buffer, how_much, &read);
+      if (!err)
+	{
+	  size_t pushed;
+
+	  err = chop_filter_push (filter, buffer, read, &pushed);
+	  if (!err)
+	    /* XXX: PUSHED will certainly always be equal to READ because
+	       READ <= HOW_MUCH.  */
+	    assert (pushed == read);
+	}
     }
 
   if (err == CHOP_STREAM_END)
@@ -86,14 +117,13 @@ handle_input_fault (chop_filter_t *filter, size_t how_much, void *data)
   return err;
 }
 
+/* Pull at most HOWMUCH bytes from STREAM's filter into BUFFER.  */
 static chop_error_t
-filtered_stream_read (chop_stream_t *raw_stream,
-		      char *buffer, size_t howmuch, size_t *read)
+pull_filtered_data (chop_filtered_stream_t *stream,
+		    char *buffer, size_t howmuch, size_t *read)
 {
   chop_error_t err;
-  chop_filtered_stream_t *stream;
 
-  stream = (chop_filtered_stream_t *)raw_stream;
   if (stream->finished)
     return CHOP_STREAM_END;
 
@@ -127,6 +157,102 @@ filtered_stream_read (chop_stream_t *raw_stream,
   return err;
 }
 
+static chop_error_t
+filtered_stream_read (chop_stream_t *raw_stream,
+		      char *buffer, size_t howmuch, size_t *read)
+{
+  chop_filtered_stream_t *stream;
+
+  stream = (chop_filtered_stream_t *)raw_stream;
+
+  if (stream->peeked_start < stream->peeked_end)
+    {
+      /* Return data previously peeked first.  */
+      *read = stream->peeked_end - stream->peeked_start;
+      if (*read > howmuch)
+	*read = howmuch;
+
+      memcpy (buffer, stream->peeked + stream->peeked_start, *read);
+      stream->peeked_start += *read;
+
+      return 0;
+    }
+
+  return (pull_filtered_data (stream, buffer, howmuch, read));
+}
+
+static chop_error_t
+filtered_stream_peek (chop_stream_t *raw_stream,
+		      const char **data, size_t *size)
+{
+  chop_error_t err = 0;
+  chop_filtered_stream_t *stream;
+
+  stream = (chop_filtered_stream_t *)raw_stream;
+
+  if ((stream->peeked_end - stream->peeked_start
+       < FILTERED_STREAM_PEEK_SIZE / 2)
+      && (!stream->finished))
+    {
+      /* Refill the peek buffer so that large-enough regions are
+	 returned.  */
+      if (!stream->peeked)
+	{
+	  stream->peeked = chop_malloc (FILTERED_STREAM_PEEK_SIZE,
+					&chop_filtered_stream_class);
+	  if (!stream->peeked)
+	    return ENOMEM;
+	}
+
+      memmove (stream->peeked, stream->peeked + stream->peeked_start,
+	       stream->peeked_end - stream->peeked_start);
+      stream->peeked_end -= stream->peeked_start;
+      stream->peeked_start = 0;
+
+      while (stream->peeked_end < FILTERED_STREAM_PEEK_SIZE)
+	{
+	  size_t read = 0;
+
+	  err = pull_filtered_data (stream,
+				    stream->peeked + stream->peeked_end,
+				    FILTERED_STREAM_PEEK_SIZE
+				    - stream->peeked_end,
+				    &read);
+	  stream->peeked_end += read;
+
+	  if ((err) || (read == 0))
+	    break;
+	}
+
+      if ((err) && (stream->peeked_end > 0))
+	/* Report errors, including CHOP_STREAM_END, next time.  */
+	err = 0;
+    }
+
+  if ((!err) && (stream->peeked_start == stream->peeked_end))
+    err = CHOP_STREAM_END;
+
+  if (err)
+    {
+      *size = 0;
+      return err;
+    }
+
+  *data = stream->peeked + stream->peeked_start;
+  *size = stream->peeked_end - stream->peeked_start;
+
+  return 0;
+}
+
+static void
+filtered_stream_consume (chop_stream_t *raw_stream, size_t size)
+{
+  chop_filtered_stream_t *stream;
+
+  stream = (chop_filtered_stream_t *)raw_stream;
+  stream->peeked_start += size;
+}
+
 static void
 filtered_stream_close (chop_stream_t *raw_stream)
 {
@@ -134,6 +260,10 @@ filtered_stream_close (chop_stream_t *raw_stream)
 
   stream = (chop_filtered_stream_t *)raw_stream;
 
+  chop_free (stream->peeked, &chop_filtered_stream_class);
+  stream->peeked = NULL;
+  stream->peeked_start = stream->peeked_end = 0;
+
   if (stream->filter)
     {
       if (stream->owns_filter)
@@ -198,6 +328,8 @@ chop_filtered_stream_open (chop_stream_t *backend,
   stream = (chop_filtered_stream_t *)raw_stream;
   stream->stream.read = filtered_stream_read;
   stream->stream.close = filtered_stream_close;
+  stream->stream.peek = filtered_stream_peek;
+  stream->stream.consume = filtered_stream_consume;
   stream->stream.preferred_block_size =
     chop_stream_preferred_block_size (backend);
 
@@ -31,6 +31,10 @@ CHOP_DECLARE_RT_CLASS (mem_stream, stream,
 static void chop_mem_stream_close (chop_stream_t *);
 static chop_error_t chop_mem_stream_read (chop_stream_t *,
 					  char *, size_t, size_t *);
+static chop_error_t chop_mem_stream_peek (chop_stream_t *,
+					  const char **, size_t *);
+static void chop_mem_stream_consume (chop_stream_t *, size_t);
+static chop_error_t chop_mem_stream_seek (chop_stream_t *, uint64_t);
 
 /* The constructor.  */
 static chop_error_t
@@ -42,6 +46,9 @@ mem_stream_ctor (chop_object_t *object,
   stream = (chop_mem_stream_t *)object;
   stream->stream.close = chop_mem_stream_close;
   stream->stream.read = chop_mem_stream_read;
+  stream->stream.peek = chop_mem_stream_peek;
+  stream->stream.consume = chop_mem_stream_consume;
+  stream->stream.seek = chop_mem_stream_seek;
   stream->stream.preferred_block_size = 8192;
 
   stream->base = NULL;
@@ -109,3 +116,39 @@ chop_mem_stream_read (chop_stream_t *stream,
   return 0;
 }
 
+static chop_error_t
+chop_mem_stream_peek (chop_stream_t *stream,
+		      const char **data, size_t *size)
+{
+  chop_mem_stream_t *mem_stream = (chop_mem_stream_t *)stream;
+
+  if (mem_stream->offset >= mem_stream->size)
+    {
+      *size = 0;
+      return CHOP_STREAM_END;
+    }
+
+  *data = &mem_stream->base[mem_stream->offset];
+  *size = mem_stream->size - mem_stream->offset;
+
+  return 0;
+}
+
+static void
+chop_mem_stream_consume (chop_stream_t *stream, size_t size)
+{
+  chop_mem_stream_t *mem_stream = (chop_mem_stream_t *)stream;
+
+  mem_stream->offset += size;
+}
+
+static chop_error_t
+chop_mem_stream_seek (chop_stream_t *stream, uint64_t offset)
+{
+  chop_mem_stream_t *mem_stream = (chop_mem_stream_t *)stream;
+
+  mem_stream->offset = (offset > mem_stream->size)
+    ? mem_stream->size : (size_t) offset;
+
+  return 0;
+}
@@ -0,0 +1,179 @@
+/* libchop -- a utility library for distributed storage and data backup
+   Copyright (C) 2026  Ludovic Courtès <ludo@gnu.org>
+
+   Libchop is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Libchop is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with libchop.  If not, see <http://www.gnu.org/licenses/>.  */
+
+/* A stream that reads a bounded number of bytes from another stream.  */
+
+#include <chop/chop-config.h>
+
+#include <chop/chop.h>
+#include <chop/streams.h>
+
+#include <stdlib.h>
+
+CHOP_DECLARE_RT_CLASS (sub_stream, stream,
+		       chop_stream_t *source;
+		       chop_proxy_semantics_t source_ps;
+		       size_t remaining;);
+
+static void chop_sub_stream_close (chop_stream_t *);
+static chop_error_t chop_sub_stream_read (chop_stream_t *,
+					  char *, size_t, size_t *);
+static chop_error_t chop_sub_stream_peek (chop_stream_t *,
+					  const char **, size_t *);
+static void chop_sub_stream_consume (chop_stream_t *, size_t);
+
+static chop_error_t
+sub_stream_ctor (chop_object_t *object, const chop_class_t *class)
+{
+  chop_sub_stream_t *stream;
+
+  stream = (chop_sub_stream_t *)object;
+  stream->stream.read = chop_sub_stream_read;
+  stream->stream.close = chop_sub_stream_close;
+  stream->stream.peek = chop_sub_stream_peek;
+  stream->stream.consume = chop_sub_stream_consume;
+
+  stream->source = NULL;
+  stream->source_ps = CHOP_PROXY_LEAVE_AS_IS;
+  stream->remaining = 0;
+
+  return 0;
+}
+
+CHOP_DEFINE_RT_CLASS (sub_stream, stream,
+		      sub_stream_ctor, NULL, /* the dtor of `stream' calls
+						`close' */
+		      NULL, NULL, /* No copy/equalp */
+		      NULL, NULL  /* No serializer/deserializer */);
+
+
+
+chop_error_t
+chop_sub_stream_open (chop_stream_t *source,
+		      chop_proxy_semantics_t sps,
+		      size_t count,
+		      chop_stream_t *raw_stream)
+{
+  chop_error_t err;
+  chop_sub_stream_t *stream;
+
+  err = chop_object_initialize ((chop_object_t *)raw_stream,
+				&chop_sub_stream_class);
+  if (err)
+    return err;
+
+  stream = (chop_sub_stream_t *)raw_stream;
+  stream->stream.preferred_block_size =
+    chop_stream_preferred_block_size (source);
+
+  stream->source = source;
+  stream->source_ps = sps;
+  stream->remaining = count;
+
+  return 0;
+}
+
+size_t
+chop_sub_stream_remaining (const chop_stream_t *raw_stream)
+{
+  const chop_sub_stream_t *stream = (const chop_sub_stream_t *)raw_stream;
+
+  return stream->remaining;
+}
+
+static chop_error_t
+chop_sub_stream_read (chop_stream_t *raw_stream,
+		      char *buffer, size_t howmuch, size_t *read)
+{
+  chop_error_t err;
+  chop_sub_stream_t *stream = (chop_sub_stream_t *)raw_stream;
+
+  *read = 0;
+  if (stream->remaining == 0)
+    return CHOP_STREAM_END;
+
+  if (howmuch > stream->remaining)
+    howmuch = stream->remaining;
+
+  err = chop_stream_read (stream->source, buffer, howmuch, read);
+  stream->remaining -= *read;
+
+  if ((err == CHOP_STREAM_END) && (*read > 0))
+    err = 0;
+
+  return err;
+}
+
+static chop_error_t
+chop_sub_stream_peek (chop_stream_t *raw_stream,
+		      const char **data, size_t *size)
+{
+  chop_error_t err;
+  chop_sub_stream_t *stream = (chop_sub_stream_t *)raw_stream;
+
+  *size = 0;
+  if (stream->remaining == 0)
+    return CHOP_STREAM_END;
+
+  err = chop_stream_peek (stream->source, data, size);
+  if ((!err) && (*size > stream->remaining))
+    *size = stream->remaining;
+
+  return err;
+}
+
+static void
+chop_sub_stream_consume (chop_stream_t *raw_stream, size_t size)
+{
+  chop_sub_stream_t *stream = (chop_sub_stream_t *)raw_stream;
+
+  chop_stream_consume (stream->source, size);
+  stream->remaining -= size;
+}
+
+static void
+chop_sub_stream_close (chop_stream_t *raw_stream)
+{
+  chop_sub_stream_t *stream = (chop_sub_stream_t *)raw_stream;
+
+  if (stream->source)
+    {
+      switch (stream->source_ps)
+	{
+	case CHOP_PROXY_LEAVE_AS_IS:
+	  break;
+
+	case CHOP_PROXY_EVENTUALLY_CLOSE:
+	  chop_stream_close (stream->source);
+	  break;
+
+	case CHOP_PROXY_EVENTUALLY_DESTROY:
+	  chop_object_destroy ((chop_object_t *)stream->source);
+	  break;
+
+	case CHOP_PROXY_EVENTUALLY_FREE:
+	  chop_object_destroy ((chop_object_t *)stream->source);
+	  free (stream->source);
+	  break;
+
+	default:
+	  abort ();
+	}
+    }
+
+  stream->source = NULL;
+  stream->remaining = 0;
+}
@@ -33,6 +33,9 @@ stream_ctor (chop_object_t *object, const chop_class_t *class)
   stream->name = NULL;
   stream->read = NULL;
   stream->close = NULL;
+  stream->peek = NULL;
+  stream->consume = NULL;
+  stream->seek = NULL;
   stream->preferred_block_size = 0;
 
   return 0;
@@ -0,0 +1,323 @@
+/* libchop -- a utility library for distributed storage and data backup
+   Copyright (C) 2026  Ludovic Courtès <ludo@gnu.org>
+
+   Libchop is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Libchop is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with libchop.  If not, see <http://www.gnu.org/licenses/>.  */
+
+/* Check that a CHK block indexer with an index cache yields the same index
+   handles as before for the blocks it already indexed, without writing
+   them again, that the cache survives the block indexer and is shared by
+   its copies, that only blocks of synced stores enter it, and that it
+   cannot be used with different parameters.  */
+
+#include <chop/chop-config.h>
+
+#include <alloca.h>
+
+#include <chop/chop.h>
+#include <chop/block-indexers.h>
+#include <chop/stores.h>
+#include <chop/store-stats.h>
+
+#include <testsuite.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+
+#define STORE_FILE_NAME  ",,t-chk-index-cache.db"
+#define CACHE_FILE_NAME  ",,t-chk-index-cache.cache"
+
+#define BLOCK_SIZE    777
+#define BLOCK_COUNT   200
+#define NEW_BLOCKS    50
+#define CACHE_SLOTS   1024
+
+#define BLOCK_INDEXER_SERIAL  "aes256,cbc,sha256,sha1"
+
+
+static char input[(BLOCK_COUNT + NEW_BLOCKS) * BLOCK_SIZE];
+
+/* The binary serialization of the index handle of each block.  */
+static chop_buffer_t handles[BLOCK_COUNT + NEW_BLOCKS];
+
+static chop_block_store_t *store;
+
+
+
+/* Return a new CHK block indexer deserialized from SERIAL.  */
+static chop_block_indexer_t *
+open_block_indexer (const char *serial, chop_block_indexer_t *indexer)
+{
+  chop_error_t err;
+  size_t consumed;
+
+  err = chop_object_deserialize ((chop_object_t *) indexer,
+				 &chop_chk_block_indexer_class,
+				 CHOP_SERIAL_ASCII,
+				 serial, strlen (serial), &consumed);
+  test_check_errcode (err, "deserializing block indexer");
+
+  return indexer;
+}
+
+/* Index blocks FIRST to LAST (excluded) of INPUT with INDEXER, check or
+   record their index handle, and return the number of blocks written to
+   STORE.  */
+static size_t
+index_blocks (chop_block_indexer_t *indexer, size_t first, size_t last)
+{
+  chop_error_t err;
+  chop_block_store_t *stat_store;
+  chop_index_handle_t *handle;
+  chop_buffer_t serial;
+  size_t block, written;
+
+  stat_store = chop_class_alloca_instance (&chop_stat_block_store_class);
+  err = chop_stat_block_store_open ("data", store, CHOP_PROXY_LEAVE_AS_IS,
+				    stat_store);
+  test_check_errcode (err, "opening statistics store");
+
+  chop_buffer_init (&serial, 0);
+  handle = chop_block_indexer_alloca_index_handle (indexer);
+
+  for (block = first; block < last; block++)
+    {
+      err = chop_block_indexer_index (indexer, stat_store,
+				      input + block * BLOCK_SIZE, BLOCK_SIZE,
+				      handle);
+      test_check_errcode (err, "indexing block");
+
+      chop_buffer_clear (&serial);
+      err = chop_object_serialize ((chop_object_t *) handle,
+				   CHOP_SERIAL_BINARY, &serial);
+      test_check_errcode (err, "serializing index handle");
+
+      if (chop_buffer_size (&handles[block]) == 0)
+	chop_buffer_push (&handles[block], chop_buffer_content (&serial),
+			  chop_buffer_size (&serial));
+      else
+	{
+	  test_assert (chop_buffer_size (&handles[block])
+		       == chop_buffer_size (&serial));
+	  test_assert (!memcmp (chop_buffer_content (&handles[block]),
+				chop_buffer_content (&serial),
+				chop_buffer_size (&serial)));
+	}
+
+      chop_object_destroy ((chop_object_t *) handle);
+    }
+
+  written =
+    chop_block_store_stats_blocks_written (chop_stat_block_store_stats
+					   (stat_store));
+
+  chop_buffer_return (&serial);
+  chop_object_destroy ((chop_object_t *) stat_store);
+
+  return written;
+}
+
+/* A `sync' method for a store whose disk is gone.  */
+static chop_error_t
+failing_sync (chop_block_store_t *store)
+{
+  return CHOP_STORE_ERROR;
+}
+
+/* Fetch every block indexed by INDEXER and compare it to INPUT.  */
+static void
+check_blocks (chop_block_indexer_t *indexer)
+{
+  chop_error_t err;
+  chop_block_fetcher_t *fetcher;
+  chop_index_handle_t *handle;
+  chop_buffer_t buffer;
+  size_t block, size, read;
+
+  fetcher = chop_block_indexer_alloca_fetcher (indexer);
+  err = chop_block_indexer_initialize_fetcher (indexer, fetcher);
+  test_check_errcode (err, "initializing block fetcher");
+
+  chop_buffer_init (&buffer, BLOCK_SIZE);
+  handle = chop_block_indexer_alloca_index_handle (indexer);
+
+  for (block = 0; block < BLOCK_COUNT + NEW_BLOCKS; block++)
+    {
+      err = chop_object_deserialize ((chop_object_t *) handle,
+				     chop_block_indexer_index_handle_class
+				     (indexer),
+				     CHOP_SERIAL_BINARY,
+				     chop_buffer_content (&handles[block]),
+				     chop_buffer_size (&handles[block]),
+				     &read);
+      test_check_errcode (err, "deserializing index handle");
+
+      err = chop_block_fetcher_fetch (fetcher, handle, store,
+				      &buffer, &size);
+      test_check_errcode (err, "fetching block");
+      test_assert (size == BLOCK_SIZE);
+      test_assert (!memcmp (chop_buffer_content (&buffer),
+			    input + block * BLOCK_SIZE, BLOCK_SIZE));
+
+      chop_object_destroy ((chop_object_t *) handle);
+    }
+
+  chop_buffer_return (&buffer);
+  chop_object_destroy ((chop_object_t *) fetcher);
+}
+
+int
+main (int argc, char *argv[])
+{
+  chop_error_t err;
+  chop_block_indexer_t *indexer, *copy;
+  chop_block_store_t *metadata_store;
+  size_t block, written;
+
+  test_init (argv[0]);
+  test_init_random_seed ();
+
+  err = chop_init ();
+  test_check_errcode (err, "initializing libchop");
+
+  unlink (STORE_FILE_NAME);
+  unlink (CACHE_FILE_NAME);
+
+  store = chop_class_alloca_instance ((chop_class_t *)
+				      &chop_gdbm_block_store_class);
+  err = chop_file_based_store_open (&chop_gdbm_block_store_class,
+				    STORE_FILE_NAME,
+				    O_RDWR | O_CREAT, S_IRUSR | S_IWUSR,
+				    store);
+  test_check_errcode (err, "opening store");
+
+  test_randomize_input (input, sizeof (input));
+  for (block = 0; block < BLOCK_COUNT + NEW_BLOCKS; block++)
+    chop_buffer_init (&handles[block], 0);
+
+  test_stage ("indexing with an empty cache");
+  indexer = chop_class_alloca_instance (&chop_chk_block_indexer_class);
+  open_block_indexer (BLOCK_INDEXER_SERIAL, indexer);
+  err = chop_chk_block_indexer_open_cache (indexer, CACHE_FILE_NAME,
+					   CACHE_SLOTS);
+  test_check_errcode (err, "opening index cache");
+
+  written = index_blocks (indexer, 0, BLOCK_COUNT);
+  test_assert (written == BLOCK_COUNT);
+  err = chop_chk_block_indexer_sync_cache (indexer, store, NULL);
+  test_check_errcode (err, "syncing index cache");
+
+  /* A second cache user would corrupt it.  */
+  copy = chop_class_alloca_instance (&chop_chk_block_indexer_class);
+  open_block_indexer (BLOCK_INDEXER_SERIAL, copy);
+  err = chop_chk_block_indexer_open_cache (copy, CACHE_FILE_NAME,
+					   CACHE_SLOTS);
+  test_assert (err != 0);
+  chop_object_destroy ((chop_object_t *) copy);
+
+  chop_object_destroy ((chop_object_t *) indexer);
+  test_stage_result (1);
+
+  test_stage ("indexing without syncing");
+  indexer = chop_class_alloca_instance (&chop_chk_block_indexer_class);
+  open_block_indexer (BLOCK_INDEXER_SERIAL, indexer);
+  err = chop_chk_block_indexer_open_cache (indexer, CACHE_FILE_NAME,
+					   CACHE_SLOTS);
+  test_check_errcode (err, "reopening index cache");
+
+  /* The new blocks are not known to be stored, so they must not be added
+     to the cache, be it when it is closed or discarded.  */
+  written = index_blocks (indexer, 0, BLOCK_COUNT + NEW_BLOCKS);
+  test_assert (written == NEW_BLOCKS);
+  err = chop_chk_block_indexer_discard_cache (indexer);
+  test_check_errcode (err, "discarding index cache entries");
+  written = index_blocks (indexer, 0, BLOCK_COUNT + NEW_BLOCKS);
+  test_assert (written == NEW_BLOCKS);
+  chop_object_destroy ((chop_object_t *) indexer);
+  test_stage_result (1);
+
+  test_stage ("failing to sync the metadata store");
+  indexer = chop_class_alloca_instance (&chop_chk_block_indexer_class);
+  open_block_indexer (BLOCK_INDEXER_SERIAL, indexer);
+  err = chop_chk_block_indexer_open_cache (indexer, CACHE_FILE_NAME,
+					   CACHE_SLOTS);
+  test_check_errcode (err, "reopening index cache");
+
+  /* Key blocks may have gone to the metadata store, so the new blocks
+     must not enter the cache when only the data store was synced.  */
+  metadata_store =
+    chop_class_alloca_instance (&chop_stat_block_store_class);
+  err = chop_stat_block_store_open ("metadata", store,
+				    CHOP_PROXY_LEAVE_AS_IS, metadata_store);
+  test_check_errcode (err, "opening metadata store");
+  metadata_store->sync = failing_sync;
+
+  written = index_blocks (indexer, 0, BLOCK_COUNT + NEW_BLOCKS);
+  test_assert (written == NEW_BLOCKS);
+  err = chop_chk_block_indexer_sync_cache (indexer, store, metadata_store);
+  test_assert (err == CHOP_STORE_ERROR);
+  written = index_blocks (indexer, 0, BLOCK_COUNT + NEW_BLOCKS);
+  test_assert (written == NEW_BLOCKS);
+
+  chop_object_destroy ((chop_object_t *) metadata_store);
+  chop_object_destroy ((chop_object_t *) indexer);
+  test_stage_result (1);
+
+  test_stage ("reopening the cache");
+  indexer = chop_class_alloca_instance (&chop_chk_block_indexer_class);
+  open_block_indexer (BLOCK_INDEXER_SERIAL, indexer);
+  err = chop_chk_block_indexer_open_cache (indexer, CACHE_FILE_NAME,
+					   CACHE_SLOTS / 2);
+  test_check_errcode (err, "reopening index cache");
+
+  /* Use a copy of INDEXER, which shares its cache, and then destroy
+     INDEXER first.  */
+  copy = chop_class_alloca_instance (&chop_chk_block_indexer_class);
+  err = chop_object_copy ((chop_object_t *) indexer, (chop_object_t *) copy);
+  test_check_errcode (err, "copying block indexer");
+
+  written = index_blocks (copy, 0, BLOCK_COUNT + NEW_BLOCKS);
+  test_debug ("%zu blocks written", written);
+  test_assert (written == NEW_BLOCKS);
+  err = chop_chk_block_indexer_sync_cache (indexer, store, NULL);
+  test_check_errcode (err, "syncing index cache");
+
+  chop_object_destroy ((chop_object_t *) indexer);
+  written = index_blocks (copy, 0, BLOCK_COUNT + NEW_BLOCKS);
+  test_assert (written == 0);
+
+  check_blocks (copy);
+  chop_object_destroy ((chop_object_t *) copy);
+  test_stage_result (1);
+
+  test_stage ("using the cache with other parameters");
+  indexer = chop_class_alloca_instance (&chop_chk_block_indexer_class);
+  open_block_indexer ("blowfish,cbc,sha1,sha1", indexer);
+  err = chop_chk_block_indexer_open_cache (indexer, CACHE_FILE_NAME,
+					   CACHE_SLOTS);
+  test_assert (err == CHOP_INVALID_ARG);
+  chop_object_destroy ((chop_object_t *) indexer);
+  test_stage_result (1);
+
+  for (block = 0; block < BLOCK_COUNT + NEW_BLOCKS; block++)
+    chop_buffer_return (&handles[block]);
+
+  chop_object_destroy ((chop_object_t *) store);
+  unlink (STORE_FILE_NAME);
+  unlink (CACHE_FILE_NAME);
+
+  return 0;
+}
@@ -22,7 +22,12 @@
    somewhere in this input.  The position of the anchors for this modified
    input sequence is recorded.  Finally, the positions of the anchors for
    both input sequences are compared and those found for the reference input
-   sequence are expected to be found in the modified input sequence too.  */
+   sequence are expected to be found in the modified input sequence too.
+
+   In addition, the minimum and maximum block sizes are checked on random
+   input and on input containing long runs of zeros, and the block
+   boundaries found by each of the anchor-scanning kernels are checked to
+   be identical to those found by the scalar kernel.  */
 
 #include <chop/chop-config.h>
 
@@ -46,6 +51,10 @@
 #define SIZE_OF_INPUT      1779773
 #define SIZE_OF_INSERTION  (MAGIC_FPR_MASK + (MAGIC_FPR_MASK >> 1))
 
+/* Minimum and maximum block sizes.  */
+#define MIN_BLOCK_SIZE     512
+#define MAX_BLOCK_SIZE    8192
+
 
 /* The input (reference) buffer.  */
 static char input[SIZE_OF_INPUT];
@@ -196,7 +205,7 @@ do_test (void)
   test_stage_intermediate ("reference");
   chop_mem_stream_open (input, sizeof (input), NULL, stream);
   err = chop_anchor_based_chopper_init (stream, WINDOW_SIZE, MAGIC_FPR_MASK,
-					chopper);
+					0, 0, chopper);
   test_check_errcode (err, "initializing chopper");
 
   read_blocks_from_chopper (chopper,
@@ -217,7 +226,7 @@ do_test (void)
 
   chop_mem_stream_open (insertion, sizeof (insertion), NULL, stream);
   err = chop_anchor_based_chopper_init (stream, WINDOW_SIZE, MAGIC_FPR_MASK,
-					chopper);
+					0, 0, chopper);
   test_check_errcode (err, "initializing chopper for insertion");
 
   read_blocks_from_chopper (chopper,
@@ -242,6 +251,121 @@ do_test (void)
   return succeeded;
 }
 
+/* Chop the SIZE bytes at DATA with MIN_BLOCK_SIZE and MAX_BLOCK_SIZE as the
+   minimum and maximum block sizes and check that block sizes are within
+   these bounds.  */
+static int
+test_block_size_bounds (const char *data, size_t size)
+{
+  chop_error_t err;
+  size_t block_size, total = 0;
+  chop_stream_t *stream;
+  chop_chopper_t *chopper;
+  chop_buffer_t buffer;
+
+  stream = chop_class_alloca_instance (&chop_mem_stream_class);
+  chopper =
+    chop_class_alloca_instance ((chop_class_t *)&chop_anchor_based_chopper_class);
+
+  chop_mem_stream_open (data, size, NULL, stream);
+  err = chop_anchor_based_chopper_init (stream, WINDOW_SIZE, MAGIC_FPR_MASK,
+					MIN_BLOCK_SIZE, MAX_BLOCK_SIZE,
+					chopper);
+  test_check_errcode (err, "initializing chopper");
+
+  err = chop_buffer_init (&buffer, chop_chopper_typical_block_size (chopper));
+  test_check_errcode (err, "allocating buffer");
+
+  do
+    {
+      err = chop_chopper_read_block (chopper, &buffer, &block_size);
+      test_assert ((!err) || (err == CHOP_STREAM_END));
+
+      if (!err)
+	{
+	  test_assert (block_size <= MAX_BLOCK_SIZE);
+	  if (total + block_size < size)
+	    test_assert (block_size >= MIN_BLOCK_SIZE);
+
+	  test_assert (!memcmp (chop_buffer_content (&buffer), data + total,
+				block_size));
+	  total += block_size;
+	}
+    }
+  while (!err);
+
+  chop_buffer_return (&buffer);
+  chop_object_destroy ((chop_object_t *)chopper);
+  chop_object_destroy ((chop_object_t *)stream);
+
+  return (total == size);
+}
+
+/* Chop the SIZE bytes at DATA with each of the available anchor-scanning
+   kernels and check that they all yield the same block boundaries as the
+   scalar kernel.  */
+static int
+test_kernels (const char *data, size_t size,
+	      size_t window_size, unsigned long magic_fpr_mask,
+	      size_t min_size, size_t max_size)
+{
+  static const char *const kernels[] = { "scalar", "sse4.2", "avx2" };
+
+  chop_error_t err;
+  unsigned k;
+  int succeeded = 1;
+  const char *default_kernel;
+  chop_stream_t *stream;
+  chop_chopper_t *chopper;
+
+  stream = chop_class_alloca_instance (&chop_mem_stream_class);
+  chopper =
+    chop_class_alloca_instance ((chop_class_t *)&chop_anchor_based_chopper_class);
+
+  default_kernel = chop_anchor_based_chopper_kernel ();
+
+  for (k = 0; k < sizeof (kernels) / sizeof (kernels[0]); k++)
+    {
+      size_t *offsets, *block_count;
+
+      err = chop_anchor_based_chopper_select_kernel (kernels[k]);
+      if (err == CHOP_ERR_NOT_IMPL)
+	{
+	  test_debug ("kernel `%s' not supported", kernels[k]);
+	  continue;
+	}
+      test_check_errcode (err, "selecting kernel");
+      test_assert (!strcmp (chop_anchor_based_chopper_kernel (), kernels[k]));
+
+      /* The first kernel is the reference.  */
+      offsets = (k == 0) ? input_block_offsets : insertion_block_offsets;
+      block_count = (k == 0) ? &input_block_count : &insertion_block_count;
+
+      chop_mem_stream_open (data, size, NULL, stream);
+      err = chop_anchor_based_chopper_init (stream, window_size,
+					    magic_fpr_mask,
+					    min_size, max_size, chopper);
+      test_check_errcode (err, "initializing chopper");
+
+      read_blocks_from_chopper (chopper, offsets,
+				sizeof (input_block_offsets)
+				/ sizeof (input_block_offsets[0]),
+				block_count);
+      chop_object_destroy ((chop_object_t *)chopper);
+      chop_object_destroy ((chop_object_t *)stream);
+
+      if (k > 0)
+	succeeded = succeeded
+	  && (insertion_block_count == input_block_count)
+	  && (!memcmp (input_block_offsets, insertion_block_offsets,
+		       input_block_count * sizeof (*input_block_offsets)));
+    }
+
+  chop_anchor_based_chopper_select_kernel (default_kernel);
+
+  return succeeded;
+}
+
 
 int
 main (int argc, char *argv[])
@@ -260,6 +384,48 @@ main (int argc, char *argv[])
   for (iterations = 0; iterations < ITERATION_COUNT; iterations++)
     succeeded = do_test () || succeeded;
 
+  test_stage ("block size bounds");
+  test_stage_intermediate ("random");
+  test_randomize_input (input, sizeof (input));
+  test_assert (test_block_size_bounds (input, sizeof (input)));
+
+  /* Windows made only of zeros have a zero fingerprint, i.e., they are all
+     anchors.  */
+  test_stage_intermediate ("zeros");
+  memset (input + sizeof (input) / 4, 0, sizeof (input) / 2);
+  test_assert (test_block_size_bounds (input, sizeof (input)));
+  test_stage_result (1);
+
+  test_stage ("anchor-scanning kernels");
+  test_stage_intermediate ("random");
+  test_randomize_input (input, sizeof (input));
+  test_assert (test_kernels (input, sizeof (input),
+			     WINDOW_SIZE, MAGIC_FPR_MASK, 0, 0));
+  test_assert (test_kernels (input, sizeof (input) - 7, 1, 255, 0, 0));
+  test_assert (test_kernels (input, sizeof (input) - 13, 7, 0x7fff,
+			     MIN_BLOCK_SIZE, MAX_BLOCK_SIZE));
+  test_assert (test_kernels (input, sizeof (input), 100, ~0UL, 0, 0));
+
+  test_stage_intermediate ("low entropy");
+  {
+    size_t i;
+
+    for (i = 0; i < sizeof (input); i++)
+      input[i] = ((unsigned char) input[i]) % 3;
+  }
+  test_assert (test_kernels (input, sizeof (input),
+			     WINDOW_SIZE, MAGIC_FPR_MASK, 0, 0));
+  test_assert (test_kernels (input, sizeof (input) - 3, 3, 31, 0, 0));
+
+  test_stage_intermediate ("zeros");
+  memset (input + sizeof (input) / 4, 0, sizeof (input) / 2);
+  test_assert (test_kernels (input, sizeof (input),
+			     WINDOW_SIZE, MAGIC_FPR_MASK, 0, 0));
+  test_assert (test_kernels (input, sizeof (input),
+			     WINDOW_SIZE, MAGIC_FPR_MASK,
+			     MIN_BLOCK_SIZE, MAX_BLOCK_SIZE));
+  test_stage_result (1);
+
   return (succeeded ? 0 : 1);
 }
 
@@ -0,0 +1,224 @@
+/* libchop -- a utility library for distributed storage and data backup
+   Copyright (C) 2026  Ludovic Courtès <ludo@gnu.org>
+
+   Libchop is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Libchop is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with libchop.  If not, see <http://www.gnu.org/licenses/>.  */
+
+/* This test simulates an append-only file.  A prefix of the input is
+   chopped by an anchor-based chopper, which is then serialized.  The
+   deserialized chopper is used to chop the input from its resume offset
+   on, and the resulting blocks must be exactly those obtained by chopping
+   the whole input at once.  */
+
+#include <chop/chop-config.h>
+
+#include <alloca.h>
+
+#include <chop/chop.h>
+#include <chop/choppers.h>
+
+#include <testsuite.h>
+
+
+#define WINDOW_SIZE         48
+#define MAGIC_FPR_MASK    4095
+
+#define ITERATION_COUNT      4
+
+#define SIZE_OF_INPUT  1234567
+
+
+static char input[SIZE_OF_INPUT];
+
+static size_t reference_offsets[SIZE_OF_INPUT];
+static size_t reference_count;
+
+static size_t offsets[SIZE_OF_INPUT];
+static size_t count;
+
+static const size_t max_sizes[] = { 0, 3 * (MAGIC_FPR_MASK + 1) };
+
+static const chop_serial_method_t methods[] =
+  { CHOP_SERIAL_ASCII, CHOP_SERIAL_BINARY };
+
+
+
+/* Chop the SIZE bytes at START with CHOPPER, alternating between
+   `chop_chopper_read_block_view ()' and `chop_chopper_find_boundaries ()'.
+   Store the end offset of each block, relative to INPUT, in OFFSETS.  */
+static void
+read_blocks (chop_chopper_t *chopper, const char *start, size_t size,
+	     size_t *offsets, size_t *count)
+{
+  chop_error_t err;
+  chop_buffer_t buffer;
+  size_t total = start - input, calls = 0;
+
+  err = chop_buffer_init (&buffer, chop_chopper_typical_block_size (chopper));
+  test_check_errcode (err, "allocating buffer");
+
+  *count = 0;
+  do
+    {
+      const char *region;
+      chop_block_span_t blocks[4];
+      size_t block_count = 1, i;
+
+      if (calls++ % 2)
+	err = chop_chopper_find_boundaries (chopper, &buffer, &region,
+					    blocks, 4, &block_count);
+      else
+	{
+	  err = chop_chopper_read_block_view (chopper, &buffer, &region,
+					      &blocks[0].size);
+	  blocks[0].offset = 0;
+	}
+
+      test_assert ((!err) || (err == CHOP_STREAM_END));
+
+      for (i = 0; (!err) && (i < block_count); i++)
+	{
+	  test_assert (blocks[i].size > 0);
+	  test_assert (!memcmp (region + blocks[i].offset, input + total,
+				blocks[i].size));
+
+	  total += blocks[i].size;
+	  offsets[(*count)++] = total;
+	}
+    }
+  while (!err);
+
+  test_assert (total == start - input + size);
+
+  chop_buffer_return (&buffer);
+}
+
+int
+main (int argc, char *argv[])
+{
+  chop_error_t err;
+  chop_stream_t *stream;
+  chop_chopper_t *chopper;
+  chop_buffer_t serial;
+  unsigned i, m, s;
+
+  test_init (argv[0]);
+  test_init_random_seed ();
+
+  err = chop_init ();
+  test_check_errcode (err, "initializing libchop");
+
+  err = chop_buffer_init (&serial, 0);
+  test_check_errcode (err, "allocating buffer");
+
+  stream = chop_class_alloca_instance (&chop_mem_stream_class);
+  chopper =
+    chop_class_alloca_instance ((chop_class_t *)
+				&chop_anchor_based_chopper_class);
+
+  for (m = 0; m < sizeof (max_sizes) / sizeof (max_sizes[0]); m++)
+    {
+      test_stage ("resuming with maximum block size %zu", max_sizes[m]);
+
+      for (i = 0; i < ITERATION_COUNT; i++)
+	{
+	  size_t prefix, resume_offset, k;
+	  size_t read;
+
+	  test_randomize_input (input, sizeof (input));
+
+	  /* Chop all of INPUT.  */
+	  chop_mem_stream_open (input, sizeof (input), NULL, stream);
+	  err = chop_anchor_based_chopper_init (stream, WINDOW_SIZE,
+						MAGIC_FPR_MASK,
+						WINDOW_SIZE, max_sizes[m],
+						chopper);
+	  test_check_errcode (err, "initializing chopper");
+
+	  read_blocks (chopper, input, sizeof (input),
+		       reference_offsets, &reference_count);
+	  test_assert (chop_anchor_based_chopper_resume_offset (chopper)
+		       <= sizeof (input));
+	  chop_object_destroy ((chop_object_t *) chopper);
+	  chop_object_destroy ((chop_object_t *) stream);
+
+	  /* Chop a prefix of INPUT.  */
+	  prefix = sizeof (input) / 4 + random () % (sizeof (input) / 2);
+	  chop_mem_stream_open (input, prefix, NULL, stream);
+	  err = chop_anchor_based_chopper_init (stream, WINDOW_SIZE,
+						MAGIC_FPR_MASK,
+						WINDOW_SIZE, max_sizes[m],
+						chopper);
+	  test_check_errcode (err, "initializing chopper");
+
+	  read_blocks (chopper, input, prefix, offsets, &count);
+	  resume_offset = chop_anchor_based_chopper_resume_offset (chopper);
+	  test_debug ("prefix of %zu bytes, resuming at %zu",
+		      prefix, resume_offset);
+
+	  /* Only the last block may end past the resume offset, and all the
+	     blocks up to it must be the same as for the whole input.  */
+	  test_assert ((count == 1) || (resume_offset == offsets[count - 2])
+		       || (resume_offset == prefix));
+	  for (k = 0; (k < count) && (offsets[k] <= resume_offset); k++)
+	    test_assert (offsets[k] == reference_offsets[k]);
+
+	  /* Serialize it and chop the rest of INPUT with the deserialized
+	     chopper.  */
+	  s = i % (sizeof (methods) / sizeof (methods[0]));
+	  chop_buffer_clear (&serial);
+	  err = chop_object_serialize ((chop_object_t *) chopper, methods[s],
+				       &serial);
+	  test_check_errcode (err, "serializing chopper");
+
+	  chop_object_destroy ((chop_object_t *) chopper);
+	  chop_object_destroy ((chop_object_t *) stream);
+
+	  err = chop_object_deserialize ((chop_object_t *) chopper,
+					 (chop_class_t *)
+					 &chop_anchor_based_chopper_class,
+					 methods[s],
+					 chop_buffer_content (&serial),
+					 chop_buffer_size (&serial), &read);
+	  test_check_errcode (err, "deserializing chopper");
+	  test_assert (chop_anchor_based_chopper_resume_offset (chopper)
+		       == resume_offset);
+
+	  chop_mem_stream_open (input + resume_offset,
+				sizeof (input) - resume_offset, NULL, stream);
+	  err = chop_anchor_based_chopper_resume (chopper, stream);
+	  test_check_errcode (err, "resuming chopper");
+
+	  read_blocks (chopper, input + resume_offset,
+		       sizeof (input) - resume_offset, offsets, &count);
+
+	  chop_object_destroy ((chop_object_t *) chopper);
+	  chop_object_destroy ((chop_object_t *) stream);
+
+	  /* The blocks must be those that follow RESUME_OFFSET when chopping
+	     the whole input.  */
+	  for (k = 0; (k < reference_count)
+		 && (reference_offsets[k] <= resume_offset); k++);
+
+	  test_assert (count == reference_count - k);
+	  test_assert (!memcmp (offsets, reference_offsets + k,
+				count * sizeof (offsets[0])));
+	}
+
+      test_stage_result (1);
+    }
+
+  chop_buffer_return (&serial);
+
+  return 0;
+}
@@ -0,0 +1,194 @@
+/* libchop -- a utility library for distributed storage and data backup
+   Copyright (C) 2026  Ludovic Courtès <ludo@gnu.org>
+
+   Libchop is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Libchop is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with libchop.  If not, see <http://www.gnu.org/licenses/>.  */
+
+/* This test makes sure the FastCDC chopper honors its minimum and maximum
+   block sizes, and that it finds the same block boundaries in a reference
+   input and in a modified version thereof where a sequence of bytes was
+   inserted, except around the insertion point.  */
+
+#include <chop/chop-config.h>
+
+#include <alloca.h>
+
+#include <chop/chop.h>
+#include <chop/choppers.h>
+
+#include <testsuite.h>
+
+
+/* Parameters of the FastCDC chopper.  */
+#define MIN_SIZE         1024
+#define AVERAGE_SIZE     4096
+#define MAX_SIZE        16384
+
+/* Parameters of the data sets.  */
+#define SIZE_OF_INPUT      1779773
+#define SIZE_OF_INSERTION  3000
+
+/* The minimum proportion (in percent) of block boundaries of the reference
+   input that must be found in the modified input.  */
+#define MIN_SHARED_BOUNDARIES  90
+
+
+static char input[SIZE_OF_INPUT];
+static size_t input_block_offsets[SIZE_OF_INPUT / MIN_SIZE + 2];
+static size_t input_block_count;
+
+static char insertion[SIZE_OF_INPUT + SIZE_OF_INSERTION];
+static size_t insertion_block_offsets[sizeof (insertion) / MIN_SIZE + 2];
+static size_t insertion_block_count;
+
+
+
+/* Chop the SIZE bytes at DATA and store the end offset of each block in
+   OFFSETS.  Check that block sizes are within bounds.  */
+static void
+chop_input (const char *data, size_t size,
+	    size_t *offsets, size_t max_offsets, size_t *count)
+{
+  chop_error_t err;
+  chop_stream_t *stream;
+  chop_chopper_t *chopper;
+  chop_buffer_t buffer;
+  size_t block_size, total = 0;
+
+  stream = chop_class_alloca_instance (&chop_mem_stream_class);
+  chopper =
+    chop_class_alloca_instance ((chop_class_t *) &chop_fastcdc_chopper_class);
+
+  chop_mem_stream_open (data, size, NULL, stream);
+  err = chop_fastcdc_chopper_init (stream, MIN_SIZE, AVERAGE_SIZE, MAX_SIZE,
+				   chopper);
+  test_check_errcode (err, "initializing chopper");
+
+  err = chop_buffer_init (&buffer, chop_chopper_typical_block_size (chopper));
+  test_check_errcode (err, "allocating buffer");
+
+  *count = 0;
+  do
+    {
+      err = chop_chopper_read_block (chopper, &buffer, &block_size);
+      test_assert ((!err) || (err == CHOP_STREAM_END));
+
+      if (!err)
+	{
+	  test_assert (block_size == chop_buffer_size (&buffer));
+	  test_assert (!memcmp (chop_buffer_content (&buffer), data + total,
+				block_size));
+	  test_assert (block_size <= MAX_SIZE);
+	  if (total + block_size < size)
+	    /* Only the last block may be smaller than MIN_SIZE.  */
+	    test_assert (block_size >= MIN_SIZE);
+
+	  total += block_size;
+	  test_assert (*count < max_offsets);
+	  offsets[(*count)++] = total;
+	}
+    }
+  while (!err);
+
+  test_assert (total == size);
+
+  chop_buffer_return (&buffer);
+  chop_object_destroy ((chop_object_t *) chopper);
+  chop_object_destroy ((chop_object_t *) stream);
+
+  test_debug ("read %zu blocks", *count);
+}
+
+/* Return the number of block boundaries of the reference input located
+   after the insertion point that are also found in the modified input.  */
+static size_t
+count_shared_boundaries (size_t insertion_offset, size_t *candidates)
+{
+  size_t ref, mod, shared = 0;
+
+  *candidates = 0;
+  for (ref = 0, mod = 0; ref < input_block_count; ref++)
+    {
+      size_t expected;
+
+      if (input_block_offsets[ref] <= insertion_offset)
+	continue;
+
+      (*candidates)++;
+      expected = input_block_offsets[ref] + SIZE_OF_INSERTION;
+      while ((mod < insertion_block_count)
+	     && (insertion_block_offsets[mod] < expected))
+	mod++;
+
+      if ((mod < insertion_block_count)
+	  && (insertion_block_offsets[mod] == expected))
+	shared++;
+    }
+
+  return shared;
+}
+
+int
+main (int argc, char *argv[])
+{
+  chop_error_t err;
+  size_t insertion_offset, shared, candidates;
+  chop_stream_t *stream;
+  chop_chopper_t *chopper;
+
+  test_init (argv[0]);
+  test_init_random_seed ();
+
+  err = chop_init ();
+  test_check_errcode (err, "initializing libchop");
+
+  test_stage ("parameter checking");
+  stream = chop_class_alloca_instance (&chop_mem_stream_class);
+  chopper =
+    chop_class_alloca_instance ((chop_class_t *) &chop_fastcdc_chopper_class);
+  chop_mem_stream_open (input, sizeof (input), NULL, stream);
+  test_assert (chop_fastcdc_chopper_init (stream, 8192, 4096, 16384, chopper)
+	       == CHOP_INVALID_ARG);
+  test_assert (chop_fastcdc_chopper_init (stream, 1024, 4096, 2048, chopper)
+	       == CHOP_INVALID_ARG);
+  chop_object_destroy ((chop_object_t *) stream);
+  test_stage_result (1);
+
+  test_stage ("block sizes");
+  test_randomize_input (input, sizeof (input));
+  chop_input (input, sizeof (input),
+	      input_block_offsets,
+	      sizeof (input_block_offsets) / sizeof (input_block_offsets[0]),
+	      &input_block_count);
+  test_stage_result (1);
+
+  test_stage ("block boundaries after an insertion");
+  insertion_offset = random () % (sizeof (input) / 2);
+  memcpy (insertion, input, insertion_offset);
+  test_randomize_input (insertion + insertion_offset, SIZE_OF_INSERTION);
+  memcpy (insertion + insertion_offset + SIZE_OF_INSERTION,
+	  input + insertion_offset, sizeof (input) - insertion_offset);
+
+  chop_input (insertion, sizeof (insertion),
+	      insertion_block_offsets,
+	      sizeof (insertion_block_offsets)
+	      / sizeof (insertion_block_offsets[0]),
+	      &insertion_block_count);
+
+  shared = count_shared_boundaries (insertion_offset, &candidates);
+  test_debug ("%zu boundaries out of %zu are shared", shared, candidates);
+  test_assert (shared * 100 >= candidates * MIN_SHARED_BOUNDARIES);
+  test_stage_result (1);
+
+  return 0;
+}
@@ -0,0 +1,220 @@
+/* libchop -- a utility library for distributed storage and data backup
+   Copyright (C) 2026  Ludovic Courtès <ludo@gnu.org>
+
+   Libchop is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Libchop is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with libchop.  If not, see <http://www.gnu.org/licenses/>.  */
+
+/* This test makes sure that parallel choppers produce exactly the same
+   blocks as their inner chopper class used sequentially, regardless of the
+   number of threads and segment size.  */
+
+#include <chop/chop-config.h>
+
+#include <alloca.h>
+
+#include <chop/chop.h>
+#include <chop/choppers.h>
+
+#include <testsuite.h>
+
+
+#define TYPICAL_BLOCK_SIZE  4096
+
+#define SIZE_OF_INPUT       3141593
+
+/* Runs of zeros are inserted in the input to exercise forced block
+   boundaries.  */
+#define ZERO_RUNS           7
+#define SIZE_OF_ZERO_RUN    100000
+
+
+static char input[SIZE_OF_INPUT];
+
+static size_t reference_offsets[SIZE_OF_INPUT];
+static size_t reference_count;
+
+static size_t offsets[SIZE_OF_INPUT];
+static size_t count;
+
+static const chop_chopper_class_t *inner_classes[] =
+  {
+    &chop_fixed_size_chopper_class,
+    &chop_anchor_based_chopper_class,
+    &chop_fastcdc_chopper_class,
+    NULL
+  };
+
+static const struct
+{
+  size_t thread_count;
+  size_t segment_size;
+} configurations[] =
+  {
+    { 1, 0 },
+    { 2, 0 },
+    { 3, 10000 },
+    { 4, 65536 },
+    { 7, 4096 },
+    { 16, 123457 },
+    { 0, 0 }
+  };
+
+
+
+/* Read all the blocks of CHOPPER, check that their contents match INPUT,
+   and store their end offset in OFFSETS.  Alternate between
+   `chop_chopper_read_block ()', `chop_chopper_read_block_view ()', and
+   `chop_chopper_find_boundaries ()'.  */
+static void
+read_blocks (chop_chopper_t *chopper, size_t *offsets, size_t *count)
+{
+  chop_error_t err;
+  chop_buffer_t buffer;
+  size_t total = 0, calls = 0;
+
+  err = chop_buffer_init (&buffer, chop_chopper_typical_block_size (chopper));
+  test_check_errcode (err, "allocating buffer");
+
+  *count = 0;
+  do
+    {
+      const char *region;
+      chop_block_span_t blocks[5];
+      size_t block_count = 1, i;
+
+      switch (calls++ % 3)
+	{
+	case 0:
+	  err = chop_chopper_read_block (chopper, &buffer, &blocks[0].size);
+	  region = chop_buffer_content (&buffer);
+	  blocks[0].offset = 0;
+	  break;
+
+	case 1:
+	  err = chop_chopper_read_block_view (chopper, &buffer, &region,
+					      &blocks[0].size);
+	  blocks[0].offset = 0;
+	  break;
+
+	default:
+	  err = chop_chopper_find_boundaries (chopper, &buffer, &region,
+					      blocks, 5, &block_count);
+	}
+
+      test_assert ((!err) || (err == CHOP_STREAM_END));
+
+      for (i = 0; (!err) && (i < block_count); i++)
+	{
+	  size_t size = blocks[i].size;
+
+	  test_assert (size > 0);
+	  test_assert (total + size <= sizeof (input));
+	  test_assert (!memcmp (region + blocks[i].offset, input + total,
+				size));
+
+	  total += size;
+	  offsets[(*count)++] = total;
+	}
+    }
+  while (!err);
+
+  test_assert (total == sizeof (input));
+
+  chop_buffer_return (&buffer);
+}
+
+int
+main (int argc, char *argv[])
+{
+  chop_error_t err;
+  chop_stream_t *stream;
+  chop_chopper_t *chopper;
+  unsigned i, c, k;
+
+  test_init (argv[0]);
+  test_init_random_seed ();
+
+  err = chop_init ();
+  test_check_errcode (err, "initializing libchop");
+
+  test_randomize_input (input, sizeof (input));
+  for (i = 0; i < ZERO_RUNS; i++)
+    {
+      size_t offset = random () % (sizeof (input) - SIZE_OF_ZERO_RUN);
+      memset (input + offset, 0, SIZE_OF_ZERO_RUN);
+    }
+
+  stream = chop_class_alloca_instance (&chop_mem_stream_class);
+  chopper =
+    chop_class_alloca_instance ((chop_class_t *) &chop_parallel_chopper_class);
+
+  test_stage ("parameter checking");
+  chop_mem_stream_open (input, sizeof (input), NULL, stream);
+  test_assert (chop_parallel_chopper_init (stream, NULL, 0, 2, 0, chopper)
+	       == CHOP_INVALID_ARG);
+  test_assert (chop_parallel_chopper_init (stream,
+					   &chop_parallel_chopper_class,
+					   0, 2, 0, chopper)
+	       == CHOP_INVALID_ARG);
+  chop_object_destroy ((chop_object_t *) stream);
+  test_stage_result (1);
+
+  for (c = 0; inner_classes[c] != NULL; c++)
+    {
+      const chop_class_t *inner = (chop_class_t *) inner_classes[c];
+      chop_chopper_t *reference;
+
+      test_stage ("parallel `%s'", chop_class_name (inner));
+
+      /* Chop INPUT sequentially.  */
+      reference = chop_class_alloca_instance (inner);
+      chop_mem_stream_open (input, sizeof (input), NULL, stream);
+      err = chop_chopper_generic_open (inner_classes[c], stream,
+				       TYPICAL_BLOCK_SIZE, reference);
+      test_check_errcode (err, "opening reference chopper");
+
+      read_blocks (reference, reference_offsets, &reference_count);
+      test_debug ("%zu blocks with `%s'", reference_count,
+		  chop_class_name (inner));
+
+      chop_object_destroy ((chop_object_t *) reference);
+      chop_object_destroy ((chop_object_t *) stream);
+
+      for (k = 0; configurations[k].thread_count != 0; k++)
+	{
+	  chop_mem_stream_open (input, sizeof (input), NULL, stream);
+	  err = chop_parallel_chopper_init (stream, inner_classes[c],
+					    TYPICAL_BLOCK_SIZE,
+					    configurations[k].thread_count,
+					    configurations[k].segment_size,
+					    chopper);
+	  test_check_errcode (err, "initializing parallel chopper");
+
+	  read_blocks (chopper, offsets, &count);
+	  test_debug ("%zu threads, %zu-byte segments: %zu blocks",
+		      configurations[k].thread_count,
+		      configurations[k].segment_size, count);
+
+	  test_assert (count == reference_count);
+	  test_assert (!memcmp (offsets, reference_offsets,
+				count * sizeof (offsets[0])));
+
+	  chop_object_destroy ((chop_object_t *) chopper);
+	  chop_object_destroy ((chop_object_t *) stream);
+	}
+
+      test_stage_result (1);
+    }
+
+  return 0;
+}
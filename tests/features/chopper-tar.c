@@ -0,0 +1,409 @@
+/* libchop -- a utility library for distributed storage and data backup
+   Copyright (C) 2026  Ludovic Courtès <ludo@gnu.org>
+
+   Libchop is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Libchop is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with libchop.  If not, see <http://www.gnu.org/licenses/>.  */
+
+/* This test makes sure that tar choppers cut at member boundaries and
+   that the contents of each member are chopped exactly as if they were
+   chopped alone, regardless of their position in the archive.  It also
+   checks sub-streams, which tar choppers rely on.  */
+
+#include <chop/chop-config.h>
+
+#include <alloca.h>
+#include <stdio.h>
+
+#include <chop/chop.h>
+#include <chop/choppers.h>
+
+#include <testsuite.h>
+
+
+#define TYPICAL_BLOCK_SIZE  1024
+
+#define RECORD_SIZE         512
+#define ARCHIVE_SIZE        (4 * 1024 * 1024)
+#define MAX_BLOCKS          (ARCHIVE_SIZE / RECORD_SIZE)
+
+/* Members of the test archives.  */
+struct member
+{
+  const char *name;
+  char        typeflag;
+  size_t      size;
+  char       *contents;
+
+  /* Offset of the contents of this member in the archive being built.  */
+  size_t      offset;
+};
+
+static struct member members[] =
+  {
+    { "new-file",  '0', 77777 },
+    { "empty",     '0', 0 },
+    { "small",     '0', 100 },
+    { "directory", '5', 0 },
+    { "medium",    '0', 5000 },
+    { "large",     '0', 300000 },
+    { "huge",      '0', 1000000 },
+    { NULL }
+  };
+
+static char archive[ARCHIVE_SIZE];
+static size_t archive_size;
+
+static size_t boundaries[MAX_BLOCKS];
+static size_t boundary_count;
+
+static size_t member_boundaries[MAX_BLOCKS];
+static size_t member_boundary_count;
+
+
+
+/* Archive creation.  */
+
+/* Append a record to the archive.  */
+static char *
+new_record (void)
+{
+  char *record = archive + archive_size;
+
+  test_assert (archive_size + RECORD_SIZE <= sizeof (archive));
+  memset (record, 0, RECORD_SIZE);
+  archive_size += RECORD_SIZE;
+
+  return record;
+}
+
+/* Append a ustar header to the archive.  */
+static void
+write_header (const char *name, char typeflag, size_t size,
+	      unsigned long mtime)
+{
+  char *header;
+  unsigned sum = 0, i;
+
+  header = new_record ();
+  strncpy (header, name, 100);
+  sprintf (header + 100, "%07o", 0644);
+  sprintf (header + 108, "%07o", 1000);
+  sprintf (header + 116, "%07o", 1000);
+  sprintf (header + 124, "%011zo", size);
+  sprintf (header + 136, "%011lo", mtime);
+  memset (header + 148, ' ', 8);
+  header[156] = typeflag;
+  memcpy (header + 257, "ustar", 6);
+  memcpy (header + 263, "00", 2);
+  strcpy (header + 265, "user");
+  strcpy (header + 297, "group");
+
+  for (i = 0; i < RECORD_SIZE; i++)
+    sum += (unsigned char) header[i];
+
+  sprintf (header + 148, "%06o", sum);
+}
+
+/* Append SIZE bytes at DATA to the archive, followed by padding.  */
+static void
+write_data (const char *data, size_t size)
+{
+  size_t padded = (size + RECORD_SIZE - 1) / RECORD_SIZE * RECORD_SIZE;
+
+  test_assert (archive_size + padded <= sizeof (archive));
+  memcpy (archive + archive_size, data, size);
+  memset (archive + archive_size + size, 0, padded - size);
+  archive_size += padded;
+}
+
+/* Build an archive containing the members of MEMBERS whose index is not
+   SKIP.  Use a pax extended header and a GNU long name for some of them.
+   MTIME is used as the modification time of all the members.  */
+static void
+build_archive (unsigned skip, unsigned long mtime)
+{
+  struct member *m;
+  unsigned i;
+
+  archive_size = 0;
+
+  for (m = members, i = 0; m->name != NULL; m++, i++)
+    {
+      if (i == skip)
+	continue;
+
+      if (!strcmp (m->name, "large"))
+	{
+	  static const char pax[] = "29 path=some/long/path/large\n";
+
+	  write_header ("PaxHeaders/large", 'x', strlen (pax), mtime);
+	  write_data (pax, strlen (pax));
+	}
+      else if (!strcmp (m->name, "huge"))
+	{
+	  static const char long_name[] = "a/very/long/name/for/huge";
+
+	  write_header ("././@LongLink", 'L', sizeof (long_name), mtime);
+	  write_data (long_name, sizeof (long_name));
+	}
+
+      write_header (m->name, m->typeflag, m->size, mtime);
+      m->offset = archive_size;
+      write_data (m->contents, m->size);
+    }
+
+  /* End-of-archive marker, and padding to the default blocking factor.  */
+  new_record ();
+  new_record ();
+  while (archive_size % (20 * RECORD_SIZE))
+    new_record ();
+}
+
+
+
+/* Chop the SIZE bytes at DATA with CHOPPER, check that the blocks match
+   DATA, and store the end offset of each block in OFFSETS.  */
+static void
+read_blocks (chop_chopper_t *chopper, const char *data, size_t size,
+	     size_t *offsets, size_t *count)
+{
+  chop_error_t err;
+  chop_buffer_t buffer;
+  size_t total = 0;
+
+  err = chop_buffer_init (&buffer, chop_chopper_typical_block_size (chopper));
+  test_check_errcode (err, "allocating buffer");
+
+  *count = 0;
+  do
+    {
+      const char *region;
+      chop_block_span_t blocks[3];
+      size_t block_count = 1, i;
+
+      if (*count % 2)
+	err = chop_chopper_find_boundaries (chopper, &buffer, &region,
+					    blocks, 3, &block_count);
+      else
+	{
+	  err = chop_chopper_read_block (chopper, &buffer, &blocks[0].size);
+	  region = chop_buffer_content (&buffer);
+	  blocks[0].offset = 0;
+	}
+
+      test_assert ((!err) || (err == CHOP_STREAM_END));
+
+      for (i = 0; (!err) && (i < block_count); i++)
+	{
+	  test_assert (blocks[i].size > 0);
+	  test_assert (total + blocks[i].size <= size);
+	  test_assert (!memcmp (region + blocks[i].offset, data + total,
+				blocks[i].size));
+
+	  total += blocks[i].size;
+	  test_assert (*count < MAX_BLOCKS);
+	  offsets[(*count)++] = total;
+	}
+    }
+  while (!err);
+
+  test_assert (total == size);
+
+  chop_buffer_return (&buffer);
+}
+
+/* Chop the SIZE bytes at DATA with a tar chopper.  */
+static void
+chop_archive (const char *data, size_t size)
+{
+  chop_error_t err;
+  chop_stream_t *stream;
+  chop_chopper_t *chopper;
+
+  stream = chop_class_alloca_instance (&chop_mem_stream_class);
+  chopper =
+    chop_class_alloca_instance ((chop_class_t *) &chop_tar_chopper_class);
+
+  chop_mem_stream_open (data, size, NULL, stream);
+  err = chop_tar_chopper_init (stream, &chop_anchor_based_chopper_class,
+			       TYPICAL_BLOCK_SIZE, chopper);
+  test_check_errcode (err, "initializing tar chopper");
+
+  read_blocks (chopper, data, size, boundaries, &boundary_count);
+  test_debug ("%zu bytes, %zu blocks", size, boundary_count);
+
+  chop_object_destroy ((chop_object_t *) chopper);
+  chop_object_destroy ((chop_object_t *) stream);
+}
+
+/* Chop the SIZE bytes at DATA with an anchor-based chopper.  */
+static void
+chop_alone (const char *data, size_t size)
+{
+  chop_error_t err;
+  chop_stream_t *stream;
+  chop_chopper_t *chopper;
+
+  stream = chop_class_alloca_instance (&chop_mem_stream_class);
+  chopper =
+    chop_class_alloca_instance ((chop_class_t *)
+				&chop_anchor_based_chopper_class);
+
+  chop_mem_stream_open (data, size, NULL, stream);
+  err = chop_chopper_generic_open (&chop_anchor_based_chopper_class, stream,
+				   TYPICAL_BLOCK_SIZE, chopper);
+  test_check_errcode (err, "initializing anchor-based chopper");
+
+  read_blocks (chopper, data, size, member_boundaries,
+	       &member_boundary_count);
+
+  chop_object_destroy ((chop_object_t *) chopper);
+  chop_object_destroy ((chop_object_t *) stream);
+}
+
+/* Return the index of OFFSET in BOUNDARIES, or BOUNDARY_COUNT if it is not
+   a block boundary.  OFFSET zero is considered to be at index -1.  */
+static size_t
+find_boundary (size_t offset)
+{
+  size_t i;
+
+  if (offset == 0)
+    return (size_t) -1;
+
+  for (i = 0; i < boundary_count; i++)
+    if (boundaries[i] == offset)
+      return i;
+
+  return boundary_count;
+}
+
+/* Check that the contents of the members of the current archive, except
+   SKIP, were chopped as if they were alone.  */
+static void
+check_members (unsigned skip)
+{
+  struct member *m;
+  unsigned i;
+
+  for (m = members, i = 0; m->name != NULL; m++, i++)
+    {
+      size_t first, j;
+
+      if ((i == skip) || (m->size == 0) || (m->typeflag != '0'))
+	continue;
+
+      /* The contents of M must start on a block boundary.  */
+      first = find_boundary (m->offset);
+      test_assert (first != boundary_count);
+
+      chop_alone (m->contents, m->size);
+      for (j = 0; j < member_boundary_count; j++)
+	test_assert (boundaries[first + 1 + j]
+		     == m->offset + member_boundaries[j]);
+
+      test_debug ("member `%s' chopped into %zu blocks", m->name,
+		  member_boundary_count);
+    }
+}
+
+int
+main (int argc, char *argv[])
+{
+  chop_error_t err;
+  chop_stream_t *source, *stream;
+  chop_chopper_t *chopper;
+  struct member *m;
+  char buffer[1000];
+  size_t amount;
+
+  test_init (argv[0]);
+  test_init_random_seed ();
+
+  err = chop_init ();
+  test_check_errcode (err, "initializing libchop");
+
+  for (m = members; m->name != NULL; m++)
+    {
+      m->contents = malloc (m->size + 1);
+      test_randomize_input (m->contents, m->size);
+    }
+
+  test_stage ("sub-streams");
+  test_randomize_input (archive, 1000);
+  source = chop_class_alloca_instance (&chop_mem_stream_class);
+  stream = chop_class_alloca_instance (&chop_sub_stream_class);
+  chop_mem_stream_open (archive, 1000, NULL, source);
+
+  err = chop_sub_stream_open (source, CHOP_PROXY_LEAVE_AS_IS, 300, stream);
+  test_check_errcode (err, "opening sub-stream");
+  err = chop_stream_read (stream, buffer, sizeof (buffer), &amount);
+  test_assert ((!err) && (amount == 300));
+  test_assert (!memcmp (buffer, archive, 300));
+  test_assert (chop_sub_stream_remaining (stream) == 0);
+  err = chop_stream_read (stream, buffer, sizeof (buffer), &amount);
+  test_assert ((err == CHOP_STREAM_END) && (amount == 0));
+  chop_object_destroy ((chop_object_t *) stream);
+
+  err = chop_sub_stream_open (source, CHOP_PROXY_EVENTUALLY_DESTROY, 5000,
+			      stream);
+  test_check_errcode (err, "opening sub-stream");
+  err = chop_stream_read (stream, buffer, sizeof (buffer), &amount);
+  test_assert ((!err) && (amount == 700));
+  test_assert (!memcmp (buffer, archive + 300, 700));
+  err = chop_stream_read (stream, buffer, sizeof (buffer), &amount);
+  test_assert ((err == CHOP_STREAM_END) && (amount == 0));
+  test_assert (chop_sub_stream_remaining (stream) == 4300);
+  chop_object_destroy ((chop_object_t *) stream);
+  test_stage_result (1);
+
+  test_stage ("parameter checking");
+  chopper =
+    chop_class_alloca_instance ((chop_class_t *) &chop_tar_chopper_class);
+  chop_mem_stream_open (archive, 1000, NULL, source);
+  test_assert (chop_tar_chopper_init (source, NULL, 0, chopper)
+	       == CHOP_INVALID_ARG);
+  chop_object_destroy ((chop_object_t *) source);
+  test_stage_result (1);
+
+  test_stage ("member boundaries");
+  build_archive (0, 1234567890);
+  chop_archive (archive, archive_size);
+  check_members (0);
+  test_stage_result (1);
+
+  test_stage ("member boundaries in a modified archive");
+  build_archive (2, 1300000000);
+  chop_archive (archive, archive_size);
+  check_members (2);
+  test_stage_result (1);
+
+  test_stage ("non-tar input");
+  test_randomize_input (archive, sizeof (archive) / 4);
+  chop_archive (archive, sizeof (archive) / 4);
+
+  /* The first record is returned on its own, and the rest is chopped by
+     the inner chopper.  */
+  test_assert (boundaries[0] == RECORD_SIZE);
+  chop_alone (archive + RECORD_SIZE, sizeof (archive) / 4 - RECORD_SIZE);
+  test_assert (member_boundary_count + 1 == boundary_count);
+  for (amount = 0; amount < member_boundary_count; amount++)
+    test_assert (boundaries[amount + 1]
+		 == member_boundaries[amount] + RECORD_SIZE);
+  test_stage_result (1);
+
+  for (m = members; m->name != NULL; m++)
+    free (m->contents);
+
+  return 0;
+}
@@ -0,0 +1,264 @@
+/* libchop -- a utility library for distributed storage and data backup
+   Copyright (C) 2026  Ludovic Courtès <ludo@gnu.org>
+
+   Libchop is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Libchop is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with libchop.  If not, see <http://www.gnu.org/licenses/>.  */
+
+/* Check that file system block stores with several directory levels work
+   like the original ones, that their layout is remembered, and that the
+   original layout is still used for stores without a layout file.  */
+
+#include <chop/chop-config.h>
+
+#include <alloca.h>
+
+#include <chop/chop.h>
+#include <chop/stores.h>
+
+#include <testsuite.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+
+#define STORE_DIR_NAME  ",,t-store-fs-layout.d"
+
+#define BLOCK_COUNT   200
+#define KEY_SIZE      20
+#define BLOCK_SIZE    64
+
+
+static char keys[BLOCK_COUNT][KEY_SIZE];
+static char blocks[BLOCK_COUNT][BLOCK_SIZE];
+static chop_block_key_t block_keys[BLOCK_COUNT];
+
+
+
+/* Return the number of entries of directory NAME other than "." and "..",
+   and the name of the last one in LAST.  */
+static size_t
+count_entries (const char *name, char *last)
+{
+  DIR *dir;
+  struct dirent *entry;
+  size_t count = 0;
+
+  dir = opendir (name);
+  test_assert (dir != NULL);
+
+  while ((entry = readdir (dir)) != NULL)
+    if (strcmp (entry->d_name, ".") && strcmp (entry->d_name, ".."))
+      {
+	count++;
+	if (last != NULL)
+	  strcpy (last, entry->d_name);
+      }
+
+  closedir (dir);
+
+  return count;
+}
+
+static chop_error_t
+open_store (unsigned levels, unsigned width, chop_block_store_t *store)
+{
+  chop_error_t err;
+  int dir_fd;
+
+  dir_fd = open (STORE_DIR_NAME, O_RDONLY | O_DIRECTORY);
+  test_assert (dir_fd >= 0);
+
+  err = chop_fs_store_open_with_layout (dir_fd, 1, levels, width, store);
+  if (err)
+    close (dir_fd);
+
+  return err;
+}
+
+/* Check that STORE contains all the blocks, and only once.  */
+static void
+check_blocks (chop_block_store_t *store)
+{
+  chop_error_t err;
+  chop_buffer_t buffer;
+  chop_block_iterator_t *it;
+  bool found[BLOCK_COUNT];
+  size_t i, size, count;
+
+  chop_buffer_init (&buffer, BLOCK_SIZE);
+
+  for (i = 0; i < BLOCK_COUNT; i++)
+    {
+      err = chop_store_read_block (store, &block_keys[i], &buffer, &size);
+      test_check_errcode (err, "reading block");
+      test_assert (size == BLOCK_SIZE);
+      test_assert (!memcmp (chop_buffer_content (&buffer), blocks[i],
+			    BLOCK_SIZE));
+    }
+
+  memset (found, 0, sizeof (found));
+  it = chop_class_alloca_instance (chop_store_iterator_class (store));
+  for (err = chop_store_first_block (store, it), count = 0;
+       err == 0;
+       err = chop_block_iterator_next (it), count++)
+    {
+      for (i = 0; i < BLOCK_COUNT; i++)
+	if (chop_block_key_equal (chop_block_iterator_key (it),
+				  &block_keys[i]))
+	  break;
+
+      test_assert (i < BLOCK_COUNT);
+      test_assert (!found[i]);
+      found[i] = true;
+    }
+
+  test_assert (err == CHOP_STORE_END);
+  test_assert (count == BLOCK_COUNT);
+  chop_object_destroy ((chop_object_t *) it);
+
+  chop_buffer_return (&buffer);
+}
+
+static void
+write_blocks (chop_block_store_t *store)
+{
+  chop_error_t err;
+  size_t i;
+
+  for (i = 0; i < BLOCK_COUNT; i++)
+    {
+      err = chop_store_write_block (store, &block_keys[i], blocks[i],
+				    BLOCK_SIZE);
+      test_check_errcode (err, "writing block");
+    }
+}
+
+static void
+delete_blocks (chop_block_store_t *store)
+{
+  chop_error_t err;
+  bool exists;
+  size_t i;
+
+  for (i = 0; i < BLOCK_COUNT; i++)
+    {
+      err = chop_store_delete_block (store, &block_keys[i]);
+      test_check_errcode (err, "deleting block");
+
+      err = chop_store_blocks_exist (store, 1, &block_keys[i], &exists);
+      test_check_errcode (err, "checking block existence");
+      test_assert (!exists);
+    }
+}
+
+int
+main (int argc, char *argv[])
+{
+  chop_error_t err;
+  chop_block_store_t *store;
+  char name[512], entry[256];
+  size_t i;
+
+  test_init (argv[0]);
+  test_init_random_seed ();
+
+  err = chop_init ();
+  test_check_errcode (err, "initializing libchop");
+
+  test_randomize_input ((char *) keys, sizeof (keys));
+  test_randomize_input ((char *) blocks, sizeof (blocks));
+  for (i = 0; i < BLOCK_COUNT; i++)
+    chop_block_key_init (&block_keys[i], keys[i], KEY_SIZE, NULL, NULL);
+
+  unlink (STORE_DIR_NAME "/.libchop-fs-layout");
+  rmdir (STORE_DIR_NAME);
+  test_assert (mkdir (STORE_DIR_NAME, S_IRWXU) == 0);
+
+  store = chop_class_alloca_instance ((chop_class_t *)
+				      &chop_fs_block_store_class);
+
+  test_stage ("three levels of one-character directories");
+  err = open_store (3, 1, store);
+  test_check_errcode (err, "creating store");
+  write_blocks (store);
+  check_blocks (store);
+  chop_object_destroy ((chop_object_t *) store);
+
+  /* Blocks are three directories deep.  */
+  {
+    char base32[KEY_SIZE * 2 + 1];
+    struct stat st;
+
+    chop_buffer_to_base32_string (keys[0], KEY_SIZE, base32);
+    snprintf (name, sizeof (name), "%s/%c/%c/%c/%s", STORE_DIR_NAME,
+	      base32[0], base32[1], base32[2], &base32[3]);
+    test_assert (stat (name, &st) == 0 && S_ISREG (st.st_mode));
+  }
+  test_stage_result (1);
+
+  test_stage ("reopening the store");
+  err = open_store (0, 0, store);
+  test_check_errcode (err, "reopening store");
+  check_blocks (store);
+  chop_object_destroy ((chop_object_t *) store);
+
+  err = open_store (1, 2, store);
+  test_assert (err == CHOP_INVALID_ARG);
+
+  err = open_store (3, 1, store);
+  test_check_errcode (err, "reopening store with its layout");
+  delete_blocks (store);
+
+  /* The directories removed along with the blocks are created again.  */
+  write_blocks (store);
+  check_blocks (store);
+  delete_blocks (store);
+  chop_object_destroy ((chop_object_t *) store);
+
+  /* Only the layout file remains.  */
+  test_assert (count_entries (STORE_DIR_NAME, entry) == 1);
+  test_assert (entry[0] == '.');
+  test_assert (unlink (STORE_DIR_NAME "/.libchop-fs-layout") == 0);
+  test_stage_result (1);
+
+  test_stage ("stores without a layout file");
+  err = open_store (0, 0, store);
+  test_check_errcode (err, "creating store");
+  write_blocks (store);
+  chop_object_destroy ((chop_object_t *) store);
+
+  test_assert (count_entries (STORE_DIR_NAME, entry) > 1);
+  test_assert (strlen (entry) == 2);
+
+  err = open_store (2, 2, store);
+  test_assert (err == CHOP_INVALID_ARG);
+
+  err = open_store (0, 0, store);
+  test_check_errcode (err, "reopening store");
+  check_blocks (store);
+  delete_blocks (store);
+  chop_object_destroy ((chop_object_t *) store);
+
+  test_assert (count_entries (STORE_DIR_NAME, NULL) == 0);
+  test_stage_result (1);
+
+  rmdir (STORE_DIR_NAME);
+
+  return 0;
+}
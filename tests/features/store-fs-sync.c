@@ -0,0 +1,151 @@
+/* libchop -- a utility library for distributed storage and data backup
+   Copyright (C) 2026  Ludovic Courtès <ludo@gnu.org>
+
+   Libchop is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Libchop is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with libchop.  If not, see <http://www.gnu.org/licenses/>.  */
+
+/* Check that the file system block store reads back large and overwritten
+   blocks exactly, whatever its sync interval, and that it leaves no
+   temporary files behind.  */
+
+#include <chop/chop-config.h>
+
+#include <alloca.h>
+
+#include <chop/chop.h>
+#include <chop/stores.h>
+
+#include <testsuite.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+
+#define STORE_DIR_NAME  ",,t-store-fs-sync.d"
+
+#define BLOCK_COUNT   40
+#define KEY_SIZE      20
+#define MAX_SIZE      (200 * 1024)
+
+
+static char keys[BLOCK_COUNT][KEY_SIZE];
+static char *blocks[BLOCK_COUNT];
+static size_t sizes[BLOCK_COUNT];
+static chop_block_key_t block_keys[BLOCK_COUNT];
+
+
+
+static void
+write_and_check_blocks (chop_block_store_t *store)
+{
+  chop_error_t err;
+  chop_buffer_t buffer;
+  size_t i, size;
+
+  /* Start with a non-empty buffer: its contents must be replaced.  */
+  chop_buffer_init (&buffer, 0);
+  chop_buffer_push (&buffer, "garbage", 7);
+
+  for (i = 0; i < BLOCK_COUNT; i++)
+    {
+      err = chop_store_write_block (store, &block_keys[i], blocks[i],
+				    sizes[i]);
+      test_check_errcode (err, "writing block");
+    }
+
+  /* Overwrite the first blocks with shorter contents.  */
+  for (i = 0; i < BLOCK_COUNT / 4; i++)
+    {
+      sizes[i] /= 2;
+      err = chop_store_write_block (store, &block_keys[i], blocks[i],
+				    sizes[i]);
+      test_check_errcode (err, "overwriting block");
+    }
+
+  for (i = 0; i < BLOCK_COUNT; i++)
+    {
+      err = chop_store_read_block (store, &block_keys[i], &buffer, &size);
+      test_check_errcode (err, "reading block");
+      test_assert (size == sizes[i]);
+      test_assert (chop_buffer_size (&buffer) == sizes[i]);
+      test_assert (!memcmp (chop_buffer_content (&buffer), blocks[i],
+			    sizes[i]));
+    }
+
+  err = chop_store_sync (store);
+  test_check_errcode (err, "syncing store");
+
+  chop_buffer_return (&buffer);
+}
+
+int
+main (int argc, char *argv[])
+{
+  static const size_t intervals[] = { 0, 1, 7 };
+
+  chop_error_t err;
+  chop_block_store_t *store;
+  size_t i, interval;
+
+  test_init (argv[0]);
+  test_init_random_seed ();
+
+  err = chop_init ();
+  test_check_errcode (err, "initializing libchop");
+
+  test_randomize_input ((char *) keys, sizeof (keys));
+  for (i = 0; i < BLOCK_COUNT; i++)
+    {
+      blocks[i] = malloc (MAX_SIZE);
+      test_assert (blocks[i] != NULL);
+      test_randomize_input (blocks[i], MAX_SIZE);
+      chop_block_key_init (&block_keys[i], keys[i], KEY_SIZE, NULL, NULL);
+    }
+
+  store = chop_class_alloca_instance ((chop_class_t *)
+				      &chop_fs_block_store_class);
+
+  for (interval = 0;
+       interval < sizeof (intervals) / sizeof (intervals[0]);
+       interval++)
+    {
+      test_stage ("sync interval %zu", intervals[interval]);
+
+      for (i = 0; i < BLOCK_COUNT; i++)
+	sizes[i] = random () % MAX_SIZE;
+
+      test_remove_directory (STORE_DIR_NAME);
+      err = chop_file_based_store_open (&chop_fs_block_store_class,
+					STORE_DIR_NAME,
+					O_RDWR | O_CREAT, S_IRUSR | S_IWUSR,
+					store);
+      test_check_errcode (err, "opening store");
+
+      chop_fs_store_set_sync_interval (store, intervals[interval]);
+      write_and_check_blocks (store);
+
+      chop_object_destroy ((chop_object_t *) store);
+
+      test_assert (test_remove_directory (STORE_DIR_NAME) == BLOCK_COUNT);
+      test_stage_result (1);
+    }
+
+  for (i = 0; i < BLOCK_COUNT; i++)
+    free (blocks[i]);
+
+  return 0;
+}
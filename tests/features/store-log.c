@@ -0,0 +1,409 @@
+/* libchop -- a utility library for distributed storage and data backup
+   Copyright (C) 2026  Ludovic Courtès <ludo@gnu.org>
+
+   Libchop is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Libchop is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with libchop.  If not, see <http://www.gnu.org/licenses/>.  */
+
+/* Check that the log block store returns the blocks written to it and not
+   those deleted, after being reopened, after a crash that left records
+   behind its checkpoint, after compaction, and after losing its
+   checkpoint, and that it rejects segments other than the newest one that
+   were cut short.  */
+
+#include <chop/chop-config.h>
+
+#include <alloca.h>
+
+#include <chop/chop.h>
+#include <chop/stores.h>
+
+#include <testsuite.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+
+#define STORE_DIR_NAME  ",,t-store-log.d"
+#define CHECKPOINT_NAME STORE_DIR_NAME "/checkpoint"
+
+#define BLOCK_COUNT   500
+#define KEY_SIZE      20
+#define MAX_SIZE      3000
+
+/* Small segments, so that blocks are spread over many of them.  */
+#define SEGMENT_SIZE  (64 * 1024)
+
+
+static char keys[BLOCK_COUNT][KEY_SIZE];
+static char blocks[BLOCK_COUNT][MAX_SIZE];
+static size_t sizes[BLOCK_COUNT];
+static bool present[BLOCK_COUNT];
+
+static chop_block_key_t block_keys[BLOCK_COUNT];
+
+
+
+/* Return the number of segments of the store, and their total size in
+   *SIZE, and the name of the last one in LAST.  */
+static size_t
+count_segments (size_t *size, char *last)
+{
+  DIR *dir;
+  struct dirent *entry;
+  size_t count = 0;
+
+  dir = opendir (STORE_DIR_NAME);
+  test_assert (dir != NULL);
+
+  *size = 0;
+  while ((entry = readdir (dir)) != NULL)
+    if (!strncmp (entry->d_name, "segment-", 8))
+      {
+	char name[512];
+	struct stat st;
+
+	snprintf (name, sizeof (name), "%s/%s", STORE_DIR_NAME,
+		  entry->d_name);
+	test_assert (stat (name, &st) == 0);
+	*size += st.st_size;
+	count++;
+
+	if ((last != NULL) && ((count == 1) || (strcmp (name, last) > 0)))
+	  strcpy (last, name);
+      }
+  closedir (dir);
+
+  return count;
+}
+
+static chop_block_store_t *
+open_store (chop_block_store_t *store)
+{
+  chop_error_t err;
+  int dir_fd;
+
+  dir_fd = open (STORE_DIR_NAME, O_RDONLY | O_DIRECTORY);
+  test_assert (dir_fd >= 0);
+
+  err = chop_log_store_open (dir_fd, 1, SEGMENT_SIZE, store);
+  test_check_errcode (err, "opening log store");
+
+  return store;
+}
+
+/* Check that STORE contains exactly the blocks marked as present.  */
+static void
+check_blocks (chop_block_store_t *store)
+{
+  chop_error_t err;
+  chop_buffer_t buffer;
+  chop_block_iterator_t *it;
+  bool exists[BLOCK_COUNT], found[BLOCK_COUNT];
+  size_t i, size, count, expected;
+
+  chop_buffer_init (&buffer, MAX_SIZE);
+
+  err = chop_store_blocks_exist (store, BLOCK_COUNT, block_keys, exists);
+  test_check_errcode (err, "checking block existence");
+
+  for (i = 0, expected = 0; i < BLOCK_COUNT; i++)
+    {
+      test_assert (exists[i] == present[i]);
+
+      err = chop_store_read_block (store, &block_keys[i], &buffer, &size);
+      if (present[i])
+	{
+	  test_check_errcode (err, "reading block");
+	  test_assert (size == sizes[i]);
+	  test_assert (!memcmp (chop_buffer_content (&buffer), blocks[i],
+				size));
+	  expected++;
+	}
+      else
+	test_assert (err == CHOP_STORE_BLOCK_UNAVAIL);
+    }
+
+  /* Each block must be visited exactly once.  */
+  memset (found, 0, sizeof (found));
+  it = chop_class_alloca_instance (chop_store_iterator_class (store));
+  for (err = chop_store_first_block (store, it), count = 0;
+       err == 0;
+       err = chop_block_iterator_next (it), count++)
+    {
+      const chop_block_key_t *key = chop_block_iterator_key (it);
+
+      for (i = 0; i < BLOCK_COUNT; i++)
+	if (chop_block_key_equal (key, &block_keys[i]))
+	  break;
+
+      test_assert (i < BLOCK_COUNT);
+      test_assert (present[i]);
+      test_assert (!found[i]);
+      found[i] = true;
+    }
+
+  test_assert (err == CHOP_STORE_END);
+  test_assert (count == expected);
+  if (count > 0)
+    chop_object_destroy ((chop_object_t *) it);
+
+  chop_buffer_return (&buffer);
+}
+
+static void
+write_blocks (chop_block_store_t *store, size_t first, size_t last)
+{
+  chop_error_t err;
+  size_t i;
+
+  for (i = first; i < last; i++)
+    {
+      err = chop_store_write_block (store, &block_keys[i], blocks[i],
+				    sizes[i]);
+      test_check_errcode (err, "writing block");
+      present[i] = true;
+    }
+}
+
+static void
+delete_block (chop_block_store_t *store, size_t i)
+{
+  chop_error_t err;
+
+  err = chop_store_delete_block (store, &block_keys[i]);
+  test_check_errcode (err, "deleting block");
+  present[i] = false;
+
+  err = chop_store_delete_block (store, &block_keys[i]);
+  test_assert (err == CHOP_STORE_BLOCK_UNAVAIL);
+}
+
+/* Return the contents of file NAME, whose size is stored in *SIZE.  */
+static char *
+read_file (const char *name, size_t *size)
+{
+  struct stat st;
+  char *data;
+  int fd;
+
+  fd = open (name, O_RDONLY);
+  test_assert (fd >= 0);
+  test_assert (fstat (fd, &st) == 0);
+
+  *size = st.st_size;
+  data = malloc (*size);
+  test_assert (data != NULL);
+  test_assert (read (fd, data, *size) == (ssize_t) *size);
+  close (fd);
+
+  return data;
+}
+
+int
+main (int argc, char *argv[])
+{
+  chop_error_t err;
+  chop_block_store_t *store;
+  char *checkpoint, last[512];
+  size_t i, segments, checkpoint_size, before, after = 0;
+
+  test_init (argv[0]);
+  test_init_random_seed ();
+
+  err = chop_init ();
+  test_check_errcode (err, "initializing libchop");
+
+  test_remove_directory (STORE_DIR_NAME);
+  test_assert (mkdir (STORE_DIR_NAME, S_IRWXU) == 0);
+
+  test_randomize_input ((char *) keys, sizeof (keys));
+  test_randomize_input ((char *) blocks, sizeof (blocks));
+  for (i = 0; i < BLOCK_COUNT; i++)
+    {
+      sizes[i] = random () % MAX_SIZE;
+      chop_block_key_init (&block_keys[i], keys[i], KEY_SIZE, NULL, NULL);
+    }
+
+  store = chop_class_alloca_instance ((chop_class_t *)
+				      &chop_log_block_store_class);
+
+  test_stage ("writing and deleting blocks");
+  open_store (store);
+  check_blocks (store);
+  write_blocks (store, 0, BLOCK_COUNT / 2);
+  check_blocks (store);
+
+  for (i = 0; i < 10; i++)
+    delete_block (store, i);
+  check_blocks (store);
+
+  /* Overwrite a few blocks; the new contents win.  */
+  for (i = 10; i < 20; i++)
+    {
+      test_randomize_input (blocks[i], MAX_SIZE);
+      sizes[i] = random () % MAX_SIZE;
+    }
+  write_blocks (store, 10, 20);
+  check_blocks (store);
+  chop_object_destroy ((chop_object_t *) store);
+
+  segments = count_segments (&before, NULL);
+  test_debug ("%zu segments", segments);
+  test_assert (segments > 1);
+  test_stage_result (1);
+
+  test_stage ("reopening the store");
+  open_store (store);
+  check_blocks (store);
+
+  /* Deleted blocks can be written again.  */
+  write_blocks (store, 0, 5);
+  err = chop_store_sync (store);
+  test_check_errcode (err, "syncing store");
+  chop_object_destroy ((chop_object_t *) store);
+
+  open_store (store);
+  check_blocks (store);
+  chop_object_destroy ((chop_object_t *) store);
+  test_stage_result (1);
+
+  test_stage ("replaying records after the checkpoint");
+  checkpoint = read_file (CHECKPOINT_NAME, &checkpoint_size);
+
+  open_store (store);
+  for (i = 20; i < 30; i++)
+    delete_block (store, i);
+  write_blocks (store, BLOCK_COUNT / 2, BLOCK_COUNT);
+  chop_object_destroy ((chop_object_t *) store);
+
+  /* Pretend the process died before writing a new checkpoint, while
+     writing the last block.  */
+  {
+    int fd;
+
+    fd = open (CHECKPOINT_NAME, O_WRONLY | O_TRUNC);
+    test_assert (fd >= 0);
+    test_assert (write (fd, checkpoint, checkpoint_size)
+		 == (ssize_t) checkpoint_size);
+    close (fd);
+    free (checkpoint);
+  }
+
+  count_segments (&before, last);
+  {
+    struct stat st;
+
+    test_assert (stat (last, &st) == 0);
+    test_assert (truncate (last, st.st_size - sizes[BLOCK_COUNT - 1] / 2
+			   - 1) == 0);
+    present[BLOCK_COUNT - 1] = false;
+  }
+
+  open_store (store);
+  check_blocks (store);
+  chop_object_destroy ((chop_object_t *) store);
+  test_stage_result (1);
+
+  test_stage ("compaction");
+  open_store (store);
+  for (i = 0; i < BLOCK_COUNT; i += 2)
+    if (present[i])
+      delete_block (store, i);
+
+  segments = count_segments (&before, NULL);
+  err = chop_log_store_compact (store, 30);
+  test_check_errcode (err, "compacting store");
+  check_blocks (store);
+
+  test_debug ("%zu segments, %zu bytes before compaction; "
+	      "%zu segments, %zu bytes after",
+	      segments, before, count_segments (&after, NULL), after);
+  test_assert (after < 2 * before / 3);
+
+  /* Blocks copied by the compactor can themselves be compacted.  */
+  for (i = 1; i < BLOCK_COUNT; i += 4)
+    if (present[i])
+      delete_block (store, i);
+  err = chop_log_store_compact (store, 0);
+  test_check_errcode (err, "compacting store again");
+  check_blocks (store);
+  chop_object_destroy ((chop_object_t *) store);
+
+  open_store (store);
+  check_blocks (store);
+  chop_object_destroy ((chop_object_t *) store);
+  test_stage_result (1);
+
+  test_stage ("replaying compacted segments");
+  test_remove_directory (STORE_DIR_NAME);
+  test_assert (mkdir (STORE_DIR_NAME, S_IRWXU) == 0);
+  memset (present, 0, sizeof (present));
+
+  /* Delete a block of the first segment, and make the segment holding the
+     tombstone almost entirely dead so that it is compacted, unlike the
+     first one.  */
+  open_store (store);
+  write_blocks (store, 0, BLOCK_COUNT / 2);
+  write_blocks (store, BLOCK_COUNT / 2, BLOCK_COUNT);
+  delete_block (store, 0);
+  write_blocks (store, BLOCK_COUNT / 2, BLOCK_COUNT);
+  write_blocks (store, BLOCK_COUNT / 2, BLOCK_COUNT);
+
+  err = chop_log_store_compact (store, 50);
+  test_check_errcode (err, "compacting store");
+  check_blocks (store);
+  chop_object_destroy ((chop_object_t *) store);
+
+  /* Without a checkpoint every segment is replayed: the tombstone kept by
+     the compactor must still hide the block of the first segment.  */
+  test_assert (unlink (CHECKPOINT_NAME) == 0);
+  open_store (store);
+  check_blocks (store);
+  chop_object_destroy ((chop_object_t *) store);
+  test_stage_result (1);
+
+  test_stage ("rejecting a truncated older segment");
+  {
+    static const char first[] = STORE_DIR_NAME "/segment-00000000.log";
+    struct stat st;
+    int dir_fd;
+
+    /* Only the newest segment may have been cut short by a crash: a
+       record missing from an older one must not be silently dropped.  */
+    test_assert (unlink (CHECKPOINT_NAME) == 0);
+    count_segments (&before, last);
+    test_assert (strcmp (first, last) != 0);
+    test_assert (stat (first, &st) == 0);
+    test_assert (truncate (first, st.st_size - 1) == 0);
+
+    dir_fd = open (STORE_DIR_NAME, O_RDONLY | O_DIRECTORY);
+    test_assert (dir_fd >= 0);
+    err = chop_log_store_open (dir_fd, 1, SEGMENT_SIZE, store);
+    test_assert (err == CHOP_DESERIAL_CORRUPT_INPUT);
+
+    test_assert (stat (first, &st) == 0);
+    count_segments (&after, NULL);
+    test_assert (after == before - 1);
+  }
+  test_stage_result (1);
+
+  test_remove_directory (STORE_DIR_NAME);
+
+  return 0;
+}
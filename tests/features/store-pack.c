@@ -0,0 +1,308 @@
+/* libchop -- a utility library for distributed storage and data backup
+   Copyright (C) 2026  Ludovic Courtès <ludo@gnu.org>
+
+   Libchop is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Libchop is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with libchop.  If not, see <http://www.gnu.org/licenses/>.  */
+
+/* Check that the pack block store returns the blocks written to it, across
+   several packs, after being reopened, and after a crash that left a pack
+   without an index, and that it rejects corrupt indices.  */
+
+#include <chop/chop-config.h>
+
+#include <alloca.h>
+
+#include <chop/chop.h>
+#include <chop/stores.h>
+
+#include <testsuite.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+
+#define STORE_DIR_NAME  ",,t-store-pack.d"
+
+#define BLOCK_COUNT   500
+#define KEY_SIZE      20
+#define MAX_SIZE      3000
+
+/* Small packs, so that blocks are spread over many of them.  */
+#define PACK_SIZE     (64 * 1024)
+
+
+static char keys[BLOCK_COUNT][KEY_SIZE];
+static char blocks[BLOCK_COUNT][MAX_SIZE];
+static size_t sizes[BLOCK_COUNT];
+
+static chop_block_key_t block_keys[BLOCK_COUNT];
+
+
+
+/* Return the number of files in the store directory whose name ends in
+   SUFFIX.  */
+static size_t
+count_files (const char *suffix)
+{
+  DIR *dir;
+  struct dirent *entry;
+  size_t count = 0;
+
+  dir = opendir (STORE_DIR_NAME);
+  test_assert (dir != NULL);
+
+  while ((entry = readdir (dir)) != NULL)
+    {
+      size_t len = strlen (entry->d_name);
+
+      if (len > strlen (suffix)
+	  && !strcmp (entry->d_name + len - strlen (suffix), suffix))
+	count++;
+    }
+  closedir (dir);
+
+  return count;
+}
+
+static chop_block_store_t *
+open_store (chop_block_store_t *store)
+{
+  chop_error_t err;
+  int dir_fd;
+
+  dir_fd = open (STORE_DIR_NAME, O_RDONLY | O_DIRECTORY);
+  test_assert (dir_fd >= 0);
+
+  err = chop_pack_store_open (dir_fd, 1, PACK_SIZE, store);
+  test_check_errcode (err, "opening pack store");
+
+  return store;
+}
+
+/* Check that STORE contains blocks FIRST to LAST (excluded) and nothing
+   else.  */
+static void
+check_blocks (chop_block_store_t *store, size_t first, size_t last)
+{
+  chop_error_t err;
+  chop_buffer_t buffer;
+  chop_block_iterator_t *it;
+  bool exists[BLOCK_COUNT], found[BLOCK_COUNT];
+  size_t i, size, count;
+
+  chop_buffer_init (&buffer, MAX_SIZE);
+
+  err = chop_store_blocks_exist (store, BLOCK_COUNT, block_keys, exists);
+  test_check_errcode (err, "checking block existence");
+
+  for (i = 0; i < BLOCK_COUNT; i++)
+    {
+      test_assert (exists[i] == (i >= first && i < last));
+
+      err = chop_store_read_block (store, &block_keys[i], &buffer, &size);
+      if (exists[i])
+	{
+	  test_check_errcode (err, "reading block");
+	  test_assert (size == sizes[i]);
+	  test_assert (!memcmp (chop_buffer_content (&buffer), blocks[i],
+				size));
+	}
+      else
+	test_assert (err == CHOP_STORE_BLOCK_UNAVAIL);
+    }
+
+  /* Each block must be visited exactly once.  */
+  memset (found, 0, sizeof (found));
+  it = chop_class_alloca_instance (chop_store_iterator_class (store));
+  for (err = chop_store_first_block (store, it), count = 0;
+       err == 0;
+       err = chop_block_iterator_next (it), count++)
+    {
+      const chop_block_key_t *key = chop_block_iterator_key (it);
+
+      for (i = first; i < last; i++)
+	if (chop_block_key_equal (key, &block_keys[i]))
+	  break;
+
+      test_assert (i < last);
+      test_assert (!found[i]);
+      found[i] = true;
+    }
+
+  test_assert (err == CHOP_STORE_END);
+  test_assert (count == last - first);
+  if (count > 0)
+    chop_object_destroy ((chop_object_t *) it);
+
+  chop_buffer_return (&buffer);
+}
+
+static void
+write_blocks (chop_block_store_t *store, size_t first, size_t last)
+{
+  chop_error_t err;
+  size_t i;
+
+  for (i = first; i < last; i++)
+    {
+      err = chop_store_write_block (store, &block_keys[i], blocks[i],
+				    sizes[i]);
+      test_check_errcode (err, "writing block");
+    }
+}
+
+int
+main (int argc, char *argv[])
+{
+  chop_error_t err;
+  chop_block_store_t *store;
+  size_t i, packs;
+  char name[256];
+
+  test_init (argv[0]);
+  test_init_random_seed ();
+
+  err = chop_init ();
+  test_check_errcode (err, "initializing libchop");
+
+  test_remove_directory (STORE_DIR_NAME);
+  test_assert (mkdir (STORE_DIR_NAME, S_IRWXU) == 0);
+
+  test_randomize_input ((char *) keys, sizeof (keys));
+  test_randomize_input ((char *) blocks, sizeof (blocks));
+  for (i = 0; i < BLOCK_COUNT; i++)
+    {
+      sizes[i] = random () % MAX_SIZE;
+      chop_block_key_init (&block_keys[i], keys[i], KEY_SIZE, NULL, NULL);
+    }
+
+  /* Give a few keys the same first bytes so that index prefixes alone
+     cannot tell them apart.  */
+  for (i = 0; i < 10; i++)
+    {
+      memcpy (keys[i], keys[0], KEY_SIZE - 1);
+      keys[i][KEY_SIZE - 1] = i;
+    }
+
+  store = chop_class_alloca_instance ((chop_class_t *)
+				      &chop_pack_block_store_class);
+
+  test_stage ("writing blocks");
+  open_store (store);
+  check_blocks (store, 0, 0);
+  write_blocks (store, 0, BLOCK_COUNT / 2);
+  check_blocks (store, 0, BLOCK_COUNT / 2);
+
+  err = chop_store_delete_block (store, &block_keys[0]);
+  test_assert (err == CHOP_ERR_NOT_IMPL);
+
+  chop_object_destroy ((chop_object_t *) store);
+
+  packs = count_files (".pack");
+  test_debug ("%zu packs", packs);
+  test_assert (packs > 1);
+  test_assert (count_files (".idx") == packs);
+  test_stage_result (1);
+
+  test_stage ("reopening the store");
+  open_store (store);
+  check_blocks (store, 0, BLOCK_COUNT / 2);
+
+  /* Overwrite a few blocks; the new contents win.  */
+  for (i = 0; i < 10; i++)
+    {
+      test_randomize_input (blocks[i], MAX_SIZE);
+      sizes[i] = random () % MAX_SIZE;
+    }
+  write_blocks (store, 0, 10);
+  write_blocks (store, BLOCK_COUNT / 2, 3 * BLOCK_COUNT / 4);
+  check_blocks (store, 0, 3 * BLOCK_COUNT / 4);
+
+  err = chop_store_sync (store);
+  test_check_errcode (err, "syncing store");
+  chop_object_destroy ((chop_object_t *) store);
+
+  open_store (store);
+  check_blocks (store, 0, 3 * BLOCK_COUNT / 4);
+  test_stage_result (1);
+
+  test_stage ("recovering a pack without an index");
+  write_blocks (store, 3 * BLOCK_COUNT / 4, BLOCK_COUNT);
+  chop_object_destroy ((chop_object_t *) store);
+
+  /* Pretend the last pack was being written when the process died: remove
+     its index and cut its last record in half.  */
+  packs = count_files (".pack");
+  snprintf (name, sizeof (name), "%s/pack-%08zx.idx", STORE_DIR_NAME,
+	    packs - 1);
+  test_assert (unlink (name) == 0);
+  snprintf (name, sizeof (name), "%s/pack-%08zx.pack", STORE_DIR_NAME,
+	    packs - 1);
+  {
+    struct stat st;
+
+    test_assert (stat (name, &st) == 0);
+    test_assert (truncate (name, st.st_size - sizes[BLOCK_COUNT - 1] / 2
+			   - 1) == 0);
+  }
+
+  open_store (store);
+  test_assert (count_files (".idx") == packs);
+  check_blocks (store, 0, BLOCK_COUNT - 1);
+  chop_object_destroy ((chop_object_t *) store);
+  test_stage_result (1);
+
+  test_stage ("rejecting an index with a bad fanout table");
+  snprintf (name, sizeof (name), "%s/pack-%08x.idx", STORE_DIR_NAME, 0);
+  {
+    unsigned char count[4], fanout[4];
+    uint32_t bogus;
+    int fd, dir_fd;
+
+    fd = open (name, O_RDWR);
+    test_assert (fd >= 0);
+
+    /* Have the first fanout entry exceed the entry count.  */
+    test_assert (pread (fd, count, sizeof (count), 8) == sizeof (count));
+    test_assert (pread (fd, fanout, sizeof (fanout), 16) == sizeof (fanout));
+    bogus = (count[0] | (count[1] << 8) | (count[2] << 16)
+	     | ((uint32_t) count[3] << 24)) + 1;
+    count[0] = bogus, count[1] = bogus >> 8;
+    count[2] = bogus >> 16, count[3] = bogus >> 24;
+    test_assert (pwrite (fd, count, sizeof (count), 16) == sizeof (count));
+
+    dir_fd = open (STORE_DIR_NAME, O_RDONLY | O_DIRECTORY);
+    test_assert (dir_fd >= 0);
+    err = chop_pack_store_open (dir_fd, 1, PACK_SIZE, store);
+    test_assert (err == CHOP_DESERIAL_CORRUPT_INPUT);
+
+    test_assert (pwrite (fd, fanout, sizeof (fanout), 16) == sizeof (fanout));
+    close (fd);
+  }
+
+  open_store (store);
+  check_blocks (store, 0, BLOCK_COUNT - 1);
+  chop_object_destroy ((chop_object_t *) store);
+  test_stage_result (1);
+
+  test_remove_directory (STORE_DIR_NAME);
+
+  return 0;
+}
@@ -0,0 +1,220 @@
+/* libchop -- a utility library for distributed storage and data backup
+   Copyright (C) 2026  Ludovic Courtès <ludo@gnu.org>
+
+   Libchop is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Libchop is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with libchop.  If not, see <http://www.gnu.org/licenses/>.  */
+
+/* Check that the smart block store only asks its backend about blocks it
+   does not know about, be it because it wrote them, because it seeded its
+   set of known keys, or because its Bloom filter says they were never
+   written.  */
+
+#include <chop/chop-config.h>
+
+#include <alloca.h>
+
+#include <chop/chop.h>
+#include <chop/stores.h>
+#include <chop/logs.h>
+
+#include <testsuite.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+
+#define STORE_FILE_NAME  ",,t-store-smart-cache.db"
+#define BLOOM_FILE_NAME  ",,t-store-smart-cache.bloom"
+
+#define BLOCK_COUNT   300
+#define KEY_SIZE      20
+#define BLOCK_SIZE    100
+
+
+static char keys[2 * BLOCK_COUNT][KEY_SIZE];
+static char blocks[2 * BLOCK_COUNT][BLOCK_SIZE];
+static chop_block_key_t block_keys[2 * BLOCK_COUNT];
+
+/* The number of calls to the backend's methods.  */
+static size_t exist_calls, write_calls;
+
+static chop_block_store_t *backend, *debugger;
+
+
+
+/* Count calls to the backend by looking at the messages of the dummy
+   proxy.  */
+static void
+count_calls (chop_log_t *log, const char *fmt, va_list ap)
+{
+  if (!strncmp (fmt, "dummy: blocks_exist (", 21))
+    exist_calls++;
+  else if (!strncmp (fmt, "dummy: write_block (", 20))
+    write_calls++;
+}
+
+static chop_block_store_t *
+open_smart_store (chop_block_store_t *store)
+{
+  chop_error_t err;
+
+  err = chop_smart_block_store_open (debugger, CHOP_PROXY_LEAVE_AS_IS,
+				     store);
+  test_check_errcode (err, "opening smart store");
+
+  exist_calls = write_calls = 0;
+
+  return store;
+}
+
+static void
+write_blocks (chop_block_store_t *store, size_t first, size_t last)
+{
+  chop_error_t err;
+  size_t i;
+
+  for (i = first; i < last; i++)
+    {
+      err = chop_store_write_block (store, &block_keys[i], blocks[i],
+				    BLOCK_SIZE);
+      test_check_errcode (err, "writing block");
+    }
+}
+
+int
+main (int argc, char *argv[])
+{
+  chop_error_t err;
+  chop_block_store_t *store;
+  bool exists[BLOCK_COUNT];
+  size_t i;
+
+  test_init (argv[0]);
+  test_init_random_seed ();
+
+  err = chop_init ();
+  test_check_errcode (err, "initializing libchop");
+
+  unlink (STORE_FILE_NAME);
+  unlink (BLOOM_FILE_NAME);
+
+  test_randomize_input ((char *) keys, sizeof (keys));
+  test_randomize_input ((char *) blocks, sizeof (blocks));
+  for (i = 0; i < 2 * BLOCK_COUNT; i++)
+    chop_block_key_init (&block_keys[i], keys[i], KEY_SIZE, NULL, NULL);
+
+  backend = chop_class_alloca_instance ((chop_class_t *)
+					&chop_gdbm_block_store_class);
+  err = chop_file_based_store_open (&chop_gdbm_block_store_class,
+				    STORE_FILE_NAME,
+				    O_RDWR | O_CREAT, S_IRUSR | S_IWUSR,
+				    backend);
+  test_check_errcode (err, "opening store");
+
+  debugger = chop_class_alloca_instance (&chop_dummy_block_store_class);
+  chop_dummy_proxy_block_store_open ("backend", backend, debugger);
+  chop_log_attach_to_user (chop_dummy_block_store_log (debugger),
+			   count_calls, NULL, NULL, NULL);
+
+  store = chop_class_alloca_instance (&chop_smart_block_store_class);
+
+  test_stage ("known keys");
+  open_smart_store (store);
+  write_blocks (store, 0, BLOCK_COUNT);
+  test_assert (exist_calls == BLOCK_COUNT);
+  test_assert (write_calls == BLOCK_COUNT);
+
+  exist_calls = write_calls = 0;
+  write_blocks (store, 0, BLOCK_COUNT);
+  err = chop_store_blocks_exist (store, BLOCK_COUNT, block_keys, exists);
+  test_check_errcode (err, "checking block existence");
+  for (i = 0; i < BLOCK_COUNT; i++)
+    test_assert (exists[i]);
+  test_assert (exist_calls == 0);
+  test_assert (write_calls == 0);
+
+  /* Only the unknown keys are looked up, in a single call.  */
+  err = chop_store_blocks_exist (store, BLOCK_COUNT,
+				 block_keys + BLOCK_COUNT / 2, exists);
+  test_check_errcode (err, "checking block existence");
+  for (i = 0; i < BLOCK_COUNT; i++)
+    test_assert (exists[i] == (i < BLOCK_COUNT / 2));
+  test_assert (exist_calls == 1);
+
+  /* Deleted blocks are written again.  */
+  for (i = 0; i < 10; i++)
+    {
+      err = chop_store_delete_block (store, &block_keys[i]);
+      test_check_errcode (err, "deleting block");
+    }
+  exist_calls = write_calls = 0;
+  write_blocks (store, 0, BLOCK_COUNT);
+  test_assert (exist_calls == 10);
+  test_assert (write_calls == 10);
+
+  chop_object_destroy ((chop_object_t *) store);
+  test_stage_result (1);
+
+  test_stage ("seeding known keys");
+  open_smart_store (store);
+  err = chop_smart_block_store_seed (store);
+  test_check_errcode (err, "seeding smart store");
+
+  exist_calls = write_calls = 0;
+  write_blocks (store, 0, BLOCK_COUNT);
+  test_assert (exist_calls == 0);
+  test_assert (write_calls == 0);
+
+  chop_object_destroy ((chop_object_t *) store);
+  test_stage_result (1);
+
+  test_stage ("Bloom filter");
+  open_smart_store (store);
+  err = chop_smart_block_store_open_bloom_filter (store, BLOOM_FILE_NAME,
+						  2 * BLOCK_COUNT);
+  test_check_errcode (err, "opening Bloom filter");
+
+  /* These blocks were never written, and most of them are known not to
+     be in the Bloom filter.  */
+  write_blocks (store, BLOCK_COUNT, 2 * BLOCK_COUNT);
+  test_debug ("%zu false positives", exist_calls);
+  test_assert (exist_calls < BLOCK_COUNT / 10);
+  test_assert (write_calls == BLOCK_COUNT);
+
+  err = chop_store_sync (store);
+  test_check_errcode (err, "syncing smart store");
+  chop_object_destroy ((chop_object_t *) store);
+
+  /* Blocks found in the Bloom filter of a new smart store are looked up
+     on the backend, but not written again.  */
+  open_smart_store (store);
+  err = chop_smart_block_store_open_bloom_filter (store, BLOOM_FILE_NAME,
+						  2 * BLOCK_COUNT);
+  test_check_errcode (err, "reopening Bloom filter");
+
+  write_blocks (store, BLOCK_COUNT, 2 * BLOCK_COUNT);
+  test_assert (exist_calls == BLOCK_COUNT);
+  test_assert (write_calls == 0);
+
+  chop_object_destroy ((chop_object_t *) store);
+  test_stage_result (1);
+
+  chop_object_destroy ((chop_object_t *) debugger);
+  chop_object_destroy ((chop_object_t *) backend);
+  unlink (STORE_FILE_NAME);
+  unlink (BLOOM_FILE_NAME);
+
+  return 0;
+}
@@ -0,0 +1,182 @@
+/* libchop -- a utility library for distributed storage and data backup
+   Copyright (C) 2026  Ludovic Courtès <ludo@gnu.org>
+
+   Libchop is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Libchop is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with libchop.  If not, see <http://www.gnu.org/licenses/>.  */
+
+/* Check that asynchronous file streams return the contents of files and
+   pipes, with each back-end and with various queue depths and read
+   sizes.  */
+
+#include <chop/chop-config.h>
+
+#include <alloca.h>
+
+#include <chop/chop.h>
+#include <chop/streams.h>
+
+#include <testsuite.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+
+
+#define FILE_NAME  ",,t-stream-async-file"
+
+#define SIZE_OF_INPUT  (3 * 1024 * 1024 + 777)
+
+
+static char input[SIZE_OF_INPUT];
+
+
+
+/* Write the SIZE first bytes of INPUT to FILE_NAME.  */
+static void
+write_input_file (size_t size)
+{
+  int fd;
+
+  fd = open (FILE_NAME, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+  test_assert (fd >= 0);
+  test_assert (write (fd, input, size) == (ssize_t) size);
+  close (fd);
+}
+
+int
+main (int argc, char *argv[])
+{
+  static const char *const backends[] = { "io_uring", "thread", NULL };
+  static const size_t input_sizes[] =
+    { 0, 1, 4096, 65536, 65537, SIZE_OF_INPUT };
+  static const size_t queue_depths[] = { 1, 2, 7 };
+  static const size_t read_sizes[] = { 4096, 65536, 123457 };
+
+  chop_error_t err;
+  chop_stream_t *stream;
+  const char *const *backend;
+  size_t s, d, r;
+
+  test_init (argv[0]);
+  test_init_random_seed ();
+
+  err = chop_init ();
+  test_check_errcode (err, "initializing libchop");
+
+  test_randomize_input (input, sizeof (input));
+
+  stream = chop_class_alloca_instance (&chop_async_file_stream_class);
+
+  for (backend = &backends[0]; *backend != NULL; backend++)
+    {
+      test_stage ("`%s' back-end", *backend);
+
+      err = chop_async_file_stream_select_backend (*backend);
+      if (err == CHOP_ERR_NOT_IMPL)
+	{
+	  test_stage_result (1);
+	  continue;
+	}
+
+      for (s = 0; s < sizeof (input_sizes) / sizeof (input_sizes[0]); s++)
+	{
+	  write_input_file (input_sizes[s]);
+
+	  for (d = 0; d < sizeof (queue_depths) / sizeof (queue_depths[0]);
+	       d++)
+	    for (r = 0; r < sizeof (read_sizes) / sizeof (read_sizes[0]); r++)
+	      {
+		err = chop_async_file_stream_open (FILE_NAME, queue_depths[d],
+						   read_sizes[r], stream);
+		test_check_errcode (err, "opening stream");
+		test_debug ("%zu bytes, depth %zu, reads of %zu bytes, "
+			    "using `%s'", input_sizes[s], queue_depths[d],
+			    read_sizes[r],
+			    chop_async_file_stream_backend (stream));
+
+		test_check_stream_contents (stream, input, input_sizes[s],
+					    77777, NULL);
+		chop_object_destroy ((chop_object_t *) stream);
+	      }
+	}
+
+      /* Start at an arbitrary offset of the file, with default
+	 parameters.  */
+      {
+	int fd;
+	size_t start;
+
+	fd = open (FILE_NAME, O_RDONLY);
+	test_assert (fd >= 0);
+
+	start = random () % SIZE_OF_INPUT;
+	test_assert (lseek (fd, start, SEEK_SET) == (off_t) start);
+
+	err = chop_async_file_stream_open_fd (fd, 1, 0, 0, stream);
+	test_check_errcode (err, "opening stream from file descriptor");
+	test_check_stream_contents (stream, input + start,
+				    SIZE_OF_INPUT - start, 77777, NULL);
+	chop_object_destroy ((chop_object_t *) stream);
+      }
+
+      test_stage_result (1);
+    }
+
+  test_stage ("pipes");
+  {
+    int fds[2], status;
+    pid_t child;
+
+    test_assert (pipe (fds) == 0);
+
+    child = fork ();
+    test_assert (child >= 0);
+    if (child == 0)
+      {
+	size_t offset;
+
+	/* Write INPUT in small pieces.  */
+	close (fds[0]);
+	for (offset = 0; offset < sizeof (input); offset += 7777)
+	  {
+	    size_t size = sizeof (input) - offset;
+
+	    if (size > 7777)
+	      size = 7777;
+
+	    if (write (fds[1], input + offset, size) != (ssize_t) size)
+	      exit (EXIT_FAILURE);
+	  }
+
+	exit (EXIT_SUCCESS);
+      }
+
+    close (fds[1]);
+    err = chop_async_file_stream_open_fd (fds[0], 1, 3, 65536, stream);
+    test_check_errcode (err, "opening stream from pipe");
+    test_assert (!strcmp (chop_async_file_stream_backend (stream), "thread"));
+
+    test_check_stream_contents (stream, input, sizeof (input), 77777, NULL);
+    chop_object_destroy ((chop_object_t *) stream);
+
+    test_assert (waitpid (child, &status, 0) == child);
+    test_assert (WIFEXITED (status) && WEXITSTATUS (status) == 0);
+  }
+  test_stage_result (1);
+
+  unlink (FILE_NAME);
+
+  return 0;
+}
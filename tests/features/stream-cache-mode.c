@@ -0,0 +1,151 @@
+/* libchop -- a utility library for distributed storage and data backup
+   Copyright (C) 2026  Ludovic Courtès <ludo@gnu.org>
+
+   Libchop is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Libchop is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with libchop.  If not, see <http://www.gnu.org/licenses/>.  */
+
+/* Check that file streams return the contents of files in each page cache
+   mode, including when the mode is changed in the middle of the file.  */
+
+#include <chop/chop-config.h>
+
+#include <alloca.h>
+
+#include <chop/chop.h>
+#include <chop/streams.h>
+
+#include <testsuite.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+
+#define FILE_NAME  ",,t-stream-cache-mode"
+
+#define SIZE_OF_INPUT  (21 * 1024 * 1024 + 777)
+
+
+static char input[SIZE_OF_INPUT];
+
+static const chop_file_stream_cache_mode_t modes[] =
+  {
+    CHOP_FILE_STREAM_CACHED,
+    CHOP_FILE_STREAM_DIRECT,
+    CHOP_FILE_STREAM_DROP_BEHIND
+  };
+
+#define MODE_COUNT  (sizeof (modes) / sizeof (modes[0]))
+
+
+
+/* Randomly change the page cache mode of STREAM.  */
+static void
+switch_cache_mode (chop_stream_t *stream)
+{
+  chop_error_t err;
+
+  if (random () % 50 == 0)
+    {
+      err = chop_file_stream_set_cache_mode (stream,
+					     modes[random () % MODE_COUNT]);
+      if (err != CHOP_ERR_NOT_IMPL)
+	test_check_errcode (err, "changing page cache mode");
+    }
+}
+
+int
+main (int argc, char *argv[])
+{
+  chop_error_t err;
+  chop_stream_t *stream;
+  size_t m, start;
+  int fd;
+
+  test_init (argv[0]);
+  test_init_random_seed ();
+
+  err = chop_init ();
+  test_check_errcode (err, "initializing libchop");
+
+  test_randomize_input (input, sizeof (input));
+
+  fd = open (FILE_NAME, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+  test_assert (fd >= 0);
+  test_assert (write (fd, input, sizeof (input))
+	       == (ssize_t) sizeof (input));
+  close (fd);
+
+  stream = chop_class_alloca_instance (&chop_file_stream_class);
+
+  for (m = 0; m < MODE_COUNT; m++)
+    {
+      test_stage ("mode %i", (int) modes[m]);
+
+      err = chop_file_stream_open (FILE_NAME, stream);
+      test_check_errcode (err, "opening file stream");
+
+      err = chop_file_stream_set_cache_mode (stream, modes[m]);
+      if (err == CHOP_ERR_NOT_IMPL)
+	{
+	  chop_object_destroy ((chop_object_t *) stream);
+	  test_stage_result (1);
+	  continue;
+	}
+
+      test_check_errcode (err, "setting page cache mode");
+      test_debug ("requested mode %i, got mode %i", (int) modes[m],
+		  (int) chop_file_stream_cache_mode (stream));
+      if (modes[m] != CHOP_FILE_STREAM_DIRECT)
+	test_assert (chop_file_stream_cache_mode (stream) == modes[m]);
+
+      test_check_stream_contents (stream, input, sizeof (input), 777777, NULL);
+      chop_object_destroy ((chop_object_t *) stream);
+
+      /* Start at an arbitrary offset of the file.  */
+      fd = open (FILE_NAME, O_RDONLY);
+      test_assert (fd >= 0);
+
+      start = random () % sizeof (input);
+      test_assert (lseek (fd, start, SEEK_SET) == (off_t) start);
+
+      err = chop_file_stream_open_fd (fd, 1, stream);
+      test_check_errcode (err, "opening file stream from file descriptor");
+
+      err = chop_file_stream_set_cache_mode (stream, modes[m]);
+      test_check_errcode (err, "setting page cache mode");
+
+      test_check_stream_contents (stream, input + start,
+				  sizeof (input) - start, 777777, NULL);
+      chop_object_destroy ((chop_object_t *) stream);
+
+      test_stage_result (1);
+    }
+
+  test_stage ("changing modes");
+  for (m = 0; m < 3; m++)
+    {
+      err = chop_file_stream_open (FILE_NAME, stream);
+      test_check_errcode (err, "opening file stream");
+
+      test_check_stream_contents (stream, input, sizeof (input), 777777,
+				  switch_cache_mode);
+      chop_object_destroy ((chop_object_t *) stream);
+    }
+  test_stage_result (1);
+
+  unlink (FILE_NAME);
+
+  return 0;
+}
@@ -0,0 +1,372 @@
+/* libchop -- a utility library for distributed storage and data backup
+   Copyright (C) 2026  Ludovic Courtès <ludo@gnu.org>
+
+   Libchop is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Libchop is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with libchop.  If not, see <http://www.gnu.org/licenses/>.  */
+
+/* Check that `chop_stream_peek ()' and `chop_stream_consume ()' return
+   the right data when interleaved with `chop_stream_read ()', including
+   for files larger than the window mapped by file streams.  Then make sure
+   choppers return the same blocks whether or not their input stream
+   supports peeking.  Last, make sure that chopping a file that gets
+   truncated fails cleanly when the file is not mapped.  */
+
+#include <chop/chop-config.h>
+
+#include <alloca.h>
+
+#include <chop/chop.h>
+#include <chop/streams.h>
+#include <chop/choppers.h>
+#include <chop/filters.h>
+
+#include <testsuite.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+
+#define FILE_NAME  ",,t-stream-peek"
+
+/* Larger than the window of file streams.  */
+#define SIZE_OF_INPUT           (20 * 1024 * 1024 + 777)
+
+/* Input size for filtered streams.  */
+#define SIZE_OF_FILTERED_INPUT  (4 * 1024 * 1024 + 77)
+
+#define MAX_BLOCK_COUNT         (SIZE_OF_INPUT / 32)
+
+/* Block size of the fixed-size chopper used on truncated files.  */
+#define TRUNCATED_BLOCK_SIZE    4096
+
+
+static char input[SIZE_OF_INPUT];
+
+static size_t reference_offsets[MAX_BLOCK_COUNT];
+static size_t offsets[MAX_BLOCK_COUNT];
+
+
+
+/* Initialize UNZIPPED_STREAM as a stack of filtered streams that zip and
+   unzip the first SIZE bytes of INPUT read from MEM_STREAM, using
+   ZIP_FILTER and UNZIP_FILTER.  Their peek buffers are smaller than
+   INPUT.  */
+static void
+open_filtered_stream (size_t size, chop_stream_t *mem_stream,
+		      chop_filter_t *zip_filter,
+		      chop_stream_t *zipped_stream,
+		      chop_filter_t *unzip_filter,
+		      chop_stream_t *unzipped_stream)
+{
+  chop_error_t err;
+
+  chop_mem_stream_open (input, size, NULL, mem_stream);
+
+  err = chop_zlib_zip_filter_init (-1, 0, zip_filter);
+  test_check_errcode (err, "initializing zip filter");
+
+  err = chop_filtered_stream_open (mem_stream, CHOP_PROXY_EVENTUALLY_DESTROY,
+				   zip_filter, 1, zipped_stream);
+  test_check_errcode (err, "initializing zip-filtered stream");
+
+  err = chop_zlib_unzip_filter_init (0, unzip_filter);
+  test_check_errcode (err, "initializing unzip filter");
+
+  err = chop_filtered_stream_open (zipped_stream,
+				   CHOP_PROXY_EVENTUALLY_DESTROY,
+				   unzip_filter, 1, unzipped_stream);
+  test_check_errcode (err, "initializing unzip-filtered stream");
+}
+
+/* Chop STREAM with a chopper of class CLASS, alternating between
+   `chop_chopper_read_block_view ()' and `chop_chopper_find_boundaries ()',
+   and store the end offset of each block in OFFSETS.  STREAM must contain
+   the first SIZE bytes of INPUT.  Return the number of blocks.  */
+static size_t
+chop_stream (const chop_chopper_class_t *class, chop_stream_t *stream,
+	     size_t size, size_t *offsets)
+{
+  chop_error_t err;
+  chop_chopper_t *chopper;
+  chop_buffer_t buffer;
+  size_t total = 0, count = 0, calls = 0;
+
+  chopper = chop_class_alloca_instance ((chop_class_t *) class);
+
+  /* Choose large blocks so that they often span several regions returned
+     by `chop_stream_peek ()'.  */
+  if (class == &chop_fixed_size_chopper_class)
+    err = chop_fixed_size_chopper_init (stream, 4096, 0, chopper);
+  else if (class == &chop_anchor_based_chopper_class)
+    err = chop_anchor_based_chopper_init (stream, 48, 65535, 48, 0,
+					  chopper);
+  else
+    err = chop_fastcdc_chopper_init (stream, 16384, 65536, 262144,
+				     chopper);
+  test_check_errcode (err, "initializing chopper");
+
+  err = chop_buffer_init (&buffer, chop_chopper_typical_block_size (chopper));
+  test_check_errcode (err, "allocating buffer");
+
+  do
+    {
+      const char *region;
+      chop_block_span_t blocks[16];
+      size_t block_count = 1, i;
+
+      if (calls++ % 2)
+	err = chop_chopper_find_boundaries (chopper, &buffer, &region,
+					    blocks, 16, &block_count);
+      else
+	{
+	  err = chop_chopper_read_block_view (chopper, &buffer, &region,
+					      &blocks[0].size);
+	  blocks[0].offset = 0;
+	}
+
+      test_assert ((!err) || (err == CHOP_STREAM_END));
+
+      for (i = 0; (!err) && (i < block_count); i++)
+	{
+	  test_assert (blocks[i].size > 0);
+	  test_assert (!memcmp (region + blocks[i].offset, input + total,
+				blocks[i].size));
+
+	  total += blocks[i].size;
+	  test_assert (count < MAX_BLOCK_COUNT);
+	  offsets[count++] = total;
+	}
+    }
+  while (!err);
+
+  test_assert (total == size);
+
+  chop_buffer_return (&buffer);
+  chop_object_destroy ((chop_object_t *) chopper);
+
+  return count;
+}
+
+int
+main (int argc, char *argv[])
+{
+  static const chop_chopper_class_t *const chopper_classes[] =
+    {
+      &chop_fixed_size_chopper_class,
+      &chop_anchor_based_chopper_class,
+      &chop_fastcdc_chopper_class,
+      NULL
+    };
+
+  chop_error_t err;
+  chop_stream_t *mem_stream, *file_stream, *sub_stream;
+  chop_stream_t *zipped_stream, *unzipped_stream;
+  chop_filter_t *zip_filter, *unzip_filter;
+  const chop_chopper_class_t *const *class;
+  size_t start;
+  int fd;
+
+  test_init (argv[0]);
+  test_init_random_seed ();
+
+  err = chop_init ();
+  test_check_errcode (err, "initializing libchop");
+
+  test_randomize_input (input, sizeof (input));
+
+  unlink (FILE_NAME);
+  fd = open (FILE_NAME, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+  test_assert (fd >= 0);
+  test_assert (write (fd, input, sizeof (input)) == sizeof (input));
+
+  mem_stream = chop_class_alloca_instance (&chop_mem_stream_class);
+  file_stream = chop_class_alloca_instance (&chop_file_stream_class);
+  sub_stream = chop_class_alloca_instance (&chop_sub_stream_class);
+  zipped_stream = chop_class_alloca_instance (&chop_filtered_stream_class);
+  unzipped_stream = chop_class_alloca_instance (&chop_filtered_stream_class);
+  zip_filter = chop_class_alloca_instance ((chop_class_t *)
+					   &chop_zlib_zip_filter_class);
+  unzip_filter = chop_class_alloca_instance ((chop_class_t *)
+					     &chop_zlib_unzip_filter_class);
+
+  test_stage ("memory streams");
+  chop_mem_stream_open (input, sizeof (input), NULL, mem_stream);
+  test_check_stream_contents (mem_stream, input, sizeof (input), 7777, NULL);
+  chop_object_destroy ((chop_object_t *) mem_stream);
+  test_stage_result (1);
+
+  test_stage ("file streams");
+  err = chop_file_stream_open (FILE_NAME, file_stream);
+  test_check_errcode (err, "opening file stream");
+  {
+    const char *data;
+    size_t size;
+
+    /* Files are not mapped by default.  */
+    err = chop_stream_peek (file_stream, &data, &size);
+    test_assert (err == CHOP_ERR_NOT_IMPL);
+  }
+  test_check_stream_contents (file_stream, input, sizeof (input), 7777, NULL);
+  chop_object_destroy ((chop_object_t *) file_stream);
+
+  err = chop_file_stream_open (FILE_NAME, file_stream);
+  test_check_errcode (err, "opening file stream");
+  err = chop_file_stream_enable_mapping (file_stream, 1);
+  test_check_errcode (err, "mapping file stream");
+  test_check_stream_contents (file_stream, input, sizeof (input), 7777, NULL);
+  chop_object_destroy ((chop_object_t *) file_stream);
+
+  /* Start at an arbitrary offset of the file.  */
+  start = random () % sizeof (input);
+  test_assert (lseek (fd, start, SEEK_SET) == (off_t) start);
+  err = chop_file_stream_open_fd (fd, 0, file_stream);
+  test_check_errcode (err, "opening file stream from file descriptor");
+  err = chop_file_stream_enable_mapping (file_stream, 1);
+  test_check_errcode (err, "mapping file stream");
+  test_check_stream_contents (file_stream, input + start,
+			      sizeof (input) - start, 7777, NULL);
+  chop_object_destroy ((chop_object_t *) file_stream);
+  test_stage_result (1);
+
+  test_stage ("sub-streams");
+  err = chop_file_stream_open (FILE_NAME, file_stream);
+  test_check_errcode (err, "opening file stream");
+  err = chop_file_stream_enable_mapping (file_stream, 1);
+  test_check_errcode (err, "mapping file stream");
+  start = random () % sizeof (input);
+  err = chop_sub_stream_open (file_stream, CHOP_PROXY_LEAVE_AS_IS, start,
+			      sub_stream);
+  test_check_errcode (err, "opening sub-stream");
+  test_check_stream_contents (sub_stream, input, start, 7777, NULL);
+  chop_object_destroy ((chop_object_t *) sub_stream);
+  test_check_stream_contents (file_stream, input + start,
+			      sizeof (input) - start, 7777, NULL);
+  chop_object_destroy ((chop_object_t *) file_stream);
+  test_stage_result (1);
+
+  test_stage ("filtered streams");
+  open_filtered_stream (SIZE_OF_FILTERED_INPUT, mem_stream,
+			zip_filter, zipped_stream,
+			unzip_filter, unzipped_stream);
+  test_check_stream_contents (unzipped_stream, input, SIZE_OF_FILTERED_INPUT,
+			      7777, NULL);
+  chop_object_destroy ((chop_object_t *) unzipped_stream);
+  test_stage_result (1);
+
+  for (class = &chopper_classes[0]; *class != NULL; class++)
+    {
+      size_t reference_count, count;
+
+      test_stage ("`%s' with and without peeking",
+		  chop_class_name ((chop_class_t *) *class));
+
+      /* A memory stream that doesn't support peeking.  */
+      chop_mem_stream_open (input, sizeof (input), NULL, mem_stream);
+      mem_stream->peek = NULL;
+      reference_count = chop_stream (*class, mem_stream, sizeof (input),
+				     reference_offsets);
+      chop_object_destroy ((chop_object_t *) mem_stream);
+      test_debug ("%zu blocks", reference_count);
+
+      chop_mem_stream_open (input, sizeof (input), NULL, mem_stream);
+      count = chop_stream (*class, mem_stream, sizeof (input), offsets);
+      chop_object_destroy ((chop_object_t *) mem_stream);
+      test_assert (count == reference_count);
+      test_assert (!memcmp (offsets, reference_offsets,
+			    count * sizeof (offsets[0])));
+
+      err = chop_file_stream_open (FILE_NAME, file_stream);
+      test_check_errcode (err, "opening file stream");
+      err = chop_file_stream_enable_mapping (file_stream, 1);
+      test_check_errcode (err, "mapping file stream");
+      count = chop_stream (*class, file_stream, sizeof (input), offsets);
+      chop_object_destroy ((chop_object_t *) file_stream);
+      test_assert (count == reference_count);
+      test_assert (!memcmp (offsets, reference_offsets,
+			    count * sizeof (offsets[0])));
+
+      /* Filtered streams return smaller regions, which exercises the case
+	 where the end of a block is not within the peeked region.  */
+      chop_mem_stream_open (input, SIZE_OF_FILTERED_INPUT, NULL, mem_stream);
+      mem_stream->peek = NULL;
+      reference_count = chop_stream (*class, mem_stream,
+				     SIZE_OF_FILTERED_INPUT,
+				     reference_offsets);
+      chop_object_destroy ((chop_object_t *) mem_stream);
+
+      open_filtered_stream (SIZE_OF_FILTERED_INPUT, mem_stream,
+			    zip_filter, zipped_stream,
+			    unzip_filter, unzipped_stream);
+      count = chop_stream (*class, unzipped_stream, SIZE_OF_FILTERED_INPUT,
+			   offsets);
+      chop_object_destroy ((chop_object_t *) unzipped_stream);
+      test_assert (count == reference_count);
+      test_assert (!memcmp (offsets, reference_offsets,
+			    count * sizeof (offsets[0])));
+
+      test_stage_result (1);
+    }
+
+  test_stage ("file truncated while being chopped");
+  {
+    chop_chopper_t *chopper;
+    chop_buffer_t buffer;
+    size_t size, total = 0;
+
+    err = chop_file_stream_open (FILE_NAME, file_stream);
+    test_check_errcode (err, "opening file stream");
+
+    chopper = chop_class_alloca_instance ((chop_class_t *)
+					  &chop_fixed_size_chopper_class);
+    err = chop_fixed_size_chopper_init (file_stream, TRUNCATED_BLOCK_SIZE,
+					0, chopper);
+    test_check_errcode (err, "initializing chopper");
+
+    err = chop_buffer_init (&buffer, TRUNCATED_BLOCK_SIZE);
+    test_check_errcode (err, "allocating buffer");
+
+    err = chop_chopper_read_block (chopper, &buffer, &size);
+    test_check_errcode (err, "reading first block");
+    test_assert (size == TRUNCATED_BLOCK_SIZE);
+    test_assert (!memcmp (chop_buffer_content (&buffer), input, size));
+
+    /* Truncate the file behind the chopper's back, as log rotation
+       would.  Reading must fail or stop rather than crash.  */
+    test_assert (ftruncate (fd, TRUNCATED_BLOCK_SIZE) == 0);
+
+    do
+      {
+	err = chop_chopper_read_block (chopper, &buffer, &size);
+	if (!err)
+	  total += size;
+      }
+    while ((!err) && (total < sizeof (input)));
+
+    test_assert (err != 0);
+    test_assert (total < sizeof (input));
+    test_debug ("got `%s' after %zu more bytes", chop_error_message (err),
+		total);
+
+    chop_buffer_return (&buffer);
+    chop_object_destroy ((chop_object_t *) chopper);
+    chop_object_destroy ((chop_object_t *) file_stream);
+  }
+  test_stage_result (1);
+
+  close (fd);
+  unlink (FILE_NAME);
+
+  return 0;
+}
@@ -0,0 +1,304 @@
+/* libchop -- a utility library for distributed storage and data backup
+   Copyright (C) 2026  Ludovic Courtès <ludo@gnu.org>
+
+   Libchop is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Libchop is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with libchop.  If not, see <http://www.gnu.org/licenses/>.  */
+
+/* Check that the streams returned by the tree indexer yield the same data
+   when data blocks are prefetched, including after seeks, and that a
+   missing data block is reported.  */
+
+#include <chop/chop-config.h>
+
+#include <alloca.h>
+
+#include <chop/chop.h>
+#include <chop/streams.h>
+#include <chop/choppers.h>
+#include <chop/block-indexers.h>
+#include <chop/indexers.h>
+#include <chop/stores.h>
+
+#include <testsuite.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+
+#define DATA_STORE_FILE_NAME      ",,t-stream-prefetch-data.db"
+#define METADATA_STORE_FILE_NAME  ",,t-stream-prefetch-metadata.db"
+
+#define BLOCK_SIZE          1000
+#define INDEXES_PER_BLOCK   20
+
+#define SIZE_OF_INPUT       (2345 * BLOCK_SIZE + 67)
+
+#define SEEK_COUNT          100
+
+
+static char input[SIZE_OF_INPUT];
+
+static chop_block_store_t *data_store, *metadata_store;
+
+
+
+/* Read SIZE bytes from STREAM, in chunks of random size, and check that
+   they match INPUT at OFFSET.  */
+static void
+check_read (chop_stream_t *stream, size_t offset, size_t size)
+{
+  chop_error_t err;
+  char *buffer;
+  size_t total = 0, read;
+
+  if (offset >= sizeof (input))
+    {
+      char c;
+
+      err = chop_stream_read (stream, &c, 1, &read);
+      test_assert (err == CHOP_STREAM_END);
+      return;
+    }
+
+  if (offset + size > sizeof (input))
+    size = sizeof (input) - offset;
+
+  buffer = malloc (size);
+  test_assert (buffer != NULL);
+
+  while (total < size)
+    {
+      size_t chunk = 1 + random () % (3 * BLOCK_SIZE);
+
+      if (chunk > size - total)
+	chunk = size - total;
+
+      err = chop_stream_read (stream, buffer + total, chunk, &read);
+      test_check_errcode (err, "reading from stream");
+      total += read;
+    }
+
+  test_assert (!memcmp (buffer, input + offset, size));
+  free (buffer);
+}
+
+/* Read the stream designated by INDEX from start to end, then at random
+   offsets.  */
+static void
+check_stream (chop_indexer_t *indexer, chop_block_indexer_t *block_indexer,
+	      chop_index_handle_t *index)
+{
+  chop_error_t err;
+  chop_stream_t *stream;
+  chop_block_fetcher_t *fetcher;
+  size_t i;
+  char c;
+
+  fetcher = chop_block_indexer_alloca_fetcher (block_indexer);
+  err = chop_block_indexer_initialize_fetcher (block_indexer, fetcher);
+  test_check_errcode (err, "initializing block fetcher");
+
+  stream = chop_indexer_alloca_stream (indexer);
+  err = chop_indexer_fetch_stream (indexer, index, fetcher,
+				   data_store, metadata_store, stream);
+  test_check_errcode (err, "fetching stream");
+
+  check_read (stream, 0, sizeof (input));
+  err = chop_stream_read (stream, &c, 1, &i);
+  test_assert (err == CHOP_STREAM_END);
+
+  for (i = 0; i < SEEK_COUNT; i++)
+    {
+      size_t offset, size;
+
+      offset = random () % (sizeof (input) + 100);
+      size = 1 + random () % (50 * BLOCK_SIZE);
+
+      err = chop_stream_seek (stream, offset);
+      test_check_errcode (err, "seeking");
+
+      check_read (stream, offset, size);
+    }
+
+  chop_object_destroy ((chop_object_t *) stream);
+  chop_object_destroy ((chop_object_t *) fetcher);
+}
+
+/* Remove the data block at OFFSET in INPUT, which must not be a block of
+   zeros, from the data store and check that reading the stream designated
+   by INDEX fails.  Assume a SHA1 hash block indexer.  */
+static void
+check_missing_block (chop_indexer_t *indexer,
+		     chop_block_indexer_t *block_indexer,
+		     chop_index_handle_t *index, size_t offset)
+{
+  chop_error_t err;
+  chop_stream_t *stream;
+  chop_block_fetcher_t *fetcher;
+  chop_block_key_t key;
+  char hash[20], buffer[BLOCK_SIZE];
+  size_t total = 0, read;
+
+  chop_hash_buffer (CHOP_HASH_SHA1, input + offset, BLOCK_SIZE, hash);
+  chop_block_key_init (&key, hash, sizeof (hash), NULL, NULL);
+
+  err = chop_store_delete_block (data_store, &key);
+  test_check_errcode (err, "deleting data block");
+
+  fetcher = chop_block_indexer_alloca_fetcher (block_indexer);
+  err = chop_block_indexer_initialize_fetcher (block_indexer, fetcher);
+  test_check_errcode (err, "initializing block fetcher");
+
+  stream = chop_indexer_alloca_stream (indexer);
+  err = chop_indexer_fetch_stream (indexer, index, fetcher,
+				   data_store, metadata_store, stream);
+  test_check_errcode (err, "fetching stream");
+
+  do
+    {
+      err = chop_stream_read (stream, buffer, sizeof (buffer), &read);
+      if (!err)
+	{
+	  test_assert (!memcmp (buffer, input + total, read));
+	  total += read;
+	}
+    }
+  while (!err);
+
+  test_assert (err != CHOP_STREAM_END);
+  test_assert (total == offset);
+
+  chop_object_destroy ((chop_object_t *) stream);
+  chop_object_destroy ((chop_object_t *) fetcher);
+}
+
+int
+main (int argc, char *argv[])
+{
+  static const chop_class_t *block_indexer_classes[] =
+    {
+      &chop_hash_block_indexer_class,
+      &chop_chk_block_indexer_class,
+      &chop_integer_block_indexer_class,
+      NULL
+    };
+
+  static const char *block_indexer_serials[] =
+    {
+      "sha1",
+      "blowfish,cbc,sha1,sha1",
+      "0",
+      NULL
+    };
+
+  static const size_t prefetch_blocks[] = { 1, 4, 50 };
+  static const size_t thread_counts[] = { 1, 3 };
+
+  chop_error_t err;
+  chop_indexer_t *indexer;
+  const chop_class_t **bi_class;
+  const char **bi_serial;
+  size_t i, p, t;
+
+  test_init (argv[0]);
+  test_init_random_seed ();
+
+  err = chop_init ();
+  test_check_errcode (err, "initializing libchop");
+
+  data_store =
+    chop_class_alloca_instance ((chop_class_t *)
+				&chop_gdbm_block_store_class);
+  metadata_store =
+    chop_class_alloca_instance ((chop_class_t *)
+				&chop_gdbm_block_store_class);
+
+  /* Random input with runs of zeros, which are recorded in key blocks.  */
+  test_randomize_input (input, sizeof (input));
+  memset (input + 100 * BLOCK_SIZE, 0, 70 * BLOCK_SIZE);
+  for (i = 300; i < 600; i += 3)
+    memset (input + i * BLOCK_SIZE, 0, BLOCK_SIZE);
+
+  indexer = chop_class_alloca_instance (&chop_tree_indexer_class);
+  err = chop_tree_indexer_open (INDEXES_PER_BLOCK, indexer);
+  test_check_errcode (err, "initializing tree indexer");
+
+  /* Have seeks go straight to the target block.  */
+  chop_tree_indexer_set_child_sizes (indexer, 1);
+
+  if (test_debug_mode ())
+    chop_log_attach (chop_tree_indexer_log (indexer), 2, 0);
+
+  for (bi_class = block_indexer_classes,
+	 bi_serial = block_indexer_serials;
+       *bi_class != NULL;
+       bi_class++, bi_serial++)
+    {
+      size_t consumed;
+      chop_block_indexer_t *block_indexer;
+      chop_index_handle_t *index;
+
+      test_stage ("`%s', `%s'", chop_class_name (*bi_class), *bi_serial);
+
+      block_indexer = chop_class_alloca_instance (*bi_class);
+      err = chop_object_deserialize ((chop_object_t *) block_indexer,
+				     *bi_class, CHOP_SERIAL_ASCII,
+				     *bi_serial, strlen (*bi_serial),
+				     &consumed);
+      test_check_errcode (err, "deserializing block indexer");
+
+      test_open_stores (DATA_STORE_FILE_NAME, data_store,
+			METADATA_STORE_FILE_NAME, metadata_store);
+      index = chop_block_indexer_alloca_index_handle (block_indexer);
+      test_index_input (indexer, &chop_fixed_size_chopper_class, BLOCK_SIZE,
+			block_indexer, data_store, metadata_store,
+			input, sizeof (input), index);
+
+      for (p = 0; p < sizeof (prefetch_blocks) / sizeof (prefetch_blocks[0]);
+	   p++)
+	for (t = 0; t < sizeof (thread_counts) / sizeof (thread_counts[0]);
+	     t++)
+	  {
+	    test_stage_intermediate ("%zu blocks, %zu threads",
+				     prefetch_blocks[p], thread_counts[t]);
+
+	    chop_tree_indexer_set_prefetch (indexer, prefetch_blocks[p]);
+	    chop_tree_indexer_set_thread_count (indexer, thread_counts[t]);
+
+	    check_stream (indexer, block_indexer, index);
+	  }
+
+      if (*bi_class == &chop_hash_block_indexer_class)
+	{
+	  test_stage_intermediate ("missing block");
+	  check_missing_block (indexer, block_indexer, index,
+			       1234 * BLOCK_SIZE);
+	}
+
+      chop_tree_indexer_set_prefetch (indexer, 0);
+      chop_tree_indexer_set_thread_count (indexer, 1);
+
+      chop_object_destroy ((chop_object_t *) index);
+      test_close_stores (DATA_STORE_FILE_NAME, data_store,
+			 METADATA_STORE_FILE_NAME, metadata_store);
+      chop_object_destroy ((chop_object_t *) block_indexer);
+
+      test_stage_result (1);
+    }
+
+  chop_object_destroy ((chop_object_t *) indexer);
+
+  return 0;
+}
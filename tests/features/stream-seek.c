@@ -0,0 +1,273 @@
+/* libchop -- a utility library for distributed storage and data backup
+   Copyright (C) 2026  Ludovic Courtès <ludo@gnu.org>
+
+   Libchop is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Libchop is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with libchop.  If not, see <http://www.gnu.org/licenses/>.  */
+
+/* Check that the streams returned by the tree indexer support
+   `chop_stream_seek ()', with and without child sizes in key blocks, and
+   that seeking does not fetch the blocks that precede the target offset
+   when child sizes are recorded.  */
+
+#include <chop/chop-config.h>
+
+#include <alloca.h>
+
+#include <chop/chop.h>
+#include <chop/streams.h>
+#include <chop/choppers.h>
+#include <chop/block-indexers.h>
+#include <chop/indexers.h>
+#include <chop/stores.h>
+
+#include <testsuite.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+
+#define DATA_STORE_FILE_NAME      ",,t-stream-seek-data.db"
+#define METADATA_STORE_FILE_NAME  ",,t-stream-seek-metadata.db"
+
+#define BLOCK_SIZE          1000
+
+/* A small number of keys per key block, so that the tree is deep.  */
+#define INDEXES_PER_BLOCK   5
+
+#define SIZE_OF_INPUT       (3333 * BLOCK_SIZE + 123)
+
+#define SEEK_COUNT          300
+
+
+static char input[SIZE_OF_INPUT];
+
+static chop_block_store_t *data_store, *metadata_store;
+static chop_block_indexer_t *block_indexer;
+
+
+
+/* Read SIZE bytes from STREAM and check that they match INPUT at
+   OFFSET.  */
+static void
+check_read (chop_stream_t *stream, size_t offset, size_t size)
+{
+  chop_error_t err;
+  char *buffer;
+  size_t total = 0, read;
+
+  if (offset >= sizeof (input))
+    {
+      char c;
+
+      err = chop_stream_read (stream, &c, 1, &read);
+      test_assert (err == CHOP_STREAM_END);
+      return;
+    }
+
+  if (offset + size > sizeof (input))
+    size = sizeof (input) - offset;
+
+  buffer = malloc (size);
+  test_assert (buffer != NULL);
+
+  while (total < size)
+    {
+      err = chop_stream_read (stream, buffer + total, size - total, &read);
+      test_check_errcode (err, "reading from stream");
+      total += read;
+    }
+
+  test_assert (!memcmp (buffer, input + offset, size));
+  free (buffer);
+}
+
+/* Seek to random offsets of the stream designated by INDEX and check what
+   is read there.  */
+static void
+check_random_seeks (chop_indexer_t *indexer, chop_index_handle_t *index)
+{
+  chop_error_t err;
+  chop_stream_t *stream;
+  chop_block_fetcher_t *fetcher;
+  size_t i;
+
+  fetcher = chop_block_indexer_alloca_fetcher (block_indexer);
+  err = chop_block_indexer_initialize_fetcher (block_indexer, fetcher);
+  test_check_errcode (err, "initializing block fetcher");
+
+  stream = chop_indexer_alloca_stream (indexer);
+  err = chop_indexer_fetch_stream (indexer, index, fetcher,
+				   data_store, metadata_store, stream);
+  test_check_errcode (err, "fetching stream");
+
+  for (i = 0; i < SEEK_COUNT; i++)
+    {
+      size_t offset, size;
+
+      switch (i % 4)
+	{
+	case 0:
+	  /* A block boundary.  */
+	  offset = (random () % (sizeof (input) / BLOCK_SIZE)) * BLOCK_SIZE;
+	  break;
+	case 1:
+	  /* Past the end.  */
+	  offset = sizeof (input) + random () % 100;
+	  break;
+	default:
+	  offset = random () % sizeof (input);
+	}
+
+      size = 1 + random () % (5 * BLOCK_SIZE);
+
+      err = chop_stream_seek (stream, offset);
+      test_check_errcode (err, "seeking");
+
+      check_read (stream, offset, size);
+    }
+
+  /* Read everything from the start.  */
+  err = chop_stream_seek (stream, 0);
+  test_check_errcode (err, "seeking to the beginning");
+  check_read (stream, 0, sizeof (input));
+
+  chop_object_destroy ((chop_object_t *) stream);
+  chop_object_destroy ((chop_object_t *) fetcher);
+}
+
+/* Remove the first data block of INPUT from the data store.  */
+static void
+delete_first_block (void)
+{
+  chop_error_t err;
+  chop_block_key_t key;
+  char hash[20];
+
+  chop_hash_buffer (CHOP_HASH_SHA1, input, BLOCK_SIZE, hash);
+  chop_block_key_init (&key, hash, sizeof (hash), NULL, NULL);
+
+  err = chop_store_delete_block (data_store, &key);
+  test_check_errcode (err, "deleting first data block");
+}
+
+/* Seek past the first block of the stream designated by INDEX and read
+   from there.  Return the error code.  */
+static chop_error_t
+seek_past_first_block (chop_indexer_t *indexer, chop_index_handle_t *index)
+{
+  chop_error_t err;
+  chop_stream_t *stream;
+  chop_block_fetcher_t *fetcher;
+  char buffer[BLOCK_SIZE];
+  size_t read;
+
+  fetcher = chop_block_indexer_alloca_fetcher (block_indexer);
+  err = chop_block_indexer_initialize_fetcher (block_indexer, fetcher);
+  test_check_errcode (err, "initializing block fetcher");
+
+  stream = chop_indexer_alloca_stream (indexer);
+  err = chop_indexer_fetch_stream (indexer, index, fetcher,
+				   data_store, metadata_store, stream);
+  test_check_errcode (err, "fetching stream");
+
+  err = chop_stream_seek (stream, sizeof (input) / 2);
+  if (!err)
+    {
+      err = chop_stream_read (stream, buffer, sizeof (buffer), &read);
+      if (!err)
+	test_assert (!memcmp (buffer, input + sizeof (input) / 2, read));
+    }
+
+  chop_object_destroy ((chop_object_t *) stream);
+  chop_object_destroy ((chop_object_t *) fetcher);
+
+  return err;
+}
+
+int
+main (int argc, char *argv[])
+{
+  chop_error_t err;
+  chop_indexer_t *indexer;
+  chop_index_handle_t *index;
+  int child_sizes;
+  size_t i;
+
+  test_init (argv[0]);
+  test_init_random_seed ();
+
+  err = chop_init ();
+  test_check_errcode (err, "initializing libchop");
+
+  data_store =
+    chop_class_alloca_instance ((chop_class_t *)
+				&chop_gdbm_block_store_class);
+  metadata_store =
+    chop_class_alloca_instance ((chop_class_t *)
+				&chop_gdbm_block_store_class);
+
+  /* Random input with runs of zeros, which are recorded in key blocks.  */
+  test_randomize_input (input, sizeof (input));
+  memset (input + 100 * BLOCK_SIZE, 0, 70 * BLOCK_SIZE);
+  memset (input + 2000 * BLOCK_SIZE + 17, 0, 3 * BLOCK_SIZE);
+  memset (input + sizeof (input) - 123, 0, 123);
+  for (i = 300; i < 600; i += 3)
+    /* Several runs per key block.  */
+    memset (input + i * BLOCK_SIZE, 0, BLOCK_SIZE);
+
+  block_indexer = chop_class_alloca_instance (&chop_hash_block_indexer_class);
+  err = chop_hash_block_indexer_open (CHOP_HASH_SHA1, block_indexer);
+  test_check_errcode (err, "initializing block indexer");
+
+  indexer = chop_class_alloca_instance (&chop_tree_indexer_class);
+  err = chop_tree_indexer_open (INDEXES_PER_BLOCK, indexer);
+  test_check_errcode (err, "initializing tree indexer");
+
+  for (child_sizes = 1; child_sizes >= 0; child_sizes--)
+    {
+      test_stage ("seeking %s child sizes", child_sizes ? "with" : "without");
+
+      chop_tree_indexer_set_child_sizes (indexer, child_sizes);
+
+      test_open_stores (DATA_STORE_FILE_NAME, data_store,
+			METADATA_STORE_FILE_NAME, metadata_store);
+
+      index = chop_block_indexer_alloca_index_handle (block_indexer);
+      test_index_input (indexer, &chop_fixed_size_chopper_class, BLOCK_SIZE,
+			block_indexer, data_store, metadata_store,
+			input, sizeof (input), index);
+      check_random_seeks (indexer, index);
+
+      /* With child sizes, seeking must not fetch the blocks that precede
+	 the target offset; without them, it has to.  */
+      delete_first_block ();
+      err = seek_past_first_block (indexer, index);
+      if (child_sizes)
+	test_check_errcode (err, "seeking past a missing block");
+      else
+	test_assert (err != 0);
+
+      chop_object_destroy ((chop_object_t *) index);
+      test_close_stores (DATA_STORE_FILE_NAME, data_store,
+			 METADATA_STORE_FILE_NAME, metadata_store);
+
+      test_stage_result (1);
+    }
+
+  chop_object_destroy ((chop_object_t *) indexer);
+  chop_object_destroy ((chop_object_t *) block_indexer);
+
+  return 0;
+}
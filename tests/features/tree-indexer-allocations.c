@@ -0,0 +1,206 @@
+/* libchop -- a utility library for distributed storage and data backup
+   Copyright (C) 2026  Ludovic Courtès <ludo@gnu.org>
+
+   Libchop is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Libchop is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with libchop.  If not, see <http://www.gnu.org/licenses/>.  */
+
+/* Check that the tree indexer does not allocate memory on the heap for
+   each block it indexes: indexing a stream sixteen times larger must not
+   make noticeably more allocations, and there must be fewer allocations
+   than key blocks.  The buffer pool is disabled so that buffers taken
+   from it are accounted for.  */
+
+#include <chop/chop-config.h>
+
+#include <alloca.h>
+
+#include <chop/chop.h>
+#include <chop/streams.h>
+#include <chop/choppers.h>
+#include <chop/block-indexers.h>
+#include <chop/indexers.h>
+#include <chop/stores.h>
+#include <chop/buffers.h>
+
+#include <testsuite.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+
+#define BLOCK_SIZE          512
+#define INDEXES_PER_BLOCK   16
+
+#define SMALL_BLOCK_COUNT   256
+#define LARGE_BLOCK_COUNT   (16 * SMALL_BLOCK_COUNT)
+
+/* The large input has one more level of key blocks than the small one.
+   Each level has a key block whose key buffer is allocated and then grown
+   as keys are added to it, which takes 4 allocations and reallocations
+   with the hash block indexer and 5 with the CHK one.  */
+#define ADDITIONAL_LEVELS           1
+#define ALLOCATIONS_PER_LEVEL       5
+#define MAX_ADDITIONAL_ALLOCATIONS  (ADDITIONAL_LEVELS * ALLOCATIONS_PER_LEVEL)
+
+/* Before key blocks were allocated from an arena, indexing the large
+   input took about 16 allocations per key block; it now takes a few
+   dozen allocations in total.  */
+#define MAX_ALLOCATIONS_PER_KEY_BLOCK  1
+
+
+static char input[LARGE_BLOCK_COUNT * BLOCK_SIZE];
+
+
+
+/* Return the number of key blocks of a tree over BLOCK_COUNT data
+   blocks.  */
+static size_t
+key_block_count (size_t block_count)
+{
+  size_t count = 0;
+
+  do
+    {
+      block_count = (block_count + INDEXES_PER_BLOCK - 1) / INDEXES_PER_BLOCK;
+      count += block_count;
+    }
+  while (block_count > 1);
+
+  return count;
+}
+
+/* Index the first BLOCK_COUNT blocks of INPUT with INDEXER and
+   BLOCK_INDEXER, and return the number of heap allocations made.  */
+static size_t
+index_input (chop_indexer_t *indexer, chop_block_indexer_t *block_indexer,
+	     size_t block_count)
+{
+  chop_error_t err;
+  chop_stream_t *stream;
+  chop_chopper_t *chopper;
+  chop_block_store_t *data_store, *metadata_store;
+  chop_index_handle_t *index;
+  size_t allocations;
+
+  data_store = chop_class_alloca_instance (&chop_dummy_block_store_class);
+  metadata_store =
+    chop_class_alloca_instance (&chop_dummy_block_store_class);
+  chop_dummy_block_store_open ("data", data_store);
+  chop_dummy_block_store_open ("meta-data", metadata_store);
+
+  stream = chop_class_alloca_instance (&chop_mem_stream_class);
+  chop_mem_stream_open (input, block_count * BLOCK_SIZE, NULL, stream);
+
+  chopper =
+    chop_class_alloca_instance ((chop_class_t *)
+				&chop_fixed_size_chopper_class);
+  err = chop_fixed_size_chopper_init (stream, BLOCK_SIZE, 0, chopper);
+  test_check_errcode (err, "initializing chopper");
+
+  index = chop_block_indexer_alloca_index_handle (block_indexer);
+
+  allocations = test_allocations ();
+  err = chop_indexer_index_blocks (indexer, chopper, block_indexer,
+				   data_store, metadata_store, index);
+  test_check_errcode (err, "indexing stream");
+  allocations = test_allocations () - allocations;
+
+  chop_object_destroy ((chop_object_t *) index);
+  chop_object_destroy ((chop_object_t *) chopper);
+  chop_object_destroy ((chop_object_t *) stream);
+  chop_object_destroy ((chop_object_t *) data_store);
+  chop_object_destroy ((chop_object_t *) metadata_store);
+
+  return allocations;
+}
+
+int
+main (int argc, char *argv[])
+{
+  static const chop_class_t *block_indexer_classes[] =
+    {
+      &chop_hash_block_indexer_class,
+      &chop_chk_block_indexer_class,
+      NULL
+    };
+
+  static const char *block_indexer_serials[] =
+    {
+      "sha1",
+      "blowfish,cbc,sha1,sha1",
+      NULL
+    };
+
+  chop_error_t err;
+  chop_indexer_t *indexer;
+  const chop_class_t **bi_class;
+  const char **bi_serial;
+  int child_sizes;
+
+  test_init (argv[0]);
+  test_init_random_seed ();
+
+  err = test_init_with_allocation_counters ();
+  test_check_errcode (err, "initializing libchop");
+  chop_buffer_enable_pool (0);
+
+  test_randomize_input (input, sizeof (input));
+
+  indexer = chop_class_alloca_instance (&chop_tree_indexer_class);
+  err = chop_tree_indexer_open (INDEXES_PER_BLOCK, indexer);
+  test_check_errcode (err, "initializing tree indexer");
+
+  for (bi_class = block_indexer_classes,
+	 bi_serial = block_indexer_serials;
+       *bi_class != NULL;
+       bi_class++, bi_serial++)
+    for (child_sizes = 1; child_sizes >= 0; child_sizes--)
+      {
+	size_t consumed, small, large;
+	chop_block_indexer_t *block_indexer;
+
+	test_stage ("`%s' %s child sizes", chop_class_name (*bi_class),
+		    child_sizes ? "with" : "without");
+
+	block_indexer = chop_class_alloca_instance (*bi_class);
+	err = chop_object_deserialize ((chop_object_t *) block_indexer,
+				       *bi_class, CHOP_SERIAL_ASCII,
+				       *bi_serial, strlen (*bi_serial),
+				       &consumed);
+	test_check_errcode (err, "deserializing block indexer");
+
+	chop_tree_indexer_set_child_sizes (indexer, child_sizes);
+
+	/* Index the small input twice so that buffer pools and the like
+	   are warm when measuring.  */
+	index_input (indexer, block_indexer, SMALL_BLOCK_COUNT);
+	small = index_input (indexer, block_indexer, SMALL_BLOCK_COUNT);
+	large = index_input (indexer, block_indexer, LARGE_BLOCK_COUNT);
+
+	test_debug ("%zu allocations for %u blocks, %zu for %u blocks "
+		    "and %zu key blocks",
+		    small, SMALL_BLOCK_COUNT, large, LARGE_BLOCK_COUNT,
+		    key_block_count (LARGE_BLOCK_COUNT));
+	test_assert (large <= small + MAX_ADDITIONAL_ALLOCATIONS);
+	test_assert (large < MAX_ALLOCATIONS_PER_KEY_BLOCK
+		     * key_block_count (LARGE_BLOCK_COUNT));
+
+	chop_object_destroy ((chop_object_t *) block_indexer);
+
+	test_stage_result (1);
+      }
+
+  chop_object_destroy ((chop_object_t *) indexer);
+
+  return 0;
+}
@@ -0,0 +1,223 @@
+/* libchop -- a utility library for distributed storage and data backup
+   Copyright (C) 2026  Ludovic Courtès <ludo@gnu.org>
+
+   Libchop is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Libchop is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with libchop.  If not, see <http://www.gnu.org/licenses/>.  */
+
+/* Check that indexing a stream with several threads yields the same index
+   as indexing it with a single thread, and that the stream can be
+   restored from the stores written by the threads.  */
+
+#include <chop/chop-config.h>
+
+#include <alloca.h>
+
+#include <chop/chop.h>
+#include <chop/streams.h>
+#include <chop/choppers.h>
+#include <chop/block-indexers.h>
+#include <chop/indexers.h>
+#include <chop/stores.h>
+#include <chop/buffers.h>
+
+#include <testsuite.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+
+#define DATA_STORE_FILE_NAME      ",,t-tree-indexer-threads-data.db"
+#define METADATA_STORE_FILE_NAME  ",,t-tree-indexer-threads-metadata.db"
+
+#define BLOCK_SIZE          1024
+#define INDEXES_PER_BLOCK   30
+
+#define SIZE_OF_INPUT       (3 * 1024 * 1024 + 777)
+
+
+static char input[SIZE_OF_INPUT];
+
+static chop_block_store_t *data_store, *metadata_store;
+
+
+
+/* Index INPUT with INDEXER, using a chopper of class CHOPPER_CLASS and
+   BLOCK_INDEXER, and return the ASCII serialization of its index in
+   SERIAL.  */
+static void
+index_input (chop_indexer_t *indexer,
+	     const chop_chopper_class_t *chopper_class,
+	     chop_block_indexer_t *block_indexer,
+	     chop_index_handle_t *index, chop_buffer_t *serial)
+{
+  chop_error_t err;
+
+  test_index_input (indexer, chopper_class, BLOCK_SIZE, block_indexer,
+		    data_store, metadata_store, input, sizeof (input), index);
+
+  err = chop_object_serialize ((chop_object_t *) index, CHOP_SERIAL_ASCII,
+			       serial);
+  test_check_errcode (err, "serializing index");
+}
+
+
+int
+main (int argc, char *argv[])
+{
+  static const chop_class_t *block_indexer_classes[] =
+    {
+      &chop_hash_block_indexer_class,
+      &chop_chk_block_indexer_class,
+      &chop_chk_block_indexer_class,
+      &chop_integer_block_indexer_class,
+      NULL
+    };
+
+  static const char *block_indexer_serials[] =
+    {
+      "sha1",
+      "blowfish,cbc,sha1,sha1",
+      "aes256,cbc,sha256,md4",
+      "0",
+      NULL
+    };
+
+  static const chop_chopper_class_t *chopper_classes[] =
+    {
+      &chop_fixed_size_chopper_class,
+      &chop_anchor_based_chopper_class,
+      NULL
+    };
+
+  static const size_t thread_counts[] = { 2, 5, 0 };
+
+  chop_error_t err;
+  chop_indexer_t *indexer;
+  const chop_class_t **bi_class;
+  const char **bi_serial;
+  const chop_chopper_class_t **chopper_class;
+  size_t i, t;
+
+  test_init (argv[0]);
+  test_init_random_seed ();
+
+  err = chop_init ();
+  test_check_errcode (err, "initializing libchop");
+
+  data_store =
+    chop_class_alloca_instance ((chop_class_t *)
+				&chop_gdbm_block_store_class);
+  metadata_store =
+    chop_class_alloca_instance ((chop_class_t *)
+				&chop_gdbm_block_store_class);
+
+  /* Random input with runs of zeros, some of which are recorded in key
+     blocks, and repeated blocks.  */
+  test_randomize_input (input, sizeof (input));
+  memset (input + 100 * BLOCK_SIZE, 0, 300 * BLOCK_SIZE);
+  for (i = 1000; i < 1500; i += 7)
+    memset (input + i * BLOCK_SIZE, 0, BLOCK_SIZE);
+  memcpy (input + 2000 * BLOCK_SIZE, input + 1700 * BLOCK_SIZE,
+	  100 * BLOCK_SIZE);
+
+  indexer = chop_class_alloca_instance (&chop_tree_indexer_class);
+  err = chop_tree_indexer_open (INDEXES_PER_BLOCK, indexer);
+  test_check_errcode (err, "initializing tree indexer");
+
+  if (test_debug_mode ())
+    chop_log_attach (chop_tree_indexer_log (indexer), 2, 0);
+
+  for (bi_class = block_indexer_classes,
+	 bi_serial = block_indexer_serials;
+       *bi_class != NULL;
+       bi_class++, bi_serial++)
+    for (chopper_class = chopper_classes;
+	 *chopper_class != NULL;
+	 chopper_class++)
+      {
+	size_t consumed;
+	chop_block_indexer_t *block_indexer;
+	chop_index_handle_t *index;
+	chop_buffer_t serial, parallel_serial;
+
+	test_stage ("`%s', `%s', `%s'", chop_class_name (*bi_class),
+		    *bi_serial, chop_class_name ((chop_class_t *)
+						 *chopper_class));
+
+	block_indexer = chop_class_alloca_instance (*bi_class);
+	err = chop_object_deserialize ((chop_object_t *) block_indexer,
+				       *bi_class, CHOP_SERIAL_ASCII,
+				       *bi_serial, strlen (*bi_serial),
+				       &consumed);
+	test_check_errcode (err, "deserializing block indexer");
+
+	chop_buffer_init (&serial, 0);
+	chop_buffer_init (&parallel_serial, 0);
+
+	/* The reference: a single thread.  */
+	chop_tree_indexer_set_thread_count (indexer, 1);
+	test_open_stores (DATA_STORE_FILE_NAME, data_store,
+			  METADATA_STORE_FILE_NAME, metadata_store);
+	index = chop_block_indexer_alloca_index_handle (block_indexer);
+	index_input (indexer, *chopper_class, block_indexer, index, &serial);
+	chop_object_destroy ((chop_object_t *) index);
+	test_close_stores (DATA_STORE_FILE_NAME, data_store,
+			   METADATA_STORE_FILE_NAME, metadata_store);
+
+	for (t = 0; t < sizeof (thread_counts) / sizeof (thread_counts[0]);
+	     t++)
+	  {
+	    test_stage_intermediate ("%zu threads", thread_counts[t]);
+
+	    chop_tree_indexer_set_thread_count (indexer, thread_counts[t]);
+	    test_open_stores (DATA_STORE_FILE_NAME, data_store,
+			      METADATA_STORE_FILE_NAME, metadata_store);
+
+	    index = chop_block_indexer_alloca_index_handle (block_indexer);
+	    chop_buffer_clear (&parallel_serial);
+	    index_input (indexer, *chopper_class, block_indexer, index,
+			 &parallel_serial);
+
+	    /* Integer block indexers cannot be used from several threads,
+	       and they yield different indices upon each run anyway.  */
+	    if (*bi_class != &chop_integer_block_indexer_class)
+	      {
+		test_assert (chop_buffer_size (&serial)
+			     == chop_buffer_size (&parallel_serial));
+		test_assert (!memcmp (chop_buffer_content (&serial),
+				      chop_buffer_content (&parallel_serial),
+				      chop_buffer_size (&serial)));
+	      }
+
+	    test_check_stream (indexer, block_indexer,
+			       data_store, metadata_store,
+			       input, sizeof (input), index);
+
+	    chop_object_destroy ((chop_object_t *) index);
+	    test_close_stores (DATA_STORE_FILE_NAME, data_store,
+			       METADATA_STORE_FILE_NAME, metadata_store);
+	  }
+
+	chop_buffer_return (&serial);
+	chop_buffer_return (&parallel_serial);
+	chop_object_destroy ((chop_object_t *) block_indexer);
+
+	test_stage_result (1);
+      }
+
+  chop_object_destroy ((chop_object_t *) indexer);
+
+  return 0;
+}
@@ -0,0 +1,274 @@
+/* libchop -- a utility library for distributed storage and data backup
+   Copyright (C) 2026  Ludovic Courtès <ludo@gnu.org>
+
+   Libchop is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Libchop is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with libchop.  If not, see <http://www.gnu.org/licenses/>.  */
+
+/* Make sure the tree indexer does not store blocks that contain only
+   zeros, and that the streams it returns expand runs of zeros properly.
+   Also check that file streams properly read sparse files.  */
+
+#include <chop/chop-config.h>
+
+#include <alloca.h>
+
+#include <chop/chop.h>
+#include <chop/streams.h>
+#include <chop/choppers.h>
+#include <chop/block-indexers.h>
+#include <chop/indexers.h>
+#include <chop/stores.h>
+#include <chop/store-stats.h>
+
+#include <testsuite.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+
+#define DATA_STORE_FILE_NAME      ",,t-zero-blocks-data.db"
+#define METADATA_STORE_FILE_NAME  ",,t-zero-blocks-metadata.db"
+#define SPARSE_FILE_NAME          ",,t-zero-blocks-sparse"
+
+#define BLOCK_SIZE          4096
+
+/* A small number of keys per key block, so that runs of zeros span
+   several key blocks.  */
+#define INDEXES_PER_BLOCK   7
+
+#define SIZE_OF_INPUT       (1234 * BLOCK_SIZE + 123)
+
+
+static char input[SIZE_OF_INPUT];
+
+
+
+/* Return the number of blocks of INPUT that are not all zeros.  */
+static size_t
+count_non_zero_blocks (const char *input, size_t size)
+{
+  size_t offset, count = 0;
+
+  for (offset = 0; offset < size; offset += BLOCK_SIZE)
+    {
+      size_t i, block_size;
+
+      block_size = (size - offset < BLOCK_SIZE) ? size - offset : BLOCK_SIZE;
+      for (i = 0; i < block_size; i++)
+	if (input[offset + i])
+	  {
+	    count++;
+	    break;
+	  }
+    }
+
+  return count;
+}
+
+/* Index the SIZE bytes at INPUT with INDEXER and check that (i) exactly
+   EXPECTED_BLOCKS data blocks are written and (ii) the stream can be
+   fetched.  */
+static void
+index_and_fetch (chop_indexer_t *indexer, const char *input, size_t size,
+		 size_t expected_blocks)
+{
+  chop_error_t err;
+  chop_stream_t *stream;
+  chop_chopper_t *chopper;
+  chop_block_store_t *store, *data_store, *metadata_store;
+  chop_block_indexer_t *block_indexer;
+  chop_block_fetcher_t *fetcher;
+  chop_index_handle_t *index;
+  const chop_block_store_stats_t *stats;
+
+  unlink (DATA_STORE_FILE_NAME);
+  unlink (METADATA_STORE_FILE_NAME);
+
+  store =
+    chop_class_alloca_instance ((chop_class_t *)
+				&chop_gdbm_block_store_class);
+  err = chop_file_based_store_open (&chop_gdbm_block_store_class,
+				    DATA_STORE_FILE_NAME,
+				    O_RDWR | O_CREAT, S_IRUSR | S_IWUSR,
+				    store);
+  test_check_errcode (err, "opening data store");
+
+  data_store = chop_class_alloca_instance (&chop_stat_block_store_class);
+  err = chop_stat_block_store_open ("data", store,
+				    CHOP_PROXY_EVENTUALLY_DESTROY,
+				    data_store);
+  test_check_errcode (err, "opening stat store");
+
+  metadata_store =
+    chop_class_alloca_instance ((chop_class_t *)
+				&chop_gdbm_block_store_class);
+  err = chop_file_based_store_open (&chop_gdbm_block_store_class,
+				    METADATA_STORE_FILE_NAME,
+				    O_RDWR | O_CREAT, S_IRUSR | S_IWUSR,
+				    metadata_store);
+  test_check_errcode (err, "opening meta-data store");
+
+  block_indexer = chop_class_alloca_instance (&chop_hash_block_indexer_class);
+  err = chop_hash_block_indexer_open (CHOP_HASH_SHA1, block_indexer);
+  test_check_errcode (err, "initializing block indexer");
+
+  stream = chop_class_alloca_instance (&chop_mem_stream_class);
+  chop_mem_stream_open (input, size, NULL, stream);
+
+  chopper =
+    chop_class_alloca_instance ((chop_class_t *)
+				&chop_fixed_size_chopper_class);
+  err = chop_fixed_size_chopper_init (stream, BLOCK_SIZE, 0, chopper);
+  test_check_errcode (err, "initializing chopper");
+
+  index = chop_block_indexer_alloca_index_handle (block_indexer);
+  err = chop_indexer_index_blocks (indexer, chopper, block_indexer,
+				   data_store, metadata_store, index);
+  test_check_errcode (err, "indexing stream");
+
+  stats = chop_stat_block_store_stats (data_store);
+  test_debug ("%zu data blocks written, %zu expected",
+	      stats->blocks_written, expected_blocks);
+  test_assert (stats->blocks_written == expected_blocks);
+
+  chop_object_destroy ((chop_object_t *) chopper);
+  chop_object_destroy ((chop_object_t *) stream);
+
+  fetcher = chop_block_indexer_alloca_fetcher (block_indexer);
+  err = chop_block_indexer_initialize_fetcher (block_indexer, fetcher);
+  test_check_errcode (err, "initializing block fetcher");
+
+  stream = chop_indexer_alloca_stream (indexer);
+  err = chop_indexer_fetch_stream (indexer, index, fetcher,
+				   data_store, metadata_store, stream);
+  test_check_errcode (err, "fetching stream");
+
+  test_check_stream_contents (stream, input, size, 7777, NULL);
+
+  chop_object_destroy ((chop_object_t *) stream);
+  chop_object_destroy ((chop_object_t *) fetcher);
+  chop_object_destroy ((chop_object_t *) index);
+  chop_object_destroy ((chop_object_t *) block_indexer);
+  chop_object_destroy ((chop_object_t *) data_store);
+  chop_object_destroy ((chop_object_t *) metadata_store);
+
+  unlink (DATA_STORE_FILE_NAME);
+  unlink (METADATA_STORE_FILE_NAME);
+}
+
+/* Write INPUT as a sparse file, leaving holes where it contains aligned
+   runs of zeros, and check that file streams read it correctly.  */
+static void
+check_sparse_file (void)
+{
+  chop_error_t err;
+  chop_stream_t *stream;
+  size_t offset, start;
+  int fd;
+
+  unlink (SPARSE_FILE_NAME);
+  fd = open (SPARSE_FILE_NAME, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+  test_assert (fd >= 0);
+  test_assert (ftruncate (fd, sizeof (input)) == 0);
+
+  for (offset = 0; offset < sizeof (input); offset += BLOCK_SIZE)
+    {
+      size_t size = (sizeof (input) - offset < BLOCK_SIZE)
+	? sizeof (input) - offset : BLOCK_SIZE;
+
+      if (count_non_zero_blocks (input + offset, size) > 0)
+	test_assert (pwrite (fd, input + offset, size, offset)
+		     == (ssize_t) size);
+    }
+
+  stream = chop_class_alloca_instance (&chop_file_stream_class);
+
+  err = chop_file_stream_open (SPARSE_FILE_NAME, stream);
+  test_check_errcode (err, "opening file stream");
+  test_check_stream_contents (stream, input, sizeof (input), 7777, NULL);
+  chop_object_destroy ((chop_object_t *) stream);
+
+  /* Start reading at an arbitrary offset.  */
+  start = random () % sizeof (input);
+  test_assert (lseek (fd, start, SEEK_SET) == (off_t) start);
+
+  err = chop_file_stream_open_fd (fd, 1, stream);
+  test_check_errcode (err, "opening file stream from file descriptor");
+  test_check_stream_contents (stream, input + start, sizeof (input) - start,
+			      7777, NULL);
+  chop_object_destroy ((chop_object_t *) stream);
+
+  unlink (SPARSE_FILE_NAME);
+}
+
+int
+main (int argc, char *argv[])
+{
+  chop_error_t err;
+  chop_indexer_t *indexer;
+  size_t i, non_zero_blocks;
+
+  test_init (argv[0]);
+  test_init_random_seed ();
+
+  err = chop_init ();
+  test_check_errcode (err, "initializing libchop");
+
+  /* Random input with runs of zeros at the beginning, at the end, and in
+     between, some of which are not aligned on block boundaries.  */
+  test_randomize_input (input, sizeof (input));
+  memset (input, 0, 3 * BLOCK_SIZE);
+  memset (input + 100 * BLOCK_SIZE + 77, 0, 50 * BLOCK_SIZE);
+  memset (input + 400 * BLOCK_SIZE, 0, 500 * BLOCK_SIZE);
+  memset (input + sizeof (input) - 2 * BLOCK_SIZE - 123, 0,
+	  2 * BLOCK_SIZE + 123);
+  for (i = 0; i < 20; i++)
+    memset (input + (random () % (sizeof (input) / BLOCK_SIZE)) * BLOCK_SIZE,
+	    0, BLOCK_SIZE);
+
+  non_zero_blocks = count_non_zero_blocks (input, sizeof (input));
+
+  indexer = chop_class_alloca_instance (&chop_tree_indexer_class);
+  err = chop_tree_indexer_open (INDEXES_PER_BLOCK, indexer);
+  test_check_errcode (err, "initializing tree indexer");
+
+  test_stage ("zero blocks are not stored");
+  index_and_fetch (indexer, input, sizeof (input), non_zero_blocks);
+  test_stage_result (1);
+
+  test_stage ("stream of zeros");
+  memset (input, 0, sizeof (input));
+  index_and_fetch (indexer, input, sizeof (input), 0);
+  index_and_fetch (indexer, input, 1, 0);
+  test_stage_result (1);
+
+  test_stage ("zero-block detection disabled");
+  chop_tree_indexer_set_zero_block_detection (indexer, 0);
+  index_and_fetch (indexer, input, 5 * BLOCK_SIZE + 1, 6);
+  test_stage_result (1);
+
+  chop_object_destroy ((chop_object_t *) indexer);
+
+  test_stage ("sparse files");
+  test_randomize_input (input, sizeof (input));
+  memset (input + 10 * BLOCK_SIZE, 0, 300 * BLOCK_SIZE);
+  memset (input + 500 * BLOCK_SIZE, 0, 1000);
+  memset (input + sizeof (input) - 100 * BLOCK_SIZE - 123, 0,
+	  100 * BLOCK_SIZE + 123);
+  check_sparse_file ();
+  test_stage_result (1);
+
+  return 0;
+}
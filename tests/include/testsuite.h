@@ -22,11 +22,20 @@
 
 #include <chop/chop-config.h>
 #include <chop/chop.h>
+#include <chop/streams.h>
+#include <chop/choppers.h>
+#include <chop/block-indexers.h>
+#include <chop/indexers.h>
+#include <chop/stores.h>
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <alloca.h>
 #include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
 
 #include <sys/time.h>
 #include <time.h>
@@ -156,6 +165,55 @@ test_debug (const char *fmt, ...)
 }
 
 
+/* Allocation counters.  */
+
+/* Number of calls to the allocation functions that libchop was initialized
+   with by `test_init_with_allocation_counters ()'.  */
+static size_t test_allocation_count _CHOP_UNUSED = 0;
+static size_t test_reallocation_count _CHOP_UNUSED = 0;
+static size_t test_deallocation_count _CHOP_UNUSED = 0;
+
+static inline void *
+test_counting_malloc (size_t size, const struct chop_class *klass)
+{
+  test_allocation_count++;
+  return (malloc (size));
+}
+
+static inline void *
+test_counting_realloc (void *mem, size_t size, const struct chop_class *klass)
+{
+  test_reallocation_count++;
+  return (realloc (mem, size));
+}
+
+static inline void
+test_counting_free (void *mem, const struct chop_class *klass)
+{
+  if (mem != NULL)
+    test_deallocation_count++;
+  free (mem);
+}
+
+/* Initialize libchop such that its heap allocations, reallocations and
+   deallocations are counted in the variables above.  */
+static inline chop_error_t
+test_init_with_allocation_counters (void)
+{
+  return (chop_init_with_allocator (test_counting_malloc,
+				    test_counting_realloc,
+				    test_counting_free));
+}
+
+/* Return the number of heap allocations and reallocations made by libchop
+   so far.  */
+static inline size_t
+test_allocations (void)
+{
+  return (test_allocation_count + test_reallocation_count);
+}
+
+
 /* Assertions.  */
 
 static inline void
@@ -188,5 +246,240 @@ do								\
 }								\
 while (0)
 
+
+/* Files.  */
+
+/* Remove directory NAME and everything it contains, if it exists, and
+   return the number of files other than directories that were removed.  */
+static inline size_t
+test_remove_directory (const char *name)
+{
+  DIR *dir;
+  struct dirent *entry;
+  size_t count = 0;
+
+  dir = opendir (name);
+  if (dir == NULL)
+    return 0;
+
+  while ((entry = readdir (dir)) != NULL)
+    {
+      char *file;
+      struct stat st;
+
+      if ((!strcmp (entry->d_name, ".")) || (!strcmp (entry->d_name, "..")))
+	continue;
+
+      file = malloc (strlen (name) + strlen (entry->d_name) + 2);
+      test_assert (file != NULL);
+      sprintf (file, "%s/%s", name, entry->d_name);
+
+      test_assert (lstat (file, &st) == 0);
+      if (S_ISDIR (st.st_mode))
+	count += test_remove_directory (file);
+      else
+	{
+	  test_assert (unlink (file) == 0);
+	  count++;
+	}
+
+      free (file);
+    }
+
+  closedir (dir);
+  test_assert (rmdir (name) == 0);
+
+  return count;
+}
+
+
+/* Streams.  */
+
+/* Read STREAM until its end, randomly peeking at it when it supports it
+   or reading up to MAX_READ bytes at a time, and check that its contents
+   are the SIZE bytes at EXPECTED and that its end is sticky.  Call STEP,
+   unless it is NULL, with STREAM before each peek or read.  */
+static inline void
+test_check_stream_contents (chop_stream_t *stream, const char *expected,
+			    size_t size, size_t max_read,
+			    void (* step) (chop_stream_t *))
+{
+  chop_error_t err;
+  char *buffer;
+  size_t total = 0, peeks = 0, read;
+  int can_peek = 1;
+
+  buffer = malloc (max_read);
+  test_assert (buffer != NULL);
+
+  while (1)
+    {
+      if (step != NULL)
+	step (stream);
+
+      if ((can_peek) && (random () % 2))
+	{
+	  const char *data;
+	  size_t available, amount;
+
+	  err = chop_stream_peek (stream, &data, &available);
+	  if (err == CHOP_ERR_NOT_IMPL)
+	    {
+	      can_peek = 0;
+	      continue;
+	    }
+	  if (err == CHOP_STREAM_END)
+	    break;
+
+	  test_check_errcode (err, "peeking at stream");
+	  test_assert (available > 0);
+	  test_assert (total + available <= size);
+	  test_assert (!memcmp (data, expected + total, available));
+
+	  amount = (random () % 3) ? 1 + random () % available : available;
+	  chop_stream_consume (stream, amount);
+	  total += amount;
+	  peeks++;
+	}
+      else
+	{
+	  read = 0;
+	  err = chop_stream_read (stream, buffer, 1 + random () % max_read,
+				  &read);
+	  if (err == CHOP_STREAM_END)
+	    break;
+
+	  test_check_errcode (err, "reading from stream");
+	  test_assert (total + read <= size);
+	  test_assert (!memcmp (buffer, expected + total, read));
+	  total += read;
+	}
+    }
+
+  test_debug ("%zu bytes read, %zu peeks", total, peeks);
+  test_assert (total == size);
+
+  test_assert (chop_stream_read (stream, buffer, 1, &read)
+	       == CHOP_STREAM_END);
+  free (buffer);
+}
+
+
+/* Indexing.  */
+
+/* Open fresh GDBM block stores in DATA_STORE and METADATA_STORE, stored
+   in DATA_FILE_NAME and METADATA_FILE_NAME.  */
+static inline void
+test_open_stores (const char *data_file_name, chop_block_store_t *data_store,
+		  const char *metadata_file_name,
+		  chop_block_store_t *metadata_store)
+{
+  chop_error_t err;
+
+  unlink (data_file_name);
+  unlink (metadata_file_name);
+
+  err = chop_file_based_store_open (&chop_gdbm_block_store_class,
+				    data_file_name,
+				    O_RDWR | O_CREAT, S_IRUSR | S_IWUSR,
+				    data_store);
+  test_check_errcode (err, "opening data store");
+
+  err = chop_file_based_store_open (&chop_gdbm_block_store_class,
+				    metadata_file_name,
+				    O_RDWR | O_CREAT, S_IRUSR | S_IWUSR,
+				    metadata_store);
+  test_check_errcode (err, "opening meta-data store");
+}
+
+/* Close the stores opened by `test_open_stores ()' and remove them.  */
+static inline void
+test_close_stores (const char *data_file_name, chop_block_store_t *data_store,
+		   const char *metadata_file_name,
+		   chop_block_store_t *metadata_store)
+{
+  chop_object_destroy ((chop_object_t *) data_store);
+  chop_object_destroy ((chop_object_t *) metadata_store);
+
+  unlink (data_file_name);
+  unlink (metadata_file_name);
+}
+
+/* Index the SIZE bytes at INPUT with INDEXER, cut in blocks of about
+   BLOCK_SIZE bytes by a chopper of class CHOPPER_CLASS that are indexed
+   by BLOCK_INDEXER, and return its index in INDEX.  */
+static inline void
+test_index_input (chop_indexer_t *indexer,
+		  const chop_chopper_class_t *chopper_class, size_t block_size,
+		  chop_block_indexer_t *block_indexer,
+		  chop_block_store_t *data_store,
+		  chop_block_store_t *metadata_store,
+		  const char *input, size_t size, chop_index_handle_t *index)
+{
+  chop_error_t err;
+  chop_stream_t *stream;
+  chop_chopper_t *chopper;
+
+  stream = chop_class_alloca_instance (&chop_mem_stream_class);
+  chop_mem_stream_open (input, size, NULL, stream);
+
+  chopper = chop_class_alloca_instance ((chop_class_t *) chopper_class);
+  err = chop_chopper_generic_open (chopper_class, stream, block_size,
+				   chopper);
+  test_check_errcode (err, "initializing chopper");
+
+  err = chop_indexer_index_blocks (indexer, chopper, block_indexer,
+				   data_store, metadata_store, index);
+  test_check_errcode (err, "indexing stream");
+
+  chop_object_destroy ((chop_object_t *) chopper);
+  chop_object_destroy ((chop_object_t *) stream);
+}
+
+/* Read the stream designated by INDEX, as returned by INDEXER and
+   BLOCK_INDEXER, from DATA_STORE and METADATA_STORE, and check that it
+   matches the SIZE bytes at INPUT.  */
+static inline void
+test_check_stream (chop_indexer_t *indexer,
+		   chop_block_indexer_t *block_indexer,
+		   chop_block_store_t *data_store,
+		   chop_block_store_t *metadata_store,
+		   const char *input, size_t size, chop_index_handle_t *index)
+{
+  chop_error_t err;
+  chop_stream_t *stream;
+  chop_block_fetcher_t *fetcher;
+  char *buffer, c;
+  size_t total = 0, read;
+
+  fetcher = chop_block_indexer_alloca_fetcher (block_indexer);
+  err = chop_block_indexer_initialize_fetcher (block_indexer, fetcher);
+  test_check_errcode (err, "initializing block fetcher");
+
+  stream = chop_indexer_alloca_stream (indexer);
+  err = chop_indexer_fetch_stream (indexer, index, fetcher,
+				   data_store, metadata_store, stream);
+  test_check_errcode (err, "fetching stream");
+
+  buffer = malloc (size);
+  test_assert (buffer != NULL);
+
+  while (total < size)
+    {
+      err = chop_stream_read (stream, buffer + total, size - total, &read);
+      test_check_errcode (err, "reading stream");
+      total += read;
+    }
+
+  test_assert (!memcmp (buffer, input, size));
+  free (buffer);
+
+  err = chop_stream_read (stream, &c, 1, &read);
+  test_assert (err == CHOP_STREAM_END);
+
+  chop_object_destroy ((chop_object_t *) stream);
+  chop_object_destroy ((chop_object_t *) fetcher);
+}
+
 
 #endif
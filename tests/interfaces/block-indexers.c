@@ -173,6 +173,64 @@ main (int argc, char *argv[])
 				sizeof (random_data[i])));
 	}
 
+      /* Decode the binary serializations of all the index handles at once
+	 and check that they yield the same handles.  */
+      test_stage_intermediate ("decoding");
+      {
+	chop_buffer_t serials, serial;
+	chop_index_handle_t *handles;
+	const chop_class_t *handle_class;
+	size_t decoded, bytes_read;
+
+	chop_buffer_init (&serials, 0);
+	chop_buffer_init (&serial, 0);
+
+	for (i = 0; i < BLOCKS_TO_INDEX; i++)
+	  {
+	    chop_buffer_clear (&serial);
+	    err = chop_object_serialize ((chop_object_t *) index[i],
+					 CHOP_SERIAL_BINARY, &serial);
+	    test_check_errcode (err, "serializing index handle");
+	    chop_buffer_append (&serials, chop_buffer_content (&serial),
+				chop_buffer_size (&serial));
+	  }
+
+	handle_class = chop_object_get_class ((chop_object_t *) index[0]);
+	handles = alloca (BLOCKS_TO_INDEX
+			  * chop_class_instance_size (handle_class));
+	err = chop_index_handle_decode_binary (handle_class,
+					       chop_buffer_content (&serials),
+					       chop_buffer_size (&serials),
+					       BLOCKS_TO_INDEX, handles,
+					       &decoded, &bytes_read);
+	test_check_errcode (err, "decoding index handles");
+	test_assert (decoded == BLOCKS_TO_INDEX);
+	test_assert (bytes_read == chop_buffer_size (&serials));
+
+	for (i = 0; i < BLOCKS_TO_INDEX; i++)
+	  {
+	    chop_index_handle_t *handle;
+
+	    handle = chop_index_handle_array_ref (handle_class, handles, i);
+	    test_assert (chop_object_is_a ((chop_object_t *) handle,
+					   handle_class));
+
+	    chop_buffer_clear (&serial);
+	    err = chop_object_serialize ((chop_object_t *) handle,
+					 CHOP_SERIAL_BINARY, &serial);
+	    test_check_errcode (err, "serializing decoded index handle");
+	    test_assert (!memcmp (chop_buffer_content (&serial),
+				  chop_buffer_content (&serials)
+				  + i * chop_buffer_size (&serial),
+				  chop_buffer_size (&serial)));
+
+	    chop_object_destroy ((chop_object_t *) handle);
+	  }
+
+	chop_buffer_return (&serial);
+	chop_buffer_return (&serials);
+      }
+
       /* Clear the store and check whether the `block_exists' method returns
 	 0 for non-existent blocks.  */
       test_stage_intermediate ("exists?");
@@ -16,7 +16,8 @@
    along with libchop.  If not, see <http://www.gnu.org/licenses/>.  */
 
 /* Test the compliance of various chopper implementations with the interface
-   specifications.  */
+   specifications.  Calls to `chop_chopper_read_block ()' and
+   `chop_chopper_read_block_view ()' are interleaved.  */
 
 #include <chop/chop-config.h>
 
@@ -44,6 +45,9 @@ main (int argc, char *argv[])
       &chop_fixed_size_chopper_class,
       &chop_whole_stream_chopper_class,
       &chop_anchor_based_chopper_class,
+      &chop_fastcdc_chopper_class,
+      &chop_parallel_chopper_class,
+      &chop_tar_chopper_class,
       NULL
     };
   static char mem_stream_contents[1000777];
@@ -75,6 +79,7 @@ main (int argc, char *argv[])
        class++)
     {
       size_t bytes_read = 0, input_size;
+      int mode;
 
       input_size = sizeof (mem_stream_contents) - (random () % 60);
       test_stage ("chopper class `%s', %zu input bytes",
@@ -104,28 +109,66 @@ main (int argc, char *argv[])
 	}
 #endif
 
-      while (!err)
+      /* Alternate between `chop_chopper_read_block ()',
+	 `chop_chopper_read_block_view ()', and
+	 `chop_chopper_find_boundaries ()'.  */
+      for (mode = 0; !err; mode = (mode + 1) % 3)
 	{
-	  size_t amount = 0;
+	  size_t amount = 0, count = 1, i;
+	  const char *block;
+	  chop_block_span_t blocks[7];
+
+	  switch (mode)
+	    {
+	    case 0:
+	      err = chop_chopper_read_block (chopper, &buffer, &amount);
+	      block = chop_buffer_content (&buffer);
+	      blocks[0].offset = 0;
+	      blocks[0].size = amount;
+	      break;
+
+	    case 1:
+	      chop_buffer_clear (&buffer);
+	      err = chop_chopper_read_block_view (chopper, &buffer,
+						  &block, &amount);
+	      blocks[0].offset = 0;
+	      blocks[0].size = amount;
+	      break;
+
+	    default:
+	      chop_buffer_clear (&buffer);
+	      err = chop_chopper_find_boundaries (chopper, &buffer, &block,
+						  blocks, 7, &count);
+	      if (!err)
+		test_assert ((count > 0) && (count <= 7));
+	      else
+		test_assert (count == 0);
+
+	      for (i = 0; i < count; i++)
+		amount += blocks[i].size;
+	    }
 
-	  err = chop_chopper_read_block (chopper, &buffer, &amount);
 	  if (!err)
 	    {
-	      if (amount > 0)
+	      /* Verify that CHOPPER complies with the interface
+		 specifications.  */
+	      if (mode == 0)
+		test_assert (amount == chop_buffer_size (&buffer));
+
+	      for (i = 0; i < count; i++)
 		{
-		  /* Verify that CHOPPER complies with the interface
-		     specifications.  */
-		  test_assert (amount == chop_buffer_size (&buffer));
+		  if (blocks[i].size == 0)
+		    {
+		      fprintf (stderr,
+			       "chopper of class `%s' returned no data\n",
+			       chop_class_name ((chop_class_t *)*class));
+		      exit (2);
+		    }
+
 		  test_assert (!memcmp (mem_stream_contents + bytes_read,
-					chop_buffer_content (&buffer),
-					amount));
-		  bytes_read += amount;
-		}
-	      else
-		{
-		  fprintf (stderr, "chopper of class `%s' returned no data\n",
-			   chop_class_name ((chop_class_t *)*class));
-		  exit (2);
+					block + blocks[i].offset,
+					blocks[i].size));
+		  bytes_read += blocks[i].size;
 		}
 	    }
 	  else
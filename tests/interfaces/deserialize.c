@@ -56,6 +56,11 @@ static const struct pair ascii_serials[] =
       "TWOFISH,ECB,TIGER,RMD160"
     },
 
+    {
+      "anchor_based_chopper",
+      "30/1fff/800/10000/1e240"
+    },
+
     { NULL, NULL }
   };
 
@@ -118,6 +123,9 @@ check_serial_deserial (const struct pair *pair)
   test_assert (!strncmp (chop_buffer_content (&buffer), pair->serial,
 			 strlen (pair->serial)));
 
+  chop_object_destroy (object);
+  chop_buffer_return (&buffer);
+
   test_stage_result (1);
 }
 
@@ -124,6 +124,9 @@ main (int argc, char *argv[])
 #endif
 #ifdef HAVE_QDBM
       &chop_qdbm_block_store_class,
+#endif
+#ifdef HAVE_LMDB
+      &chop_lmdb_block_store_class,
 #endif
       NULL
     };
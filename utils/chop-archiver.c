@@ -79,6 +79,15 @@ static int archive_queried = 0, restore_queried = 0;
 /* Whether the source (when archiving) is a file descriptor.  */
 static int source_is_fd = 0;
 
+/* Whether the source should be read asynchronously, and the queue depth
+   and read size to use in that case (zero means "default value").  */
+static int async_input = 0;
+static size_t async_queue_depth = 0;
+static size_t async_read_size = 0;
+
+/* Whether the source should be read without filling the page cache.  */
+static int no_cache = 0;
+
 /* If ARCHIVE_QUERIED, this is the typical size of blocks that should be
    produced by the chopper.  Zero means ``chopper class preferred
    value''.  */
@@ -160,6 +169,14 @@ static struct argp_option options[] =
       "Pass the input stream through a zip filter to compress (resp. "
       "decompress) data when writing (resp. reading) to (resp. from) the "
       "archive.  ZIP-TYPE should be one of `zlib', `bzip2', or `lzo'." },
+    { "async-input", 'y', "DEPTH[:SIZE]", OPTION_ARG_OPTIONAL,
+      "Read the input file asynchronously, with up to DEPTH reads of SIZE "
+      "bytes in flight, so that reading overlaps with chopping and "
+      "hashing" },
+    { "no-cache", 'n', 0, 0,
+      "Read the input file without filling the page cache, using "
+      "`O_DIRECT' when possible, so as not to evict the data of other "
+      "processes" },
     { "zip",     'z', "ZIP-TYPE", OPTION_ARG_OPTIONAL,
       "Pass data blocks through a zip filter to compress (resp. decompress) "
       "data when writing (resp. reading) to (resp. from) the archive.  "
@@ -430,7 +447,9 @@ process_command (const char *argument,
       chop_chopper_t *chopper;
       size_t bytes_read;
 
-      stream = chop_class_alloca_instance (&chop_file_stream_class);
+      stream = chop_class_alloca_instance (async_input
+					   ? &chop_async_file_stream_class
+					   : &chop_file_stream_class);
 
       if (source_is_fd)
 	{
@@ -453,8 +472,15 @@ process_command (const char *argument,
 		}
 	    }
 
-	  err = chop_file_stream_open_fd (fd, 1, stream);
+	  if (async_input)
+	    err = chop_async_file_stream_open_fd (fd, 1, async_queue_depth,
+						  async_read_size, stream);
+	  else
+	    err = chop_file_stream_open_fd (fd, 1, stream);
 	}
+      else if (async_input)
+	err = chop_async_file_stream_open (argument, async_queue_depth,
+					   async_read_size, stream);
       else
 	err = chop_file_stream_open (argument, stream);
 
@@ -464,6 +490,27 @@ process_command (const char *argument,
 	  exit (1);
 	}
 
+      if ((async_input) && (verbose))
+	fprintf (stderr, "%s: reading input with the `%s' back-end\n",
+		 program_name, chop_async_file_stream_backend (stream));
+
+      if (no_cache)
+	{
+	  if (async_input)
+	    err = CHOP_ERR_NOT_IMPL;
+	  else
+	    err = chop_file_stream_set_cache_mode (stream,
+						   CHOP_FILE_STREAM_DIRECT);
+	  if (err)
+	    chop_error (err, "warning: cannot bypass the page cache");
+	  else if (verbose)
+	    fprintf (stderr, "%s: bypassing the page cache (%s)\n",
+		     program_name,
+		     (chop_file_stream_cache_mode (stream)
+		      == CHOP_FILE_STREAM_DIRECT)
+		     ? "O_DIRECT" : "drop-behind");
+	}
+
       if (zip_stream_filter_class)
 	{
 	  /* Use a zip-filtered stream to proxy STREAM.  */
@@ -733,6 +780,26 @@ parse_opt (int key, char *arg, struct argp_state *state)
       get_zip_filter_classes (arg, &zip_stream_filter_class,
 			      &unzip_stream_filter_class);
       break;
+    case 'y':
+      async_input = 1;
+      if (arg)
+	{
+	  char *end;
+
+	  async_queue_depth = strtoul (arg, &end, 0);
+	  if (*end == ':')
+	    async_read_size = strtoul (end + 1, &end, 0);
+	  if (*end != '\0')
+	    {
+	      fprintf (stderr, "%s: invalid argument to `--async-input': %s\n",
+		       program_name, arg);
+	      exit (1);
+	    }
+	}
+      break;
+    case 'n':
+      no_cache = 1;
+      break;
     case 'z':
       get_zip_filter_classes (arg, &zip_block_filter_class,
 			      &unzip_block_filter_class);
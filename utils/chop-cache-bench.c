@@ -0,0 +1,330 @@
+/* libchop -- a utility library for distributed storage and data backup
+   Copyright (C) 2026  Ludovic Courtès <ludo@gnu.org>
+
+   Libchop is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Libchop is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with libchop.  If not, see <http://www.gnu.org/licenses/>.  */
+
+/* A benchmark of the page cache modes of file streams.  For each mode, FILE
+   is evicted from the page cache, read through a file stream, and the
+   throughput and the amount of FILE that is left in the page cache are
+   reported.  */
+
+#include <chop/chop-config.h>
+
+#include <chop/chop.h>
+#include <chop/streams.h>
+
+#include <alloca.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <argp.h>
+
+
+const char *argp_program_version = "chop-cache-bench (" PACKAGE_NAME ") " PACKAGE_VERSION;
+const char *argp_program_bug_address = PACKAGE_BUGREPORT;
+
+static char doc[] =
+"chop-cache-bench -- measure the effect of file stream page cache modes\
+\v\
+Read FILE through a file stream in each page cache mode, and report \
+the throughput along with the amount of FILE that remains in the page \
+cache afterwards.  FILE is evicted from the page cache before each run, \
+unless `--warm' is passed.";
+
+static struct argp_option options[] =
+  {
+    { "mode",       'm', "MODE", 0,
+      "Only benchmark MODE, one of `cached', `direct', and `drop-behind'" },
+    { "read-size",  's', "SIZE", 0,
+      "Read SIZE bytes at a time (default: 65536)" },
+    { "peek",       'p', 0, 0,
+      "Use `chop_stream_peek ()' rather than `chop_stream_read ()'" },
+    { "warm",       'w', 0, 0,
+      "Do not evict FILE from the page cache before each run" },
+
+    { 0, 0, 0, 0, 0 }
+  };
+
+static char args_doc[] = "FILE";
+
+
+/* The file being read.  */
+static char *file_name = NULL;
+
+/* The mode to benchmark, or -1 for all of them.  */
+static int only_mode = -1;
+
+/* The size of reads.  */
+static size_t read_size = 65536;
+
+/* Whether to peek rather than read.  */
+static int use_peek = 0;
+
+/* Whether to leave FILE in the page cache before each run.  */
+static int warm = 0;
+
+static const char *const mode_names[] =
+  {
+    [CHOP_FILE_STREAM_CACHED]      = "cached",
+    [CHOP_FILE_STREAM_DIRECT]      = "direct",
+    [CHOP_FILE_STREAM_DROP_BEHIND] = "drop-behind"
+  };
+
+#define MODE_COUNT  (sizeof (mode_names) / sizeof (mode_names[0]))
+
+
+
+/* Return the number of bytes of the SIZE-byte file at FD that are in the
+   page cache, or -1 on failure.  */
+static long long
+cached_bytes (int fd, size_t size)
+{
+  long page_size;
+  size_t pages, i;
+  unsigned char *vec;
+  void *map;
+  long long count = 0;
+
+  if (size == 0)
+    return 0;
+
+  page_size = sysconf (_SC_PAGESIZE);
+  pages = (size + page_size - 1) / page_size;
+
+  /* Mapping FILE does not bring it into the page cache.  */
+  map = mmap (0, size, PROT_READ, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED)
+    return -1;
+
+  vec = malloc (pages);
+  if ((vec == NULL) || (mincore (map, size, vec) != 0))
+    count = -1;
+  else
+    for (i = 0; i < pages; i++)
+      if (vec[i] & 1)
+	count += page_size;
+
+  free (vec);
+  munmap (map, size);
+
+  return count;
+}
+
+/* Read all of STREAM and return the number of bytes read.  */
+static size_t
+read_stream (chop_stream_t *stream, char *buffer)
+{
+  chop_error_t err;
+  size_t total = 0, size;
+
+  while (1)
+    {
+      if (use_peek)
+	{
+	  const char *data;
+
+	  err = chop_stream_peek (stream, &data, &size);
+	  if (!err)
+	    {
+	      /* Touch the data as a chopper would.  */
+	      if (size > read_size)
+		size = read_size;
+	      memcpy (buffer, data, size);
+	      chop_stream_consume (stream, size);
+	    }
+	}
+      else
+	err = chop_stream_read (stream, buffer, read_size, &size);
+
+      if (err == CHOP_STREAM_END)
+	break;
+      if (err)
+	{
+	  chop_error (err, "while reading `%s'", file_name);
+	  exit (2);
+	}
+
+      total += size;
+    }
+
+  return total;
+}
+
+/* Benchmark MODE and display the results.  */
+static void
+bench_mode (chop_file_stream_cache_mode_t mode, char *buffer)
+{
+  chop_error_t err;
+  chop_stream_t *stream;
+  struct stat st;
+  struct timeval start, end;
+  double seconds;
+  size_t total;
+  long long before, after;
+  int fd;
+
+  fd = open (file_name, O_RDONLY);
+  if ((fd < 0) || (fstat (fd, &st) != 0))
+    {
+      chop_error (errno, "%s", file_name);
+      exit (1);
+    }
+
+  if (!warm)
+    {
+      /* Evict FILE's clean pages from the page cache.  */
+      fdatasync (fd);
+      posix_fadvise (fd, 0, 0, POSIX_FADV_DONTNEED);
+    }
+
+  before = cached_bytes (fd, st.st_size);
+
+  stream = chop_class_alloca_instance (&chop_file_stream_class);
+  err = chop_file_stream_open (file_name, stream);
+  if (err)
+    {
+      chop_error (err, "%s", file_name);
+      exit (1);
+    }
+
+  err = chop_file_stream_set_cache_mode (stream, mode);
+  if ((!err) && (use_peek))
+    err = chop_file_stream_enable_mapping (stream, 1);
+  if (err)
+    {
+      chop_error (err, "while selecting mode `%s'", mode_names[mode]);
+      chop_object_destroy ((chop_object_t *) stream);
+      close (fd);
+      return;
+    }
+
+  gettimeofday (&start, NULL);
+  total = read_stream (stream, buffer);
+  gettimeofday (&end, NULL);
+
+  mode = chop_file_stream_cache_mode (stream);
+  chop_object_destroy ((chop_object_t *) stream);
+
+  after = cached_bytes (fd, st.st_size);
+  close (fd);
+
+  seconds = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+  if (seconds <= 0.)
+    seconds = 1e-6;
+
+  printf ("%-12s %10.1f %12.1f %12.1f\n", mode_names[mode],
+	  total / seconds / (1024. * 1024.),
+	  before / (1024. * 1024.), after / (1024. * 1024.));
+}
+
+
+
+/* Parse a single option. */
+static error_t
+parse_opt (int key, char *arg, struct argp_state *state)
+{
+  switch (key)
+    {
+    case 'm':
+      {
+	size_t m;
+
+	for (m = 0; m < MODE_COUNT; m++)
+	  if (!strcmp (arg, mode_names[m]))
+	    break;
+
+	if (m >= MODE_COUNT)
+	  argp_error (state, "%s: unknown page cache mode", arg);
+
+	only_mode = m;
+	break;
+      }
+
+    case 's':
+      read_size = strtoul (arg, NULL, 0);
+      if (read_size == 0)
+	argp_error (state, "%s: invalid read size", arg);
+      break;
+
+    case 'p':
+      use_peek = 1;
+      break;
+
+    case 'w':
+      warm = 1;
+      break;
+
+    case ARGP_KEY_ARG:
+      if (state->arg_num >= 1)
+	/* Too many arguments. */
+	argp_usage (state);
+
+      file_name = arg;
+      break;
+
+    case ARGP_KEY_END:
+      if (state->arg_num < 1)
+	/* Not enough arguments. */
+	argp_usage (state);
+      break;
+
+    default:
+      return ARGP_ERR_UNKNOWN;
+    }
+
+  return 0;
+}
+
+/* Argp argument parsing.  */
+static struct argp argp = { options, parse_opt, args_doc, doc };
+
+
+
+int
+main (int argc, char *argv[])
+{
+  char *buffer;
+  size_t m;
+
+  chop_init ();
+
+  /* Parse arguments.  */
+  argp_parse (&argp, argc, argv, 0, NULL, 0);
+
+  buffer = malloc (read_size);
+  if (buffer == NULL)
+    {
+      chop_error (ENOMEM, "while allocating buffer");
+      return 1;
+    }
+
+  printf ("%-12s %10s %12s %12s\n", "mode", "MiB/s",
+	  "before (MiB)", "after (MiB)");
+
+  for (m = 0; m < MODE_COUNT; m++)
+    if ((only_mode < 0) || (only_mode == (int) m))
+      bench_mode ((chop_file_stream_cache_mode_t) m, buffer);
+
+  free (buffer);
+
+  return 0;
+}
@@ -29,6 +29,7 @@
 #include <unistd.h>
 #include <errno.h>
 #include <argp.h>
+#include <progname.h>
 
 
 #include <assert.h>
@@ -54,6 +55,13 @@ static struct argp_option options[] =
       "Use MASK as the fingerprint mask used to determine whether a "
       "fingerprint is magic, i.e. whether it should yield a block "
       "boundary" },
+    { "min-size", 'm', "SIZE", 0,
+      "Produce blocks of at least SIZE bytes" },
+    { "max-size", 'M', "SIZE", 0,
+      "Produce blocks of at most SIZE bytes (zero means no limit)" },
+    { "chopper", 'C', "CHOPPER", 0,
+      "Use an instance of the chopper class CHOPPER instead of an "
+      "anchor-based chopper; its typical block size is MASK + 1" },
     { "quiet",   'q', 0, 0,
       "Don't display FILE's contents" },
     { "stats",   's', 0, 0,
@@ -83,6 +91,13 @@ static size_t window_size = 48;
 /* The magic fingerprint mask.  */
 static unsigned long magic_fpr_mask = 0x1fff; /* the 13 LSBs */
 
+/* The minimum and maximum block sizes.  */
+static size_t min_block_size = 0;
+static size_t max_block_size = 0;
+
+/* The name of the chopper class to use.  */
+static const char *chopper_class_name = "anchor_based_chopper";
+
 
 
 /* Block statistics.  */
@@ -161,6 +176,18 @@ parse_opt (int key, char *arg, struct argp_state *state)
       magic_fpr_mask = strtoul (arg, NULL, 0);
       break;
 
+    case 'm':
+      min_block_size = strtoul (arg, NULL, 0);
+      break;
+
+    case 'M':
+      max_block_size = strtoul (arg, NULL, 0);
+      break;
+
+    case 'C':
+      chopper_class_name = arg;
+      break;
+
     case ARGP_KEY_ARG:
       if (state->arg_num >= 1)
 	/* Too many arguments. */
@@ -194,6 +221,7 @@ main (int argc, char *argv[])
   size_t source_size, chopped_size = 0;
   chop_stream_t *stream;
   chop_chopper_t *chopper;
+  const chop_chopper_class_t *chopper_class;
   chop_buffer_t buffer;
   chop_log_t *chopper_log;
   block_stats_t the_stats;
@@ -203,8 +231,19 @@ main (int argc, char *argv[])
   /* Parse arguments.  */
   argp_parse (&argp, argc, argv, 0, NULL, 0);
 
+  chopper_class =
+    (chop_chopper_class_t *) chop_class_lookup (chopper_class_name);
+  if ((!chopper_class)
+      || (!chop_object_is_a ((chop_object_t *) chopper_class,
+			     (chop_class_t *) &chop_chopper_class_class)))
+    {
+      fprintf (stderr, "%s: `%s': not a chopper class\n",
+	       program_name, chopper_class_name);
+      return 1;
+    }
+
   stream = chop_class_alloca_instance (&chop_file_stream_class);
-  chopper = chop_class_alloca_instance ((chop_class_t *)&chop_anchor_based_chopper_class);
+  chopper = chop_class_alloca_instance ((chop_class_t *) chopper_class);
 
   {
     /* Get the size of the file (for debugging purposes).  */
@@ -228,11 +267,16 @@ main (int argc, char *argv[])
       return 1;
     }
 
-  err = chop_anchor_based_chopper_init (stream, window_size, magic_fpr_mask,
-					chopper);
+  if (chopper_class == &chop_anchor_based_chopper_class)
+    err = chop_anchor_based_chopper_init (stream, window_size, magic_fpr_mask,
+					  min_block_size, max_block_size,
+					  chopper);
+  else
+    err = chop_chopper_generic_open (chopper_class, stream,
+				     magic_fpr_mask + 1, chopper);
   if (err)
     {
-      chop_error (err, "anchor-based-chopper");
+      chop_error (err, "%s", chopper_class_name);
       return 1;
     }
 
@@ -240,7 +284,10 @@ main (int argc, char *argv[])
     {
       /* Output debugging messages to `stderr'.  */
       chopper_log = chop_anchor_based_chopper_log (chopper);
-      chop_log_attach (chopper_log, 2, 0);
+      if (!chopper_log)
+	chopper_log = chop_fastcdc_chopper_log (chopper);
+      if (chopper_log)
+	chop_log_attach (chopper_log, 2, 0);
     }
 
   stats_init (&the_stats);
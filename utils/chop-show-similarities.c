@@ -355,7 +355,7 @@ main (int argc, char *argv[])
     magic_fpr_mask = choose_magic_fingerprint_mask (file_name1, file_name2);
 
   err = chop_anchor_based_chopper_init (stream1, window_size, magic_fpr_mask,
-					chopper1);
+					0, 0, chopper1);
   if (err)
     {
       chop_error (err, "anchor-based-chopper");
@@ -363,7 +363,7 @@ main (int argc, char *argv[])
     }
 
   err = chop_anchor_based_chopper_init (stream2, window_size, magic_fpr_mask,
-					chopper2);
+					0, 0, chopper2);
   if (err)
     {
       chop_error (err, "anchor-based-chopper");